@@ -93,8 +93,11 @@ echo "Building SPIFFS for ESP32 targets"
 pio run --environment tbeam -t buildfs
 cp .pio/build/tbeam/spiffs.bin $OUTDIR/bins/universal/spiffs-$VERSION.bin
 
+echo "Packing the web bundle for ESP32 targets"
+bin/pack-web-bundle.py data/static $OUTDIR/bins/universal/webui-$VERSION.bin
+
 # keep the bins in archive also
-cp $OUTDIR/bins/firmware* $OUTDIR/bins/universal/spiffs* $OUTDIR/elfs/firmware* $OUTDIR/bins/universal/firmware* $OUTDIR/elfs/universal/firmware* $ARCHIVEDIR
+cp $OUTDIR/bins/firmware* $OUTDIR/bins/universal/spiffs* $OUTDIR/bins/universal/webui* $OUTDIR/elfs/firmware* $OUTDIR/bins/universal/firmware* $OUTDIR/elfs/universal/firmware* $ARCHIVEDIR
 
 echo Updating android bins $OUTDIR/forandroid
 rm -rf $OUTDIR/forandroid
@@ -115,6 +118,6 @@ XML
 
 echo Generating $ARCHIVEDIR/firmware-$VERSION.zip
 rm -f $ARCHIVEDIR/firmware-$VERSION.zip
-zip --junk-paths $ARCHIVEDIR/firmware-$VERSION.zip $ARCHIVEDIR/spiffs-$VERSION.bin $OUTDIR/bins/firmware-*-$VERSION.* images/system-info.bin bin/device-install.sh bin/device-update.sh
+zip --junk-paths $ARCHIVEDIR/firmware-$VERSION.zip $ARCHIVEDIR/spiffs-$VERSION.bin $ARCHIVEDIR/webui-$VERSION.bin $OUTDIR/bins/firmware-*-$VERSION.* images/system-info.bin bin/device-install.sh bin/device-update.sh
 
 echo BUILT ALL
@@ -39,6 +39,7 @@ if [ -f "${FILENAME}" ]; then
 	esptool.py --baud 921600 erase_flash
 	esptool.py --baud 921600 write_flash 0x1000 system-info.bin
     esptool.py --baud 921600 write_flash 0x00390000 spiffs-*.bin
+    esptool.py --baud 921600 write_flash 0x003d0000 webui-*.bin
 	esptool.py --baud 921600 write_flash 0x10000 ${FILENAME}
 else
 	echo "Invalid file: ${FILENAME}"
@@ -1,3 +1,48 @@
-arm-none-eabi-readelf -s -e .pio/build/nrf52dk/firmware.elf | head -80
+#!/bin/bash
 
-nm -CSr --size-sort .pio/build/nrf52dk/firmware.elf  | grep '^200'
+# List the biggest users of RAM in a build, and fail if its static RAM (.data + .bss) is over budget, so a change which
+# quietly moves a table out of flash (i.e. a missing const) gets noticed.
+#
+# Usage: bin/dump-ram-users.sh [env] [budget bytes] [how many symbols to list]
+# i.e. bin/dump-ram-users.sh nrf52dk 65536
+
+set -e
+
+ENV=${1:-nrf52dk}
+BUDGET=${2:-${RAM_BUDGET:-0}}
+TOP=${3:-40}
+ELF=.pio/build/$ENV/firmware.elf
+
+# Use the matching binutils if we have them (symbol sizes and sections are the same for any of them)
+PREFIX=""
+for p in arm-none-eabi- xtensa-esp32-elf-; do
+    if command -v ${p}nm >/dev/null; then
+        PREFIX=$p
+        break
+    fi
+done
+
+if [ ! -f "$ELF" ]; then
+    echo "No $ELF, build it first with: pio run -e $ENV"
+    exit 1
+fi
+
+${PREFIX}readelf -S -W "$ELF" | grep -E ' \.(data|bss|noinit|heap|stack)' || true
+
+# Initialized (d) and zeroed (b) data are what we keep in RAM, read only data (r) and code (t) stay in flash
+echo
+echo "Top $TOP RAM users (bytes, type, symbol):"
+${PREFIX}nm -CS -t d --size-sort -r "$ELF" | awk '$3 ~ /^[dDbB]$/ { printf "%8d %s %s\n", $2, $3, substr($0, index($0, $4)) }' |
+    head -n "$TOP"
+
+USED=$(${PREFIX}size -A "$ELF" | awk '$1 ~ /^\.(data|bss)/ { total += $2 } END { print total + 0 }')
+echo
+echo "Static RAM: $USED bytes"
+
+if [ "$BUDGET" -gt 0 ]; then
+    if [ "$USED" -gt "$BUDGET" ]; then
+        echo "Over our budget of $BUDGET bytes by $((USED - BUDGET))"
+        exit 2
+    fi
+    echo "Within our budget of $BUDGET bytes ($((BUDGET - USED)) to spare)"
+fi
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Pack our static web assets into an image for the webui flash partition (see src/meshwifi/WebBundle.h).
+
+Usage: pack-web-bundle.py [SOURCE_DIR] [OUTPUT]
+
+Every file under SOURCE_DIR (default data/static) is served as /static/<its relative path>.  Text files are gzipped here, so
+the device never has to, and files which are already gzipped (name.gz) are served as name with Content-Encoding: gzip.
+"""
+
+import gzip
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x4245574d  # "MWEB"
+VERSION = 1
+FLAG_GZIP = 0x01
+PARTITION_SIZE = 0x30000  # Must match partition-table.csv
+
+HEADER = struct.Struct("<IHH")
+ENTRY = struct.Struct("<48sIII B35s")
+assert ENTRY.size == 96
+
+# Like contentTypes in meshhttp.cpp
+CONTENT_TYPES = {
+    ".txt": "text/plain",
+    ".html": "text/html",
+    ".js": "text/javascript",
+    ".png": "image/png",
+    ".jpg": "image/jpg",
+    ".gif": "image/gif",
+    ".json": "application/json",
+    ".css": "text/css",
+    ".ico": "image/vnd.microsoft.icon",
+    ".svg": "image/svg+xml",
+}
+
+# Compressing these would just cost the browser time
+ALREADY_COMPRESSED = {".png", ".jpg", ".gif"}
+
+
+def load(sourceDir):
+    files = []
+    for root, _, names in os.walk(sourceDir):
+        for name in sorted(names):
+            with open(os.path.join(root, name), "rb") as f:
+                data = f.read()
+            rel = os.path.relpath(os.path.join(root, name), sourceDir).replace(os.sep, "/")
+
+            flags = 0
+            if rel.endswith(".gz"):
+                rel = rel[:-3]
+                flags = FLAG_GZIP
+            ext = os.path.splitext(rel)[1]
+            if not flags and ext not in ALREADY_COMPRESSED:
+                data = gzip.compress(data, 9, mtime=0)  # mtime=0 so our ETags only change with the contents
+                flags = FLAG_GZIP
+
+            path = "/static/" + rel
+            if len(path) >= 48:
+                sys.exit("Path too long for our index: " + path)
+            files.append((path, flags, CONTENT_TYPES.get(ext, "application/octet-stream"), data))
+    return files
+
+
+def pack(files):
+    offset = HEADER.size + len(files) * ENTRY.size
+    index, blobs = [HEADER.pack(MAGIC, VERSION, len(files))], []
+    for path, flags, contentType, data in files:
+        offset = (offset + 3) & ~3  # Word aligned, so the flash cache reads them efficiently
+        index.append(ENTRY.pack(path.encode(), offset, len(data), zlib.crc32(data) & 0xffffffff, flags,
+                                contentType.encode()))
+        blobs.append((offset, data))
+        offset += len(data)
+
+    image = bytearray(b"".join(index))
+    for blobOffset, data in blobs:
+        image += b"\0" * (blobOffset - len(image))
+        image += data
+    return bytes(image)
+
+
+def main():
+    sourceDir = sys.argv[1] if len(sys.argv) > 1 else "data/static"
+    output = sys.argv[2] if len(sys.argv) > 2 else "webui.bin"
+
+    image = pack(load(sourceDir))
+    if len(image) > PARTITION_SIZE:
+        sys.exit("Web bundle is %d bytes, but our partition only holds %d" % (len(image), PARTITION_SIZE))
+
+    with open(output, "wb") as f:
+        f.write(image)
+    print("Packed %s into %s, %d bytes" % (sourceDir, output, len(image)))
+
+
+if __name__ == "__main__":
+    main()
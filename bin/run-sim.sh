@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Run a simulated mesh of N linux nodes (built with "pio run -e linux") connected by tools/meshsim
+#
+# usage: bin/run-sim.sh N [meshsim options], i.e. bin/run-sim.sh 50 --area 8000 --duration 600
+#
+# Each node runs in its own directory (so it has its own preferences) under $SIMDIR, with its log in node.log.  The medium
+# prints its report when it exits.
+
+set -e
+
+NUM=${1:?usage: $0 numnodes [meshsim options]}
+shift
+
+PROGRAM=${PROGRAM:-$PWD/.pio/build/linux/program}
+SIMDIR=${SIMDIR:-/tmp/meshsim}
+export MESHSIM_PORT=${MESHSIM_PORT:-4700}
+
+MESHSIM=$SIMDIR/meshsim
+mkdir -p $SIMDIR
+g++ -O2 -std=c++11 -o $MESHSIM tools/meshsim/meshsim.cpp
+
+PIDS=""
+function cleanup() {
+	kill $PIDS 2>/dev/null || true
+}
+trap cleanup EXIT
+
+$MESHSIM --nodes $NUM --port $MESHSIM_PORT "$@" &
+MEDIUM=$!
+
+for ((i = 0; i < NUM; i++)); do
+	NODEDIR=$SIMDIR/node$i
+	mkdir -p $NODEDIR
+	(cd $NODEDIR && HOME=$NODEDIR MESHSIM_NODE=$i exec $PROGRAM >node.log 2>&1) &
+	PIDS="$PIDS $!"
+done
+
+echo "started $NUM nodes, logs in $SIMDIR/node*/node.log"
+trap "kill -INT $MEDIUM" INT
+# A ctrl-C interrupts the first wait, the second waits for the medium to finish its report
+wait $MEDIUM || wait $MEDIUM || true
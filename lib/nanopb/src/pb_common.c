@@ -207,13 +207,9 @@ bool pb_field_iter_find(pb_field_iter_t *iter, uint32_t tag)
         pb_size_t start = iter->index;
         uint32_t fieldinfo;
 
-        if (tag < iter->tag)
-        {
-            /* Fields are in tag number order, so we know that tag is between
-             * 0 and our start position. Setting index to end forces
-             * advance_iterator() call below to restart from beginning. */
-            iter->index = iter->descriptor->field_count;
-        }
+        /* Fields are NOT always in tag number order (oneof members are
+         * grouped together, i.e. in SubPacket), so we always search the
+         * whole ring of fields from our current position. */
 
         do
         {
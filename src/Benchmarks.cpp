@@ -0,0 +1,229 @@
+#include "configuration.h"
+
+#ifdef MESH_BENCHMARKS
+#include "Benchmarks.h"
+#include "CryptoEngine.h"
+#include "MeshPlugin.h"
+#include "NodeDB.h"
+#include "PacketHistory.h"
+#include "RadioInterface.h"
+#include "SubPacketCodec.h"
+#include "mesh-pb-constants.h"
+
+extern RadioInterface *rIf;
+
+/// We repeat each benchmark (doubling the number of calls) until it has taken at least this long
+#define BENCH_MIN_USEC 200000
+
+/// Each benchmark writes here, so the compiler can't optimise the work away
+static volatile uint32_t benchSink;
+
+/// Made up NodeNums for the nodes and packets we benchmark with, well out of the way of real nodes
+#define BENCH_NODENUM_BASE 0x7e000000
+
+static void report(const char *name, uint32_t param, uint32_t iters, uint32_t elapsedUsec)
+{
+    uint32_t nsPerOp = (uint64_t)elapsedUsec * 1000 / iters;
+    DEBUG_MSG("BENCH {\"name\":\"%s\",\"param\":%u,\"iters\":%u,\"nsPerOp\":%u}\n", name, param, iters, nsPerOp);
+}
+
+/// Call fn until at least BENCH_MIN_USEC have passed, then report the mean time per call
+template <typename F> static void bench(const char *name, uint32_t param, F fn)
+{
+    fn(); // warm up our caches
+
+    uint32_t iters = 1, elapsed;
+    for (;;) {
+        uint32_t start = micros();
+        for (uint32_t i = 0; i < iters; i++)
+            fn();
+        elapsed = micros() - start;
+        if (elapsed >= BENCH_MIN_USEC || iters >= (1UL << 30))
+            break;
+        iters *= 2;
+    }
+    report(name, param, iters, elapsed);
+}
+
+static void benchPacketHistory()
+{
+    // PACKET_HISTORY_SIZE is fixed at build time, so we look at how a table behaves as it fills instead
+    MeshPacket p;
+    memset(&p, 0, sizeof(p));
+
+    for (size_t fill = PACKET_HISTORY_SIZE / 4; fill <= PACKET_HISTORY_SIZE; fill += PACKET_HISTORY_SIZE / 4) {
+        PacketHistory *h = new PacketHistory();
+        for (size_t i = 0; i < fill; i++) {
+            p.from = BENCH_NODENUM_BASE + i % 16;
+            p.id = i + 1;
+            h->wasSeenRecently(&p);
+        }
+
+        uint32_t n = 0;
+        bench("PacketHistory.hit", fill, [&]() {
+            p.from = BENCH_NODENUM_BASE + n % 16;
+            p.id = n % fill + 1;
+            n++;
+            benchSink += h->wasSeenRecently(&p, false);
+        });
+        bench("PacketHistory.miss", fill, [&]() {
+            p.from = BENCH_NODENUM_BASE + 17;
+            p.id = ++n;
+            benchSink += h->wasSeenRecently(&p, false);
+        });
+        delete h;
+    }
+}
+
+static void benchNodeDB()
+{
+    Position pos;
+    memset(&pos, 0, sizeof(pos));
+
+    // Fill the DB, updatePosition adds any node we don't have yet
+    for (NodeNum n = BENCH_NODENUM_BASE; nodeDB.getNumNodes() < MAX_NUM_NODES; n++)
+        nodeDB.updatePosition(n, pos);
+
+    NodeNum last = nodeDB.getNodeByIndex(nodeDB.getNumNodes() - 1)->num;
+    bench("NodeDB.getNode.hit", nodeDB.getNumNodes(), [&]() { benchSink += !!nodeDB.getNode(last); });
+    bench("NodeDB.getNode.miss", nodeDB.getNumNodes(), [&]() { benchSink += !!nodeDB.getNode(BENCH_NODENUM_BASE - 1); });
+}
+
+static void benchProtobufs()
+{
+    static SubPacket sub;
+    static FromRadio from;
+    static uint8_t buf[FromRadio_size];
+
+    for (size_t len = 16; len <= sizeof(sub.data.payload.bytes); len *= 2) {
+        memset(&sub, 0, sizeof(sub));
+        sub.which_payload = SubPacket_data_tag;
+        sub.data.portnum = PortNum_TEXT_MESSAGE_APP;
+        sub.data.payload.size = len;
+        memset(sub.data.payload.bytes, 'x', len);
+
+        size_t numbytes = 0;
+        bench("pb_encode.SubPacket", len,
+              [&]() { benchSink += numbytes = pb_encode_to_bytes(buf, sizeof(buf), SubPacket_fields, &sub); });
+        bench("pb_decode.SubPacket", len, [&]() { benchSink += pb_decode_from_bytes(buf, numbytes, SubPacket_fields, &sub); });
+
+        // Our hand written codecs must match nanopb byte for byte
+        static uint8_t fastBuf[FromRadio_size];
+        if (fastEncodeSubPacket(fastBuf, sizeof(fastBuf), sub) != numbytes || memcmp(fastBuf, buf, numbytes))
+            DEBUG_MSG("BENCH ERROR: fastEncodeSubPacket differs from nanopb for a %u byte payload\n", len);
+        bench("fast_encode.SubPacket", len, [&]() { benchSink += fastEncodeSubPacket(fastBuf, sizeof(fastBuf), sub); });
+        bench("fast_decode.SubPacket", len, [&]() { benchSink += fastDecodeSubPacket(buf, numbytes, sub); });
+        static SubPacketHeader header;
+        bench("peek.SubPacket", len, [&]() { benchSink += peekSubPacket(buf, numbytes, header); });
+        if (fastEncodeSubPacket(fastBuf, sizeof(fastBuf), sub) != numbytes || memcmp(fastBuf, buf, numbytes))
+            DEBUG_MSG("BENCH ERROR: fastDecodeSubPacket differs from nanopb for a %u byte payload\n", len);
+
+        memset(&from, 0, sizeof(from));
+        from.which_variant = FromRadio_packet_tag;
+        MeshPacket &mp = from.variant.packet;
+        mp.from = BENCH_NODENUM_BASE;
+        mp.to = NODENUM_BROADCAST;
+        mp.id = 1;
+        mp.which_payload = MeshPacket_decoded_tag;
+        mp.decoded = sub;
+
+        bench("pb_encode.FromRadio", len,
+              [&]() { benchSink += numbytes = pb_encode_to_bytes(buf, sizeof(buf), FromRadio_fields, &from); });
+        bench("pb_decode.FromRadio", len, [&]() { benchSink += pb_decode_from_bytes(buf, numbytes, FromRadio_fields, &from); });
+
+        if (len == 128)
+            len = sizeof(sub.data.payload.bytes) / 2; // So our last size is the biggest payload we can carry
+    }
+}
+
+static void benchPosition()
+{
+    Position pos = {-12, 87, 374221234, -1220845678, 1600000000};
+    static uint8_t buf[Position_size], fastBuf[Position_size];
+
+    size_t numbytes = pb_encode_to_bytes(buf, sizeof(buf), Position_fields, &pos);
+    if (fastEncodePosition(fastBuf, sizeof(fastBuf), pos) != numbytes || memcmp(fastBuf, buf, numbytes))
+        DEBUG_MSG("BENCH ERROR: fastEncodePosition differs from nanopb\n");
+
+    bench("pb_encode.Position", numbytes, [&]() { benchSink += pb_encode_to_bytes(buf, sizeof(buf), Position_fields, &pos); });
+    bench("fast_encode.Position", numbytes, [&]() { benchSink += fastEncodePosition(fastBuf, sizeof(fastBuf), pos); });
+}
+
+static void benchCrypto()
+{
+    // Whichever CryptoEngine this platform was built with (crypto is already keyed with our channel)
+    static uint8_t in[MAX_BLOCKSIZE], out[MAX_BLOCKSIZE];
+    memset(in, 0x5a, sizeof(in));
+
+    const size_t sizes[] = {16, 32, 64, 128, 237};
+    for (size_t len : sizes) {
+        uint64_t packetNum = 0;
+        bench("CryptoEngine.encrypt", len, [&]() {
+            crypto->encrypt(BENCH_NODENUM_BASE, ++packetNum, len, in, out);
+            benchSink += out[0];
+        });
+        bench("CryptoEngine.decrypt", len, [&]() {
+            crypto->decrypt(BENCH_NODENUM_BASE, ++packetNum, len, in, out);
+            benchSink += out[0];
+        });
+        // The same packet over and over, so this is the cost with a cached keystream
+        bench("CryptoEngine.encryptOutgoing", len, [&]() {
+            crypto->encryptOutgoing(BENCH_NODENUM_BASE, 1, len, in, out);
+            benchSink += out[0];
+        });
+    }
+}
+
+static void benchPacketTime()
+{
+    if (!rIf)
+        return; // No radio, so no modem settings
+
+    const size_t sizes[] = {16, 64, 128, MAX_LORA_FRAME_LEN};
+    for (size_t len : sizes)
+        bench("RadioInterface.getPacketTime", len, [&]() { benchSink += rIf->getPacketTime(len); });
+}
+
+static void benchPlugins()
+{
+    static MeshPacket mp;
+    memset(&mp, 0, sizeof(mp));
+    mp.from = BENCH_NODENUM_BASE;
+    mp.to = nodeDB.getNodeNum();
+    mp.id = 1;
+    mp.which_payload = MeshPacket_decoded_tag;
+    mp.decoded.which_payload = SubPacket_data_tag;
+
+    // A port no plugin wants, so we only measure finding (and asking) the interested plugins
+    mp.decoded.data.portnum = (PortNum)(_PortNum_ARRAYSIZE - 1);
+    bench("MeshPlugin.callPlugins.unhandled", mp.decoded.data.portnum, [&]() { MeshPlugin::callPlugins(mp); });
+}
+
+void runBenchmarks()
+{
+    // Our plugins log every packet, which would swamp what we are trying to time
+    for (uint8_t shift = 0; shift <= LOG_SHIFT_HTTP; shift += 4)
+        setLogLevel(shift, LOG_LEVEL_WARN);
+
+    DEBUG_MSG("BENCH {\"version\":\"%s\",\"hw\":\"%s\",\"vendor\":\"%s\",\"profile\":\"%s\",\"minUsec\":%u}\n",
+              optstr(APP_VERSION), optstr(HW_VERSION), HW_VENDOR, meshProfile.name, BENCH_MIN_USEC);
+
+    benchPacketHistory();
+    benchNodeDB();
+    benchProtobufs();
+    benchPosition();
+    benchCrypto();
+    benchPacketTime();
+    benchPlugins();
+
+    DEBUG_MSG("BENCH {\"done\":true}\n");
+
+#ifdef PORTDUINO
+    exit(0);
+#else
+    for (;;)
+        delay(1000); // Our NodeDB is full of made up nodes, don't let anything save it
+#endif
+}
+
+#endif
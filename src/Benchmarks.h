@@ -0,0 +1,14 @@
+#pragma once
+
+/**
+ * Timings for our mesh hot paths, for builds with -DMESH_BENCHMARKS (see the *-bench envs in platformio.ini).
+ *
+ * Called at the end of setup() (before our other tasks start, so they don't disturb the timings), prints one line per result
+ * and never returns, because it leaves the NodeDB full of made up nodes.  Each result line is "BENCH " followed by a JSON
+ * object, so a script can grep them out of the serial log and compare releases:
+ *
+ *   BENCH {"name":"PacketHistory.hit","param":64,"iters":65536,"nsPerOp":912}
+ *
+ * The first line describes the build and hardware, the last is BENCH {"done":true}.
+ */
+void runBenchmarks();
@@ -1,4 +1,5 @@
 #include "BluetoothCommon.h"
+#include "configuration.h"
 
 // NRF52 wants these constants as byte arrays
 // Generated here https://yupana-engineering.com/online-uuid-to-c-array-converter - but in REVERSE BYTE ORDER
@@ -9,4 +10,47 @@ const uint8_t TORADIO_UUID_16[16u] = {0xe7, 0x01, 0x44, 0x12, 0x66, 0x78, 0xdd,
 const uint8_t FROMRADIO_UUID_16[16u] = {0xd5, 0x54, 0xe4, 0xc5, 0x25, 0xc5, 0x31, 0xa5,
                                         0x55, 0x4a, 0x02, 0xee, 0xc2, 0xbc, 0xa2, 0x8b};
 const uint8_t FROMNUM_UUID_16[16u] = {0x53, 0x44, 0xe3, 0x47, 0x75, 0xaa, 0x70, 0xa6,
-                                      0x66, 0x4f, 0x00, 0xa8, 0x8c, 0xa1, 0x9d, 0xed};
\ No newline at end of file
+                                      0x66, 0x4f, 0x00, 0xa8, 0x8c, 0xa1, 0x9d, 0xed};
+const uint8_t FROMRADIOBATCH_UUID_16[16u] = {0xd6, 0x54, 0xe4, 0xc5, 0x25, 0xc5, 0x31, 0xa5,
+                                             0x55, 0x4a, 0x02, 0xee, 0xc2, 0xbc, 0xa2, 0x8b};
+
+static const BluetoothLinkParams fastParams = BLE_LINK_FAST_PARAMS, slowParams = BLE_LINK_SLOW_PARAMS;
+
+void BluetoothLinkManager::onConnect(uint16_t conn)
+{
+    connHandle = conn;
+    connected = true;
+    isFast = false; // We don't know what the central picked, so make sure we ask
+    lastBusyMsec = millis();
+
+    setInterval(0);
+    getController()->wake();
+}
+
+void BluetoothLinkManager::markBusy()
+{
+    lastBusyMsec = millis();
+    if (connected && !isFast) {
+        setInterval(0);
+        getController()->wake();
+    }
+}
+
+int32_t BluetoothLinkManager::runOnce()
+{
+    if (!connected)
+        return INT32_MAX; // Wait for onConnect
+
+    uint32_t now = millis();
+    if (api->isSendingConfig() || api->numPendingPackets() >= BLE_LINK_BUSY_PACKETS)
+        lastBusyMsec = now;
+
+    bool wantFast = now - lastBusyMsec < BLE_LINK_IDLE_MSEC;
+    if (wantFast != isFast) {
+        DEBUG_MSG("BLE link going %s\n", wantFast ? "fast" : "slow");
+        if (requestParams(connHandle, wantFast ? fastParams : slowParams))
+            isFast = wantFast;
+    }
+
+    return BLE_LINK_CHECK_MSEC;
+}
\ No newline at end of file
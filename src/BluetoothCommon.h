@@ -1,5 +1,7 @@
 #pragma once
 
+#include "PhoneAPI.h"
+#include "concurrency/OSThread.h"
 #include <Arduino.h>
 
 /**
@@ -11,10 +13,68 @@
 #define TORADIO_UUID "f75c76d2-129e-4dad-a1dd-7866124401e7"
 #define FROMRADIO_UUID "8ba2bcc2-ee02-4a55-a531-c525c5e454d5"
 #define FROMNUM_UUID "ed9da18c-a800-4f66-a670-aa7547e34453"
+#define FROMRADIOBATCH_UUID "8ba2bcc2-ee02-4a55-a531-c525c5e454d6"
+
+/// Clients who subscribe to fromradiobatch get FromRadio packets pushed as notifies, we send at most this many per run of
+/// our streaming thread before letting other threads run
+#define BLE_STREAM_MAX_PER_RUN 8
 
 // NRF52 wants these constants as byte arrays
 // Generated here https://yupana-engineering.com/online-uuid-to-c-array-converter - but in REVERSE BYTE ORDER
-extern const uint8_t MESH_SERVICE_UUID_16[], TORADIO_UUID_16[16u], FROMRADIO_UUID_16[], FROMNUM_UUID_16[];
+extern const uint8_t MESH_SERVICE_UUID_16[], TORADIO_UUID_16[16u], FROMRADIO_UUID_16[], FROMNUM_UUID_16[],
+    FROMRADIOBATCH_UUID_16[];
 
 /// Given a level between 0-100, update the BLE attribute
-void updateBatteryLevel(uint8_t level);
\ No newline at end of file
+void updateBatteryLevel(uint8_t level);
+
+/// Connection parameters, in the units BLE uses (intervals in 1.25 msec, the supervision timeout in 10 msec)
+struct BluetoothLinkParams {
+    uint16_t minInterval, maxInterval;
+    uint16_t latency; // How many connection events the peripheral (us) may skip when it has nothing to send
+    uint16_t timeout;
+};
+
+/// While a client is downloading we want the shortest interval iOS and Android will both accept (15-30 msec)
+#define BLE_LINK_FAST_PARAMS {12, 24, 0, 400}
+
+/// Once idle, 100-200 msec with latency 4 lets us sleep through most connection events but still answer within a second
+#define BLE_LINK_SLOW_PARAMS {80, 160, 4, 600}
+
+/// We consider the link busy with this many received packets waiting for the client
+#define BLE_LINK_BUSY_PACKETS 4
+
+/// We go back to slow parameters once the link has been quiet this long
+#define BLE_LINK_IDLE_MSEC (10 * 1000)
+
+/// How often we check whether the link is busy
+#define BLE_LINK_CHECK_MSEC 500
+
+/**
+ * Picks connection parameters for our BLE link: fast while a client is downloading its config (or has a backlog of
+ * packets), slow with slave latency once things have been quiet for a while.  Each platform implements requestParams.
+ */
+class BluetoothLinkManager : public concurrency::OSThread
+{
+    PhoneAPI *api;
+    bool connected = false;
+    uint16_t connHandle = 0;
+    bool isFast = false;
+    uint32_t lastBusyMsec = 0;
+
+  public:
+    BluetoothLinkManager(PhoneAPI *_api) : OSThread("BLELink"), api(_api) {}
+
+    /// Call from the connect callback, a new client will almost certainly want our config
+    void onConnect(uint16_t conn);
+
+    void onDisconnect() { connected = false; }
+
+    /// Keep the link fast for a while, because a client is sending us lots (i.e. a software update), safe from any thread
+    void markBusy();
+
+  protected:
+    virtual int32_t runOnce();
+
+    /// Ask the central to change our connection parameters, @return false if we couldn't even ask
+    virtual bool requestParams(uint16_t conn, const BluetoothLinkParams &params) = 0;
+};
\ No newline at end of file
@@ -0,0 +1,18 @@
+#include "BootTimer.h"
+
+BootTimer bootTimer;
+
+void BootTimer::phaseDone(const char *name)
+{
+    uint32_t now = millis();
+    if (numPhases < BOOT_MAX_PHASES)
+        phases[numPhases++] = {name, now - lastMsec};
+    lastMsec = now;
+}
+
+void BootTimer::logSummary() const
+{
+    LOG_INFO(MESH, "Booted in %u msec, radio receiving after %u msec\n", lastMsec, rxReadyMsec);
+    for (size_t i = 0; i < numPhases; i++)
+        LOG_DEBUG(MESH, "  %s: %u msec\n", phases[i].name, phases[i].msec);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "configuration.h"
+
+/// The most boot phases we keep times for
+#ifndef BOOT_MAX_PHASES
+#define BOOT_MAX_PHASES 16
+#endif
+
+struct BootPhase {
+    const char *name;
+    uint32_t msec; // How long this phase of setup() took
+};
+
+/**
+ * Times the phases of setup(), so we can see where our boot time goes.
+ *
+ * Each call to phaseDone() closes the phase which started when the previous one ended (the first starts at reset).  We also
+ * note when our radio was first able to receive, which is the boot time that matters to the mesh.
+ */
+class BootTimer
+{
+    BootPhase phases[BOOT_MAX_PHASES];
+    size_t numPhases = 0;
+    uint32_t lastMsec = 0;
+    uint32_t rxReadyMsec = 0;
+
+  public:
+    /// The phase called name has just finished
+    void phaseDone(const char *name);
+
+    /// Our radio is now receiving
+    void radioReady() { rxReadyMsec = millis(); }
+
+    /// msecs from reset until our radio was receiving, or 0 if it isn't yet
+    uint32_t getRxReadyMsec() const { return rxReadyMsec; }
+
+    size_t getNumPhases() const { return numPhases; }
+    const BootPhase &getPhase(size_t i) const { return phases[i]; }
+
+    /// Log all our phases, called once setup() is done
+    void logSummary() const;
+};
+
+extern BootTimer bootTimer;
@@ -11,6 +11,7 @@
 #define FSBegin() true
 #define FILE_O_WRITE "w"
 #define FILE_O_READ "r"
+#define FILE_O_APPEND "a"
 #elif !defined(NO_ESP32)
 // ESP32 version
 #include "SPIFFS.h"
@@ -18,12 +19,14 @@
 #define FSBegin() FS.begin(true)
 #define FILE_O_WRITE "w"
 #define FILE_O_READ "r"
+#define FILE_O_APPEND "a"
 #else
 // NRF52 version
 #include "InternalFileSystem.h"
 #define FS InternalFS
 #define FSBegin() FS.begin()
 using namespace Adafruit_LittleFS_Namespace;
+#define FILE_O_APPEND FILE_O_WRITE // LittleFS always opens for writing at the end of the file
 #endif
 
 void fsInit();
\ No newline at end of file
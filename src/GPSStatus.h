@@ -68,9 +68,10 @@ class GPSStatus : public Status
     int updateStatus(const GPSStatus *newStatus)
     {
         // Only update the status if values have actually changed
-        bool isDirty;
+        bool isDirty, significant;
         {
             isDirty = matches(newStatus);
+            significant = newStatus->hasLock != hasLock || newStatus->isConnected != isConnected; // Got or lost a fix (or GPS)
             initialized = true;
             hasLock = newStatus->hasLock;
             isConnected = newStatus->isConnected;
@@ -87,7 +88,7 @@ class GPSStatus : public Status
                           altitude, dop * 1e-2, heading * 1e-5, numSatellites);
             else
                 DEBUG_MSG("No GPS lock\n");
-            onNewStatus.notifyObservers(this);
+            publish(significant);
         }
         return 0;
     }
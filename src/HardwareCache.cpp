@@ -0,0 +1,64 @@
+#include "HardwareCache.h"
+#include "FSCommon.h"
+
+#define HWCACHE_MAGIC 0x48570001 // "HW" and our format version
+
+static const char *hwfile = "/hw.dat";
+
+HardwareCache hardwareCache;
+
+void HardwareCache::load()
+{
+#ifdef FS
+    auto f = FS.open(hwfile);
+    if (f) {
+        Record r;
+        if (f.read((uint8_t *)&r, sizeof(r)) == (int)sizeof(r) && r.magic == HWCACHE_MAGIC && r.radio < HW_RADIO_NUM_KINDS) {
+            cached = r;
+            LOG_DEBUG(MESH, "Cached hardware: radio %d, gps %d\n", cached.radio, cached.gps);
+        }
+        f.close();
+    }
+#endif
+
+    found = cached; // Until we find something different, so a partial boot doesn't forget the rest
+    found.magic = HWCACHE_MAGIC;
+}
+
+void HardwareCache::foundRadio(HardwareRadio r)
+{
+    if (found.radio != r) {
+        found.radio = r;
+        save();
+    }
+}
+
+void HardwareCache::foundGPS(HardwareGPS g)
+{
+    if (found.gps != g) {
+        found.gps = g;
+        save();
+    }
+}
+
+void HardwareCache::save()
+{
+#ifdef FS
+    FS.remove(hwfile); // We can't truncate on all of our filesystems
+    auto f = FS.open(hwfile, FILE_O_WRITE);
+    if (f) {
+        f.write((const uint8_t *)&found, sizeof(found));
+        f.close();
+    } else
+        LOG_ERROR(MESH, "ERROR: can't write hardware cache\n");
+#endif
+}
+
+void HardwareCache::forget()
+{
+    cached = found = {};
+    found.magic = HWCACHE_MAGIC;
+#ifdef FS
+    FS.remove(hwfile);
+#endif
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "configuration.h"
+
+/// Which radio answered when we probed for it
+enum HardwareRadio : uint8_t { HW_RADIO_UNKNOWN, HW_RADIO_RF95, HW_RADIO_SX1262, HW_RADIO_SIM, HW_RADIO_NUM_KINDS };
+
+/// Which sort of GPS we found
+enum HardwareGPS : uint8_t { HW_GPS_UNKNOWN, HW_GPS_UBLOX_SERIAL, HW_GPS_UBLOX_I2C, HW_GPS_NMEA };
+
+/**
+ * Remembers which radio and GPS we found last boot, so we can try those first rather than waiting for the probes of hardware
+ * this board doesn't have to time out.  If the cached hardware doesn't answer our callers fall back to their full probe, and
+ * record whatever they find instead.
+ *
+ * Stored in its own small file rather than in devicestate, so our settings format doesn't change.  We forget it on a factory
+ * reset, in case the hardware was changed.
+ */
+class HardwareCache
+{
+    struct Record {
+        uint32_t magic; // HWCACHE_MAGIC, change it if this struct changes
+        HardwareRadio radio;
+        HardwareGPS gps;
+    } __attribute__((packed));
+
+    Record cached = {}; // What we found on a previous boot
+    Record found = {};  // What we have found this boot
+
+  public:
+    /// Read the record from our last boot, call this after fsInit()
+    void load();
+
+    HardwareRadio getRadio() const { return cached.radio; }
+    HardwareGPS getGPS() const { return cached.gps; }
+
+    void foundRadio(HardwareRadio r);
+    void foundGPS(HardwareGPS g);
+
+    /// Probe everything from scratch next boot
+    void forget();
+
+  private:
+    void save();
+};
+
+extern HardwareCache hardwareCache;
@@ -0,0 +1,37 @@
+#include "LargeAlloc.h"
+#include "configuration.h"
+#include <stdlib.h>
+
+#ifdef BOARD_HAS_PSRAM
+#include <esp_heap_caps.h>
+#endif
+
+/// @return size bytes of PSRAM, or NULL if we have none (boards built with BOARD_HAS_PSRAM can still lack the chip)
+static void *psramAlloc(size_t size)
+{
+#ifdef BOARD_HAS_PSRAM
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    return NULL;
+#endif
+}
+
+void *largeAlloc(size_t size)
+{
+    void *p = psramAlloc(size);
+    return p ? p : malloc(size);
+}
+
+void *largeAllocScaled(size_t &count, size_t elemSize)
+{
+    void *p = psramAlloc(count * PSRAM_CAPACITY_SCALE * elemSize);
+    if (p) {
+        count *= PSRAM_CAPACITY_SCALE;
+        return p;
+    }
+
+    p = malloc(count * elemSize);
+    if (!p)
+        count = 0;
+    return p;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/// On boards with PSRAM, the buffers we allocate with largeAllocScaled() hold this many times as much (keep it a power of 2)
+#ifndef PSRAM_CAPACITY_SCALE
+#define PSRAM_CAPACITY_SCALE 4
+#endif
+
+/**
+ * Allocate a big buffer which is never touched from an ISR or a hot path (caches, capture buffers, HTTP buffers...).
+ *
+ * On boards with PSRAM (BOARD_HAS_PSRAM, i.e. T-Beams) it goes there, leaving our scarce internal RAM for everything
+ * else, otherwise it comes from our regular heap.  Free it with free().
+ *
+ * @return NULL if we are out of memory
+ */
+void *largeAlloc(size_t size);
+
+/**
+ * Like largeAlloc() for an array of count elements, except that if it lands in PSRAM the array is PSRAM_CAPACITY_SCALE
+ * times longer.  count is updated to the number of elements we allocated (0 if we couldn't).
+ */
+void *largeAllocScaled(size_t &count, size_t elemSize);
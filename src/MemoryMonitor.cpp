@@ -0,0 +1,109 @@
+#include "MemoryMonitor.h"
+#include "MeshTypes.h"
+#include "concurrency/LockGuard.h"
+
+#ifndef NO_ESP32
+#include <esp_heap_caps.h>
+#elif defined(NRF52_SERIES)
+#include <malloc.h>
+#include <unistd.h>
+
+extern "C" char __HeapLimit; // From our linker script, the top of the region sbrk can grow the heap into
+#endif
+
+MemoryMonitor *memoryMonitor;
+
+MemoryMonitor::MemoryMonitor() : concurrency::OSThread("MemoryMonitor") {}
+
+MemoryStats MemoryMonitor::getStats()
+{
+    concurrency::LockGuard g(&lock);
+    return stats;
+}
+
+int32_t MemoryMonitor::runOnce()
+{
+    // Sample into a scratch copy, so we don't hold our lock while we walk the task list
+    static MemoryStats s;
+    {
+        concurrency::LockGuard g(&lock);
+        s = stats;
+    }
+    sample(s);
+    checkAlarms(s);
+    {
+        concurrency::LockGuard g(&lock);
+        stats = s;
+    }
+
+    return MEMORY_MONITOR_MSEC;
+}
+
+void MemoryMonitor::sample(MemoryStats &s)
+{
+    s.sampleMsec = millis() ? millis() : 1;
+
+#ifndef NO_ESP32
+    // Only internal RAM, boards with PSRAM would otherwise hide a shortage of it behind megabytes we can't use for everything
+    s.freeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    s.largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    s.minFreeHeap = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#elif defined(NRF52_SERIES)
+    // Free chunks inside the heap, plus the space sbrk hasn't handed out yet (which is all in one piece)
+    struct mallinfo m = mallinfo();
+    uint32_t unclaimed = &__HeapLimit - (char *)sbrk(0);
+    s.freeHeap = m.fordblks + unclaimed;
+    s.largestFreeBlock = unclaimed; // newlib can't tell us its largest free chunk, so this is a lower bound
+    if (!s.minFreeHeap || s.freeHeap < s.minFreeHeap)
+        s.minFreeHeap = s.freeHeap; // Only as low as we've seen, the allocator doesn't track this for us
+#endif
+
+#if defined(HAS_FREE_RTOS) && configUSE_TRACE_FACILITY
+    static TaskStatus_t taskStatus[MEMORY_MONITOR_MAX_TASKS];
+    UBaseType_t n = uxTaskGetSystemState(taskStatus, MEMORY_MONITOR_MAX_TASKS, NULL); // 0 if there are too many tasks
+
+    s.numTasks = n;
+    for (UBaseType_t i = 0; i < n; i++) {
+        TaskStackInfo &t = s.tasks[i];
+        strncpy(t.name, taskStatus[i].pcTaskName, sizeof(t.name) - 1);
+        t.name[sizeof(t.name) - 1] = '\0';
+#ifndef NO_ESP32
+        t.minFreeBytes = taskStatus[i].usStackHighWaterMark; // ESP-IDF measures stacks in bytes
+#else
+        t.minFreeBytes = taskStatus[i].usStackHighWaterMark * sizeof(StackType_t);
+#endif
+    }
+#else
+    s.numTasks = 0;
+#endif
+
+    s.packetsInUse = packetPool.getNumInUse();
+    s.maxPacketsInUse = packetPool.getMaxInUse();
+    s.packetCapacity = packetPool.getCapacity();
+    s.packetAllocFailures = packetPool.getNumFailed();
+}
+
+void MemoryMonitor::checkAlarms(const MemoryStats &s)
+{
+    // We only measure the heap on some platforms
+    if (s.freeHeap || s.largestFreeBlock) {
+        if (s.freeHeap < MEMORY_LOW_HEAP_BYTES && !heapAlarm) {
+            LOG_ERROR(MESH, "Low memory! free heap %u, largest free block %u\n", s.freeHeap, s.largestFreeBlock);
+            recordCriticalError(CRITICAL_ERROR_LOW_MEMORY, s.freeHeap);
+            heapAlarm = true;
+        } else if (s.freeHeap >= 2 * MEMORY_LOW_HEAP_BYTES)
+            heapAlarm = false; // We have properly recovered, so alarm again next time
+    }
+
+    const TaskStackInfo *lowest = NULL;
+    for (size_t i = 0; i < s.numTasks; i++)
+        if (!lowest || s.tasks[i].minFreeBytes < lowest->minFreeBytes)
+            lowest = &s.tasks[i];
+
+    // High water marks never recover, so this alarm is raised at most once per boot
+    if (lowest && lowest->minFreeBytes < MEMORY_LOW_STACK_BYTES && !stackAlarm) {
+        LOG_ERROR(MESH, "Low stack! task %s only had %u bytes left\n", lowest->name, lowest->minFreeBytes);
+        recordCriticalError(CRITICAL_ERROR_LOW_MEMORY, lowest->minFreeBytes);
+        stackAlarm = true;
+    }
+}
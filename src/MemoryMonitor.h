@@ -0,0 +1,85 @@
+#pragma once
+
+#include "concurrency/Lock.h"
+#include "concurrency/OSThread.h"
+#include "configuration.h"
+#include "error.h"
+
+/// How often we sample our memory use
+#ifndef MEMORY_MONITOR_MSEC
+#define MEMORY_MONITOR_MSEC (30 * 1000)
+#endif
+
+/// The most FreeRTOS tasks we report stack use for (if there are more, we don't see any of them)
+#ifndef MEMORY_MONITOR_MAX_TASKS
+#define MEMORY_MONITOR_MAX_TASKS 24
+#endif
+
+/// We raise an alarm if the free heap falls below this many bytes
+#ifndef MEMORY_LOW_HEAP_BYTES
+#ifdef NRF52_SERIES
+#define MEMORY_LOW_HEAP_BYTES (4 * 1024)
+#else
+#define MEMORY_LOW_HEAP_BYTES (16 * 1024)
+#endif
+#endif
+
+/// We raise an alarm if any task has ever had less than this many bytes of its stack left
+#ifndef MEMORY_LOW_STACK_BYTES
+#define MEMORY_LOW_STACK_BYTES 256
+#endif
+
+/// The error code for our low memory alarm (not yet in mesh.proto)
+#define CRITICAL_ERROR_LOW_MEMORY ((CriticalErrorCode)8)
+
+struct TaskStackInfo {
+    char name[16];
+    uint32_t minFreeBytes; // The least stack this task has ever had left (its high water mark)
+};
+
+/// One sample of our memory use, all sizes in bytes.  Heap numbers are 0 on platforms where we can't measure them.
+struct MemoryStats {
+    uint32_t sampleMsec; // millis() when this was taken (0 if we haven't sampled yet)
+
+    uint32_t freeHeap;
+    uint32_t largestFreeBlock; // If this is much smaller than freeHeap, our heap is fragmented
+    uint32_t minFreeHeap;      // The least free heap we have ever had (or seen, where the platform can't tell us)
+
+    uint8_t numTasks;
+    TaskStackInfo tasks[MEMORY_MONITOR_MAX_TASKS];
+
+    uint16_t packetsInUse, maxPacketsInUse, packetCapacity;
+    uint32_t packetAllocFailures;
+};
+
+/**
+ * Samples our heap, each FreeRTOS task's stack high water mark and packetPool every MEMORY_MONITOR_MSEC.
+ *
+ * A sample is a handful of allocator queries and one walk of the task list, so this is cheap enough for production builds.
+ * If free heap or any task's stack drops below MEMORY_LOW_HEAP_BYTES/MEMORY_LOW_STACK_BYTES we log an error and record a
+ * CRITICAL_ERROR_LOW_MEMORY, so the problem shows up in MyNodeInfo before we actually run out.  Each alarm is only raised
+ * again after we have recovered.
+ */
+class MemoryMonitor : private concurrency::OSThread
+{
+    MemoryStats stats = {};
+    concurrency::Lock lock; // Protects stats, which is read from the web server task
+
+    bool heapAlarm = false, stackAlarm = false;
+
+  public:
+    MemoryMonitor();
+
+    /// A consistent copy of our latest sample
+    MemoryStats getStats();
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    void sample(MemoryStats &s);
+
+    void checkAlarms(const MemoryStats &s);
+};
+
+extern MemoryMonitor *memoryMonitor;
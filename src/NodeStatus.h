@@ -71,7 +71,8 @@ namespace meshtastic {
             }
             if(isDirty || newStatus->forceUpdate) {
                 DEBUG_MSG("Node status update: %d online, %d total\n", numOnline, numTotal);            
-                onNewStatus.notifyObservers(this);
+                // Nodes coming and going from online are routine, a new (or forgotten) node is worth showing at once
+                publish(numTotal != lastNumTotal || newStatus->forceUpdate);
             }
             return 0;
         }
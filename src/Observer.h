@@ -2,7 +2,6 @@
 
 #include <Arduino.h>
 #include <assert.h>
-#include <list>
 
 template <class T> class Observable;
 
@@ -13,6 +12,9 @@ template <class T> class Observer
 {
     Observable<T> *observed = NULL;
 
+    /// The next observer watching the same observable (we can only watch one thing at a time, so we can embed the link here)
+    Observer<T> *nextObserver = NULL;
+
   public:
     virtual ~Observer();
 
@@ -53,10 +55,12 @@ template <class Callback, class T> class CallbackObserver : public Observer<T>
 /**
  * An observable class that will notify observers anytime notifyObservers is called.  Argument type T can be any type, but for
  * performance reasons a pointer or word sized object is recommended.
+ *
+ * Observers are kept in an intrusive list (the links live inside the Observer objects), so observing never touches the heap.
  */
 template <class T> class Observable
 {
-    std::list<Observer<T> *> observers;
+    Observer<T> *firstObserver = NULL;
 
   public:
     /**
@@ -66,11 +70,12 @@ template <class T> class Observable
      */
     int notifyObservers(T arg)
     {
-        for (typename std::list<Observer<T> *>::const_iterator iterator = observers.begin(); iterator != observers.end();
-             ++iterator) {
-            int result = (*iterator)->onNotify(arg);
+        for (Observer<T> *o = firstObserver; o;) {
+            Observer<T> *next = o->nextObserver; // In case o stops observing us from inside onNotify
+            int result = o->onNotify(arg);
             if (result != 0)
                 return result;
+            o = next;
         }
 
         return 0;
@@ -80,9 +85,25 @@ template <class T> class Observable
     friend class Observer<T>;
 
     // Not called directly, instead call observer.observe
-    void addObserver(Observer<T> *o) { observers.push_back(o); }
+    void addObserver(Observer<T> *o)
+    {
+        // Add to the end, so observers are called in the order they subscribed
+        Observer<T> **link = &firstObserver;
+        while (*link)
+            link = &(*link)->nextObserver;
+
+        o->nextObserver = NULL;
+        *link = o;
+    }
 
-    void removeObserver(Observer<T> *o) { observers.remove(o); }
+    void removeObserver(Observer<T> *o)
+    {
+        for (Observer<T> **link = &firstObserver; *link; link = &(*link)->nextObserver)
+            if (*link == o) {
+                *link = o->nextObserver;
+                return;
+            }
+    }
 };
 
 template <class T> Observer<T>::~Observer()
@@ -33,6 +33,12 @@ using namespace meshtastic;
 #define AREF_VOLTAGE 3.3
 #endif
 
+/// How many ADC reads we average for each battery voltage sample
+#define BATTERY_SENSE_SAMPLES 16
+
+/// We reuse a battery voltage sample for this long
+#define BATTERY_SAMPLE_MSEC 1000
+
 /**
  * If this board has a battery level sensor, set this to a valid implementation
  */
@@ -66,13 +72,23 @@ class AnalogBatteryLevel : public HasBatteryLevel
      */
     virtual float getBattVoltage()
     {
-        // Tested ttgo eink nrf52 board and the reported value is perfect
-        // DEBUG_MSG("raw val %u", raw);
-        return
 #ifdef BATTERY_PIN
-            1000.0 * 2.0 * (AREF_VOLTAGE / 1024.0) * analogRead(BATTERY_PIN);
+        // Each status update asks for the voltage several times, only sample it once per update
+        uint32_t now = millis();
+        if (!hasSample || now - lastSampleMsec >= BATTERY_SAMPLE_MSEC) {
+            // Average a burst of readings, a single ADC read on these boards is quite noisy
+            uint32_t sum = 0;
+            for (int i = 0; i < BATTERY_SENSE_SAMPLES; i++)
+                sum += analogRead(BATTERY_PIN);
+
+            // Tested ttgo eink nrf52 board and the reported value is perfect
+            lastMv = 1000.0 * 2.0 * (AREF_VOLTAGE / 1024.0) * sum / BATTERY_SENSE_SAMPLES;
+            lastSampleMsec = now;
+            hasSample = true;
+        }
+        return lastMv;
 #else
-            NAN;
+        return NAN;
 #endif
     }
 
@@ -93,14 +109,22 @@ class AnalogBatteryLevel : public HasBatteryLevel
     /// If we see a battery voltage higher than physics allows - assume charger is pumping
     /// in power
     const float fullVolt = 4.2, emptyVolt = 3.27, chargingVolt = 4.3, noBatVolt = 2.1;
+
+    float lastMv = NAN;
+    uint32_t lastSampleMsec = 0;
+    bool hasSample = false;
 } analogLevel;
 
-Power::Power() : OSThread("Power") {}
+Power::Power() : OSThread("Power")
+{
+    setSlack(POWER_POLL_SLACK_MSEC);
+    setPriority(concurrency::PRIORITY_BACKGROUND);
+}
 
 bool Power::analogInit()
 {
 #ifdef BATTERY_PIN
-    DEBUG_MSG("Using analog input for battery level\n");
+    LOG_DEBUG(POWER, "Using analog input for battery level\n");
 
     // disable any internal pullups
     pinMode(BATTERY_PIN, INPUT);
@@ -129,7 +153,7 @@ bool Power::setup()
     if (!found) {
         found = analogInit();
     }
-    enabled = found;
+    setEnabled(found);
 
     return found;
 }
@@ -137,7 +161,7 @@ bool Power::setup()
 void Power::shutdown()
 {
 #ifdef TBEAM_V10
-    DEBUG_MSG("Shutting down\n");
+    LOG_DEBUG(POWER, "Shutting down\n");
     axp.shutdown();
 #endif
 }
@@ -145,7 +169,7 @@ void Power::shutdown()
 /// Reads power status to powerStatus singleton.
 //
 // TODO(girts): move this and other axp stuff to power.h/power.cpp.
-void Power::readPowerStatus()
+bool Power::readPowerStatus()
 {
     if (batteryLevel) {
         bool hasBattery = batteryLevel->isBatteryConnect();
@@ -170,61 +194,117 @@ void Power::readPowerStatus()
         const PowerStatus powerStatus =
             PowerStatus(hasBattery ? OptTrue : OptFalse, batteryLevel->isVBUSPlug() ? OptTrue : OptFalse,
                         batteryLevel->isChargeing() ? OptTrue : OptFalse, batteryVoltageMv, batteryChargePercent);
-        DEBUG_MSG("Battery: usbPower=%d, isCharging=%d, batMv=%d, batPct=%d\n", powerStatus.getHasUSB(),
+        LOG_DEBUG(POWER, "Battery: usbPower=%d, isCharging=%d, batMv=%d, batPct=%d\n", powerStatus.getHasUSB(),
                   powerStatus.getIsCharging(), powerStatus.getBatteryVoltageMv(), powerStatus.getBatteryChargePercent());
         newStatus.notifyObservers(&powerStatus);
 
         // If we have a battery at all and it is less than 10% full, force deep sleep
-        if (powerStatus.getHasBattery() && !powerStatus.getHasUSB() && batteryLevel->getBattVoltage() < MIN_BAT_MILLIVOLTS)
+        bool onBattery = powerStatus.getHasBattery() && !powerStatus.getHasUSB();
+        if (onBattery && batteryLevel->getBattVoltage() < MIN_BAT_MILLIVOLTS)
             powerFSM.trigger(EVENT_LOW_BATTERY);
+
+        bool changed = powerStatus.getHasUSB() != lastHasUSB || powerStatus.getIsCharging() != lastIsCharging ||
+                       powerStatus.getHasBattery() != lastHasBattery ||
+                       abs(batteryVoltageMv - lastVoltageMv) >= POWER_CHANGE_MILLIVOLTS;
+        if (changed) {
+            lastHasUSB = powerStatus.getHasUSB();
+            lastIsCharging = powerStatus.getIsCharging();
+            lastHasBattery = powerStatus.getHasBattery();
+            lastVoltageMv = batteryVoltageMv;
+        }
+
+        // Nearly flat counts as changing, so we keep checking often enough to catch it
+        return changed || (onBattery && batteryVoltageMv < MIN_BAT_MILLIVOLTS + POWER_LOW_MARGIN_MILLIVOLTS);
     } else {
         // No power sensing on this board - tell everyone else we have no idea what is happening
         const PowerStatus powerStatus = PowerStatus(OptUnknown, OptUnknown, OptUnknown, -1, -1);
         newStatus.notifyObservers(&powerStatus);
+        return false;
     }
 }
 
-int32_t Power::runOnce()
+IRAM_ATTR void Power::onPmuIrqFromISR()
 {
-    readPowerStatus();
+    pmu_irq = true;
+
+    BaseType_t higherWake = 0;
+    setInterval(0);
+    getController()->wakeFromISR(&higherWake);
+    portYIELD_FROM_ISR(higherWake);
+}
 
+bool Power::checkPmuIrq()
+{
 #ifdef TBEAM_V10
-    // WE no longer use the IRQ line to wake the CPU (due to false wakes from sleep), but we do poll
-    // the IRQ status by reading the registers over I2C
+    if (batteryLevel != &axp)
+        return false;
+
+#ifdef PMU_IRQ
+    if (!pmu_irq)
+        return false; // Our IRQ line hasn't fired, no need to talk to the PMU
+    pmu_irq = false;
+#endif
+
     axp.readIRQ();
+    bool hadEvent = false;
 
     if (axp.isVbusRemoveIRQ()) {
-        DEBUG_MSG("USB unplugged\n");
+        LOG_DEBUG(POWER, "USB unplugged\n");
         powerFSM.trigger(EVENT_POWER_DISCONNECTED);
+        hadEvent = true;
     }
     if (axp.isVbusPlugInIRQ()) {
-        DEBUG_MSG("USB plugged In\n");
+        LOG_DEBUG(POWER, "USB plugged In\n");
         powerFSM.trigger(EVENT_POWER_CONNECTED);
+        hadEvent = true;
+    }
+    if (axp.isBattPlugInIRQ()) {
+        LOG_DEBUG(POWER, "Battery inserted\n");
+        hadEvent = true;
     }
     /*
     Other things we could check if we cared...
 
     if (axp.isChargingIRQ()) {
-        DEBUG_MSG("Battery start charging\n");
+        LOG_DEBUG(POWER, "Battery start charging\n");
     }
     if (axp.isChargingDoneIRQ()) {
-        DEBUG_MSG("Battery fully charged\n");
-    }
-    if (axp.isBattPlugInIRQ()) {
-        DEBUG_MSG("Battery inserted\n");
+        LOG_DEBUG(POWER, "Battery fully charged\n");
     }
     if (axp.isBattRemoveIRQ()) {
-        DEBUG_MSG("Battery removed\n");
+        LOG_DEBUG(POWER, "Battery removed\n");
     }
     if (axp.isPEKShortPressIRQ()) {
-        DEBUG_MSG("PEK short button press\n");
+        LOG_DEBUG(POWER, "PEK short button press\n");
     }
     */
     axp.clearIRQ();
+
+    return hadEvent;
+#else
+    return false;
 #endif
+}
+
+int32_t Power::runOnce()
+{
+    bool hadEvent = checkPmuIrq();
+    bool changed = readPowerStatus();
+
+    if (hadEvent || changed)
+        pollMsec = POWER_POLL_MIN_MSEC;
+    else {
+        uint32_t maxMsec = POWER_POLL_MAX_MSEC;
+#if defined(TBEAM_V10) && !defined(PMU_IRQ)
+        // Without our IRQ line polling is the only way we find out about plug/unplug events
+        if (batteryLevel == &axp)
+            maxMsec = POWER_POLL_MIN_MSEC;
+#endif
+        pollMsec = min(pollMsec * 2, maxMsec);
+    }
 
-    // Only read once every 20 seconds once the power status for the app has been initialized
-    return (statusHandler && statusHandler->isInitialized()) ? (1000 * 20) : RUN_SAME;
+    // Only back off once the power status for the app has been initialized
+    return (statusHandler && statusHandler->isInitialized()) ? pollMsec : RUN_SAME;
 }
 
 /**
@@ -243,16 +323,16 @@ bool Power::axp192Init()
         if (!axp.begin(Wire, AXP192_SLAVE_ADDRESS)) {
             batteryLevel = &axp;
 
-            DEBUG_MSG("AXP192 Begin PASS\n");
+            LOG_DEBUG(POWER, "AXP192 Begin PASS\n");
 
             // axp.setChgLEDMode(LED_BLINK_4HZ);
-            DEBUG_MSG("DCDC1: %s\n", axp.isDCDC1Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("DCDC2: %s\n", axp.isDCDC2Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("LDO2: %s\n", axp.isLDO2Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("LDO3: %s\n", axp.isLDO3Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("DCDC3: %s\n", axp.isDCDC3Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("Exten: %s\n", axp.isExtenEnable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("----------------------------------------\n");
+            LOG_DEBUG(POWER, "DCDC1: %s\n", axp.isDCDC1Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "DCDC2: %s\n", axp.isDCDC2Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "LDO2: %s\n", axp.isLDO2Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "LDO3: %s\n", axp.isLDO3Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "DCDC3: %s\n", axp.isDCDC3Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "Exten: %s\n", axp.isExtenEnable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "----------------------------------------\n");
 
             axp.setPowerOutPut(AXP192_LDO2, AXP202_ON); // LORA radio
             // axp.setPowerOutPut(AXP192_LDO3, AXP202_ON); // GPS main power - now turned on in setGpsPower
@@ -261,12 +341,12 @@ bool Power::axp192Init()
             axp.setPowerOutPut(AXP192_DCDC1, AXP202_ON);
             axp.setDCDC1Voltage(3300); // for the OLED power
 
-            DEBUG_MSG("DCDC1: %s\n", axp.isDCDC1Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("DCDC2: %s\n", axp.isDCDC2Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("LDO2: %s\n", axp.isLDO2Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("LDO3: %s\n", axp.isLDO3Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("DCDC3: %s\n", axp.isDCDC3Enable() ? "ENABLE" : "DISABLE");
-            DEBUG_MSG("Exten: %s\n", axp.isExtenEnable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "DCDC1: %s\n", axp.isDCDC1Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "DCDC2: %s\n", axp.isDCDC2Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "LDO2: %s\n", axp.isLDO2Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "LDO3: %s\n", axp.isLDO3Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "DCDC3: %s\n", axp.isDCDC3Enable() ? "ENABLE" : "DISABLE");
+            LOG_DEBUG(POWER, "Exten: %s\n", axp.isExtenEnable() ? "ENABLE" : "DISABLE");
 
             //axp.setChargeControlCur(AXP1XX_CHARGE_CUR_1320MA); // actual limit (in HW) on the tbeam is 450mA
             axp.setChargeControlCur(AXP1XX_CHARGE_CUR_450MA); // There's no HW limit on the tbeam. Setting to 450mz to be a good neighbor on the usb bus.
@@ -286,23 +366,25 @@ bool Power::axp192Init()
 #ifdef PMU_IRQ
             pinMode(PMU_IRQ, INPUT);
             attachInterrupt(
-                PMU_IRQ, [] { pmu_irq = true; }, FALLING);
+                PMU_IRQ, [] { power->onPmuIrqFromISR(); }, FALLING);
 
             axp.adc1Enable(AXP202_BATT_CUR_ADC1, 1);
             // we do not look for AXP202_CHARGING_FINISHED_IRQ & AXP202_CHARGING_IRQ because it occurs repeatedly while there is
             // no battery also it could cause inadvertent waking from light sleep just because the battery filled
             // we don't look for AXP202_BATT_REMOVED_IRQ because it occurs repeatedly while no battery installed
-            // we don't look at AXP202_VBUS_REMOVED_IRQ because we don't have anything hooked to vbus
-            axp.enableIRQ(AXP202_BATT_CONNECT_IRQ | AXP202_VBUS_CONNECT_IRQ | AXP202_PEK_SHORTPRESS_IRQ, 1);
+            // we do want AXP202_VBUS_REMOVED_IRQ, it is how the PowerFSM finds out we've been unplugged
+            axp.enableIRQ(AXP202_BATT_CONNECT_IRQ | AXP202_VBUS_CONNECT_IRQ | AXP202_VBUS_REMOVED_IRQ |
+                              AXP202_PEK_SHORTPRESS_IRQ,
+                          1);
 
             axp.clearIRQ();
 #endif
             readPowerStatus();
         } else {
-            DEBUG_MSG("AXP192 Begin FAIL\n");
+            LOG_ERROR(POWER, "AXP192 Begin FAIL\n");
         }
     } else {
-        DEBUG_MSG("AXP192 not found\n");
+        LOG_ERROR(POWER, "AXP192 not found\n");
     }
 
     return axp192_found;
@@ -3,6 +3,9 @@
 #include "GPS.h"
 #include "MeshService.h"
 #include "NodeDB.h"
+#include "PowerStats.h"
+#include "RadioLibInterface.h"
+#include "Router.h"
 #include "configuration.h"
 #include "graphics/Screen.h"
 #include "main.h"
@@ -11,6 +14,7 @@
 
 static void sdsEnter()
 {
+    powerStats.onEnter(PS_SDS);
     // FIXME - make sure GPS and LORA radio are off first - because we want close to zero current draw
     doDeepSleep(getPref_sds_secs() * 1000LL);
 }
@@ -21,11 +25,12 @@ static uint32_t secsSlept;
 
 static void lsEnter()
 {
-    DEBUG_MSG("lsEnter begin, ls_secs=%u\n", getPref_ls_secs());
+    powerStats.onEnter(PS_LS);
+    LOG_DEBUG(POWER, "lsEnter begin, ls_secs=%u\n", getPref_ls_secs());
     screen->setOn(false);
     secsSlept = 0; // How long have we been sleeping this time
 
-    DEBUG_MSG("lsEnter end\n");
+    LOG_DEBUG(POWER, "lsEnter end\n");
 }
 
 static void lsIdle()
@@ -64,7 +69,18 @@ static void lsIdle()
             default:
                 // We woke for some other reason (button press, device interrupt)
                 // uint64_t status = esp_sleep_get_ext1_wakeup_status();
-                DEBUG_MSG("wakeCause %d\n", wakeCause);
+                LOG_DEBUG(POWER, "wakeCause %d\n", wakeCause);
+
+                // If it was our radio, get the packet to the router now rather than after a trip through the scheduler
+                if (wakeCause == ESP_SLEEP_WAKEUP_GPIO && RadioLibInterface::instance &&
+                    RadioLibInterface::instance->handleSleepWake(lightSleepWakeUsec)) {
+                    router->runOnce();
+
+                    auto radio = RadioLibInterface::instance;
+                    LOG_DEBUG(POWER, "radio wake: rx handled after %u usec (max %u), routed after %u usec, %u wakes\n",
+                              radio->lastWakeLatencyUsec, radio->maxWakeLatencyUsec, micros() - lightSleepWakeUsec,
+                              radio->numRadioWakes);
+                }
 
 #ifdef BUTTON_PIN
                 bool pressed = !digitalRead(BUTTON_PIN);
@@ -88,7 +104,7 @@ static void lsIdle()
     } else {
         // Time to stop sleeping!
         setLed(false);
-        DEBUG_MSG("reached ls_secs, servicing loop()\n");
+        LOG_DEBUG(POWER, "reached ls_secs, servicing loop()\n");
         powerFSM.trigger(EVENT_WAKE_TIMER);
     }
 #endif
@@ -97,11 +113,13 @@ static void lsIdle()
 static void lsExit()
 {
     // setGPSPower(true); // restore GPS power
-    gps->forceWake(true);
+    if (gps) // We might not have found it yet
+        gps->forceWake(true);
 }
 
 static void nbEnter()
 {
+    powerStats.onEnter(PS_NB);
     screen->setOn(false);
     setBluetoothEnable(false);
 
@@ -110,12 +128,14 @@ static void nbEnter()
 
 static void darkEnter()
 {
+    powerStats.onEnter(PS_DARK);
     setBluetoothEnable(true);
     screen->setOn(false);
 }
 
 static void serialEnter()
 {
+    powerStats.onEnter(PS_SERIAL);
     setBluetoothEnable(false);
     screen->setOn(true);
     screen->print("Using API...\n");
@@ -123,6 +143,7 @@ static void serialEnter()
 
 static void powerEnter()
 {
+    powerStats.onEnter(PS_POWER);
     screen->setOn(true);
     setBluetoothEnable(true);
     screen->print("Powered...\n");
@@ -137,6 +158,7 @@ static void powerExit()
 
 static void onEnter()
 {
+    powerStats.onEnter(PS_ON);
     screen->setOn(true);
     setBluetoothEnable(true);
 
@@ -183,7 +205,7 @@ void PowerFSM_setup()
     */
     bool hasPower = (powerStatus && !powerStatus->getHasBattery()) || (!isLowPower && powerStatus && powerStatus->getHasUSB());
 
-    DEBUG_MSG("PowerFSM init, USB power=%d\n", hasPower);
+    LOG_DEBUG(POWER, "PowerFSM init, USB power=%d\n", hasPower);
     powerFSM.add_timed_transition(&stateBOOT, hasPower ? &statePOWER : &stateON, 3 * 1000, NULL, "boot timeout");
 
     // wake timer expired or a packet arrived
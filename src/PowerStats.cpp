@@ -0,0 +1,71 @@
+#include "PowerStats.h"
+#include "airtime.h"
+
+PowerStats powerStats;
+
+void PowerStats::onEnter(PowerStatsState s)
+{
+    uint32_t now = millis();
+
+    stateMsec[current] += now - enteredMsec;
+    numEntries[s]++;
+    if (transitions[current][s] != UINT16_MAX)
+        transitions[current][s]++;
+
+    LOG_DEBUG(POWER, "power state %s -> %s after %u msec\n", getStateName(current), getStateName(s), now - enteredMsec);
+
+    current = s;
+    enteredMsec = now;
+}
+
+uint64_t PowerStats::getStateMsec(PowerStatsState s) const
+{
+    uint64_t r = stateMsec[s];
+    if (s == current)
+        r += millis() - enteredMsec;
+    return r;
+}
+
+float PowerStats::getRadioMah() const
+{
+    // The radio listens whenever we are awake, except for the time it spends transmitting
+    uint64_t awakeMsec = 0;
+    for (int s = 0; s < PS_NUM_STATES; s++)
+        if (s != PS_SDS)
+            awakeMsec += getStateMsec((PowerStatsState)s);
+
+    uint64_t txMsec = getAirtimeMsec(TX_LOG);
+    uint64_t rxMsec = awakeMsec > txMsec ? awakeMsec - txMsec : 0;
+
+    return (txMsec * POWER_MA_RADIO_TX + rxMsec * POWER_MA_RADIO_RX) / 3600000.0f;
+}
+
+float PowerStats::getTotalMah() const
+{
+    float mah = getRadioMah();
+    for (int s = 0; s < PS_NUM_STATES; s++)
+        mah += getStateMah((PowerStatsState)s);
+    return mah;
+}
+
+float PowerStats::getAverageMilliamps() const
+{
+    uint64_t totalMsec = 0;
+    for (int s = 0; s < PS_NUM_STATES; s++)
+        totalMsec += getStateMsec((PowerStatsState)s);
+
+    return totalMsec ? getTotalMah() * 3600000.0f / totalMsec : 0;
+}
+
+float PowerStats::getStateMilliamps(PowerStatsState s)
+{
+    static const float milliamps[PS_NUM_STATES] = {POWER_MA_BOOT, POWER_MA_SDS,   POWER_MA_LS,    POWER_MA_NB,
+                                                   POWER_MA_DARK, POWER_MA_ON,    POWER_MA_POWER, POWER_MA_SERIAL};
+    return milliamps[s];
+}
+
+const char *PowerStats::getStateName(PowerStatsState s)
+{
+    static const char *const names[PS_NUM_STATES] = {"BOOT", "SDS", "LS", "NB", "DARK", "ON", "POWER", "SERIAL"};
+    return names[s];
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "configuration.h"
+#include <Arduino.h>
+
+/// The PowerFSM states we keep statistics for (the order is part of the PowerStatsPlugin wire format, only add to the end)
+enum PowerStatsState { PS_BOOT, PS_SDS, PS_LS, PS_NB, PS_DARK, PS_ON, PS_POWER, PS_SERIAL, PS_NUM_STATES };
+
+/*
+  Estimated board current in each state (excluding the radio), in mA.  These are rough numbers from bench measurements, boards
+  which differ a lot (i.e. that have a GPS or a big screen) should override them in configuration.h
+*/
+#ifdef NRF52_SERIES
+#ifndef POWER_MA_BOOT
+#define POWER_MA_BOOT 8.0
+#endif
+#ifndef POWER_MA_SDS
+#define POWER_MA_SDS 0.02
+#endif
+#ifndef POWER_MA_LS
+#define POWER_MA_LS 1.5 // We don't actually light sleep on NRF52, but the CPU idles in WFE between threads
+#endif
+#ifndef POWER_MA_NB
+#define POWER_MA_NB 1.5
+#endif
+#ifndef POWER_MA_DARK
+#define POWER_MA_DARK 3.0
+#endif
+#ifndef POWER_MA_ON
+#define POWER_MA_ON 12.0
+#endif
+#else
+#ifndef POWER_MA_BOOT
+#define POWER_MA_BOOT 80.0
+#endif
+#ifndef POWER_MA_SDS
+#define POWER_MA_SDS 0.15
+#endif
+#ifndef POWER_MA_LS
+#define POWER_MA_LS 1.5
+#endif
+#ifndef POWER_MA_NB
+#define POWER_MA_NB 25.0
+#endif
+#ifndef POWER_MA_DARK
+#define POWER_MA_DARK 45.0
+#endif
+#ifndef POWER_MA_ON
+#define POWER_MA_ON 70.0
+#endif
+#endif
+
+#ifndef POWER_MA_POWER
+#define POWER_MA_POWER POWER_MA_ON
+#endif
+#ifndef POWER_MA_SERIAL
+#define POWER_MA_SERIAL POWER_MA_ON
+#endif
+
+/// Extra current while our radio is listening (it stays in rx in every state except SDS), in mA
+#ifndef POWER_MA_RADIO_RX
+#define POWER_MA_RADIO_RX 11.0
+#endif
+
+/// Extra current while our radio is transmitting (at full power), in mA
+#ifndef POWER_MA_RADIO_TX
+#define POWER_MA_RADIO_TX 120.0
+#endif
+
+/**
+ * Time and (estimated) energy accounting for the PowerFSM states.
+ *
+ * Each state's enter function tells us about the transition, we keep the cumulative time in every state, how often it was
+ * entered, and how often each from -> to transition happened.  The energy estimate multiplies time in state by the
+ * POWER_MA_xxx constants and adds the radio's share from our tx airtime (see airtime.cpp).  That makes it a model, not a
+ * measurement, but it is good enough to compare settings like ls_secs, wait_bluetooth_secs and min_wake_secs.
+ *
+ * Nothing survives deep sleep (SDS), so the counts are since our last reboot.
+ */
+class PowerStats
+{
+    PowerStatsState current = PS_BOOT;
+    uint32_t enteredMsec = 0; // millis() when we entered current
+
+    uint64_t stateMsec[PS_NUM_STATES] = {}; // Not including our current stay
+    uint32_t numEntries[PS_NUM_STATES] = {};
+    uint16_t transitions[PS_NUM_STATES][PS_NUM_STATES] = {}; // [from][to], saturates rather than wrapping
+
+  public:
+    PowerStats() { numEntries[PS_BOOT] = 1; }
+
+    /// Called by each PowerFSM state's enter function (including when a state is reentered)
+    void onEnter(PowerStatsState s);
+
+    PowerStatsState getState() const { return current; }
+
+    /// msecs we have spent in s since boot, including our current stay
+    uint64_t getStateMsec(PowerStatsState s) const;
+
+    uint32_t getNumEntries(PowerStatsState s) const { return numEntries[s]; }
+
+    uint16_t getNumTransitions(PowerStatsState from, PowerStatsState to) const { return transitions[from][to]; }
+
+    /// Estimated mAh the board (not counting the radio) has used in s
+    float getStateMah(PowerStatsState s) const { return getStateMsec(s) * getStateMilliamps(s) / 3600000.0f; }
+
+    /// Estimated mAh our radio has used listening and transmitting
+    float getRadioMah() const;
+
+    /// Estimated mAh used since boot
+    float getTotalMah() const;
+
+    /// Estimated average current since boot, in mA
+    float getAverageMilliamps() const;
+
+    static float getStateMilliamps(PowerStatsState s);
+
+    static const char *getStateName(PowerStatsState s);
+};
+
+extern PowerStats powerStats;
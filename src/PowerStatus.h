@@ -3,6 +3,11 @@
 #include "configuration.h"
 #include <Arduino.h>
 
+/// On battery below this we are nearly flat, which observers hear about at once (rather than after StatusHandler's wait)
+#ifndef POWER_STATUS_CRITICAL_MILLIVOLTS
+#define POWER_STATUS_CRITICAL_MILLIVOLTS 3450
+#endif
+
 namespace meshtastic
 {
 
@@ -63,6 +68,12 @@ class PowerStatus : public Status
      */
     uint8_t getBatteryChargePercent() const { return getHasBattery() ? batteryChargePercent : 0; }
 
+    /// Are we running on a nearly flat battery
+    bool getIsCritical() const
+    {
+        return getHasBattery() && !getHasUSB() && batteryVoltageMv >= 0 && batteryVoltageMv < POWER_STATUS_CRITICAL_MILLIVOLTS;
+    }
+
     bool matches(const PowerStatus *newStatus) const
     {
         return (newStatus->getHasBattery() != hasBattery || newStatus->getHasUSB() != hasUSB ||
@@ -71,9 +82,11 @@ class PowerStatus : public Status
     int updateStatus(const PowerStatus *newStatus)
     {
         // Only update the status if values have actually changed
-        bool isDirty;
+        bool isDirty, significant;
         {
             isDirty = matches(newStatus);
+            significant = newStatus->hasBattery != hasBattery || newStatus->hasUSB != hasUSB ||
+                          newStatus->isCharging != isCharging || newStatus->getIsCritical() != getIsCritical();
             initialized = true;
             hasBattery = newStatus->hasBattery;
             batteryVoltageMv = newStatus->getBatteryVoltageMv();
@@ -83,7 +96,7 @@ class PowerStatus : public Status
         }
         if (isDirty) {
             // DEBUG_MSG("Battery %dmV %d%%\n", batteryVoltageMv, batteryChargePercent);
-            onNewStatus.notifyObservers(this);
+            publish(significant);
         }
         return 0;
     }
@@ -1,6 +1,8 @@
 #include "RedirectablePrint.h"
 #include "configuration.h"
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include "concurrency/OSThread.h"
@@ -10,6 +12,112 @@
  */
 NoopPrint noopPrint;
 
+uint32_t logRuntimeLevels = 0x444444; // LOG_LEVEL_DEBUG for every module
+
+/// Our time of day for log records when we don't have one
+#define LOG_TIME_UNKNOWN UINT32_MAX
+
+/**
+ * Prints deferred log messages.  It runs on the main loop, so log output never interleaves with whatever our other main loop
+ * threads (i.e. the serial API) write to the same port.  Except on portduino, where writing to a terminal (or a pipe to
+ * journald) is slow enough that a busy gateway would spend its main loop logging, so there we drain from our host thread.
+ */
+#ifdef PORTDUINO
+#define LOG_DRAIN_CONTROLLER concurrency::hostController
+#else
+#define LOG_DRAIN_CONTROLLER concurrency::mainController
+#endif
+
+class LogDrainThread : public concurrency::OSThread
+{
+    RedirectablePrint *printer;
+
+  public:
+    LogDrainThread(RedirectablePrint *_printer) : OSThread("LogDrain", 0, &LOG_DRAIN_CONTROLLER), printer(_printer) {}
+
+  protected:
+    virtual int32_t runOnce() { return printer->runDrain(); }
+};
+
+/// The parts of a printf conversion spec we need to know to find (and later reformat) its argument
+struct FormatSpec {
+    const char *end; // Just past the conversion character
+    char conversion;
+    char length; // 0, 'h', 'H' (hh), 'l', 'L' (ll or L), 'z', 'j' or 't'
+    uint8_t numStars; // How many ints the width and precision consume
+};
+
+/// Parse the conversion spec starting at the '%' at s
+static FormatSpec parseSpec(const char *s)
+{
+    FormatSpec spec = {NULL, 0, 0, 0};
+
+    s++;
+    while (*s && strchr("-+ #0", *s))
+        s++;
+    for (; *s == '*' || (*s >= '0' && *s <= '9'); s++)
+        if (*s == '*')
+            spec.numStars++;
+    if (*s == '.')
+        for (s++; *s == '*' || (*s >= '0' && *s <= '9'); s++)
+            if (*s == '*')
+                spec.numStars++;
+
+    switch (*s) {
+    case 'h':
+    case 'l':
+        spec.length = *s++;
+        if (*s == spec.length) { // hh or ll
+            spec.length = spec.length == 'h' ? 'H' : 'L';
+            s++;
+        }
+        break;
+    case 'L':
+    case 'z':
+    case 'j':
+    case 't':
+        spec.length = *s++;
+        break;
+    }
+
+    spec.conversion = *s;
+    spec.end = *s ? s + 1 : s;
+    return spec;
+}
+
+template <class T> static bool putArg(DeferredLog &r, T v)
+{
+    if (r.argsLen + sizeof(T) > LOG_RECORD_ARGS_LEN)
+        return false;
+
+    memcpy(r.args + r.argsLen, &v, sizeof(T)); // args are packed, so they might not be aligned
+    r.argsLen += sizeof(T);
+    return true;
+}
+
+template <class T> static bool getArg(const DeferredLog &r, size_t &pos, T *v)
+{
+    if (pos + sizeof(T) > r.argsLen)
+        return false;
+
+    memcpy(v, r.args + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+RedirectablePrint::RedirectablePrint(Print *_dest) : dest(_dest), enqueuePos(0), numDropped(0), drainIdle(false)
+{
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].seq = i;
+}
+
+void RedirectablePrint::startDeferredLogging()
+{
+    if (!drainThread)
+        drainThread = new LogDrainThread(this);
+    deferred = true;
+}
+
 void RedirectablePrint::setDestination(Print *_dest)
 {
     assert(_dest);
@@ -18,6 +126,12 @@ void RedirectablePrint::setDestination(Print *_dest)
 
 size_t RedirectablePrint::write(uint8_t c)
 {
+    if (capturing) {
+        if (c != '\r' && c != '\n' && lineLen < sizeof(line) - 1)
+            line[lineLen++] = c;
+        return 1;
+    }
+
     // Always send the characters to our segger JTAG debugger
 #ifdef SEGGER_STDOUT_CH
     SEGGER_RTT_PutCharSkip(SEGGER_STDOUT_CH, c);
@@ -32,17 +146,17 @@ size_t RedirectablePrint::vprintf(const char *format, va_list arg)
     va_list copy;
 
     va_copy(copy, arg);
-    int len = vsnprintf(printBuf, printBufLen, format, copy);
+    int len = vsnprintf(printBuf, sizeof(printBuf), format, copy);
     va_end(copy);
     if (len < 0) {
         va_end(arg);
         return 0;
     };
-    if (len >= printBufLen) {
-        delete[] printBuf;
-        printBufLen *= 2;
-        printBuf = new char[printBufLen];
-        len = vsnprintf(printBuf, printBufLen, format, arg);
+    if (len >= (int)sizeof(printBuf)) {
+        // Truncated, but keep the line ending so the next message doesn't run on from ours
+        len = sizeof(printBuf) - 1;
+        if (format[strlen(format) - 1] == '\n')
+            printBuf[len - 1] = '\n';
     }
 
     len = Print::write(printBuf, len);
@@ -53,42 +167,66 @@ size_t RedirectablePrint::vprintf(const char *format, va_list arg)
 #define SEC_PER_HOUR 3600
 #define SEC_PER_MIN 60
 
+size_t RedirectablePrint::printHeader(uint32_t timeSec, const char *threadName)
+{
+    size_t r = 0;
+
+    if (timeSec != LOG_TIME_UNKNOWN) {
+        long hms = timeSec % SEC_PER_DAY;
+        //hms += tz.tz_dsttime * SEC_PER_HOUR;
+        //hms -= tz.tz_minuteswest * SEC_PER_MIN;
+        // mod `hms` to ensure in positive range of [0...SEC_PER_DAY)
+        hms = (hms + SEC_PER_DAY) % SEC_PER_DAY;
+
+        // Tear apart hms into h:m:s
+        int hour = hms / SEC_PER_HOUR;
+        int min = (hms % SEC_PER_HOUR) / SEC_PER_MIN;
+        int sec = (hms % SEC_PER_HOUR) % SEC_PER_MIN; // or hms % SEC_PER_MIN
+
+        r += printf("%02d:%02d:%02d ", hour, min, sec);
+    } else
+        r += printf("??:??:?? ");
+
+    if (threadName) {
+        print("[");
+        print(threadName);
+        print("] ");
+    }
+
+    return r;
+}
+
+static uint32_t getLogTime()
+{
+    struct timeval tv;
+    return gettimeofday(&tv, NULL) ? LOG_TIME_UNKNOWN : (uint32_t)tv.tv_sec;
+}
+
+static const char *getLogThreadName()
+{
+    auto thread = concurrency::OSThread::currentThread;
+    return thread ? thread->ThreadName.c_str() : NULL;
+}
+
 size_t RedirectablePrint::logDebug(const char *format, ...)
 {
     va_list arg;
     va_start(arg, format);
 
+    if (deferred) {
+        logDeferred(format, arg);
+        va_end(arg);
+        return 0; // We don't know how long it will be yet
+    }
+
     // Cope with 0 len format strings, but look for new line terminator
     bool hasNewline = *format && format[strlen(format) - 1] == '\n';
 
     size_t r = 0;
 
     // If we are the first message on a report, include the header
-    if (!isContinuationMessage) {
-        struct timeval tv;
-        if (!gettimeofday(&tv, NULL)) {
-            long hms = tv.tv_sec % SEC_PER_DAY;
-            //hms += tz.tz_dsttime * SEC_PER_HOUR;
-            //hms -= tz.tz_minuteswest * SEC_PER_MIN;
-            // mod `hms` to ensure in positive range of [0...SEC_PER_DAY)
-            hms = (hms + SEC_PER_DAY) % SEC_PER_DAY;
-
-            // Tear apart hms into h:m:s
-            int hour = hms / SEC_PER_HOUR;
-            int min = (hms % SEC_PER_HOUR) / SEC_PER_MIN;
-            int sec = (hms % SEC_PER_HOUR) % SEC_PER_MIN; // or hms % SEC_PER_MIN
-
-            r += printf("%02d:%02d:%02d ", hour, min, sec);
-        } else
-            r += printf("??:??:?? ");
-
-        auto thread = concurrency::OSThread::currentThread;
-        if(thread) {
-            print("[");
-            print(thread->ThreadName);
-            print("] ");
-        }
-    }
+    if (!isContinuationMessage)
+        r += printHeader(getLogTime(), getLogThreadName());
 
     r += vprintf(format, arg);
     va_end(arg);
@@ -96,4 +234,294 @@ size_t RedirectablePrint::logDebug(const char *format, ...)
     isContinuationMessage = !hasNewline;
 
     return r;
-}
\ No newline at end of file
+}
+
+void RedirectablePrint::logDeferred(const char *format, va_list arg)
+{
+    // Claim a slot
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    DeferredLog *r;
+    while (true) {
+        r = &ring[pos & (LOG_RING_SIZE - 1)];
+        intptr_t dif = (intptr_t)r->seq.load(std::memory_order_acquire) - (intptr_t)pos;
+        if (dif == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            numDropped++; // The drain thread hasn't freed this slot from the last lap yet, we are full
+            return;
+        } else
+            pos = enqueuePos.load(std::memory_order_relaxed); // Someone else claimed it first
+    }
+
+    r->format = format;
+    const char *threadName = getLogThreadName();
+    strncpy(r->threadName, threadName ? threadName : "", sizeof(r->threadName) - 1);
+    r->threadName[sizeof(r->threadName) - 1] = '\0';
+    r->timeSec = getLogTime();
+    r->argsLen = 0;
+    r->argsTruncated = false;
+
+    // Copy each argument the format will consume (strings by value, because they are often temporary buffers)
+    bool ok = true;
+    for (const char *s = strchr(format, '%'); ok && s; s = strchr(s, '%')) {
+        if (s[1] == '%') {
+            s += 2;
+            continue;
+        }
+
+        FormatSpec spec = parseSpec(s);
+        s = spec.end;
+        for (uint8_t i = 0; ok && i < spec.numStars; i++)
+            ok = putArg(*r, va_arg(arg, int));
+        if (!ok)
+            break;
+
+        switch (spec.conversion) {
+        case 'd':
+        case 'i':
+        case 'c':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if (spec.length == 'l')
+                ok = putArg(*r, va_arg(arg, long));
+            else if (spec.length == 'L' || spec.length == 'j')
+                ok = putArg(*r, va_arg(arg, long long));
+            else if (spec.length == 'z')
+                ok = putArg(*r, va_arg(arg, size_t));
+            else if (spec.length == 't')
+                ok = putArg(*r, va_arg(arg, ptrdiff_t));
+            else
+                ok = putArg(*r, va_arg(arg, int)); // char and short were promoted to int
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (spec.length == 'L')
+                ok = putArg(*r, va_arg(arg, long double));
+            else
+                ok = putArg(*r, va_arg(arg, double)); // floats were promoted to double
+            break;
+        case 'p':
+            ok = putArg(*r, va_arg(arg, void *));
+            break;
+        case 's': {
+            const char *str = va_arg(arg, const char *);
+            if (!str)
+                str = "(null)";
+            size_t space = LOG_RECORD_ARGS_LEN - r->argsLen;
+            if (!space) {
+                ok = false;
+                break;
+            }
+            size_t len = strnlen(str, space - 1);
+            memcpy(r->args + r->argsLen, str, len);
+            r->args[r->argsLen + len] = '\0';
+            r->argsLen += len + 1;
+            break;
+        }
+        default:
+            ok = false; // Something we don't understand (or %n), we can't safely find any later arguments
+            break;
+        }
+    }
+    r->argsTruncated = !ok;
+
+    r->seq.store(pos + 1, std::memory_order_release); // Publish to the drain thread
+
+    if (drainIdle.exchange(false)) {
+        drainThread->setInterval(0);
+        drainThread->getController()->wake();
+    }
+}
+
+void RedirectablePrint::sinkRecord(const DeferredLog &r)
+{
+    if (!isContinuationMessage) {
+        lineLen = 0;
+        lineTimeSec = r.timeSec;
+        strcpy(lineSource, r.threadName);
+    }
+
+    // printRecord() writes the text to our line rather than dest, and leaves out the header (the sink gets it separately)
+    capturing = true;
+    printRecord(r);
+    capturing = false;
+
+    if (!isContinuationMessage) {
+        line[lineLen] = '\0';
+        lineSink->writeLogLine(lineTimeSec, lineSource[0] ? lineSource : NULL, line);
+    }
+}
+
+void RedirectablePrint::printRecord(const DeferredLog &r)
+{
+    const char *format = r.format;
+    size_t argPos = 0;
+
+    if (!isContinuationMessage && !capturing)
+        printHeader(r.timeSec, r.threadName[0] ? r.threadName : NULL);
+
+    // Cope with 0 len format strings, but look for new line terminator
+    isContinuationMessage = !(*format && format[strlen(format) - 1] == '\n');
+
+    // Literal text goes out as is, each conversion is formatted on its own with the argument we copied for it
+    const char *s = format;
+    while (*s) {
+        const char *pct = strchr(s, '%');
+        size_t literalLen = pct ? pct - s : strlen(s);
+        Print::write((const uint8_t *)s, literalLen);
+        if (!pct)
+            break;
+
+        if (pct[1] == '%') {
+            write('%');
+            s = pct + 2;
+            continue;
+        }
+
+        FormatSpec spec = parseSpec(pct);
+        s = spec.end;
+
+        // Rebuild the spec with the star values filled in
+        char specBuf[32];
+        size_t specLen = 0;
+        bool ok = true;
+        for (const char *c = pct; ok && c < spec.end && specLen < sizeof(specBuf) - 12; c++) {
+            int star;
+            if (*c != '*')
+                specBuf[specLen++] = *c;
+            else if ((ok = getArg(r, argPos, &star)))
+                specLen += snprintf(specBuf + specLen, sizeof(specBuf) - specLen, "%d", star);
+        }
+        specBuf[specLen] = '\0';
+
+        char out[LOG_RECORD_ARGS_LEN + 32];
+        int outLen = -1;
+        if (ok) {
+            switch (spec.conversion) {
+            case 'd':
+            case 'i':
+            case 'c':
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                if (spec.length == 'l') {
+                    long v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                } else if (spec.length == 'L' || spec.length == 'j') {
+                    long long v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                } else if (spec.length == 'z') {
+                    size_t v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                } else if (spec.length == 't') {
+                    ptrdiff_t v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                } else {
+                    int v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                }
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                if (spec.length == 'L') {
+                    long double v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                } else {
+                    double v;
+                    if (getArg(r, argPos, &v))
+                        outLen = snprintf(out, sizeof(out), specBuf, v);
+                }
+                break;
+            case 'p': {
+                void *v;
+                if (getArg(r, argPos, &v))
+                    outLen = snprintf(out, sizeof(out), specBuf, v);
+                break;
+            }
+            case 's':
+                if (argPos < r.argsLen) {
+                    const char *str = (const char *)r.args + argPos;
+                    argPos += strlen(str) + 1;
+                    outLen = snprintf(out, sizeof(out), specBuf, str);
+                }
+                break;
+            }
+        }
+
+        if (outLen < 0) {
+            // We didn't have this argument, so we can't print anything after it either
+            print(r.argsTruncated ? "...[truncated]" : "...[bad format]");
+            if (isContinuationMessage)
+                break;
+            write('\n');
+            break;
+        }
+        Print::write((const uint8_t *)out, (size_t)outLen < sizeof(out) ? outLen : sizeof(out) - 1); // snprintf truncated it
+    }
+}
+
+bool RedirectablePrint::drainLog(size_t maxRecords)
+{
+    for (size_t n = 0; n < maxRecords; n++) {
+        // Only report drops between lines, so we don't split someone's message
+        if (!isContinuationMessage) {
+            uint32_t dropped = numDropped.exchange(0);
+            if (dropped && lineSink) {
+                char msg[40];
+                snprintf(msg, sizeof(msg), "(%u log messages dropped)", (unsigned)dropped);
+                lineSink->writeLogLine(getLogTime(), NULL, msg);
+            } else if (dropped)
+                printf("(%u log messages dropped)\n", (unsigned)dropped);
+        }
+
+        DeferredLog &r = ring[dequeuePos & (LOG_RING_SIZE - 1)];
+        if (r.seq.load(std::memory_order_acquire) != dequeuePos + 1)
+            return false; // Empty (or the next producer hasn't finished filling its slot)
+
+        if (lineSink)
+            sinkRecord(r);
+        else
+            printRecord(r);
+        r.seq.store(dequeuePos + LOG_RING_SIZE, std::memory_order_release); // Free the slot for the next lap
+        dequeuePos++;
+    }
+
+    return ring[dequeuePos & (LOG_RING_SIZE - 1)].seq.load(std::memory_order_acquire) == dequeuePos + 1;
+}
+
+int32_t RedirectablePrint::runDrain()
+{
+    if (drainLog(LOG_DRAIN_MAX_RECORDS))
+        return 0; // Let the other threads run, then come back for more
+
+    // Tell producers to wake us, then check again in case one published just before it saw the flag
+    drainIdle = true;
+    if (drainLog(LOG_DRAIN_MAX_RECORDS)) {
+        drainIdle = false;
+        return 0;
+    }
+
+    return INT32_MAX; // Wait a long time - until a new message wakes us
+}
@@ -1,8 +1,65 @@
 #pragma once
 
+#include "mesh/MeshProfile.h"
 #include <Print.h>
+#include <atomic>
 #include <stdarg.h>
 
+namespace concurrency
+{
+class OSThread;
+}
+
+/// How many log messages we can hold while waiting for them to be printed (must be a power of 2)
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 32
+#endif
+
+/// Bytes in our buffer for formatting a log line, longer lines are truncated
+#ifndef LOG_PRINT_BUF_SIZE
+#define LOG_PRINT_BUF_SIZE (meshProfile.logLine)
+#endif
+
+/// Bytes of raw printf arguments we keep per log message, strings that don't fit are truncated
+#ifndef LOG_RECORD_ARGS_LEN
+#define LOG_RECORD_ARGS_LEN 80
+#endif
+
+/// Bytes we keep of the name of the thread which logged a message (including the NUL), longer names are truncated
+#define LOG_THREAD_NAME_LEN 16
+
+/// Max log messages printed per run of our drain thread, so we don't hog the main loop
+#define LOG_DRAIN_MAX_RECORDS 8
+
+/**
+ * A log message which hasn't been formatted yet: the format string pointer plus copies of the arguments it consumes.
+ */
+struct DeferredLog {
+    std::atomic<size_t> seq;              // For the lock free ring, see RedirectablePrint::logDeferred
+    const char *format;                   // Must be a string literal (which DEBUG_MSG formats always are)
+    char threadName[LOG_THREAD_NAME_LEN]; // A copy (the thread might be gone by the time we print), empty if none
+    uint32_t timeSec;                     // The time of day when we were logged
+    uint8_t argsLen;
+    bool argsTruncated; // We ran out of room for some arguments, only print the format up to the first missing one
+    uint8_t args[LOG_RECORD_ARGS_LEN];
+};
+
+/// The longest log line a LogLineSink gets, longer lines are truncated (the API's LogRecord.message holds 63 chars)
+#define LOG_LINE_MAX 64
+
+/**
+ * Receives whole log lines rather than bytes, i.e. to wrap each one in its own API frame
+ */
+class LogLineSink
+{
+  public:
+    /**
+     * @param source the thread which logged it (might be null)
+     * @return false if the line had to be dropped
+     */
+    virtual bool writeLogLine(uint32_t timeSec, const char *source, const char *line) = 0;
+};
+
 /**
  * A Printable that can be switched to squirt its bytes to a different sink.
  * This class is mostly useful to allow debug printing to be redirected away from Serial
@@ -12,21 +69,55 @@ class RedirectablePrint : public Print
 {
     Print *dest;
 
-    /// We dynamically grow this scratch buffer if necessary
-    char *printBuf = new char[64];
-    size_t printBufLen = 64;
+    /// Where vprintf formats each line (a fixed size, so logging never allocates)
+    char printBuf[LOG_PRINT_BUF_SIZE];
 
     /// Used to allow multiple logDebug messages to appear on a single log line
     bool isContinuationMessage = false;
 
+    /// Once set logDebug only records messages, our drain thread does the (slow) formatting and printing later
+    bool deferred = false;
+
+    /**
+     * A bounded multi-producer ring (any task or ISR can log) with our drain thread as the only consumer.  Each slot's seq
+     * says whose turn it is: a producer claims slot pos when seq == pos, publishes it by setting pos + 1, and the consumer
+     * hands it back for the next lap with pos + LOG_RING_SIZE.
+     */
+    DeferredLog ring[LOG_RING_SIZE];
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos = 0;
+
+    /// Messages we threw away because the ring was full
+    std::atomic<uint32_t> numDropped;
+
+    /// Set by our drain thread when it has gone to sleep, the next producer needs to wake it
+    std::atomic<bool> drainIdle;
+
+    concurrency::OSThread *drainThread = NULL;
+
+    /// If set, deferred messages go here one line at a time instead of to dest
+    LogLineSink *lineSink = NULL;
+
+    /// The line we are building for lineSink (messages without a newline continue it)
+    char line[LOG_LINE_MAX];
+    size_t lineLen = 0;
+    uint32_t lineTimeSec = 0;
+    char lineSource[LOG_THREAD_NAME_LEN] = ""; // Copied, the record it came from might be reused before the line ends
+
+    /// Set while printRecord() is writing to line rather than dest
+    bool capturing = false;
+
   public:
-    RedirectablePrint(Print *_dest) : dest(_dest) {}
+    RedirectablePrint(Print *_dest);
 
     /**
      * Set a new destination
      */
     void setDestination(Print *dest);
 
+    /// Send deferred messages to sink a line at a time (or NULL to print them to our destination again)
+    void setLineSink(LogLineSink *sink) { lineSink = sink; }
+
     virtual size_t write(uint8_t c);
 
     /**
@@ -43,6 +134,42 @@ class RedirectablePrint : public Print
 
     /** like printf but va_list based */
     size_t vprintf(const char *format, va_list arg);
+
+    /**
+     * Switch logDebug to deferred mode, where callers only pay for copying their arguments into our ring.  Call once the
+     * scheduler is running (at the end of setup()), until then messages are printed immediately.
+     */
+    void startDeferredLogging();
+
+    /**
+     * Print up to maxRecords pending log messages
+     *
+     * @return true if more messages are still waiting
+     */
+    bool drainLog(size_t maxRecords = LOG_RING_SIZE);
+
+    /// Called by our drain thread, @return how long it should sleep
+    int32_t runDrain();
+
+    /// Print all pending log messages, i.e. before we go to sleep
+    void flushLog()
+    {
+        while (drainLog())
+            ;
+    }
+
+  private:
+    /// Print our header for the start of a log line
+    size_t printHeader(uint32_t timeSec, const char *threadName);
+
+    /// Record a message in our ring for later printing
+    void logDeferred(const char *format, va_list arg);
+
+    /// Format and print a message recorded by logDeferred
+    void printRecord(const DeferredLog &r);
+
+    /// Format a message recorded by logDeferred into our line, and hand the line to lineSink once it is complete
+    void sinkRecord(const DeferredLog &r);
 };
 
 class NoopPrint : public Print
@@ -2,10 +2,68 @@
 #include <Arduino.h>
 #include <assert.h>
 
-concurrency::Lock *spiLock;
+SPIBusLock *spiLock;
 
 void initSPI()
 {
     assert(!spiLock);
-    spiLock = new concurrency::Lock();
-}
\ No newline at end of file
+    spiLock = new SPIBusLock();
+}
+
+SPIBusLock::SPIBusLock() : radioWaiting(0)
+{
+    memset(stats, 0, sizeof(stats));
+}
+
+void SPIBusLock::lock(SPIClient client)
+{
+    uint32_t start = micros();
+
+    if (client == SPI_CLIENT_RADIO) {
+        radioWaiting.fetch_add(1);
+        lock_.lock();
+        radioWaiting.fetch_sub(1);
+    } else {
+        while (true) {
+            while (radioWaiting.load())
+                delay(1); // The radio only holds the bus for a few register accesses
+
+            lock_.lock();
+            if (!radioWaiting.load())
+                break;
+            lock_.unlock(); // The radio got in line while we were waiting, it goes first
+        }
+    }
+
+    uint32_t now = micros(), waited = now - start;
+    SPIBusStats &s = stats[client];
+    s.numLocks++;
+    s.totalWaitUsec += waited;
+    if (waited > s.maxWaitUsec)
+        s.maxWaitUsec = waited;
+
+    holder = client;
+    holdStartUsec = now;
+}
+
+void SPIBusLock::unlock()
+{
+    uint32_t held = micros() - holdStartUsec;
+    SPIBusStats &s = stats[holder];
+    s.totalHoldUsec += held;
+    if (held > s.maxHoldUsec)
+        s.maxHoldUsec = held;
+
+    lock_.unlock();
+}
+
+bool SPIBusLock::yieldToRadio()
+{
+    if (!radioWaiting.load())
+        return false;
+
+    SPIClient client = holder;
+    unlock();
+    lock(client);
+    return true;
+}
@@ -1,12 +1,71 @@
 #pragma once
 
 #include "../concurrency/LockGuard.h"
+#include <atomic>
+
+/// Who is using the SPI bus, the radio always gets it before anyone else who is waiting
+enum SPIClient { SPI_CLIENT_RADIO, SPI_CLIENT_HOST, SPI_NUM_CLIENTS };
+
+/// How long each client has waited for, and held, the SPI bus
+struct SPIBusStats {
+    uint32_t numLocks;
+    uint32_t maxWaitUsec, maxHoldUsec;
+    uint64_t totalWaitUsec, totalHoldUsec;
+};
 
 /**
- * Used to provide mutual exclusion for access to the SPI bus.  Usage:
- * concurrency::LockGuard g(spiLock);
+ * Provides mutual exclusion for access to the SPI bus, with priority for the radio (so a slow display update can't make us
+ * miss its FIFO or interrupt).  Usage:
+ *   SPIBusGuard g(spiLock, SPI_CLIENT_HOST);
+ *
+ * Other clients wait while the radio is waiting, so it always gets the bus next.  Anything which holds the bus for long (i.e.
+ * drawing a whole display) must split its work into chunks and call yieldToRadio() between them.
  */
-extern concurrency::Lock *spiLock;
+class SPIBusLock
+{
+    concurrency::Lock lock_;
+
+    /// How many radio callers are waiting for the bus (they can be in other tasks)
+    std::atomic<uint8_t> radioWaiting;
+
+    /// Who has the bus, and micros() when they got it
+    SPIClient holder = SPI_CLIENT_HOST;
+    uint32_t holdStartUsec = 0;
+
+    SPIBusStats stats[SPI_NUM_CLIENTS];
+
+  public:
+    SPIBusLock();
+
+    /// Wait for the bus, must not be called from an ISR
+    void lock(SPIClient client);
+
+    void unlock();
+
+    /**
+     * Call between chunks of a long transfer, if the radio is waiting let it have the bus before we carry on
+     *
+     * @return true if we gave the bus up (so anything which assumes it wasn't touched, i.e. a chip select, must be redone)
+     */
+    bool yieldToRadio();
+
+    const SPIBusStats &getStats(SPIClient client) const { return stats[client]; }
+};
+
+/// RAII guard for SPIBusLock
+class SPIBusGuard
+{
+    SPIBusLock *bus;
+
+  public:
+    SPIBusGuard(SPIBusLock *_bus, SPIClient client) : bus(_bus) { bus->lock(client); }
+    ~SPIBusGuard() { bus->unlock(); }
+
+    SPIBusGuard(const SPIBusGuard &) = delete;
+    SPIBusGuard &operator=(const SPIBusGuard &) = delete;
+};
+
+extern SPIBusLock *spiLock;
 
 /** Setup SPI access and create the spiLock lock. */
-void initSPI();
\ No newline at end of file
+void initSPI();
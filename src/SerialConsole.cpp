@@ -4,7 +4,15 @@
 #include "NodeDB.h"
 #include <Arduino.h>
 
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32/ESP32UartStream.h"
+
+// Skip HardwareSerial, so frames arrive in chunks rather than an interrupt per byte
+static ESP32UartStream uart0(UART_NUM_0);
+#define Port uart0
+#else
 #define Port Serial
+#endif
 
 SerialConsole console;
 
@@ -22,20 +30,46 @@ void SerialConsole::init()
     emitRebooted();
 }
 
+void SerialConsole::flush()
+{
+    Port.flush();
+}
+
 /**
  * we override this to notice when we've received a protobuf over the serial
  * stream.  Then we shunt off debug serial output.
  */
 void SerialConsole::handleToRadio(const uint8_t *buf, size_t len)
 {
-    // Turn off debug serial printing once the API is activated, because other threads could print and corrupt packets
-    if(!radioConfig.preferences.debug_log_enabled)
-        setDestination(&noopPrint);
+    // Turn off raw debug serial printing once the API is activated, because other threads could print and corrupt packets.  If
+    // the client wants our log we frame each line instead (our log drain runs on the main loop, like us, except on portduino).
+    setDestination(&noopPrint);
+#ifndef PORTDUINO
+    if (radioConfig.preferences.debug_log_enabled)
+        setLineSink(this);
+#endif
     canWrite = true;
 
     StreamAPI::handleToRadio(buf, len);
 }
 
+bool SerialConsole::writeLogLine(uint32_t timeSec, const char *source, const char *line)
+{
+    uint32_t now = millis(), elapsed = now - logTokensMsec;
+    if (elapsed >= 1000 / SERIAL_LOG_LINES_PER_SEC) {
+        elapsed = min(elapsed, (uint32_t)1000); // A full bucket, and no overflow after a long quiet spell
+        logTokens = min(logTokens + elapsed * SERIAL_LOG_LINES_PER_SEC / 1000, (uint32_t)SERIAL_LOG_LINES_PER_SEC);
+        logTokensMsec = now;
+    }
+
+    if (!logTokens || !emitLogRecord(timeSec == UINT32_MAX ? 0 : timeSec, source, line)) {
+        numLogLinesDropped++;
+        return false;
+    }
+    logTokens--;
+    return true;
+}
+
 /// Hookable to find out when connection changes
 void SerialConsole::onConnectionChanged(bool connected)
 {
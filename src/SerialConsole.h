@@ -2,12 +2,23 @@
 
 #include "RedirectablePrint.h"
 #include "StreamAPI.h"
+/// Once the API is active, the most log lines a second we send as FromRadio.log_record (the rest are dropped)
+#ifndef SERIAL_LOG_LINES_PER_SEC
+#define SERIAL_LOG_LINES_PER_SEC 20
+#endif
+
 /**
- * Provides both debug printing and, if the client starts sending protobufs to us, switches to send/receive protobufs
- * (and starts dropping debug printing - FIXME, eventually those prints should be encapsulated in protobufs).
+ * Provides both debug printing and, if the client starts sending protobufs to us, switches to send/receive protobufs.  From
+ * then on (if debug_log_enabled) each log line is sent as its own FromRadio.log_record, so it can't corrupt the framing.  Log
+ * lines are rate limited, and dropped first when the port is backed up.
  */
-class SerialConsole : public StreamAPI, public RedirectablePrint
+class SerialConsole : public StreamAPI, public RedirectablePrint, private LogLineSink
 {
+    /// For our rate limit, a token bucket refilled at SERIAL_LOG_LINES_PER_SEC
+    uint32_t logTokens = SERIAL_LOG_LINES_PER_SEC, logTokensMsec = 0;
+
+    uint32_t numLogLinesDropped = 0;
+
   public:
     SerialConsole();
 
@@ -20,6 +31,9 @@ class SerialConsole : public StreamAPI, public RedirectablePrint
      */
     virtual void handleToRadio(const uint8_t *buf, size_t len);
 
+    /// Wait until everything we've written has gone out the port
+    virtual void flush();
+
     virtual size_t write(uint8_t c)
     {
         if (c == '\n') // prefix any newlines with carriage return
@@ -27,9 +41,15 @@ class SerialConsole : public StreamAPI, public RedirectablePrint
         return RedirectablePrint::write(c);
     }
 
+    /// Log lines we didn't send because of our rate limit or a backed up port
+    uint32_t getNumLogLinesDropped() const { return numLogLinesDropped; }
+
   protected:
     /// Hookable to find out when connection changes
     virtual void onConnectionChanged(bool connected);
+
+  private:
+    virtual bool writeLogLine(uint32_t timeSec, const char *source, const char *line);
 };
 
 extern SerialConsole console;
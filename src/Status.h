@@ -7,6 +7,7 @@
 #define STATUS_TYPE_POWER 1
 #define STATUS_TYPE_GPS 2
 #define STATUS_TYPE_NODE 3
+#define STATUS_TYPE_COUNT 4
 
 
 namespace meshtastic
@@ -15,6 +16,12 @@ namespace meshtastic
     // A base class for observable status
     class Status
     {
+        friend class StatusHandler;
+
+        // When we last told our observers about a change, and whether StatusHandler is holding a newer one back
+        uint32_t lastPublishMsec = 0;
+        bool publishPending = false;
+
        protected:
         // Allows us to observe an Observable
         CallbackObserver<Status, const Status *> statusObserver = CallbackObserver<Status, const Status *>(this, &Status::updateStatus);
@@ -68,5 +75,9 @@ namespace meshtastic
             return 0;
         }
 
+       protected:
+        // Tell our observers we changed.  StatusHandler rate limits this, unless the change is significant (see StatusHandler)
+        void publish(bool significant);
+
     };
 };
@@ -0,0 +1,92 @@
+#include "StatusHandler.h"
+#include "configuration.h"
+#include <assert.h>
+
+namespace meshtastic
+{
+
+void Status::publish(bool significant)
+{
+    StatusHandler::publish(this, significant);
+}
+
+StatusHandler::StatusHandler() : concurrency::OSThread("StatusHandler")
+{
+    setEnabled(false); // Until something is waiting
+}
+
+StatusHandler *StatusHandler::get()
+{
+    static StatusHandler *handler;
+    if (!handler)
+        handler = new StatusHandler();
+    return handler;
+}
+
+uint32_t StatusHandler::getNumCoalesced()
+{
+    return get()->numCoalesced;
+}
+
+void StatusHandler::publish(Status *status, bool significant)
+{
+    StatusHandler *h = get();
+    int type = status->getStatusType();
+    assert(type >= 0 && type < STATUS_TYPE_COUNT);
+
+    if (significant || millis() - status->lastPublishMsec >= STATUS_MIN_PUBLISH_MSEC) {
+        if (status->publishPending)
+            h->numCoalesced++; // This one covers the change we held back
+        h->publishNow(status);
+        return;
+    }
+
+    if (status->publishPending) {
+        h->numCoalesced++; // Observers will only see the latest
+        return;
+    }
+
+    status->publishPending = true;
+    h->pending[type] = status;
+
+    int32_t wait = status->lastPublishMsec + STATUS_MIN_PUBLISH_MSEC - millis();
+    if (!h->enabled || wait < (int32_t)(h->getNextRunTime() - millis())) {
+        h->setEnabled(true);
+        h->setIntervalFromNow(wait);
+    }
+}
+
+void StatusHandler::publishNow(Status *status)
+{
+    status->publishPending = false;
+    status->lastPublishMsec = millis();
+    pending[status->getStatusType()] = NULL;
+
+    status->onNewStatus.notifyObservers(status);
+}
+
+int32_t StatusHandler::runOnce()
+{
+    uint32_t now = millis();
+    uint32_t nextWait = UINT32_MAX;
+
+    for (int type = 0; type < STATUS_TYPE_COUNT; type++) {
+        Status *status = pending[type];
+        if (!status)
+            continue;
+
+        uint32_t sincePublish = now - status->lastPublishMsec;
+        if (sincePublish >= STATUS_MIN_PUBLISH_MSEC)
+            publishNow(status);
+        else if (STATUS_MIN_PUBLISH_MSEC - sincePublish < nextWait)
+            nextWait = STATUS_MIN_PUBLISH_MSEC - sincePublish;
+    }
+
+    if (nextWait == UINT32_MAX) {
+        setEnabled(false);
+        return RUN_SAME;
+    }
+    return nextWait;
+}
+
+} // namespace meshtastic
@@ -0,0 +1,50 @@
+#pragma once
+#include "Status.h"
+#include "concurrency/OSThread.h"
+
+/// The most often observers hear about any one status (significant changes go out at once regardless)
+#ifndef STATUS_MIN_PUBLISH_MSEC
+#define STATUS_MIN_PUBLISH_MSEC 500
+#endif
+
+namespace meshtastic
+{
+
+/**
+ * Coalesces status updates on their way to observers (i.e. the screen, which redraws for each).
+ *
+ * Our statuses are updated far more often than anyone needs to hear about it: NodeDB reports its node counts for nearly every
+ * packet, and GPS positions creep with every fix.  So a status which published less than STATUS_MIN_PUBLISH_MSEC ago holds
+ * its change back, and we publish it once that time is up.  The status object always has the latest value, so however many
+ * changes arrive meanwhile observers get one notification, of where things ended up.
+ *
+ * Significant changes (losing a GPS fix, the battery going critical, a new node) are published at once, and reset the wait.
+ */
+class StatusHandler : private concurrency::OSThread
+{
+    /// Statuses holding a change back, by status type
+    Status *pending[STATUS_TYPE_COUNT] = {};
+
+    /// Changes we folded into a later publish
+    uint32_t numCoalesced = 0;
+
+  public:
+    /// Publish a status's change now, or once its wait is up
+    static void publish(Status *status, bool significant);
+
+    /// How many changes observers never saw on their own (because a later one replaced them)
+    static uint32_t getNumCoalesced();
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    StatusHandler();
+
+    /// Created the first time a status publishes, so we aren't an OSThread built by a static constructor
+    static StatusHandler *get();
+
+    void publishNow(Status *status);
+};
+
+} // namespace meshtastic
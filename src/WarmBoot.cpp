@@ -0,0 +1,96 @@
+#include "WarmBoot.h"
+#include "NodeDB.h"
+#include "configuration.h"
+#include "main.h"
+#include "sleep.h"
+#include <sys/time.h>
+
+WarmBoot warmBoot;
+
+#ifndef NO_ESP32
+RTC_DATA_ATTR WarmBoot::Record WarmBoot::record;
+#endif
+
+void WarmBoot::begin()
+{
+#ifndef NO_ESP32
+    Record &r = record;
+    if (wakeCause == ESP_SLEEP_WAKEUP_UNDEFINED || r.magic != WARMBOOT_MAGIC || r.crc != crc(r) ||
+        r.numPackets > WARMBOOT_MAX_PACKETS) {
+        r.magic = 0;
+        return;
+    }
+
+    r.magic = 0; // Each record is only good for one wake, if we crash and reset we cold boot
+    warm = true;
+    LOG_INFO(POWER, "Warm boot, slept %u secs\n", (uint32_t)((clockMsec() - r.sleptAtMsec) / 1000));
+#endif
+}
+
+bool WarmBoot::restoreI2C()
+{
+#ifndef NO_ESP32
+    if (warm) {
+        screen_found = record.screenFound;
+        axp192_found = record.axp192Found;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void WarmBoot::resume()
+{
+#ifndef NO_ESP32
+    if (!warm)
+        return;
+
+    const Record &r = record;
+    if (!r.stateStamp || r.stateStamp != nodeDB.getSavedStateHash() || r.myNodeNum != nodeDB.getNodeNum()) {
+        LOG_INFO(POWER, "Our settings changed while we slept, not resuming our mesh state\n");
+        return;
+    }
+
+    setPacketIdCounter(r.packetIdCounter);
+
+    uint64_t slept = clockMsec() - r.sleptAtMsec;
+    uint32_t sleptMsec = slept > UINT32_MAX ? UINT32_MAX : slept;
+    for (uint16_t i = 0; i < r.numPackets; i++)
+        router->restoreHistory(r.packets[i], sleptMsec);
+    LOG_DEBUG(POWER, "Resumed with %u packet records\n", r.numPackets);
+#endif
+}
+
+void WarmBoot::save()
+{
+#ifndef NO_ESP32
+    Record &r = record;
+    r.sleptAtMsec = clockMsec();
+    r.stateStamp = nodeDB.getSavedStateHash();
+    r.screenFound = screen_found;
+    r.axp192Found = axp192_found;
+    r.myNodeNum = nodeDB.getNodeNum();
+    r.packetIdCounter = getPacketIdCounter();
+    r.numPackets = router ? router->saveHistory(r.packets, WARMBOOT_MAX_PACKETS) : 0;
+    r.crc = crc(r);
+    r.magic = WARMBOOT_MAGIC;
+#endif
+}
+
+uint32_t WarmBoot::crc(const Record &r)
+{
+    // FNV-1a, like NodeDB::hashDeviceState()
+    uint32_t hash = 2166136261u;
+    const uint8_t *p = (const uint8_t *)&r.sleptAtMsec;
+    const uint8_t *end = (const uint8_t *)&r.packets[r.numPackets < WARMBOOT_MAX_PACKETS ? r.numPackets : WARMBOOT_MAX_PACKETS];
+    for (; p < end; p++)
+        hash = (hash ^ *p) * 16777619u;
+    return hash;
+}
+
+uint64_t WarmBoot::clockMsec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
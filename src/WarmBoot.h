@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Router.h"
+
+/// The most of our router's recent packet records we keep across a deep sleep
+#ifndef WARMBOOT_MAX_PACKETS
+#define WARMBOOT_MAX_PACKETS 64
+#endif
+
+#define WARMBOOT_MAGIC 0x57524d01 // "WRM" and our format version
+
+/**
+ * Keeps some of our runtime state across deep sleep, so waking from it isn't a full cold boot.
+ *
+ * Just before we deep sleep, save() fills a record in memory which survives it (the ESP32's RTC slow memory) with: what our
+ * I2C scan found, our node number and packet id counter, a stamp of the device state NodeDB had just saved to flash, and
+ * the most recent records of our router's duplicate history (with how old each was).
+ *
+ * When we wake, begin() checks the record is intact (and that we really woke from deep sleep), so setup() can skip the I2C
+ * scan.  Once NodeDB has loaded our settings, resume() compares its stamp: if flash still holds what we saved, we carry on
+ * with the same packet ids and put the history records which haven't expired (allowing for how long we slept) back into our
+ * router, before our radio starts receiving.  So we don't reuse packet ids, and floods we had already handled before we
+ * slept are still suppressed as duplicates.
+ *
+ * Retransmissions pending when we slept aren't kept, they would all have timed out by the time we woke.  Other platforms
+ * always cold boot.
+ */
+class WarmBoot
+{
+    struct Record {
+        uint32_t magic; // WARMBOOT_MAGIC
+        uint32_t crc;   // Of everything after it
+
+        uint64_t sleptAtMsec; // Our clock (which keeps running in deep sleep) when we saved this
+        uint32_t stateStamp;  // NodeDB's hash of the device state it had saved to flash (0 if it hadn't)
+
+        uint8_t screenFound;
+        bool axp192Found;
+
+        NodeNum myNodeNum;
+        uint32_t packetIdCounter;
+
+        uint16_t numPackets;
+        SavedPacketRecord packets[WARMBOOT_MAX_PACKETS];
+    };
+
+    /// In the ESP32's RTC slow memory (on a cold boot it starts zeroed, so its magic won't match)
+    static Record record;
+
+    bool warm = false;
+
+  public:
+    /// Check whether we woke from deep sleep with a valid record, call this early in setup()
+    void begin();
+
+    /// Did begin() find a valid record
+    bool isWarm() const { return warm; }
+
+    /// Restore what our I2C scan found before we slept, instead of scanning again @return false if we must scan
+    bool restoreI2C();
+
+    /// Restore our mesh state, once NodeDB has loaded our settings (and before our radio starts receiving)
+    void resume();
+
+    /// Save our state, call this just before we deep sleep
+    void save();
+
+  private:
+    static uint32_t crc(const Record &r);
+
+    /// Our clock in msecs, which keeps counting through deep sleep
+    static uint64_t clockMsec();
+};
+
+extern WarmBoot warmBoot;
@@ -1,4 +1,5 @@
 #include "airtime.h"
+#include "concurrency/Periodic.h"
 #include <Arduino.h>
 
 #define periodsToLog 48
@@ -8,68 +9,207 @@
 //   This can be changed to a smaller number to speed up testing.
 //
 uint32_t secondsPerPeriod = 3600;
-uint32_t lastMillis = 0;
-uint32_t secSinceBoot = 0;
+
+// millis() wraps every 49 days, our period thread counts the wraps (it runs far more often than that)
+static uint32_t lastMillis = 0;
+static uint32_t millisWraps = 0;
+
+// Channel utilization is kept in buckets of this many msecs, enough of them to cover our longest window
+#define UTIL_BUCKET_MSEC 10000
+#define UTIL_BUCKETS 60
+#define UTIL_1_MINUTE_BUCKETS 6
 
 // Don't read out of this directly. Use the helper functions.
 struct airtimeStruct {
-    uint16_t periodTX[periodsToLog];
-    uint16_t periodRX[periodsToLog];
-    uint16_t periodRX_ALL[periodsToLog];
+    // msecs of airtime for each period, indexed by currentPeriodIndex() (so we never need to shift them)
+    uint32_t periodTX[periodsToLog];
+    uint32_t periodRX[periodsToLog];
+    uint32_t periodRX_ALL[periodsToLog];
     uint8_t lastPeriodIndex;
+
+    uint64_t totalTX, totalRX, totalRX_ALL;
+
+    // msecs the channel was in use for each UTIL_BUCKET_MSEC, indexed by epoch % UTIL_BUCKETS
+    uint32_t utilBuckets[UTIL_BUCKETS];
+    uint32_t utilEpoch;
+
+    // Sums of the buckets in each window (other than the current one, which is still filling)
+    uint32_t util1MinSum, util10MinSum;
+
+    // Just our own transmissions, in the same buckets, for txDutyPercent()
+    uint32_t txBuckets[UTIL_BUCKETS];
+    uint32_t tx10MinSum;
 } airtimes;
 
+/// Move to the current utilization bucket, retiring any which have aged out of our windows
+static void advanceUtilization()
+{
+    uint32_t now = millis() / UTIL_BUCKET_MSEC;
+    uint32_t elapsed = now - airtimes.utilEpoch;
+
+    if (elapsed >= UTIL_BUCKETS) {
+        // It has been a long time, so nothing we have is in either window
+        memset(airtimes.utilBuckets, 0, sizeof(airtimes.utilBuckets));
+        memset(airtimes.txBuckets, 0, sizeof(airtimes.txBuckets));
+        airtimes.util1MinSum = airtimes.util10MinSum = airtimes.tx10MinSum = 0;
+        airtimes.utilEpoch = now;
+        return;
+    }
+
+    for (; airtimes.utilEpoch != now; airtimes.utilEpoch++) {
+        uint32_t e = airtimes.utilEpoch;
+
+        // The bucket we are leaving joins both windows, the oldest buckets leave them
+        airtimes.util1MinSum += airtimes.utilBuckets[e % UTIL_BUCKETS];
+        airtimes.util10MinSum += airtimes.utilBuckets[e % UTIL_BUCKETS];
+        airtimes.util1MinSum -= airtimes.utilBuckets[(e + 1 - UTIL_1_MINUTE_BUCKETS + UTIL_BUCKETS) % UTIL_BUCKETS];
+
+        uint32_t &next = airtimes.utilBuckets[(e + 1) % UTIL_BUCKETS];
+        airtimes.util10MinSum -= next;
+        next = 0;
+
+        airtimes.tx10MinSum += airtimes.txBuckets[e % UTIL_BUCKETS];
+        uint32_t &nextTx = airtimes.txBuckets[(e + 1) % UTIL_BUCKETS];
+        airtimes.tx10MinSum -= nextTx;
+        nextTx = 0;
+    }
+}
+
+static void logUtilization(uint32_t ms)
+{
+    advanceUtilization();
+    airtimes.utilBuckets[airtimes.utilEpoch % UTIL_BUCKETS] += ms;
+}
+
+/// If we have moved into a new period, clear it (and any we skipped over) for reuse, they hold data from periodsToLog ago
+static void startNewPeriods()
+{
+    uint8_t current = currentPeriodIndex();
+    while (airtimes.lastPeriodIndex != current) {
+        uint8_t i = (airtimes.lastPeriodIndex + 1) % periodsToLog;
+        airtimes.periodTX[i] = 0;
+        airtimes.periodRX[i] = 0;
+        airtimes.periodRX_ALL[i] = 0;
+        airtimes.lastPeriodIndex = i;
+    }
+}
+
 void logAirtime(reportTypes reportType, uint32_t airtime_ms)
 {
+    startNewPeriods(); // In case our period thread hasn't run yet
+    uint8_t i = currentPeriodIndex();
 
     if (reportType == TX_LOG) {
-        airtimes.periodTX[0] = airtimes.periodTX[0] + round(airtime_ms / 1000);
+        airtimes.periodTX[i] += airtime_ms;
+        airtimes.totalTX += airtime_ms;
+        logUtilization(airtime_ms);
+        airtimes.txBuckets[airtimes.utilEpoch % UTIL_BUCKETS] += airtime_ms;
     } else if (reportType == RX_LOG) {
-        airtimes.periodRX[0] = airtimes.periodRX[0] + round(airtime_ms / 1000);
+        airtimes.periodRX[i] += airtime_ms;
+        airtimes.totalRX += airtime_ms;
     } else if (reportType == RX_ALL_LOG) {
-        airtimes.periodRX_ALL[0] = airtimes.periodRX_ALL[0] + round(airtime_ms / 1000);
+        airtimes.periodRX_ALL[i] += airtime_ms;
+        airtimes.totalRX_ALL += airtime_ms;
+        logUtilization(airtime_ms);
     } else {
         // Unknown report type
     }
 }
 
+void logChannelBusy(uint32_t busy_ms)
+{
+    logUtilization(busy_ms);
+}
+
+/// busy msecs as a percentage of the given window, which includes the part of the current bucket that has already elapsed
+static float windowPercent(utilizationWindows window, uint32_t busy)
+{
+    uint32_t windowMsec = (window == UTIL_1_MINUTE ? UTIL_1_MINUTE_BUCKETS - 1 : UTIL_BUCKETS - 1) * UTIL_BUCKET_MSEC +
+                          millis() % UTIL_BUCKET_MSEC;
+
+    // Right after boot our window is shorter than requested
+    if (windowMsec > millis())
+        windowMsec = millis();
+
+    if (windowMsec == 0)
+        return 0;
+
+    float percent = 100.0f * busy / windowMsec;
+    return percent > 100 ? 100 : percent;
+}
+
+float channelUtilizationPercent(utilizationWindows window)
+{
+    advanceUtilization();
+
+    // Include what was logged during the current bucket
+    uint32_t current = airtimes.utilBuckets[airtimes.utilEpoch % UTIL_BUCKETS];
+    return windowPercent(window, (window == UTIL_1_MINUTE ? airtimes.util1MinSum : airtimes.util10MinSum) + current);
+}
+
+float txDutyPercent()
+{
+    advanceUtilization();
+    return windowPercent(UTIL_10_MINUTES, airtimes.tx10MinSum + airtimes.txBuckets[airtimes.utilEpoch % UTIL_BUCKETS]);
+}
+
+uint64_t getAirtimeMsec(reportTypes reportType)
+{
+    if (reportType == TX_LOG) {
+        return airtimes.totalTX;
+    } else if (reportType == RX_LOG) {
+        return airtimes.totalRX;
+    } else if (reportType == RX_ALL_LOG) {
+        return airtimes.totalRX_ALL;
+    }
+    return 0;
+}
+
 uint8_t currentPeriodIndex()
 {
     return ((getSecondsSinceBoot() / secondsPerPeriod) % periodsToLog);
 }
 
-void airtimeCalculator()
+/// Runs at the start of each period (rather than polling from our main loop)
+static int32_t airtimePeriodCb()
 {
-    if (millis() - lastMillis > 1000) {
-        lastMillis = millis();
-        secSinceBoot++;
-        if (airtimes.lastPeriodIndex != currentPeriodIndex()) {
-            for (int i = periodsToLog - 2; i >= 0; --i) {
-                airtimes.periodTX[i + 1] = airtimes.periodTX[i];
-                airtimes.periodRX[i + 1] = airtimes.periodRX[i];
-                airtimes.periodRX_ALL[i + 1] = airtimes.periodRX_ALL[i];
-            }
-            airtimes.periodTX[0] = 0;
-            airtimes.periodRX[0] = 0;
-            airtimes.periodRX_ALL[0] = 0;
+    uint32_t now = millis();
+    if (now < lastMillis)
+        millisWraps++;
+    lastMillis = now;
 
-            airtimes.lastPeriodIndex = currentPeriodIndex();
-        }
-    }
+    startNewPeriods();
+
+    uint32_t msecPerPeriod = secondsPerPeriod * 1000;
+    uint64_t sinceBoot = ((uint64_t)millisWraps << 32) | now;
+    return msecPerPeriod - sinceBoot % msecPerPeriod + 1; // Just past the boundary, so currentPeriodIndex() has moved on
+}
+
+void airtimeInit()
+{
+    new concurrency::Periodic("Airtime", airtimePeriodCb); // Runs straight away, then at each period boundary
 }
 
 uint16_t *airtimeReport(reportTypes reportType)
 {
-    // currentHourIndexReset();
+    // Our report is in seconds, with the current period first
+    static uint16_t report[periodsToLog];
 
+    const uint32_t *periods;
     if (reportType == TX_LOG) {
-        return airtimes.periodTX;
+        periods = airtimes.periodTX;
     } else if (reportType == RX_LOG) {
-        return airtimes.periodRX;
+        periods = airtimes.periodRX;
     } else if (reportType == RX_ALL_LOG) {
-        return airtimes.periodRX_ALL;
-    }
-    return 0;
+        periods = airtimes.periodRX_ALL;
+    } else
+        return 0;
+
+    uint8_t current = currentPeriodIndex();
+    for (int i = 0; i < periodsToLog; i++)
+        report[i] = periods[(current + periodsToLog - i) % periodsToLog] / 1000;
+
+    return report;
 }
 
 uint8_t getPeriodsToLog()
@@ -84,5 +224,7 @@ uint32_t getSecondsPerPeriod()
 
 uint32_t getSecondsSinceBoot()
 {
-    return secSinceBoot;
+    uint32_t now = millis();
+    uint32_t wraps = millisWraps + (now < lastMillis ? 1 : 0); // Wrapped since our period thread last looked
+    return (((uint64_t)wraps << 32) | now) / 1000;
 }
@@ -2,7 +2,6 @@
 
 #include "configuration.h"
 #include <Arduino.h>
-#include <functional>
 
 /*
   TX_LOG      - Time on air this device has transmitted
@@ -24,9 +23,28 @@
 */
 enum reportTypes { TX_LOG, RX_LOG, RX_ALL_LOG };
 
+/*
+  Windows for channelUtilizationPercent(), which counts all the time the channel was in use: TX_LOG + RX_ALL_LOG plus any time
+  the radio was busy receiving something it could not decode (see logChannelBusy).
+*/
+enum utilizationWindows { UTIL_1_MINUTE, UTIL_10_MINUTES };
+
 void logAirtime(reportTypes reportType, uint32_t airtime_ms);
 
-void airtimeCalculator();
+/// Count time the radio was busy with a signal that never turned into a received packet (i.e. a preamble with a bad header)
+void logChannelBusy(uint32_t busy_ms);
+
+/// The percentage of the given window (ending now) that the channel was in use.  Cheap enough to call per packet.
+float channelUtilizationPercent(utilizationWindows window);
+
+/// The percentage of the last 10 minutes we spent transmitting
+float txDutyPercent();
+
+/// Total msecs of airtime since boot
+uint64_t getAirtimeMsec(reportTypes reportType);
+
+/// Start the thread which moves us into each new period, call once from setup()
+void airtimeInit();
 
 uint8_t currentPeriodIndex();
 uint8_t getPeriodsToLog();
@@ -12,4 +12,7 @@ enum class Cmd {
         STOP_BLUETOOTH_PIN_SCREEN,
         STOP_BOOT_SCREEN,
         PRINT,
+        BLINK,
+        ADJUST_BRIGHTNESS,
+        REFRESH_FRAMES,
 };
\ No newline at end of file
@@ -19,16 +19,35 @@ BinarySemaphorePosix::~BinarySemaphorePosix()
  */
 bool BinarySemaphorePosix::take(uint32_t msec)
 {
+#ifdef PORTDUINO
+    std::unique_lock<std::mutex> l(mutex);
+    if (msec == portMAX_DELAY)
+        cond.wait(l, [this] { return given; });
+    else if (!cond.wait_for(l, std::chrono::milliseconds(msec), [this] { return given; }))
+        return false;
+
+    given = false;
+    return true;
+#else
     delay(msec); // FIXME
     return false;
+#endif
 }
 
 void BinarySemaphorePosix::give()
 {
+#ifdef PORTDUINO
+    {
+        std::lock_guard<std::mutex> l(mutex);
+        given = true;
+    }
+    cond.notify_one();
+#endif
 }
 
 IRAM_ATTR void BinarySemaphorePosix::giveFromISR(BaseType_t *pxHigherPriorityTaskWoken)
 {
+    give(); // Our "ISRs" are ordinary threads, so they can take a mutex
 }
 
 } // namespace concurrency
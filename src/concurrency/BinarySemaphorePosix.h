@@ -3,6 +3,11 @@
 #include "configuration.h"
 #include "../freertosinc.h"
 
+#if !defined(HAS_FREE_RTOS) && defined(PORTDUINO)
+#include <condition_variable>
+#include <mutex>
+#endif
+
 namespace concurrency
 {
 
@@ -10,7 +15,12 @@ namespace concurrency
 
 class BinarySemaphorePosix
 {
-    // SemaphoreHandle_t semaphore;
+#ifdef PORTDUINO
+    // Portduino runs our GPIO interrupts (and the host task) on their own threads, so this needs to really block and wake
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool given = false;
+#endif
 
   public:
     BinarySemaphorePosix();
@@ -0,0 +1,153 @@
+#include "HwTimer.h"
+#include "configuration.h"
+
+#ifdef NRF52_SERIES
+#include <nrf.h>
+#endif
+
+namespace concurrency
+{
+
+/// The most HwTimers we can run at once
+#ifndef NO_ESP32
+#define HWTIMER_MAX 2 // ESP32 has four hardware timers, OSTimer uses the first
+#elif defined(NRF52_SERIES)
+#define HWTIMER_MAX 1 // TIMER2, the SoftDevice owns TIMER0
+#else
+#define HWTIMER_MAX 0
+#endif
+
+#if HWTIMER_MAX
+static HwTimer *timers[HWTIMER_MAX];
+#endif
+
+#ifndef NO_ESP32
+
+static hw_timer_t *hwTimers[HWTIMER_MAX];
+
+// timerAttachInterrupt() doesn't pass an argument, so each of our hardware timers needs its own ISR
+static void IRAM_ATTR onTimer0()
+{
+    timers[0]->fire();
+}
+
+static void IRAM_ATTR onTimer1()
+{
+    timers[1]->fire();
+}
+
+static void (*const isrs[HWTIMER_MAX])() = {onTimer0, onTimer1};
+
+bool HwTimer::begin()
+{
+    for (int i = 0; index < 0 && i < HWTIMER_MAX; i++)
+        if (!timers[i]) {
+            hwTimers[i] = timerBegin(i + 1, 80, true); // One tick per usec (the timers run from the 80MHz APB clock)
+            if (!hwTimers[i])
+                return false;
+            timers[i] = this;
+            index = i;
+            timerAttachInterrupt(hwTimers[i], isrs[i], true);
+        }
+    return index >= 0;
+}
+
+bool HwTimer::start(uint32_t usecs)
+{
+    if (index < 0)
+        return false;
+
+    hw_timer_t *t = hwTimers[index];
+    timerAlarmDisable(t);
+    pending = true;
+    timerWrite(t, 0);
+    timerAlarmWrite(t, usecs ? usecs : 1, false); // Single shot
+    timerAlarmEnable(t);
+    return true;
+}
+
+void HwTimer::stop()
+{
+    if (index >= 0)
+        timerAlarmDisable(hwTimers[index]);
+    pending = false;
+}
+
+#elif defined(NRF52_SERIES)
+
+extern "C" void TIMER2_IRQHandler(void)
+{
+    if (NRF_TIMER2->EVENTS_COMPARE[0]) {
+        NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+        if (timers[0])
+            timers[0]->fire();
+    }
+}
+
+bool HwTimer::begin()
+{
+    if (index >= 0 || timers[0])
+        return index >= 0;
+
+    NRF_TIMER2->TASKS_STOP = 1;
+    NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;
+    NRF_TIMER2->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER2->PRESCALER = 4; // 16MHz / 2^4, one tick per usec
+    NRF_TIMER2->SHORTS = TIMER_SHORTS_COMPARE0_STOP_Msk | TIMER_SHORTS_COMPARE0_CLEAR_Msk; // Single shot
+    NRF_TIMER2->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_SetPriority(TIMER2_IRQn, 6); // Below the priorities the SoftDevice reserves
+    NVIC_ClearPendingIRQ(TIMER2_IRQn);
+    NVIC_EnableIRQ(TIMER2_IRQn);
+
+    timers[0] = this;
+    index = 0;
+    return true;
+}
+
+bool HwTimer::start(uint32_t usecs)
+{
+    if (index < 0)
+        return false;
+
+    NRF_TIMER2->TASKS_STOP = 1;
+    NRF_TIMER2->TASKS_CLEAR = 1;
+    NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+    pending = true;
+    NRF_TIMER2->CC[0] = usecs ? usecs : 1;
+    NRF_TIMER2->TASKS_START = 1;
+    return true;
+}
+
+void HwTimer::stop()
+{
+    if (index >= 0)
+        NRF_TIMER2->TASKS_STOP = 1;
+    pending = false;
+}
+
+#else
+
+bool HwTimer::begin()
+{
+    return false;
+}
+
+bool HwTimer::start(uint32_t usecs)
+{
+    return false;
+}
+
+void HwTimer::stop()
+{
+    pending = false;
+}
+
+#endif
+
+void IRAM_ATTR HwTimer::fire()
+{
+    pending = false;
+    callback(arg);
+}
+
+} // namespace concurrency
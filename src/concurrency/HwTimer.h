@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace concurrency
+{
+
+/// Called from an ISR when a HwTimer fires, so it must be IRAM_ATTR on ESP32 and only do ISR safe things
+typedef void (*HwTimerCallback)(void *arg);
+
+/**
+ * A one shot timer with microsecond resolution, on a hardware timer.
+ *
+ * Unlike OSThread intervals (which have millisecond granularity, and only run once whatever else the main loop is doing has
+ * finished) the callback runs from the timer's interrupt, within a few microseconds of when we asked.  Use it for the radio
+ * timing which needs that: TDMA slots, ack turnaround and contention windows.
+ *
+ * We have two of these on ESP32 and one on nRF52.  Platforms without a spare hardware timer (and any timers beyond those)
+ * fail begin(), so callers fall back to the scheduler.
+ */
+class HwTimer
+{
+    HwTimerCallback callback;
+    void *arg;
+    int index = -1; // Which of our hardware timers we own, or -1
+
+    volatile bool pending = false;
+
+  public:
+    HwTimer(HwTimerCallback callback, void *arg) : callback(callback), arg(arg) {}
+
+    /// Claim a hardware timer @return false if we can't (in which case start() always fails)
+    bool begin();
+
+    /// (Re)start the timer, to fire once usecs from now @return false if we have no hardware timer
+    bool start(uint32_t usecs);
+
+    /// Stop the timer, if it hasn't already fired
+    void stop();
+
+    /// Has start() been called, and the timer not yet fired (or been stopped)
+    bool isPending() const { return pending; }
+
+    /// Called by the interrupt of our hardware timer
+    void fire();
+};
+
+} // namespace concurrency
@@ -21,6 +21,18 @@ void Lock::unlock()
 {
     assert(xSemaphoreGive(handle));
 }
+#elif defined(PORTDUINO)
+Lock::Lock() {}
+
+void Lock::lock()
+{
+    mutex.lock();
+}
+
+void Lock::unlock()
+{
+    mutex.unlock();
+}
 #else
 Lock::Lock() {}
 
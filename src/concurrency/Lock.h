@@ -2,11 +2,15 @@
 
 #include "../freertosinc.h"
 
+#if !defined(HAS_FREE_RTOS) && defined(PORTDUINO)
+#include <mutex>
+#endif
+
 namespace concurrency
 {
 
 /**
- * @brief Simple wrapper around FreeRTOS API for implementing a mutex lock
+ * @brief Simple wrapper around FreeRTOS API for implementing a mutex lock (or std::mutex on portduino, which has real threads)
  */
 class Lock
 {
@@ -29,6 +33,8 @@ class Lock
   private:
 #ifdef HAS_FREE_RTOS
     SemaphoreHandle_t handle;
+#elif defined(PORTDUINO)
+    std::mutex mutex;
 #endif
 };
 
@@ -0,0 +1,105 @@
+#include "MainThread.h"
+#include "BinarySemaphoreFreeRTOS.h"
+#include "BinarySemaphorePosix.h"
+#include "Lock.h"
+#include "LockGuard.h"
+#include "OSThread.h"
+#include <cassert>
+
+#ifdef PORTDUINO
+#include <atomic>
+#include <thread>
+#endif
+
+namespace concurrency
+{
+
+#ifdef HAS_FREE_RTOS
+static TaskHandle_t mainTask;
+static QueueHandle_t jobs;
+static BinarySemaphoreFreeRTOS *jobDone;
+static Lock *oneJobAtATime; // So jobDone always means the job of the task waiting for it
+
+void initMainThread()
+{
+    mainTask = xTaskGetCurrentTaskHandle();
+    jobs = xQueueCreate(1, sizeof(const std::function<void()> *));
+    jobDone = new BinarySemaphoreFreeRTOS();
+    oneJobAtATime = new Lock();
+}
+
+void runOnMainThread(const std::function<void()> &fn)
+{
+    assert(mainTask); // Other tasks only start once setup() is done
+    if (xTaskGetCurrentTaskHandle() == mainTask) {
+        fn();
+        return;
+    }
+
+    LockGuard g(oneJobAtATime);
+    const std::function<void()> *job = &fn;
+    xQueueSend(jobs, &job, portMAX_DELAY);
+    mainDelay.interrupt();
+
+    while (!jobDone->take(1000))
+        ;
+}
+
+void runMainThreadJobs()
+{
+    const std::function<void()> *job;
+    while (xQueueReceive(jobs, &job, 0)) {
+        (*job)();
+        jobDone->give();
+    }
+}
+#elif defined(PORTDUINO)
+static std::thread::id mainThreadId;
+static std::atomic<const std::function<void()> *> pendingJob;
+static BinarySemaphorePosix *jobDone;
+static Lock *oneJobAtATime; // So there is only ever one pendingJob, and jobDone always means it
+
+void initMainThread()
+{
+    mainThreadId = std::this_thread::get_id();
+    jobDone = new BinarySemaphorePosix();
+    oneJobAtATime = new Lock();
+}
+
+void runOnMainThread(const std::function<void()> &fn)
+{
+    assert(jobDone);
+    if (std::this_thread::get_id() == mainThreadId) {
+        fn();
+        return;
+    }
+
+    LockGuard g(oneJobAtATime);
+    pendingJob = &fn;
+    mainDelay.interrupt();
+
+    while (!jobDone->take(1000))
+        ;
+}
+
+void runMainThreadJobs()
+{
+    auto job = pendingJob.exchange(NULL);
+    if (job) {
+        (*job)();
+        jobDone->give();
+    }
+}
+#else
+// Without FreeRTOS (or portduino's host threads) everything runs on our main thread
+void initMainThread() {}
+
+void runOnMainThread(const std::function<void()> &fn)
+{
+    fn();
+}
+
+void runMainThreadJobs() {}
+#endif
+
+} // namespace concurrency
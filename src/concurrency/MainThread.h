@@ -0,0 +1,27 @@
+#pragma once
+
+#include <functional>
+
+namespace concurrency
+{
+
+/**
+ * Call from setup(), on the thread which runs our main loop
+ */
+void initMainThread();
+
+/**
+ * Run fn on the main thread (from runMainThreadJobs), and wait for it to finish
+ *
+ * Our mesh state (the router, NodeDB, MeshService and our PhoneAPIs) is only ever touched from the main thread, so other tasks
+ * (the web server, the BLE host) use this rather than each piece of state needing its own lock.  Keep fn short (no network
+ * IO), the main thread is blocked while it runs.  From the main thread itself we just call fn.
+ */
+void runOnMainThread(const std::function<void()> &fn);
+
+/**
+ * Called from our main loop, does any work other tasks are waiting for us to do
+ */
+void runMainThreadJobs();
+
+} // namespace concurrency
@@ -8,36 +8,27 @@ namespace concurrency
 static bool debugNotification;
 
 /**
- * Notify this thread so it can run
+ * Notify this thread of some events, so it runs ASAP
  */
-bool NotifiedWorkerThread::notify(uint32_t v, bool overwrite)
+void NotifiedWorkerThread::notify(uint32_t events)
 {
-    bool r = notifyCommon(v, overwrite);
-
-    if (r)
-        mainDelay.interrupt();
-
-    return r;
+    notifyCommon(events);
+    mainDelay.interrupt();
 }
 
 /**
- * Notify this thread so it can run
+ * Add to our pending events, and make us run ASAP
  */
-IRAM_ATTR bool NotifiedWorkerThread::notifyCommon(uint32_t v, bool overwrite)
+IRAM_ATTR void NotifiedWorkerThread::notifyCommon(uint32_t events)
 {
-    if (overwrite || notification == 0) {
-        enabled = true;
-        setInterval(0); // Run ASAP
-
-        notification = v;
-        if (debugNotification)
-            DEBUG_MSG("setting notification %d\n", v);
-        return true;
-    } else {
-        if (debugNotification)
-            DEBUG_MSG("dropping notification %d\n", v);
-        return false;
-    }
+    // We add our bits before we enable ourselves, so however this races runOnce() (which disables us before it takes them) the
+    // worst case is one extra run with nothing to do
+    pendingEvents.fetch_or(events);
+    setEnabled(true);
+    setInterval(0); // Run ASAP
+
+    if (debugNotification)
+        DEBUG_MSG("adding notification 0x%x\n", events);
 }
 
 /**
@@ -45,41 +36,99 @@ IRAM_ATTR bool NotifiedWorkerThread::notifyCommon(uint32_t v, bool overwrite)
  *
  * This must be inline or IRAM_ATTR on ESP32
  */
-IRAM_ATTR bool NotifiedWorkerThread::notifyFromISR(BaseType_t *highPriWoken, uint32_t v, bool overwrite)
+IRAM_ATTR void NotifiedWorkerThread::notifyFromISR(BaseType_t *highPriWoken, uint32_t events)
 {
-    bool r = notifyCommon(v, overwrite);
-    if (r)
-        mainDelay.interruptFromISR(highPriWoken);
-
-    return r;
+    notifyCommon(events);
+    mainDelay.interruptFromISR(highPriWoken);
 }
 
 /**
- * Schedule a notification to fire in delay msecs
+ * Schedule events to be notified in delay msecs
  */
-bool NotifiedWorkerThread::notifyLater(uint32_t delay, uint32_t v, bool overwrite)
+bool NotifiedWorkerThread::notifyLater(uint32_t delay, uint32_t events)
 {
-    bool didIt = notify(v, overwrite);
+    if (laterEvents || (pendingEvents.load() & events))
+        return false; // Our delay is already running, or these are about to be handled anyway
 
-    if (didIt) {                   // If we didn't already have something queued, override the delay to be larger
-        setIntervalFromNow(delay); // a new version of setInterval relative to the current time
-        if (debugNotification)
-            DEBUG_MSG("delaying notification %u\n", delay);
+    laterEvents = events;
+    laterMsec = millis() + delay;
+    setEnabled(true);
+    setIntervalFromNow(delay);
+    if (debugNotification)
+        DEBUG_MSG("delaying notification 0x%x by %u\n", events, delay);
+
+    return true;
+}
+
+bool NotifiedWorkerThread::notifyLaterUsec(uint32_t usecs, uint32_t events)
+{
+    if (!triedTimer) {
+        triedTimer = true;
+        timer = new HwTimer(onTimer, this);
+        if (!timer->begin()) {
+            delete timer;
+            timer = NULL;
+        }
     }
 
-    return didIt;
+    if (!timer)
+        return notifyLater((usecs + 999) / 1000, events);
+
+    if (timer->isPending() || (pendingEvents.load() & events))
+        return false;
+
+    timerEvents = events;
+    return timer->start(usecs);
+}
+
+void NotifiedWorkerThread::rescheduleLaterUsec(uint32_t usecs)
+{
+    if (!timer) {
+        if (laterEvents) {
+            uint32_t delay = (usecs + 999) / 1000;
+            laterMsec = millis() + delay;
+            setIntervalFromNow(delay);
+        }
+    } else if (timer->isPending())
+        timer->start(usecs);
+    // Otherwise our timer already fired, so we are about to run anyway
+}
+
+IRAM_ATTR void NotifiedWorkerThread::onTimer(void *arg)
+{
+    NotifiedWorkerThread *t = (NotifiedWorkerThread *)arg;
+
+    BaseType_t higherPriWoken = 0;
+    t->notifyFromISR(&higherPriWoken, t->timerEvents);
+#ifndef NO_ESP32
+    portYIELD_FROM_ISR();
+#elif defined(HAS_FREE_RTOS)
+    portYIELD_FROM_ISR(higherPriWoken);
+#endif
 }
 
 int32_t NotifiedWorkerThread::runOnce()
 {
-    auto n = notification;
-    enabled = false;  // Only run once per notification
-    notification = 0; // clear notification
-    if (n) {
-        onNotify(n);
+    setEnabled(false); // Until we are notified again, any notify() from here on turns us back on
+
+    // We might have run early for some other event, in which case our delay keeps running (we set it before we take our
+    // pending events, so a notify() in between still wins)
+    if (laterEvents) {
+        int32_t wait = laterMsec - millis();
+        if (wait <= 0) {
+            pendingEvents.fetch_or(laterEvents);
+            laterEvents = 0;
+        } else {
+            setEnabled(true);
+            setIntervalFromNow(wait);
+        }
     }
 
+    uint32_t events = pendingEvents.exchange(0);
+    if (events)
+        onNotify(events);
+
     return RUN_SAME;
 }
 
-} // namespace concurrency
\ No newline at end of file
+} // namespace concurrency
@@ -1,50 +1,84 @@
 #pragma once
 
+#include "HwTimer.h"
 #include "OSThread.h"
+#include <atomic>
 
 namespace concurrency
 {
 
 /**
- * @brief A worker thread that waits on a freertos notification
+ * @brief A worker thread that waits on a set of event bits (like a freertos notification with eSetBits)
+ *
+ * Each notify() ORs its bits into what is pending, so no event is ever lost: if several arrive before we run (say a radio
+ * interrupt while our transmit delay is also due) onNotify() gets them all in one call.  Subclasses should give each of their
+ * events its own bit.
  */
 class NotifiedWorkerThread : public OSThread
 {
-    /**
-     * The notification that was most recently used to wake the thread.  Read from runOnce()
-     */
-    uint32_t notification = 0;
+    /// The events we have been notified of but not yet handled.  Taken (and cleared) by runOnce()
+    std::atomic<uint32_t> pendingEvents;
+
+    /// Events from notifyLater(), which become pending at laterMsec
+    uint32_t laterEvents = 0;
+    uint32_t laterMsec = 0;
+
+    /// For notifyLaterUsec(), created the first time it is called (NULL if we couldn't get a hardware timer)
+    HwTimer *timer = NULL;
+    bool triedTimer = false;
+
+    /// The events our timer will deliver
+    volatile uint32_t timerEvents = 0;
 
   public:
-    NotifiedWorkerThread(const char *name) : OSThread(name) {}
+    NotifiedWorkerThread(const char *name) : OSThread(name), pendingEvents(0) {}
 
     /**
-     * Notify this thread so it can run
+     * Notify this thread of some events, so it runs ASAP
      */
-    bool notify(uint32_t v, bool overwrite);
+    void notify(uint32_t events);
 
     /**
      * Notify from an ISR
      *
      * This must be inline or IRAM_ATTR on ESP32
      */
-    bool notifyFromISR(BaseType_t *highPriWoken, uint32_t v, bool overwrite);
+    void notifyFromISR(BaseType_t *highPriWoken, uint32_t events);
 
     /**
-     * Schedule a notification to fire in delay msecs
+     * Schedule events to be notified in delay msecs.  We only have one such delay, so if it is already running (or these events
+     * are already pending) we leave it be.
+     * @return true if we scheduled them
      */
-    bool notifyLater(uint32_t delay, uint32_t v, bool overwrite);
+    bool notifyLater(uint32_t delay, uint32_t events);
+
+    /**
+     * Schedule events to be notified in usecs.  If we can get a hardware timer (see HwTimer) they are delivered from its
+     * interrupt right on time, rather than on the scheduler's next millisecond tick once the main loop gets to it.  Otherwise
+     * this is notifyLater() rounded up to msecs.
+     *
+     * Like notifyLater() we don't replace a timed notification which is already running.
+     * @return true if we scheduled it
+     */
+    bool notifyLaterUsec(uint32_t usecs, uint32_t events);
+
+    /// Move a timed notification which is already pending so it fires usecs from now instead
+    void rescheduleLaterUsec(uint32_t usecs);
 
   protected:
-    virtual void onNotify(uint32_t notification) = 0;
+    /// Handle every event which was pending when we woke, @param events one or more of our subclass's event bits
+    virtual void onNotify(uint32_t events) = 0;
 
     virtual int32_t runOnce();
 
   private:
     /**
-     * Notify this thread so it can run
+     * Add to our pending events, and make us run ASAP
      */
-    bool notifyCommon(uint32_t v, bool overwrite);
+    void notifyCommon(uint32_t events);
+
+    /// Our timer's interrupt
+    static void onTimer(void *arg);
 };
 
 } // namespace concurrency
@@ -2,6 +2,10 @@
 #include "configuration.h"
 #include <assert.h>
 
+#ifdef PORTDUINO
+#include <thread>
+#endif
+
 namespace concurrency
 {
 
@@ -14,18 +18,55 @@ bool OSThread::showRun = false;
 /// Show debugging info for threads we decide not to run;
 bool OSThread::showWaiting = false;
 
+#ifdef PORTDUINO
+thread_local const OSThread *OSThread::currentThread;
+#else
 const OSThread *OSThread::currentThread;
+#endif
 
-ThreadController mainController, timerController;
 InterruptableDelay mainDelay;
+Scheduler mainController("mainController", &mainDelay);
+
+#ifdef HOST_CORE
+static InterruptableDelay hostDelay;
+static Scheduler hostScheduler("hostController", &hostDelay);
+Scheduler &hostController = hostScheduler;
+
+static void hostTask(void *param)
+{
+    while (true)
+        hostDelay.delay(hostScheduler.runOrDelay());
+}
 
-void OSThread::setup()
+void startHostTask()
 {
-    mainController.ThreadName = "mainController";
-    timerController.ThreadName = "timerController";
+    xTaskCreatePinnedToCore(hostTask, "host", 8192, NULL, HOST_TASK_PRIORITY, NULL, HOST_CORE);
 }
+#elif defined(PORTDUINO)
+static InterruptableDelay hostDelay;
+static Scheduler hostScheduler("hostController", &hostDelay);
+Scheduler &hostController = hostScheduler;
 
-OSThread::OSThread(const char *_name, uint32_t period, ThreadController *_controller)
+static void hostTask()
+{
+    while (true)
+        hostDelay.delay(hostScheduler.runOrDelay());
+}
+
+void startHostTask()
+{
+    // A linux gateway has cores to spare, so our host threads (i.e. the log drain) run beside the main loop rather than in it
+    std::thread(hostTask).detach();
+}
+#else
+Scheduler &hostController = mainController;
+
+void startHostTask() {}
+#endif
+
+void OSThread::setup() {}
+
+OSThread::OSThread(const char *_name, uint32_t period, Scheduler *_controller)
     : Thread(NULL, period), controller(_controller)
 {
     assertIsSetup();
@@ -52,6 +93,35 @@ void OSThread::setIntervalFromNow(unsigned long _interval)
 
     // Cache the next run based on the last_run
     _cached_next_run = millis() + interval;
+
+    markDirty();
+}
+
+IRAM_ATTR void OSThread::setInterval(unsigned long _interval)
+{
+    Thread::setInterval(_interval);
+    markDirty();
+}
+
+IRAM_ATTR void OSThread::setEnabled(bool _enabled)
+{
+    enabled = _enabled;
+    markDirty();
+}
+
+IRAM_ATTR void OSThread::runUrgently()
+{
+    setInterval(0);
+    if (controller)
+        controller->runUrgently(this);
+}
+
+IRAM_ATTR void OSThread::markDirty()
+{
+    // Note: we must set our flag before our controller's, because it clears its flag before looking at ours
+    needsReschedule = true;
+    if (controller)
+        controller->markDirty();
 }
 
 bool OSThread::shouldRun(unsigned long time)
@@ -73,16 +143,53 @@ bool OSThread::shouldRun(unsigned long time)
 void OSThread::run()
 {
     currentThread = this;
+
+    int32_t late = millis() - _cached_next_run - slackMsec; // Running within our slack is what we asked for
+    if (late > 0) {
+        totalLateMsec += late;
+        if ((uint32_t)late > maxLateMsec)
+            maxLateMsec = late;
+
+        if ((uint32_t)late > getLatencyBudgetMsec()) {
+            numOverruns++;
+            const OSThread *last = controller ? controller->getLastRun() : NULL;
+            if (priority == PRIORITY_CRITICAL && last && last != this)
+                LOG_DEBUG(MESH, "Thread %s started %d msec late, after %s ran for %u usec\n", ThreadName.c_str(), late,
+                          last->ThreadName.c_str(), last->lastRunMicros);
+        }
+    }
+
+    uint32_t start = micros();
     auto newDelay = runOnce();
+    uint32_t elapsed = micros() - start;
+
+    numRuns++;
+    lastRunMicros = elapsed;
+    totalRunMicros += elapsed;
+    if (elapsed > maxRunMicros)
+        maxRunMicros = elapsed;
 
     runned();
 
+    // Our controller always reschedules us after we run, so we don't need to flag the change
     if (newDelay >= 0)
-        setInterval(newDelay);
+        Thread::setInterval(newDelay);
 
     currentThread = NULL;
 }
 
+uint32_t OSThread::getLatencyBudgetMsec() const
+{
+    switch (priority) {
+    case PRIORITY_CRITICAL:
+        return THREAD_BUDGET_CRITICAL_MSEC;
+    case PRIORITY_BACKGROUND:
+        return THREAD_BUDGET_BACKGROUND_MSEC;
+    default:
+        return THREAD_BUDGET_INTERACTIVE_MSEC;
+    }
+}
+
 /**
  * This flag is set **only** when setup() starts, to provide a way for us to check for sloppy static constructor calls.
  * Call assertIsSetup() to force a crash if someone tries to create an instance too early.
@@ -4,17 +4,47 @@
 #include <stdint.h>
 
 #include "Thread.h"
-#include "ThreadController.h"
 #include "concurrency/InterruptableDelay.h"
+#include "concurrency/Scheduler.h"
 
 namespace concurrency
 {
 
-extern ThreadController mainController, timerController;
+extern Scheduler mainController;
 extern InterruptableDelay mainDelay;
 
+/// Runs threads for our host interfaces (i.e. the screen), in their own task on HOST_CORE where we have one (or their own
+/// thread on portduino, otherwise this is mainController)
+extern Scheduler &hostController;
+
+/// Start the task which runs hostController, call once at the end of setup() (after all host threads have been created)
+void startHostTask();
+
 #define RUN_SAME -1
 
+/**
+ * How urgently a thread's work needs the CPU.  Our threads are cooperative, so nothing can interrupt a long runOnce() (a screen
+ * redraw, a GPS parse, a TLS step), but when several threads are due our Scheduler runs the most important first, and holds
+ * back background work which would still be running when critical work is due.
+ */
+enum ThreadPriority : uint8_t {
+    PRIORITY_BACKGROUND,  // The screen, GPS and power polls, which are fine running a second late
+    PRIORITY_INTERACTIVE, // Our API clients and plugins (the default)
+    PRIORITY_CRITICAL,    // Our radio and router, which lose packets if they wait
+    PRIORITY_NUM_CLASSES
+};
+
+/// How late (beyond its slack) a thread of each class may start, before we count it as overrunning its latency budget
+#ifndef THREAD_BUDGET_CRITICAL_MSEC
+#define THREAD_BUDGET_CRITICAL_MSEC 5
+#endif
+#ifndef THREAD_BUDGET_INTERACTIVE_MSEC
+#define THREAD_BUDGET_INTERACTIVE_MSEC 50
+#endif
+#ifndef THREAD_BUDGET_BACKGROUND_MSEC
+#define THREAD_BUDGET_BACKGROUND_MSEC 1000
+#endif
+
 /**
  * @brief Base threading
  *
@@ -30,7 +60,27 @@ extern InterruptableDelay mainDelay;
  */
 class OSThread : public Thread
 {
-    ThreadController *controller;
+    friend class Scheduler;
+
+    Scheduler *controller;
+
+    /// Our position in our controller's heap (or -1 if we are disabled), only touched by the controller
+    int heapPos = -1;
+
+    /// The deadline our controller has us sorted by, only touched by the controller
+    unsigned long heapDeadline = 0;
+
+    /// Set (possibly from an ISR) if our interval or enabled state has changed since our controller last looked
+    volatile bool needsReschedule = false;
+
+    /// How late we are happy to run (see setSlack)
+    uint32_t slackMsec = 0;
+
+    ThreadPriority priority = PRIORITY_INTERACTIVE;
+
+    /// Profiling, always collected because it is cheap and lets us see which threads use CPU in the field
+    uint32_t numRuns = 0, lastRunMicros = 0, maxRunMicros = 0, maxLateMsec = 0, numOverruns = 0;
+    uint64_t totalRunMicros = 0, totalLateMsec = 0;
 
     /// Show debugging info for disabled threads
     static bool showDisabled;
@@ -43,9 +93,16 @@ class OSThread : public Thread
 
   public:
     /// For debug printing only (might be null)
+#ifdef PORTDUINO
+    static thread_local const OSThread *currentThread; // Each of our schedulers has its own thread
+#else
     static const OSThread *currentThread;
+#endif
+
+    OSThread(const char *name, uint32_t period = 0, Scheduler *controller = &mainController);
 
-    OSThread(const char *name, uint32_t period = 0, ThreadController *controller = &mainController);
+    /// The scheduler which runs us (see Scheduler::wake)
+    Scheduler *getController() const { return controller; }
 
     virtual ~OSThread();
 
@@ -58,6 +115,59 @@ class OSThread : public Thread
      */
     void setIntervalFromNow(unsigned long _interval);
 
+    /**
+     * Set how long to wait (from when we last ran) before running again.  Safe to call from an ISR or another task.
+     */
+    virtual void setInterval(unsigned long _interval);
+
+    /**
+     * Enable or disable this thread.  Always use this rather than writing 'enabled' directly, so our controller notices.
+     * Safe to call from an ISR or another task.
+     */
+    void setEnabled(bool _enabled);
+
+    /**
+     * Run as soon as possible, ahead of any other thread which is also due.  Safe to call from an ISR or another task, the
+     * caller must still wake our controller.
+     */
+    void runUrgently();
+
+    /**
+     * Let our controller run us up to msec after we are due, so it doesn't wake just for us.  For periodic work which doesn't
+     * care exactly when it happens: we run in whichever wakeup comes first in that window (for a radio interrupt, or a thread
+     * which can't wait), and while nothing else needs the CPU the main loop sleeps right through to the end of it.
+     *
+     * Only call this from the task which runs our controller.
+     */
+    void setSlack(uint32_t msec) { slackMsec = msec; }
+
+    uint32_t getSlack() const { return slackMsec; }
+
+    /// Which class of work we are (see ThreadPriority).  Only call this from the task which runs our controller.
+    void setPriority(ThreadPriority p) { priority = p; }
+
+    ThreadPriority getPriority() const { return priority; }
+
+    /// How late we may start before it counts as an overrun (from our priority)
+    uint32_t getLatencyBudgetMsec() const;
+
+    /// The millis() time when we next want to run
+    unsigned long getNextRunTime() const { return _cached_next_run; }
+
+    /// How many times runOnce() has been called
+    uint32_t getNumRuns() const { return numRuns; }
+
+    /// Total and worst case time spent in runOnce()
+    uint64_t getTotalRunMicros() const { return totalRunMicros; }
+    uint32_t getMaxRunMicros() const { return maxRunMicros; }
+
+    /// Total and worst case time between when we asked to run (plus our slack) and when we actually started
+    uint64_t getTotalLateMsec() const { return totalLateMsec; }
+    uint32_t getMaxLateMsec() const { return maxLateMsec; }
+
+    /// How many times we started later than our latency budget
+    uint32_t getNumOverruns() const { return numOverruns; }
+
   protected:
     /**
      * The method that will be called each time our thread gets a chance to run
@@ -68,6 +178,10 @@ class OSThread : public Thread
 
     // Do not override this
     virtual void run();
+
+  private:
+    /// Tell our controller we need to be moved in its run order
+    void markDirty();
 };
 
 /**
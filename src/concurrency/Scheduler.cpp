@@ -0,0 +1,229 @@
+#include "Scheduler.h"
+#include "OSThread.h"
+#include "configuration.h"
+#include <assert.h>
+
+namespace concurrency
+{
+
+void Scheduler::add(OSThread *t)
+{
+    assert(numThreads < MAX_OSTHREADS);
+    threads[numThreads++] = t;
+
+    t->heapPos = -1;
+    reschedule(t);
+}
+
+void Scheduler::remove(OSThread *t)
+{
+    if (urgent == t)
+        urgent = NULL;
+
+    if (t->heapPos >= 0)
+        heapErase(t);
+
+    for (size_t i = 0; i < numThreads; i++)
+        if (threads[i] == t) {
+            threads[i] = threads[--numThreads];
+            break;
+        }
+}
+
+int32_t Scheduler::runOrDelay()
+{
+    applyPending();
+
+    // Only run as many threads as we have in one call, so a thread which keeps asking to run immediately can't prevent us
+    // from returning to the main loop
+    int32_t deferMsec = -1;
+    for (size_t n = heapSize; n > 0 && heapSize > 0; n--) {
+        OSThread *t = heap[0];
+        unsigned long now = millis();
+
+        OSThread *u = urgent;
+        if (u) {
+            urgent = NULL;
+            if (u->heapPos >= 0 && u->shouldRun(now))
+                t = u;
+        }
+
+        if (!t->shouldRun(now))
+            break;
+
+        if (t != u) {
+            t = pickByPriority(t, now);
+            if ((deferMsec = msecToDefer(t, now)) >= 0)
+                break; // Until our critical thread has had its turn
+        }
+
+        t->run();
+        lastRun = t;
+        reschedule(t);
+        applyPending(); // The thread we just ran might have woken others
+    }
+
+    if (dirty)
+        return 0; // Someone changed a thread while we were running, come back and look again
+
+    if (heapSize == 0)
+        return INT32_MAX; // Nothing enabled, sleep until someone interrupts mainDelay
+
+    if (deferMsec >= 0)
+        return deferMsec;
+
+    int32_t delta = msecUntilMustRun(millis());
+    return delta > 0 ? delta : 0;
+}
+
+OSThread *Scheduler::pickByPriority(OSThread *t, unsigned long now) const
+{
+    if (t->priority == PRIORITY_CRITICAL)
+        return t; // Nothing outranks it, and it is the earliest due
+
+    // n is small, and usually t is the only thread due
+    for (size_t i = 0; i < heapSize; i++) {
+        OSThread *o = heap[i];
+        if ((int32_t)(o->heapDeadline - now) <= 0 &&
+            (o->priority > t->priority || (o->priority == t->priority && isBefore(o, t))))
+            t = o;
+    }
+    return t;
+}
+
+int32_t Scheduler::msecToDefer(const OSThread *t, unsigned long now) const
+{
+    uint32_t runMsec = t->maxRunMicros / 1000;
+    if (t->priority != PRIORITY_BACKGROUND || !runMsec)
+        return -1;
+
+    int32_t late = now - t->heapDeadline - t->slackMsec;
+    if (late > 0 && (uint32_t)late > t->getLatencyBudgetMsec())
+        return -1; // It has waited long enough
+
+    int32_t soonest = -1;
+    for (size_t i = 0; i < heapSize; i++) {
+        const OSThread *o = heap[i];
+        int32_t dueIn = o->heapDeadline - now;
+        if (o->priority == PRIORITY_CRITICAL && dueIn > 0 && (uint32_t)dueIn <= runMsec && (soonest < 0 || dueIn < soonest))
+            soonest = dueIn;
+    }
+    return soonest;
+}
+
+int32_t Scheduler::msecUntilMustRun(unsigned long now) const
+{
+    // Usually our first thread has no slack, so it is what we wake for
+    if (!heap[0]->slackMsec)
+        return heap[0]->heapDeadline - now;
+
+    // Otherwise it could be any thread which runs out of slack first (n is small, and most threads have no slack)
+    int32_t delta = INT32_MAX;
+    for (size_t i = 0; i < heapSize; i++) {
+        int32_t d = heap[i]->heapDeadline + heap[i]->slackMsec - now;
+        if (d < delta)
+            delta = d;
+    }
+    return delta;
+}
+
+void Scheduler::reschedule(OSThread *t)
+{
+    if (!t->enabled) {
+        if (t->heapPos >= 0)
+            heapErase(t);
+        return;
+    }
+
+    t->heapDeadline = t->getNextRunTime();
+    if (t->heapPos < 0)
+        heapInsert(t);
+    else {
+        siftUp(t->heapPos);
+        siftDown(t->heapPos);
+    }
+}
+
+void Scheduler::applyPending()
+{
+    if (!dirty)
+        return;
+
+    // Clear our flag before looking at the threads, so any change made while we are looking is caught next time
+    dirty = false;
+    for (size_t i = 0; i < numThreads; i++) {
+        OSThread *t = threads[i];
+        if (t->needsReschedule) {
+            t->needsReschedule = false;
+            reschedule(t);
+        }
+    }
+}
+
+bool Scheduler::isBefore(const OSThread *a, const OSThread *b)
+{
+    // Deadlines are millis() values and can wrap, so compare them by their signed difference
+    return (int32_t)(a->heapDeadline - b->heapDeadline) < 0;
+}
+
+void Scheduler::heapSet(size_t pos, OSThread *t)
+{
+    heap[pos] = t;
+    t->heapPos = pos;
+}
+
+void Scheduler::heapInsert(OSThread *t)
+{
+    assert(heapSize < MAX_OSTHREADS);
+    heapSet(heapSize++, t);
+    siftUp(t->heapPos);
+}
+
+void Scheduler::heapErase(OSThread *t)
+{
+    size_t pos = t->heapPos;
+    t->heapPos = -1;
+
+    OSThread *last = heap[--heapSize];
+    if (last != t) {
+        heapSet(pos, last);
+        siftUp(pos);
+        siftDown(last->heapPos);
+    }
+}
+
+void Scheduler::siftUp(size_t pos)
+{
+    OSThread *t = heap[pos];
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (!isBefore(t, heap[parent]))
+            break;
+
+        heapSet(pos, heap[parent]);
+        pos = parent;
+    }
+    heapSet(pos, t);
+}
+
+void Scheduler::siftDown(size_t pos)
+{
+    OSThread *t = heap[pos];
+    while (true) {
+        size_t child = 2 * pos + 1;
+        if (child >= heapSize)
+            break;
+
+        if (child + 1 < heapSize && isBefore(heap[child + 1], heap[child]))
+            child++;
+
+        if (!isBefore(heap[child], t))
+            break;
+
+        heapSet(pos, heap[child]);
+        pos = child;
+    }
+    heapSet(pos, t);
+}
+
+} // namespace concurrency
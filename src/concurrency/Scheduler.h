@@ -0,0 +1,133 @@
+#pragma once
+
+#include "concurrency/InterruptableDelay.h"
+#include <cstdlib>
+#include <stdint.h>
+
+namespace concurrency
+{
+
+class OSThread;
+
+/// The most threads a single Scheduler can manage
+#define MAX_OSTHREADS 32
+
+/**
+ * Runs OSThreads in order of their next deadline.
+ *
+ * Enabled threads are kept in a min-heap keyed on when they next want to run, so finding the next thread (and therefore how
+ * long the main loop can sleep) is O(1) and rescheduling a thread is O(log n).  Disabled threads are not in the heap at all,
+ * so they cost nothing until they are enabled again.
+ *
+ * Threads are often woken from an ISR or another task (a queue push, a notify).  Those callers must not touch the heap, so
+ * they only flag the thread as needing a reschedule (see OSThread::setInterval()) and then call wake().  The next
+ * call to runOrDelay() (from the task which runs this scheduler) moves any flagged threads to their new place in the heap.
+ *
+ * Threads must only be added or removed from the task which runs the scheduler (or before that task starts).
+ *
+ * Threads with slack (see OSThread::setSlack()) don't get wakeups of their own: we sleep until the first thread that can't
+ * wait any longer, and then run everything which is due by then together.  So a battery node's periodic work (beacons,
+ * power polls, GPS windows) piles into a few shared wakeups, often the ones a received packet caused anyway.
+ *
+ * When several threads are due we run them by ThreadPriority (earliest deadline first within a class), so our radio and
+ * router never queue behind a screen redraw which happened to be due first.  We can't interrupt a thread once it runs, so we
+ * also hold back a background thread whose longest run so far would overlap a critical thread's deadline, unless it is
+ * already beyond its own latency budget (so background work is delayed, never starved).
+ */
+class Scheduler
+{
+    /// Every thread we manage, enabled or not
+    OSThread *threads[MAX_OSTHREADS];
+    size_t numThreads = 0;
+
+    /// The enabled threads, as a min-heap on OSThread::heapDeadline
+    OSThread *heap[MAX_OSTHREADS];
+    size_t heapSize = 0;
+
+    /// Set if any of our threads has been flagged as needing a reschedule
+    volatile bool dirty = false;
+
+    /// A thread which has asked to run ahead of everything else which is due (see runUrgently())
+    OSThread *volatile urgent = NULL;
+
+    /// The delay whoever runs us sleeps in between calls to runOrDelay()
+    InterruptableDelay *delay;
+
+    /// The thread we ran most recently, to blame for any critical thread which had to wait for it
+    const OSThread *lastRun = NULL;
+
+  public:
+    /// For debug printing only
+    const char *name;
+
+    Scheduler(const char *_name, InterruptableDelay *_delay) : delay(_delay), name(_name) {}
+
+    void add(OSThread *t);
+
+    void remove(OSThread *t);
+
+    /**
+     * Note that one of our threads has changed its interval or enabled state.  Safe to call from an ISR or any task.
+     */
+    void markDirty() { dirty = true; }
+
+    /// Make whoever runs us call runOrDelay() again now, because one of our threads was woken (from another task)
+    void wake() { delay->interrupt(); }
+
+    void wakeFromISR(BaseType_t *pxHigherPriorityTaskWoken) { delay->interruptFromISR(pxHigherPriorityTaskWoken); }
+
+    /**
+     * Run t next, before any other thread which is already due (i.e. because a queue it reads is about to overflow).  Only
+     * one thread can be urgent at a time, the latest caller wins.  Safe to call from an ISR or any task, the caller must still
+     * wake() us.
+     */
+    void runUrgently(OSThread *t)
+    {
+        urgent = t;
+        markDirty();
+    }
+
+    /**
+     * Run any threads which are due.
+     *
+     * @return the number of msecs until the next thread is due, which is how long the caller can sleep for
+     */
+    int32_t runOrDelay();
+
+    /// The thread we ran most recently (or NULL)
+    const OSThread *getLastRun() const { return lastRun; }
+
+    /// The thread which will run next (or NULL if no threads are enabled)
+    OSThread *nextThread() const { return heapSize ? heap[0] : NULL; }
+
+    /// For reporting only, list all our threads (in no particular order)
+    size_t getNumThreads() const { return numThreads; }
+    OSThread *getThread(size_t i) const { return threads[i]; }
+
+  private:
+    /// Move t to the correct place in the heap (inserting or removing it based on its enabled state)
+    void reschedule(OSThread *t);
+
+    /// Reschedule any threads which were flagged by markDirty()
+    void applyPending();
+
+    /// How long until some thread is due and out of slack (heap must not be empty)
+    int32_t msecUntilMustRun(unsigned long now) const;
+
+    void heapInsert(OSThread *t);
+    void heapErase(OSThread *t);
+    void heapSet(size_t pos, OSThread *t);
+    void siftUp(size_t pos);
+    void siftDown(size_t pos);
+
+    static bool isBefore(const OSThread *a, const OSThread *b);
+
+    /// Of the threads which are due now, the one with the highest priority (t, the earliest due, unless another outranks it)
+    OSThread *pickByPriority(OSThread *t, unsigned long now) const;
+
+    /// If background thread t should wait for a critical thread due before t would be done, @return msecs until that thread is
+    /// due (otherwise -1)
+    int32_t msecToDefer(const OSThread *t, unsigned long now) const;
+};
+
+} // namespace concurrency
@@ -197,11 +197,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // code)
 #endif
 
-// Leave undefined to disable our PMU IRQ handler.  DO NOT ENABLE THIS because the pmuirq can cause sperious interrupts
-// and waking from light sleep
-// #define PMU_IRQ 35
+// Leave undefined to disable our PMU IRQ handler (we then poll the PMU instead).  We only enable PMU events which happen once
+// per plug/unplug (the charging events repeat while there is no battery), and we clear them as soon as they fire, so
+// they no longer cause spurious interrupts or wakes from light sleep
+#define PMU_IRQ 35
 #define AXP192_SLAVE_ADDRESS 0x34
 
+// Our GPS draws about 35mA whenever we are awake (see PowerStats.h)
+#define POWER_MA_NB 60.0
+#define POWER_MA_DARK 80.0
+#define POWER_MA_ON 105.0
+
 #elif defined(TBEAM_V07)
 // This string must exactly match the case used in release file names or the android updater won't work
 #define HW_VENDOR "tbeam0.7"
@@ -418,6 +424,24 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define RF95_DIO2 LORA_DIO2 // Note: not really used for RF95
 #endif
 
+// -----------------------------------------------------------------------------
+// Task partitioning
+// -----------------------------------------------------------------------------
+
+#ifdef ARDUINO_ARCH_ESP32
+// Our mesh work (radio bottom half, router, plugins) all runs from the Arduino loop() on ARDUINO_RUNNING_CORE.  Work for our
+// hosts (web server, screen) runs in its own tasks on HOST_CORE (where the IDF also puts the WiFi and NimBLE tasks), so a
+// slow client never delays packet processing.  Set HOST_CORE to ARDUINO_RUNNING_CORE to keep everything on one core.
+#ifndef HOST_CORE
+#define HOST_CORE 0
+#endif
+
+// Priority of our host scheduler task (the Arduino loop task runs at 1)
+#ifndef HOST_TASK_PRIORITY
+#define HOST_TASK_PRIORITY 1
+#endif
+#endif
+
 // -----------------------------------------------------------------------------
 // DEBUG
 // -----------------------------------------------------------------------------
@@ -465,6 +489,78 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 #endif
 
+// -----------------------------------------------------------------------------
+// Log levels
+// -----------------------------------------------------------------------------
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// The most verbose level we compile in for each module, i.e. build with -DLOG_LEVEL_RADIO=LOG_LEVEL_WARN to drop the per
+// packet radio spew.  Messages above these levels vanish at compile time, so they cost nothing.
+#ifndef LOG_LEVEL_DEFAULT
+#define LOG_LEVEL_DEFAULT LOG_LEVEL_DEBUG
+#endif
+
+#ifndef LOG_LEVEL_MESH
+#define LOG_LEVEL_MESH LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_LEVEL_RADIO
+#define LOG_LEVEL_RADIO LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_LEVEL_GPS
+#define LOG_LEVEL_GPS LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_LEVEL_POWER
+#define LOG_LEVEL_POWER LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_LEVEL_SCREEN
+#define LOG_LEVEL_SCREEN LOG_LEVEL_DEFAULT
+#endif
+
+#ifndef LOG_LEVEL_HTTP
+#define LOG_LEVEL_HTTP LOG_LEVEL_DEFAULT
+#endif
+
+// Where each module keeps its runtime level in logRuntimeLevels (4 bits each)
+#define LOG_SHIFT_MESH 0
+#define LOG_SHIFT_RADIO 4
+#define LOG_SHIFT_GPS 8
+#define LOG_SHIFT_POWER 12
+#define LOG_SHIFT_SCREEN 16
+#define LOG_SHIFT_HTTP 20
+
+/// The most verbose level each module currently prints, can only lower what was compiled in (all LOG_LEVEL_DEBUG at boot)
+extern uint32_t logRuntimeLevels;
+
+/// Change a module's runtime level, i.e. setLogLevel(LOG_SHIFT_RADIO, LOG_LEVEL_WARN)
+inline void setLogLevel(uint8_t moduleShift, uint8_t level)
+{
+    logRuntimeLevels = (logRuntimeLevels & ~(0xfUL << moduleShift)) | ((uint32_t)level << moduleShift);
+}
+
+/// Would a message of this level from this module be printed?  Cheap enough to guard expensive debug dumps with
+#define LOG_ENABLED(module, level)                                                                                              \
+    (LOG_LEVEL_##module >= (level) && ((logRuntimeLevels >> LOG_SHIFT_##module) & 0xf) >= (level))
+
+#define LOG_MSG(module, level, ...)                                                                                             \
+    do {                                                                                                                       \
+        if (LOG_ENABLED(module, level))                                                                                        \
+            DEBUG_MSG(__VA_ARGS__);                                                                                            \
+    } while (0)
+
+#define LOG_ERROR(module, ...) LOG_MSG(module, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_MSG(module, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_MSG(module, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(module, ...) LOG_MSG(module, LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 // -----------------------------------------------------------------------------
 // AXP192 (Rev1-specific options)
 // -----------------------------------------------------------------------------
@@ -1,27 +1,43 @@
 #include <Arduino.h>
 
 #include "../concurrency/LockGuard.h"
+#include "../concurrency/Periodic.h"
 #include "BluetoothSoftwareUpdate.h"
 #include "PowerFSM.h"
 #include "RadioLibInterface.h"
+#include "UpdateWriter.h"
 #include "configuration.h"
 #include "nimble/BluetoothUtil.h"
+#include "nimble/NimbleBluetoothAPI.h"
 #include "NodeDB.h"
 
-#include <CRC32.h>
 #include <Update.h>
 
-int16_t updateResultHandle = -1;
+int16_t updateResultHandle = -1, updateAckHandle = -1;
 
-static CRC32 crc;
-static uint32_t rebootAtMsec = 0; // If not zero we will reboot at this time (used to reboot shortly after the update completes)
+/// Reboots us shortly after an update completes (disabled until then)
+static concurrency::Periodic *rebootPeriod;
 
-static uint32_t updateExpectedSize, updateActualSize;
+static uint32_t updateExpectedSize;
 static uint8_t update_result;
 static uint8_t update_region;
 
 static concurrency::Lock *updateLock;
 
+/// How many bytes updateWriter has written to flash (as our ack characteristic tells the client), and the window: how far
+/// past that the client may send
+static uint32_t update_ack[2];
+
+/// Tell the client how far we have got, from updateWriter's task
+static void onUpdateFlashed(uint32_t flashedBytes)
+{
+    if (updateAckHandle >= 0 && curConnectionHandle >= 0)
+        ble_gattc_notify(curConnectionHandle, updateAckHandle); // Ignore failures, the client can also read it
+
+    if (bluetoothLinkManager)
+        bluetoothLinkManager->markBusy(); // Short connection intervals until the image is in
+}
+
 /// Handle writes & reads to total size
 int update_size_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
@@ -31,11 +47,7 @@ int update_size_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_
     chr_readwrite32le(&updateExpectedSize, ctxt);
 
     if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR && updateExpectedSize != 0) {
-        updateActualSize = 0;
-        crc.reset();
-        if (Update.isRunning())
-            Update.abort();
-        bool canBegin = Update.begin(updateExpectedSize, update_region);
+        bool canBegin = updateWriter.begin(updateExpectedSize, update_region, onUpdateFlashed);
         DEBUG_MSG("Setting region %d update size %u, result %d\n", update_region, updateExpectedSize, canBegin);
         if (!canBegin) {
             // Indicate failure by forcing the size to 0 (client will read it back)
@@ -51,6 +63,9 @@ int update_size_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_
                 RadioLibInterface::instance->sleep(); // FIXME, nasty hack - the RF95 ISR/SPI code on ESP32 can fail while we are
                                                       // writing flash - shut the radio off during updates
         }
+
+        if (bluetoothLinkManager)
+            bluetoothLinkManager->markBusy(); // Short connection intervals until the image is in
     }
 
     return 0;
@@ -58,7 +73,7 @@ int update_size_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_
 
 #define MAX_BLOCKSIZE 512
 
-/// Handle writes to data
+/// Handle writes to data, which may be writes without response: updateWriter only copies them, its own task does the rest
 int update_data_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     concurrency::LockGuard g(updateLock);
@@ -72,14 +87,20 @@ int update_data_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_
     assert(rc == 0);
 
     // DEBUG_MSG("Writing %u\n", len);
-    crc.update(data, len);
-    Update.write(data, len);
-    updateActualSize += len;
+    updateWriter.write(data, len);
     powerFSM.trigger(EVENT_CONTACT_FROM_PHONE);
 
     return 0;
 }
 
+/// Handle reads of our flow control state
+int update_ack_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    update_ack[0] = updateWriter.getFlashedSize();
+    update_ack[1] = UPDATE_WINDOW;
+    return chr_readwrite8((uint8_t *)update_ack, sizeof(update_ack), ctxt); // Both little endian, as we are
+}
+
 /// Handle writes to crc32
 int update_crc32_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
@@ -87,7 +108,9 @@ int update_crc32_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble
     uint32_t expectedCRC = 0;
     chr_readwrite32le(&expectedCRC, ctxt);
 
-    uint32_t actualCRC = crc.finalize();
+    updateWriter.drain(); // The CRC is only complete once everything is in flash
+    uint32_t actualCRC = updateWriter.getCrc();
+    uint32_t updateActualSize = updateWriter.getReceivedSize();
     DEBUG_MSG("expected CRC %u\n", expectedCRC);
 
     uint8_t result = 0xff;
@@ -107,7 +130,9 @@ int update_crc32_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble
             }
             else {
                 DEBUG_MSG("Appload updated, rebooting in 5 seconds!\n");
-                rebootAtMsec = millis() + 5000;
+                rebootPeriod->setIntervalFromNow(5000);
+                rebootPeriod->setEnabled(true);
+                concurrency::mainDelay.interrupt(); // We are on the nimble task, make sure our main loop sees the change
             }
         } else {
             DEBUG_MSG("Error Occurred. Error #: %d\n", Update.getError());
@@ -137,12 +162,12 @@ int update_region_callback(uint16_t conn_handle, uint16_t attr_handle, struct bl
     return chr_readwrite8(&update_region, sizeof(update_region), ctxt);
 }
 
-void bluetoothRebootCheck()
+static int32_t rebootCb()
 {
-    if (rebootAtMsec && millis() > rebootAtMsec) {
-        DEBUG_MSG("Rebooting for update\n");
-        ESP.restart();
-    }
+    DEBUG_MSG("Rebooting for update\n");
+    nodeDB.saveIfChanged();
+    ESP.restart();
+    return 0;
 }
 
 /*
@@ -153,6 +178,11 @@ void reinitUpdateService()
 {
     if (!updateLock)
         updateLock = new concurrency::Lock();
+    update_ack[1] = UPDATE_WINDOW;
+    if (!rebootPeriod) {
+        rebootPeriod = new concurrency::Periodic("UpdateReboot", rebootCb);
+        rebootPeriod->setEnabled(false);
+    }
 
     auto res = ble_gatts_count_cfg(gatt_update_svcs); // assigns handles?  see docstring for note about clearing the handle list
                                                       // before calling SLEEP SUPPORT
@@ -2,9 +2,19 @@
 
 #include "nimble/NimbleDefs.h"
 
+/**
+ * Firmware (or SPIFFS) updates over BLE, see bluetooth-api.md.
+ *
+ * The client writes the image size, then streams the image to the data characteristic, then writes its CRC32 and waits for
+ * the result notify.  Data writes may be writes without response, in chunks up to the negotiated MTU: we only hand them to
+ * updateWriter, whose own task does the CRC and the (erase stalled) flash writes, so the BLE host is never blocked by flash.
+ *
+ * Such a client must do flow control with the ack characteristic (read or notify), two little endian uint32s: how many bytes we
+ * have written to flash, and the window, how far past that it may send.  We notify it after each block.  Legacy clients
+ * writing with response need none of this, their writes are held up if all of our blocks are full.
+ */
 void reinitUpdateService();
 
-void bluetoothRebootCheck();
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,12 +25,13 @@ int update_data_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_
 int update_result_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 int update_crc32_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 int update_region_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+int update_ack_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 extern const struct ble_gatt_svc_def gatt_update_svcs[];
 
-extern const ble_uuid128_t update_result_uuid, update_region_uuid;
+extern const ble_uuid128_t update_result_uuid, update_region_uuid, update_ack_uuid;
 
-extern int16_t updateResultHandle;
+extern int16_t updateResultHandle, updateAckHandle;
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,76 @@
+#include "CpuGovernor.h"
+#include "MeshProfile.h"
+#include "RadioCoexistence.h"
+#include "Router.h"
+#include "configuration.h"
+#include "meshwifi/meshhttp.h"
+#include "meshwifi/meshwifi.h"
+
+CpuGovernor *cpuGovernor;
+
+static const uint32_t speedMhz[] = {80, 160, 240};
+
+CpuGovernor::CpuGovernor() : concurrency::OSThread("CpuGovernor", GOVERNOR_POLL_MSEC) {}
+
+void CpuGovernor::boost(uint32_t msecs)
+{
+    boostUntilMsec = millis() + msecs;
+
+    // Don't wait for our next poll, whoever asked is about to need it
+    runUrgently();
+    getController()->wake();
+}
+
+CpuSpeed CpuGovernor::getDemand()
+{
+    uint32_t now = millis();
+    if ((int32_t)(boostUntilMsec - now) > 0)
+        return CPU_FAST;
+
+    CpuSpeed demand = CPU_SLOW;
+
+    if (wifiShouldDefer() || (isWifiAvailable() && isWebClientActive(COEX_WEB_ACTIVE_MSEC)))
+        demand = CPU_MEDIUM;
+
+    if (router) {
+        RouterStats r;
+        router->getStats(r);
+        if (r.radio.txQueued > meshProfile.txQueue / 2 || r.fromRadioQueued > meshProfile.rxFromRadio / 2)
+            demand = CPU_MEDIUM;
+    }
+
+    // How late this run started is how far behind everything else on the main loop is too
+    uint64_t totalLate = getTotalLateMsec();
+    uint32_t late = totalLate - lastTotalLateMsec;
+    lastTotalLateMsec = totalLate;
+    if (late >= GOVERNOR_LATE_MSEC && demand < CPU_FAST)
+        demand = (CpuSpeed)(max(demand, speed) + 1);
+
+    return demand;
+}
+
+void CpuGovernor::setSpeed(CpuSpeed s)
+{
+    if (s == speed)
+        return;
+
+    LOG_DEBUG(POWER, "CPU speed %u -> %u MHz\n", speedMhz[speed], speedMhz[s]);
+    speed = s;
+    setCpuFrequencyMhz(speedMhz[s]);
+}
+
+int32_t CpuGovernor::runOnce()
+{
+    uint32_t now = millis();
+    CpuSpeed demand = getDemand();
+
+    if (demand >= speed) {
+        lastDemandMsec = now;
+        setSpeed(demand); // Speed up right away
+    } else if (now - lastDemandMsec >= GOVERNOR_SLOWDOWN_MSEC) {
+        lastDemandMsec = now; // So each further step down waits its turn too
+        setSpeed((CpuSpeed)(speed - 1));
+    }
+
+    return GOVERNOR_POLL_MSEC;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "concurrency/OSThread.h"
+
+/// How often we look at our demand signals
+#define GOVERNOR_POLL_MSEC 250
+
+/// We only slow down after demand has stayed lower for this long (so bursty loads don't make us flap)
+#define GOVERNOR_SLOWDOWN_MSEC (5 * 1000)
+
+/// If our own runs start this late, the main loop is falling behind and we speed up a step
+#define GOVERNOR_LATE_MSEC 20
+
+/// After a new HTTPS connection we run flat out this long, which covers its TLS handshake
+#define GOVERNOR_HANDSHAKE_MSEC (3 * 1000)
+
+/// The speeds we choose from
+enum CpuSpeed { CPU_SLOW, CPU_MEDIUM, CPU_FAST };
+
+/**
+ * Picks our CPU frequency (80, 160 or 240 MHz) from how busy we actually are, so nothing else needs to manage clocks.
+ *
+ * Each poll we work out the speed our demand signals call for:
+ * - CPU_FAST while a TLS handshake is probably running, or someone asked for a burst with boost() (i.e. file uploads)
+ * - CPU_MEDIUM while a BLE client downloads our config, a web client is active, or our radio's queues are backing up
+ * - and one step faster than that if the main loop is running late (which we measure from our own runs)
+ *
+ * We speed up as soon as we see demand, but only slow down a step at a time, once demand has stayed lower for
+ * GOVERNOR_SLOWDOWN_MSEC.
+ */
+class CpuGovernor : private concurrency::OSThread
+{
+    CpuSpeed speed = CPU_SLOW;
+
+    /// When demand last called for at least our current speed
+    uint32_t lastDemandMsec = 0;
+
+    /// Anything which asked for CPU_FAST wants it until then (0 if no one has)
+    volatile uint32_t boostUntilMsec = 0;
+
+    /// Our OSThread lateness total when we last ran
+    uint64_t lastTotalLateMsec = 0;
+
+  public:
+    CpuGovernor();
+
+    /// Run flat out for the next msecs (safe to call from any task)
+    void boost(uint32_t msecs);
+
+    CpuSpeed getSpeed() const { return speed; }
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    /// The speed our demand signals call for right now
+    CpuSpeed getDemand();
+
+    void setSpeed(CpuSpeed s);
+};
+
+extern CpuGovernor *cpuGovernor;
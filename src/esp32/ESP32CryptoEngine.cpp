@@ -16,68 +16,67 @@
 class ESP32CryptoEngine : public CryptoEngine
 {
 
-    mbedtls_aes_context aes;
+    /// Each key's expanded key schedule, computed once when the key is installed
+    mbedtls_aes_context aes[CRYPTO_NUM_SLOTS];
 
-    /// How many bytes in our key
-    uint8_t keySize = 0;
+    /// How many bytes in each key
+    uint8_t keySizes[CRYPTO_NUM_SLOTS] = {0};
 
   public:
-    ESP32CryptoEngine() { mbedtls_aes_init(&aes); }
+    ESP32CryptoEngine()
+    {
+        for (size_t i = 0; i < CRYPTO_NUM_SLOTS; i++)
+            mbedtls_aes_init(&aes[i]);
+    }
 
-    ~ESP32CryptoEngine() { mbedtls_aes_free(&aes); }
+    ~ESP32CryptoEngine()
+    {
+        for (size_t i = 0; i < CRYPTO_NUM_SLOTS; i++)
+            mbedtls_aes_free(&aes[i]);
+    }
 
-    /**
-     * Set the key used for encrypt, decrypt.
-     *
-     * As a special case: If all bytes are zero, we assume _no encryption_ and send all data in cleartext.
-     *
-     * @param numBytes must be 16 (AES128), 32 (AES256) or 0 (no crypt)
-     * @param bytes a _static_ buffer that will remain valid for the life of this crypto instance (i.e. this class will cache the
-     * provided pointer)
-     */
-    virtual void setKey(size_t numBytes, uint8_t *bytes)
+  protected:
+    virtual void installKey(size_t keyIndex, size_t numBytes, const uint8_t *bytes)
     {
-        keySize = numBytes;
-        DEBUG_MSG("Installing AES%d key!\n", numBytes * 8);
+        keySizes[keyIndex] = numBytes;
         if (numBytes != 0) {
-            auto res = mbedtls_aes_setkey_enc(&aes, bytes, numBytes * 8);
+            auto res = mbedtls_aes_setkey_enc(&aes[keyIndex], bytes, numBytes * 8);
             assert(!res);
         }
     }
 
     /**
-     * Encrypt a packet
+     * Run AES-CTR with one of our keys
      *
-     * @param bytes is updated in place
+     * @param in numBytes of input
+     * @param out where to write numBytes of output, it can be the same buffer as in
      */
-    virtual void encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    virtual void crypt(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
     {
-        if (keySize != 0) {
+        if (keySizes[keyIndex] != 0) {
             uint8_t stream_block[16];
-            static uint8_t scratch[MAX_BLOCKSIZE];
+            uint8_t packetNonce[16]; // Our own copy, because mbedtls advances the counter as it goes
             size_t nc_off = 0;
 
             // DEBUG_MSG("ESP32 encrypt!\n");
-            initNonce(fromNode, packetNum);
+            initNonce(packetNonce, fromNode, packetNum);
             assert(numBytes <= MAX_BLOCKSIZE);
-            memcpy(scratch, bytes, numBytes);
-            memset(scratch + numBytes, 0,
-                   sizeof(scratch) - numBytes); // Fill rest of buffer with zero (in case cypher looks at it)
 
-            auto res = mbedtls_aes_crypt_ctr(&aes, numBytes, &nc_off, nonce, stream_block, scratch, bytes);
+            // CTR mode only reads numBytes of input, and mbedtls is fine with in == out
+            auto res = mbedtls_aes_crypt_ctr(&aes[keyIndex], numBytes, &nc_off, packetNonce, stream_block, in, out);
             assert(!res);
-        }
+        } else if (in != out)
+            memcpy(out, in, numBytes);
     }
 
-    virtual void decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    virtual void cryptBlock(size_t keyIndex, const uint8_t *in, uint8_t *out)
     {
-        // DEBUG_MSG("ESP32 decrypt!\n");
-
-        // For CTR, the implementation is the same
-        encrypt(fromNode, packetNum, numBytes, bytes);
+        if (keySizes[keyIndex] != 0) {
+            auto res = mbedtls_aes_crypt_ecb(&aes[keyIndex], MBEDTLS_AES_ENCRYPT, in, out);
+            assert(!res);
+        } else if (in != out)
+            memcpy(out, in, 16);
     }
-
-  private:
 };
 
 CryptoEngine *crypto = new ESP32CryptoEngine();
@@ -0,0 +1,135 @@
+#include "ESP32UartStream.h"
+#include "concurrency/OSThread.h"
+#include "configuration.h"
+#include <assert.h>
+
+/// Interrupt once the 128 byte hardware FIFO has this many bytes
+#define UART_RX_FULL_THRESH 100
+
+/// Or once the line has been idle this many byte times, which is how we notice the end of a frame
+#define UART_RX_TIMEOUT_THRESH 4
+
+void ESP32UartStream::begin(unsigned long baud, int rxPin, int txPin)
+{
+    uart_config_t config = {};
+    config.baud_rate = baud;
+    config.data_bits = UART_DATA_8_BITS;
+    config.parity = UART_PARITY_DISABLE;
+    config.stop_bits = UART_STOP_BITS_1;
+    config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    auto res = uart_param_config(port, &config);
+    assert(res == ESP_OK);
+
+    res = uart_set_pin(port, txPin, rxPin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    assert(res == ESP_OK);
+
+    res = uart_driver_install(port, rxBufSize, txBufSize, 16, &events, 0);
+    assert(res == ESP_OK);
+
+    uart_intr_config_t intr = {};
+    intr.intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_TOUT_INT_ENA_M | UART_FRM_ERR_INT_ENA_M |
+                            UART_RXFIFO_OVF_INT_ENA_M;
+    intr.rxfifo_full_thresh = UART_RX_FULL_THRESH;
+    intr.rx_timeout_thresh = UART_RX_TIMEOUT_THRESH;
+    intr.txfifo_empty_intr_thresh = 10;
+    res = uart_intr_config(port, &intr);
+    assert(res == ESP_OK);
+
+    xTaskCreate(eventTask, "uartWake", 2048, this, 1, NULL);
+}
+
+void ESP32UartStream::eventTask(void *param)
+{
+    ESP32UartStream *s = (ESP32UartStream *)param;
+    uart_event_t event;
+
+    while (true) {
+        if (!xQueueReceive(s->events, &event, portMAX_DELAY))
+            continue;
+
+        switch (event.type) {
+        case UART_DATA: {
+            // The driver hands over a whole FIFO full at a time, so a short chunk means the line went idle
+            size_t len = 0;
+            uart_get_buffered_data_len(s->port, &len);
+            bool idle = event.size < UART_RX_FULL_THRESH, full = len > s->rxBufSize / 2;
+            if (s->wakeMode == UART_WAKE_ALWAYS || (s->wakeMode == UART_WAKE_ON_IDLE && idle) || full)
+                s->wakeReader(); // Our reader will read the whole chunk
+            break;
+        }
+
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            // We fell behind, whatever was in flight is garbage now.  Our reader will resync on its next frame header.
+            uart_flush_input(s->port);
+            xQueueReset(s->events);
+            DEBUG_MSG("uart%d rx overflow, dropped input\n", s->port);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+void ESP32UartStream::wakeReader()
+{
+    if (reader) {
+        reader->setInterval(0);
+        reader->getController()->wake();
+    } else
+        concurrency::mainController.wake();
+}
+
+int ESP32UartStream::available()
+{
+    size_t len = 0;
+    uart_get_buffered_data_len(port, &len);
+    return len + (peeked >= 0 ? 1 : 0);
+}
+
+int ESP32UartStream::read()
+{
+    if (peeked >= 0) {
+        int c = peeked;
+        peeked = -1;
+        return c;
+    }
+
+    uint8_t c;
+    return uart_read_bytes(port, &c, 1, 0) == 1 ? c : -1;
+}
+
+int ESP32UartStream::peek()
+{
+    if (peeked < 0)
+        peeked = read();
+    return peeked;
+}
+
+size_t ESP32UartStream::readBytes(char *buffer, size_t length)
+{
+    size_t n = 0;
+    if (length && peeked >= 0) {
+        buffer[n++] = peeked;
+        peeked = -1;
+    }
+
+    if (n < length) {
+        int r = uart_read_bytes(port, (uint8_t *)buffer + n, length - n, 0); // Never wait, callers check available() first
+        if (r > 0)
+            n += r;
+    }
+    return n;
+}
+
+size_t ESP32UartStream::write(const uint8_t *buffer, size_t size)
+{
+    int r = uart_write_bytes(port, (const char *)buffer, size);
+    return r > 0 ? r : 0;
+}
+
+void ESP32UartStream::flush()
+{
+    uart_wait_tx_done(port, portMAX_DELAY);
+}
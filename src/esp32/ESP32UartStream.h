@@ -0,0 +1,82 @@
+#pragma once
+
+#include "concurrency/OSThread.h"
+#include <Arduino.h>
+#include <driver/uart.h>
+
+/// Bytes the uart driver can buffer for us in each direction
+#ifndef UART_STREAM_RX_BUF_SIZE
+#define UART_STREAM_RX_BUF_SIZE 4096
+#endif
+
+#ifndef UART_STREAM_TX_BUF_SIZE
+#define UART_STREAM_TX_BUF_SIZE 4096
+#endif
+
+/// When to wake our reader about new rx data
+enum UartWakeMode {
+    UART_WAKE_ALWAYS,    // For each chunk the driver moves into our ring
+    UART_WAKE_ON_IDLE,   // Once the line goes idle (i.e. after a device's burst of messages), or our ring is half full
+    UART_WAKE_WHEN_FULL, // Only once our ring is half full
+};
+
+/**
+ * A Stream for our serial API (and GPS) which talks straight to the IDF uart driver, rather than the arduino HardwareSerial
+ * (whose ISR takes an interrupt and a queue push for every byte).
+ *
+ * The driver only interrupts once the hardware FIFO is nearly full, or the line has gone idle for a few byte times (which
+ * is how a frame ends), and then moves a whole chunk into its ring with one copy.  When that happens we wake our reader
+ * thread (or the main loop if there is none), so it can sleep between frames rather than polling us.
+ */
+class ESP32UartStream : public Stream
+{
+    uart_port_t port;
+    size_t rxBufSize, txBufSize;
+    QueueHandle_t events = NULL;
+
+    concurrency::OSThread *reader = NULL;
+    UartWakeMode wakeMode = UART_WAKE_ALWAYS;
+
+    /// For peek(), the driver has no way to look at a byte without taking it
+    int peeked = -1;
+
+  public:
+    /// If txBufSize is 0, writes block until the bytes are in the hardware FIFO
+    ESP32UartStream(uart_port_t _port, size_t _rxBufSize = UART_STREAM_RX_BUF_SIZE, size_t _txBufSize = UART_STREAM_TX_BUF_SIZE)
+        : port(_port), rxBufSize(_rxBufSize), txBufSize(_txBufSize)
+    {
+    }
+
+    /// By default we keep the pins the ROM bootloader set up
+    void begin(unsigned long baud, int rxPin = UART_PIN_NO_CHANGE, int txPin = UART_PIN_NO_CHANGE);
+
+    /**
+     * Set a thread that reads from this stream, it will be scheduled to run ASAP when data arrives (as selected by mode).
+     * If NULL we wake the main loop instead.
+     */
+    void setReader(concurrency::OSThread *t, UartWakeMode mode = UART_WAKE_ALWAYS)
+    {
+        reader = t;
+        wakeMode = mode;
+    }
+
+    virtual int available();
+    virtual int read();
+    virtual int peek();
+    virtual size_t readBytes(char *buffer, size_t length);
+    size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t *buffer, size_t size);
+
+    /// The driver doesn't tell us how full its tx ring is, but writes only block until the ring has room
+    virtual int availableForWrite() { return txBufSize ? txBufSize : UART_FIFO_LEN; }
+
+    virtual void flush();
+
+  private:
+    /// Waits for driver events, so we can wake our reader when data arrives
+    static void eventTask(void *param);
+
+    void wakeReader();
+};
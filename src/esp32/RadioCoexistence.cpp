@@ -0,0 +1,52 @@
+#include "RadioCoexistence.h"
+#include "configuration.h"
+#include "mesh/wifi/WiFiServerAPI.h"
+#include "meshwifi/meshhttp.h"
+#include "meshwifi/meshwifi.h"
+#include "nimble/BluetoothUtil.h"
+#include "nimble/NimbleBluetoothAPI.h"
+
+RadioCoexistence *radioCoexistence;
+
+static const char *preferenceName(esp_coex_prefer_t p)
+{
+    switch (p) {
+    case ESP_COEX_PREFER_WIFI:
+        return "wifi";
+    case ESP_COEX_PREFER_BT:
+        return "ble";
+    default:
+        return "balanced";
+    }
+}
+
+RadioCoexistence::RadioCoexistence() : concurrency::OSThread("Coexistence", COEX_POLL_MSEC) {}
+
+int32_t RadioCoexistence::runOnce()
+{
+    bool bleConnected = curConnectionHandle >= 0 && bluetoothPhoneAPI;
+    bleSyncing = bleConnected && bluetoothPhoneAPI->isSendingConfig();
+
+    bool wifiBusy = isWifiAvailable() && (WiFiServerAPI::getNumConnected() || isWebClientActive(COEX_WEB_ACTIVE_MSEC));
+
+    esp_coex_prefer_t want;
+    if (bleSyncing)
+        want = ESP_COEX_PREFER_BT;
+    else if (wifiBusy)
+        want = ESP_COEX_PREFER_WIFI;
+    else if (bleConnected)
+        want = ESP_COEX_PREFER_BT;
+    else
+        want = ESP_COEX_PREFER_BALANCE;
+
+    if (want != preference) {
+        esp_err_t err = esp_coex_preference_set(want);
+        if (err == ESP_OK) {
+            LOG_DEBUG(HTTP, "Radio coexistence now prefers %s\n", preferenceName(want));
+            preference = want;
+        } else
+            LOG_WARN(HTTP, "Can't set radio coexistence preference, err=%d\n", err);
+    }
+
+    return COEX_POLL_MSEC;
+}
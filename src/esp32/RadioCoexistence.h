@@ -0,0 +1,44 @@
+#pragma once
+
+#include "concurrency/OSThread.h"
+#include <esp_coexist.h>
+
+/// How often we check which of our 2.4 GHz links is busy
+#define COEX_POLL_MSEC 500
+
+/// After an HTTP request we treat the web API as busy for this long (browsers fetch a page's resources in quick bursts)
+#define COEX_WEB_ACTIVE_MSEC (5 * 1000)
+
+/**
+ * WiFi and BLE share the ESP32's one 2.4 GHz radio, which the IDF time slices between them.  Its default (balanced) split
+ * serves neither of our APIs well once both are in use, so we tell the IDF which link matters most right now:
+ *
+ * - A BLE client downloading our config gets the radio, WiFi scans and new TLS handshakes wait until it is done (each of
+ *   those can hold the radio for hundreds of msecs, which stalls the notifies carrying our node DB).
+ * - A BLE client which has finished its sync only needs a slice for the occasional packet, so an active web or TCP API
+ *   client gets the rest.
+ * - Otherwise whichever link has a client is preferred, and with no clients at all we leave the IDF balanced.
+ */
+class RadioCoexistence : private concurrency::OSThread
+{
+    esp_coex_prefer_t preference = ESP_COEX_PREFER_BALANCE;
+
+    bool bleSyncing = false;
+
+  public:
+    RadioCoexistence();
+
+    /// A BLE client is downloading our config, so scans and TLS handshakes should wait
+    bool isBleSyncing() const { return bleSyncing; }
+
+  protected:
+    virtual int32_t runOnce();
+};
+
+extern RadioCoexistence *radioCoexistence;
+
+/// Should WiFi hold off on long radio operations (scans, TLS handshakes) for now?
+inline bool wifiShouldDefer()
+{
+    return radioCoexistence && radioCoexistence->isBleSyncing();
+}
@@ -1,5 +1,6 @@
 #include "SimpleAllocator.h"
 #include "assert.h"
+#include "configuration.h"
 
 
 SimpleAllocator::SimpleAllocator() { reset(); }
@@ -9,7 +10,7 @@ void *SimpleAllocator::alloc(size_t size)
     assert(nextFree + size <= sizeof(bytes));
     void *res = &bytes[nextFree];
     nextFree += size;
-    Serial.printf("Total simple allocs %u\n", nextFree);
+    DEBUG_MSG("Total simple allocs %u\n", nextFree);
 
     return res;
 }
@@ -52,7 +53,7 @@ void *operator new(size_t sz) throw(std::bad_alloc)
 void operator delete(void *ptr) throw()
 {
     if (activeAllocator)
-        Serial.println("Warning: leaking an active allocator object"); // We don't properly handle this yet
+        DEBUG_MSG("Warning: leaking an active allocator object\n"); // We don't properly handle this yet
     else
         free(ptr);
 }
@@ -0,0 +1,103 @@
+#include "UpdateWriter.h"
+#include "configuration.h"
+#include <Update.h>
+
+UpdateWriter updateWriter;
+
+bool UpdateWriter::begin(uint32_t size, int command, UpdateProgressCallback _progress)
+{
+    if (freeBlocks)
+        drain(); // Whatever is left of a previous attempt
+
+    receivedSize = 0;
+    flashedSize = 0;
+    crc.reset();
+    progress = _progress;
+    if (Update.isRunning())
+        Update.abort();
+
+    return init() && Update.begin(size, command);
+}
+
+void UpdateWriter::write(const uint8_t *bytes, size_t len)
+{
+    if (!freeBlocks)
+        return; // No update has begun
+
+    for (size_t done = 0; done < len;) {
+        if (fillBlock < 0) {
+            uint8_t i;
+            xQueueReceive(freeBlocks, &i, portMAX_DELAY); // Only a sender which ignores our window waits here
+            fillBlock = i;
+            blocks[i].len = 0;
+        }
+
+        Block &b = blocks[fillBlock];
+        size_t n = min(len - done, (size_t)(UPDATE_BLOCK_SIZE - b.len));
+        memcpy(b.bytes + b.len, bytes + done, n);
+        b.len += n;
+        done += n;
+        if (b.len == UPDATE_BLOCK_SIZE)
+            submitFillBlock();
+    }
+
+    receivedSize += len;
+}
+
+void UpdateWriter::drain()
+{
+    submitFillBlock();
+    while (flashedSize != receivedSize)
+        vTaskDelay(pdMS_TO_TICKS(5));
+}
+
+void UpdateWriter::submitFillBlock()
+{
+    if (fillBlock < 0)
+        return;
+
+    uint8_t i = fillBlock;
+    fillBlock = -1;
+    xQueueSend(blocks[i].len ? fullBlocks : freeBlocks, &i, portMAX_DELAY);
+}
+
+bool UpdateWriter::init()
+{
+    if (freeBlocks)
+        return true;
+
+    for (uint8_t i = 0; i < UPDATE_NUM_BLOCKS; i++)
+        if (!blocks[i].bytes && !(blocks[i].bytes = (uint8_t *)malloc(UPDATE_BLOCK_SIZE)))
+            return false;
+
+    freeBlocks = xQueueCreate(UPDATE_NUM_BLOCKS, sizeof(uint8_t));
+    fullBlocks = xQueueCreate(UPDATE_NUM_BLOCKS, sizeof(uint8_t));
+    for (uint8_t i = 0; i < UPDATE_NUM_BLOCKS; i++)
+        xQueueSend(freeBlocks, &i, 0);
+
+    xTaskCreate(writerTask, "updateWriter", 4096, this, UPDATE_WRITER_PRIORITY, NULL);
+    return true;
+}
+
+void UpdateWriter::writerTask(void *param)
+{
+    UpdateWriter *w = (UpdateWriter *)param;
+
+    while (true) {
+        uint8_t i;
+        xQueueReceive(w->fullBlocks, &i, portMAX_DELAY);
+        Block &b = w->blocks[i];
+
+        uint16_t len = b.len;
+        w->crc.update(b.bytes, len);
+        if (Update.write(b.bytes, len) != len)
+            LOG_ERROR(MESH, "Update write failed, error %d\n", Update.getError());
+
+        // Free the block before we count it, so a sender which waits for our progress finds room
+        xQueueSend(w->freeBlocks, &i, portMAX_DELAY);
+        w->flashedSize += len;
+
+        if (w->progress)
+            w->progress(w->flashedSize);
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "../freertosinc.h"
+#include <CRC32.h>
+#include <stdint.h>
+
+/// Bytes of data we collect before writing them to flash (a flash sector, so Update erases and writes a sector at a time)
+#ifndef UPDATE_BLOCK_SIZE
+#define UPDATE_BLOCK_SIZE 4096
+#endif
+
+/// How many blocks we have, one being filled while the others wait for (or are being written to) flash
+#ifndef UPDATE_NUM_BLOCKS
+#define UPDATE_NUM_BLOCKS 2
+#endif
+
+/// How many bytes a sender may have in flight beyond what we have written to flash, without write() having to wait
+#define UPDATE_WINDOW (UPDATE_NUM_BLOCKS * UPDATE_BLOCK_SIZE)
+
+/// Our flash writer task runs at the same priority as the main loop
+#define UPDATE_WRITER_PRIORITY 1
+
+/// Called by our writer task each time a block is in flash
+typedef void (*UpdateProgressCallback)(uint32_t flashedBytes);
+
+/**
+ * Feeds a software (or SPIFFS) update to Update from whatever is receiving it (BLE or HTTP), pipelined: write() only copies
+ * the data into one of our blocks, and our own task does the CRC32 and the Update.write() of each full block (which stalls for
+ * the sector's erase), while the receiver carries on filling the next block.
+ *
+ * There is only one Update, so there is only one of us.  Our callers serialize their own calls, one update at a time.
+ */
+class UpdateWriter
+{
+    struct Block {
+        uint8_t *bytes;
+        uint16_t len;
+    };
+    Block blocks[UPDATE_NUM_BLOCKS] = {};
+
+    /// Indexes into blocks: free ones, and full ones waiting for our writer task
+    QueueHandle_t freeBlocks = NULL, fullBlocks = NULL;
+
+    /// The block we are filling, or -1
+    int fillBlock = -1;
+
+    /// Bytes given to write(), and bytes our writer task has written to flash
+    uint32_t receivedSize = 0;
+    volatile uint32_t flashedSize = 0;
+
+    /// Only our writer task touches crc while an update is running
+    CRC32 crc;
+
+    UpdateProgressCallback progress = NULL;
+
+  public:
+    /**
+     * Start an update of size bytes to the app partition (U_FLASH) or SPIFFS (U_SPIFFS), abandoning any update we were
+     * already doing.  progress (if any) is called from our writer task.
+     * @return false if Update can't take it, or we are out of memory
+     */
+    bool begin(uint32_t size, int command, UpdateProgressCallback progress = NULL);
+
+    /// Add the next len bytes of the image, only waits if all of our blocks are full
+    void write(const uint8_t *bytes, size_t len);
+
+    /// Wait until everything we were given is in flash (before Update.end(), or checking our CRC)
+    void drain();
+
+    /// The CRC32 of everything in flash so far, drain() first to have all of it
+    uint32_t getCrc() { return crc.finalize(); }
+
+    uint32_t getReceivedSize() const { return receivedSize; }
+    uint32_t getFlashedSize() const { return flashedSize; }
+
+  private:
+    /// Allocate our blocks and start our writer task, the first time we have an update @return false if we are out of memory
+    bool init();
+
+    /// Hand the block we are filling (if any) to our writer task
+    void submitFillBlock();
+
+    static void writerTask(void *param);
+};
+
+extern UpdateWriter updateWriter;
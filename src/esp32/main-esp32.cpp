@@ -1,5 +1,8 @@
 #include "BluetoothSoftwareUpdate.h"
+#include "CpuGovernor.h"
 #include "PowerFSM.h"
+#include "RadioCoexistence.h"
+#include "concurrency/Periodic.h"
 #include "configuration.h"
 #include "esp_task_wdt.h"
 #include "main.h"
@@ -28,6 +31,16 @@ static void printBLEinfo() {
 
 } */
 
+/// How often we feed our app level watchdog, well inside its APP_WATCHDOG_SECS timeout
+#define WATCHDOG_FEED_MSEC (10 * 1000)
+
+/// Our app level watchdog, fed from a main loop thread so it still catches the main loop hanging
+static int32_t feedWatchdog()
+{
+    esp_task_wdt_reset();
+    return WATCHDOG_FEED_MSEC;
+}
+
 void esp32Setup()
 {
     uint32_t seed = esp_random();
@@ -57,6 +70,10 @@ void esp32Setup()
 
     res = esp_task_wdt_add(NULL);
     assert(res == ESP_OK);
+    new concurrency::Periodic("Watchdog", feedWatchdog);
+
+    radioCoexistence = new RadioCoexistence();
+    cpuGovernor = new CpuGovernor();
 }
 
 #if 0
@@ -80,16 +97,6 @@ Periodic axpDebugOutput(axpDebugRead);
 #endif
 
 /// loop code specific to ESP32 targets
-void esp32Loop()
-{
-    esp_task_wdt_reset(); // service our app level watchdog
-    loopBLE();
-    bluetoothRebootCheck();
-
-    // for debug printing
-    // radio.radioIf.canSleep();
-}
-
 void cpuDeepSleep(uint64_t msecToWake)
 {
     /*
@@ -44,6 +44,18 @@ $PGKC105,8*3F<CR><LF>
 This will set automatic low power mode with waking when we send chars to the serial port.  Possibly do this as soon as we get a
 new location.  When we wake again in a minute we send a character to wake up.
 
+Commands for faster fixes
+Command: 634
+输入 UTC 时间 (input UTC time)
+Arguments: year, month, day, hour, minute, second
+
+Command: 639
+输入参考位置和时间用于快速定位 (input a reference position and time, for a fast first fix)
+Arguments: lat, lon (degrees), alt (meters), year, month, day, hour, minute, second
+
+Example:
+$PGKC639,28.166450,120.389700,0,2017,3,15,12,0,0*33
+
 */
 
 
@@ -64,6 +76,37 @@ void Air530GPS::sendCommand(const char *cmd) {
     // DEBUG_MSG("xsum %02x\n", sum);
 }
 
+/// Format 1e-7 degrees as degrees with 6 decimal places (we don't want to pull in float printf)
+static void formatDegrees(char *buf, size_t len, int32_t deg7)
+{
+    uint32_t mag = deg7 < 0 ? -(int64_t)deg7 : deg7;
+    mag = (mag + 5) / 10; // 1e-6 degrees
+    snprintf(buf, len, "%s%u.%06u", deg7 < 0 ? "-" : "", mag / 1000000, mag % 1000000);
+}
+
+void Air530GPS::aid(const GPSAiding &aiding)
+{
+    if (!aiding.time)
+        return; // Both commands need the time
+
+    time_t secs = aiding.time;
+    struct tm t;
+    gmtime_r(&secs, &t);
+
+    char cmd[96];
+    if (aiding.hasPosition) {
+        char lat[16], lon[16];
+        formatDegrees(lat, sizeof(lat), aiding.latitude);
+        formatDegrees(lon, sizeof(lon), aiding.longitude);
+        snprintf(cmd, sizeof(cmd), "$PGKC639,%s,%s,%d,%d,%d,%d,%d,%d,%d", lat, lon, aiding.altitude, t.tm_year + 1900,
+                 t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+    } else
+        snprintf(cmd, sizeof(cmd), "$PGKC634,%d,%d,%d,%d,%d,%d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min,
+                 t.tm_sec);
+
+    sendCommand(cmd);
+}
+
 void Air530GPS::sleep() {
     NMEAGPS::sleep();
 #ifdef PIN_GPS_WAKE
@@ -16,6 +16,9 @@ class Air530GPS : public NMEAGPS
     /// wake the GPS into normal operation mode
     virtual void wake();
 
+    /// Send our reference position and time (PGKC639), or just our time (PGKC634)
+    virtual void aid(const GPSAiding &aiding);
+
   private:
     /// Send a NMEA cmd with checksum
     void sendCommand(const char *str);
@@ -6,17 +6,64 @@
 #include "sleep.h"
 #include <assert.h>
 
+#ifndef NO_ESP32
+#include "esp32/ESP32UartStream.h"
+#endif
+
 // If we have a serial GPS port it will not be null
-#ifdef GPS_RX_PIN
-HardwareSerial _serial_gps_real(GPS_SERIAL_NUM);
-HardwareSerial *GPS::_serial_gps = &_serial_gps_real;
+#if defined(GPS_RX_PIN) && !defined(NO_ESP32)
+// The uart driver wakes our thread once a burst of messages has arrived, so we don't need to poll it.  GPS commands are
+// short, so we don't need a tx ring.
+static ESP32UartStream gpsUart((uart_port_t)GPS_SERIAL_NUM, 2048, 0);
+Stream *GPS::_serial_gps = &gpsUart;
+#define GPS_UART_EVENTS
+#elif defined(GPS_RX_PIN)
+static HardwareSerial gpsSerial(GPS_SERIAL_NUM);
+static HardwareSerial *gpsHardwareSerial = &gpsSerial;
+Stream *GPS::_serial_gps = &gpsSerial;
 #elif defined(NRF52840_XXAA) || defined(NRF52833_XXAA)
 // Assume NRF52840
-HardwareSerial *GPS::_serial_gps = &Serial1;
+static HardwareSerial *gpsHardwareSerial = &Serial1;
+Stream *GPS::_serial_gps = &Serial1;
 #else
-HardwareSerial *GPS::_serial_gps = NULL;
+static HardwareSerial *gpsHardwareSerial = NULL;
+Stream *GPS::_serial_gps = NULL;
 #endif
 
+/// While awake we have to do our own timeouts (and poll GPSes which can't wake us) at least this often
+#define GPS_AWAKE_CHECK_MSEC 1000
+
+/// 9600bps is approx 1 byte per msec, so considering our buffer size we never need to poll more often than 100ms
+#define GPS_POLL_MSEC 100
+
+/// While asleep we wake up at least this often to see if an inhibited wake is now allowed
+#define GPS_SLEEP_CHECK_MSEC 5000
+
+/// While the GPS sleeps we don't mind starting our next acquisition (or check) this late, so we share a wakeup with other
+/// work (see OSThread::setSlack()).  While it is awake we run on time, to catch its fix as it arrives
+#define GPS_SLEEP_SLACK_MSEC (15 * 1000)
+
+/// Set to 0 to never send our GPS aiding (time and position) as it wakes
+#ifndef GPS_AIDING
+#define GPS_AIDING 1
+#endif
+
+/// How long after waking the GPS we send it aiding (GPSes which wake on serial activity can miss our first chars)
+#define GPS_AID_DELAY_MSEC 100
+
+/// How far off we assume our clock might be, when it was set from our GPS or from the mesh
+#define GPS_AID_GPS_TIME_ACC_SECS 2
+#define GPS_AID_NET_TIME_ACC_SECS 10
+
+/// How far we might have moved since our last position, and how far a neighbor we heard might be from us
+#ifndef GPS_AID_OWN_POS_ACC_METERS
+#define GPS_AID_OWN_POS_ACC_METERS (10 * 1000)
+#endif
+#define GPS_AID_NEIGHBOR_POS_ACC_METERS (50 * 1000)
+
+/// We only seed our position from neighbors we heard this recently (we might have moved since)
+#define GPS_AID_NEIGHBOR_MAX_AGE_SECS (60 * 60)
+
 #ifdef GPS_I2C_ADDRESS
 uint8_t GPS::i2cAddress = GPS_I2C_ADDRESS;
 #else
@@ -33,20 +80,33 @@ bool GPS::setupGPS()
 {
     if (_serial_gps && !didSerialInit) {
         didSerialInit = true;
-        
-#ifdef GPS_RX_PIN
-        _serial_gps->begin(GPS_BAUDRATE, SERIAL_8N1, GPS_RX_PIN, GPS_TX_PIN);
+
+#ifdef GPS_UART_EVENTS
+        gpsUart.begin(GPS_BAUDRATE, GPS_RX_PIN, GPS_TX_PIN);
+#elif defined(GPS_RX_PIN)
+        gpsHardwareSerial->begin(GPS_BAUDRATE, SERIAL_8N1, GPS_RX_PIN, GPS_TX_PIN);
 #else
-        _serial_gps->begin(GPS_BAUDRATE);
-#endif
-#ifndef NO_ESP32
-        _serial_gps->setRxBufferSize(2048); // the default is 256
+        gpsHardwareSerial->begin(GPS_BAUDRATE);
 #endif
     }
 
+#ifdef GPS_UART_EVENTS
+    // Each GPS instance that tries the port (in sequence) becomes its reader
+    gpsUart.setReader(this, isAwake ? UART_WAKE_ON_IDLE : UART_WAKE_WHEN_FULL);
+    serialWakesUs = true;
+#endif
+
     return true;
 }
 
+GPS::~GPS()
+{
+#ifdef GPS_UART_EVENTS
+    if (serialWakesUs)
+        gpsUart.setReader(NULL, UART_WAKE_WHEN_FULL);
+#endif
+}
+
 bool GPS::setup()
 {
     // Master power for the GPS
@@ -119,21 +179,28 @@ void GPS::setNumSatellites(uint8_t n)
 void GPS::setAwake(bool on)
 {
     if (!wakeAllowed && on) {
-        DEBUG_MSG("Inhibiting because !wakeAllowed\n");
+        LOG_DEBUG(GPS, "Inhibiting because !wakeAllowed\n");
         on = false;
     }
 
     if (isAwake != on) {
-        DEBUG_MSG("WANT GPS=%d\n", on);
+        LOG_DEBUG(GPS, "WANT GPS=%d\n", on);
         if (on) {
             lastWakeStartMsec = millis();
             wake();
+            aidPending = GPS_AIDING;
         } else {
             lastSleepStartMsec = millis();
             sleep();
         }
 
         isAwake = on;
+
+#ifdef GPS_UART_EVENTS
+        // While asleep we only want to hear from the port if a GPS that ignores sleep is about to overflow our buffer
+        if (serialWakesUs)
+            gpsUart.setReader(this, on ? UART_WAKE_ON_IDLE : UART_WAKE_WHEN_FULL);
+#endif
     }
 }
 
@@ -187,12 +254,60 @@ uint32_t GPS::getSleepTime() const
     return t;
 }
 
+bool GPS::getAiding(GPSAiding &aiding)
+{
+    memset(&aiding, 0, sizeof(aiding));
+
+    aiding.time = getValidTime(RTCQualityFromNet);
+    aiding.timeAccSecs = getRTCQuality() >= RTCQualityGPS ? GPS_AID_GPS_TIME_ACC_SECS : GPS_AID_NET_TIME_ACC_SECS;
+
+    // Our own last fix (this boot, or in our NodeDB from before, or set by our phone)
+    int32_t lat = latitude, lon = longitude, alt = altitude;
+    if (!lat && !lon) {
+        const NodeInfo *ourNode = nodeDB.getNode(nodeDB.getNodeNum());
+        if (ourNode && ourNode->has_position) {
+            lat = ourNode->position.latitude_i;
+            lon = ourNode->position.longitude_i;
+            alt = ourNode->position.altitude;
+        }
+    }
+    if (lat || lon) {
+        aiding.hasPosition = true;
+        aiding.posAccMeters = GPS_AID_OWN_POS_ACC_METERS;
+    } else {
+        // Whoever we heard most recently, who knows where they are
+        uint32_t bestHeard = 0;
+        for (size_t i = 0; i < nodeDB.getNumNodes(); i++) {
+            const NodeInfo *n = nodeDB.getNodeByIndex(i);
+            uint32_t heard = nodeDB.getLastHeardByIndex(i);
+            if (n->num == nodeDB.getNodeNum() || !n->has_position || (!n->position.latitude_i && !n->position.longitude_i))
+                continue;
+            if (aiding.time && (int32_t)(aiding.time - heard) > GPS_AID_NEIGHBOR_MAX_AGE_SECS)
+                continue;
+            if (heard >= bestHeard) {
+                bestHeard = heard;
+                lat = n->position.latitude_i;
+                lon = n->position.longitude_i;
+                alt = n->position.altitude;
+                aiding.hasPosition = true;
+                aiding.posAccMeters = GPS_AID_NEIGHBOR_POS_ACC_METERS;
+            }
+        }
+    }
+
+    aiding.latitude = lat;
+    aiding.longitude = lon;
+    aiding.altitude = alt;
+
+    return aiding.time || aiding.hasPosition;
+}
+
 void GPS::publishUpdate()
 {
     if (shouldPublish) {
         shouldPublish = false;
 
-        DEBUG_MSG("publishing GPS lock=%d\n", hasLock());
+        LOG_DEBUG(GPS, "publishing GPS lock=%d\n", hasLock());
 
         // Notify any status instances that are observing us
         const meshtastic::GPSStatus status =
@@ -219,6 +334,17 @@ int32_t GPS::runOnce()
 
     // While we are awake
     if (isAwake) {
+        if (aidPending && now - lastWakeStartMsec >= GPS_AID_DELAY_MSEC) {
+            aidPending = false;
+
+            GPSAiding aiding;
+            if (getAiding(aiding)) {
+                LOG_DEBUG(GPS, "Aiding GPS with time=%u (+-%us), pos=%d (%d, %d +-%um)\n", aiding.time, aiding.timeAccSecs,
+                          aiding.hasPosition, aiding.latitude, aiding.longitude, aiding.posAccMeters);
+                aid(aiding);
+            }
+        }
+
         // DEBUG_MSG("looking for location\n");
         if ((now - lastWhileActiveMsec) > 5000) {
             lastWhileActiveMsec = now;
@@ -261,17 +387,25 @@ int32_t GPS::runOnce()
     // If state has changed do a publish
     publishUpdate();
 
-    // 9600bps is approx 1 byte per msec, so considering our buffer size we never need to wake more often than 200ms
-    // if not awake we can run super infrquently (once every 5 secs?) to see if we need to wake.
-    return isAwake ? 100 : 5000;
+    setSlack(isAwake ? 0 : GPS_SLEEP_SLACK_MSEC);
+
+    if (isAwake)
+        return aidPending ? GPS_AID_DELAY_MSEC : serialWakesUs ? GPS_AWAKE_CHECK_MSEC : GPS_POLL_MSEC;
+
+    // Sleep until our next acquisition is due
+    now = millis();
+    if (sleepTime != UINT32_MAX && now - lastSleepStartMsec < sleepTime)
+        return min(sleepTime - (now - lastSleepStartMsec), (uint32_t)INT32_MAX);
+    return GPS_SLEEP_CHECK_MSEC;
 }
 
 void GPS::forceWake(bool on)
 {
     if (on) {
-        DEBUG_MSG("Allowing GPS lock\n");
+        LOG_DEBUG(GPS, "Allowing GPS lock\n");
         // lastSleepStartMsec = 0; // Force an update ASAP
         wakeAllowed = true;
+        setInterval(0); // See if we have a wake we weren't allowed to do
     } else {
         wakeAllowed = false;
 
@@ -284,7 +418,7 @@ void GPS::forceWake(bool on)
 /// Prepare the GPS for the cpu entering deep or light sleep, expect to be gone for at least 100s of msecs
 int GPS::prepareSleep(void *unused)
 {
-    DEBUG_MSG("GPS prepare sleep!\n");
+    LOG_DEBUG(GPS, "GPS prepare sleep!\n");
     forceWake(false);
 
     return 0;
@@ -293,7 +427,7 @@ int GPS::prepareSleep(void *unused)
 /// Prepare the GPS for the cpu entering deep or light sleep, expect to be gone for at least 100s of msecs
 int GPS::prepareDeepSleep(void *unused)
 {
-    DEBUG_MSG("GPS deep sleep!\n");
+    LOG_DEBUG(GPS, "GPS deep sleep!\n");
 
     // For deep sleep we also want abandon any lock attempts (because we want minimum power)
     setAwake(false);
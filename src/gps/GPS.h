@@ -7,6 +7,17 @@
 // Generate a string representation of DOP
 const char *getDOPString(uint32_t dop);
 
+/// What we know before the GPS does, sent to it as it wakes so it can skip most of its search (see GPS::aid)
+struct GPSAiding {
+    uint32_t time;        // secs since 1970, 0 if we don't know it
+    uint32_t timeAccSecs; // How far off time might be
+
+    bool hasPosition;
+    int32_t latitude, longitude; // 1e-7 degrees
+    int32_t altitude;            // meters
+    uint32_t posAccMeters;       // How far from here we might be
+};
+
 /**
  * A gps class that only reads from the GPS periodically (and FIXME - eventually keeps the gps powered down except when reading)
  *
@@ -27,6 +38,8 @@ class GPS : private concurrency::OSThread
 
     bool hasGPS = false; // Do we have a GPS we are talking to
 
+    bool aidPending = false; // We just woke the GPS, and haven't yet given it our time and position
+
     uint8_t numSatellites = 0;
 
     CallbackObserver<GPS, void *> notifySleepObserver = CallbackObserver<GPS, void *>(this, &GPS::prepareSleep);
@@ -34,7 +47,7 @@ class GPS : private concurrency::OSThread
 
   public:
     /** If !NULL we will use this serial port to construct our GPS */
-    static HardwareSerial *_serial_gps;
+    static Stream *_serial_gps;
 
     /** If !0 we will attempt to connect to the GPS over I2C */
     static uint8_t i2cAddress;
@@ -45,9 +58,9 @@ class GPS : private concurrency::OSThread
                           // scaling before use)
     uint32_t heading = 0; // Heading of motion, in degrees * 10^-5
 
-    GPS() : concurrency::OSThread("GPS") {}
+    GPS() : concurrency::OSThread("GPS") { setPriority(concurrency::PRIORITY_BACKGROUND); }
 
-    virtual ~GPS() {} // FIXME, we really should unregister our sleep observer
+    virtual ~GPS(); // FIXME, we really should unregister our sleep observer
 
     /** We will notify this observable anytime GPS state has changed meaningfully */
     Observable<const meshtastic::GPSStatus *> newStatus;
@@ -72,6 +85,9 @@ class GPS : private concurrency::OSThread
     void forceWake(bool on);
 
   protected:
+    /// true if our serial port wakes us when data arrives (so we don't need to poll it)
+    bool serialWakesUs = false;
+
     /// Do gps chipset specific init, return true for success
     virtual bool setupGPS();
 
@@ -82,6 +98,8 @@ class GPS : private concurrency::OSThread
     virtual void wake();
 
     /** Subclasses should look for serial rx characters here and feed it to their GPS parser
+     *
+     * If serialWakesUs, we are called soon after each burst of messages arrives, otherwise we poll.
      *
      * Return true if we received a valid message from the GPS
      */
@@ -106,6 +124,9 @@ class GPS : private concurrency::OSThread
      */
     virtual bool lookForLocation() = 0;
 
+    /// Give the GPS our approximate time and position, shortly after we wake it.  GPSes which can't take aiding ignore this
+    virtual void aid(const GPSAiding &aiding) {}
+
     /// Record that we have a GPS
     void setConnected();
 
@@ -137,6 +158,14 @@ class GPS : private concurrency::OSThread
 
     GpsOperation getGpsOp() const;
 
+    /**
+     * Work out what we can tell the GPS: our clock (mesh or GPS time), and our position from our last fix, or else from the
+     * most recently heard node which has one (anything in LoRa range is close enough to seed a search)
+     *
+     * @return false if we know nothing useful
+     */
+    bool getAiding(GPSAiding &aiding);
+
     /**
      * Tell users we have new GPS readings
      */
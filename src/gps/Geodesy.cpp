@@ -0,0 +1,127 @@
+#include "Geodesy.h"
+#include <math.h>
+
+#define GEO_PI 3.14159265f
+#define GEO_DEG_PER_UNIT 1e-7f                     // Our positions are in 1e-7 degrees
+#define GEO_RAD_PER_UNIT (GEO_DEG_PER_UNIT * GEO_PI / 180)
+
+/// The first quarter of a sine wave, in GEO_SIN_STEPS steps
+#define GEO_SIN_STEPS 64
+static const float sinTable[GEO_SIN_STEPS + 1] = {
+    0.0000000f, 0.0245412f, 0.0490677f, 0.0735646f, 0.0980171f, 0.1224107f, 0.1467305f, 0.1709619f,
+    0.1950903f, 0.2191012f, 0.2429802f, 0.2667128f, 0.2902847f, 0.3136817f, 0.3368899f, 0.3598950f,
+    0.3826834f, 0.4052413f, 0.4275551f, 0.4496113f, 0.4713967f, 0.4928982f, 0.5141027f, 0.5349976f,
+    0.5555702f, 0.5758082f, 0.5956993f, 0.6152316f, 0.6343933f, 0.6531728f, 0.6715590f, 0.6895405f,
+    0.7071068f, 0.7242471f, 0.7409511f, 0.7572088f, 0.7730105f, 0.7883464f, 0.8032075f, 0.8175848f,
+    0.8314696f, 0.8448536f, 0.8577286f, 0.8700870f, 0.8819213f, 0.8932243f, 0.9039893f, 0.9142098f,
+    0.9238795f, 0.9329928f, 0.9415441f, 0.9495282f, 0.9569403f, 0.9637761f, 0.9700313f, 0.9757021f,
+    0.9807853f, 0.9852776f, 0.9891765f, 0.9924795f, 0.9951847f, 0.9972905f, 0.9987955f, 0.9996988f,
+    1.0000000f,
+};
+
+float geoSin(float radians)
+{
+    // Work in units of table steps, there are 4 * GEO_SIN_STEPS in a full turn
+    float t = fmodf(radians * (2 * GEO_SIN_STEPS / GEO_PI), 4 * GEO_SIN_STEPS);
+    if (t < 0)
+        t += 4 * GEO_SIN_STEPS;
+    uint32_t i = (uint32_t)t;
+    float frac = t - i;
+    uint32_t quadrant = (i / GEO_SIN_STEPS) & 3, step = i % GEO_SIN_STEPS;
+
+    // Odd quadrants run the table backwards, the second half of the turn is negative
+    float a, b;
+    if (quadrant & 1) {
+        a = sinTable[GEO_SIN_STEPS - step];
+        b = sinTable[GEO_SIN_STEPS - step - 1];
+    } else {
+        a = sinTable[step];
+        b = sinTable[step + 1];
+    }
+    float v = a + (b - a) * frac;
+    return (quadrant & 2) ? -v : v;
+}
+
+float geoCos(float radians)
+{
+    return geoSin(radians + GEO_PI / 2);
+}
+
+float geoAtan2(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    if (ax == 0 && ay == 0)
+        return 0;
+
+    // atan on [0, 1], then use symmetry for the other octants
+    float z = ax > ay ? ay / ax : ax / ay, z2 = z * z;
+    float a = z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+
+    if (ay > ax)
+        a = GEO_PI / 2 - a;
+    if (x < 0)
+        a = GEO_PI - a;
+    return y < 0 ? -a : a;
+}
+
+/// The difference b - a in our integer units, for longitudes the short way around the globe
+static int32_t lonDelta(int32_t lonA, int32_t lonB)
+{
+    int64_t d = (int64_t)lonB - lonA;
+    if (d > 1800000000LL)
+        d -= 3600000000LL;
+    else if (d < -1800000000LL)
+        d += 3600000000LL;
+    return (int32_t)d;
+}
+
+/// Is this pair close enough for the flat earth approximation?
+static bool isShort(int32_t dLat, int32_t dLon)
+{
+    const int32_t shortUnits = (int32_t)(GEO_SHORT_DEG / GEO_DEG_PER_UNIT);
+    return dLat < shortUnits && dLat > -shortUnits && dLon < shortUnits && dLon > -shortUnits;
+}
+
+/// For the flat earth approximation, the position of b relative to a in meters north and east
+static void flatOffset(int32_t latA, int32_t latB, int32_t dLat, int32_t dLon, float *north, float *east)
+{
+    // The mean latitude, computed in integers so we don't lose precision, is plenty accurate for scaling longitudes
+    float meanLat = (float)(((int64_t)latA + latB) / 2) * GEO_RAD_PER_UNIT;
+    *north = dLat * GEO_RAD_PER_UNIT * GEO_EARTH_RADIUS;
+    *east = dLon * GEO_RAD_PER_UNIT * GEO_EARTH_RADIUS * geoCos(meanLat);
+}
+
+float geoDistanceMeters(int32_t latA, int32_t lonA, int32_t latB, int32_t lonB)
+{
+    int32_t dLat = latB - latA, dLon = lonDelta(lonA, lonB);
+
+    if (isShort(dLat, dLon)) {
+        float north, east;
+        flatOffset(latA, latB, dLat, dLon, &north, &east);
+        return sqrtf(north * north + east * east);
+    }
+
+    // Haversine
+    float lat1 = latA * GEO_RAD_PER_UNIT, lat2 = latB * GEO_RAD_PER_UNIT;
+    float sinHalfLat = geoSin(dLat * (GEO_RAD_PER_UNIT / 2)), sinHalfLon = geoSin(dLon * (GEO_RAD_PER_UNIT / 2));
+    float h = sinHalfLat * sinHalfLat + geoCos(lat1) * geoCos(lat2) * sinHalfLon * sinHalfLon;
+    if (h > 1)
+        h = 1; // Rounding near antipodal points
+    return 2 * GEO_EARTH_RADIUS * geoAtan2(sqrtf(h), sqrtf(1 - h));
+}
+
+float geoBearing(int32_t latA, int32_t lonA, int32_t latB, int32_t lonB)
+{
+    int32_t dLat = latB - latA, dLon = lonDelta(lonA, lonB);
+
+    if (isShort(dLat, dLon)) {
+        float north, east;
+        flatOffset(latA, latB, dLat, dLon, &north, &east);
+        return geoAtan2(east, north);
+    }
+
+    float lat1 = latA * GEO_RAD_PER_UNIT, lat2 = latB * GEO_RAD_PER_UNIT, dLonRad = dLon * GEO_RAD_PER_UNIT;
+    float y = geoSin(dLonRad) * geoCos(lat2);
+    float x = geoCos(lat1) * geoSin(lat2) - geoSin(lat1) * geoCos(lat2) * geoCos(dLonRad);
+    return geoAtan2(y, x);
+}
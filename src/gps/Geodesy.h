@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Distances and bearings between positions, for the UI and for deciding when we've moved.
+ *
+ * Everything takes our integer positions (1e-7 degrees, i.e. Position.latitude_i) directly and works in float32 (our
+ * nRF52s only have a single precision FPU, doubles are emulated in software).  We subtract the integer coordinates before
+ * converting, so small differences keep all of their precision.
+ *
+ * Positions closer than GEO_SHORT_DEG use an equirectangular (flat earth) approximation, which is well under 0.1% off over
+ * that distance.  Further apart we use the haversine formula on a spherical earth.
+ */
+
+/// Positions this close (in degrees of latitude and longitude) are treated as being on a flat earth
+#define GEO_SHORT_DEG 0.1f
+
+/// Earth's mean radius in meters
+#define GEO_EARTH_RADIUS 6371000.0f
+
+/// @return the distance in meters between a and b
+float geoDistanceMeters(int32_t latA, int32_t lonA, int32_t latB, int32_t lonB);
+
+/// @return the bearing from a towards b in radians, 0 means due north and increasing clockwise
+float geoBearing(int32_t latA, int32_t lonA, int32_t latB, int32_t lonB);
+
+/// Table driven sin/cos, good to about 1e-4 (plenty for drawing and navigation), angles in radians
+float geoSin(float radians);
+float geoCos(float radians);
+
+/// A polynomial atan2, good to about 1e-5 radians
+float geoAtan2(float y, float x);
@@ -90,7 +90,7 @@ bool NMEAGPS::lookForLocation()
         foundLocation = true;
 
         // expect gps pos lat=37.520825, lon=-122.309162, alt=158
-        DEBUG_MSG("new NMEA GPS pos lat=%f, lon=%f, alt=%d, hdop=%g, heading=%f\n", latitude * 1e-7, longitude * 1e-7, altitude,
+        LOG_DEBUG(GPS, "new NMEA GPS pos lat=%f, lon=%f, alt=%d, hdop=%g, heading=%f\n", latitude * 1e-7, longitude * 1e-7, altitude,
                   dop * 1e-2, heading * 1e-5);
     }
 
@@ -101,11 +101,15 @@ bool NMEAGPS::whileIdle()
 {
     bool isValid = false;
 
-    // First consume any chars that have piled up at the receiver
-    while (_serial_gps->available() > 0) {
-        int c = _serial_gps->read();
-        // DEBUG_MSG("%c", c);
-        isValid |= reader.encode(c);
+    // First consume any chars that have piled up at the receiver, in chunks so we aren't making a driver call per char
+    uint8_t buf[128];
+    int avail;
+    while ((avail = _serial_gps->available()) > 0) {
+        size_t n = _serial_gps->readBytes(buf, min(avail, (int)sizeof(buf)));
+        for (size_t i = 0; i < n; i++) {
+            // DEBUG_MSG("%c", buf[i]);
+            isValid |= reader.encode(buf[i]);
+        }
     }
 
     return isValid;
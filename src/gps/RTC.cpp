@@ -22,7 +22,7 @@ void readFromRTC()
     if (!gettimeofday(&tv, NULL)) {
         uint32_t now = millis();
 
-        DEBUG_MSG("Read RTC time as %ld (cur millis %u) quality=%d\n", tv.tv_sec, now, currentQuality);
+        LOG_DEBUG(GPS, "Read RTC time as %ld (cur millis %u) quality=%d\n", tv.tv_sec, now, currentQuality);
         timeStartMsec = now;
         zeroOffsetSecs = tv.tv_sec;
     }
@@ -38,11 +38,11 @@ bool perhapsSetRTC(RTCQuality q, const struct timeval *tv)
     if (q > currentQuality) {
         currentQuality = q;
         shouldSet = true;
-        DEBUG_MSG("Upgrading time to RTC %ld secs (quality %d)\n", tv->tv_sec, q);
-    } else if(q == RTCQualityGPS && (now - lastSetMsec) > (12 * 60 * 60 * 1000L)) {
-        // Every 12 hrs we will slam in a new GPS time, to correct for local RTC clock drift
+        LOG_DEBUG(GPS, "Upgrading time to RTC %ld secs (quality %d)\n", tv->tv_sec, q);
+    } else if(q == RTCQualityGPS && (now - lastSetMsec) > RTC_GPS_RESYNC_MSEC) {
+        // Every so often we will slam in a new GPS time, to correct for local RTC clock drift
         shouldSet = true;
-        DEBUG_MSG("Reapplying GPS time to correct clock drift %ld secs\n", tv->tv_sec);
+        LOG_DEBUG(GPS, "Reapplying GPS time to correct clock drift %ld secs\n", tv->tv_sec);
     }
     else
         shouldSet = false;
@@ -52,7 +52,7 @@ bool perhapsSetRTC(RTCQuality q, const struct timeval *tv)
 #ifndef NO_ESP32
         settimeofday(tv, NULL);
 #else
-        DEBUG_MSG("ERROR TIME SETTING NOT IMPLEMENTED!\n");
+        LOG_ERROR(GPS, "ERROR TIME SETTING NOT IMPLEMENTED!\n");
 #endif
         readFromRTC();
         return true;
@@ -90,3 +90,8 @@ uint32_t getValidTime(RTCQuality minQuality)
 {
     return (currentQuality >= minQuality) ? getTime() : 0;
 }
+
+uint64_t getValidTimeMsec(RTCQuality minQuality)
+{
+    return (currentQuality >= minQuality) ? zeroOffsetSecs * 1000 + (millis() - timeStartMsec) : 0;
+}
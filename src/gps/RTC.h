@@ -15,6 +15,15 @@ enum RTCQuality {
     RTCQualityGPS = 2
 };
 
+/// How often we correct our clock from our GPS (slotted transmits need everyone's clocks to agree to within a guard time)
+#ifndef RTC_GPS_RESYNC_MSEC
+#ifdef LORA_SLOTTED_TX
+#define RTC_GPS_RESYNC_MSEC (10 * 60 * 1000L)
+#else
+#define RTC_GPS_RESYNC_MSEC (12 * 60 * 60 * 1000L)
+#endif
+#endif
+
 RTCQuality getRTCQuality();
 
 /// If we haven't yet set our RTC this boot, set it from a GPS derived time
@@ -27,4 +36,7 @@ uint32_t getTime();
 /// Return time since 1970 in secs.  If quality is RTCQualityNone return zero
 uint32_t getValidTime(RTCQuality minQuality);
 
+/// Like getValidTime, but in msecs
+uint64_t getValidTimeMsec(RTCQuality minQuality);
+
 void readFromRTC();
\ No newline at end of file
@@ -4,14 +4,24 @@
 #include "sleep.h"
 #include <assert.h>
 
+#define UBX_SYNC_CHAR1 0xB5
+#define UBX_SYNC_CHAR2 0x62
+#define UBX_CLASS_NAV 0x01
+#define UBX_ID_NAV_PVT 0x07
+#define UBX_CLASS_MGA 0x13
+#define UBX_ID_MGA_INI 0x40
+
+/// If we are in autoPVT mode but haven't heard a NAV-PVT for this long after waking the GPS, we go back to polling
+#define UBX_PVT_TIMEOUT_MSEC (10 * 1000)
+
 UBloxGPS::UBloxGPS() {}
 
 bool UBloxGPS::tryConnect()
 {
     bool c = false;
 
-    if (_serial_gps)
-        c = ublox.begin(*_serial_gps);
+    if (_serial_gps && !skipSerial)
+        c = onSerial = ublox.begin(*_serial_gps);
 
     if (!c && i2cAddress) {
         extern bool neo6M; // Super skanky - if we are talking to the device i2c we assume it is a neo7 on a RAK815, which
@@ -19,6 +29,7 @@ bool UBloxGPS::tryConnect()
         neo6M = true;
 
         c = ublox.begin(Wire, i2cAddress);
+        serialWakesUs = false; // We have to poll i2c
     }
 
     if (c)
@@ -34,13 +45,16 @@ bool UBloxGPS::setupGPS()
     // uncomment to see debug info
     // ublox.enableDebugging(Serial);
 
-    // try a second time, the ublox lib serial parsing is buggy?
-    // see https://github.com/meshtastic/Meshtastic-device/issues/376
-    for (int i = 0; (i < 3) && !tryConnect(); i++)
-        delay(500);
+    connect();
+    if (!isConnected() && skipSerial) {
+        LOG_WARN(GPS, "No UBLOX GPS on i2c, where we found it last boot, trying serial\n");
+        skipSerial = false;
+        connectTries = 3;
+        connect();
+    }
 
     if (isConnected()) {
-        DEBUG_MSG("Connected to UBLOX GPS successfully\n");
+        LOG_DEBUG(GPS, "Connected to UBLOX GPS successfully\n");
 
         if (!setUBXMode())
             recordCriticalError(CriticalErrorCode_UBloxInitFailed); // Don't halt the boot if saving the config fails, but do report the bug
@@ -51,6 +65,16 @@ bool UBloxGPS::setupGPS()
     }
 }
 
+bool UBloxGPS::connect()
+{
+    // try a second time, the ublox lib serial parsing is buggy?
+    // see https://github.com/meshtastic/Meshtastic-device/issues/376
+    for (int i = 0; (i < connectTries) && !tryConnect(); i++)
+        delay(500);
+
+    return isConnected();
+}
+
 bool UBloxGPS::setUBXMode()
 {
     if (_serial_gps) {
@@ -65,8 +89,10 @@ bool UBloxGPS::setUBXMode()
     if (!ublox.setNavigationFrequency(1, 1000)) // Produce 4x/sec to keep the amount of time we stall in getPVT low
         return false;
 
-    // ok = ublox.setAutoPVT(false); // Not implemented on NEO-6M
-    // assert(ok);
+    // Our UART protocol mask above turned NMEA off, now ask for a NAV-PVT with each navigation solution.  We only parse
+    // these ourselves from serial, i2c GPSes keep being polled.  Not implemented on NEO-6M, which will just nak this.
+    autoPVT = onSerial && ublox.setAutoPVT(true, 1000);
+    LOG_INFO(GPS, "UBX NAV-PVT %s\n", autoPVT ? "streaming" : "polling");
     // ok = ublox.setDynamicModel(DYN_MODEL_BIKE); // probably PEDESTRIAN but just in case assume bike speeds
     // assert(ok);
 
@@ -100,7 +126,7 @@ bool UBloxGPS::factoryReset()
     for (int i = 0; (i < 3) && !tryConnect(); i++)
         delay(500);
 
-    DEBUG_MSG("GPS Factory reset success=%d\n", isConnected());
+    LOG_DEBUG(GPS, "GPS Factory reset success=%d\n", isConnected());
     if (isConnected())
         ok = setUBXMode();
 
@@ -110,6 +136,17 @@ bool UBloxGPS::factoryReset()
 /** Idle processing while GPS is looking for lock */
 void UBloxGPS::whileActive()
 {
+    if (autoPVT) {
+        // Nothing to ask for, unless the GPS stopped sending (i.e. it was reset to a config without our NAV-PVT rate)
+        uint32_t now = millis();
+        if (now - wakeMsec < UBX_PVT_TIMEOUT_MSEC || now - lastPvtMsec < UBX_PVT_TIMEOUT_MSEC)
+            return;
+
+        LOG_WARN(GPS, "No UBX NAV-PVT for %u msecs, falling back to polling\n", now - lastPvtMsec);
+        autoPVT = false;
+        ublox.setAutoPVT(false, 0); // Otherwise the library would keep waiting for PVTs rather than asking for them
+    }
+
     ublox.getT(maxWait()); // ask for new time data - hopefully ready when we come back
 
     // Ask for a new position fix - hopefully it will have results ready by next time
@@ -133,6 +170,23 @@ void UBloxGPS::whileActive()
  */
 bool UBloxGPS::lookForTime()
 {
+    if (autoPVT) {
+        if (!pvtNewForTime || (pvt.valid & 0x03) != 0x03) // We need both validDate and validTime
+            return false;
+
+        pvtNewForTime = false;
+        struct tm t;
+        t.tm_sec = pvt.sec;
+        t.tm_min = pvt.min;
+        t.tm_hour = pvt.hour;
+        t.tm_mday = pvt.day;
+        t.tm_mon = pvt.month - 1;
+        t.tm_year = pvt.year - 1900;
+        t.tm_isdst = false;
+        perhapsSetRTC(RTCQualityGPS, t);
+        return true;
+    }
+
     if (ublox.moduleQueried.gpsSecond) {
         /* Convert to unix time
         The Unix epoch (or Unix time or POSIX time or Unix timestamp) is the number of seconds that have elapsed since January
@@ -163,6 +217,29 @@ bool UBloxGPS::lookForLocation()
 {
     bool foundLocation = false;
 
+    if (autoPVT) {
+        if (!pvtNewForLocation)
+            return false;
+        pvtNewForLocation = false;
+
+        fixType = pvt.fixType;
+        setNumSatellites(pvt.numSV);
+        dop = pvt.pDOP; // Same scale as the library's getPDOP
+
+        // 3d fixes only, which the GPS says are within its accuracy limits
+        if (fixType >= 3 && fixType <= 4 && (pvt.flags & 0x01)) {
+            latitude = pvt.lat;
+            longitude = pvt.lon;
+            altitude = pvt.hMSL / 1000; // in mm convert to meters
+            heading = pvt.headMot;
+
+            // Same sanity checks as for polled fixes
+            foundLocation = (latitude != 0) && (longitude != 0) && (latitude <= 900000000 && latitude >= -900000000);
+        }
+
+        return foundLocation;
+    }
+
     if (ublox.moduleQueried.SIV)
         setNumSatellites(ublox.getSIV(0));
 
@@ -192,10 +269,124 @@ bool UBloxGPS::lookForLocation()
 
 bool UBloxGPS::whileIdle()
 {
+    if (autoPVT) {
+        bool gotPVT = false;
+        uint8_t buf[128];
+        int avail;
+        while ((avail = _serial_gps->available()) > 0) {
+            size_t n = _serial_gps->readBytes(buf, min(avail, (int)sizeof(buf)));
+            for (size_t i = 0; i < n; i++)
+                gotPVT |= parseUBX(buf[i]);
+        }
+        return gotPVT;
+    }
+
     // if using i2c or serial look too see if any chars are ready
     return ublox.checkUblox(); // See if new data is available. Process bytes as they come in.
 }
 
+bool UBloxGPS::parseUBX(uint8_t c)
+{
+    // Frames are: sync1, sync2, class, id, length (2 bytes LE), payload, ck_a, ck_b.  The checksum covers class to payload.
+    if (framePos == 0) {
+        if (c == UBX_SYNC_CHAR1)
+            framePos = 1;
+        return false;
+    }
+    if (framePos == 1) {
+        framePos = (c == UBX_SYNC_CHAR2) ? 2 : (c == UBX_SYNC_CHAR1 ? 1 : 0);
+        ckA = ckB = 0;
+        return false;
+    }
+
+    uint16_t i = framePos++ - 2; // Index into class/id/length/payload/checksum
+    if (i < sizeof(frame)) {
+        frame[i] = c;
+        ckA += c;
+        ckB += ckA;
+
+        // We only want NAV-PVT, for anything else just look for the next sync (the checksum protects us from false syncs)
+        bool isPVT = frame[0] == UBX_CLASS_NAV && frame[1] == UBX_ID_NAV_PVT && (frame[2] | (frame[3] << 8)) == sizeof(pvt);
+        if (i == 3 && !isPVT)
+            framePos = 0;
+        return false;
+    }
+
+    if (i == sizeof(frame)) {
+        if (c != ckA)
+            framePos = 0;
+        return false;
+    }
+
+    // The last checksum byte
+    framePos = 0;
+    if (c != ckB)
+        return false;
+
+    memcpy(&pvt, frame + 4, sizeof(pvt));
+    pvtNewForTime = pvtNewForLocation = true;
+    lastPvtMsec = millis();
+    return true;
+}
+
+void UBloxGPS::sendUBX(uint8_t msgClass, uint8_t msgId, const void *payload, uint16_t len)
+{
+    uint8_t header[6] = {UBX_SYNC_CHAR1, UBX_SYNC_CHAR2, msgClass, msgId, (uint8_t)len, (uint8_t)(len >> 8)};
+
+    // The checksum covers class to payload
+    uint8_t a = 0, b = 0;
+    for (int i = 2; i < 6; i++) {
+        a += header[i];
+        b += a;
+    }
+    for (uint16_t i = 0; i < len; i++) {
+        a += ((const uint8_t *)payload)[i];
+        b += a;
+    }
+
+    _serial_gps->write(header, sizeof(header));
+    _serial_gps->write((const uint8_t *)payload, len);
+    _serial_gps->write(a);
+    _serial_gps->write(b);
+}
+
+void UBloxGPS::aid(const GPSAiding &aiding)
+{
+    if (!onSerial)
+        return;
+
+    // Position first, so the GPS has it when the time arrives (which is when it starts its search)
+    if (aiding.hasPosition) {
+        UbxMgaIniPosLlh pos;
+        memset(&pos, 0, sizeof(pos));
+        pos.type = 0x01;
+        pos.lat = aiding.latitude;
+        pos.lon = aiding.longitude;
+        pos.alt = aiding.altitude * 100; // Our altitude is above sea level, but this is far inside posAcc
+        pos.posAcc = aiding.posAccMeters * 100;
+        sendUBX(UBX_CLASS_MGA, UBX_ID_MGA_INI, &pos, sizeof(pos));
+    }
+
+    if (aiding.time) {
+        time_t secs = aiding.time;
+        struct tm t;
+        gmtime_r(&secs, &t);
+
+        UbxMgaIniTimeUtc utc;
+        memset(&utc, 0, sizeof(utc));
+        utc.type = 0x10;
+        utc.leapSecs = -128;
+        utc.year = t.tm_year + 1900;
+        utc.month = t.tm_mon + 1;
+        utc.day = t.tm_mday;
+        utc.hour = t.tm_hour;
+        utc.minute = t.tm_min;
+        utc.second = t.tm_sec;
+        utc.tAccS = aiding.timeAccSecs;
+        sendUBX(UBX_CLASS_MGA, UBX_ID_MGA_INI, &utc, sizeof(utc));
+    }
+}
+
 /// If possible force the GPS into sleep/low power mode
 /// Note: ublox doesn't need a wake method, because as soon as we send chars to the GPS it will wake up
 void UBloxGPS::sleep()
@@ -208,6 +399,8 @@ void UBloxGPS::sleep()
 void UBloxGPS::wake()
 {
     fixType = 0; // assume we hace no fix yet
+    wakeMsec = millis();
+    pvtNewForTime = pvtNewForLocation = false; // Anything we have is from before we slept
 
     setGPSPower(true);
 
@@ -4,9 +4,63 @@
 #include "Observer.h"
 #include "SparkFun_Ublox_Arduino_Library.h"
 
+/// The payload of a UBX NAV-PVT message (see the u-blox 8 protocol spec, section 32.17.14).  Little endian, like our CPUs.
+typedef struct __attribute__((packed)) {
+    uint32_t iTOW;
+    uint16_t year;
+    uint8_t month, day, hour, min, sec;
+    uint8_t valid; // bit 0 validDate, bit 1 validTime
+    uint32_t tAcc;
+    int32_t nano;
+    uint8_t fixType;
+    uint8_t flags; // bit 0 gnssFixOK
+    uint8_t flags2;
+    uint8_t numSV;
+    int32_t lon, lat;    // 1e-7 degrees
+    int32_t height;      // above the ellipsoid, mm
+    int32_t hMSL;        // above mean sea level, mm
+    uint32_t hAcc, vAcc; // mm
+    int32_t velN, velE, velD, gSpeed;
+    int32_t headMot; // heading of motion, 1e-5 degrees
+    uint32_t sAcc, headAcc;
+    uint16_t pDOP; // 0.01
+    uint8_t flags3;
+    uint8_t reserved1[5];
+    int32_t headVeh;
+    int16_t magDec;
+    uint16_t magAcc;
+} UbxNavPvt;
+
+/// The payloads of the UBX MGA-INI messages we send as aiding (see the u-blox 8 protocol spec, section 32.10.15)
+typedef struct __attribute__((packed)) {
+    uint8_t type; // 0x01
+    uint8_t version;
+    uint8_t reserved1[2];
+    int32_t lat, lon; // 1e-7 degrees
+    int32_t alt;      // above the ellipsoid, cm
+    uint32_t posAcc;  // cm
+} UbxMgaIniPosLlh;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type; // 0x10
+    uint8_t version;
+    uint8_t ref;     // 0 means the time is for when the message arrives
+    int8_t leapSecs; // -128 if unknown
+    uint16_t year;
+    uint8_t month, day, hour, minute, second;
+    uint8_t reserved1;
+    uint32_t ns;
+    uint16_t tAccS;
+    uint8_t reserved2[2];
+    uint32_t tAccNs;
+} UbxMgaIniTimeUtc;
+
 /**
  * A gps class that only reads from the GPS periodically (and FIXME - eventually keeps the gps powered down except when reading)
  *
+ * For serial GPSes which support it (not the NEO-6M), we have the GPS send binary NAV-PVT messages as each navigation solution
+ * is ready and decode them ourselves (autoPVT mode).  Otherwise we poll the GPS through the SparkFun library.
+ *
  * When new data is available it will notify observers.
  */
 class UBloxGPS : public GPS
@@ -14,9 +68,34 @@ class UBloxGPS : public GPS
     SFE_UBLOX_GPS ublox;
     uint8_t fixType = 0;
 
+    /// true if we are talking to the GPS over serial (rather than i2c)
+    bool onSerial = false;
+
+    /// If true the GPS sends us NAV-PVT every navigation solution, which we parse ourselves, rather than us polling it
+    bool autoPVT = false;
+
+    /// The last NAV-PVT we received (in autoPVT mode), and whether lookForTime/lookForLocation have seen it yet
+    UbxNavPvt pvt;
+    bool pvtNewForTime = false, pvtNewForLocation = false;
+    uint32_t lastPvtMsec = 0, wakeMsec = 0;
+
+    /// Our UBX frame parser state
+    uint8_t frame[4 + sizeof(UbxNavPvt)]; // class, id, length then payload
+    uint16_t framePos = 0;                // counts from the first sync char
+    uint8_t ckA = 0, ckB = 0;
+
   public:
+    /// How many times setupGPS tries to connect (the ublox lib serial parsing is buggy, so one failure isn't proof)
+    uint8_t connectTries = 3;
+
+    /// Only look on i2c, because that's where we found the GPS last boot (we still try serial if it isn't there)
+    bool skipSerial = false;
+
     UBloxGPS();
 
+    /// true if we are talking to the GPS over serial (rather than i2c)
+    bool isOnSerial() const { return onSerial; }
+
     /**
      * Reset our GPS back to factory settings
      *
@@ -59,13 +138,29 @@ class UBloxGPS : public GPS
     virtual void sleep();
     virtual void wake();
 
+    /// Send MGA-INI time and position (serial only, the library gives us no way to send raw UBX over i2c)
+    virtual void aid(const GPSAiding &aiding);
+
   private:
+    /// Send a UBX frame over serial, adding the sync chars, length and checksum
+    void sendUBX(uint8_t msgClass, uint8_t msgId, const void *payload, uint16_t len);
+
     /// Attempt to connect to our GPS, returns false if no gps is present
     bool tryConnect();
 
+    /// tryConnect up to connectTries times
+    bool connect();
+
     /// Switch to our desired operating mode and save the settings to flash
     /// returns true for success
     bool setUBXMode();
 
     uint16_t maxWait() const { return i2cAddress ? 300 : 0; /*If using i2c we must poll with wait */ }
+
+    /**
+     * Feed one char from the GPS to our UBX parser (which only keeps NAV-PVT messages)
+     *
+     * @return true if it completed a valid NAV-PVT
+     */
+    bool parseUBX(uint8_t c);
 };
@@ -44,6 +44,16 @@ void updateDisplay(uint8_t *blackFrame = framePtr)
 #endif
 }
 
+// The two colour Waveshare panels with a frame memory window and a partial refresh waveform
+#if defined(EPD1IN54_H) || defined(EPD2IN13_H) || defined(EPD2IN9_H)
+#define EINK_HAS_PARTIAL_REFRESH
+#endif
+
+/// Do a full refresh (which flashes the panel, but clears ghosting) after this many partial ones
+#ifndef EINK_FULL_REFRESH_INTERVAL
+#define EINK_FULL_REFRESH_INTERVAL 10
+#endif
+
 EInkDisplay::EInkDisplay(uint8_t address, int sda, int scl)
 {
     setGeometry(GEOMETRY_RAWMODE, EPD_WIDTH, EPD_HEIGHT);
@@ -60,34 +70,50 @@ uint32_t lastDrawMsec;
 bool EInkDisplay::forceDisplay(uint32_t msecLimit)
 {
     // No need to grab this lock because we are on our own SPI bus
-    // concurrency::LockGuard g(spiLock);
+    // SPIBusGuard g(spiLock, SPI_CLIENT_HOST);
 
     uint32_t now = millis();
     uint32_t sinceLast = now - lastDrawMsec;
 
-    if (framePtr && (sinceLast > msecLimit || lastDrawMsec == 0)) {
-        lastDrawMsec = now;
+    if (framePtr && shownBuffer && (sinceLast > msecLimit || lastDrawMsec == 0)) {
+        // Find the window that changed since we last drew, in the page based ordering the OLED lib uses (each byte is a
+        // column of 8 pixels)
+        int16_t x0 = displayWidth, y0 = displayHeight, x1 = -1, y1 = -1;
+        for (uint16_t page = 0; page < displayHeight / 8; page++) {
+            const uint8_t *src = buffer + page * displayWidth, *shown = shownBuffer + page * displayWidth;
+            for (uint16_t x = 0; x < displayWidth; x++)
+                if (src[x] != shown[x]) {
+                    x0 = min(x0, (int16_t)x);
+                    x1 = max(x1, (int16_t)x);
+                    y0 = min(y0, (int16_t)(page * 8));
+                    y1 = max(y1, (int16_t)(page * 8 + 7));
+                }
+        }
+
+        if (x1 < 0 && lastDrawMsec != 0) {
+            // Nothing changed, don't spend seconds (and the power to drive the panel) redrawing the same image.  We leave
+            // lastDrawMsec alone so the next change can be shown as soon as it happens.
+            return false;
+        }
 
-        // FIXME - only draw bits have changed (use backbuf similar to the other displays)
-        // tft.drawBitmap(0, 0, buffer, 128, 64, TFT_YELLOW, TFT_BLACK);
-        for (uint8_t y = 0; y < displayHeight; y++) {
-            for (uint8_t x = 0; x < displayWidth; x++) {
+        lastDrawMsec = now;
+        if (x1 < 0) { // Our first draw, send everything
+            x0 = y0 = 0;
+            x1 = displayWidth - 1;
+            y1 = displayHeight - 1;
+        }
 
-                // get src pixel in the page based ordering the OLED lib uses FIXME, super inefficent
+        // Only convert the pixels that changed to the panel's format, FIXME, still one pixel at a time
+        for (int16_t y = y0; y <= y1; y++) {
+            for (int16_t x = x0; x <= x1; x++) {
                 auto b = buffer[x + (y / 8) * displayWidth];
                 auto isset = b & (1 << (y & 7));
                 frame.drawPixel(x, y, isset ? INK : PAPER);
             }
         }
+        memcpy(shownBuffer, buffer, displayBufferSize);
 
-        ePaper.Reset(); // wake the screen from sleep
-
-        DEBUG_MSG("Updating eink... ");
-        updateDisplay(); // Send image to display and refresh
-        DEBUG_MSG("done\n");
-
-        // Put screen to sleep to save power
-        ePaper.Sleep();
+        refresh(x0, y0, x1, y1);
         return true;
     } else {
         // DEBUG_MSG("Skipping eink display\n");
@@ -95,6 +121,55 @@ bool EInkDisplay::forceDisplay(uint32_t msecLimit)
     }
 }
 
+void EInkDisplay::refresh(int16_t x0, int16_t y0, int16_t x1, int16_t y1)
+{
+#ifdef EINK_HAS_PARTIAL_REFRESH
+    bool full = numPartialRefreshes >= EINK_FULL_REFRESH_INTERVAL;
+#else
+    bool full = true;
+#endif
+
+    if (full) {
+        ePaper.Init(lut_full_update); // wake the screen from sleep
+
+        LOG_DEBUG(SCREEN, "Updating eink (full)... ");
+        updateDisplay(); // Send image to display and refresh
+        LOG_DEBUG(SCREEN, "done\n");
+
+        // The other half of the panel RAM still has our old frame, so the first partial refresh must rewrite all of it
+        numPartialRefreshes = 0;
+        prevX0 = prevY0 = 0;
+        prevX1 = displayWidth - 1;
+        prevY1 = displayHeight - 1;
+    }
+#ifdef EINK_HAS_PARTIAL_REFRESH
+    else {
+        // The panel only takes windows in whole bytes of pixels
+        int16_t wx0 = min(x0, prevX0) & ~7, wx1 = max(x1, prevX1) | 7;
+        int16_t wy0 = min(y0, prevY0), wy1 = max(y1, prevY1);
+        prevX0 = x0;
+        prevY0 = y0;
+        prevX1 = x1;
+        prevY1 = y1;
+
+        ePaper.Init(lut_partial_update); // wake the screen from sleep
+
+        LOG_DEBUG(SCREEN, "Updating eink (partial %d,%d to %d,%d)... ", wx0, wy0, wx1, wy1);
+        // Our frame rows are whole bytes, so send the window a row at a time straight from the frame buffer
+        size_t stride = EPD_WIDTH / 8;
+        for (int16_t y = wy0; y <= wy1; y++)
+            ePaper.SetFrameMemory(framePtr + y * stride + wx0 / 8, wx0, y, wx1 - wx0 + 1, 1);
+        ePaper.DisplayFrame();
+        LOG_DEBUG(SCREEN, "done\n");
+
+        numPartialRefreshes++;
+    }
+#endif
+
+    // Put screen to sleep to save power
+    ePaper.Sleep();
+}
+
 // Write the buffer to the display memory
 void EInkDisplay::display(void)
 {
@@ -115,7 +190,7 @@ void EInkDisplay::sendCommand(uint8_t com)
 // Connect to the display
 bool EInkDisplay::connect()
 {
-    DEBUG_MSG("Doing EInk init\n");
+    LOG_DEBUG(SCREEN, "Doing EInk init\n");
 
 #ifdef PIN_EINK_PWR_ON
     digitalWrite(PIN_EINK_PWR_ON, HIGH); // If we need to assert a pin to power external peripherals
@@ -127,10 +202,9 @@ bool EInkDisplay::connect()
     pinMode(PIN_EINK_EN, OUTPUT);
 #endif
 
-    // Initialise the ePaper library
-    // FIXME - figure out how to use lut_partial_update
+    // Initialise the ePaper library (each refresh initialises it again with whichever waveform that refresh needs)
     if (ePaper.Init(lut_full_update) != 0) {
-        DEBUG_MSG("ePaper init failed\n");
+        LOG_ERROR(SCREEN, "ePaper init failed\n");
         return false;
     } else {
         frame.setColorDepth(1); // Must set the bits per pixel to 1 for ePaper displays
@@ -141,6 +215,12 @@ bool EInkDisplay::connect()
         // Note: always create the Sprite before setting the Sprite rotation
         framePtr = (uint8_t *)frame.createSprite(EPD_WIDTH, EPD_HEIGHT);
 
+        // What the panel is showing, which starts out as paper (i.e. an all clear OLED buffer).  The panel hasn't been drawn
+        // yet, so our first refresh is a full one.
+        if (!shownBuffer)
+            shownBuffer = (uint8_t *)calloc(displayBufferSize, 1);
+        numPartialRefreshes = EINK_FULL_REFRESH_INTERVAL;
+
         frame.fillSprite(PAPER); // Fill frame with white
         /* frame.drawLine(0, 0, frame.width() - 1, frame.height() - 1, INK);
         frame.drawLine(0, frame.height() - 1, frame.width() - 1, 0, INK);
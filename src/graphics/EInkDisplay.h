@@ -5,8 +5,11 @@
 /**
  * An adapter class that allows using the TFT_eSPI library as if it was an OLEDDisplay implementation.
  *
+ * We only refresh the panel when the frame has changed, and where the panel supports it we only rewrite the changed window
+ * and use the (much faster, non flashing) partial refresh waveform.  Every EINK_FULL_REFRESH_INTERVAL partial refreshes we
+ * do a full one, to clear the ghosting partial refreshes leave behind.
+ *
  * Remaining TODO:
- * optimize display() to only draw changed pixels (see other OLED subclasses for examples)
  * implement displayOn/displayOff to turn off the TFT device (and backlight)
  * Use the fast NRF52 SPI API rather than the slow standard arduino version
  *
@@ -17,7 +20,16 @@ class EInkDisplay : public OLEDDisplay
     /// How often should we update the display
     /// thereafter we do once per 5 minutes
     uint32_t slowUpdateMsec = 5 * 60 * 1000;
-    
+
+    /// A copy of the buffer we last sent to the panel, so we can tell what changed
+    uint8_t *shownBuffer = NULL;
+
+    /// How many partial refreshes we have done since our last full one
+    uint32_t numPartialRefreshes = 0;
+
+    /// The panel RAM is double buffered, so a partial refresh must also rewrite whatever area the previous one changed
+    int16_t prevX0 = 0, prevY0 = 0, prevX1 = -1, prevY1 = -1;
+
   public:
     /* constructor
     FIXME - the parameters are not used, just a temporary hack to keep working like the old displays
@@ -34,6 +46,10 @@ class EInkDisplay : public OLEDDisplay
      */
     bool forceDisplay(uint32_t msecLimit = 1000);
 
+  private:
+    /// Clock the changed window of our frame to the panel RAM and refresh
+    void refresh(int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+
   protected:
     // the header size of the buffer used, e.g. for the SPI command header
     virtual int getBufferOffset(void) { return 0; }
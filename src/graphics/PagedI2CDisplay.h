@@ -0,0 +1,126 @@
+#pragma once
+
+#include <OLEDDisplay.h>
+#include <Wire.h>
+
+/// How many display pages (128 bytes each, about 3 msecs at 400 kHz) we send each time our screen thread runs
+#ifndef SCREEN_FLUSH_PAGES
+#define SCREEN_FLUSH_PAGES 2
+#endif
+
+/**
+ * Wraps an I2C OLED driver (SSD1306Wire or SH1106Wire) so that display() doesn't block while the whole frame is clocked out.
+ *
+ * display() only snapshots the pages which changed into our own copy of the frame, so rendering can carry on into the
+ * driver's buffer straight away.  flushPages() then sends a few of those pages each time it is called, and our screen thread
+ * returns to its scheduler in between.  On boards where the screen shares the main loop (nRF52) that keeps the router running
+ * through animations.  Each page goes out whole, so a frame can never tear within a page.
+ *
+ * Neither the ESP32 nor the nRF52 arduino Wire library can start a transfer without waiting for it, so rather than DMA this
+ * splits the blocking transfer into pieces small enough to interleave with everything else.
+ */
+template <class Base, bool isSH1106 = false> class PagedI2CDisplay : public Base
+{
+    uint8_t address;
+
+    /// What the panel shows (or will, once our pending pages are sent)
+    uint8_t *shown = NULL;
+
+    /// Bit n is set if page n of shown still needs sending
+    uint8_t pendingPages = 0;
+
+    /// Some ssd1306 clones discard the first frame they are sent, so we send everything twice after connecting
+    uint8_t fullSendsLeft = 2;
+
+  public:
+    PagedI2CDisplay(uint8_t _address, int sda, int scl) : Base(_address, sda, scl), address(_address) {}
+
+    virtual ~PagedI2CDisplay() { free(shown); }
+
+    /// Snapshot the pages which changed, they are sent by flushPages()
+    virtual void display(void)
+    {
+        if (!shown) {
+            shown = (uint8_t *)calloc(this->displayBufferSize, 1);
+            if (!shown) {
+                Base::display(); // No RAM to spare, fall back to the blocking driver
+                return;
+            }
+            pendingPages = allPages(); // We don't know what the panel RAM holds
+        }
+
+        uint16_t width = this->width();
+        for (uint8_t page = 0; page < this->height() / 8; page++) {
+            uint8_t *src = this->buffer + page * width, *dest = shown + page * width;
+            if (memcmp(src, dest, width)) {
+                memcpy(dest, src, width);
+                pendingPages |= 1 << page;
+            }
+        }
+    }
+
+    /**
+     * Send up to maxPages of our pending pages
+     *
+     * @return true if we still have pages to send
+     */
+    bool flushPages(uint8_t maxPages = SCREEN_FLUSH_PAGES)
+    {
+        if (!shown)
+            return false;
+
+        for (uint8_t page = 0; page < this->height() / 8 && maxPages; page++)
+            if (pendingPages & (1 << page)) {
+                sendPage(page);
+                pendingPages &= ~(1 << page);
+                maxPages--;
+            }
+
+        if (!pendingPages && fullSendsLeft) {
+            fullSendsLeft--;
+            if (fullSendsLeft)
+                pendingPages = allPages();
+        }
+        return pendingPages != 0;
+    }
+
+  private:
+    uint8_t allPages() const { return (1 << (this->height() / 8)) - 1; }
+
+    void sendCmd(uint8_t cmd)
+    {
+        Wire.beginTransmission(address);
+        Wire.write(0x80); // A single command byte
+        Wire.write(cmd);
+        Wire.endTransmission();
+    }
+
+    void sendPage(uint8_t page)
+    {
+        uint16_t width = this->width();
+        uint8_t xOffset = (128 - width) / 2;
+
+        if (isSH1106) {
+            xOffset += 2; // The SH1106 has 132 columns, the panel shows the middle 128
+            sendCmd(0xb0 | page);
+            sendCmd(0x00 | (xOffset & 0x0f));
+            sendCmd(0x10 | (xOffset >> 4));
+        } else {
+            sendCmd(0x21); // COLUMNADDR
+            sendCmd(xOffset);
+            sendCmd(xOffset + width - 1);
+            sendCmd(0x22); // PAGEADDR
+            sendCmd(page);
+            sendCmd(page);
+        }
+
+        // In 16 byte transmissions, which fit every platform's Wire buffer
+        const uint8_t *src = shown + page * width;
+        for (uint16_t x = 0; x < width; x += 16) {
+            Wire.beginTransmission(address);
+            Wire.write(0x40); // Data follows
+            Wire.write(src + x, min((uint16_t)16, (uint16_t)(width - x)));
+            Wire.endTransmission();
+        }
+    }
+};
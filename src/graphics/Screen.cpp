@@ -23,8 +23,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <OLEDDisplay.h>
 
 #include "GPS.h"
+#include "Geodesy.h"
 #include "MeshService.h"
+#include "NeighborTable.h"
 #include "NodeDB.h"
+#include "NodeHistory.h"
+#include "PacketTrace.h"
 #include "Screen.h"
 #include "configuration.h"
 #include "fonts.h"
@@ -46,12 +50,25 @@ namespace graphics
 #define COMPASS_DIAM 44
 
 // DEBUG
-#define NUM_EXTRA_FRAMES 3 // text message and debug frame
+#define NUM_EXTRA_FRAMES 7 // fault, text message, debug, settings, wifi, threads and latency frames
+
+/// How many of a node's latest SNR samples its frame graphs (two pixels apart)
+#define SNR_HISTORY_SAMPLES 32
+
+/// The most node frames we show, for the nodes we heard most recently
+#ifndef SCREEN_MAX_NODE_FRAMES
+#define SCREEN_MAX_NODE_FRAMES 8
+#endif
 // if defined a pixel will blink to show redraws
 // #define SHOW_REDRAWS
 
-// A text message frame + debug frame + all the node infos
-static FrameCallback normalFrames[MAX_NUM_NODES + NUM_EXTRA_FRAMES];
+// A text message frame + debug frame + the node infos
+static FrameCallback normalFrames[SCREEN_MAX_NODE_FRAMES + NUM_EXTRA_FRAMES];
+/// How often each of normalFrames must be redrawn even if we weren't told anything changed, 0 for only when dirty
+static uint16_t normalFrameRefreshMsec[SCREEN_MAX_NODE_FRAMES + NUM_EXTRA_FRAMES];
+static size_t numNormalFrames;
+/// normalFrames[firstNodeFrame + k] shows our k'th most recently heard node
+static size_t firstNodeFrame, numNodeFrames;
 static uint32_t targetFramerate = IDLE_FRAMERATE;
 static char btPIN[16] = "888888";
 
@@ -59,7 +76,7 @@ static char btPIN[16] = "888888";
 uint8_t imgBattery[16] = {0xFF, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0xE7, 0x3C};
 
 // Threshold values for the GPS lock accuracy bar display
-uint32_t dopThresholds[5] = {2000, 1000, 500, 200, 100};
+static const uint32_t dopThresholds[5] = {2000, 1000, 500, 200, 100};
 
 // Stores the last 4 of our hardware ID, to make finding the device for pairing easier
 static char ourId[5];
@@ -332,10 +349,19 @@ static void drawGPSAltitude(OLEDDisplay *display, int16_t x, int16_t y, const GP
     } else {
 
         displayLine = "Altitude: " + String(gps->getAltitude()) + "m";
-        display->drawString(x + (SCREEN_WIDTH - (display->getStringWidth(displayLine))) / 2, y, displayLine);
+        display->drawString(x, y, displayLine);
     }
 }
 
+// Draw packet pool usage (in use/high water mark/failed allocs)
+static void drawPacketPool(OLEDDisplay *display, int16_t x, int16_t y)
+{
+    char poolStr[20];
+    snprintf(poolStr, sizeof(poolStr), "Pkt %u/%u/%u", (unsigned)packetPool.getNumInUse(), (unsigned)packetPool.getMaxInUse(),
+             (unsigned)packetPool.getNumFailed());
+    display->drawString(x + SCREEN_WIDTH - display->getStringWidth(poolStr), y, poolStr);
+}
+
 // Draw GPS status coordinates
 static void drawGPScoordinates(OLEDDisplay *display, int16_t x, int16_t y, const GPSStatus *gps)
 {
@@ -353,62 +379,6 @@ static void drawGPScoordinates(OLEDDisplay *display, int16_t x, int16_t y, const
     }
 }
 
-/// Ported from my old java code, returns distance in meters along the globe
-/// surface (by magic?)
-static float latLongToMeter(double lat_a, double lng_a, double lat_b, double lng_b)
-{
-    double pk = (180 / 3.14169);
-    double a1 = lat_a / pk;
-    double a2 = lng_a / pk;
-    double b1 = lat_b / pk;
-    double b2 = lng_b / pk;
-    double cos_b1 = cos(b1);
-    double cos_a1 = cos(a1);
-    double t1 = cos_a1 * cos(a2) * cos_b1 * cos(b2);
-    double t2 = cos_a1 * sin(a2) * cos_b1 * sin(b2);
-    double t3 = sin(a1) * sin(b1);
-    double tt = acos(t1 + t2 + t3);
-    if (isnan(tt))
-        tt = 0.0; // Must have been the same point?
-
-    return (float)(6366000 * tt);
-}
-
-static inline double toRadians(double deg)
-{
-    return deg * PI / 180;
-}
-
-static inline double toDegrees(double r)
-{
-    return r * 180 / PI;
-}
-
-/**
- * Computes the bearing in degrees between two points on Earth.  Ported from my
- * old Gaggle android app.
- *
- * @param lat1
- * Latitude of the first point
- * @param lon1
- * Longitude of the first point
- * @param lat2
- * Latitude of the second point
- * @param lon2
- * Longitude of the second point
- * @return Bearing between the two points in radians. A value of 0 means due
- * north.
- */
-static float bearing(double lat1, double lon1, double lat2, double lon2)
-{
-    double lat1Rad = toRadians(lat1);
-    double lat2Rad = toRadians(lat2);
-    double deltaLonRad = toRadians(lon2 - lon1);
-    double y = sin(deltaLonRad) * cos(lat2Rad);
-    double x = cos(lat1Rad) * sin(lat2Rad) - (sin(lat1Rad) * cos(lat2Rad) * cos(deltaLonRad));
-    return atan2(y, x);
-}
-
 namespace
 {
 
@@ -423,7 +393,7 @@ class Point
     /// Apply a rotation around zero (standard rotation matrix math)
     void rotate(float radian)
     {
-        float cos = cosf(radian), sin = sinf(radian);
+        float cos = geoCos(radian), sin = geoSin(radian);
         float rx = x * cos - y * sin, ry = x * sin + y * cos;
 
         x = rx;
@@ -456,9 +426,9 @@ static void drawLine(OLEDDisplay *d, const Point &p1, const Point &p2)
  * We keep a series of "after you've gone 10 meters, what is your heading since
  * the last reference point?"
  */
-static float estimatedHeading(double lat, double lon)
+static float estimatedHeading(int32_t lat, int32_t lon)
 {
-    static double oldLat, oldLon;
+    static int32_t oldLat, oldLon;
     static float b;
 
     if (oldLat == 0) {
@@ -469,11 +439,11 @@ static float estimatedHeading(double lat, double lon)
         return b;
     }
 
-    float d = latLongToMeter(oldLat, oldLon, lat, lon);
+    float d = geoDistanceMeters(oldLat, oldLon, lat, lon);
     if (d < 10) // haven't moved enough, just keep current bearing
         return b;
 
-    b = bearing(oldLat, oldLon, lat, lon);
+    b = geoBearing(oldLat, oldLon, lat, lon);
     oldLat = lat;
     oldLon = lon;
 
@@ -487,11 +457,61 @@ static bool hasPosition(NodeInfo *n)
     return n->has_position && (n->position.latitude_i != 0 || n->position.longitude_i != 0);
 }
 
-/// We will skip one node - the one for us, so we just blindly loop over all
-/// nodes
-static size_t nodeIndex;
+/// The frame we last picked a node for
 static int8_t prevFrame = -1;
 
+/**
+ * Which of our node frames is being drawn.  During a transition both frames are drawn with the same state, so if we are
+ * sliding in from a frame which isn't a node frame we must be the frame that is arriving.
+ */
+static size_t getNodeFrameSlot(const OLEDDisplayUiState *state)
+{
+    size_t frame = state->currentFrame;
+    if (state->frameState == IN_TRANSITION && (frame < firstNodeFrame || frame >= firstNodeFrame + numNodeFrames))
+        frame = (frame + state->frameTransitionDirection + numNormalFrames) % numNormalFrames;
+
+    return frame - firstNodeFrame;
+}
+
+/**
+ * Find the node to show on node frame k, nodes are ordered most recently heard first (by the time in their position, as
+ * sinceLastSeen does) and we never show ourselves.
+ *
+ * We keep only the top k + 1 nodes while scanning the DB, so this needs no storage per node and is only called when the
+ * frame changes.
+ *
+ * @return NULL if we don't have that many nodes
+ */
+static NodeInfo *findNodeForSlot(size_t k)
+{
+    size_t top[SCREEN_MAX_NODE_FRAMES]; // Indexes into our NodeDB
+    size_t numTop = 0;
+
+    if (k >= SCREEN_MAX_NODE_FRAMES)
+        return NULL;
+
+    // Only uses the DB's hot arrays, so we don't touch each NodeInfo while scanning
+    for (size_t i = 0; i < nodeDB.getNumNodes(); i++) {
+        if (nodeDB.getNodeNumByIndex(i) == nodeDB.getNodeNum())
+            continue;
+
+        // Insertion sort into our (short) list of the most recently heard
+        uint32_t lastHeard = nodeDB.getLastHeardByIndex(i);
+        size_t pos = numTop;
+        while (pos > 0 && nodeDB.getLastHeardByIndex(top[pos - 1]) < lastHeard)
+            pos--;
+        if (pos > k)
+            continue; // Older than everything we need
+
+        if (numTop <= k)
+            numTop++;
+        memmove(&top[pos + 1], &top[pos], (numTop - 1 - pos) * sizeof(top[0]));
+        top[pos] = i;
+    }
+
+    return k < numTop ? nodeDB.getNodeByIndex(top[k]) : NULL;
+}
+
 // Draw the arrow pointing to a node's location
 static void drawNodeHeading(OLEDDisplay *display, int16_t compassX, int16_t compassY, float headingRadian)
 {
@@ -528,33 +548,65 @@ static void drawCompassHeading(OLEDDisplay *display, int16_t compassX, int16_t c
     drawLine(display, N1, N4);
 }
 
-/// Convert an integer GPS coords to a floating point
-#define DegD(i) (i * 1e-7)
+/// The distance and bearing we last computed for a node frame, reused until either position changes
+static struct {
+    NodeNum node;
+    int32_t lat, lon, ourLat, ourLon;
+    float distance, bearing;
+} nodeGeoCache;
+
+/// Graph a node's latest SNR samples (from NodeHistory) in the space below its frame's numLines lines of text
+static void drawSnrHistory(OLEDDisplay *display, int16_t x, int16_t y, int numLines, NodeNum num)
+{
+    int16_t top = y + numLines * FONT_HEIGHT_SMALL + 1;
+    int16_t height = y + SCREEN_HEIGHT - top - 1;
+    if (height < 4)
+        return; // No room on this display
+
+    static NodeHistorySample samples[SNR_HISTORY_SAMPLES];
+    size_t numSamples = nodeHistory.getNumSamples(num);
+    size_t n = nodeHistory.read(num, 0, numSamples > SNR_HISTORY_SAMPLES ? numSamples - SNR_HISTORY_SAMPLES : 0, samples,
+                                SNR_HISTORY_SAMPLES);
+
+    // The same -10 to +10 dB our signal percentage covers
+    bool first = true;
+    int16_t lastX = 0, lastY = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!(samples[i].flags & NODE_HISTORY_HAS_SNR))
+            continue;
+        int level = clamp(samples[i].snr / 4 + 10, 0, 20);
+        int16_t px = x + 2 * i, py = top + height - 1 - level * (height - 1) / 20;
+        if (first)
+            display->setPixel(px, py);
+        else
+            display->drawLine(lastX, lastY, px, py);
+        first = false;
+        lastX = px;
+        lastY = py;
+    }
+}
 
 static void drawNodeInfo(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
 {
-    // We only advance our nodeIndex if the frame # has changed - because
+    // We only pick our node if the frame # has changed - because
     // drawNodeInfo will be called repeatedly while the frame is shown
-    if (state->currentFrame != prevFrame) {
+    NodeInfo *node = displayedNodeNum ? nodeDB.getNode(displayedNodeNum) : NULL;
+    if (state->currentFrame != prevFrame || !node) {
         prevFrame = state->currentFrame;
 
-        nodeIndex = (nodeIndex + 1) % nodeDB.getNumNodes();
-        NodeInfo *n = nodeDB.getNodeByIndex(nodeIndex);
-        if (n->num == nodeDB.getNodeNum()) {
-            // Don't show our node, just skip to next
-            nodeIndex = (nodeIndex + 1) % nodeDB.getNumNodes();
-            n = nodeDB.getNodeByIndex(nodeIndex);
+        node = findNodeForSlot(getNodeFrameSlot(state));
+        if (!node) {
+            displayedNodeNum = 0; // The DB shrank since our frames were made, we will get a REFRESH_FRAMES soon
+            return;
         }
-        displayedNodeNum = n->num;
+        displayedNodeNum = node->num;
 
         // We just changed to a new node screen, ask that node for updated state if it's older than 2 minutes
-        if (sinceLastSeen(n) > 120) {
+        if (sinceLastSeen(node) > 120) {
             service.sendNetworkPing(displayedNodeNum, true);
         }
     }
 
-    NodeInfo *node = nodeDB.getNodeByIndex(nodeIndex);
-
     display->setFont(FONT_SMALL);
 
     // The coordinates define the left starting point of the text
@@ -562,8 +614,14 @@ static void drawNodeInfo(OLEDDisplay *display, OLEDDisplayUiState *state, int16_
 
     const char *username = node->has_user ? node->user.long_name : "Unknown Name";
 
-    static char signalStr[20];
-    snprintf(signalStr, sizeof(signalStr), "Signal: %d%%", clamp((int)((node->snr + 10) * 5), 0, 100));
+    static char signalStr[32];
+    int signalPercent = clamp((int)((node->snr + 10) * 5), 0, 100);
+    const Neighbor *neighbor = neighbors.find(node->num);
+    if (neighbor) // We can hear them directly, so we also know how lossy the link is
+        snprintf(signalStr, sizeof(signalStr), "Signal: %d%% %d%% lost", signalPercent,
+                 neighbor->rxLoss * 100 / NEIGHBOR_LOSS_SCALE);
+    else
+        snprintf(signalStr, sizeof(signalStr), "Signal: %d%%", signalPercent);
 
     uint32_t agoSecs = sinceLastSeen(node);
     static char lastStr[20];
@@ -586,14 +644,21 @@ static void drawNodeInfo(OLEDDisplay *display, OLEDDisplayUiState *state, int16_
 
     if (ourNode && hasPosition(ourNode)) {
         Position &op = ourNode->position;
-        float myHeading = estimatedHeading(DegD(op.latitude_i), DegD(op.longitude_i));
+        float myHeading = estimatedHeading(op.latitude_i, op.longitude_i);
         drawCompassHeading(display, compassX, compassY, myHeading);
 
         if (hasPosition(node)) {
             // display direction toward node
             hasNodeHeading = true;
             Position &p = node->position;
-            float d = latLongToMeter(DegD(p.latitude_i), DegD(p.longitude_i), DegD(op.latitude_i), DegD(op.longitude_i));
+            if (nodeGeoCache.node != node->num || nodeGeoCache.lat != p.latitude_i || nodeGeoCache.lon != p.longitude_i ||
+                nodeGeoCache.ourLat != op.latitude_i || nodeGeoCache.ourLon != op.longitude_i) {
+                nodeGeoCache = {node->num, p.latitude_i, p.longitude_i, op.latitude_i, op.longitude_i,
+                                geoDistanceMeters(p.latitude_i, p.longitude_i, op.latitude_i, op.longitude_i),
+                                geoBearing(p.latitude_i, p.longitude_i, op.latitude_i, op.longitude_i)};
+            }
+
+            float d = nodeGeoCache.distance;
             if (d < 2000)
                 snprintf(distStr, sizeof(distStr), "%.0f m", d);
             else
@@ -601,7 +666,7 @@ static void drawNodeInfo(OLEDDisplay *display, OLEDDisplayUiState *state, int16_
 
             // FIXME, also keep the guess at the operators heading and add/substract
             // it.  currently we don't do this and instead draw north up only.
-            float bearingToOther = bearing(DegD(p.latitude_i), DegD(p.longitude_i), DegD(op.latitude_i), DegD(op.longitude_i));
+            float bearingToOther = nodeGeoCache.bearing;
             headingRadian = bearingToOther - myHeading;
             drawNodeHeading(display, compassX, compassY, headingRadian);
         }
@@ -615,6 +680,7 @@ static void drawNodeInfo(OLEDDisplay *display, OLEDDisplayUiState *state, int16_
 
     // Must be after distStr is populated
     drawColumns(display, x, y, fields);
+    drawSnrHistory(display, x, y, sizeof(fields) / sizeof(fields[0]) - 1, node->num);
 }
 
 #if 0
@@ -640,9 +706,11 @@ void _screen_header()
 }
 #endif
 
-Screen::Screen(uint8_t address, int sda, int scl) : OSThread("Screen"), cmdQueue(32), dispdev(address, sda, scl), ui(&dispdev)
+Screen::Screen(uint8_t address, int sda, int scl)
+    : OSThread("Screen", 0, &concurrency::hostController), cmdQueue(32), dispdev(address, sda, scl), ui(&dispdev)
 {
     cmdQueue.setReader(this);
+    setPriority(concurrency::PRIORITY_BACKGROUND); // A redraw (and its I2C transfer) can take tens of msecs
 }
 
 /**
@@ -667,15 +735,15 @@ void Screen::handleSetOn(bool on)
 
     if (on != screenOn) {
         if (on) {
-            DEBUG_MSG("Turning on screen\n");
+            LOG_DEBUG(SCREEN, "Turning on screen\n");
             dispdev.displayOn();
             dispdev.displayOn();
-            enabled = true;
+            setEnabled(true);
             setInterval(0); // Draw ASAP
         } else {
-            DEBUG_MSG("Turning off screen\n");
+            LOG_DEBUG(SCREEN, "Turning off screen\n");
             dispdev.displayOff();
-            enabled = false;
+            setEnabled(false);
         }
         screenOn = on;
     }
@@ -761,14 +829,14 @@ int32_t Screen::runOnce()
 {
     // If we don't have a screen, don't ever spend any CPU for us.
     if (!useDisplay) {
-        enabled = false;
+        setEnabled(false);
         return RUN_SAME;
     }
 
     // Show boot screen for first 3 seconds, then switch to normal operation.
     static bool showingBootScreen = true;
     if (showingBootScreen && (millis() > 5000)) {
-        DEBUG_MSG("Done with boot screen...\n");
+        LOG_DEBUG(SCREEN, "Done with boot screen...\n");
         stopBootScreen();
         showingBootScreen = false;
     }
@@ -782,6 +850,7 @@ int32_t Screen::runOnce()
         if (!cmdQueue.dequeue(&cmd, 0)) {
             break;
         }
+        dirty = true; // Any command might change what we show
         switch (cmd.cmd) {
         case Cmd::SET_ON:
             handleSetOn(true);
@@ -800,30 +869,50 @@ int32_t Screen::runOnce()
             setFrames();
             break;
         case Cmd::PRINT:
-            handlePrint(cmd.print_text);
-            free(cmd.print_text);
+            handlePrint(cmd.print_text.start, cmd.print_text.len);
+            break;
+        case Cmd::BLINK:
+            handleBlink();
+            break;
+        case Cmd::ADJUST_BRIGHTNESS:
+            handleAdjustBrightness();
+            break;
+        case Cmd::REFRESH_FRAMES:
+            refreshPending = false; // Any update from now on needs another refresh
+            if (showingNormalScreen)
+                setFrames(); // Regen the list of screens
             break;
         default:
-            DEBUG_MSG("BUG: invalid cmd");
+            LOG_ERROR(SCREEN, "BUG: invalid cmd");
         }
     }
 
     if (!screenOn) { // If we didn't just wake and the screen is still off, then
                      // stop updating until it is on again
-        enabled = false;
+        setEnabled(false);
         return 0;
     }
 
     // this must be before the frameState == FIXED check, because we always
     // want to draw at least one FIXED frame before doing forceDisplay
-    ui.update();
+    if (needsRedraw()) {
+        lastDrawMsec = millis();
+        ui.update();
+    }
+
+#ifdef SCREEN_PAGED_FLUSH
+    // Send a few pages of what we drew, and come back for the rest once everyone else has had a turn
+    bool flushing = dispdev.flushPages();
+#else
+    bool flushing = false;
+#endif
 
     // Switch to a low framerate (to save CPU) when we are not in transition
     // but we should only call setTargetFPS when framestate changes, because
     // otherwise that breaks animations.
     if (targetFramerate != IDLE_FRAMERATE && ui.getUiState()->frameState == FIXED) {
         // oldFrameState = ui.getUiState()->frameState;
-        DEBUG_MSG("Setting idle framerate\n");
+        LOG_DEBUG(SCREEN, "Setting idle framerate\n");
         targetFramerate = IDLE_FRAMERATE;
         ui.setTargetFPS(targetFramerate);
         forceDisplay();
@@ -840,7 +929,21 @@ int32_t Screen::runOnce()
     // soon, otherwise just 1 fps (to save CPU) We also ask to be called twice
     // as fast as we really need so that any rounding errors still result with
     // the correct framerate
-    return (1000 / targetFramerate);
+    return flushing ? 0 : (1000 / targetFramerate);
+}
+
+bool Screen::needsRedraw()
+{
+    // Clear the flag before we draw, so a change that arrives while drawing gets another redraw
+    bool wasDirty = dirty.exchange(false);
+
+    // Transitions, the boot screen and the bluetooth screen animate, so always draw them
+    OLEDDisplayUiState *state = ui.getUiState();
+    if (wasDirty || !showingNormalScreen || state->frameState != FIXED || state->currentFrame >= numNormalFrames)
+        return true;
+
+    uint16_t refreshMsec = normalFrameRefreshMsec[state->currentFrame];
+    return refreshMsec && millis() - lastDrawMsec >= refreshMsec;
 }
 
 void Screen::drawDebugInfoTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
@@ -861,45 +964,80 @@ void Screen::drawDebugInfoWiFiTrampoline(OLEDDisplay *display, OLEDDisplayUiStat
     screen->debugInfo.drawFrameWiFi(display, state, x, y);
 }
 
+void Screen::drawDebugInfoThreadsTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
+{
+    Screen *screen = reinterpret_cast<Screen *>(state->userData);
+    screen->debugInfo.drawFrameThreads(display, state, x, y);
+}
+
+void Screen::drawDebugInfoLatencyTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
+{
+    Screen *screen = reinterpret_cast<Screen *>(state->userData);
+    screen->debugInfo.drawFrameLatency(display, state, x, y);
+}
+
 // restore our regular frame list
 void Screen::setFrames()
 {
-    DEBUG_MSG("showing standard frames\n");
+    LOG_DEBUG(SCREEN, "showing standard frames\n");
     showingNormalScreen = true;
 
-    // We don't show the node info our our node (if we have it yet - we should)
+    // We don't show the node info our our node (if we have it yet - we should), and only show the most recently heard
+    // nodes.  Which node each frame shows is worked out when it is drawn, so this doesn't depend on the size of the DB.
     size_t numnodes = nodeStatus->getNumTotal();
     if (numnodes > 0)
         numnodes--;
+    if (numnodes > SCREEN_MAX_NODE_FRAMES)
+        numnodes = SCREEN_MAX_NODE_FRAMES;
 
     size_t numframes = 0;
 
     // If we have a critical fault, show it first
-    if (myNodeInfo.error_code)
+    if (myNodeInfo.error_code) {
+        normalFrameRefreshMsec[numframes] = 0;
         normalFrames[numframes++] = drawCriticalFaultFrame;
+    }
 
     // If we have a text message - show it next
-    if (devicestate.has_rx_text_message)
+    if (devicestate.has_rx_text_message) {
+        normalFrameRefreshMsec[numframes] = 0;
         normalFrames[numframes++] = drawTextMessageFrame;
+    }
 
-    // then all the nodes
-    for (size_t i = 0; i < numnodes; i++)
+    // then the nodes (which show how long ago we heard them, and a compass)
+    firstNodeFrame = numframes;
+    numNodeFrames = numnodes;
+    for (size_t i = 0; i < numnodes; i++) {
+        normalFrameRefreshMsec[numframes] = 1000;
         normalFrames[numframes++] = drawNodeInfo;
+    }
 
     // then the debug info
     //
     // Since frames are basic function pointers, we have to use a helper to
-    // call a method on debugInfo object.
+    // call a method on debugInfo object.  Everything it shows comes from status updates or prints, which mark us dirty.
+    normalFrameRefreshMsec[numframes] = 0;
     normalFrames[numframes++] = &Screen::drawDebugInfoTrampoline;
 
     // call a method on debugInfoScreen object (for more details)
+    normalFrameRefreshMsec[numframes] = 1000; // shows our uptime
     normalFrames[numframes++] = &Screen::drawDebugInfoSettingsTrampoline;
 
     if (isWifiAvailable()) {
         // call a method on debugInfoScreen object (for more details)
+        normalFrameRefreshMsec[numframes] = 1000; // shows RSSI, which we don't get told about
         normalFrames[numframes++] = &Screen::drawDebugInfoWiFiTrampoline;
     }
 
+    // call a method on debugInfoScreen object (for per thread CPU use)
+    normalFrameRefreshMsec[numframes] = 1000;
+    normalFrames[numframes++] = &Screen::drawDebugInfoThreadsTrampoline;
+
+    // call a method on debugInfoScreen object (for where our packets spend their time)
+    normalFrameRefreshMsec[numframes] = 1000;
+    normalFrames[numframes++] = &Screen::drawDebugInfoLatencyTrampoline;
+
+    numNormalFrames = numframes;
     ui.setFrames(normalFrames, numframes);
     ui.enableAllIndicators();
 
@@ -911,7 +1049,7 @@ void Screen::setFrames()
 
 void Screen::handleStartBluetoothPinScreen(uint32_t pin)
 {
-    DEBUG_MSG("showing bluetooth screen\n");
+    LOG_DEBUG(SCREEN, "showing bluetooth screen\n");
     showingNormalScreen = false;
 
     static FrameCallback btFrames[] = {drawFrameBluetooth};
@@ -923,7 +1061,7 @@ void Screen::handleStartBluetoothPinScreen(uint32_t pin)
     setFastFramerate();
 }
 
-void Screen::blink()
+void Screen::handleBlink()
 {
     setFastFramerate();
     uint8_t count = 10;
@@ -931,20 +1069,50 @@ void Screen::blink()
     while (count > 0) {
         dispdev.fillRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
         dispdev.display();
+        finishDisplay();
         delay(50);
         dispdev.clear();
         dispdev.display();
+        finishDisplay();
         delay(50);
         count = count - 1;
     }
     dispdev.setBrightness(brightness);
 }
 
-void Screen::handlePrint(const char *text)
+void Screen::print(const char *text)
 {
+    ScreenCmd cmd;
+    cmd.cmd = Cmd::PRINT;
+    cmd.print_text.len = min(strlen(text), (size_t)SCREEN_CONSOLE_MAX_LINE);
+
+    {
+        concurrency::LockGuard g(&consoleLock);
+        cmd.print_text.start = consoleEnd;
+        for (uint16_t i = 0; i < cmd.print_text.len; i++)
+            consoleRing[(consoleEnd + i) % SCREEN_CONSOLE_SIZE] = text[i];
+        consoleEnd += cmd.print_text.len;
+    }
+
+    enqueueCmd(cmd); // If the queue is full the text is simply overwritten later
+}
+
+void Screen::handlePrint(uint32_t start, uint16_t len)
+{
+    char text[SCREEN_CONSOLE_MAX_LINE + 1];
+    {
+        concurrency::LockGuard g(&consoleLock);
+        if (consoleEnd - start > SCREEN_CONSOLE_SIZE)
+            return; // Newer text has already overwritten this line, it would have scrolled off anyway
+
+        for (uint16_t i = 0; i < len; i++)
+            text[i] = consoleRing[(start + i) % SCREEN_CONSOLE_SIZE];
+        text[len] = '\0';
+    }
+
     // the string passed into us probably has a newline, but that would confuse the logging system
     // so strip it
-    DEBUG_MSG("Screen: %.*s\n", strlen(text) - 1, text);
+    LOG_DEBUG(SCREEN, "Screen: %.*s\n", strlen(text) - 1, text);
     if (!useDisplay || !showingNormalScreen)
         return;
 
@@ -968,7 +1136,7 @@ void Screen::handleOnPress()
 
 void Screen::setFastFramerate()
 {
-    DEBUG_MSG("Setting fast framerate\n");
+    LOG_DEBUG(SCREEN, "Setting fast framerate\n");
 
     // We are about to start a transition so speed up fps
     targetFramerate = SCREEN_TRANSITION_FRAMERATE;
@@ -1221,6 +1389,7 @@ void DebugInfo::drawFrameSettings(OLEDDisplay *display, OLEDDisplayUiState *stat
 
     // Line 3
     drawGPSAltitude(display, x, y + FONT_HEIGHT_SMALL * 2, gpsStatus);
+    drawPacketPool(display, x, y + FONT_HEIGHT_SMALL * 2);
 
     // Line 4
     drawGPScoordinates(display, x, y + FONT_HEIGHT_SMALL * 3, gpsStatus);
@@ -1232,8 +1401,78 @@ void DebugInfo::drawFrameSettings(OLEDDisplay *display, OLEDDisplayUiState *stat
     heartbeat = !heartbeat;
 #endif
 }
+void DebugInfo::drawFrameThreads(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
+{
+    displayedNodeNum = 0; // Not currently showing a node pane
+
+    display->setFont(FONT_SMALL);
+    display->setTextAlignment(TEXT_ALIGN_LEFT);
+
+    // Show the threads which have used the most CPU, as a percentage of our uptime along with their worst case run
+    const size_t numLines = 4;
+    concurrency::OSThread *top[numLines] = {};
+    for (size_t i = 0; i < concurrency::mainController.getNumThreads(); i++) {
+        concurrency::OSThread *t = concurrency::mainController.getThread(i);
+        for (size_t n = 0; n < numLines; n++)
+            if (!top[n] || t->getTotalRunMicros() > top[n]->getTotalRunMicros()) {
+                memmove(top + n + 1, top + n, (numLines - n - 1) * sizeof(top[0]));
+                top[n] = t;
+                break;
+            }
+    }
+
+    display->drawString(x, y, "Thread   CPU   max");
+
+    uint64_t uptimeMicros = (uint64_t)millis() * 1000;
+    for (size_t n = 0; n < numLines && top[n]; n++) {
+        char line[32];
+        uint32_t permille = uptimeMicros ? (top[n]->getTotalRunMicros() * 1000) / uptimeMicros : 0;
+        snprintf(line, sizeof(line), "%-8.8s %2u.%u%% %4ums", top[n]->ThreadName.c_str(), permille / 10, permille % 10,
+                 top[n]->getMaxRunMicros() / 1000);
+        display->drawString(x, y + FONT_HEIGHT_SMALL * (n + 1), line);
+    }
+}
+
+void DebugInfo::drawFrameLatency(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y)
+{
+    displayedNodeNum = 0; // Not currently showing a node pane
+
+    display->setFont(FONT_SMALL);
+    display->setTextAlignment(TEXT_ALIGN_LEFT);
+
+    // Show the stages where packets have spent the most time in total, with their typical and worst case latency
+    const size_t numLines = 4;
+    TraceHistogram h[TRACE_NUM_STAGES];
+    TraceStage top[numLines];
+    size_t numTop = 0;
+    for (int i = 0; i < TRACE_NUM_STAGES; i++) {
+        h[i] = packetTrace.getHistogram((TraceStage)i);
+        if (!h[i].count)
+            continue;
+
+        size_t n = 0;
+        while (n < numTop && h[top[n]].totalUsec >= h[i].totalUsec)
+            n++;
+        if (n < numLines) {
+            memmove(top + n + 1, top + n, (min(numTop, numLines - 1) - n) * sizeof(top[0]));
+            top[n] = (TraceStage)i;
+            numTop = min(numTop + 1, numLines);
+        }
+    }
+
+    display->drawString(x, y, "Stage     p50   max");
+
+    for (size_t n = 0; n < numTop; n++) {
+        const TraceHistogram &s = h[top[n]];
+        char line[32];
+        snprintf(line, sizeof(line), "%-9.9s %4ums %4ums", PacketTrace::getStageName(top[n]), s.getPercentileUsec(50) / 1000,
+                 s.maxUsec / 1000);
+        display->drawString(x, y + FONT_HEIGHT_SMALL * (n + 1), line);
+    }
+}
+
 // adjust Brightness cycle trough 1 to 254 as long as attachDuringLongPress is true
-void Screen::adjustBrightness()
+void Screen::handleAdjustBrightness()
 {
     if (brightness == 254) {
         brightness = 0;
@@ -1250,11 +1489,11 @@ void Screen::adjustBrightness()
 int Screen::handleStatusUpdate(const meshtastic::Status *arg)
 {
     // DEBUG_MSG("Screen got status update %d\n", arg->getStatusType());
+    dirty = true; // Our debug frame shows all of the power, GPS and node status
     switch (arg->getStatusType()) {
     case STATUS_TYPE_NODE:
-        if (showingNormalScreen && nodeStatus->getLastNumTotal() != nodeStatus->getNumTotal()) {
-            setFrames(); // Regen the list of screens
-        }
+        if (nodeStatus->getLastNumTotal() != nodeStatus->getNumTotal())
+            requestRefreshFrames();
         nodeDB.updateGUI = false;
         break;
     }
@@ -1264,11 +1503,16 @@ int Screen::handleStatusUpdate(const meshtastic::Status *arg)
 
 int Screen::handleTextMessage(const MeshPacket *arg)
 {
-    if (showingNormalScreen) {
-        setFrames(); // Regen the list of screens (will show new text message)
-    }
+    dirty = true;
+    requestRefreshFrames(); // Will show the new text message
 
     return 0;
 }
 
+void Screen::requestRefreshFrames()
+{
+    if (!refreshPending.exchange(true) && !enqueueCmd(ScreenCmd{.cmd = Cmd::REFRESH_FRAMES}))
+        refreshPending = false; // Our queue was full, let the next update try again
+}
+
 } // namespace graphics
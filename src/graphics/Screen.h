@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstring>
 
 #include <OLEDDisplayUi.h>
@@ -13,6 +14,7 @@
 #endif
 
 #include "EInkDisplay.h"
+#include "PagedI2CDisplay.h"
 #include "TFTDisplay.h"
 #include "TypedQueue.h"
 #include "commands.h"
@@ -21,6 +23,19 @@
 #include "power.h"
 #include <string>
 
+// Our I2C OLEDs send their frames a few pages at a time (see PagedI2CDisplay)
+#if !defined(ST7735_CS) && !defined(HAS_EINK) && !defined(USE_ST7567)
+#define SCREEN_PAGED_FLUSH
+#endif
+
+/// Bytes of text print() can hold until our thread shows it, new text overwrites the oldest
+#ifndef SCREEN_CONSOLE_SIZE
+#define SCREEN_CONSOLE_SIZE 256
+#endif
+
+/// The longest single print() we show, the rest is cut off
+#define SCREEN_CONSOLE_MAX_LINE 64
+
 // 0 to 255, though particular variants might define different defaults
 #ifndef BRIGHTNESS_DEFAULT
 #define BRIGHTNESS_DEFAULT 150
@@ -55,6 +70,8 @@ class DebugInfo
     void drawFrame(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
     void drawFrameSettings(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
     void drawFrameWiFi(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
+    void drawFrameThreads(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
+    void drawFrameLatency(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
 
     std::string channelName;
 
@@ -107,13 +124,14 @@ class Screen : public concurrency::OSThread
      */
     void doDeepSleep();
 
-    void blink();
+    /// Flash the whole screen, so the user can tell which device this is
+    void blink() { enqueueCmd(ScreenCmd{.cmd = Cmd::BLINK}); }
 
     /// Handles a button press.
     void onPress() { enqueueCmd(ScreenCmd{.cmd = Cmd::ON_PRESS}); }
 
     // Implementation to Adjust Brightness
-    void adjustBrightness();
+    void adjustBrightness() { enqueueCmd(ScreenCmd{.cmd = Cmd::ADJUST_BRIGHTNESS}); }
     uint8_t brightness = BRIGHTNESS_DEFAULT;
 
     /// Starts showing the Bluetooth PIN screen.
@@ -134,19 +152,8 @@ class Screen : public concurrency::OSThread
     /// Stops showing the boot screen.
     void stopBootScreen() { enqueueCmd(ScreenCmd{.cmd = Cmd::STOP_BOOT_SCREEN}); }
 
-    /// Writes a string to the screen.
-    void print(const char *text)
-    {
-        ScreenCmd cmd;
-        cmd.cmd = Cmd::PRINT;
-        // TODO(girts): strdup() here is scary, but we can't use std::string as
-        // FreeRTOS queue is just dumbly copying memory contents. It would be
-        // nice if we had a queue that could copy objects by value.
-        cmd.print_text = strdup(text);
-        if (!enqueueCmd(cmd)) {
-            free(cmd.print_text);
-        }
-    }
+    /// Writes a string to the screen (from any thread, but not an ISR)
+    void print(const char *text);
 
     /// Overrides the default utf8 character conversion, to replace empty space with question marks
     static char customFontTableLookup(const uint8_t ch)
@@ -201,10 +208,20 @@ class Screen : public concurrency::OSThread
     /// Used to force (super slow) eink displays to draw critical frames
     void forceDisplay();
 
+    /// Wait until what we last drew is on the panel (for the few places which draw and then pause, i.e. handleBlink())
+    void finishDisplay()
+    {
+#ifdef SCREEN_PAGED_FLUSH
+        while (dispdev.flushPages())
+            ;
+#endif
+    }
+
   protected:
     /// Updates the UI.
     //
-    // Called periodically from the main loop.
+    // Called periodically from hostController (so on HOST_CORE where we have one), which is why everyone else talks to us via
+    // cmdQueue.
     int32_t runOnce() final;
 
   private:
@@ -212,7 +229,10 @@ class Screen : public concurrency::OSThread
         Cmd cmd;
         union {
             uint32_t bluetooth_pin;
-            char *print_text;
+            struct {
+                uint32_t start; // Offset of the text in consoleRing (counting every byte ever written, so it never wraps)
+                uint16_t len;
+            } print_text;
         };
     };
 
@@ -222,9 +242,9 @@ class Screen : public concurrency::OSThread
         if (!useDisplay)
             return true; // claim success if our display is not in use
         else {
-            bool success = cmdQueue.enqueue(cmd, 0);
-            enabled = true; // handle ASAP (we are the registered reader for cmdQueue, but might have been disabled)
-            return success;
+            // Enable before we enqueue (which wakes hostController), or it might look at us while we are still disabled
+            setEnabled(true); // handle ASAP (we are the registered reader for cmdQueue, but might have been disabled)
+            return cmdQueue.enqueue(cmd, 0);
         }
     }
 
@@ -232,7 +252,9 @@ class Screen : public concurrency::OSThread
     void handleSetOn(bool on);
     void handleOnPress();
     void handleStartBluetoothPinScreen(uint32_t pin);
-    void handlePrint(const char *text);
+    void handlePrint(uint32_t start, uint16_t len);
+    void handleBlink();
+    void handleAdjustBrightness();
 
     /// Rebuilds our list of frames (screens) to default ones.
     void setFrames();
@@ -240,6 +262,9 @@ class Screen : public concurrency::OSThread
     /// Try to start drawing ASAP
     void setFastFramerate();
 
+    /// Does the frame we are showing need to be rendered again (i.e. because something it shows changed)?
+    bool needsRedraw();
+
     /// Called when debug screen is to be drawn, calls through to debugInfo.drawFrame.
     static void drawDebugInfoTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
 
@@ -247,12 +272,33 @@ class Screen : public concurrency::OSThread
 
     static void drawDebugInfoWiFiTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
 
+    static void drawDebugInfoThreadsTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
+
+    static void drawDebugInfoLatencyTrampoline(OLEDDisplay *display, OLEDDisplayUiState *state, int16_t x, int16_t y);
+
     /// Queue of commands to execute in doTask.
     TypedQueue<ScreenCmd> cmdQueue;
+
+    /// The text of our PRINT commands, so printing never touches the heap
+    char consoleRing[SCREEN_CONSOLE_SIZE];
+    /// How many bytes have ever been written to consoleRing, anything older than SCREEN_CONSOLE_SIZE bytes is gone
+    uint32_t consoleEnd = 0;
+    /// Protects consoleRing, print() can be called from any thread
+    concurrency::Lock consoleLock;
+
+    /// Set while a REFRESH_FRAMES is waiting in cmdQueue, so a burst of updates only regenerates our frames once
+    std::atomic<bool> refreshPending{false};
+
+    /// Queue a REFRESH_FRAMES, unless one is already waiting
+    void requestRefreshFrames();
     /// Whether we are using a display
     bool useDisplay = false;
     /// Whether the display is currently powered
     bool screenOn = false;
+    /// Set (from any thread) when something a frame might show has changed, cleared when we redraw
+    std::atomic<bool> dirty{true};
+    /// When we last rendered a frame, in msecs
+    uint32_t lastDrawMsec = 0;
     // Whether we are showing the regular screen (as opposed to booth screen or
     // Bluetooth PIN screen)
     bool showingNormalScreen = false;
@@ -267,11 +313,11 @@ class Screen : public concurrency::OSThread
 #elif defined(HAS_EINK)
     EInkDisplay dispdev;
 #elif defined(USE_SH1106)
-    SH1106Wire dispdev;
+    PagedI2CDisplay<SH1106Wire, true> dispdev;
 #elif defined(USE_ST7567)
     ST7567Wire dispdev;
 #else
-    SSD1306Wire dispdev;
+    PagedI2CDisplay<SSD1306Wire> dispdev;
 #endif
     /// UI helper for rendering to frames and switching between them
     OLEDDisplayUi ui;
@@ -16,11 +16,12 @@ TFTDisplay::TFTDisplay(uint8_t address, int sda, int scl)
 // Write the buffer to the display memory
 void TFTDisplay::display(void)
 {
-    concurrency::LockGuard g(spiLock);
+    SPIBusGuard g(spiLock, SPI_CLIENT_HOST);
 
     // FIXME - only draw bits have changed (use backbuf similar to the other displays)
     // tft.drawBitmap(0, 0, buffer, 128, 64, TFT_YELLOW, TFT_BLACK);
     for (uint8_t y = 0; y < displayHeight; y++) {
+        spiLock->yieldToRadio(); // A whole frame takes far longer than the radio can wait, each pixel is its own transaction
         for (uint8_t x = 0; x < displayWidth; x++) {
 
             // get src pixel in the page based ordering the OLED lib uses FIXME, super inefficent
@@ -41,7 +42,7 @@ void TFTDisplay::sendCommand(uint8_t com)
 // Connect to the display
 bool TFTDisplay::connect()
 {
-    DEBUG_MSG("Doing TFT init\n");
+    LOG_DEBUG(SCREEN, "Doing TFT init\n");
 
 #ifdef ST7735_BACKLIGHT_EN
     digitalWrite(ST7735_BACKLIGHT_EN, HIGH);
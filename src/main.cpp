@@ -1,10 +1,18 @@
 
 #include "Air530GPS.h"
+#include "Benchmarks.h"
+#include "BootTimer.h"
+#include "ChannelSurvey.h"
+#include "CryptoEngine.h"
+#include "HardwareCache.h"
+#include "MemoryMonitor.h"
 #include "MeshRadio.h"
 #include "MeshService.h"
 #include "NodeDB.h"
+#include "NoiseMonitor.h"
 #include "PowerFSM.h"
 #include "UBloxGPS.h"
+#include "WarmBoot.h"
 #include "airtime.h"
 #include "configuration.h"
 #include "error.h"
@@ -15,6 +23,7 @@
 #include "FSCommon.h"
 #include "RTC.h"
 #include "SPILock.h"
+#include "concurrency/MainThread.h"
 #include "concurrency/OSThread.h"
 #include "concurrency/Periodic.h"
 #include "graphics/Screen.h"
@@ -22,6 +31,7 @@
 #include "meshwifi/meshhttp.h"
 #include "meshwifi/meshwifi.h"
 #include "sleep.h"
+#include "plugins/PerfQueryPlugin.h"
 #include "plugins/Plugins.h"
 #include "target_specific.h"
 #include <OneButton.h>
@@ -35,6 +45,16 @@
 #include "RF95Interface.h"
 #include "SX1262Interface.h"
 
+#ifdef USE_SIM_RADIO
+#include "portduino/SimRadio.h"
+#endif
+
+#ifdef PORTDUINO
+#include "portduino/EpollServerAPI.h"
+#include "portduino/PacketArchive.h"
+#include "portduino/UdpMulticastInterface.h"
+#endif
+
 #ifdef NRF52_SERIES
 #include "variant.h"
 #endif
@@ -268,12 +288,115 @@ class ButtonThread : public OSThread
     }
 };
 
-static Periodic *ledPeriodic;
+static Periodic *ledPeriodic, *gpsProbePeriodic;
 static OSThread *powerFSMthread, *buttonThread;
 uint32_t ButtonThread::longPressTime = 0;
 
 RadioInterface *rIf = NULL;
 
+/**
+ * Look for our GPS.  The probes can take seconds to time out, and nothing else in setup() needs the GPS, so we do this from
+ * the scheduler once setup() is done (after our radio is already receiving).
+ */
+static int32_t probeGPS()
+{
+    HardwareGPS cachedGPS = hardwareCache.getGPS();
+
+    // If we don't have bidirectional comms, we can't even try talking to UBLOX
+    UBloxGPS *ublox = NULL;
+#ifdef GPS_TX_PIN
+    // Init GPS - first try ublox
+    ublox = new UBloxGPS();
+    if (cachedGPS == HW_GPS_UBLOX_I2C)
+        ublox->skipSerial = true;
+    else if (cachedGPS == HW_GPS_NMEA)
+        ublox->connectTries = 1; // It didn't answer last boot either, one try is enough to notice if it has been replaced
+    gps = ublox;
+    if (!gps->setup()) {
+        DEBUG_MSG("ERROR: No UBLOX GPS found\n");
+
+        delete ublox;
+        gps = ublox = NULL;
+    }
+#endif
+
+    if (!gps && GPS::_serial_gps) {
+        // Some boards might have only the TX line from the GPS connected, in that case, we can't configure it at all.  Just
+        // assume NMEA at 9600 baud.
+        // dumb NMEA access only work for serial GPSes)
+        DEBUG_MSG("Hoping that NMEA might work\n");
+
+#ifdef HAS_AIR530_GPS
+        gps = new Air530GPS();
+#else
+        gps = new NMEAGPS();
+#endif
+        gps->setup();
+    }
+
+    hardwareCache.foundGPS(ublox ? (ublox->isOnSerial() ? HW_GPS_UBLOX_SERIAL : HW_GPS_UBLOX_I2C)
+                                 : gps ? HW_GPS_NMEA : HW_GPS_UNKNOWN);
+
+    if (gps) {
+        gpsStatus->observe(&gps->newStatus);
+        service.startGPS();
+    } else
+        DEBUG_MSG("Warning: No GPS found - running without GPS\n");
+
+    // ONCE we will factory reset the GPS for bug #327
+    if (ublox && !devicestate.did_gps_reset) {
+        if (ublox->factoryReset()) { // If we don't succeed try again next time
+            devicestate.did_gps_reset = true;
+            nodeDB.requestSave();
+        }
+    }
+
+    bootTimer.phaseDone("gps");
+    return 0; // Only once
+}
+
+/**
+ * Try to bring up a radio of the given kind
+ *
+ * @return false if it didn't answer, or this build has no such radio
+ */
+static bool initRadio(HardwareRadio kind)
+{
+    const char *name;
+    switch (kind) {
+#if defined(RF95_IRQ)
+    case HW_RADIO_RF95:
+        rIf = new RF95Interface(RF95_NSS, RF95_IRQ, RF95_RESET, SPI);
+        name = "RF95";
+        break;
+#endif
+#if defined(SX1262_CS)
+    case HW_RADIO_SX1262:
+        rIf = new SX1262Interface(SX1262_CS, SX1262_DIO1, SX1262_RESET, SX1262_BUSY, SPI);
+        name = "SX1262";
+        break;
+#endif
+#ifdef USE_SIM_RADIO
+    case HW_RADIO_SIM:
+        rIf = new SimRadio;
+        name = "simulated";
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    if (!rIf->init()) {
+        DEBUG_MSG("Warning: Failed to find %s radio\n", name);
+        delete rIf;
+        rIf = NULL;
+        return false;
+    }
+
+    hardwareCache.foundRadio(kind);
+    return true;
+}
+
 void setup()
 {
     concurrency::hasBeenSetup = true;
@@ -292,6 +415,7 @@ void setup()
 #endif
 
     initDeepSleep();
+    warmBoot.begin();
 
 #ifdef VEXT_ENABLE
     pinMode(VEXT_ENABLE, OUTPUT);
@@ -320,10 +444,12 @@ void setup()
 #endif
 
     OSThread::setup();
+    concurrency::initMainThread();
 
     ledPeriodic = new Periodic("Blink", ledBlinker);
 
     fsInit();
+    hardwareCache.load();
 
     router = new DSRRouter();
 
@@ -342,7 +468,9 @@ void setup()
     delay(1);
 #endif
 
-    scanI2Cdevice();
+    if (!warmBoot.restoreI2C()) // Our hardware can't have changed while we were in deep sleep
+        scanI2Cdevice();
+    bootTimer.phaseDone("i2c");
 
     // Buttons & LED
     buttonThread = new ButtonThread();
@@ -370,12 +498,15 @@ void setup()
     // We do this as early as possible because this loads preferences from flash
     // but we need to do this after main cpu iniot (esp32setup), because we need the random seed set
     nodeDB.init();
+    warmBoot.resume(); // Before our radio starts receiving, so floods we handled before we slept are still duplicates
+    bootTimer.phaseDone("nodedb");
 
     // Currently only the tbeam has a PMU
     power = new Power();
     power->setStatusHandler(powerStatus);
     powerStatus->observe(&power->newStatus);
     power->setup(); // Must be after status handler is installed, so that handler gets notified of the initial configuration
+    bootTimer.phaseDone("power");
 
     // Init our SPI controller (must be before screen and lora)
     initSPI();
@@ -405,45 +536,14 @@ void setup()
     digitalWrite(BATTERY_EN_PIN, LOW);
 #endif
 
-    // If we don't have bidirectional comms, we can't even try talking to UBLOX
-    UBloxGPS *ublox = NULL;
-#ifdef GPS_TX_PIN
-    // Init GPS - first try ublox
-    ublox = new UBloxGPS();
-    gps = ublox;
-    if (!gps->setup()) {
-        DEBUG_MSG("ERROR: No UBLOX GPS found\n");
-
-        delete ublox;
-        gps = ublox = NULL;
-    }
-#endif
-
-    if (!gps && GPS::_serial_gps) {
-        // Some boards might have only the TX line from the GPS connected, in that case, we can't configure it at all.  Just
-        // assume NMEA at 9600 baud.
-        // dumb NMEA access only work for serial GPSes)
-        DEBUG_MSG("Hoping that NMEA might work\n");
-
-#ifdef HAS_AIR530_GPS
-        gps = new Air530GPS();
-#else
-        gps = new NMEAGPS();
-#endif
-        gps->setup();
-    }
-
-    if (gps)
-        gpsStatus->observe(&gps->newStatus);
-    else
-        DEBUG_MSG("Warning: No GPS found - running without GPS\n");
-
     nodeStatus->observe(&nodeDB.newStatus);
 
     service.init();
+    airtimeInit();
 
     // Now that the mesh service is created, create any plugins
     setupPlugins();
+    bootTimer.phaseDone("service");
 
     // Do this after service.init (because that clears error_code)
 #ifdef AXP192_SLAVE_ADDRESS
@@ -461,16 +561,7 @@ void setup()
 #endif
 
     screen->print("Started...\n");
-
-    // We have now loaded our saved preferences from flash
-
-    // ONCE we will factory reset the GPS for bug #327
-    if (ublox && !devicestate.did_gps_reset) {
-        if (ublox->factoryReset()) { // If we don't succeed try again next time
-            devicestate.did_gps_reset = true;
-            nodeDB.saveToDisk();
-        }
-    }
+    bootTimer.phaseDone("screen");
 
 #ifdef SX1262_ANT_SW
     // make analog PA vs not PA switch on SX1262 eval board work properly
@@ -480,53 +571,92 @@ void setup()
 
     // radio init MUST BE AFTER service.init, so we have our radio config settings (from nodedb init)
 
-#if defined(RF95_IRQ)
-    if (!rIf) {
-        rIf = new RF95Interface(RF95_NSS, RF95_IRQ, RF95_RESET, SPI);
-        if (!rIf->init()) {
-            DEBUG_MSG("Warning: Failed to find RF95 radio\n");
-            delete rIf;
-            rIf = NULL;
-        }
-    }
+#ifdef LORA_FRAME_CAPTURE
+    frameCapture = new FrameCapture(); // Before our radio, so we capture its first frames
 #endif
 
-#if defined(SX1262_CS)
-    if (!rIf) {
-        rIf = new SX1262Interface(SX1262_CS, SX1262_DIO1, SX1262_RESET, SX1262_BUSY, SPI);
-        if (!rIf->init()) {
-            DEBUG_MSG("Warning: Failed to find SX1262 radio\n");
-            delete rIf;
-            rIf = NULL;
-        }
-    }
-#endif
+    // Try the radio we found last boot first, then the rest in order (each probe which fails has to time out)
+    HardwareRadio cachedRadio = hardwareCache.getRadio();
+    if (cachedRadio != HW_RADIO_UNKNOWN)
+        initRadio(cachedRadio);
+    for (int kind = HW_RADIO_RF95; !rIf && kind < HW_RADIO_NUM_KINDS; kind++)
+        if (kind != cachedRadio)
+            initRadio((HardwareRadio)kind);
 
-#ifdef USE_SIM_RADIO
-    if (!rIf) {
-        rIf = new SimRadio;
-        if (!rIf->init()) {
-            DEBUG_MSG("Warning: Failed to find simulated radio\n");
-            delete rIf;
-            rIf = NULL;
-        }
+    if (!rIf)
+        recordCriticalError(CriticalErrorCode_NoRadio);
+    else {
+        router->addInterface(rIf);
+        bootTimer.radioReady();
+        noiseMonitor = new NoiseMonitor(rIf);
+#ifdef CHANNEL_SURVEY
+        channelSurvey = new ChannelSurvey(rIf);
+#endif
     }
+
+#ifdef PORTDUINO
+    // Gateways routing for several channels can decrypt their packets too (MESH_EXTRA_PSKS is a comma separated list of hex keys)
+    const char *extraPsks = getenv("MESH_EXTRA_PSKS");
+    if (extraPsks)
+        crypto->addKeysFromHex(extraPsks);
+
+    // Admins who have this key (hex) can query our performance counters from anywhere on the mesh
+    const char *adminPsk = getenv("MESH_ADMIN_PSK");
+    if (adminPsk && !perfQueryPlugin->setAdminKey(adminPsk))
+        LOG_ERROR(MESH, "Invalid MESH_ADMIN_PSK, only our own phone can query our performance counters\n");
+
+    // Linux gateways can join their LoRa island to others over a LAN (if MESH_BACKHAUL_GROUP is set)
+    UdpMulticastInterface *backhaul = new UdpMulticastInterface();
+    if (backhaul->init())
+        router->addInterface(backhaul);
+    else
+        delete backhaul;
 #endif
 
+    bootTimer.phaseDone("radio");
+
     // Initialize Wifi
     initWifi(forceSoftAP);
+    bootTimer.phaseDone("wifi");
 
-    if (!rIf)
-        recordCriticalError(CriticalErrorCode_NoRadio);
-    else
-        router->addInterface(rIf);
+#ifdef PORTDUINO
+    // Linux gateways serve our API over TCP, to as many clients as want it
+    (new EpollServerPort())->init();
+
+    // And can keep every packet they hear (if PACKET_ARCHIVE_DIR is set), for those clients to replay
+    packetArchive = new PacketArchive();
+    if (!packetArchive->init()) {
+        delete packetArchive;
+        packetArchive = NULL;
+    }
+#endif
 
     // This must be _after_ service.init because we need our preferences loaded from flash to have proper timeout values
     PowerFSM_setup(); // we will transition to ON in a couple of seconds, FIXME, only do this for cold boots, not waking from SDS
     powerFSMthread = new PowerFSMThread();
 
+    memoryMonitor = new MemoryMonitor(); // Warns us (and records a critical error) before we run out of heap or stack
+
     // setBluetoothEnable(false); we now don't start bluetooth until we enter the proper state
-    setCPUFast(false); // 80MHz is fine for our slow peripherals
+    setCPUFast(false); // 80MHz is fine for our slow peripherals, on ESP32 our CpuGovernor speeds us up when we get busy
+
+#ifdef MESH_BENCHMARKS
+    runBenchmarks(); // Never returns
+#endif
+
+    gpsProbePeriodic = new Periodic("GPSProbe", probeGPS);
+
+    bootTimer.phaseDone("setup");
+    bootTimer.logSummary();
+
+#ifdef DEBUG_PORT
+    // From now on the scheduler is running, so log messages can wait for our drain thread rather than slowing their callers
+    DEBUG_PORT.startDeferredLogging();
+#endif
+
+    // Everything is created (including the log drain, which is a host thread on portduino), our host threads (i.e. the screen)
+    // can start running on their own core
+    concurrency::startHostTask();
 }
 
 #if 0
@@ -560,10 +690,6 @@ void loop()
 
     // heap_caps_check_integrity_all(true); // FIXME - disable this expensive check
 
-#ifndef NO_ESP32
-    esp32Loop();
-#endif
-
     // For debugging
     // if (rIf) ((RadioLibInterface *)rIf)->isActivelyReceiving();
 
@@ -575,21 +701,16 @@ void loop()
     }
 #endif
 
-    // TODO: This should go into a thread handled by FreeRTOS.
-    handleWebResponse();
-
-    service.loop();
+    // The web server and BLE host have their own tasks, but anything they do with our mesh state happens here
+    concurrency::runMainThreadJobs();
 
+    // Everything else we do is an OSThread, so (serial input aside) this is always our next deadline
     long delayMsec = mainController.runOrDelay();
 
-    /* if (mainController.nextThread && delayMsec)
-        DEBUG_MSG("Next %s in %ld\n", mainController.nextThread->ThreadName.c_str(),
-                  mainController.nextThread->tillRun(millis())); */
+    /* if (mainController.nextThread() && delayMsec)
+        DEBUG_MSG("Next %s in %ld\n", mainController.nextThread()->ThreadName.c_str(), delayMsec); */
 
     // We want to sleep as long as possible here - because it saves power
     mainDelay.delay(delayMsec);
     // if (didWake) DEBUG_MSG("wake!\n");
-
-    // Handles cleanup for the airtime calculator.
-    airtimeCalculator();
 }
@@ -5,6 +5,7 @@
 #include "PowerStatus.h"
 #include "graphics/Screen.h"
 
+extern uint8_t screen_found;
 extern bool axp192_found;
 extern bool isCharging;
 extern bool isUSBPowered;
@@ -20,4 +21,4 @@ extern graphics::Screen *screen;
 // Return a human readable string of the form "Meshtastic_ab13"
 const char *getDeviceName();
 
-void nrf52Setup(), esp32Setup(), nrf52Loop(), esp32Loop();
+void nrf52Setup(), esp32Setup(), nrf52Loop();
@@ -0,0 +1,89 @@
+#include "ChannelSurvey.h"
+#include "configuration.h"
+
+ChannelSurvey *channelSurvey;
+
+/// Move avg 1/2^CHANNEL_SURVEY_EWMA_SHIFT of the way towards sample
+static int32_t ewma(int32_t avg, int32_t sample)
+{
+    return avg + (sample - avg) / (1 << CHANNEL_SURVEY_EWMA_SHIFT);
+}
+
+ChannelSurvey::ChannelSurvey(RadioInterface *radio)
+    : concurrency::OSThread("ChannelSurvey", CHANNEL_SURVEY_INTERVAL_MSEC), radio(radio)
+{
+    memset(quality, 0, sizeof(quality));
+    setSlack(CHANNEL_SURVEY_SLACK_MSEC);
+}
+
+uint8_t ChannelSurvey::getNumChannels() const
+{
+    return min(radio->getNumChannels(), (uint8_t)CHANNEL_SURVEY_MAX_CHANNELS);
+}
+
+int32_t ChannelSurvey::runOnce()
+{
+    uint8_t numChannels = getNumChannels();
+    if (nextChannel >= numChannels)
+        nextChannel = 0; // Our region changed
+
+    ChannelSample sample;
+    if (!radio->surveyChannel(nextChannel, sample))
+        return CHANNEL_SURVEY_RETRY_MSEC;
+
+    addSample(nextChannel, sample);
+    if (++nextChannel == numChannels) {
+        nextChannel = 0;
+
+        int8_t best = getQuietestChannel();
+        uint8_t control = radio->getControlChannel();
+        LOG_DEBUG(RADIO, "Channel survey: quietest channel %d, our control channel %u is %u.%02u%% busy, noise %d dBm\n", best,
+                  control, quality[control].busy / 100, quality[control].busy % 100, quality[control].noise / 16);
+    }
+
+    return CHANNEL_SURVEY_INTERVAL_MSEC;
+}
+
+void ChannelSurvey::addSample(uint8_t channel, const ChannelSample &sample)
+{
+    ChannelQuality &q = quality[channel];
+    int32_t busy = sample.busy ? 10000 : 0;
+
+    // A busy sample's RSSI is someone's signal rather than the noise floor
+    bool hasNoise = !sample.busy && sample.rssi;
+    int32_t noise = (int32_t)sample.rssi * 16;
+
+    if (!q.numSamples)
+        q.busy = busy;
+    else
+        q.busy = ewma(q.busy, busy);
+
+    if (hasNoise)
+        q.noise = q.noise ? ewma(q.noise, noise) : noise;
+
+    if (q.numSamples < UINT16_MAX)
+        q.numSamples++;
+}
+
+int32_t ChannelSurvey::getScore(const ChannelQuality &q) const
+{
+    // busy is in hundredths of a percent, noise in 1/16 dBm
+    return (int32_t)q.busy * 16 * CHANNEL_SURVEY_DB_PER_BUSY_PERCENT / 100 + q.noise;
+}
+
+int8_t ChannelSurvey::getQuietestChannel(int8_t exclude) const
+{
+    int8_t best = -1;
+    int32_t bestScore = 0;
+    for (uint8_t c = 0; c < getNumChannels(); c++) {
+        if (c == exclude || !quality[c].numSamples)
+            continue;
+
+        int32_t score = getScore(quality[c]);
+        if (best < 0 || score < bestScore) {
+            best = c;
+            bestScore = score;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "RadioInterface.h"
+#include "concurrency/OSThread.h"
+
+/// How often we look at another channel (one channel per look, so a full sweep takes numChannels of these)
+#ifndef CHANNEL_SURVEY_INTERVAL_MSEC
+#define CHANNEL_SURVEY_INTERVAL_MSEC (20 * 1000L)
+#endif
+
+/// How late a look may be, so it can share a wakeup with something else we do (see OSThread::setSlack)
+#ifndef CHANNEL_SURVEY_SLACK_MSEC
+#define CHANNEL_SURVEY_SLACK_MSEC (10 * 1000L)
+#endif
+
+/// If our radio was busy we try again this soon
+#define CHANNEL_SURVEY_RETRY_MSEC 1000
+
+/// Each new sample moves our averages 1/2^CHANNEL_SURVEY_EWMA_SHIFT of the way towards it
+#define CHANNEL_SURVEY_EWMA_SHIFT 3
+
+/// The most channels of a region we keep quality for (our regions have up to 20)
+#define CHANNEL_SURVEY_MAX_CHANNELS 32
+
+/// When ranking channels, each percent of the time we found one busy counts as this many dB of extra noise
+#define CHANNEL_SURVEY_DB_PER_BUSY_PERCENT 1
+
+/// What we have learned about one channel
+struct ChannelQuality {
+    uint16_t numSamples;
+    uint16_t busy; // How often channel activity detection heard someone, in hundredths of a percent
+    int16_t noise; // The RSSI when it heard nobody (the noise floor), in 1/16 dBm, 0 if we have no RSSI for it
+};
+
+/**
+ * A background survey of our region's channels, for picking the quietest one.
+ *
+ * applyModemConfig() picks our control channel from a hash of our channel name, and bulk transfers picked their data channel
+ * at random, neither knowing whether the channel has a neighbouring mesh, a LoRaWAN gateway or a noisy appliance on it.  So
+ * every CHANNEL_SURVEY_INTERVAL_MSEC we have our radio look at the next channel: a channel activity detection and (on chips
+ * which can) an instantaneous RSSI.  We only look while our radio is idle, and it is back on its own channel within a few
+ * milliseconds, so our mesh doesn't notice.  With our slack we mostly look when something else has woken us anyway, so the
+ * survey barely shortens our light sleeps.
+ *
+ * Each channel keeps an average of how often it was busy and of its noise floor.  getQuietestChannel() ranks them, which
+ * BulkTransferPlugin uses for its data channels.  Moving a whole mesh's control channel needs every node to agree, so we only
+ * log our pick for the admin (who can set channel_num on every node).  Build with CHANNEL_SURVEY to enable it.
+ */
+class ChannelSurvey : private concurrency::OSThread
+{
+    RadioInterface *radio;
+
+    ChannelQuality quality[CHANNEL_SURVEY_MAX_CHANNELS];
+
+    /// The channel we look at next
+    uint8_t nextChannel = 0;
+
+  public:
+    explicit ChannelSurvey(RadioInterface *radio);
+
+    /// How many channels we survey (all of our region's, up to CHANNEL_SURVEY_MAX_CHANNELS)
+    uint8_t getNumChannels() const;
+
+    const ChannelQuality &getQuality(uint8_t channel) const { return quality[channel]; }
+
+    /// @return the channel with the least traffic and noise (other than exclude), or -1 if we haven't sampled any such channel
+    int8_t getQuietestChannel(int8_t exclude = -1) const;
+
+    /// Add a sample of a channel (ours, or the one we just looked at), NoiseMonitor gives us its samples of our own channel
+    void addSample(uint8_t channel, const ChannelSample &sample);
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    /// Lower is better, comparable between channels with the same kinds of samples
+    int32_t getScore(const ChannelQuality &q) const;
+};
+
+extern ChannelSurvey *channelSurvey;
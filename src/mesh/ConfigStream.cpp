@@ -0,0 +1,162 @@
+#include "ConfigStream.h"
+#include "configuration.h"
+#include <assert.h>
+#include <string.h>
+
+static_assert(CONFIG_STREAM_BLOCK_LEN >= FromRadio_size + 2, "A block must hold at least one record");
+static_assert(CONFIG_STREAM_BOUND(CONFIG_STREAM_BLOCK_LEN) <= 0xffff, "Our block lengths and hash table entries are 16 bits");
+
+// LZ4's block format rules: matches are at least MINMATCH long, the last LASTLITERALS bytes of a block are always literals,
+// and no match starts within MFLIMIT bytes of the end
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - CONFIG_STREAM_HASH_BITS);
+}
+
+/// The extra bytes of a literal or match length which didn't fit in its 4 bit field
+static uint8_t *writeLength(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Compress in to out in LZ4's block format, greedily taking the first match our hash table finds (which is most of what LZ4's
+ * own fast mode gains, for very little code or RAM)
+ *
+ * @param out must have room for CONFIG_STREAM_BOUND(inLen) bytes
+ * @return the compressed length
+ */
+static size_t compressBlock(const uint8_t *in, size_t inLen, uint8_t *out, uint16_t *hashTable)
+{
+    uint8_t *op = out;
+    const uint8_t *anchor = in; // The start of the literals our next sequence needs
+
+    if (inLen > MFLIMIT) { // Anything shorter can only be literals
+        const uint8_t *ip = in + 1;
+        const uint8_t *ipLimit = in + inLen - MFLIMIT;
+        const uint8_t *matchLimit = in + inLen - LASTLITERALS;
+
+        // Every entry starts out as position 0, which we check like any other candidate
+        memset(hashTable, 0, sizeof(uint16_t) << CONFIG_STREAM_HASH_BITS);
+
+        while (ip < ipLimit) {
+            size_t h = hash32(read32(ip));
+            const uint8_t *ref = in + hashTable[h];
+            hashTable[h] = ip - in;
+            if (read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            // Our blocks are far smaller than LZ4's 64KB offset limit, so any earlier position is in range
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *matchEnd = ip + MINMATCH;
+            while (matchEnd < matchLimit && *matchEnd == ref[matchEnd - ip])
+                matchEnd++;
+
+            size_t litLen = ip - anchor, matchLen = matchEnd - ip - MINMATCH, offset = ip - ref;
+            *op++ = ((litLen < 15 ? litLen : 15) << 4) | (matchLen < 15 ? matchLen : 15);
+            if (litLen >= 15)
+                op = writeLength(op, litLen - 15);
+            memcpy(op, anchor, litLen);
+            op += litLen;
+            *op++ = offset;
+            *op++ = offset >> 8;
+            if (matchLen >= 15)
+                op = writeLength(op, matchLen - 15);
+
+            ip = anchor = matchEnd;
+        }
+    }
+
+    // Our last sequence is only literals
+    size_t litLen = in + inLen - anchor;
+    *op++ = (litLen < 15 ? litLen : 15) << 4;
+    if (litLen >= 15)
+        op = writeLength(op, litLen - 15);
+    memcpy(op, anchor, litLen);
+    op += litLen;
+
+    assert(op - out <= (ptrdiff_t)CONFIG_STREAM_BOUND(inLen));
+    return op - out;
+}
+
+uint8_t *ConfigStream::beginRecord()
+{
+    // Leave room for the record's length prefix, which we don't know yet
+    return rawLen + 2 + FromRadio_size <= sizeof(raw) ? raw + rawLen + 2 : NULL;
+}
+
+void ConfigStream::endRecord(size_t len)
+{
+    if (!len)
+        return;
+
+    // The same framing as getFromRadioBatch, a one or two byte varint
+    uint8_t *p = raw + rawLen;
+    if (len < 0x80) {
+        p[0] = len;
+        memmove(p + 1, p + 2, len);
+        rawLen += 1 + len;
+    } else {
+        p[0] = (len & 0x7f) | 0x80;
+        p[1] = len >> 7;
+        rawLen += 2 + len;
+    }
+}
+
+void ConfigStream::endBlock()
+{
+    assert(!hasOutput());
+
+    outLen = outPos = 0;
+    if (!rawLen)
+        return;
+
+    ConfigStreamBlockHeader h;
+    h.rawLen = rawLen;
+    h.compressedLen = compressBlock(raw, rawLen, out + sizeof(h), hashTable);
+    memcpy(out, &h, sizeof(h));
+    outLen = sizeof(h) + h.compressedLen;
+
+    rawTotal += rawLen;
+    compressedTotal += outLen;
+    rawLen = 0;
+}
+
+size_t ConfigStream::readChunk(uint8_t *payload, size_t maxLen, bool done)
+{
+    assert(maxLen > sizeof(ConfigStreamChunk));
+
+    size_t len = outLen - outPos;
+    if (len > maxLen - sizeof(ConfigStreamChunk))
+        len = maxLen - sizeof(ConfigStreamChunk);
+    memcpy(payload + sizeof(ConfigStreamChunk), out + outPos, len);
+    outPos += len;
+
+    ConfigStreamChunk c;
+    c.version = CONFIG_STREAM_VERSION;
+    c.flags = done && !hasOutput() ? CONFIG_STREAM_LAST : 0;
+    c.seq = nextSeq++;
+    c.nonce = nonce;
+    memcpy(payload, &c, sizeof(c));
+
+    return sizeof(c) + len;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "mesh-pb-constants.h"
+
+/// Clients which can decompress our config send a packet on this port (not yet in portnums.proto) to our own node, with a
+/// ConfigStreamRequest as its payload, just before their want_config_id.  It doesn't go into the mesh, and lasts until the
+/// client disconnects.  We then send our config records to that client as a ConfigStream, in packets on this port.
+#define CONFIG_STREAM_PORTNUM ((PortNum)47)
+
+/// Bump this if the stream format changes
+#define CONFIG_STREAM_VERSION 1
+
+/// How much of our config (FromRadio records, with their length prefixes) we compress as one block.  Bigger blocks compress
+/// better (later records can refer back to more of the earlier ones), our buffers need a bit over twice this much RAM.
+#ifndef CONFIG_STREAM_BLOCK_LEN
+#define CONFIG_STREAM_BLOCK_LEN 1024
+#endif
+
+/// Our compressor finds repeats with a hash table of this many bits (two bytes per entry)
+#ifndef CONFIG_STREAM_HASH_BITS
+#define CONFIG_STREAM_HASH_BITS 9
+#endif
+
+/// The most a block can grow by when compressed (the LZ4 bound, for a block which doesn't compress at all)
+#define CONFIG_STREAM_BOUND(len) ((len) + (len) / 255 + 16)
+
+struct ConfigStreamRequest {
+    uint8_t version; // CONFIG_STREAM_VERSION, we ignore requests for versions we don't know
+} __attribute__((packed));
+
+/// The start of each packet's payload, followed by the next bytes of our stream.  All little endian.
+struct ConfigStreamChunk {
+    uint8_t version; // CONFIG_STREAM_VERSION
+    uint8_t flags;   // CONFIG_STREAM_LAST
+    uint16_t seq;    // 0 for the first chunk of a stream, if the client sees another 0 we started again (i.e. a config change)
+    uint32_t nonce;  // The want_config_id this stream answers
+} __attribute__((packed));
+
+/// This is our stream's last chunk, our config_complete_id FromRadio follows (as usual, and uncompressed)
+#define CONFIG_STREAM_LAST 0x01
+
+/// Each block of our stream starts with this, followed by compressedLen bytes of LZ4 block format (no frame or checksum)
+struct ConfigStreamBlockHeader {
+    uint16_t rawLen; // Once decompressed, varint length prefixed FromRadio records (the same as getFromRadioBatch)
+    uint16_t compressedLen;
+} __attribute__((packed));
+
+/**
+ * Compresses the config we send a client (our MyNodeInfo, RadioConfig and every NodeInfo) into one stream, for clients on slow
+ * links (BLE, or serial at 115200 baud) which would rather decompress than wait for a full node DB.
+ *
+ * NodeInfo records are very repetitive (the same field tags, names and ids with shared prefixes, nearby positions), which
+ * an LZ77 style compressor removes well.  We collect records into blocks of up to CONFIG_STREAM_BLOCK_LEN bytes, compress each
+ * block independently in LZ4's block format (so any LZ4 library can decompress it, without needing a big window or any
+ * state between blocks), and cut the resulting stream into packet sized chunks.  We only hold one block at a time, so a
+ * sync takes a few KB of RAM however many nodes we have, and only while the sync lasts.
+ */
+class ConfigStream
+{
+    uint32_t nonce;
+    uint16_t nextSeq = 0;
+
+    /// The records for our current block
+    uint8_t raw[CONFIG_STREAM_BLOCK_LEN];
+    size_t rawLen = 0;
+
+    /// Our last block, compressed and with its header, and how much of it we have sent
+    uint8_t out[sizeof(ConfigStreamBlockHeader) + CONFIG_STREAM_BOUND(CONFIG_STREAM_BLOCK_LEN)];
+    size_t outLen = 0, outPos = 0;
+
+    uint16_t hashTable[1 << CONFIG_STREAM_HASH_BITS];
+
+    /// For our logs
+    uint32_t rawTotal = 0, compressedTotal = 0;
+
+  public:
+    explicit ConfigStream(uint32_t nonce) : nonce(nonce) {}
+
+    /// Where to encode our next record (there is room for FromRadio_size bytes), or NULL if our current block is full
+    uint8_t *beginRecord();
+
+    /// Add the record we encoded at beginRecord() to our block, len can be 0 if there wasn't one after all
+    void endRecord(size_t len);
+
+    /// Compress our current block, only call this once the client has all of our last one
+    void endBlock();
+
+    /// Do we have compressed bytes the client doesn't have yet?
+    bool hasOutput() const { return outPos < outLen; }
+
+    /**
+     * Fill payload with our next chunk (a ConfigStreamChunk and as many of our bytes as fit in maxLen)
+     *
+     * @param done true if there are no more records to come, so if this chunk takes the last of our bytes it is our last
+     * @return the length of the chunk
+     */
+    size_t readChunk(uint8_t *payload, size_t maxLen, bool done);
+
+    uint32_t getRawTotal() const { return rawTotal; }
+    uint32_t getCompressedTotal() const { return compressedTotal; }
+};
@@ -1,32 +1,212 @@
 #include "CryptoEngine.h"
 #include "configuration.h"
+#include <assert.h>
+#include <ctype.h>
 
 void CryptoEngine::setKey(size_t numBytes, uint8_t *bytes)
 {
-    DEBUG_MSG("WARNING: Using stub crypto - all crypto is sent in plaintext!\n");
+    LOG_DEBUG(MESH, "Installing AES%d key!\n", (int)numBytes * 8);
+    invalidateKeystreams(); // They were for our old key
+    installKey(0, numBytes, bytes);
+}
+
+bool CryptoEngine::addKey(size_t numBytes, const uint8_t *bytes)
+{
+    if (numKeys == CRYPTO_MAX_KEYS || (numBytes != 16 && numBytes != 32))
+        return false;
+
+    uint8_t *copy = extraKeys[numKeys - 1];
+    memcpy(copy, bytes, numBytes);
+    installKey(numKeys, numBytes, copy);
+    numKeys++;
+    LOG_INFO(MESH, "Added AES%d receive key #%u\n", (int)numBytes * 8, (uint32_t)numKeys - 1);
+    return true;
+}
+
+/// Parse one hex key, up to the end of list or a comma @return its length, 0 if it isn't valid hex or is too long
+static size_t parseHexKey(const char *&list, uint8_t *key, size_t maxLen)
+{
+    size_t len = 0;
+    for (; *list && *list != ','; list += 2) {
+        if (!isxdigit(list[0]) || !isxdigit(list[1]) || len == maxLen)
+            return 0;
+        char hex[3] = {list[0], list[1], 0};
+        key[len++] = strtoul(hex, NULL, 16);
+    }
+    return len;
+}
+
+size_t CryptoEngine::addKeysFromHex(const char *list)
+{
+    size_t numAdded = 0;
+    while (*list) {
+        uint8_t key[32];
+        size_t len = parseHexKey(list, key, sizeof(key));
+        if (!len) {
+            LOG_ERROR(MESH, "Invalid key in key list\n");
+            return numAdded;
+        }
+
+        if (!addKey(len, key)) {
+            LOG_ERROR(MESH, "Can't add a %u byte key, our key ring holds %u keys of 16 or 32 bytes\n", (uint32_t)len,
+                      (uint32_t)CRYPTO_MAX_KEYS);
+            return numAdded;
+        }
+        numAdded++;
+        if (*list == ',')
+            list++;
+    }
+    return numAdded;
+}
+
+bool CryptoEngine::setAuthKey(size_t numBytes, const uint8_t *bytes)
+{
+    if (numBytes != 16 && numBytes != 32)
+        return false;
+
+    memcpy(authKey, bytes, numBytes);
+    authKeyLen = numBytes;
+    installKey(CRYPTO_AUTH_SLOT, numBytes, authKey);
+    LOG_INFO(MESH, "Installed AES%d authentication key\n", (int)numBytes * 8);
+    return true;
+}
+
+bool CryptoEngine::setAuthKeyFromHex(const char *hex)
+{
+    uint8_t key[32];
+    size_t len = parseHexKey(hex, key, sizeof(key));
+    return !*hex && setAuthKey(len, key);
+}
+
+/// Double a CMAC subkey in GF(2^128) (RFC 4493 section 2.3)
+static void cmacDouble(const uint8_t *in, uint8_t *out)
+{
+    uint8_t carry = in[0] >> 7;
+    for (int i = 0; i < 15; i++)
+        out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+    out[15] = (in[15] << 1) ^ (carry ? 0x87 : 0);
+}
+
+void CryptoEngine::cmac(const uint8_t *msg, size_t len, uint8_t *mac)
+{
+    assert(authKeyLen);
+
+    // Our subkeys, K1 for a last block which is complete and K2 for one we had to pad
+    uint8_t k[16] = {0};
+    cryptBlock(CRYPTO_AUTH_SLOT, k, k);
+    cmacDouble(k, k);
+    bool complete = len && len % 16 == 0;
+    if (!complete)
+        cmacDouble(k, k);
+
+    // CBC over every block, the last one xored with its subkey
+    uint8_t x[16] = {0};
+    size_t numBlocks = len ? (len + 15) / 16 : 1;
+    for (size_t b = 0; b < numBlocks; b++) {
+        size_t n = b + 1 < numBlocks ? 16 : len - b * 16;
+        for (size_t i = 0; i < 16; i++) {
+            uint8_t m = i < n ? msg[b * 16 + i] : (i == n ? 0x80 : 0);
+            x[i] ^= b + 1 < numBlocks ? m : m ^ k[i];
+        }
+        cryptBlock(CRYPTO_AUTH_SLOT, x, x);
+    }
+    memcpy(mac, x, CRYPTO_CMAC_LEN);
+}
+
+void CryptoEngine::installKey(size_t keyIndex, size_t numBytes, const uint8_t *bytes)
+{
+    LOG_WARN(MESH, "WARNING: Using stub crypto - all crypto is sent in plaintext!\n");
+}
+
+void CryptoEngine::crypt(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
+{
+    LOG_WARN(MESH, "WARNING: noop encryption!\n");
+    if (in != out)
+        memcpy(out, in, numBytes);
+}
+
+void CryptoEngine::cryptBlock(size_t keyIndex, const uint8_t *in, uint8_t *out)
+{
+    LOG_WARN(MESH, "WARNING: noop encryption!\n");
+    if (in != out)
+        memcpy(out, in, 16);
 }
 
 /**
- * Encrypt a packet
- *
- * @param bytes is updated in place
+ * Encrypt a packet we are sending.  If we precomputed the keystream for this packet this is just an XOR, otherwise it is
+ * the same as encrypt().
  */
-void CryptoEngine::encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+void CryptoEngine::encryptOutgoing(uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
 {
-    DEBUG_MSG("WARNING: noop encryption!\n");
+    for (size_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++) {
+        Keystream &k = keystreams[i];
+        if (k.valid && k.fromNode == fromNode && k.packetNum == packetNum && numBytes <= sizeof(k.bytes)) {
+            for (size_t b = 0; b < numBytes; b++)
+                out[b] = in[b] ^ k.bytes[b];
+
+            k.valid = false; // Free the slot for a future packet
+            return;
+        }
+    }
+
+    encrypt(fromNode, packetNum, numBytes, in, out);
+}
+
+/**
+ * Make sure we have keystreams ready for the packets we expect to send next (discarding any others)
+ */
+void CryptoEngine::precomputeKeystreams(uint32_t fromNode, const uint64_t *packetNums, size_t numPackets)
+{
+    if (numPackets > KEYSTREAM_CACHE_SIZE)
+        numPackets = KEYSTREAM_CACHE_SIZE;
+
+    // Throw away anything we no longer expect to need
+    bool have[KEYSTREAM_CACHE_SIZE] = {false};
+    for (size_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++) {
+        Keystream &k = keystreams[i];
+        if (!k.valid)
+            continue;
+
+        k.valid = false;
+        if (k.fromNode == fromNode)
+            for (size_t n = 0; n < numPackets; n++)
+                if (k.packetNum == packetNums[n] && !have[n]) {
+                    have[n] = k.valid = true;
+                    break;
+                }
+    }
+
+    // Compute whatever is missing into the free slots
+    size_t slot = 0;
+    for (size_t n = 0; n < numPackets; n++) {
+        if (have[n])
+            continue;
+
+        while (keystreams[slot].valid)
+            slot++; // we have at least as many slots as packets, so this can't run off the end
+
+        Keystream &k = keystreams[slot];
+        memset(k.bytes, 0, sizeof(k.bytes));
+        encrypt(fromNode, packetNums[n], sizeof(k.bytes), k.bytes, k.bytes); // In CTR mode the keystream is just E(zeros)
+        k.fromNode = fromNode;
+        k.packetNum = packetNums[n];
+        k.valid = true;
+    }
 }
 
-void CryptoEngine::decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+/// Forget all our precomputed keystreams, subclasses must call this whenever their key changes
+void CryptoEngine::invalidateKeystreams()
 {
-    DEBUG_MSG("WARNING: noop decryption!\n");
+    for (size_t i = 0; i < KEYSTREAM_CACHE_SIZE; i++)
+        keystreams[i].valid = false;
 }
 
 /**
  * Init our 128 bit nonce for a new packet
  */
-void CryptoEngine::initNonce(uint32_t fromNode, uint64_t packetNum)
+void CryptoEngine::initNonce(uint8_t *nonce, uint32_t fromNode, uint64_t packetNum)
 {
-    memset(nonce, 0, sizeof(nonce));
+    memset(nonce, 0, 16);
     *((uint64_t *)&nonce[0]) = packetNum;
     *((uint32_t *)&nonce[8]) = fromNode;
 }
\ No newline at end of file
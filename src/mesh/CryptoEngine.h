@@ -9,13 +9,83 @@
 
 #define MAX_BLOCKSIZE 256
 
+/// How many keystreams we precompute for our upcoming outgoing packets (each costs MAX_BLOCKSIZE bytes of RAM)
+#ifndef KEYSTREAM_CACHE_SIZE
+#define KEYSTREAM_CACHE_SIZE 4
+#endif
+
+/// How many keys our key ring holds: our own channel's key (which we send with) and extra keys we also receive with
+#ifndef CRYPTO_MAX_KEYS
+#define CRYPTO_MAX_KEYS 4
+#endif
+
+/// The slot our authentication key (see setAuthKey) is installed in, after our key ring, so engines need CRYPTO_NUM_SLOTS
+#define CRYPTO_AUTH_SLOT CRYPTO_MAX_KEYS
+#define CRYPTO_NUM_SLOTS (CRYPTO_MAX_KEYS + 1)
+
+/// The length of an AES-CMAC
+#define CRYPTO_CMAC_LEN 16
+
+/// How many senders we remember the key of (which key last decrypted their packets)
+#define CRYPTO_KEY_HINTS 32
+
+/// How many decryptions trial decoding hands our engine at once.  Only worth more than 1 where the engine runs them side by
+/// side (our linux builds, with the CPU's AES instructions).
+#ifndef CRYPTO_BATCH_LANES
+#ifdef PORTDUINO
+#define CRYPTO_BATCH_LANES 4
+#else
+#define CRYPTO_BATCH_LANES 1
+#endif
+#endif
+
+/// One AES-CTR run for decryptBatch()
+struct CryptJob {
+    size_t keyIndex;
+    uint32_t fromNode;
+    uint64_t packetNum;
+    size_t numBytes;
+    const uint8_t *in;
+    uint8_t *out; // Can be the same buffer as in
+};
+
 class CryptoEngine
 {
-  protected:
-    /** Our per packet nonce */
-    uint8_t nonce[16];
+    /// A precomputed CTR keystream (i.e. the encryption of MAX_BLOCKSIZE zeros) for one packet
+    struct Keystream {
+        uint32_t fromNode;
+        uint64_t packetNum;
+        bool valid;
+        uint8_t bytes[MAX_BLOCKSIZE];
+    };
+
+    Keystream keystreams[KEYSTREAM_CACHE_SIZE];
+
+    /// The key which last decrypted a packet from each sender, in a table indexed by NodeNum % CRYPTO_KEY_HINTS
+    struct KeyHint {
+        uint32_t node;
+        uint8_t keyIndex;
+    };
+
+    KeyHint keyHints[CRYPTO_KEY_HINTS];
+
+    /// Our own key is always index 0, extra keys follow it
+    size_t numKeys = 1;
+
+    /// The bytes of our extra keys (setKey()'s caller keeps our own key's bytes)
+    uint8_t extraKeys[CRYPTO_MAX_KEYS - 1][32];
+
+    /// The bytes of our authentication key, and how many there are (0 for none)
+    uint8_t authKey[32];
+    size_t authKeyLen = 0;
 
   public:
+    CryptoEngine()
+    {
+        invalidateKeystreams();
+        memset(keyHints, 0, sizeof(keyHints));
+    }
+
     virtual ~CryptoEngine() {}
 
     /**
@@ -27,17 +97,125 @@ class CryptoEngine
      * @param bytes a _static_ buffer that will remain valid for the life of this crypto instance (i.e. this class will cache the
      * provided pointer)
      */
-    virtual void setKey(size_t numBytes, uint8_t *bytes);
+    void setKey(size_t numBytes, uint8_t *bytes);
+
+    /**
+     * Add a key we also decrypt received packets with (but never send with), so a router can serve several channels.  Each
+     * key's AES schedule is computed once here, so trying several keys per packet costs no key setup.
+     *
+     * @param numBytes must be 16 (AES128) or 32 (AES256)
+     * @return false if our key ring is full
+     */
+    bool addKey(size_t numBytes, const uint8_t *bytes);
+
+    /// Add a comma separated list of hex keys with addKey() @return how many we added
+    size_t addKeysFromHex(const char *list);
+
+    /// Our own key and our extra keys
+    size_t getNumKeys() const { return numKeys; }
+
+    /**
+     * Set the key cmac() uses.  It lives in its own slot outside our key ring, so it never decrypts packets: a secret which
+     * proves who sent a request has nothing to do with which channels we are on.
+     *
+     * @param numBytes must be 16 (AES128) or 32 (AES256)
+     * @return false if it isn't
+     */
+    bool setAuthKey(size_t numBytes, const uint8_t *bytes);
+
+    /// setAuthKey() from a hex string @return false if it isn't a valid key
+    bool setAuthKeyFromHex(const char *hex);
+
+    bool hasAuthKey() const { return authKeyLen != 0; }
+
+    /// The AES-CMAC (RFC 4493) of len bytes of msg with our authentication key, into CRYPTO_CMAC_LEN bytes of mac
+    void cmac(const uint8_t *msg, size_t len, uint8_t *mac);
 
     /**
      * Encrypt a packet
      *
-     * @param bytes is updated in place
+     * Implementations must not use any shared scratch buffers, so this is safe to call from multiple threads.
+     *
+     * @param in numBytes of cleartext
+     * @param out where to write numBytes of ciphertext, it can be the same buffer as in (but must not partially overlap it)
+     */
+    void encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
+    {
+        crypt(0, fromNode, packetNum, numBytes, in, out);
+    }
+
+    void decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
+    {
+        crypt(0, fromNode, packetNum, numBytes, in, out); // For CTR, the implementation is the same
+    }
+
+    /// Decrypt with one of the keys in our ring (0 is our own)
+    void decryptWith(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
+    {
+        crypt(keyIndex, fromNode, packetNum, numBytes, in, out);
+    }
+
+    /**
+     * Run several decryptions (i.e. one packet with several keys, or several packets), which engines that can run them side by
+     * side do faster than one by one.
+     */
+    void decryptBatch(const CryptJob *jobs, size_t numJobs) { cryptBatch(jobs, numJobs); }
+
+    /// The key which last decrypted a packet from fromNode, so trial decryption can start with it (0 if we don't know)
+    size_t getKeyHint(uint32_t fromNode) const
+    {
+        const KeyHint &h = keyHints[fromNode % CRYPTO_KEY_HINTS];
+        return h.node == fromNode && h.keyIndex < numKeys ? h.keyIndex : 0;
+    }
+
+    void setKeyHint(uint32_t fromNode, size_t keyIndex) { keyHints[fromNode % CRYPTO_KEY_HINTS] = {fromNode, (uint8_t)keyIndex}; }
+
+    /**
+     * Encrypt a packet we are sending.  If we precomputed the keystream for this packet this is just an XOR, otherwise it is
+     * the same as encrypt().
+     *
+     * Note: unlike encrypt() this uses our shared keystream cache, so only call it from the router thread
+     */
+    void encryptOutgoing(uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out);
+
+    /**
+     * Make sure we have keystreams ready for the packets we expect to send next (discarding any others).  Call this when
+     * idle, again only from the router thread.
+     *
+     * @param packetNums the next numPackets packet numbers we will use, only the first KEYSTREAM_CACHE_SIZE are cached
      */
-    virtual void encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes);
-    virtual void decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes);
+    void precomputeKeystreams(uint32_t fromNode, const uint64_t *packetNums, size_t numPackets);
 
   protected:
+    /**
+     * Precompute whatever a key needs (i.e. its AES key schedule) into slot keyIndex of our ring
+     *
+     * @param numBytes 16 (AES128), 32 (AES256) or 0 (no crypt)
+     * @param bytes stays valid while the key is installed
+     */
+    virtual void installKey(size_t keyIndex, size_t numBytes, const uint8_t *bytes);
+
+    /**
+     * Run AES-CTR (which both encrypts and decrypts) with the key in slot keyIndex
+     *
+     * @param in numBytes of input
+     * @param out where to write numBytes of output, it can be the same buffer as in
+     */
+    virtual void crypt(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out);
+
+    /// Encrypt one 16 byte block with the key in slot keyIndex (plain AES, for cmac()) @param out can be the same buffer as in
+    virtual void cryptBlock(size_t keyIndex, const uint8_t *in, uint8_t *out);
+
+    /// Run every job's AES-CTR, by default one after the other with crypt()
+    virtual void cryptBatch(const CryptJob *jobs, size_t numJobs)
+    {
+        for (size_t i = 0; i < numJobs; i++)
+            crypt(jobs[i].keyIndex, jobs[i].fromNode, jobs[i].packetNum, jobs[i].numBytes, jobs[i].in, jobs[i].out);
+    }
+
+    /// Forget all our precomputed keystreams
+    void invalidateKeystreams();
+
     /**
      * Init our 128 bit nonce for a new packet
      *
@@ -45,8 +223,10 @@ class CryptoEngine
      * a 64 bit packet number (stored in little endian order)
      * a 32 bit sending node number (stored in little endian order)
      * a 32 bit block counter (starts at zero)
+     *
+     * @param nonce a 16 byte buffer owned by the caller (we don't keep one in the engine, so encrypt can be reentrant)
      */
-    void initNonce(uint32_t fromNode, uint64_t packetNum);
+    static void initNonce(uint8_t *nonce, uint32_t fromNode, uint64_t packetNum);
 };
 
 extern CryptoEngine *crypto;
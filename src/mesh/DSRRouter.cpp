@@ -1,83 +1,239 @@
 #include "DSRRouter.h"
+#include "HopStarts.h"
+#include "NeighborTable.h"
+#include "NetworkCoder.h"
 #include "configuration.h"
 
 /* when we receive any packet
 
 - sniff and update tables (especially useful to find adjacent nodes). Update user, network and position info.
-- if we need to route() that packet, resend it to the next_hop based on our nodedb.
+- if we need to route() that packet, resend it to the next_hop based on our route cache.
 - if it is broadcast or destined for our node, deliver locally
 - handle routereply/routeerror/routediscovery messages as described below
 - then free it
 
+On the wire a source routed packet has decoded.dest set to the final destination, decoded.source set to the node which
+originated it and decoded.original_id set to the id the originator gave it.  Each hop is a normal reliable (want_ack) unicast
+to the next node, with a fresh from/id.  hop_limit counts down once per hop as a TTL.
+
 routeDiscovery
 
+- route requests are zero hop broadcasts, each node that doesn't know the answer adds itself to the route and rebroadcasts it
+(so the route list length limits how far a request can travel)
 - if we've already passed through us (or is from us), then it ignore it
 - use the nodes already mentioned in the request to update our routing table
 - if they were looking for us, send back a routereply
-- if max_hops is zero and they weren't looking for us, drop (FIXME, send back error - I think not though?)
-- if we receive a discovery packet, we use it to populate next_hop (if needed) towards the requester (after decrementing max_hops)
-- if we receive a discovery packet, and we have a next_hop in our nodedb for that destination we send a (reliable) we send a route
+- if we receive a discovery packet, and we have a next_hop in our route cache for that destination we send a route
 reply towards the requester
 
-when sending any reliable packet
+when sending a unicast packet
+
+- if the destination is adjacent we send it the way we always have
+- we only source route to nodes we know understand it (see speaksDsr), older builds would think a source routed packet came
+from its last hop, so everyone else gets packets the way we always sent them
+- if we have a route we source route it, otherwise we send it the way we always have and start a discovery in the background,
+so later packets to that node can be source routed.  Older builds never answer route requests, so after a discovery times
+out we don't start a new one for that node for a while (see DSR_FAILED_DISCOVERY_MSEC)
+- routes we learned from overheard floods (see onRelayHeard) are used just like discovered ones, so replies usually need no
+discovery at all
 
-- if timeout doing retries, send a routeError (nak) message back towards the original requester. all nodes eavesdrop on that
-packet and update their route caches.
+when sending any source routed hop
+
+- if timeout doing retries, we get a nak, so we send a routeError (flooded) so that all nodes can update their route caches.
+If we originated the packet we also send it again after a fresh route discovery (once, see onReliableSendFailed), and only
+nak it if that fails too
 
 when we receive a routereply packet
 
 - update next_hop on the node, if the new reply needs fewer hops than the existing one (we prefer shorter paths). fixme, someday
 use a better heuristic
+- send any packets which were waiting for that route
 
 when we receive a routeError packet
 
-- delete the route for that failed recipient, restartRouteDiscovery()
-- if we receive routeerror in response to a discovery,
+- delete the route for that failed recipient, the next packet we send to them will start a new discovery
 - fixme, eventually keep caches of possible other routes.
 */
 
 ErrorCode DSRRouter::send(MeshPacket *p)
 {
-    // We only consider multihop routing packets (i.e. those with dest set)
-    if (p->decoded.dest) {
-        // add an entry for this pending message
-        auto pending = startRetransmission(p);
-        // FIXME - when acks come in for this packet, we should _not_ delete the record unless the ack was from
-        // the final dest.  We need to keep that record around until FIXME
-        // Also we should not retransmit multihop entries in that table at all
-
-        // If we have an entry in our routing tables, just send it, otherwise start a route discovery
-        NodeNum nextHop = getNextHop(p->decoded.dest);
-        if (nextHop) {
-            sendNextHop(nextHop, p); // start a reliable single hop send
-        } else {
-            pending->wantRoute = true;
+    // Broadcasts (including our route requests and errors) are never source routed, and zero hop packets (acks) are only for
+    // our neighbors
+    if (p->to == NODENUM_BROADCAST || p->which_payload != MeshPacket_decoded_tag || p->hop_limit == 0)
+        return ReliableRouter::send(p);
 
-            // start discovery, but only if we don't already a discovery in progress for that node number
-            startDiscovery(p->decoded.dest);
+    if (!p->decoded.dest) {
+        // A regular unicast that we originated
+        const Route *r = routeCache.find(p->to);
+        if (r && r->numHops == 0)
+            return ReliableRouter::send(p); // They are adjacent, no need for the routing overhead
+        if (r && (!speaksDsr(p->to) || !speaksDsr(r->nextHop)))
+            return ReliableRouter::send(p); // They might be running an older build, which can't take source routed packets
+
+        if (!r) {
+            // Don't hold it while we look for a route, the discovery might take until it times out (or never be answered)
+            NodeNum dest = p->to;
+            ErrorCode err = ReliableRouter::send(p);
+            if (!recentlyFailed(dest))
+                startDiscovery(dest);
+            return err;
         }
 
+        // Switch it to source routing
+        p->decoded.dest = p->to;
+        p->decoded.source = p->from;
+        p->decoded.original_id = p->id;
+        p->hop_limit = HOP_MAX; // Used as a TTL for source routed packets
+    }
+
+    NodeNum nextHop = getNextHop(p->decoded.dest);
+    if (nextHop) {
+        sendNextHop(nextHop, p); // start a reliable single hop send
         return ERRNO_OK;
-    } else
-        return ReliableRouter::send(p);
+    }
+
+    // We don't have a route (any more), if we started this packet we can wait for one
+    if (p->decoded.source == getNodeNum() && !recentlyFailed(p->decoded.dest) && waitForRoute(p, p->decoded.dest)) {
+        startDiscovery(p->decoded.dest);
+        return ERRNO_OK;
+    }
+
+    LOG_WARN(MESH, "No route to 0x%x, dropping source routed packet\n", p->decoded.dest);
+    NodeNum dest = p->decoded.dest;
+    PacketId originalId = p->decoded.original_id;
+    bool forOthers = p->decoded.source != getNodeNum();
+    packetPool.release(p);
+    if (forOthers)
+        sendRouteError(dest, RouteError_NO_ROUTE);
+    else
+        sendAckNak(false, getNodeNum(), originalId); // So whoever gave us the packet hears it failed
+    return ERRNO_UNKNOWN;
+}
+
+int32_t DSRRouter::runOnce()
+{
+    int32_t d = ReliableRouter::runOnce();
+
+    if (numWaiting)
+        sendWaiting(); // For routes onRelayHeard learned
+
+    uint32_t now = millis();
+    for (size_t i = 0; i < numDiscoveries;) {
+        if (routeCache.find(discoveries[i].dest)) {
+            discoveries[i] = discoveries[--numDiscoveries]; // We learned a route some other way
+            continue;
+        }
+
+        int32_t left = discoveries[i].startMsec + DSR_DISCOVERY_TIMEOUT_MSEC - now;
+        if (left > 0) {
+            d = min(d, left);
+            i++;
+            continue;
+        }
+
+        failDiscovery(i);
+    }
+
+#ifdef LORA_NETWORK_CODING
+    // Held forwards which didn't find a partner go out the normal way
+    NodeNum nextHop;
+    while (MeshPacket *p = networkCoder.takeExpired(nextHop, d))
+        sendNextHop(nextHop, p);
+#endif
+
+    return d;
+}
+
+uint8_t DSRRouter::getHopsAway(NodeNum node)
+{
+    uint8_t hops = ReliableRouter::getHopsAway(node);
+    const Route *r = routeCache.find(node);
+    return r && r->numHops < hops ? r->numHops : hops;
+}
+
+void DSRRouter::onRelayHeard(const MeshPacket *p, uint8_t relayByte)
+{
+    // Whoever transmitted this copy wrote our header magic, so they understand source routing
+    uint8_t hops = hopStarts.getHopsTaken(p);
+    NodeNum relay = hops == 0 && (p->from & 0xff) == relayByte ? p->from : neighbors.findByLowByte(relayByte);
+    if (relay)
+        addKnownNode(relay);
+
+    // Copies straight from the sender are covered by the 0 hop routes sniffReceived learns
+    if (hops == 0 || hops == 0xff)
+        return;
+
+    // Not addRoute(), we are inside our radio's receive handling, so any packets waiting for this route go out from runOnce
+    if (relay && relay != p->from && p->from != getNodeNum() && routeCache.add(p->from, relay, hops - 1) && numWaiting)
+        setIntervalFromNow(0);
+}
+
+bool DSRRouter::onReliableSendFailed(const MeshPacket *p)
+{
+    // Only packets we source routed ourselves
+    if (p->which_payload != MeshPacket_decoded_tag || !p->decoded.dest || p->decoded.source != getNodeNum())
+        return false;
+
+    NodeNum dest = p->decoded.dest;
+    if (p->id != p->decoded.original_id) {
+        // Our retry failed too (it has a new id, so we never loop).  Nak the id whoever gave us the packet knows, and do what
+        // the nak of our own hop would have (see sniffReceived).
+        LOG_WARN(MESH, "Source routed retry to 0x%x failed, returning a nak for id=0x%x\n", dest, p->decoded.original_id);
+        sendRouteError(dest, RouteError_GOT_NAK);
+        sendAckNak(false, getNodeNum(), p->decoded.original_id);
+        return true;
+    }
+
+    // Our route is broken (it may only have been a guess from overheard floods), so find a new one before sending again
+    removeRoute(dest);
+    if (recentlyFailed(dest))
+        return false; // No point, we couldn't find one a moment ago
+    MeshPacket *retry = packetPool.allocCopy(*p, 0);
+    if (!retry)
+        return false;
+
+    retry->id = generatePacketId(); // original_id still tells the destination which packet this is
+    retry->hop_limit = HOP_MAX;
+    retry->decoded.which_ack = 0;
+    if (!waitForRoute(retry, dest)) {
+        packetPool.release(retry);
+        return false;
+    }
+
+    LOG_DEBUG(MESH, "Source routed send to 0x%x failed, rediscovering its route\n", dest);
+    sendRouteError(dest, RouteError_GOT_NAK); // As the nak we aren't sending yet would have
+    startDiscovery(dest);
+    return true;
+}
+
+void DSRRouter::sniffTransit(const MeshPacket *p)
+{
+    if (NeighborTable::isDirect(p))
+        addRoute(p->from, p->from, 0);
+
+    ReliableRouter::sniffTransit(p);
 }
 
 void DSRRouter::sniffReceived(const MeshPacket *p)
 {
-    // Learn 0 hop routes by just hearing any adjacent nodes
-    // But treat broadcasts carefully, because when flood broadcasts go out they keep the same original "from".  So we want to
-    // ignore rebroadcasts.
+    // Learn 0 hop routes by just hearing any adjacent nodes (ignoring flood rebroadcasts, which keep the original "from")
     // this will also add records for any ACKs we receive for our messages
-    if (p->to != NODENUM_BROADCAST || p->hop_limit != HOP_RELIABLE) {
+    if (NeighborTable::isDirect(p)) {
         addRoute(p->from, p->from, 0); // We are adjacent with zero hops
     }
 
+    // Only builds which understand source routing set source (on our route packets and source routed ones)
+    if (p->decoded.source)
+        addKnownNode(p->decoded.source);
+
     switch (p->decoded.which_payload) {
     case SubPacket_route_request_tag:
+        addKnownNodes(p->decoded.route_request, 0);
         // Handle route discovery packets (will be a broadcast message)
-        // FIXME - always start request with the senders nodenum
-        if (weAreInRoute(p->decoded.route_request)) {
-            DEBUG_MSG("Ignoring a route request that contains us\n");
+        if (p->decoded.source == getNodeNum() || weAreInRoute(p->decoded.route_request)) {
+            LOG_DEBUG(MESH, "Ignoring a route request that contains us\n");
+        } else if (isDuplicateRequest(p)) {
+            LOG_DEBUG(MESH, "Ignoring a route request we already handled\n");
         } else {
             updateRoutes(p->decoded.route_request,
                          true); // Update our routing tables based on the route that came in so far on this request
@@ -85,67 +241,75 @@ void DSRRouter::sniffReceived(const MeshPacket *p)
             if (p->decoded.dest == getNodeNum()) {
                 // They were looking for us, send back a route reply (the sender address will be first in the list)
                 sendRouteReply(p->decoded.route_request);
+            } else if (getNextHop(p->decoded.dest)) {
+                // in our route cache, reply to the requester (the sender address will be first in the list)
+                sendRouteReply(p->decoded.route_request, p->decoded.dest);
             } else {
-                // They were looking for someone else, forward it along (as a zero hop broadcast)
-                NodeNum nextHop = getNextHop(p->decoded.dest);
-                if (nextHop) {
-                    // in our route cache, reply to the requester (the sender address will be first in the list)
-                    sendRouteReply(p->decoded.route_request, nextHop);
-                } else {
-                    // Not in our route cache, rebroadcast on their behalf (after adding ourselves to the request route)
-                    resendRouteRequest(p);
-                }
+                // Not in our route cache, rebroadcast on their behalf (after adding ourselves to the request route)
+                resendRouteRequest(p);
             }
         }
         break;
     case SubPacket_route_reply_tag:
+        addKnownNodes(p->decoded.route_reply, p->decoded.source);
         updateRoutes(p->decoded.route_reply, false);
-
-        // FIXME, if any of our current pending packets were waiting for this route, send them (and leave them as regular pending
-        // packets until ack arrives)
-        // FIXME, if we don't get a route reply at all (or a route error), timeout and generate a routeerror TIMEOUT on our own...
         break;
     case SubPacket_route_error_tag:
         removeRoute(p->decoded.dest);
-
-        // FIXME: if any pending packets were waiting on this route, delete them
         break;
     default:
         break;
     }
 
-    // We simply ignore ACKs - because ReliableRouter will delete the pending packet for us
-
     // Handle regular packets
     if (p->to == getNodeNum()) { // Destined for us (at least for this hop)
 
         // We need to route this packet to some other node
         if (p->decoded.dest && p->decoded.dest != p->to) {
             // if we have a route out, resend the packet to the next hop, otherwise return RouteError no-route available
-
             NodeNum nextHop = getNextHop(p->decoded.dest);
-            if (nextHop) {
-                sendNextHop(nextHop, p); // start a reliable single hop send
+            if (p->hop_limit == 0) {
+                LOG_DEBUG(MESH, "Source routed packet to 0x%x ran out of hops\n", p->decoded.dest);
+            } else if (!nextHop || nextHop == p->from) {
+                // We don't have a route out (sending it back where it came from would just make a loop)
+                sendRouteError(p->decoded.dest, RouteError_NO_ROUTE);
             } else {
-                // We don't have a route out
-                assert(p->decoded.source); // I think this is guaranteed by now
-
-                // FIXME - what if the current packet _is_ a route error packet?
-                sendRouteError(p, RouteError_NO_ROUTE);
+                MeshPacket *tosend = packetPool.allocCopy(*p, 0);
+                if (tosend) {
+                    tosend->from = getNodeNum();
+                    tosend->id = generatePacketId();
+                    tosend->hop_limit--;
+                    tosend->decoded.which_ack = 0; // Any ack piggybacked on this hop was for us
+#ifdef LORA_NETWORK_CODING
+                    // If a forward going the other way turns up soon we can send both in one coded frame
+                    MeshPacket *coded =
+                        networkCoder.offer(p, tosend, nextHop, iface ? NC_HOLD_PACKET_TIMES * iface->shortPacketMsec : 0);
+                    if (coded == tosend)
+                        sendNextHop(nextHop, tosend);
+                    else if (coded)
+                        ReliableRouter::send(coded);
+                    else
+                        setIntervalFromNow(0); // Held, so runOnce needs to know when to give up waiting
+#else
+                    sendNextHop(nextHop, tosend);
+#endif
+                } else
+                    LOG_ERROR(MESH, "No free packets, can't forward to 0x%x\n", p->decoded.dest);
             }
-
-            // FIXME, stop local processing of this packet
         }
 
         // handle naks - convert them to route error packets
         // All naks are generated locally, because we failed resending the packet too many times
         PacketId nakId = p->decoded.which_ack == SubPacket_fail_id_tag ? p->decoded.ack.fail_id : 0;
         if (nakId) {
-            auto pending = findPendingPacket(p->to, nakId);
-            if (pending && pending->packet->decoded.source) { // if source not set, this was not a multihop packet, just ignore
-                removeRoute(pending->packet->decoded.dest);   // We no longer have a route to the specified node
-
-                sendRouteError(p, RouteError_GOT_NAK);
+            for (size_t i = 0; i < DSR_MAX_RECENT_SENDS; i++) {
+                RecentSend &s = recentSends[i];
+                if (s.id == nakId && s.dest) {
+                    NodeNum dest = s.dest;
+                    s.dest = 0;
+                    sendRouteError(dest, RouteError_GOT_NAK);
+                    break;
+                }
             }
         }
     }
@@ -153,12 +317,45 @@ void DSRRouter::sniffReceived(const MeshPacket *p)
     return ReliableRouter::sniffReceived(p);
 }
 
+bool DSRRouter::prepareForDelivery(MeshPacket *p)
+{
+    if (p->to == getNodeNum() && p->decoded.dest) {
+        if (p->decoded.dest != getNodeNum())
+            return false; // We were just a hop along the way
+
+        // Show our local services who really sent this
+        if (p->decoded.source) {
+            p->from = p->decoded.source;
+            p->id = p->decoded.original_id;
+        }
+    }
+
+    return ReliableRouter::prepareForDelivery(p);
+}
+
+bool DSRRouter::isDuplicateRequest(const MeshPacket *p)
+{
+    // The original broadcast was already checked by our regular duplicate detection
+    if (p->from == p->decoded.source && p->id == p->decoded.original_id)
+        return false;
+
+    // But intermediate nodes resend with their own from/id, so also remember the request by its originator
+    MeshPacket key = MeshPacket_init_default;
+    key.from = p->decoded.source;
+    key.id = p->decoded.original_id;
+    return wasSeenRecently(&key);
+}
+
 /**
  * Does our node appear in the specified route
  */
 bool DSRRouter::weAreInRoute(const RouteDiscovery &route)
 {
-    return true; // FIXME
+    for (pb_size_t i = 0; i < route.route_count; i++)
+        if ((NodeNum)route.route[i] == getNodeNum())
+            return true;
+
+    return false;
 }
 
 /**
@@ -170,7 +367,30 @@ bool DSRRouter::weAreInRoute(const RouteDiscovery &route)
  **/
 void DSRRouter::updateRoutes(const RouteDiscovery &route, bool isRequest)
 {
-    DEBUG_MSG("FIXME not implemented updateRoutes\n");
+    pb_size_t n = route.route_count;
+    if (n == 0)
+        return;
+
+    if (isRequest) {
+        // Everyone in the request so far can be reached by going back through whoever sent it to us (the last entry)
+        NodeNum forwarder = route.route[n - 1];
+        for (pb_size_t i = 0; i < n; i++)
+            addRoute(route.route[i], forwarder, n - 1 - i);
+    } else {
+        // A reply lists the whole route, we can reach everyone before us by going back and everyone after by going forward
+        int us = -1;
+        for (pb_size_t i = 0; i < n; i++)
+            if ((NodeNum)route.route[i] == getNodeNum())
+                us = i;
+
+        if (us < 0)
+            return; // We overheard a reply we are not part of, we don't know who is adjacent
+
+        for (int i = 0; i < us; i++)
+            addRoute(route.route[i], route.route[us - 1], us - 1 - i);
+        for (int i = us + 1; i < n; i++)
+            addRoute(route.route[i], route.route[us + 1], i - us - 1);
+    }
 }
 
 /**
@@ -178,7 +398,28 @@ void DSRRouter::updateRoutes(const RouteDiscovery &route, bool isRequest)
  */
 void DSRRouter::sendRouteReply(const RouteDiscovery &route, NodeNum toAppend)
 {
-    DEBUG_MSG("FIXME not implemented sendRoute\n");
+    const pb_size_t maxRoute = sizeof(route.route) / sizeof(route.route[0]);
+    if (route.route_count + (toAppend ? 2 : 1) > maxRoute) {
+        LOG_DEBUG(MESH, "Route too long to reply to\n");
+        return;
+    }
+
+    MeshPacket *p = allocForSending();
+    p->decoded.which_payload = SubPacket_route_reply_tag;
+
+    RouteDiscovery &reply = p->decoded.route_reply;
+    reply = route;
+    reply.route[reply.route_count++] = getNodeNum();
+    if (toAppend)
+        reply.route[reply.route_count++] = toAppend;
+
+    // The reply is itself source routed back to the requester
+    p->to = p->decoded.dest = route.route[0];
+    p->decoded.source = getNodeNum();
+    p->decoded.original_id = p->id;
+    p->hop_limit = HOP_MAX;
+
+    send(p);
 }
 
 /**
@@ -188,17 +429,27 @@ void DSRRouter::sendRouteReply(const RouteDiscovery &route, NodeNum toAppend)
  */
 NodeNum DSRRouter::getNextHop(NodeNum dest)
 {
-    DEBUG_MSG("FIXME not implemented getNextHop\n");
-    return 0;
+    const Route *r = routeCache.find(dest);
+    return r ? r->nextHop : 0;
 }
 
 /** Not in our route cache, rebroadcast on their behalf (after adding ourselves to the request route)
- *
- * We will bump down hop_limit in this call.
  */
 void DSRRouter::resendRouteRequest(const MeshPacket *p)
 {
-    DEBUG_MSG("FIXME not implemented resendRoute\n");
+    const RouteDiscovery &route = p->decoded.route_request;
+    if (route.route_count >= sizeof(route.route) / sizeof(route.route[0])) {
+        LOG_DEBUG(MESH, "Route request has gone as far as it can\n");
+        return;
+    }
+
+    MeshPacket *tosend = allocForSending();
+    tosend->decoded = p->decoded; // keeps dest, source, original_id and the route so far
+    tosend->decoded.route_request.route[tosend->decoded.route_request.route_count++] = getNodeNum();
+    tosend->to = NODENUM_BROADCAST;
+    tosend->hop_limit = 0; // Only our neighbors should see it, they will add themselves and resend
+
+    send(tosend);
 }
 
 /**
@@ -208,7 +459,24 @@ void DSRRouter::resendRouteRequest(const MeshPacket *p)
  */
 void DSRRouter::addRoute(NodeNum dest, NodeNum forwarder, uint8_t numHops)
 {
-    DEBUG_MSG("FIXME not implemented addRoute\n");
+    if (dest == getNodeNum() || forwarder == getNodeNum())
+        return; // We never need a route to ourselves
+
+    if (routeCache.add(dest, forwarder, numHops)) {
+        for (size_t i = 0; i < DSR_MAX_DISCOVERIES; i++)
+            if (failedDiscoveries[i].dest == dest)
+                failedDiscoveries[i].dest = 0; // It is reachable after all
+
+        // No need to keep asking about this node
+        for (size_t i = 0; i < numDiscoveries; i++)
+            if (discoveries[i].dest == dest) {
+                discoveries[i] = discoveries[--numDiscoveries];
+                break;
+            }
+
+        if (numWaiting)
+            sendWaiting();
+    }
 }
 
 /**
@@ -216,30 +484,155 @@ void DSRRouter::addRoute(NodeNum dest, NodeNum forwarder, uint8_t numHops)
  */
 void DSRRouter::removeRoute(NodeNum dest)
 {
-    DEBUG_MSG("FIXME not implemented removeRoute\n");
+    routeCache.remove(dest);
 }
 
 /**
- * Forward the specified packet to the specified node
+ * Send the specified packet (which we own) to the specified node, as a reliable single hop send
  */
-void DSRRouter::sendNextHop(NodeNum n, const MeshPacket *p)
+void DSRRouter::sendNextHop(NodeNum n, MeshPacket *p)
 {
-    DEBUG_MSG("FIXME not implemented sendNextHop\n");
+    p->to = n;
+    p->want_ack = true;
+
+    // Remember this hop, so if it fails we can tell the mesh
+    recentSends[recentSendPos] = {p->id, p->decoded.dest};
+    recentSendPos = (recentSendPos + 1) % DSR_MAX_RECENT_SENDS;
+
+    ReliableRouter::send(p);
 }
 
 /**
- * Send a route error packet towards whoever originally sent this message
+ * Tell the mesh that we can no longer reach dest
  */
-void DSRRouter::sendRouteError(const MeshPacket *p, RouteError err)
+void DSRRouter::sendRouteError(NodeNum dest, RouteError err)
 {
-    DEBUG_MSG("FIXME not implemented sendRouteError\n");
+    removeRoute(dest);
+
+    // Flooded, so everyone who might have been routing through us can forget the route
+    MeshPacket *p = allocForSending();
+    p->to = NODENUM_BROADCAST;
+    p->decoded.which_payload = SubPacket_route_error_tag;
+    p->decoded.route_error = err;
+    p->decoded.dest = dest;
+    p->decoded.source = getNodeNum();
+
+    send(p);
 }
 
-/** make a copy of p, start discovery, but only if we don't
- *  already a discovery in progress for that node number.  Caller has already scheduled this message for retransmission
- *  when the discovery is complete.
+/** start discovery, but only if we don't
+ *  already a discovery in progress for that node number.
  */
 void DSRRouter::startDiscovery(NodeNum dest)
 {
-    DEBUG_MSG("FIXME not implemented startDiscovery\n");
-}
\ No newline at end of file
+    for (size_t i = 0; i < numDiscoveries; i++)
+        if (discoveries[i].dest == dest)
+            return;
+
+    if (numDiscoveries == DSR_MAX_DISCOVERIES) {
+        LOG_DEBUG(MESH, "Too many route discoveries, not looking for 0x%x\n", dest);
+        return;
+    }
+
+    discoveries[numDiscoveries++] = {dest, millis()};
+
+    MeshPacket *p = allocForSending();
+    p->to = NODENUM_BROADCAST;
+    p->hop_limit = 0; // Each node that doesn't know a route will add itself and resend
+    p->decoded.which_payload = SubPacket_route_request_tag;
+    p->decoded.route_request.route_count = 1;
+    p->decoded.route_request.route[0] = getNodeNum();
+    p->decoded.dest = dest;
+    p->decoded.source = getNodeNum();
+    p->decoded.original_id = p->id;
+
+    LOG_DEBUG(MESH, "Starting route discovery for 0x%x\n", dest);
+    send(p);
+}
+
+bool DSRRouter::recentlyFailed(NodeNum dest)
+{
+    uint32_t now = millis();
+    for (size_t i = 0; i < DSR_MAX_DISCOVERIES; i++) {
+        const Discovery &f = failedDiscoveries[i];
+        if (f.dest == dest && now - f.startMsec < DSR_FAILED_DISCOVERY_MSEC)
+            return true;
+    }
+
+    return false;
+}
+
+void DSRRouter::failDiscovery(size_t i)
+{
+    NodeNum dest = discoveries[i].dest;
+    discoveries[i] = discoveries[--numDiscoveries];
+    LOG_WARN(MESH, "Route discovery for 0x%x timed out\n", dest);
+
+    failedDiscoveries[failedDiscoveryPos] = {dest, millis()};
+    failedDiscoveryPos = (failedDiscoveryPos + 1) % DSR_MAX_DISCOVERIES;
+
+    for (size_t j = 0; j < numWaiting;) {
+        if (waiting[j].dest != dest) {
+            j++;
+            continue;
+        }
+
+        MeshPacket *p = waiting[j].packet;
+        waiting[j] = waiting[--numWaiting];
+
+        // Only source routed packets wait (see onReliableSendFailed), tell whoever gave it to us that it failed
+        LOG_WARN(MESH, "No route to 0x%x, returning a nak for id=0x%x\n", dest, p->decoded.original_id);
+        sendAckNak(false, p->decoded.source, p->decoded.original_id);
+        packetPool.release(p);
+    }
+}
+
+bool DSRRouter::speaksDsr(NodeNum n)
+{
+    for (size_t i = 0; i < DSR_MAX_KNOWN_NODES; i++)
+        if (knownNodes[i] == n)
+            return true;
+
+    return false;
+}
+
+void DSRRouter::addKnownNode(NodeNum n)
+{
+    if (!n || n == getNodeNum() || speaksDsr(n))
+        return;
+
+    knownNodes[knownNodePos] = n;
+    knownNodePos = (knownNodePos + 1) % DSR_MAX_KNOWN_NODES;
+}
+
+void DSRRouter::addKnownNodes(const RouteDiscovery &route, NodeNum lastAdded)
+{
+    for (pb_size_t i = 0; i < route.route_count; i++) {
+        addKnownNode(route.route[i]);
+        if ((NodeNum)route.route[i] == lastAdded)
+            break; // Anything after it was appended from a route cache
+    }
+}
+
+bool DSRRouter::waitForRoute(MeshPacket *p, NodeNum dest)
+{
+    if (numWaiting == DSR_MAX_WAITING)
+        return false;
+
+    waiting[numWaiting++] = {p, dest};
+    return true;
+}
+
+void DSRRouter::sendWaiting()
+{
+    for (size_t i = 0; i < numWaiting;) {
+        if (!getNextHop(waiting[i].dest)) {
+            i++;
+            continue;
+        }
+
+        MeshPacket *p = waiting[i].packet;
+        waiting[i] = waiting[--numWaiting];
+        send(p);
+    }
+}
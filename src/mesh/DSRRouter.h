@@ -1,7 +1,71 @@
 #include "ReliableRouter.h"
+#include "RouteCache.h"
+
+/// The most packets we will hold while waiting for route discoveries to complete
+#define DSR_MAX_WAITING 4
+
+/// The most route discoveries we will have in progress at once
+#define DSR_MAX_DISCOVERIES 4
+
+/// How long we wait for a route reply before giving up on a discovery (and naking any packets waiting for it)
+#define DSR_DISCOVERY_TIMEOUT_MSEC (60 * 1000L)
+
+/// After a route discovery for a node times out we don't start another for it for this long (we just send the old way)
+#define DSR_FAILED_DISCOVERY_MSEC (2 * 60 * 1000L)
+
+/// How many of our recent source routed sends we remember, so a nak for one of them can be turned into a route error
+#define DSR_MAX_RECENT_SENDS 8
+
+/// How many nodes we remember hearing speak DSR (only they are sent source routed packets)
+#define DSR_MAX_KNOWN_NODES ROUTE_CACHE_SIZE
 
 class DSRRouter : public ReliableRouter
 {
+    struct WaitingPacket {
+        MeshPacket *packet;
+        NodeNum dest;
+    };
+
+    struct Discovery {
+        NodeNum dest;
+        uint32_t startMsec;
+    };
+
+    struct RecentSend {
+        PacketId id;
+        NodeNum dest;
+    };
+
+    /// Packets we originated which are waiting for a route
+    WaitingPacket waiting[DSR_MAX_WAITING];
+    size_t numWaiting = 0;
+
+    /// Destinations we have sent route requests for (we only allow one outstanding request per destination)
+    Discovery discoveries[DSR_MAX_DISCOVERIES];
+    size_t numDiscoveries = 0;
+
+    /// A ring of destinations whose discoveries recently timed out (startMsec is when they failed, dest 0 if unused)
+    Discovery failedDiscoveries[DSR_MAX_DISCOVERIES] = {};
+    size_t failedDiscoveryPos = 0;
+
+    /// A ring of our recent source routed single hop sends
+    RecentSend recentSends[DSR_MAX_RECENT_SENDS];
+    size_t recentSendPos = 0;
+
+    /// A ring of nodes we know understand source routing (0 if unused)
+    NodeNum knownNodes[DSR_MAX_KNOWN_NODES] = {};
+    size_t knownNodePos = 0;
+
+  public:
+    /** Time out any route discoveries which haven't been answered */
+    virtual int32_t runOnce();
+
+    /**
+     * Reverse path learning: a copy of a flood from O that neighbor N transmitted tells us N can reach O, in one hop fewer
+     * than the copy took to reach us.  We keep the shortest path we hear (the copy with the highest remaining hop_limit), so
+     * replies to anyone who has flooded recently (and speaks DSR, see speaksDsr()) are source routed without a route discovery.
+     */
+    virtual void onRelayHeard(const MeshPacket *p, uint8_t relayByte);
 
   protected:
     /**
@@ -10,6 +74,18 @@ class DSRRouter : public ReliableRouter
      */
     virtual void sniffReceived(const MeshPacket *p);
 
+    /// Learn 0 hop routes from the transit packets we overhear too
+    virtual void sniffTransit(const MeshPacket *p);
+
+    /// Our source routes also tell us how far away nodes are
+    virtual uint8_t getHopsAway(NodeNum node);
+
+    /**
+     * If the first hop of a packet we source routed failed, try again with a fresh route discovery.  The nak for it waits
+     * until that retry fails too.
+     */
+    virtual bool onReliableSendFailed(const MeshPacket *p);
+
     /**
      * Send a packet on a suitable interface.  This routine will
      * later free() the packet to pool.  This routine is not allowed to stall.
@@ -17,12 +93,21 @@ class DSRRouter : public ReliableRouter
      */
     virtual ErrorCode send(MeshPacket *p);
 
+    /**
+     * Show the original sender for source routed packets which have reached us, and don't deliver packets we are only
+     * forwarding
+     */
+    virtual bool prepareForDelivery(MeshPacket *p);
+
   private:
     /**
      * Does our node appear in the specified route
      */
     bool weAreInRoute(const RouteDiscovery &route);
 
+    /// Have we already handled this route request (possibly as resent by some other node)
+    bool isDuplicateRequest(const MeshPacket *p);
+
     /**
      * Given a DSR route, use that route to update our DB of possible routes
      *
@@ -34,6 +119,8 @@ class DSRRouter : public ReliableRouter
 
     /**
      * send back a route reply (the sender address will be first in the list)
+     *
+     * @param toAppend if not zero, the node the requester was looking for (which we have a cached route to)
      */
     void sendRouteReply(const RouteDiscovery &route, NodeNum toAppend = 0);
 
@@ -46,7 +133,7 @@ class DSRRouter : public ReliableRouter
 
     /** Not in our route cache, rebroadcast on their behalf (after adding ourselves to the request route)
      *
-     * We will bump down hop_limit in this call.
+     * The resend is a zero hop broadcast, requests can only travel as far as the route list has room for.
      */
     void resendRouteRequest(const MeshPacket *p);
 
@@ -63,18 +150,44 @@ class DSRRouter : public ReliableRouter
     void removeRoute(NodeNum dest);
 
     /**
-     * Forward the specified packet to the specified node
+     * Send the specified packet (which we own) to the specified node, as a reliable single hop send
      */
-    void sendNextHop(NodeNum n, const MeshPacket *p);
+    void sendNextHop(NodeNum n, MeshPacket *p);
 
     /**
-     * Send a route error packet towards whoever originally sent this message
+     * Tell the mesh that we can no longer reach dest
      */
-    void sendRouteError(const MeshPacket *p, RouteError err);
+    void sendRouteError(NodeNum dest, RouteError err);
 
-    /** make a copy of p, start discovery, but only if we don't
-     *  already a discovery in progress for that node number.  Caller has already scheduled this message for retransmission
-     *  when the discovery is complete.
+    /** start discovery, but only if we don't
+     *  already a discovery in progress for that node number.
      */
     void startDiscovery(NodeNum dest);
-};
\ No newline at end of file
+
+    /// Did a discovery for dest time out within the last DSR_FAILED_DISCOVERY_MSEC?
+    bool recentlyFailed(NodeNum dest);
+
+    /**
+     * Do we know n is running a build which understands source routing?  Only those restore the original sender of a source
+     * routed packet, older builds would think it came from its last hop (and send their ack and reply there).
+     */
+    bool speaksDsr(NodeNum n);
+
+    /// Remember that n understands source routing
+    void addKnownNode(NodeNum n);
+
+    /**
+     * Remember everyone in a route request or reply up to lastAdded (all of it if 0), they added themselves to it.  A node
+     * replying from its route cache appends the destination after itself, which tells us nothing about that destination.
+     */
+    void addKnownNodes(const RouteDiscovery &route, NodeNum lastAdded);
+
+    /// Give up on our discovery for discoveries[i] and anything waiting for it
+    void failDiscovery(size_t i);
+
+    /// Hold p (which we own) until we find a route to dest, @return false if we have no room for it
+    bool waitForRoute(MeshPacket *p, NodeNum dest);
+
+    /// Send any waiting packets we now have routes for
+    void sendWaiting();
+};
@@ -0,0 +1,114 @@
+#include "ErasureCode.h"
+
+/// The usual Reed-Solomon field polynomial, x^8 + x^4 + x^3 + x^2 + 1
+#define GF_POLY 0x11d
+
+static uint8_t gfMul(uint8_t a, uint8_t b)
+{
+    uint16_t x = a, product = 0;
+    for (; b; b >>= 1) {
+        if (b & 1)
+            product ^= x;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    return product;
+}
+
+/// a^254, which is a's inverse (a must not be 0)
+static uint8_t gfInv(uint8_t a)
+{
+    uint8_t result = 1;
+    for (uint8_t e = 254; e; e >>= 1) {
+        if (e & 1)
+            result = gfMul(result, a);
+        a = gfMul(a, a);
+    }
+    return result;
+}
+
+/// The Cauchy matrix entry for parity block j and data block i, 1 / (x_j + y_i) with x_j = ERASURE_MAX_BLOCKS + j and y_i = i
+static uint8_t coefficient(uint8_t j, uint8_t i)
+{
+    return gfInv((ERASURE_MAX_BLOCKS + j) ^ i);
+}
+
+/// dst += f * src
+static void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t f, size_t len)
+{
+    if (f == 1) {
+        for (size_t n = 0; n < len; n++)
+            dst[n] ^= src[n];
+    } else if (f) {
+        for (size_t n = 0; n < len; n++)
+            dst[n] ^= gfMul(f, src[n]);
+    }
+}
+
+void erasureEncode(const uint8_t *const *data, size_t k, size_t len, uint8_t parityIndex, uint8_t *parity)
+{
+    for (size_t n = 0; n < len; n++)
+        parity[n] = 0;
+    for (size_t i = 0; i < k; i++)
+        mulAdd(parity, data[i], coefficient(parityIndex, i), len);
+}
+
+bool erasureDecode(uint8_t *const *data, size_t k, uint16_t missing, const uint8_t *const *parity, const uint8_t *parityIndexes,
+                   size_t numParity, size_t len)
+{
+    uint8_t lost[ERASURE_MAX_BLOCKS];
+    size_t e = 0;
+    for (size_t i = 0; i < k; i++)
+        if (missing & (1 << i))
+            lost[e++] = i;
+    if (e > numParity)
+        return false;
+
+    // Using the first e parity blocks, take away what we know of each (leaving its combination of the lost blocks) and keep the
+    // result where the lost blocks go.  That leaves m * lost = the buffers, for the e x e Cauchy submatrix m.
+    uint8_t m[ERASURE_MAX_BLOCKS][ERASURE_MAX_BLOCKS];
+    for (size_t r = 0; r < e; r++) {
+        uint8_t *row = data[lost[r]];
+        for (size_t n = 0; n < len; n++)
+            row[n] = parity[r][n];
+        for (size_t i = 0; i < k; i++)
+            if (!(missing & (1 << i)))
+                mulAdd(row, data[i], coefficient(parityIndexes[r], i), len);
+        for (size_t c = 0; c < e; c++)
+            m[r][c] = coefficient(parityIndexes[r], lost[c]);
+    }
+
+    // Gauss-Jordan elimination, doing each row operation to the buffers too.  Rather than swapping rows we add a row with a good
+    // pivot, so each buffer stays in place and ends up holding its own block.
+    for (size_t c = 0; c < e; c++) {
+        if (!m[c][c]) {
+            size_t p = c + 1;
+            while (p < e && !m[p][c])
+                p++;
+            if (p == e)
+                return false; // Can't happen for a Cauchy matrix, unless a parity index was repeated
+            for (size_t x = 0; x < e; x++)
+                m[c][x] ^= m[p][x];
+            mulAdd(data[lost[c]], data[lost[p]], 1, len);
+        }
+
+        uint8_t scale = gfInv(m[c][c]);
+        for (size_t x = 0; x < e; x++)
+            m[c][x] = gfMul(m[c][x], scale);
+        uint8_t *pivotRow = data[lost[c]];
+        for (size_t n = 0; n < len; n++)
+            pivotRow[n] = gfMul(pivotRow[n], scale);
+
+        for (size_t r = 0; r < e; r++) {
+            uint8_t f = m[r][c];
+            if (r == c || !f)
+                continue;
+            for (size_t x = 0; x < e; x++)
+                m[r][x] ^= gfMul(f, m[c][x]);
+            mulAdd(data[lost[r]], pivotRow, f, len);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// The most data or parity blocks one group can have
+#define ERASURE_MAX_BLOCKS 16
+
+/**
+ * A systematic Reed-Solomon erasure code over GF(2^8), built from a Cauchy matrix.
+ *
+ * A group of k data blocks (all len bytes, pad shorter ones with zeros) gets up to ERASURE_MAX_BLOCKS parity blocks.  Parity
+ * block j is a fixed linear combination of the data blocks, and any k of the data and parity blocks are enough to rebuild the
+ * whole group (every square submatrix of a Cauchy matrix is invertible).  Senders can add parity blocks one at a time, so
+ * redundancy can be picked per group.
+ *
+ * The field arithmetic is done bit by bit rather than with log tables, which keeps this out of our RAM budget.  Our groups
+ * are a few fragments of a couple hundred bytes, so that is plenty fast.
+ */
+
+/// Compute parity block parityIndex of the k data blocks in data
+void erasureEncode(const uint8_t *const *data, size_t k, size_t len, uint8_t parityIndex, uint8_t *parity);
+
+/**
+ * Rebuild the data blocks of a group which are missing
+ *
+ * @param data the k data blocks, the ones with their bit set in missing are overwritten with what we rebuild
+ * @param parity the parity blocks we have, parityIndexes[i] is the index parity[i] was encoded with
+ * @return false if we don't have enough parity blocks (we need at least one per missing block)
+ */
+bool erasureDecode(uint8_t *const *data, size_t k, uint16_t missing, const uint8_t *const *parity, const uint8_t *parityIndexes,
+                   size_t numParity, size_t len);
@@ -1,4 +1,6 @@
 #include "FloodingRouter.h"
+#include "NeighborTable.h"
+#include "NodeDB.h"
 #include "configuration.h"
 #include "mesh-pb-constants.h"
 
@@ -17,36 +19,139 @@ ErrorCode FloodingRouter::send(MeshPacket *p)
     return Router::send(p);
 }
 
+int32_t FloodingRouter::runOnce()
+{
+    int32_t d = Router::runOnce();
+
+    uint32_t now = millis();
+    for (size_t i = 0; i < numPending;) {
+        PendingRebroadcast &r = pendingRebroadcasts[i];
+        int32_t t = r.sendAtMsec - now;
+
+        if (t <= 0) {
+            MeshPacket *p = r.packet;
+            r = pendingRebroadcasts[--numPending]; // Order doesn't matter, so just fill the hole with our last entry
+            Router::queueRebroadcast(p);
+        } else {
+            d = min(t, d);
+            i++;
+        }
+    }
+
+    return d;
+}
+
 bool FloodingRouter::shouldFilterReceived(const MeshPacket *p)
 {
     if (wasSeenRecently(p)) { // Note: this will also add a recent packet record
-        printPacket("Ignoring incoming msg, because we've already seen it", p);
+        LOG_PACKET(MESH, "Ignoring incoming msg, because we've already seen it", p);
         return true;
     }
 
     return Router::shouldFilterReceived(p);
 }
 
-void FloodingRouter::sniffReceived(const MeshPacket *p)
+bool FloodingRouter::isDuplicate(const MeshPacket *p)
+{
+    if (p->to != NODENUM_BROADCAST || p->from == getNodeNum() || is_in_repeated(radioConfig.preferences.ignore_incoming, p->from))
+        return false;
+
+    return wasSeenRecently(p); // Which also counts it towards cancelling our own rebroadcast
+}
+
+MeshPacket *FloodingRouter::copyForRebroadcast(const MeshPacket *p)
 {
     // If a broadcast, possibly _also_ send copies out into the mesh.
-    // (FIXME, do something smarter than naive flooding here)
     if (p->to == NODENUM_BROADCAST && p->hop_limit > 0) {
         if (p->id != 0) {
-            MeshPacket *tosend = packetPool.allocCopy(*p); // keep a copy because we will be sending it
+            uint8_t percent = getGossipPercent();
+            if (percent < 100 && (uint8_t)random(0, 100) >= percent) {
+                LOG_PACKET(MESH, "Not rebroadcasting, we have plenty of neighbors to do it", p);
+                numGossipSkipped++;
+                return NULL;
+            }
+
+            MeshPacket *tosend = packetPool.allocCopy(*p, 0); // keep a copy because we will be sending it
 
-            tosend->hop_limit--; // bump down the hop count
+            if (!tosend) {
+                LOG_WARN(MESH, "Warning: packet pool is low, not rebroadcasting floodmsg\n");
+            } else {
+                tosend->hop_limit--; // bump down the hop count
 
-            printPacket("Rebroadcasting received floodmsg to neighbors", p);
-            // Note: we are careful to resend using the original senders node id
-            // We are careful not to call our hooked version of send() - because we don't want to check this again
-            Router::send(tosend);
+                // Note: we are careful to resend using the original senders node id (and the original ciphertext)
+                return tosend;
+            }
 
         } else {
-            DEBUG_MSG("Ignoring a simple (0 id) broadcast\n");
+            LOG_DEBUG(MESH, "Ignoring a simple (0 id) broadcast\n");
         }
     }
 
-    // handle the packet as normal
-    Router::sniffReceived(p);
+    return NULL;
+}
+
+void FloodingRouter::queueRebroadcast(MeshPacket *p)
+{
+    if (numPending == FLOOD_MAX_PENDING) {
+        LOG_WARN(MESH, "Warning: too many pending rebroadcasts, sending now\n");
+        Router::queueRebroadcast(p);
+        return;
+    }
+
+    uint32_t delay = getRebroadcastDelayMsec(p);
+    LOG_DEBUG(MESH, "Rebroadcasting fr=0x%x,id=%d in %u msec unless we hear it from others (snr=%f)\n", p->from, p->id, delay,
+              p->rx_snr);
+    pendingRebroadcasts[numPending++] = {p, millis() + delay, 0};
+
+    // Note: we are called from within our runOnce(), which will schedule us based on our new pending rebroadcast
+}
+
+void FloodingRouter::onDuplicate(const MeshPacket *p)
+{
+    for (size_t i = 0; i < numPending; i++) {
+        PendingRebroadcast &r = pendingRebroadcasts[i];
+        if (r.packet->from == p->from && r.packet->id == p->id) {
+            if (++r.numCopies >= FLOOD_SUPPRESS_COPIES) {
+                LOG_PACKET(MESH, "Cancelling rebroadcast, enough neighbors already sent it", r.packet);
+                numSuppressed++;
+                packetPool.release(r.packet);
+                r = pendingRebroadcasts[--numPending];
+            }
+            return;
+        }
+    }
+}
+
+uint8_t FloodingRouter::getGossipPercent()
+{
+#ifndef LORA_FLOOD_GOSSIP
+    return 100;
+#else
+    if (radioConfig.preferences.is_router)
+        return 100;
+
+    uint32_t now = millis();
+    size_t numRecent = 0;
+    for (size_t i = 0; i < neighbors.getNumNeighbors(); i++)
+        if (now - neighbors.getByIndex(i).lastHeardMsec < FLOOD_GOSSIP_WINDOW_MSEC)
+            numRecent++;
+
+    // Each of our neighbors probably hears most of the others, so about FLOOD_GOSSIP_MIN_NEIGHBORS rebroadcasts cover us
+    if (numRecent <= FLOOD_GOSSIP_MIN_NEIGHBORS)
+        return 100;
+    return max((size_t)FLOOD_GOSSIP_MIN_PERCENT, 100 * FLOOD_GOSSIP_MIN_NEIGHBORS / numRecent);
+#endif
+}
+
+uint32_t FloodingRouter::getRebroadcastDelayMsec(const MeshPacket *p)
+{
+    if (!iface)
+        return 0;
+
+    // Spread our delay over a couple of short packet times by SNR, plus a little jitter for nodes which heard it equally well
+    float snr = p->rx_snr < FLOOD_SNR_MIN ? FLOOD_SNR_MIN : (p->rx_snr > FLOOD_SNR_MAX ? FLOOD_SNR_MAX : p->rx_snr);
+    uint32_t window = 2 * iface->shortPacketMsec;
+    uint32_t delay = window * (snr - FLOOD_SNR_MIN) / (FLOOD_SNR_MAX - FLOOD_SNR_MIN);
+
+    return delay + random(0, iface->shortPacketMsec / 4 + 1);
 }
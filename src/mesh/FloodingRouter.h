@@ -3,8 +3,31 @@
 #include "PacketHistory.h"
 #include "Router.h"
 
+/// The most rebroadcasts we will hold waiting for their turn, if we have more than this we send them immediately
+#define FLOOD_MAX_PENDING 8
+
+/// We cancel a waiting rebroadcast once we have overheard this many other nodes rebroadcasting the same packet
+#define FLOOD_SUPPRESS_COPIES 2
+
+/// The range of SNRs we spread our rebroadcast delays over (weaker is sooner)
+#define FLOOD_SNR_MIN -20
+#define FLOOD_SNR_MAX 10
+
+/// Gossip forwarding (see getGossipPercent): with this many recent neighbors or fewer we always rebroadcast
+#ifndef FLOOD_GOSSIP_MIN_NEIGHBORS
+#define FLOOD_GOSSIP_MIN_NEIGHBORS 3
+#endif
+
+/// We count the neighbors we have heard directly within this long
+#define FLOOD_GOSSIP_WINDOW_MSEC (5 * 60 * 1000L)
+
+/// However many neighbors we have, we still rebroadcast at least this percentage of floods
+#ifndef FLOOD_GOSSIP_MIN_PERCENT
+#define FLOOD_GOSSIP_MIN_PERCENT 20
+#endif
+
 /**
- * This is a mixin that extends Router with the ability to do Naive Flooding (in the standard mesh protocol sense)
+ * This is a mixin that extends Router with the ability to do Managed Flooding (in the standard mesh protocol sense)
  *
  *   Rules for broadcasting (listing here for now, will move elsewhere eventually):
 
@@ -20,8 +43,20 @@
   indicates this message.  If so, we've already seen it - so we discard it.  If
   not, we add it to the table and then resend this message on all interfaces.
   When resending we are careful to use the "from" ID of the original sender. Not
-  our own ID.  When resending we pick a random delay between 0 and 10 seconds to
-  decrease the chance of collisions with transmitters we can not even hear.
+  our own ID.
+
+  Before resending we wait for a delay based on the SNR we heard the message with.  Nodes that barely
+  heard the sender are probably the farthest away, so they wait the least and their rebroadcast
+  reaches the most new nodes.  If while waiting we overhear FLOOD_SUPPRESS_COPIES other nodes
+  rebroadcasting the same message, our neighbors have almost certainly already heard it and we
+  cancel our rebroadcast (counter based suppression).
+
+  Builds with LORA_FLOOD_GOSSIP also only rebroadcast each flood with a probability that depends on how many neighbors we
+  have heard directly in the last few minutes (gossip forwarding).  With few neighbors we may be the only bridge between parts
+  of the mesh, so we always rebroadcast; in a dense cluster most of our neighbors will rebroadcast anyway, so we rarely do.
+  Routers always rebroadcast.  Floods we do decide to rebroadcast still go through counter based suppression.  It is off by
+  default, because a node with many neighbors can still be the only bridge to a sparse area, and counter based suppression
+  already thins out dense clusters.
 
   Any entries in recentBroadcasts that are older than X seconds (longer than the
   max time a flood can take) will be discarded.
@@ -29,6 +64,18 @@
 class FloodingRouter : public Router, protected PacketHistory
 {
   private:
+    struct PendingRebroadcast {
+        MeshPacket *packet;
+        uint32_t sendAtMsec;
+        uint8_t numCopies; // How many other rebroadcasts of this packet we have heard while waiting
+    };
+
+    PendingRebroadcast pendingRebroadcasts[FLOOD_MAX_PENDING];
+    size_t numPending = 0;
+
+    /// Debugging counts
+    uint32_t numSuppressed = 0, numGossipSkipped = 0;
+
   public:
     /**
      * Constructor
@@ -43,6 +90,30 @@ class FloodingRouter : public Router, protected PacketHistory
      */
     virtual ErrorCode send(MeshPacket *p);
 
+    /** Send any rebroadcasts whose time has come */
+    virtual int32_t runOnce();
+
+    /// The number of rebroadcasts we cancelled because other nodes had already covered them
+    uint32_t getNumSuppressed() const { return numSuppressed; }
+
+    /**
+     * Copies of floods we have already seen can be dropped by the radio, as shouldFilterReceived() would.  Our own packets coming
+     * back (implicit acks) and anything sent to a particular node still go through the router.
+     */
+    virtual bool isDuplicate(const MeshPacket *p);
+
+    virtual size_t saveHistory(SavedPacketRecord *out, size_t maxOut) { return saveRecords(out, maxOut); }
+
+    virtual void restoreHistory(const SavedPacketRecord &r, uint32_t sleptMsec) { restoreRecord(r, sleptMsec); }
+
+    virtual void getStats(RouterStats &s)
+    {
+        Router::getStats(s);
+        s.duplicates = getNumHits();
+        s.suppressed = numSuppressed;
+        s.gossipSkipped = numGossipSkipped;
+    }
+
   protected:
     /**
      * Should this incoming filter be dropped?
@@ -53,7 +124,24 @@ class FloodingRouter : public Router, protected PacketHistory
     virtual bool shouldFilterReceived(const MeshPacket *p);
 
     /**
-     * Look for broadcasts we need to rebroadcast
+     * Look for broadcasts we need to rebroadcast, we forward the original ciphertext
+     */
+    virtual MeshPacket *copyForRebroadcast(const MeshPacket *p);
+
+    /**
+     * Hold our rebroadcast until its SNR based delay has passed
+     */
+    virtual void queueRebroadcast(MeshPacket *p);
+
+    /**
+     * Count copies of a packet we are waiting to rebroadcast
      */
-    virtual void sniffReceived(const MeshPacket *p);
+    virtual void onDuplicate(const MeshPacket *p);
+
+  private:
+    /// The chance (as a percentage) that we rebroadcast a flood, from how many neighbors we have heard recently
+    uint8_t getGossipPercent();
+
+    /// How long to wait before rebroadcasting p, based on the SNR we received it with
+    uint32_t getRebroadcastDelayMsec(const MeshPacket *p);
 };
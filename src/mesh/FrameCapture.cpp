@@ -0,0 +1,165 @@
+#include "FrameCapture.h"
+#include "FSCommon.h"
+#include "LargeAlloc.h"
+#include "RadioInterface.h"
+#include "gps/RTC.h"
+#include "nrf52/QSPIStore.h"
+
+FrameCapture *frameCapture;
+
+static uint16_t toBigEndian16(uint16_t x)
+{
+    return (x >> 8) | (x << 8);
+}
+
+static uint32_t toBigEndian32(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+FrameCapture::FrameCapture()
+    : concurrency::OSThread("FrameCapture", FRAME_CAPTURE_FLUSH_MSEC), ringSize(FRAME_CAPTURE_RING_SIZE), head(0), tail(0),
+      numDropped(0)
+{
+    // PSRAM_CAPACITY_SCALE is a power of 2 too, and if this fails ringSize is 0 so we just drop every frame
+    ring = (uint8_t *)largeAllocScaled(ringSize, 1);
+    if (!ring)
+        LOG_ERROR(RADIO, "Error: no memory for frame capture\n");
+}
+
+void FrameCapture::capture(const CapturedFrame &info, const uint8_t *frame)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t used = t - head.load(std::memory_order_acquire);
+    if (used + sizeof(info) + info.len > ringSize) {
+        numDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    copyIn(t, &info, sizeof(info));
+    copyIn(t + sizeof(info), frame, info.len);
+    tail.store(t + sizeof(info) + info.len, std::memory_order_release);
+
+    // Flush early rather than start dropping frames
+    if (used > ringSize / 2)
+        setIntervalFromNow(0);
+}
+
+void FrameCapture::copyIn(size_t at, const void *src, size_t len)
+{
+    size_t offset = at & (ringSize - 1), first = min(len, ringSize - offset);
+    memcpy(ring + offset, src, first);
+    memcpy(ring, (const uint8_t *)src + first, len - first);
+}
+
+void FrameCapture::copyOut(size_t at, void *dest, size_t len)
+{
+    size_t offset = at & (ringSize - 1), first = min(len, ringSize - offset);
+    memcpy(dest, ring + offset, first);
+    memcpy((uint8_t *)dest + first, ring, len - first);
+}
+
+int32_t FrameCapture::runOnce()
+{
+    flush();
+    return FRAME_CAPTURE_FLUSH_MSEC;
+}
+
+size_t FrameCapture::formatRecord(size_t &at, uint64_t nowMsec, uint32_t nowUsec, uint8_t *dest)
+{
+    CapturedFrame info;
+    uint8_t frame[MAX_RHPACKETLEN];
+    copyOut(at, &info, sizeof(info));
+    copyOut(at + sizeof(info), frame, info.len);
+    at += sizeof(info) + info.len;
+
+    uint64_t atUsec = nowMsec * 1000 - (nowUsec - info.usec);
+    PcapRecordHeader rh = {(uint32_t)(atUsec / 1000000), (uint32_t)(atUsec % 1000000),
+                           (uint32_t)(sizeof(LoRaTapHeader) + info.len), (uint32_t)(sizeof(LoRaTapHeader) + info.len)};
+
+    bool isTx = info.flags & FRAME_CAPTURE_TX;
+    uint8_t rssi = isTx ? 0 : (uint8_t)constrain((int)info.rssi + 139, 0, 255);
+    LoRaTapHeader lh;
+    lh.version = 0;
+    lh.padding = info.flags;
+    lh.length = toBigEndian16(sizeof(lh));
+    lh.frequency = toBigEndian32(info.freq * 1e6);
+    lh.bandwidth = info.bw / 125;
+    lh.sf = info.sf;
+    lh.packetRssi = lh.maxRssi = lh.currentRssi = rssi;
+    lh.snr = isTx ? 0 : (int8_t)constrain((int)(info.snr * 4), -128, 127);
+    lh.syncWord = info.syncWord;
+
+    memcpy(dest, &rh, sizeof(rh));
+    memcpy(dest + sizeof(rh), &lh, sizeof(lh));
+    memcpy(dest + sizeof(rh) + sizeof(lh), frame, info.len);
+    return sizeof(rh) + sizeof(lh) + info.len;
+}
+
+void FrameCapture::flush()
+{
+    size_t h = head.load(std::memory_order_relaxed), t = tail.load(std::memory_order_acquire);
+    if (h == t)
+        return;
+
+    // Our records have micros() timestamps, which are recent enough that we can turn them into wall clock times from now
+    uint64_t nowMsec = getValidTimeMsec(RTCQualityNone);
+    uint32_t nowUsec = micros();
+
+    uint8_t record[FRAME_CAPTURE_MAX_RECORD];
+    size_t numFrames = 0;
+
+#ifdef HAS_QSPI_STORE
+    // External flash has room for far more frames than our filesystem, and doesn't wear out our internal flash
+    if (qspiStore) {
+        while (h != t) {
+            size_t len = formatRecord(h, nowMsec, nowUsec, record);
+            if (!qspiStore->append(QSPI_STREAM_CAPTURE, record, len))
+                numDropped.fetch_add(1, std::memory_order_relaxed);
+            numFrames++;
+        }
+        LOG_DEBUG(RADIO, "Captured %u frames to QSPI (%u dropped so far)\n", numFrames, getNumDropped());
+        head.store(t, std::memory_order_release);
+        return;
+    }
+#endif
+
+#ifdef FS
+    if (fileSize < 0 || fileSize >= FRAME_CAPTURE_MAX_FILE) {
+        auto f = FS.open(FRAME_CAPTURE_FILE);
+        fileSize = f ? f.size() : 0;
+        if (f)
+            f.close();
+
+        if (fileSize >= FRAME_CAPTURE_MAX_FILE) {
+            FS.remove(FRAME_CAPTURE_OLD_FILE);
+            if (!FS.rename(FRAME_CAPTURE_FILE, FRAME_CAPTURE_OLD_FILE))
+                FS.remove(FRAME_CAPTURE_FILE);
+            fileSize = 0;
+        }
+    }
+
+    auto f = FS.open(FRAME_CAPTURE_FILE, FILE_O_APPEND);
+    if (!f) {
+        LOG_ERROR(RADIO, "Error: can't write %s, discarding captured frames\n", FRAME_CAPTURE_FILE);
+        head.store(t, std::memory_order_release);
+        return;
+    }
+
+    if (fileSize == 0) {
+        PcapHeader ph = {PCAP_MAGIC, 2, 4, 0, 0, MAX_RHPACKETLEN + sizeof(LoRaTapHeader), LINKTYPE_LORATAP};
+        fileSize += f.write((const uint8_t *)&ph, sizeof(ph));
+    }
+
+    while (h != t) {
+        size_t len = formatRecord(h, nowMsec, nowUsec, record);
+        fileSize += f.write(record, len);
+        numFrames++;
+    }
+    f.close();
+
+    LOG_DEBUG(RADIO, "Captured %u frames (%u dropped so far)\n", numFrames, getNumDropped());
+#endif
+
+    head.store(t, std::memory_order_release);
+}
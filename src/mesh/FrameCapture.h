@@ -0,0 +1,119 @@
+#pragma once
+
+#include "concurrency/OSThread.h"
+#include "configuration.h"
+#include <atomic>
+
+/// How many bytes of frames (and their headers) we can hold in RAM between flushes, must be a power of 2 (boards with PSRAM
+/// hold PSRAM_CAPACITY_SCALE times as much)
+#ifndef FRAME_CAPTURE_RING_SIZE
+#define FRAME_CAPTURE_RING_SIZE 4096
+#endif
+
+/// How often we write captured frames out to our file
+#ifndef FRAME_CAPTURE_FLUSH_MSEC
+#define FRAME_CAPTURE_FLUSH_MSEC (10 * 1000)
+#endif
+
+/// Once our capture file is this big we move it to FRAME_CAPTURE_OLD_FILE and start a new one
+#ifndef FRAME_CAPTURE_MAX_FILE
+#define FRAME_CAPTURE_MAX_FILE (64 * 1024)
+#endif
+
+#define FRAME_CAPTURE_FILE "/capture.pcap"
+#define FRAME_CAPTURE_OLD_FILE "/capture.old.pcap"
+
+/// Our flags for a captured frame (stored in the LoRaTap padding byte, which wireshark ignores)
+#define FRAME_CAPTURE_TX 0x01      // We sent this frame, rather than received it
+#define FRAME_CAPTURE_BAD_CRC 0x02 // We received this frame, but it failed its CRC
+
+/// The pcap file header, we write it in our native byte order (readers tell which that is from magic)
+struct PcapHeader {
+    uint32_t magic;
+    uint16_t versionMajor, versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs, snapLen, linkType;
+};
+
+struct PcapRecordHeader {
+    uint32_t tsSec, tsUsec, inclLen, origLen;
+};
+
+/// A LoRaTap (version 0) header, which comes before each frame.  Unlike pcap's own headers its fields are big endian.
+struct LoRaTapHeader {
+    uint8_t version;
+    uint8_t padding; // Our FRAME_CAPTURE_ flags
+    uint16_t length;
+    uint32_t frequency; // Hz
+    uint8_t bandwidth;  // In 125 kHz steps
+    uint8_t sf;
+    uint8_t packetRssi, maxRssi, currentRssi; // dBm + 139
+    int8_t snr;                               // In quarter dB steps
+    uint8_t syncWord;
+} __attribute__((packed));
+
+/// The most a frame's pcap record (headers included) can take
+#define FRAME_CAPTURE_MAX_RECORD (sizeof(PcapRecordHeader) + sizeof(LoRaTapHeader) + MAX_RHPACKETLEN)
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_LORATAP 270
+
+/// What a radio tells us about a frame it sent or received
+struct CapturedFrame {
+    uint32_t usec;   // micros() of our rx interrupt, or when we started sending
+    float freq;      // MHz
+    float bw;        // kHz
+    float snr, rssi; // Ignored for frames we sent
+    uint8_t sf;
+    uint8_t syncWord;
+    uint8_t flags;
+    uint8_t len;
+} __attribute__((packed));
+
+/**
+ * Records the raw frames our radio sends and receives (including corrupt ones) for debugging congestion in the field, in a
+ * pcap file wireshark can read (link type LoRaTap).  Build with LORA_FRAME_CAPTURE to enable it.
+ *
+ * Boards with a QSPIStore append each pcap record to its QSPI_STREAM_CAPTURE stream instead, which holds far more than our
+ * file and spares the internal flash.  A PcapHeader followed by that stream's records (oldest first) is the same capture.
+ *
+ * Capturing a frame is just two copies into a RAM ring (which is lock free, with one producer and one consumer), we do all the
+ * formatting and file writing later in our own thread.  If the ring fills up before we get to it we drop frames rather than
+ * slow the radio down, getNumDropped() says how many.
+ */
+class FrameCapture : private concurrency::OSThread
+{
+    uint8_t *ring; // In PSRAM if we have it, only we and the radio's thread touch it
+    size_t ringSize;
+
+    std::atomic<size_t> head; // Offset of the next byte to flush, only written by our thread
+    std::atomic<size_t> tail; // Offset of the next byte to fill, only written by the radio
+
+    std::atomic<uint32_t> numDropped;
+
+    /// The size of FRAME_CAPTURE_FILE, or -1 if we haven't looked yet
+    int32_t fileSize = -1;
+
+  public:
+    FrameCapture();
+
+    /// Record a frame (from the radio's thread, not an ISR)
+    void capture(const CapturedFrame &info, const uint8_t *frame);
+
+    uint32_t getNumDropped() const { return numDropped.load(std::memory_order_relaxed); }
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    void copyIn(size_t at, const void *src, size_t len);
+    void copyOut(size_t at, void *dest, size_t len);
+
+    /// Write everything in our ring to our capture file (or QSPI flash)
+    void flush();
+
+    /// Turn the frame at offset at in our ring into a pcap record in dest (FRAME_CAPTURE_MAX_RECORD bytes), moving at past it
+    size_t formatRecord(size_t &at, uint64_t nowMsec, uint32_t nowUsec, uint8_t *dest);
+};
+
+extern FrameCapture *frameCapture;
@@ -0,0 +1,44 @@
+#include "HopStarts.h"
+
+HopStarts hopStarts;
+
+HopStarts::HopStarts()
+{
+    // id 0 is never a valid packet id, so these entries won't match anything
+    memset(entries, 0, sizeof(entries));
+}
+
+void HopStarts::add(NodeNum from, PacketId id, uint8_t hopStart)
+{
+    // We add our own packets again each time we retransmit them, so update any record we already have
+    for (size_t i = 0; i < HOP_STARTS_SIZE; i++) {
+        Entry &e = entries[i];
+        if (e.id == id && e.from == from) {
+            e.hopStart = hopStart;
+            return;
+        }
+    }
+
+    if (hopStart == HOP_RELIABLE)
+        return; // What everyone assumes anyway
+
+    entries[next] = {from, id, hopStart};
+    next = (next + 1) % HOP_STARTS_SIZE;
+}
+
+uint8_t HopStarts::get(NodeNum from, PacketId id) const
+{
+    for (size_t i = 0; i < HOP_STARTS_SIZE; i++) {
+        const Entry &e = entries[i];
+        if (e.id && e.from == from && e.id == id)
+            return e.hopStart;
+    }
+
+    return HOP_RELIABLE;
+}
+
+uint8_t HopStarts::getHopsTaken(const MeshPacket *p) const
+{
+    uint8_t start = get(p->from, p->id);
+    return p->hop_limit <= start ? start - p->hop_limit : 0xff;
+}
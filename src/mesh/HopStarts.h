@@ -0,0 +1,40 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/// How many recent packets we remember a non default starting hop limit for
+#define HOP_STARTS_SIZE 16
+
+/**
+ * The hop_limit the original senders of recent packets started them with.
+ *
+ * Senders usually start with HOP_RELIABLE, so the hop_limit of a received packet tells us how many relays it took to get to
+ * us.  Senders which pick a smaller limit (see Router::pickHopLimit) put their start in the PacketHeader, and MeshPacket has no
+ * room for it, so our radios record it here (for everyone who works out distances from hop_limit) and relays look it up
+ * again when they forward the packet.  Packets we don't have a record for started at HOP_RELIABLE.
+ */
+class HopStarts
+{
+    struct Entry {
+        NodeNum from;
+        PacketId id;
+        uint8_t hopStart;
+    };
+
+    Entry entries[HOP_STARTS_SIZE];
+    size_t next = 0; // Where our next record goes, we overwrite the oldest
+
+  public:
+    HopStarts();
+
+    /// Remember the start of a packet, we only need to for starts other than HOP_RELIABLE
+    void add(NodeNum from, PacketId id, uint8_t hopStart);
+
+    /// @return the hop_limit the original sender started this packet with
+    uint8_t get(NodeNum from, PacketId id) const;
+
+    /// @return how many relays p took to get to us, or 0xff if we can't tell
+    uint8_t getHopsTaken(const MeshPacket *p) const;
+};
+
+extern HopStarts hopStarts;
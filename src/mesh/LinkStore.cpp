@@ -0,0 +1,164 @@
+#include "LinkStore.h"
+#include "FSCommon.h"
+#include "NeighborTable.h"
+#include "RTC.h"
+#include "RouteCache.h"
+#include "configuration.h"
+
+#define LINKSTORE_MAGIC 0x4c4b0001 // "LK" and our format version
+
+static const char *linkfile = "/db.links";
+static const char *linktmp = "/db.links.tmp";
+
+LinkStore linkStore;
+
+/// The start of our file, followed by numNeighbors NeighborRecords and numRoutes RouteRecords
+struct LinkHeader {
+    uint32_t magic;     // LINKSTORE_MAGIC, change it if any of these structs change
+    uint32_t savedTime; // When we saved, in secs since 1970 (0 if our clock wasn't valid)
+    uint8_t numNeighbors;
+    uint8_t numRoutes;
+} __attribute__((packed));
+
+struct NeighborRecord {
+    NodeNum node;
+    int8_t snr;   // dB
+    int16_t rssi; // dBm
+    uint16_t rxLoss, ackLoss;
+    uint32_t ageSecs; // How long before savedTime we last heard them
+    uint8_t interfaceIndex;
+} __attribute__((packed));
+
+struct RouteRecord {
+    NodeNum dest;
+    NodeNum nextHop;
+    uint8_t numHops;
+    uint32_t ageSecs; // How long before savedTime we last learned or confirmed it
+} __attribute__((packed));
+
+void LinkStore::load()
+{
+#ifdef FS
+    auto f = FS.open(linkfile);
+    if (!f)
+        f = FS.open(linktmp); // We might have lost power while save was replacing the old file (the new one is complete)
+    if (!f)
+        return;
+
+    LinkHeader h;
+    if (f.read((uint8_t *)&h, sizeof(h)) != (int)sizeof(h) || h.magic != LINKSTORE_MAGIC) {
+        f.close();
+        return;
+    }
+
+    // If our clock survived (i.e. deep sleep on an ESP32) our entries aged while we were down, otherwise all we know is how old
+    // they were when we saved (usually we were only down for a reboot)
+    uint32_t now = getValidTime(RTCQualityFromNet);
+    uint32_t downSecs = now && h.savedTime && now > h.savedTime ? now - h.savedTime : 0;
+
+    uint32_t numNeighbors = 0, numRoutes = 0;
+    for (uint8_t i = 0; i < h.numNeighbors; i++) {
+        NeighborRecord r;
+        if (f.read((uint8_t *)&r, sizeof(r)) != (int)sizeof(r))
+            break;
+
+        uint64_t ageMsec = ((uint64_t)r.ageSecs + downSecs) * 1000;
+        if (ageMsec >= NEIGHBOR_EXPIRE_MSEC)
+            continue;
+
+        // restore() wants the age in lastHeardMsec
+        Neighbor n = {r.node, (float)r.snr, (float)r.rssi, 0, r.rxLoss, r.ackLoss, (uint32_t)ageMsec, r.interfaceIndex, true};
+        neighbors.restore(n);
+        numNeighbors++;
+    }
+
+    for (uint8_t i = 0; i < h.numRoutes; i++) {
+        RouteRecord r;
+        if (f.read((uint8_t *)&r, sizeof(r)) != (int)sizeof(r))
+            break;
+
+        uint64_t ageMsec = ((uint64_t)r.ageSecs + downSecs) * 1000;
+        if (ageMsec >= ROUTE_EXPIRE_MSEC)
+            continue;
+
+        routeCache.restore(r.dest, r.nextHop, r.numHops, ageMsec);
+        numRoutes++;
+    }
+    f.close();
+
+    LOG_DEBUG(MESH, "Restored %u neighbors and %u routes (down for %u secs)\n", numNeighbors, numRoutes, downSecs);
+#endif
+}
+
+void LinkStore::save()
+{
+    lastSaveMsec = millis();
+    if (!lastSaveMsec)
+        lastSaveMsec = 1;
+
+#ifdef FS
+    FS.remove(linktmp); // In case a previous attempt left a partial file behind
+    auto f = FS.open(linktmp, FILE_O_WRITE);
+    if (!f) {
+        LOG_ERROR(MESH, "ERROR: can't write link file\n");
+        return;
+    }
+
+    uint32_t now = millis();
+    LinkHeader h = {LINKSTORE_MAGIC, getValidTime(RTCQualityFromNet), 0, 0};
+    for (size_t i = 0; i < neighbors.getNumNeighbors(); i++)
+        if (!NeighborTable::isExpired(neighbors.getByIndex(i), now))
+            h.numNeighbors++;
+    for (size_t i = 0; i < routeCache.getNumRoutes(); i++)
+        if (!RouteCache::isExpired(routeCache.getByIndex(i), now))
+            h.numRoutes++;
+
+    size_t written = f.write((const uint8_t *)&h, sizeof(h));
+    size_t expected = sizeof(h) + h.numNeighbors * sizeof(NeighborRecord) + h.numRoutes * sizeof(RouteRecord);
+
+    for (size_t i = 0; i < neighbors.getNumNeighbors(); i++) {
+        const Neighbor &n = neighbors.getByIndex(i);
+        if (NeighborTable::isExpired(n, now))
+            continue;
+
+        uint32_t ageSecs = (now - n.lastHeardMsec) / 1000;
+        NeighborRecord r = {n.node, (int8_t)n.snr, (int16_t)n.rssi, n.rxLoss, n.ackLoss, ageSecs, n.interfaceIndex};
+        written += f.write((const uint8_t *)&r, sizeof(r));
+    }
+
+    for (size_t i = 0; i < routeCache.getNumRoutes(); i++) {
+        const Route &rt = routeCache.getByIndex(i);
+        if (RouteCache::isExpired(rt, now))
+            continue;
+
+        RouteRecord r = {rt.dest, rt.nextHop, rt.numHops, (now - rt.lastUpdatedMsec) / 1000};
+        written += f.write((const uint8_t *)&r, sizeof(r));
+    }
+    f.close();
+
+    if (written != expected) {
+        LOG_ERROR(MESH, "Error: can't write link file\n");
+        return;
+    }
+
+    FS.remove(linkfile);
+    if (!FS.rename(linktmp, linkfile))
+        LOG_ERROR(MESH, "Error: can't rename new link file\n");
+    else
+        LOG_DEBUG(MESH, "Saved %u neighbors and %u routes\n", h.numNeighbors, h.numRoutes);
+#endif
+}
+
+void LinkStore::saveIfDue()
+{
+    if (!lastSaveMsec || millis() - lastSaveMsec >= LINK_STORE_SAVE_SECS * 1000UL)
+        save();
+}
+
+void LinkStore::forget()
+{
+#ifdef FS
+    FS.remove(linkfile);
+    FS.remove(linktmp);
+#endif
+}
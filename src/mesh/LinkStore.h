@@ -0,0 +1,41 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/// How often we rewrite our saved routes and neighbors while running (we also save them before every reboot and deep sleep)
+#ifndef LINK_STORE_SAVE_SECS
+#define LINK_STORE_SAVE_SECS (10 * 60)
+#endif
+
+/**
+ * Saves our route cache (see DSRRouter) and neighbor table across reboots and deep sleep.
+ *
+ * Without them every node we talk to after a boot costs a route discovery flood, so a router rebooting for an update (or a
+ * whole mesh of them) causes a burst of floods.  We write both tables to a small file of compact records beside NodeDB's files,
+ * whenever NodeDB saves (at most every LINK_STORE_SAVE_SECS, and always before a reboot or sleep), and read it back at boot.
+ *
+ * Each record holds how old it was when we saved it, and the file holds when we saved it (if our clock was valid), so restored
+ * entries keep aging and expire as they would have.  We trust them less than what we learn this boot: a restored route is
+ * replaced by any route we learn, and a restored neighbor gets our full spreading factor and power until we hear from it, and
+ * is forgotten the first time it misses an ack.
+ */
+class LinkStore
+{
+    /// millis() of our last save, 0 if we haven't this boot
+    uint32_t lastSaveMsec = 0;
+
+  public:
+    /// Restore our saved tables, call this after fsInit() and before we hear any packets
+    void load();
+
+    /// Save our tables now
+    void save();
+
+    /// Save our tables if we haven't for LINK_STORE_SAVE_SECS, called whenever NodeDB journals its nodes
+    void saveIfDue();
+
+    /// Delete our saved tables (i.e. on a factory reset)
+    void forget();
+};
+
+extern LinkStore linkStore;
@@ -2,6 +2,7 @@
 
 #include <Arduino.h>
 #include <assert.h>
+#include <atomic>
 
 #include "PointerQueue.h"
 
@@ -32,23 +33,76 @@ template <class T> class Allocator
         return p;
     }
 
-    /// Return a queable object which is a copy of some other object
+    /// Return a queable object with undefined contents (or NULL if no buffer is available), for callers which are about to
+    /// initialize it themselves and want to avoid the cost of zeroing the whole thing.
+    T *allocUninitialized(TickType_t maxWait) { return alloc(maxWait); }
+
+    /// Like allocZeroed() but we are also allowed to use the buffers the allocator holds in reserve for high priority traffic
+    /// (acks and packets originated by this node).  Panic if no buffer is available.
+    T *allocZeroedReserved()
+    {
+        T *p = allocReserved(0);
+        assert(p);
+
+        memset(p, 0, sizeof(T));
+        return p;
+    }
+
+    /// Return a queable object which is a copy of some other object.  If maxWait is portMAX_DELAY we panic if no buffer is
+    /// available, otherwise we return NULL.
     T *allocCopy(const T &src, TickType_t maxWait = portMAX_DELAY)
     {
         T *p = alloc(maxWait);
-        assert(p);
+        assert(p || maxWait != portMAX_DELAY);
 
         if (p)
             *p = src;
         return p;
     }
 
-    /// Return a buffer for use by others
+    /// Like allocCopy() but allowed to use our reserved buffers, panic if no buffer is available
+    T *allocCopyReserved(const T &src)
+    {
+        T *p = allocReserved(0);
+        assert(p);
+
+        *p = src;
+        return p;
+    }
+
+    /// Return another reference to p, which the caller must release() separately.  No holder may change p while it is shared
+    /// (see makeWritable).  Allocators which can't share buffers return a copy (or NULL if no buffer is available).
+    virtual T *share(T *p) { return allocCopy(*p, 0); }
+
+    /// Return a version of p which is safe to change: p itself if it isn't shared, otherwise a private copy (in which case our
+    /// reference to p is released).  Panic if no buffer is available.
+    virtual T *makeWritable(T *p) { return p; }
+
+    /// Did p come from us?  (Allocators which can't tell say no, so callers copy rather than share)
+    virtual bool owns(const T *p) const { return false; }
+
+    /// Drop a reference to a buffer, once the last one is dropped (by default, the only one) the buffer is free for use by
+    /// others
     virtual void release(T *p) = 0;
 
+    /// The total number of buffers this allocator can provide (or 0 if unbounded)
+    virtual size_t getCapacity() const { return 0; }
+
+    /// The number of buffers currently handed out
+    virtual size_t getNumInUse() const { return 0; }
+
+    /// The largest number of buffers we've ever had handed out at once
+    virtual size_t getMaxInUse() const { return 0; }
+
+    /// The number of times we've been unable to satisfy an alloc request
+    virtual uint32_t getNumFailed() const { return 0; }
+
   protected:
     // Alloc some storage
     virtual T *alloc(TickType_t maxWait) = 0;
+
+    // Alloc some storage, possibly using buffers we are holding in reserve
+    virtual T *allocReserved(TickType_t maxWait) { return alloc(maxWait); }
 };
 
 /**
@@ -75,51 +129,245 @@ template <class T> class MemoryDynamic : public Allocator<T>
 };
 
 /**
- * A pool based allocator
+ * A fixed capacity pool based allocator
+ *
+ * Free buffers are kept on a lock-free stack, so alloc() and release() never block and are safe to call from ISRs (and from
+ * either core on the ESP32).  The stack links are buffer indexes rather than pointers, which lets us pack a generation tag
+ * into the same 32 bit word as the head index and guards against the ABA problem without a double width CAS.
  *
+ * numReserved buffers are held back for allocReserved() callers, so a flood of received packets can never starve us of the
+ * buffers we need to send acks or our own traffic.
+ *
+ * Buffers are reference counted, so a packet headed out on several interfaces (or held for retransmission) can be shared
+ * instead of copied.
+ *
+ * Note: maxWait is ignored, if the pool is empty we fail immediately.
  */
 template <class T> class MemoryPool : public Allocator<T>
 {
-    PointerQueue<T> dead;
+    static const uint16_t NO_BUF = 0xffff;
 
     T *buf; // our large raw block of memory
 
-    size_t maxElements;
+    /// nextFree[i] is the index of the buffer after buf[i] in our freelist
+    uint16_t *nextFree;
+
+    /// refCounts[i] is the number of references to buf[i] we have handed out (0 if it is free)
+    std::atomic<uint8_t> *refCounts;
+
+    /// Low 16 bits are the index of the first free buffer (or NO_BUF), high 16 bits are a tag bumped on every change
+    std::atomic<uint32_t> head;
+
+    /// Always <= the number of buffers in the freelist (we push before incrementing and decrement before popping)
+    std::atomic<uint32_t> numFree;
+
+    std::atomic<uint32_t> maxInUse, numFailed;
+
+    size_t maxElements, numReserved;
 
   public:
-    MemoryPool(size_t _maxElements) : dead(_maxElements), maxElements(_maxElements)
+    MemoryPool(size_t _maxElements, size_t _numReserved = 0)
+        : head(NO_BUF), numFree(0), maxInUse(0), numFailed(0), maxElements(_maxElements), numReserved(_numReserved)
     {
+        assert(maxElements < NO_BUF && numReserved < maxElements);
+
         buf = new T[maxElements];
+        nextFree = new uint16_t[maxElements];
+        refCounts = new std::atomic<uint8_t>[maxElements];
+
+        // prefill our freelist
+        for (size_t i = 0; i < maxElements; i++) {
+            refCounts[i] = 0;
+            push(i);
+        }
 
-        // prefill dead
-        for (size_t i = 0; i < maxElements; i++)
-            release(&buf[i]);
+        maxInUse = 0; // Our prefill doesn't count as usage
     }
 
-    ~MemoryPool() { delete[] buf; }
+    ~MemoryPool()
+    {
+        delete[] buf;
+        delete[] nextFree;
+        delete[] refCounts;
+    }
 
-    /// Return a buffer for use by others
-    virtual void release(T *p)
+    virtual T *share(T *p)
+    {
+        assert(owns(p));
+        uint8_t old = refCounts[p - buf]++;
+        assert(old && old != UINT8_MAX); // Must not be free, and mustn't wrap
+        return p;
+    }
+
+    virtual T *makeWritable(T *p)
     {
-        assert(dead.enqueue(p, 0));
-        assert(p >= buf &&
-               (size_t)(p - buf) <
-                   maxElements); // sanity check to make sure a programmer didn't free something that didn't come from this pool
+        assert(owns(p));
+        if (refCounts[p - buf].load() == 1)
+            return p; // Only we hold it, so nobody can share it behind our back
+
+        T *copy = this->allocCopyReserved(*p);
+        release(p);
+        return copy;
     }
 
-#ifdef HAS_FREE_RTOS
-    /// Return a buffer from an ISR, if higherPriWoken is set to true you have some work to do ;-)
-    void releaseFromISR(T *p, BaseType_t *higherPriWoken)
+    /// Drop a reference to a buffer, once the last one is dropped the buffer is free for use by others
+    /// Note: this method is safe to call from regular OR ISR code
+    virtual void release(T *p)
     {
-        assert(dead.enqueueFromISR(p, higherPriWoken));
-        assert(p >= buf &&
-               (size_t)(p - buf) <
-                   maxElements); // sanity check to make sure a programmer didn't free something that didn't come from this pool
+        assert(owns(p)); // sanity check to make sure a programmer didn't free something that didn't come from this pool
+
+        uint8_t old = refCounts[p - buf]--;
+        assert(old); // Released more often than it was allocated or shared
+        if (old == 1)
+            push(p - buf);
     }
-#endif
+
+    /// Is p one of our buffers?
+    virtual bool owns(const T *p) const { return p >= buf && (size_t)(p - buf) < maxElements; }
+
+    virtual size_t getCapacity() const { return maxElements; }
+
+    virtual size_t getNumInUse() const { return maxElements - numFree.load(); }
+
+    virtual size_t getMaxInUse() const { return maxInUse.load(); }
+
+    virtual uint32_t getNumFailed() const { return numFailed.load(); }
 
   protected:
-    /// Return a queable object which has been prefilled with zeros - allow timeout to wait for available buffers (you
-    /// probably don't want this version).
-    virtual T *alloc(TickType_t maxWait) { return dead.dequeuePtr(maxWait); }
+    virtual T *alloc(TickType_t maxWait) { return pop(numReserved); }
+
+    virtual T *allocReserved(TickType_t maxWait) { return pop(0); }
+
+  private:
+    void push(uint16_t index)
+    {
+        uint32_t h = head.load();
+        uint32_t newHead;
+        do {
+            nextFree[index] = h & 0xffff;
+            newHead = ((h + 0x10000) & 0xffff0000) | index;
+        } while (!head.compare_exchange_weak(h, newHead));
+
+        numFree++;
+    }
+
+    /// Pop a buffer from our freelist, but only if doing so would leave at least minFree buffers behind
+    T *pop(uint32_t minFree)
+    {
+        // First claim one of the free buffers
+        uint32_t n = numFree.load();
+        do {
+            if (n <= minFree) {
+                numFailed++;
+                return NULL;
+            }
+        } while (!numFree.compare_exchange_weak(n, n - 1));
+
+        // Now pull it from the stack, we are guaranteed something will be there because we claimed it above
+        uint32_t h = head.load();
+        uint32_t newHead;
+        uint16_t index;
+        do {
+            index = h & 0xffff;
+            assert(index != NO_BUF);
+            newHead = ((h + 0x10000) & 0xffff0000) | nextFree[index];
+        } while (!head.compare_exchange_weak(h, newHead));
+        refCounts[index] = 1;
+
+        // Update our high water mark
+        uint32_t inUse = maxElements - (n - 1);
+        uint32_t oldMax = maxInUse.load();
+        while (inUse > oldMax && !maxInUse.compare_exchange_weak(oldMax, inUse))
+            ;
+
+        return &buf[index];
+    }
+};
+
+/**
+ * Variable sized byte buffers, for things which are usually much smaller than their worst case (i.e. encoded packets, where an
+ * ack or a position is a few tens of bytes but a text message can be over 200).
+ *
+ * Each size class is its own MemoryPool, so this has the same lock-free and ISR safe properties.  We hand out a buffer from the
+ * smallest class the request fits in, or if that class is empty from the next bigger class which isn't.
+ */
+class SlabAllocator
+{
+    template <size_t N> struct Slab {
+        uint8_t bytes[N];
+    };
+
+    MemoryPool<Slab<32>> slabs32;
+    MemoryPool<Slab<64>> slabs64;
+    MemoryPool<Slab<128>> slabs128;
+    MemoryPool<Slab<256>> slabs256;
+
+    std::atomic<uint32_t> numFailed;
+
+  public:
+    /// The largest buffer we can provide
+    static const size_t MAX_SIZE = 256;
+
+    /// How many buffers of each size class we hold (each must be at least 1)
+    SlabAllocator(size_t num32, size_t num64, size_t num128, size_t num256)
+        : slabs32(num32), slabs64(num64), slabs128(num128), slabs256(num256), numFailed(0)
+    {
+    }
+
+    /// Return a buffer of at least len bytes with undefined contents, or NULL if none is available
+    uint8_t *alloc(size_t len)
+    {
+        uint8_t *p = NULL;
+        if (len <= 32)
+            p = allocFrom(slabs32);
+        if (!p && len <= 64)
+            p = allocFrom(slabs64);
+        if (!p && len <= 128)
+            p = allocFrom(slabs128);
+        if (!p && len <= MAX_SIZE)
+            p = allocFrom(slabs256);
+
+        if (!p)
+            numFailed++;
+        return p;
+    }
+
+    /// Return a buffer from alloc() for use by others
+    void release(uint8_t *p)
+    {
+        if (!releaseTo(slabs32, p) && !releaseTo(slabs64, p) && !releaseTo(slabs128, p) && !releaseTo(slabs256, p))
+            assert(0); // Not one of ours
+    }
+
+    /// The total number of buffers we can provide (of all sizes)
+    size_t getCapacity() const
+    {
+        return slabs32.getCapacity() + slabs64.getCapacity() + slabs128.getCapacity() + slabs256.getCapacity();
+    }
+
+    /// The number of buffers currently handed out (of all sizes)
+    size_t getNumInUse() const
+    {
+        return slabs32.getNumInUse() + slabs64.getNumInUse() + slabs128.getNumInUse() + slabs256.getNumInUse();
+    }
+
+    /// The number of times we couldn't find a buffer big enough (spilling over into a bigger class doesn't count)
+    uint32_t getNumFailed() const { return numFailed.load(); }
+
+  private:
+    template <size_t N> static uint8_t *allocFrom(MemoryPool<Slab<N>> &pool)
+    {
+        Slab<N> *s = pool.allocUninitialized(0);
+        return s ? s->bytes : NULL;
+    }
+
+    template <size_t N> static bool releaseTo(MemoryPool<Slab<N>> &pool, uint8_t *p)
+    {
+        Slab<N> *s = reinterpret_cast<Slab<N> *>(p);
+        if (!pool.owns(s))
+            return false;
+
+        pool.release(s);
+        return true;
+    }
 };
@@ -0,0 +1,239 @@
+#include "MeshPacketQueue.h"
+#include "NodeDB.h"
+#include "RadioInterface.h"
+#include "concurrency/LockGuard.h"
+#include "configuration.h"
+#include <assert.h>
+
+TxPriority getTxPriority(const MeshPacket *p)
+{
+    if (p->which_payload != MeshPacket_decoded_tag)
+        return TX_PRIORITY_BACKGROUND; // We are just forwarding this packet
+
+    switch (p->decoded.which_payload) {
+    case 0:
+        // A bare ack or nak
+        return p->decoded.which_ack ? TX_PRIORITY_ACK : TX_PRIORITY_BACKGROUND;
+
+    case SubPacket_route_request_tag:
+    case SubPacket_route_reply_tag:
+    case SubPacket_route_error_tag:
+        return TX_PRIORITY_ROUTING;
+
+    case SubPacket_data_tag:
+        return TX_PRIORITY_USER;
+
+    default:
+        // Position and user broadcasts are sent periodically, so it is fine if one of them waits.  But if someone is waiting on
+        // an answer from us treat it like a user message.
+        return p->want_ack ? TX_PRIORITY_USER : TX_PRIORITY_BACKGROUND;
+    }
+}
+
+static PacketId phoneIds[TX_PHONE_IDS];
+static size_t nextPhoneId;
+
+void markFromPhone(PacketId id)
+{
+    phoneIds[nextPhoneId] = id;
+    nextPhoneId = (nextPhoneId + 1) % TX_PHONE_IDS;
+}
+
+TxSource getTxSource(const MeshPacket *p)
+{
+    if (p->from != nodeDB.getNodeNum())
+        return TX_SOURCE_FORWARD;
+
+    for (size_t i = 0; i < TX_PHONE_IDS; i++)
+        if (phoneIds[i] == p->id)
+            return TX_SOURCE_PHONE;
+
+    if (p->which_payload == MeshPacket_decoded_tag && p->decoded.which_payload == SubPacket_data_tag)
+        return TX_SOURCE_PLUGIN + p->decoded.data.portnum;
+
+    return TX_SOURCE_LOCAL;
+}
+
+MeshPacketQueue::MeshPacketQueue(size_t _maxLen) : maxLen(_maxLen)
+{
+    entries = new Entry[maxLen];
+    flows = new Flow[maxLen];
+}
+
+MeshPacketQueue::~MeshPacketQueue()
+{
+    delete[] entries;
+    delete[] flows;
+}
+
+uint32_t MeshPacketQueue::getWeight(TxSource source)
+{
+    switch (source) {
+    case TX_SOURCE_FORWARD:
+        return TX_FAIR_WEIGHT_FORWARD;
+    case TX_SOURCE_PHONE:
+        return TX_FAIR_WEIGHT_PHONE;
+    case TX_SOURCE_LOCAL:
+        return TX_FAIR_WEIGHT_LOCAL;
+    default:
+        return TX_FAIR_WEIGHT_PLUGIN;
+    }
+}
+
+MeshPacketQueue::Flow *MeshPacketQueue::findFlow(TxSource source)
+{
+    for (size_t i = 0; i < numFlows; i++)
+        if (flows[i].source == source)
+            return &flows[i];
+    return NULL;
+}
+
+bool MeshPacketQueue::pickVictim(TxPriority priority, TxSource source, size_t &victim)
+{
+    // The source with the most queued airtime (for its weight) which holds more than its share of our entries, if that isn't
+    // the source asking for room, loses its newest packet whatever its priority
+    size_t share = maxLen / (numFlows + (findFlow(source) ? 0 : 1));
+    Flow *hog = NULL;
+    for (size_t i = 0; i < numFlows; i++) {
+        Flow &f = flows[i];
+        if (f.numQueued > share && (!hog || f.queuedMsec / getWeight(f.source) > hog->queuedMsec / getWeight(hog->source)))
+            hog = &f;
+    }
+    if (hog && hog->source != source) {
+        for (victim = numEntries - 1; entries[victim].source != hog->source; victim--)
+            ;
+        LOG_DEBUG(RADIO, "TX source %u has %u queued packets, dropping its newest\n", hog->source, hog->numQueued);
+        return true;
+    }
+
+    // Otherwise the newest packet of the lowest class (ignoring aging, so packets which have already waited a long time stay)
+    victim = 0;
+    for (size_t i = 1; i < numEntries; i++)
+        if (entries[i].priority <= entries[victim].priority)
+            victim = i;
+
+    return entries[victim].priority < priority; // Unless everything queued is at least as important as p
+}
+
+void MeshPacketQueue::removeEntry(size_t i)
+{
+    Flow *f = findFlow(entries[i].source);
+    assert(f);
+    f->numQueued--;
+    f->queuedMsec -= entries[i].airtimeMsec;
+    if (!f->numQueued) {
+        size_t fi = f - flows;
+        memmove(flows + fi, flows + fi + 1, (numFlows - fi - 1) * sizeof(Flow));
+        numFlows--;
+        if (nextFlow > fi)
+            nextFlow--; // Still the same flow's turn
+        if (nextFlow >= numFlows)
+            nextFlow = 0;
+    }
+
+    memmove(entries + i, entries + i + 1, (numEntries - i - 1) * sizeof(Entry));
+    numEntries--;
+}
+
+bool MeshPacketQueue::enqueue(MeshPacket *p, TxPriority priority, TxSource source, uint32_t airtimeMsec, MeshPacket **dropped)
+{
+    concurrency::LockGuard g(&lock);
+
+    *dropped = NULL;
+    if (numEntries == maxLen) {
+        numDropped++;
+        size_t victim;
+        if (!pickVictim(priority, source, victim)) {
+            lastDroppedId = p->id;
+            return false;
+        }
+
+        *dropped = entries[victim].p;
+        lastDroppedId = (*dropped)->id;
+        removeEntry(victim);
+    }
+
+    entries[numEntries++] = {p, millis(), priority, source, airtimeMsec};
+
+    Flow *f = findFlow(source);
+    if (!f) {
+        f = &flows[numFlows++];
+        *f = {source, 0, 0, 0};
+    }
+    f->numQueued++;
+    f->queuedMsec += airtimeMsec;
+    return true;
+}
+
+MeshPacket *MeshPacketQueue::dequeueIfFits(size_t maxPayload)
+{
+    concurrency::LockGuard g(&lock);
+
+    if (numEntries == 0)
+        return NULL;
+
+    // Packets which are (or have aged into) our most important class present compete.  Aging only gets a packet into the
+    // competition, otherwise a busy source's backlog of old packets would always beat everyone else's new ones.
+    uint32_t now = millis(), topClass = 0;
+    for (size_t i = 0; i < numEntries; i++)
+        topClass = max(topClass, (uint32_t)entries[i].priority);
+
+    // Deficit round robin between the flows with packets competing.  Each flow's candidate is its most important one, and
+    // entries are kept in arrival order, so taking the first best keeps a source's packets of a class in FIFO order.
+    size_t best = 0;
+    Flow *bestFlow = NULL;
+    while (!bestFlow) {
+        for (size_t n = 0; n < numFlows && !bestFlow; n++) {
+            Flow &f = flows[(nextFlow + n) % numFlows];
+            size_t i = numEntries;
+            uint32_t candidatePriority = topClass;
+            for (size_t j = 0; j < numEntries; j++) {
+                uint32_t priority = agedPriority(entries[j], now);
+                if (entries[j].source == f.source && priority >= candidatePriority &&
+                    (i == numEntries || priority > candidatePriority)) {
+                    i = j;
+                    candidatePriority = priority;
+                }
+            }
+            if (i == numEntries)
+                continue; // Nothing competing, so it isn't this flow's turn
+
+            if (f.deficitMsec >= (int32_t)entries[i].airtimeMsec) {
+                best = i;
+                bestFlow = &f;
+                nextFlow = (nextFlow + n) % numFlows; // It keeps its turn while its credit lasts
+            } else
+                f.deficitMsec += TX_FAIR_QUANTUM_MSEC * getWeight(f.source);
+        }
+    }
+
+    MeshPacket *p = entries[best].p;
+    if (getWirePayloadLen(p) > maxPayload)
+        return NULL;
+
+    bestFlow->deficitMsec -= entries[best].airtimeMsec;
+    removeEntry(best);
+    return p;
+}
+
+bool MeshPacketQueue::isEmpty()
+{
+    concurrency::LockGuard g(&lock);
+    return numEntries == 0;
+}
+
+size_t MeshPacketQueue::getNumQueued()
+{
+    concurrency::LockGuard g(&lock);
+    return numEntries;
+}
+
+TxQueueStatus MeshPacketQueue::getStatus()
+{
+    concurrency::LockGuard g(&lock);
+
+    TxQueueStatus s = {(uint32_t)(maxLen - numEntries), (uint32_t)maxLen, 0, lastDroppedId};
+    for (size_t i = 0; i < numFlows; i++)
+        s.queuedMsec += flows[i].queuedMsec;
+    return s;
+}
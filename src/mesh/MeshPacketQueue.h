@@ -0,0 +1,160 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "concurrency/Lock.h"
+
+/// Transmit priority classes, higher values are sent first
+enum TxPriority {
+    TX_PRIORITY_BACKGROUND = 0, // Packets we are forwarding for others and periodic broadcasts (position, user info)
+    TX_PRIORITY_USER,           // Messages originated by the user of this node
+    TX_PRIORITY_ROUTING,        // Route discovery and route errors
+    TX_PRIORITY_ACK             // Acks and naks, these are small and other nodes are waiting on them to stop retransmitting
+};
+
+/// A queued packet gains one priority class for each this many msecs it has been waiting, so low priorities can't starve
+#define TX_PRIORITY_AGE_MSEC 4000
+
+/// Who wants a packet sent, each source gets its fair share of our airtime (see MeshPacketQueue)
+typedef uint16_t TxSource;
+#define TX_SOURCE_FORWARD 0 // Packets we are forwarding for others
+#define TX_SOURCE_PHONE 1   // Packets from our phone/API clients
+#define TX_SOURCE_LOCAL 2   // Our own acks, routing and node broadcasts
+#define TX_SOURCE_PLUGIN 3  // Plus the portnum, each plugin is its own source
+
+/// The airtime each source is credited per deficit round robin round is this, times its weight
+#ifndef TX_FAIR_QUANTUM_MSEC
+#define TX_FAIR_QUANTUM_MSEC 250
+#endif
+
+/// Relative airtime budgets.  Forwarded packets carry everyone else's traffic, and we don't want any one plugin to crowd out
+/// our phone clients.
+#ifndef TX_FAIR_WEIGHT_FORWARD
+#define TX_FAIR_WEIGHT_FORWARD 4
+#endif
+#ifndef TX_FAIR_WEIGHT_PHONE
+#define TX_FAIR_WEIGHT_PHONE 2
+#endif
+#ifndef TX_FAIR_WEIGHT_LOCAL
+#define TX_FAIR_WEIGHT_LOCAL 2
+#endif
+#ifndef TX_FAIR_WEIGHT_PLUGIN
+#define TX_FAIR_WEIGHT_PLUGIN 1
+#endif
+
+/// How many of our phone clients' recent packet ids we remember, so we can tell their packets (and retransmissions) apart
+#define TX_PHONE_IDS 8
+
+/// What a transmit queue looks like right now, so API clients can pace themselves (see QueueStatusPlugin)
+struct TxQueueStatus {
+    uint32_t free, capacity; // Entries, capacity is 0 for interfaces without a queue
+    uint32_t queuedMsec;     // The airtime of everything queued, roughly how long a packet queued now would wait
+    PacketId lastDroppedId;  // The last packet we dropped (or refused) because we were full, 0 if none
+};
+
+/**
+ * Pick the transmit priority class for a packet we are about to send
+ *
+ * Must be called while the packet is still decoded (forwarded packets are still encrypted, and are treated as background)
+ */
+TxPriority getTxPriority(const MeshPacket *p);
+
+/// Pick the source a packet we are about to send counts against (like getTxPriority, while it is still decoded)
+TxSource getTxSource(const MeshPacket *p);
+
+/// Remember a packet came from one of our phone clients, so getTxSource() counts it as theirs
+void markFromPhone(PacketId id);
+
+/**
+ * A queue of packets waiting to be transmitted, ordered by priority class (with aging), then shared fairly between sources.
+ *
+ * Among the packets of the best priority class, sources take turns by deficit round robin weighted by airtime: each turn a
+ * source is credited TX_FAIR_QUANTUM_MSEC times its weight, and sends its oldest packet once its credit covers that packet's
+ * airtime.  So a source sending long packets gets fewer of them, and a busy source can't push out everyone else.
+ *
+ * When full, a source holding more than its share of our entries loses its newest packet to make room for another source.
+ * Otherwise we drop by priority class as before.
+ *
+ * Thread safe, packets are added by the router and might be added from the bluetooth task.
+ */
+class MeshPacketQueue
+{
+    struct Entry {
+        MeshPacket *p;
+        uint32_t enqueuedMsec;
+        TxPriority priority;
+        TxSource source;
+        uint32_t airtimeMsec;
+    };
+
+    /// A source with packets queued (a source's credit is forgotten once it has nothing left to send)
+    struct Flow {
+        TxSource source;
+        uint16_t numQueued;
+        uint32_t queuedMsec; // The airtime of its queued packets
+        int32_t deficitMsec; // Its unused credit
+    };
+
+    Entry *entries;
+    size_t maxLen, numEntries = 0;
+
+    /// In the order they take turns, nextFlow is the one whose turn it is
+    Flow *flows;
+    size_t numFlows = 0, nextFlow = 0;
+
+    /// How many packets we have thrown away (or refused) because we were full, and the last one's id
+    uint32_t numDropped = 0;
+    PacketId lastDroppedId = 0;
+
+    concurrency::Lock lock;
+
+  public:
+    MeshPacketQueue(size_t _maxLen);
+
+    ~MeshPacketQueue();
+
+    /**
+     * Add a packet to our queue.
+     *
+     * If we are full, a source holding more than its share of the queue loses its newest packet to make room.  Otherwise the
+     * newest packet of our lowest priority class is dropped to make room - as long as it is less important than p.
+     *
+     * @param airtimeMsec how long p will take to send (see RadioInterface::getPacketTime)
+     * @param dropped set to a packet which the caller must now release (or NULL)
+     * @return false if p could not be queued (caller still owns p)
+     */
+    bool enqueue(MeshPacket *p, TxPriority priority, TxSource source, uint32_t airtimeMsec, MeshPacket **dropped);
+
+    /// Remove and return the packet we should send next (or NULL if empty)
+    MeshPacket *dequeue() { return dequeueIfFits(SIZE_MAX); }
+
+    /// Like dequeue(), but only if the encrypted payload of the packet we should send next is at most maxPayload bytes
+    MeshPacket *dequeueIfFits(size_t maxPayload);
+
+    bool isEmpty();
+
+    /// @return how many packets are waiting
+    size_t getNumQueued();
+
+    /// @return how many packets we have dropped (or refused) because we were full
+    uint32_t getNumDropped() const { return numDropped; }
+
+    TxQueueStatus getStatus();
+
+  private:
+    /// Our priority including any bonus for time spent waiting in the queue
+    static uint32_t agedPriority(const Entry &e, uint32_t now)
+    {
+        return e.priority + (now - e.enqueuedMsec) / TX_PRIORITY_AGE_MSEC;
+    }
+
+    static uint32_t getWeight(TxSource source);
+
+    /// @return the flow for source, or NULL if it has nothing queued
+    Flow *findFlow(TxSource source);
+
+    /// Pick the entry to drop so a packet of priority from source fits @return false if p should be refused instead
+    bool pickVictim(TxPriority priority, TxSource source, size_t &victim);
+
+    /// Remove entries[i], and its flow once that has nothing left
+    void removeEntry(size_t i);
+};
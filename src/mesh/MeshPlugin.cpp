@@ -1,19 +1,45 @@
 #include "MeshPlugin.h"
 #include "NodeDB.h"
 #include "MeshService.h"
+#include "Router.h"
+#include "concurrency/OSThread.h"
+#include "mesh-pb-constants.h"
 #include <assert.h>
 
-std::vector<MeshPlugin *> *MeshPlugin::plugins;
+static_assert(MAX_PLUGINS < UINT8_MAX, "Our port table entries are 1 + a plugin index in a byte");
+
+MeshPlugin *MeshPlugin::plugins[MAX_PLUGINS];
+uint8_t MeshPlugin::numPlugins;
+
+uint8_t MeshPlugin::portTable[_PortNum_ARRAYSIZE];
+
+MeshPlugin *MeshPlugin::wildcardPlugins[MAX_PLUGINS];
+uint8_t MeshPlugin::numWildcardPlugins;
+
+bool MeshPlugin::tableDirty;
 
 const MeshPacket *MeshPlugin::currentRequest;
+bool MeshPlugin::currentRequestLocal;
+
+MeshPlugin::DecodeState MeshPlugin::decodeState;
+alignas(8) uint8_t MeshPlugin::decodeArena[PLUGIN_DECODE_ARENA_SIZE];
+
+uint32_t MeshPlugin::numAsyncOverflows;
+
+static inline size_t align8(size_t x)
+{
+    return (x + 7) & ~7;
+}
 
 MeshPlugin::MeshPlugin(const char *_name) : name(_name)
 {
-    // Can't trust static initalizer order, so we check each time
-    if(!plugins)
-        plugins = new std::vector<MeshPlugin *>();
+    // Our table is zero initialized before any constructors run, so static plugins can register too
+    assert(numPlugins < MAX_PLUGINS); // Raise this profile's plugins (or MAX_PLUGINS) if you add plugins
+    index = numPlugins;
+    plugins[numPlugins++] = this;
 
-    plugins->push_back(this);
+    // We can't ask subclasses which ports they want until they are constructed, so wait until the first packet
+    tableDirty = true;
 }
 
 void MeshPlugin::setup() {
@@ -24,33 +50,217 @@ MeshPlugin::~MeshPlugin()
     assert(0); // FIXME - remove from list of plugins once someone needs this feature
 }
 
+/// Sort our plugins into portTable (for plugins which want one port) and wildcardPlugins (for everyone else)
+void MeshPlugin::buildPortTable()
+{
+    memset(portTable, 0, sizeof(portTable));
+    numWildcardPlugins = 0;
+
+    // Walk backwards so each list ends up in registration order
+    for (int i = numPlugins - 1; i >= 0; i--) {
+        auto &pi = *plugins[i];
+
+        int port = pi.getSinglePortnum();
+        if (port >= 0 && port < _PortNum_ARRAYSIZE) {
+            pi.nextForPort = portTable[port];
+            portTable[port] = i + 1;
+        } else
+            wildcardPlugins[numWildcardPlugins++] = &pi;
+    }
+
+    // Which put our wildcards in reverse order
+    for (int i = 0, j = numWildcardPlugins - 1; i < j; i++, j--) {
+        MeshPlugin *t = wildcardPlugins[i];
+        wildcardPlugins[i] = wildcardPlugins[j];
+        wildcardPlugins[j] = t;
+    }
+
+    tableDirty = false;
+}
+
+/**
+ * Runs async plugins (see MeshPlugin::isAsync) on the packets queued for them, one per pass of our scheduler so the router and
+ * everyone else get a turn in between.
+ *
+ * We are on the same thread as the router rather than a task of our own, because plugins freely use the node DB, the mesh
+ * service and the packet pool, none of which are locked.
+ */
+class AsyncPluginWorker : private concurrency::OSThread
+{
+    struct Job {
+        MeshPlugin *plugin;
+        MeshPacket *packet; // Our reference, released once the plugin is done with it
+        bool local;         // See MeshPlugin::isLocalRequest
+    } jobs[ASYNC_PLUGIN_QUEUE_SIZE];
+    size_t first = 0, numJobs = 0;
+
+  public:
+    AsyncPluginWorker() : concurrency::OSThread("AsyncPlugins")
+    {
+        setEnabled(false); // Until we have work
+    }
+
+    /// Queue mp for pi @return false if we are full (or out of packets)
+    bool enqueue(MeshPlugin *pi, const MeshPacket &mp, bool local)
+    {
+        if (numJobs == ASYNC_PLUGIN_QUEUE_SIZE)
+            return false;
+
+        // The router's packets come from the pool so we just take a reference, anything else we need to copy
+        MeshPacket *p = packetPool.owns(&mp) ? packetPool.share(const_cast<MeshPacket *>(&mp)) : packetPool.allocCopy(mp, 0);
+        if (!p)
+            return false;
+
+        jobs[(first + numJobs++) % ASYNC_PLUGIN_QUEUE_SIZE] = {pi, p, local};
+
+        setIntervalFromNow(0);
+        setEnabled(true);
+        return true;
+    }
+
+  protected:
+    virtual int32_t runOnce()
+    {
+        if (numJobs) {
+            Job job = jobs[first];
+            first = (first + 1) % ASYNC_PLUGIN_QUEUE_SIZE;
+            numJobs--;
+
+            {
+                MeshPlugin::DispatchScope scope(*job.packet, job.local);
+                MeshPlugin::dispatch(job.plugin, *job.packet);
+            }
+            packetPool.release(job.packet);
+        }
+
+        if (!numJobs)
+            setEnabled(false);
+        return 0;
+    }
+};
+
+static AsyncPluginWorker *asyncWorker;
+
+// A plugin which sends a broadcast gets it dispatched to us before its handleReceived returns, so we can be nested.  The
+// outer call keeps its request and decoded payloads, we decode ours above them in our arena.
+MeshPlugin::DispatchScope::DispatchScope(const MeshPacket &mp, bool local)
+    : outerRequest(currentRequest), outerLocal(currentRequestLocal), outerDecode(decodeState)
+{
+    decodeState.base = decodeState.used = align8(decodeState.used);
+    clearDecoded(&mp);
+
+    currentRequest = &mp;
+    currentRequestLocal = local;
+}
+
+MeshPlugin::DispatchScope::~DispatchScope()
+{
+    currentRequest = outerRequest;
+    currentRequestLocal = outerLocal;
+    decodeState = outerDecode;
+}
+
+bool MeshPlugin::dispatch(MeshPlugin *pi, const MeshPacket &mp)
+{
+    uint32_t start = micros();
+    bool handled = pi->handleReceived(mp);
+    pi->handleMicros += micros() - start;
+    pi->numDispatched++;
+
+    // Possibly send replies
+    if (mp.decoded.want_response)
+        pi->sendResponse(mp);
+
+    LOG_DEBUG(MESH, "Plugin %s handled=%d\n", pi->name, handled);
+    return handled;
+}
+
 void MeshPlugin::callPlugins(const MeshPacket &mp)
 {
     // DEBUG_MSG("In call plugins\n");
-    bool pluginFound = false;
-    for (auto i = plugins->begin(); i != plugins->end(); ++i) {
-        auto &pi = **i;
+    if (tableDirty)
+        buildPortTable();
 
-        pi.currentRequest = &mp;
-        if (pi.wantPortnum(mp.decoded.data.portnum)) {
-            pluginFound = true;
+    PortNum port = mp.decoded.data.portnum;
+    uint8_t next = (port >= 0 && port < _PortNum_ARRAYSIZE) ? portTable[port] : 0;
+    uint8_t wildcard = 0;
 
-            bool handled = pi.handleReceived(mp);
+    // We only ever get packets the router is handling, which knows where they came from
+    bool local = router->isHandlingLocal();
+    DispatchScope scope(mp, local);
 
-            // Possibly send replies
-            if (mp.decoded.want_response)
-                pi.sendResponse(mp);
+    bool pluginFound = false;
+    for (;;) {
+        // Merge the plugins for this port with the wildcard plugins, so we visit everyone in registration order
+        MeshPlugin *pi;
+        if (next && (wildcard == numWildcardPlugins || next - 1 < wildcardPlugins[wildcard]->index)) {
+            pi = plugins[next - 1];
+            next = pi->nextForPort;
+        } else if (wildcard != numWildcardPlugins) {
+            pi = wildcardPlugins[wildcard++];
+            if (!pi->wantPortnum(port))
+                continue;
+        } else
+            break;
 
-            DEBUG_MSG("Plugin %s handled=%d\n", pi.name, handled);
-            if (handled)
-                break;
+        pluginFound = true;
+
+        if (pi->isAsync()) {
+            if (!asyncWorker)
+                asyncWorker = new AsyncPluginWorker();
+            if (asyncWorker->enqueue(pi, mp, local))
+                continue;
+
+            numAsyncOverflows++;
+            LOG_DEBUG(MESH, "Async plugin queue full, running %s inline\n", pi->name);
         }
-       
-        pi.currentRequest = NULL;
+
+        if (dispatch(pi, mp))
+            break;
     }
 
     if(!pluginFound)
-        DEBUG_MSG("No plugins interested in portnum=%d\n", mp.decoded.data.portnum);
+        LOG_DEBUG(MESH, "No plugins interested in portnum=%d\n", mp.decoded.data.portnum);
+}
+
+void MeshPlugin::clearDecoded(const MeshPacket *forPacket)
+{
+    decodeState.packet = forPacket;
+    memset(decodeState.payloads, 0, sizeof(decodeState.payloads));
+    decodeState.used = decodeState.base;
+}
+
+const void *MeshPlugin::decodePayload(const MeshPacket &mp, const pb_msgdesc_t *fields, size_t size)
+{
+    if (decodeState.packet != &mp)
+        clearDecoded(&mp);
+
+    size_t slot = 0;
+    for (; slot < PLUGIN_DECODE_SLOTS && decodeState.payloads[slot].fields; slot++)
+        if (decodeState.payloads[slot].fields == fields)
+            return decodeState.payloads[slot].decoded;
+
+    // Each plugin is done with what it asked for once it returns, so if we are out of room we can start over
+    size_t at = align8(decodeState.used);
+    if (slot == PLUGIN_DECODE_SLOTS || at + size > sizeof(decodeArena)) {
+        clearDecoded(&mp);
+        slot = 0;
+        at = decodeState.base;
+        if (at + size > sizeof(decodeArena)) {
+            LOG_WARN(MESH, "Warning: plugins nested too deeply to decode a %u byte payload\n", size);
+            return NULL;
+        }
+    }
+
+    auto &p = mp.decoded.data.payload;
+    void *decoded = decodeArena + at;
+    if (pb_decode_from_bytes(p.bytes, p.size, fields, decoded))
+        decodeState.used = at + size;
+    else
+        decoded = NULL;
+
+    decodeState.payloads[slot] = {fields, decoded};
+    return decoded;
 }
 
 /** Messages can be received that have the want_response bit set.  If set, this callback will be invoked
@@ -60,12 +270,12 @@ void MeshPlugin::callPlugins(const MeshPacket &mp)
 void MeshPlugin::sendResponse(const MeshPacket &req) {
     auto r = allocReply();
     if(r) {
-        DEBUG_MSG("Sending response\n");
+        LOG_DEBUG(MESH, "Sending response\n");
         setReplyTo(r, req);
         service.sendToMesh(r);
     }
     else {
-        DEBUG_MSG("WARNING: Client requested response but this plugin did not provide\n");
+        LOG_WARN(MESH, "WARNING: Client requested response but this plugin did not provide\n");
     }
 }
 
@@ -1,7 +1,27 @@
 #pragma once
 
+#include "mesh/MeshProfile.h"
 #include "mesh/MeshTypes.h"
-#include <vector>
+#include <pb.h>
+
+/// Bytes we have for payloads decoded by the plugins handling one packet (shared between them, see decodePayload)
+#ifndef PLUGIN_DECODE_ARENA_SIZE
+#define PLUGIN_DECODE_ARENA_SIZE 512
+#endif
+
+/// The most plugins which can register
+#ifndef MAX_PLUGINS
+#define MAX_PLUGINS (meshProfile.plugins)
+#endif
+
+/// How many different payload types we remember decoding for one packet
+#define PLUGIN_DECODE_SLOTS 4
+
+/// How many packets can wait for async plugins (see isAsync), once full further packets are handled inline
+#ifndef ASYNC_PLUGIN_QUEUE_SIZE
+#define ASYNC_PLUGIN_QUEUE_SIZE 8
+#endif
+
 /** A baseclass for any mesh "plugin".
  *
  * A plugin allows you to add new features to meshtastic device code, without needing to know messaging details.
@@ -14,7 +34,69 @@
  */
 class MeshPlugin
 {
-    static std::vector<MeshPlugin *> *plugins;
+    static MeshPlugin *plugins[MAX_PLUGINS];
+    static uint8_t numPlugins;
+
+    /// For each portnum, 1 + the index in plugins of the first plugin which wants only that port (or 0 for none)
+    static uint8_t portTable[_PortNum_ARRAYSIZE];
+
+    /// Plugins which might want any portnum, we have to ask them about each packet
+    static MeshPlugin *wildcardPlugins[MAX_PLUGINS];
+    static uint8_t numWildcardPlugins;
+
+    /// Set when a plugin is added, so we know to rebuild portTable
+    static bool tableDirty;
+
+    /// Our position in plugins
+    uint8_t index;
+
+    /// 1 + the index in plugins of the next plugin which wants the same single port as us (or 0 for none)
+    uint8_t nextForPort = 0;
+
+    /// Debugging counts
+    uint32_t numDispatched = 0, handleMicros = 0;
+
+    static void buildPortTable();
+
+    /// A payload we have decoded for the packet we are dispatching
+    struct DecodedPayload {
+        const pb_msgdesc_t *fields; // Its type (NULL for an unused slot)
+        void *decoded;              // In decodeArena, or NULL if it wouldn't decode
+    };
+
+    struct DecodeState {
+        const MeshPacket *packet; // The packet our payloads came from, we forget them all when we move on to another
+        DecodedPayload payloads[PLUGIN_DECODE_SLOTS];
+        size_t base, used; // The part of decodeArena we are using (callPlugins can nest, outer calls own what is below base)
+    };
+    static DecodeState decodeState;
+
+    /// Where our decoded payloads live, so plugins don't each need a decoded copy on their stack
+    alignas(8) static uint8_t decodeArena[PLUGIN_DECODE_ARENA_SIZE];
+
+    /// Forget every payload we have decoded (at this level of nesting)
+    static void clearDecoded(const MeshPacket *forPacket);
+
+    /// Did currentRequest originate on this node (see isLocalRequest)?
+    static bool currentRequestLocal;
+
+    /// Makes mp the current request (with nothing decoded yet) for as long as we exist, then puts back whatever was before
+    struct DispatchScope {
+        const MeshPacket *outerRequest;
+        bool outerLocal;
+        DecodeState outerDecode;
+
+        DispatchScope(const MeshPacket &mp, bool local);
+        ~DispatchScope();
+    };
+
+    /// Times our async plugins had to run inline because their queue was full
+    static uint32_t numAsyncOverflows;
+
+    /// Pass mp to pi (and send its response, if one was wanted) @return true if pi handled it
+    static bool dispatch(MeshPlugin *pi, const MeshPacket &mp);
+
+    friend class AsyncPluginWorker;
 
   public:
     /** Constructor
@@ -28,6 +110,21 @@ class MeshPlugin
      */
     static void callPlugins(const MeshPacket &mp);
 
+    /// All registered plugins, in the order they will be offered packets
+    static size_t getNumPlugins() { return numPlugins; }
+    static MeshPlugin *getPlugin(size_t i) { return plugins[i]; }
+
+    const char *getName() const { return name; }
+
+    /// The number of packets we've passed to handleReceived
+    uint32_t getNumDispatched() const { return numDispatched; }
+
+    /// The total time spent in handleReceived
+    uint32_t getHandleMicros() const { return handleMicros; }
+
+    /// How often a packet for an async plugin found the queue full
+    static uint32_t getNumAsyncOverflows() { return numAsyncOverflows; }
+
   protected:
     const char *name;
 
@@ -40,6 +137,21 @@ class MeshPlugin
      */
     static const MeshPacket *currentRequest;
 
+    /**
+     * Did currentRequest originate on this node (from our phone, or another of our plugins) rather than arrive over the air?
+     * Check this rather than its from, which anyone can set to our node number.
+     */
+    static bool isLocalRequest() { return currentRequestLocal; }
+
+    /**
+     * Decode mp's payload as the protobuf described by fields (whose struct is size bytes), or return the copy another plugin
+     * already decoded for this packet.  So each packet's payload is decoded once, however many plugins want it.
+     *
+     * The result is only valid until this plugin returns from handleReceived, and must not be modified.
+     * @return NULL if the payload didn't decode
+     */
+    static const void *decodePayload(const MeshPacket &mp, const pb_msgdesc_t *fields, size_t size);
+
     /**
      * Initialize your plugin.  This setup function is called once after all hardware and mesh protocol layers have
      * been initialized
@@ -51,6 +163,20 @@ class MeshPlugin
      */
     virtual bool wantPortnum(PortNum p) = 0;
 
+    /**
+     * If this plugin only ever wants one portnum, return it so callPlugins can find us directly.  Otherwise return -1 and
+     * wantPortnum() will be called for every packet.  The result must not change after the first packet is dispatched.
+     */
+    virtual int getSinglePortnum() { return -1; }
+
+    /**
+     * Return true if handleReceived is slow (flash I/O, GPIO, sending replies) and doesn't need to run before the router moves
+     * on.  We then queue each packet for you (sharing the router's copy) and call you later from our own thread, so you
+     * can't stop later plugins from seeing a packet: your handleReceived's result is ignored.  If the queue is full we call you
+     * inline as usual.
+     */
+    virtual bool isAsync() { return false; }
+
     /** Called to handle a particular incoming message
 
     @return true if you've guaranteed you've handled this message and no other handlers should be considered for it
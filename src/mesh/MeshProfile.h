@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * How much memory our mesh gets for its queues, tables and pools, sized for the kind of board and the job it does.  Each
+ * platformio env picks one with -DMESH_PROFILE=MESH_PROFILE_..., or gets the default for its platform below.
+ *
+ * Everything is constexpr, so the capacities below size our arrays at build time as before.  A single capacity can still be
+ * overridden by defining its macro (i.e. -DPACKET_HISTORY_SIZE=1024).
+ *
+ * Our containers (queues, the packet history, the plugin registry, the log buffers) are all fixed size arrays sized from here
+ * rather than STL containers on the heap, so what the mesh needs is all known at link time and never fragments the heap.
+ * That matters most on tiny boards, which can't afford the STL's code size or its allocations.
+ */
+struct MeshProfile {
+    const char *name;
+
+    size_t txQueue;       // Packets each interface can queue for transmission
+    size_t rxFromRadio;   // Received packets which can wait for the router, must be a power of 2
+    size_t rxToPhone;     // Packets which can wait for our phone
+    size_t packetHistory; // Packets the router remembers, to suppress duplicates (must be a power of 2)
+    size_t maxNodes;      // Nodes in our NodeDB (never more than the protobufs have room for)
+    size_t interfaces;    // Radio interfaces we can use at once
+    size_t plugins;       // MeshPlugins which can register (we have a fixed table of them)
+    size_t logLine;       // Bytes in our formatted log line buffer, longer lines are truncated
+    size_t nodeHistory;   // Bytes in the ring of SNR and position samples we keep for our nodes (see NodeHistory)
+};
+
+#define MESH_PROFILE_TINY 0     // Boards with very little RAM (i.e. CubeCell)
+#define MESH_PROFILE_STANDARD 1 // Handhelds and most boards
+#define MESH_PROFILE_ROUTER 2   // Dedicated relays, which forward much more than they originate
+#define MESH_PROFILE_GATEWAY 3  // Linux gateways, with lots of RAM, several interfaces and many API clients
+
+constexpr MeshProfile meshProfiles[] = {
+    // name, txQueue, rxFromRadio, rxToPhone, packetHistory, maxNodes, interfaces, plugins, logLine, nodeHistory
+    {"tiny", 8, 4, 8, 64, 16, 1, 20, 128, 256},
+    {"standard", 16, 4, 32, 128, 32, 1, 32, 256, 2048},
+    {"router", 32, 8, 16, 256, 32, 1, 32, 256, 2048},
+    {"gateway", 32, 8, 64, 1024, 32, 2, 32, 512, 16384},
+};
+
+#ifndef MESH_PROFILE
+#if defined(CubeCell_BoardPlus)
+#define MESH_PROFILE MESH_PROFILE_TINY
+#elif defined(PORTDUINO)
+#define MESH_PROFILE MESH_PROFILE_GATEWAY
+#else
+#define MESH_PROFILE MESH_PROFILE_STANDARD
+#endif
+#endif
+
+/// The profile this build uses
+constexpr MeshProfile meshProfile = meshProfiles[MESH_PROFILE];
+
+static_assert((meshProfile.rxFromRadio & (meshProfile.rxFromRadio - 1)) == 0, "rxFromRadio must be a power of two");
@@ -1,19 +1,28 @@
 
 #include <Arduino.h>
 #include <assert.h>
-#include <string>
 
 #include "GPS.h"
 //#include "MeshBluetoothService.h"
+#include "../concurrency/LockGuard.h"
 #include "../concurrency/Periodic.h"
 #include "BluetoothCommon.h" // needed for updateBatteryLevel, FIXME, eventually when we pull mesh out into a lib we shouldn't be whacking bluetooth from here
 #include "MeshService.h"
 #include "NodeDB.h"
+#include "PacketTrace.h"
 #include "PowerFSM.h"
 #include "RTC.h"
+#include "SubPacketCodec.h"
 #include "main.h"
 #include "mesh-pb-constants.h"
+#include <pb_encode.h>
+#include "plugins/LatencyStatsPlugin.h"
+#include "plugins/LoadGenPlugin.h"
+#include "plugins/MemoryStatsPlugin.h"
 #include "plugins/PositionPlugin.h"
+#include "plugins/PowerStatsPlugin.h"
+#include "plugins/QueueStatusPlugin.h"
+#include "plugins/TelemetryPlugin.h"
 #include "plugins/NodeInfoPlugin.h"
 #include "power.h"
 
@@ -55,20 +64,35 @@ static int32_t sendOwnerCb()
 {
     static uint32_t currentGeneration;
 
+    static uint32_t numSkipped;
+
     // If we changed channels, ask everyone else for their latest info
     bool requestReplies = currentGeneration != radioGeneration;
     currentGeneration = radioGeneration;
 
-    DEBUG_MSG("Sending our nodeinfo to mesh (wantReplies=%d)\n", requestReplies);
+    // Our beacons (see BeaconPlugin) carry a hash of our User, so nodes which don't have it ask for it.  Therefore we only
+    // broadcast it when it has changed (and every NODEINFO_REFRESH_INTERVALS, for nodes too old to ask).
     assert(nodeInfoPlugin);
-    nodeInfoPlugin->sendOurNodeInfo(NODENUM_BROADCAST, requestReplies); // Send our info (don't request replies)
+    if (requestReplies || nodeInfoPlugin->ownerChanged() || ++numSkipped >= NODEINFO_REFRESH_INTERVALS) {
+        LOG_DEBUG(MESH, "Sending our nodeinfo to mesh (wantReplies=%d)\n", requestReplies);
+        nodeInfoPlugin->sendOurNodeInfo(NODENUM_BROADCAST, requestReplies);
+        numSkipped = 0;
+    }
 
-    return getPref_send_owner_interval() * getPref_position_broadcast_secs() * 1000;
+    return nodeDB.stretchForCongestion(getPref_send_owner_interval() * getPref_position_broadcast_secs() * 1000);
 }
 
 static concurrency::Periodic *sendOwnerPeriod;
 
-MeshService::MeshService() : toPhoneQueue(MAX_RX_TOPHONE)
+static int32_t notifyFromNumCb()
+{
+    service.notifyFromNum();
+    return 0;
+}
+
+static concurrency::Periodic *notifyFromNumPeriod;
+
+MeshService::MeshService()
 {
     // assert(MAX_RX_TOPHONE == 32); // FIXME, delete this, just checking my clever macro
 }
@@ -78,41 +102,290 @@ void MeshService::init()
     sendOwnerPeriod = new concurrency::Periodic("SendOwner", sendOwnerCb);
     sendOwnerPeriod->setIntervalFromNow(30 * 1000); // Send our initial owner announcement 30 seconds after we start (to give network time to setup)
 
+    notifyFromNumPeriod = new concurrency::Periodic("NotifyFromNum", notifyFromNumCb);
+    notifyFromNumPeriod->setEnabled(false); // Until we queue something for our phones
+
     // moved much earlier in boot (called from setup())
     // nodeDB.init();
 
     if (gps)
-        gpsObserver.observe(&gps->newStatus);
+        startGPS();
     packetReceivedObserver.observe(&router->notifyPacketReceived);
 }
 
+void MeshService::startGPS()
+{
+    gpsObserver.observe(&gps->newStatus);
+}
+
 
 int MeshService::handleFromRadio(const MeshPacket *mp)
 {
     powerFSM.trigger(EVENT_RECEIVED_PACKET); // Possibly keep the node from sleeping
 
-    printPacket("Forwarding to phone", mp);
+    LOG_PACKET(MESH, "Forwarding to phone", mp);
     nodeDB.updateFrom(*mp); // update our DB state based off sniffing every RX packet from the radio
 
+    storeForPhone(*mp);
+    packetTrace.mark(mp, TRACE_RX_TOPHONE);
+    return 0;
+}
+
+void MeshService::sendToPhone(MeshPacket *p)
+{
+    storeForPhone(*p);
+    releaseToPool(p);
+}
+
+PhonePriority MeshService::classifyForPhone(const MeshPacket &p)
+{
+    if (p.which_payload != MeshPacket_decoded_tag)
+        return PHONE_TELEMETRY; // Not on any channel we have, so no phone app can read it either
+
+    if (p.decoded.which_payload != SubPacket_data_tag)
+        return PHONE_USER_DATA; // Acks and routing, which tell the user their messages got through
+
+    // Not switching on the enum, because our own plugins use portnums mesh.proto doesn't list yet
+    switch ((uint32_t)p.decoded.data.portnum) {
+    case PortNum_POSITION_APP:
+    case PortNum_NODEINFO_APP:
+    case QUEUE_STATUS_PORTNUM: // Only our newest queue status matters
+        return PHONE_UPDATE;
+
+    case POSITION_DELTA_PORTNUM: // PositionPlugin also gives the phone a full position for each of these
+    case POWER_STATS_PORTNUM:
+    case LATENCY_STATS_PORTNUM:
+    case MEMORY_STATS_PORTNUM:
+    case TELEMETRY_PORTNUM:
+    case LOAD_GEN_PORTNUM: // Synthetic load, which must never crowd out real messages
+        return PHONE_TELEMETRY;
+
+    default:
+        return PHONE_USER_DATA;
+    }
+}
+
+void MeshService::storeForPhone(const MeshPacket &p)
+{
+    // Encode outside of our lock, our clients might be waiting on it
+    static_assert(sizeof(p.encrypted.bytes) <= SubPacket_size, "encoded must be big enough for either payload");
+    uint8_t encoded[SubPacket_size];
+    size_t len;
+    if (p.which_payload == MeshPacket_encrypted_tag) {
+        len = p.encrypted.size;
+        memcpy(encoded, p.encrypted.bytes, len);
+    } else
+        len = encodeSubPacket(encoded, sizeof(encoded), p.decoded);
+
+    bool isData = p.which_payload == MeshPacket_decoded_tag && p.decoded.which_payload == SubPacket_data_tag;
+    QueuedPacket q = {0,
+                      p.from,
+                      p.to,
+                      p.id,
+                      p.channel_index,
+                      p.rx_time,
+                      p.hop_limit,
+                      p.rx_snr,
+                      p.want_ack,
+                      p.which_payload,
+                      (uint16_t)(isData ? p.decoded.data.portnum : 0),
+                      classifyForPhone(p),
+                      (uint16_t)len,
+                      NULL};
+
+    concurrency::LockGuard g(&toPhoneLock);
+
+    if (numToPhone == MAX_RX_TOPHONE && !makeRoomForPhone(q))
+        return;
+
+    while (!(q.payload = phoneSlabs.alloc(len))) {
+        if (!numToPhone) {
+            LOG_WARN(MESH, "Warning: %u byte packet is too big to queue for phone, discarding\n", len);
+            numPhoneDrops[q.priority]++;
+            return;
+        }
+        if (!makeRoomForPhone(q)) // Out of buffers big enough
+            return;
+    }
+
+    memcpy(q.payload, encoded, len);
+    q.seq = toPhoneNext++;
+    toPhone[numToPhone++] = q;
     fromNum++;
 
-    if (toPhoneQueue.numFree() == 0) {
-        DEBUG_MSG("NOTE: tophone queue is full, discarding oldest\n");
-        MeshPacket *d = toPhoneQueue.dequeuePtr(0);
-        if (d)
-            releaseToPool(d);
+    // Everything queued before our notifier gets to run shares one notify
+    if (notifyFromNumPeriod) {
+        notifyFromNumPeriod->setIntervalFromNow(0);
+        notifyFromNumPeriod->setEnabled(true);
     }
+}
 
-    MeshPacket *copied = packetPool.allocCopy(*mp);
-    assert(toPhoneQueue.enqueue(copied, 0)); // FIXME, instead of failing for full queue, delete the oldest mssages
+PhonePriority MeshService::getPhonePriority(size_t i, const QueuedPacket &incoming) const
+{
+    const QueuedPacket &q = toPhone[i];
+    if (q.priority != PHONE_UPDATE)
+        return q.priority;
+
+    auto isNewer = [&](const QueuedPacket &n) {
+        return n.priority == PHONE_UPDATE && n.from == q.from && n.portnum == q.portnum;
+    };
+    if (isNewer(incoming))
+        return PHONE_SUPERSEDED;
+    for (size_t j = i + 1; j < numToPhone; j++)
+        if (isNewer(toPhone[j]))
+            return PHONE_SUPERSEDED;
+
+    return PHONE_UPDATE;
+}
 
-    return 0;
+bool MeshService::makeRoomForPhone(const QueuedPacket &incoming)
+{
+    assert(numToPhone);
+
+    // Our oldest packet of the lowest priority
+    size_t victim = 0;
+    PhonePriority victimPriority = getPhonePriority(0, incoming);
+    for (size_t i = 1; i < numToPhone && victimPriority != PHONE_SUPERSEDED; i++) {
+        PhonePriority priority = getPhonePriority(i, incoming);
+        if (priority < victimPriority) {
+            victim = i;
+            victimPriority = priority;
+        }
+    }
+
+    if (incoming.priority < victimPriority) {
+        LOG_DEBUG(MESH, "Phone queue full of more important packets, not queuing fr=0x%x,id=%d\n", incoming.from, incoming.id);
+        numPhoneDrops[incoming.priority]++;
+        return false;
+    }
+
+    QueuedPacket &q = toPhone[victim];
+    LOG_DEBUG(MESH, "Phone queue full, discarding fr=0x%x,id=%d (priority %d)\n", q.from, q.id, victimPriority);
+    numPhoneDrops[victimPriority]++;
+
+    phoneSlabs.release(q.payload);
+    memmove(&toPhone[victim], &toPhone[victim + 1], (numToPhone - victim - 1) * sizeof(QueuedPacket));
+    numToPhone--;
+    return true;
+}
+
+size_t MeshService::findForPhone(uint32_t cursor) const
+{
+    size_t i = 0;
+    while (i < numToPhone && (int32_t)(toPhone[i].seq - cursor) < 0)
+        i++;
+    return i;
+}
+
+bool MeshService::isWantedByPhone(const QueuedPacket &q, const PhoneFilter *filter)
+{
+    if (!filter)
+        return true;
+    if (filter->from && q.from != filter->from)
+        return false;
+    if (!filter->numPortnums)
+        return true;
+    if (!q.portnum)
+        return filter->wantsRouting;
+
+    for (uint8_t i = 0; i < filter->numPortnums; i++)
+        if (filter->portnums[i] == q.portnum)
+            return true;
+    return false;
+}
+
+size_t MeshService::encodeForPhone(uint32_t &cursor, uint8_t *buf, size_t bufsize, const PhoneFilter *filter)
+{
+    concurrency::LockGuard g(&toPhoneLock);
+
+    size_t i = findForPhone(cursor);
+    if (i < numToPhone && toPhone[i].seq != cursor)
+        LOG_DEBUG(MESH, "NOTE: phone client fell behind, skipping %u discarded packets\n", toPhone[i].seq - cursor);
+    while (i < numToPhone && !isWantedByPhone(toPhone[i], filter))
+        i++;
+    if (i == numToPhone) {
+        cursor = toPhoneNext; // Anything it hasn't seen we have discarded (or it doesn't want)
+        return 0;
+    }
+
+    const QueuedPacket &q = toPhone[i];
+    cursor = q.seq + 1;
+
+    // We only know the MeshPacket's length once we have written it, so it goes after room for the longest FromRadio tag and
+    // length, and moves down to meet them
+    static_assert(FromRadio_packet_tag < 16 && MeshPacket_size < (1 << 14), "Our prefix is at most 3 bytes");
+    const size_t maxPrefixLen = 3;
+    assert(bufsize > maxPrefixLen);
+
+    pb_ostream_t body = pb_ostream_from_buffer(buf + maxPrefixLen, bufsize - maxPrefixLen);
+    if (!encodeQueuedPacket(&body, q)) {
+        LOG_ERROR(MESH, "Error: can't encode packet we queued for phone\n"); // Can't happen, it came from a MeshPacket
+        return 0;
+    }
+
+    uint8_t prefix[maxPrefixLen];
+    pb_ostream_t head = pb_ostream_from_buffer(prefix, sizeof(prefix));
+    pb_encode_tag(&head, PB_WT_STRING, FromRadio_packet_tag);
+    pb_encode_varint(&head, body.bytes_written);
+    memmove(buf + head.bytes_written, buf + maxPrefixLen, body.bytes_written);
+    memcpy(buf, prefix, head.bytes_written);
+
+    LOG_DEBUG(MESH, "phone downloaded packet id=0x%x from=0x%x portnum=%u\n", q.id, q.from, q.portnum);
+    packetTrace.mark(q.from, q.id, TRACE_RX_PHONE);
+    return head.bytes_written + body.bytes_written;
+}
+
+bool MeshService::encodeQueuedPacket(pb_ostream_t *s, const QueuedPacket &q)
+{
+    // Fields in MeshPacket's declaration order, skipping proto3 defaults (as nanopb checks them, i.e. a float's bits), and our
+    // payload is already encoded by encodeSubPacket (for a decoded packet) so it goes in as is
+    uint32_t snrBits;
+    memcpy(&snrBits, &q.rx_snr, sizeof(snrBits));
+    uint32_t payloadTag = q.which_payload == MeshPacket_encrypted_tag ? MeshPacket_encrypted_tag : MeshPacket_decoded_tag;
+
+    return (!q.from || (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_from_tag) && pb_encode_varint(s, q.from))) &&
+           (!q.to || (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_to_tag) && pb_encode_varint(s, q.to))) &&
+           pb_encode_tag(s, PB_WT_STRING, payloadTag) && pb_encode_string(s, q.payload, q.len) &&
+           (!q.channel_index ||
+            (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_channel_index_tag) && pb_encode_varint(s, q.channel_index))) &&
+           (!q.id || (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_id_tag) && pb_encode_varint(s, q.id))) &&
+           (!snrBits || (pb_encode_tag(s, PB_WT_32BIT, MeshPacket_rx_snr_tag) && pb_encode_fixed32(s, &snrBits))) &&
+           (!q.rx_time || (pb_encode_tag(s, PB_WT_32BIT, MeshPacket_rx_time_tag) && pb_encode_fixed32(s, &q.rx_time))) &&
+           (!q.hop_limit || (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_hop_limit_tag) && pb_encode_varint(s, q.hop_limit))) &&
+           (!q.want_ack || (pb_encode_tag(s, PB_WT_VARINT, MeshPacket_want_ack_tag) && pb_encode_varint(s, 1)));
+}
+
+uint32_t MeshService::numForPhone(uint32_t cursor, const PhoneFilter *filter)
+{
+    concurrency::LockGuard g(&toPhoneLock);
+    size_t i = findForPhone(cursor);
+    if (!filter)
+        return numToPhone - i;
+
+    uint32_t n = 0;
+    for (; i < numToPhone; i++)
+        if (isWantedByPhone(toPhone[i], filter))
+            n++;
+    return n;
+}
+
+uint32_t MeshService::getOldestForPhone()
+{
+    concurrency::LockGuard g(&toPhoneLock);
+    return numToPhone ? toPhone[0].seq : toPhoneNext;
+}
+
+uint32_t MeshService::getNewestForPhone()
+{
+    concurrency::LockGuard g(&toPhoneLock);
+    return toPhoneNext;
 }
 
 /// Do idle processing (mostly processing messages which have been queued from the radio)
-void MeshService::loop()
+void MeshService::notifyFromNum()
 {
-    if (oldFromNum != fromNum) { // We don't want to generate extra notifies for multiple new packets
+    notifyFromNumPeriod->setEnabled(false); // Until the next packet for our phones
+    if (oldFromNum != fromNum) {
         fromNumChanged.notifyObservers(fromNum);
         oldFromNum = fromNum;
     }
@@ -127,7 +400,7 @@ bool MeshService::reloadConfig()
     bool didReset = nodeDB.resetRadioConfig(); // Don't let the phone send us fatally bad settings
 
     configChanged.notifyObservers(NULL);
-    nodeDB.saveToDisk();
+    nodeDB.requestSave();
 
     return didReset;
 }
@@ -137,7 +410,7 @@ void MeshService::reloadOwner()
 {
     assert(nodeInfoPlugin);
     nodeInfoPlugin->sendOurNodeInfo();
-    nodeDB.saveToDisk();
+    nodeDB.requestSave();
 }
 
 /**
@@ -152,13 +425,14 @@ void MeshService::handleToRadio(MeshPacket &p)
 
     if (p.id == 0)
         p.id = generatePacketId(); // If the phone didn't supply one, then pick one
+    markFromPhone(p.id);        // So it (and any retransmission) shares our phone clients' airtime
 
     p.rx_time = getValidTime(RTCQualityFromNet); // Record the time the packet arrived from the phone
                                                  // (so we update our nodedb for the local node)
 
     // Send the packet into the mesh
 
-    sendToMesh(packetPool.allocCopy(p));
+    sendToMesh(packetPool.allocCopyReserved(p));
 
     bool loopback = false; // if true send any packet the phone sends back itself (for testing)
     if (loopback) {
@@ -179,10 +453,10 @@ void MeshService::sendToMesh(MeshPacket *p)
     if (p->which_payload == MeshPacket_decoded_tag && p->decoded.which_payload == SubPacket_position_tag &&
         p->decoded.position.time) {
         if (getRTCQuality() < RTCQualityGPS) {
-            DEBUG_MSG("Stripping time %u from position send\n", p->decoded.position.time);
+            LOG_DEBUG(MESH, "Stripping time %u from position send\n", p->decoded.position.time);
             p->decoded.position.time = 0;
         } else
-            DEBUG_MSG("Providing time to mesh %u\n", p->decoded.position.time);
+            LOG_DEBUG(MESH, "Providing time to mesh %u\n", p->decoded.position.time);
     }
 
     // Note: We might return !OK if our fifo was full, at that point the only option we have is to drop it
@@ -194,7 +468,7 @@ void MeshService::sendNetworkPing(NodeNum dest, bool wantReplies)
     NodeInfo *node = nodeDB.getNode(nodeDB.getNodeNum());
     assert(node);
 
-    DEBUG_MSG("Sending network ping to 0x%x, with position=%d, wantReplies=%d\n", dest, node->has_position, wantReplies);
+    LOG_DEBUG(MESH, "Sending network ping to 0x%x, with position=%d, wantReplies=%d\n", dest, node->has_position, wantReplies);
     assert(positionPlugin && nodeInfoPlugin);
     if (node->has_position)
         positionPlugin->sendOurPosition(dest, wantReplies);
@@ -217,6 +491,7 @@ NodeInfo *MeshService::refreshMyNodeInfo() {
 
     // Update our local node info with our position (even if we don't decide to update anyone else)
     position.time = getValidTime(RTCQualityGPS); // This nodedb timestamp might be stale, so update it if our clock is valid.
+    nodeDB.updateLastSeen(node);
 
     position.battery_level = powerStatus->getBatteryChargePercent();
     updateBatteryLevel(position.battery_level);
@@ -240,7 +515,7 @@ int MeshService::onGPSChanged(const meshtastic::GPSStatus *unused)
         // The GPS has lost lock, if we are fixed position we should just keep using
         // the old position
         if(!radioConfig.preferences.fixed_position) {
-            DEBUG_MSG("WARNING: Using fixed position\n");
+            LOG_WARN(MESH, "WARNING: Using fixed position\n");
         } else {
             // throw away old position
             pos.latitude_i = 0;
@@ -249,27 +524,20 @@ int MeshService::onGPSChanged(const meshtastic::GPSStatus *unused)
         }
     }
 
-    DEBUG_MSG("got gps notify time=%u, lat=%d, bat=%d\n", pos.latitude_i, pos.time, pos.battery_level);
+    LOG_DEBUG(MESH, "got gps notify time=%u, lat=%d, bat=%d\n", pos.latitude_i, pos.time, pos.battery_level);
 
     // Update our current position in the local DB
     nodeDB.updatePosition(nodeDB.getNodeNum(), pos);
 
-    // We limit our GPS broadcasts to a max rate
-    static uint32_t lastGpsSend;
-    uint32_t now = millis();
-    if (lastGpsSend == 0 || now - lastGpsSend > getPref_position_broadcast_secs() * 1000) {
-        lastGpsSend = now;
-
-        static uint32_t currentGeneration;
+    static uint32_t currentGeneration;
 
-        // If we changed channels, ask everyone else for their latest info
-        bool requestReplies = currentGeneration != radioGeneration;
-        currentGeneration = radioGeneration;
+    // If we changed channels, ask everyone else for their latest info
+    bool requestReplies = currentGeneration != radioGeneration;
+    currentGeneration = radioGeneration;
 
-        DEBUG_MSG("Sending position to mesh (wantReplies=%d)\n", requestReplies);
-        assert(positionPlugin);
-        positionPlugin->sendOurPosition(NODENUM_BROADCAST, requestReplies);
-    }
+    // The plugin limits our broadcasts to a rate that depends on how much we are moving
+    assert(positionPlugin);
+    positionPlugin->broadcastIfNeeded(requestReplies);
 
     return 0;
 }
@@ -2,7 +2,6 @@
 
 #include <Arduino.h>
 #include <assert.h>
-#include <string>
 
 #include "GPSStatus.h"
 #include "MemoryPool.h"
@@ -10,6 +9,43 @@
 #include "MeshTypes.h"
 #include "Observer.h"
 #include "PointerQueue.h"
+#include "concurrency/Lock.h"
+
+/// How many payload buffers of each size we keep for the packets waiting for our phone clients.  Most packets are acks,
+/// positions and node infos which fit in 64 bytes, so this holds a full toPhone ring of those in well under half the RAM
+/// a MeshPacket each would take.
+#ifndef TOPHONE_SLABS_32
+#define TOPHONE_SLABS_32 16
+#endif
+#ifndef TOPHONE_SLABS_64
+#define TOPHONE_SLABS_64 16
+#endif
+#ifndef TOPHONE_SLABS_128
+#define TOPHONE_SLABS_128 8
+#endif
+#ifndef TOPHONE_SLABS_256
+#define TOPHONE_SLABS_256 6
+#endif
+
+/// How much we want to keep a packet queued for our phone clients, when we have to discard one the lowest goes first
+enum PhonePriority : uint8_t {
+    PHONE_SUPERSEDED, // A position or node info for which we have a newer one from the same sender
+    PHONE_TELEMETRY,  // Stats and other packets phone apps don't show (or can't even decrypt)
+    PHONE_UPDATE,     // Positions and node infos, of which only the latest from each sender matters
+    PHONE_USER_DATA,  // Text messages, acks and everything else
+    PHONE_NUM_PRIORITIES
+};
+
+/// The most portnums one PhoneFilter can ask for
+#define PHONE_FILTER_MAX_PORTNUMS 8
+
+/// Which of our received packets a phone client wants (see PHONE_FILTER_PORTNUM), all zeros wants everything
+struct PhoneFilter {
+    NodeNum from;        // Only packets from this node, 0 for any
+    bool wantsRouting;   // If it lists portnums, whether it also wants packets with none (acks, routing and those we can't read)
+    uint8_t numPortnums; // 0 for packets on any portnum
+    uint16_t portnums[PHONE_FILTER_MAX_PORTNUMS];
+};
 
 /**
  * Top level app for this service.  keeps the mesh, the radio config and the queue of received packets.
@@ -22,16 +58,45 @@ class MeshService
     CallbackObserver<MeshService, const MeshPacket *> packetReceivedObserver =
         CallbackObserver<MeshService, const MeshPacket *>(this, &MeshService::handleFromRadio);
 
-    /// received packets waiting for the phone to process them
-    /// FIXME, change to a DropOldestQueue and keep a count of the number of dropped packets to ensure
-    /// we never hang because android hasn't been there in a while
+    /// A packet waiting in toPhone.  Rather than a whole MeshPacket (which is mostly the unused part of its payload union) we
+    /// keep its header fields and its encoded payload, in a buffer from phoneSlabs just big enough to hold it.
+    struct QueuedPacket {
+        uint32_t seq; // Our sequence number for this packet, which is what our clients' cursors count
+        uint32_t from, to, id, channel_index, rx_time, hop_limit;
+        float rx_snr;
+        bool want_ack;
+        pb_size_t which_payload;
+        uint16_t portnum; // 0 unless this is a data packet
+        PhonePriority priority;
+        uint16_t len;
+        uint8_t *payload;
+    };
+
+    /// The most recent received packets, for our phone clients, oldest first.  Each client keeps its own cursor (the seq of the
+    /// next packet it wants, see encodeForPhone), so they all see every packet without us keeping a copy per client.  Once full
+    /// (or once we run out of phoneSlabs) we discard packets by PhonePriority, oldest first within a priority.
     /// FIXME - save this to flash on deep sleep
-    PointerQueue<MeshPacket> toPhoneQueue;
+    QueuedPacket toPhone[MAX_RX_TOPHONE] = {};
+
+    /// The payloads of the packets in toPhone
+    SlabAllocator phoneSlabs = SlabAllocator(TOPHONE_SLABS_32, TOPHONE_SLABS_64, TOPHONE_SLABS_128, TOPHONE_SLABS_256);
+
+    /// The seq the next packet we add to toPhone will get
+    uint32_t toPhoneNext = 0;
+
+    /// How many packets are in toPhone
+    uint32_t numToPhone = 0;
+
+    /// How many packets of each priority we have discarded to make room in toPhone (or not queued at all)
+    uint32_t numPhoneDrops[PHONE_NUM_PRIORITIES] = {};
+
+    /// Our clients read from other threads (i.e. bluetooth)
+    concurrency::Lock toPhoneLock;
 
     /// The current nonce for the newest packet which has been queued for the phone
     uint32_t fromNum = 0;
 
-    /// Updated in loop() to detect when fromNum changes
+    /// The fromNum our observers last heard about
     uint32_t oldFromNum = 0;
 
   public:
@@ -45,12 +110,43 @@ class MeshService
 
     void init();
 
-    /// Do idle processing (mostly processing messages which have been queued from the radio)
-    void loop();
+    /// Tell our fromNumChanged observers about the packets we have queued for our phones since we last did
+    void notifyFromNum();
+
+    /**
+     * Encode the next packet for a phone client as a FromRadio into buf, and advance its cursor.  A client which fell so far
+     * behind that we have already discarded its next packets skips ahead to our oldest one.
+     *
+     * We write the FromRadio straight from our queued header fields and encoded payload (the same bytes as encoding a
+     * MeshPacket, without decoding the payload into one first).
+     *
+     * Packets which don't pass the client's filter (if it has one) are skipped without being encoded.
+     *
+     * @return its length, or 0 if the client has already seen every packet
+     */
+    size_t encodeForPhone(uint32_t &cursor, uint8_t *buf, size_t bufsize, const PhoneFilter *filter = NULL);
+
+    /// @return true if a client with this cursor has packets to read
+    bool hasForPhone(uint32_t cursor, const PhoneFilter *filter = NULL) { return numForPhone(cursor, filter) != 0; }
+
+    /// @return how many packets a client with this cursor still has to read (it will skip any packets we discarded, and any
+    /// its filter doesn't want)
+    uint32_t numForPhone(uint32_t cursor, const PhoneFilter *filter = NULL);
 
-    /// Return the next packet destined to the phone.  FIXME, somehow use fromNum to allow the phone to retry the
-    /// last few packets if needs to.
-    MeshPacket *getForPhone() { return toPhoneQueue.dequeuePtr(0); }
+    /// @return the cursor a new client should start from (so it gets all the packets we still have)
+    uint32_t getOldestForPhone();
+
+    /// @return the cursor for a client which only wants the packets we receive from now on
+    uint32_t getNewestForPhone();
+
+    /// How many packets are waiting in the queue for our phone clients
+    uint32_t getNumToPhone() const { return numToPhone; }
+
+    /// How many packets we have discarded from (or never added to) the queue for our phone clients because it was full
+    uint32_t getNumPhoneDrops(PhonePriority priority) const { return numPhoneDrops[priority]; }
+
+    /// The buffers our packets for the phone are kept in (for our stats)
+    const SlabAllocator &getPhoneSlabs() const { return phoneSlabs; }
 
     /// Allows the bluetooth handler to free packets after they have been sent
     void releaseToPool(MeshPacket *p) { packetPool.release(p); }
@@ -79,9 +175,16 @@ class MeshService
     /// cache
     void sendToMesh(MeshPacket *p);
 
+    /// Queue a packet for our phone clients (without sending it into the mesh), p must have been allocated from packetPool and
+    /// we take ownership of it
+    void sendToPhone(MeshPacket *p);
+
     /// Pull the latest power and time info into my nodeinfo
     NodeInfo *refreshMyNodeInfo();
 
+    /// Called once we have found our GPS (we look for it after boot), so we can start sending our position
+    void startGPS();
+
   private:
 
     /// Called when our gps position has changed - updates nodedb and sends Location message out into the mesh
@@ -91,6 +194,28 @@ class MeshService
     /// Handle a packet that just arrived from the radio.  This method does _not_ free the provided packet.  If it needs
     /// to keep the packet around it makes a copy
     int handleFromRadio(const MeshPacket *p);
+
+    /// Add a copy of p to toPhone
+    void storeForPhone(const MeshPacket &p);
+
+    /// Discard the least wanted packet in toPhone to make room for incoming, toPhoneLock must be held
+    /// @return false (and counts incoming as dropped) if incoming is the least wanted
+    bool makeRoomForPhone(const QueuedPacket &incoming);
+
+    /// How much we want to keep toPhone[i], now that incoming is arriving
+    PhonePriority getPhonePriority(size_t i, const QueuedPacket &incoming) const;
+
+    /// The index of the first packet in toPhone a client with this cursor hasn't seen (numToPhone if none)
+    size_t findForPhone(uint32_t cursor) const;
+
+    /// @return true if a client with this filter (NULL for none) wants q
+    static bool isWantedByPhone(const QueuedPacket &q, const PhoneFilter *filter);
+
+    /// Write q as the fields of a MeshPacket
+    static bool encodeQueuedPacket(pb_ostream_t *s, const QueuedPacket &q);
+
+    /// How we classify a packet for toPhone
+    static PhonePriority classifyForPhone(const MeshPacket &p);
 };
 
 extern MeshService service;
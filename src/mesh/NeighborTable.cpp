@@ -0,0 +1,163 @@
+#include "NeighborTable.h"
+#include "NodeDB.h"
+#include "NoiseMonitor.h"
+#include "configuration.h"
+
+NeighborTable neighbors;
+
+/// A gap in packet ids this big probably means they rebooted (or we were out of range for a long time), not ordinary loss
+#define MAX_COUNTED_GAP 16
+
+void NeighborTable::onReceive(const MeshPacket *p, float snr, float rssi, uint8_t interfaceIndex)
+{
+    if (p->from == nodeDB.getNodeNum() || !isDirect(p))
+        return; // Our own packet echoed back, or relayed by someone we can't identify
+
+    uint32_t now = millis();
+    int i = indexOf(p->from);
+
+    if (i < 0) {
+        if (numNeighbors == NEIGHBOR_TABLE_SIZE) {
+            // Full, replace the neighbor we heard least recently
+            size_t oldest = 0;
+            for (size_t j = 1; j < numNeighbors; j++)
+                if (now - neighbors[j].lastHeardMsec > now - neighbors[oldest].lastHeardMsec)
+                    oldest = j;
+            i = oldest;
+        } else
+            i = numNeighbors++;
+
+        LOG_DEBUG(MESH, "New neighbor 0x%x, snr=%f\n", p->from, snr);
+        neighbors[i] = {p->from, snr, rssi, p->id, 0, 0, now, interfaceIndex, false};
+        return;
+    }
+
+    Neighbor &n = neighbors[i];
+
+    // Each node numbers its packets sequentially, so any ids we skipped were (probably) packets we missed
+    PacketId gap = p->id - n.lastId;
+    if (gap == 0)
+        return; // A duplicate, tells us nothing new
+
+    // (the last id we saved before a reboot is too old to count gaps from)
+    if (gap <= MAX_COUNTED_GAP && !isExpired(n, now) && !n.restored) {
+        for (PacketId j = 1; j < gap; j++)
+            addLossSample(n.rxLoss, true);
+        addLossSample(n.rxLoss, false);
+    }
+
+    // Same weights as TCP uses for its smoothed RTT
+    n.snr += (snr - n.snr) / 8;
+    n.rssi += (rssi - n.rssi) / 8;
+    n.lastId = p->id;
+    n.lastHeardMsec = now;
+    n.interfaceIndex = interfaceIndex;
+    n.restored = false;
+}
+
+void NeighborTable::onAck(NodeNum node)
+{
+    int i = indexOf(node);
+    if (i >= 0)
+        addLossSample(neighbors[i].ackLoss, false); // Any earlier tries were already counted by onAckMissed
+}
+
+void NeighborTable::onAckMissed(NodeNum node)
+{
+    int i = indexOf(node);
+    if (i < 0)
+        return;
+
+    if (neighbors[i].restored) {
+        LOG_DEBUG(MESH, "Restored neighbor 0x%x missed an ack, forgetting it\n", node);
+        removeAt(i);
+    } else
+        addLossSample(neighbors[i].ackLoss, true);
+}
+
+void NeighborTable::restore(const Neighbor &n)
+{
+    uint32_t age = n.lastHeardMsec;
+    if (age >= NEIGHBOR_EXPIRE_MSEC || numNeighbors == NEIGHBOR_TABLE_SIZE || indexOf(n.node) >= 0)
+        return;
+
+    Neighbor &r = neighbors[numNeighbors++];
+    r = n;
+    r.lastHeardMsec = millis() - age;
+    r.restored = true;
+}
+
+const Neighbor *NeighborTable::find(NodeNum node) const
+{
+    int i = indexOf(node);
+    return i >= 0 && !isExpired(neighbors[i], millis()) ? &neighbors[i] : NULL;
+}
+
+NodeNum NeighborTable::findByLowByte(uint8_t lowByte) const
+{
+    uint32_t now = millis();
+    NodeNum found = 0;
+    for (size_t i = 0; i < numNeighbors; i++) {
+        if ((neighbors[i].node & 0xff) != lowByte || isExpired(neighbors[i], now))
+            continue;
+
+        if (found)
+            return 0; // Two of our neighbors end in it, we can't tell which one this was
+        found = neighbors[i].node;
+    }
+    return found;
+}
+
+/// While something is interfering with us the SNRs we heard our neighbors with (before it started, and smoothed) overstate our
+/// links, and our neighbors might be hearing it too, so we want this much more margin
+static float getInterferenceMarginDb()
+{
+    return noiseMonitor && noiseMonitor->isInterfered() ? noiseMonitor->getNoiseRiseDb() : 0;
+}
+
+uint8_t NeighborTable::pickSpreadFactor(NodeNum node, uint8_t maxSf) const
+{
+    const Neighbor *n = find(node);
+    if (!n || n->restored)
+        return maxSf;
+
+    float margin = NEIGHBOR_SF_MARGIN_DB + getInterferenceMarginDb();
+    uint8_t sf = NEIGHBOR_MIN_SF;
+    while (sf < maxSf && n->snr - margin < getDemodulationSnr(sf))
+        sf++;
+    return sf;
+}
+
+int8_t NeighborTable::pickTxPower(NodeNum node, int8_t maxPower, uint8_t sf) const
+{
+    const Neighbor *n = find(node);
+    if (!n || n->restored || n->ackLoss > NEIGHBOR_POWER_MAX_ACK_LOSS || maxPower <= NEIGHBOR_MIN_TX_POWER)
+        return maxPower;
+
+    // The SNR they hear us with should go down dB for dB with our power
+    int32_t spare = (int32_t)(n->snr - getDemodulationSnr(sf) - NEIGHBOR_POWER_MARGIN_DB - getInterferenceMarginDb());
+    if (spare <= 0)
+        return maxPower;
+
+    return maxPower - spare > NEIGHBOR_MIN_TX_POWER ? maxPower - spare : NEIGHBOR_MIN_TX_POWER;
+}
+
+int NeighborTable::indexOf(NodeNum node) const
+{
+    for (size_t i = 0; i < numNeighbors; i++)
+        if (neighbors[i].node == node)
+            return i;
+
+    return -1;
+}
+
+void NeighborTable::removeAt(size_t i)
+{
+    neighbors[i] = neighbors[--numNeighbors]; // Order doesn't matter, so just fill the hole with our last record
+}
+
+void NeighborTable::addLossSample(uint16_t &loss, bool lost)
+{
+    int32_t sample = lost ? NEIGHBOR_LOSS_SCALE : 0;
+    loss += (sample - loss) / 8;
+}
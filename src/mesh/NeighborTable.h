@@ -0,0 +1,145 @@
+#pragma once
+
+#include "HopStarts.h"
+#include "MeshTypes.h"
+#include "NetworkCoder.h"
+
+/// Max number of neighbors we keep link statistics for
+#ifndef NEIGHBOR_TABLE_SIZE
+#define NEIGHBOR_TABLE_SIZE 32
+#endif
+
+/// We no longer consider a node to be our neighbor if we haven't heard it directly for this long
+#define NEIGHBOR_EXPIRE_MSEC (15 * 60 * 1000L)
+
+/// Loss rates are fractions scaled to this (i.e. NEIGHBOR_LOSS_SCALE means every packet was lost)
+#define NEIGHBOR_LOSS_SCALE 1000
+
+/// How much better than the demodulation limit of a spreading factor a link's SNR must be before we use it (like LoRaWAN's ADR
+/// margin, this covers fading and the difference between how well we hear them and how well they hear us)
+#ifndef NEIGHBOR_SF_MARGIN_DB
+#define NEIGHBOR_SF_MARGIN_DB 10
+#endif
+
+/// The fastest spreading factor we will pick for a link (every chip we support can do this one with an explicit header)
+#define NEIGHBOR_MIN_SF 7
+
+/// How far above the demodulation limit we want a neighbor to hear our unicasts, when we turn our transmit power down for them
+#ifndef NEIGHBOR_POWER_MARGIN_DB
+#define NEIGHBOR_POWER_MARGIN_DB 12
+#endif
+
+/// The lowest transmit power (in dBm) we turn down to, every chip we support can do this
+#define NEIGHBOR_MIN_TX_POWER 2
+
+/// If more of our reliable sends to a neighbor than this went unacked recently, we talk to them at full power
+#define NEIGHBOR_POWER_MAX_ACK_LOSS (NEIGHBOR_LOSS_SCALE / 10)
+
+/**
+ * What we know about the link to a node we can hear directly
+ */
+struct Neighbor {
+    NodeNum node;
+    float snr;              // Smoothed SNR of packets we heard directly from this node
+    float rssi;             // Smoothed RSSI of packets we heard directly from this node
+    PacketId lastId;        // The id of the last packet we heard directly from this node, for spotting gaps
+    uint16_t rxLoss;        // Smoothed fraction of their packets we missed (from gaps in their packet ids)
+    uint16_t ackLoss;       // Smoothed fraction of our reliable transmissions to them which weren't acked in time
+    uint32_t lastHeardMsec; // When we last heard this node directly
+    uint8_t interfaceIndex; // Which of our radio interfaces we last heard them on
+    bool restored;          // Saved before our last reboot (see LinkStore), and we haven't heard from them since
+};
+
+/**
+ * Link quality statistics for each of our neighbors.
+ *
+ * The radio updates this for every packet it hears directly (see isDirect) and ReliableRouter tells us how our acks went.
+ * Lookups are a linear scan of a small array, which is cheap enough for the routers and the UI to call per packet/frame.
+ *
+ * If we hear more neighbors than we have room for, we replace the one we heard least recently.
+ */
+class NeighborTable
+{
+    Neighbor neighbors[NEIGHBOR_TABLE_SIZE];
+    size_t numNeighbors = 0;
+
+  public:
+    /**
+     * Was this packet (just received by our radio) sent by p->from itself, rather than being relayed?
+     *
+     * Flood rebroadcasts keep the original from, but we only flood broadcasts and each rebroadcast lowers hop_limit, so a
+     * broadcast which still has its starting hop_limit (or any unicast) must have come straight from the sender.  Except the
+     * unicasts we decode from network coded frames, which came through the relay that coded them.
+     */
+    static bool isDirect(const MeshPacket *p)
+    {
+#ifdef LORA_NETWORK_CODING
+        if (p->to != NODENUM_BROADCAST && networkCoder.wasDecoded(p->from, p->id))
+            return false;
+#endif
+        return p->to != NODENUM_BROADCAST || p->hop_limit == hopStarts.get(p->from, p->id);
+    }
+
+    /// One of our radios just received p with the given link metrics, update our stats if it came straight from its sender
+    void onReceive(const MeshPacket *p, float snr, float rssi, uint8_t interfaceIndex);
+
+    /// We got an ack from a neighbor
+    void onAck(NodeNum node);
+
+    /// A reliable send to a neighbor timed out, and we are about to retransmit (or give up)
+    void onAckMissed(NodeNum node);
+
+    /// @return our stats for node, or NULL if we haven't heard it directly recently
+    const Neighbor *find(NodeNum node) const;
+
+    /**
+     * Put back a neighbor we saved before a reboot (n.lastHeardMsec is how long before now we last heard it).  Until we hear
+     * from it again we don't use its stats to turn our spreading factor or power down, and the first ack it misses removes it.
+     * Ignored if we already know node (or have no room).
+     */
+    void restore(const Neighbor &n);
+
+    /// @return the neighbor whose node number ends in lowByte, or 0 if we haven't heard exactly one of those recently
+    NodeNum findByLowByte(uint8_t lowByte) const;
+
+    /**
+     * The fastest spreading factor the link with node should support, from the SNR we hear it with
+     *
+     * @return a spreading factor no slower than maxSf, or maxSf if node isn't our neighbor
+     */
+    uint8_t pickSpreadFactor(NodeNum node, uint8_t maxSf) const;
+
+    /**
+     * The transmit power to send unicasts to node with, so they hear us NEIGHBOR_POWER_MARGIN_DB above the demodulation limit
+     * of spreading factor sf (assuming the link is symmetric).  Radios report SNRs of strong signals as no better than about
+     * +10 dB, so for very strong links we stay louder than we need to be.
+     *
+     * @return a power no higher than maxPower, or maxPower if node isn't our neighbor or has recently missed our packets
+     */
+    int8_t pickTxPower(NodeNum node, int8_t maxPower, uint8_t sf) const;
+
+    /// The lowest SNR a LoRa receiver can demodulate with spreading factor sf
+    static float getDemodulationSnr(uint8_t sf) { return -7.5f - 2.5f * (sf - NEIGHBOR_MIN_SF); }
+
+    /// @return true if we have recently heard node directly
+    bool isNeighbor(NodeNum node) const { return find(node) != NULL; }
+
+    /// The number of nodes we have stats for (which might include some that have expired)
+    size_t getNumNeighbors() const { return numNeighbors; }
+
+    /// For iterating over all of our neighbors, check isExpired yourself
+    const Neighbor &getByIndex(size_t i) const { return neighbors[i]; }
+
+    static bool isExpired(const Neighbor &n, uint32_t now) { return now - n.lastHeardMsec >= NEIGHBOR_EXPIRE_MSEC; }
+
+  private:
+    /// @return the index of our record for node, or -1
+    int indexOf(NodeNum node) const;
+
+    void removeAt(size_t i);
+
+    /// Move a loss estimate towards one more sample
+    static void addLossSample(uint16_t &loss, bool lost);
+};
+
+extern NeighborTable neighbors;
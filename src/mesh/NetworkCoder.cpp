@@ -0,0 +1,168 @@
+#include "NetworkCoder.h"
+
+#ifdef LORA_NETWORK_CODING
+
+#include "NodeDB.h"
+#include "RadioInterface.h"
+#include "configuration.h"
+
+NetworkCoder networkCoder;
+
+static_assert(sizeof(PacketHeader) + sizeof(CodedHeader) + NC_MAX_LEN <= MAX_LORA_FRAME_LEN, "NC_MAX_LEN is too big");
+
+NetworkCoder::NetworkCoder()
+{
+    // id 0 is never a valid packet id, so these entries won't match anything
+    memset(sent, 0, sizeof(sent));
+    memset(received, 0, sizeof(received));
+    memset(coded, 0, sizeof(coded));
+    memset(decoded, 0, sizeof(decoded));
+}
+
+void NetworkCoder::keep(Ciphertext *ring, size_t size, size_t &next, const MeshPacket *p)
+{
+    if (p->which_payload != MeshPacket_encrypted_tag || p->encrypted.size > NC_MAX_LEN)
+        return;
+
+    // Our retransmissions have the same ciphertext, so keep just one copy
+    Ciphertext *c = NULL;
+    for (size_t i = 0; i < size && !c; i++)
+        if (ring[i].id == p->id && ring[i].from == p->from)
+            c = &ring[i];
+    if (!c) {
+        c = &ring[next];
+        next = (next + 1) % size;
+    }
+
+    c->from = p->from;
+    c->id = p->id;
+    c->len = p->encrypted.size;
+    memcpy(c->bytes, p->encrypted.bytes, c->len);
+}
+
+bool NetworkCoder::contains(const Key *ring, size_t size, NodeNum from, PacketId id)
+{
+    for (size_t i = 0; i < size; i++)
+        if (ring[i].id && ring[i].id == id && ring[i].from == from)
+            return true;
+    return false;
+}
+
+void NetworkCoder::onSent(const MeshPacket *p)
+{
+    // Relays only code the reliable single hop sends of DSRRouter
+    if (p->to != NODENUM_BROADCAST && p->want_ack && p->from == nodeDB.getNodeNum())
+        keep(sent, NC_SENT_SIZE, nextSent, p);
+}
+
+void NetworkCoder::onReceived(const MeshPacket *p)
+{
+    if (p->to == nodeDB.getNodeNum() && p->want_ack)
+        keep(received, NC_RECEIVED_SIZE, nextReceived, p);
+}
+
+const uint8_t *NetworkCoder::findSent(NodeNum from, PacketId id, size_t &len) const
+{
+    for (size_t i = 0; i < NC_SENT_SIZE; i++)
+        if (sent[i].id && sent[i].id == id && sent[i].from == from) {
+            len = sent[i].len;
+            return sent[i].bytes;
+        }
+    return NULL;
+}
+
+void NetworkCoder::markDecoded(NodeNum from, PacketId id)
+{
+    decoded[nextDecoded] = {from, id};
+    nextDecoded = (nextDecoded + 1) % NC_DECODED_SIZE;
+    numDecoded++;
+}
+
+MeshPacket *NetworkCoder::offer(const MeshPacket *received, MeshPacket *forward, NodeNum nextHop, uint32_t holdMsec)
+{
+    // Acks piggybacked on the hop to us were for us, and the other side would see them
+    if (received->decoded.which_ack)
+        return forward;
+
+    const Ciphertext *c = NULL;
+    for (size_t i = 0; i < NC_RECEIVED_SIZE && !c; i++)
+        if (this->received[i].id == received->id && this->received[i].from == received->from)
+            c = &this->received[i];
+    if (!c)
+        return forward; // Too long, or we missed it
+
+    Held h = {*c, forward, nextHop, forward->hop_limit, millis() + holdMsec};
+
+    for (size_t i = 0; i < numHeld; i++) {
+        Held &other = held[i];
+        if (other.c.from == nextHop && other.nextHop == received->from && abs(other.c.len - c->len) <= NC_MAX_LEN_DIFF) {
+            MeshPacket *p = code(other, h);
+            if (!p)
+                return forward; // Out of packets, send it the normal way (the other one will time out)
+
+            packetPool.release(other.forward);
+            packetPool.release(forward);
+            other = held[--numHeld];
+            return p;
+        }
+    }
+
+    if (numHeld == NC_MAX_HELD)
+        return forward;
+
+    held[numHeld++] = h;
+    return NULL;
+}
+
+MeshPacket *NetworkCoder::code(const Held &a, const Held &b)
+{
+    MeshPacket *p = packetPool.allocZeroed(0);
+    if (!p)
+        return NULL;
+
+    p->from = a.c.from;
+    p->to = a.nextHop;
+    p->id = a.c.id;
+    p->hop_limit = a.hopLimit;
+    p->which_payload = MeshPacket_encrypted_tag;
+
+    CodedHeader h;
+    h.to = b.nextHop;
+    h.from = b.c.from;
+    h.id = b.c.id;
+    h.flags = b.hopLimit;
+    h.firstLen = a.c.len;
+    h.secondLen = b.c.len;
+
+    uint8_t *payload = p->encrypted.bytes + sizeof(h);
+    size_t len = max(a.c.len, b.c.len);
+    memcpy(p->encrypted.bytes, &h, sizeof(h));
+    for (size_t i = 0; i < len; i++)
+        payload[i] = (i < a.c.len ? a.c.bytes[i] : 0) ^ (i < b.c.len ? b.c.bytes[i] : 0);
+    p->encrypted.size = sizeof(h) + len;
+
+    coded[nextCoded] = {p->from, p->id};
+    nextCoded = (nextCoded + 1) % NC_CODED_SIZE;
+    numCoded++;
+
+    LOG_DEBUG(MESH, "Coding 0x%x->0x%x with 0x%x->0x%x (%u bytes)\n", a.c.from, a.nextHop, b.c.from, b.nextHop, len);
+    return p;
+}
+
+MeshPacket *NetworkCoder::takeExpired(NodeNum &nextHop, int32_t &nextDelay)
+{
+    uint32_t now = millis();
+    for (size_t i = 0; i < numHeld; i++) {
+        int32_t left = held[i].untilMsec - now;
+        if (left <= 0) {
+            MeshPacket *p = held[i].forward;
+            nextHop = held[i].nextHop;
+            held[i] = held[--numHeld];
+            return p;
+        }
+        nextDelay = min(nextDelay, left);
+    }
+    return NULL;
+}
+
+#endif
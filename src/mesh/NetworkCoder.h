@@ -0,0 +1,128 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+#ifdef LORA_NETWORK_CODING
+
+/// The longest ciphertext we will code, so a coded frame (PacketHeader, CodedHeader and payload) always fits
+#define NC_MAX_LEN 224
+
+/// How many of our own recent unicasts we keep the ciphertext of, to decode coded frames with
+#define NC_SENT_SIZE 4
+
+/// How many unicasts sent to us we keep the ciphertext of, in case we forward them in a coded frame
+#define NC_RECEIVED_SIZE 4
+
+/// The most forwards we hold waiting for a partner going the other way
+#define NC_MAX_HELD 4
+
+/// We hold a forward for at most this many short packet times while we wait for its partner
+#define NC_HOLD_PACKET_TIMES 4
+
+/// Partners' ciphertexts must be within this many bytes of each other's length (we pad the shorter one, which costs airtime)
+#define NC_MAX_LEN_DIFF 16
+
+/// How many coded frames we remember sending, and how many packets we remember decoding from them
+#define NC_CODED_SIZE 4
+#define NC_DECODED_SIZE 8
+
+/**
+ * Two way relay network coding.
+ *
+ * When a relay R forwards A's packet to B and B's packet to A, A and B each already have the packet they sent, so R can
+ * send both in one frame: the XOR of their ciphertexts (see CodedHeader).  A XORs out its own packet to get B's, and B does
+ * the same.  For two way conversations over a relay that roughly halves the relay's airtime.
+ *
+ * A relay holds each eligible forward (see offer) for a few packet times, and if the partner going the other way turns up
+ * meanwhile the two go out as one coded frame.  Otherwise the forward goes out normally.  Coded forwards aren't acked (only
+ * their destination can decode them, and its ack would go to the original sender), so they are only as reliable as a
+ * flood rebroadcast.  Their senders still got an ack from the relay, and anything end to end (i.e. want_response) still
+ * retries.
+ *
+ * The packets we decode look like they came straight from the other side, so NeighborTable asks wasDecoded() to tell.
+ *
+ * Note: all nodes in the mesh must be running a build which understands coded frames.
+ */
+class NetworkCoder
+{
+    struct Ciphertext {
+        NodeNum from;
+        PacketId id; // 0 for an unused slot
+        uint8_t len;
+        uint8_t bytes[NC_MAX_LEN];
+    };
+
+    struct Held {
+        Ciphertext c;       // What its original sender sent us
+        MeshPacket *forward; // Our normal forward, which we send if no partner turns up
+        NodeNum nextHop;
+        uint8_t hopLimit;
+        uint32_t untilMsec;
+    };
+
+    struct Key {
+        NodeNum from;
+        PacketId id;
+    };
+
+    Ciphertext sent[NC_SENT_SIZE], received[NC_RECEIVED_SIZE];
+    size_t nextSent = 0, nextReceived = 0;
+
+    Held held[NC_MAX_HELD];
+    size_t numHeld = 0;
+
+    Key coded[NC_CODED_SIZE], decoded[NC_DECODED_SIZE];
+    size_t nextCoded = 0, nextDecoded = 0;
+
+    /// Debugging counts
+    uint32_t numCoded = 0, numDecoded = 0;
+
+  public:
+    NetworkCoder();
+
+    /// Our radio is sending p, keep it if it is a unicast we might need to decode a coded frame with
+    void onSent(const MeshPacket *p);
+
+    /// Our radio received p (still encrypted), keep it if it is a unicast we might forward
+    void onReceived(const MeshPacket *p);
+
+    /**
+     * A relay is about to forward received (which came to us from its previous hop) to nextHop, as forward.  If we can code it
+     * with a held forward going the other way we release both forwards and return the coded packet to send instead.  If it is
+     * eligible we might hold it instead (and return NULL), see takeExpired().  Otherwise we return forward.
+     */
+    MeshPacket *offer(const MeshPacket *received, MeshPacket *forward, NodeNum nextHop, uint32_t holdMsec);
+
+    /**
+     * @return a held forward (and its next hop) which has waited long enough for a partner, or NULL (in which case nextDelay
+     * is reduced to when the next one will be)
+     */
+    MeshPacket *takeExpired(NodeNum &nextHop, int32_t &nextDelay);
+
+    /// Is p a coded packet from offer()
+    bool isCoded(const MeshPacket *p) const { return contains(coded, NC_CODED_SIZE, p->from, p->id); }
+
+    /// @return the ciphertext of a unicast we sent recently (or NULL), sets len
+    const uint8_t *findSent(NodeNum from, PacketId id, size_t &len) const;
+
+    /// We got (from, id) by decoding a coded frame
+    void markDecoded(NodeNum from, PacketId id);
+
+    /// Did we get (from, id) by decoding a coded frame (so it came through a relay)
+    bool wasDecoded(NodeNum from, PacketId id) const { return contains(decoded, NC_DECODED_SIZE, from, id); }
+
+    uint32_t getNumCoded() const { return numCoded; }
+    uint32_t getNumDecoded() const { return numDecoded; }
+
+  private:
+    static void keep(Ciphertext *ring, size_t size, size_t &next, const MeshPacket *p);
+
+    static bool contains(const Key *ring, size_t size, NodeNum from, PacketId id);
+
+    /// Make one packet from the ciphertexts of a (from A, going to B) and b (from B, going to A)
+    MeshPacket *code(const Held &a, const Held &b);
+};
+
+extern NetworkCoder networkCoder;
+
+#endif
@@ -7,9 +7,19 @@
 #include "CryptoEngine.h"
 #include "FSCommon.h"
 #include "GPS.h"
+#include "HopStarts.h"
+#include "HardwareCache.h"
+#include "LinkStore.h"
 #include "MeshRadio.h"
+#include "NeighborTable.h"
+#include "NodeHistory.h"
+#include "concurrency/Periodic.h"
 #include "NodeDB.h"
+#include "NodeInfoCache.h"
+#include "airtime.h"
 #include "PacketHistory.h"
+#include "PacketTrace.h"
+#include "PbFileStream.h"
 #include "PowerFSM.h"
 #include "RTC.h"
 #include "Router.h"
@@ -103,7 +113,18 @@ const char *getChannelName()
     return buf;
 }
 
-NodeDB::NodeDB() : nodes(devicestate.node_db), numNodes(&devicestate.node_db_count) {}
+NodeDB::NodeDB() : nodes(devicestate.node_db), numNodes(&devicestate.node_db_count)
+{
+    static_assert((NODE_INDEX_SIZE & (NODE_INDEX_SIZE - 1)) == 0, "NODE_INDEX_SIZE must be a power of two");
+    static_assert(NODE_INDEX_SIZE >= 2 * MAX_NUM_NODES, "NODE_INDEX_SIZE is too small for MAX_NUM_NODES");
+    static_assert(MAX_NUM_NODES < NODE_INDEX_EMPTY, "node index entries are too small for MAX_NUM_NODES");
+    static_assert(NODEDB_MAX_PINNED + 1 < MAX_NUM_NODES, "NODEDB_MAX_PINNED would leave no nodes we can evict");
+
+    memset(hotHopsAway, NODEDB_HOPS_UNKNOWN, sizeof(hotHopsAway));
+    memset(channelUtils, NODEDB_CHANNEL_UTIL_UNKNOWN, sizeof(channelUtils));
+    memset(txDuties, NODEDB_CHANNEL_UTIL_UNKNOWN, sizeof(txDuties));
+    rebuildIndex();
+}
 
 bool NodeDB::resetRadioConfig()
 {
@@ -116,11 +137,14 @@ bool NodeDB::resetRadioConfig()
                                          0xf0, 0xbc, 0xff, 0xab, 0xcf, 0x4e, 0x69, 0xbf};
 
     if (radioConfig.preferences.factory_reset) {
-        DEBUG_MSG("Performing factory reset!\n");
+        LOG_DEBUG(MESH, "Performing factory reset!\n");
         installDefaultDeviceState();
+        hardwareCache.forget(); // In case the hardware was changed too
+        linkStore.forget();
+        nodeHistory.clear();
         didFactoryReset = true;
     } else if (!channelSettings.psk.size) {
-        DEBUG_MSG("Setting default preferences!\n");
+        LOG_DEBUG(MESH, "Setting default preferences!\n");
 
         radioConfig.has_channel_settings = true;
         radioConfig.has_preferences = true;
@@ -181,7 +205,7 @@ bool NodeDB::resetRadioConfig()
     activePSKSize = channelSettings.psk.size;
     if (activePSKSize == 1) {
         uint8_t pskIndex = activePSK[0];
-        DEBUG_MSG("Expanding short PSK #%d\n", pskIndex);
+        LOG_DEBUG(MESH, "Expanding short PSK #%d\n", pskIndex);
         if (pskIndex == 0)
             activePSKSize = 0; // Turn off encryption
         else {
@@ -199,7 +223,7 @@ bool NodeDB::resetRadioConfig()
     // temp hack for quicker testing
     // devicestate.no_save = true;
     if (devicestate.no_save) {
-        DEBUG_MSG("***** DEVELOPMENT MODE - DO NOT RELEASE *****\n");
+        LOG_DEBUG(MESH, "***** DEVELOPMENT MODE - DO NOT RELEASE *****\n");
 
         // Sleep quite frequently to stress test the BLE comms, broadcast position every 6 mins
         radioConfig.preferences.screen_on_secs = 10;
@@ -228,6 +252,9 @@ void NodeDB::installDefaultDeviceState()
     memset(&devicestate, 0, sizeof(devicestate));
 
     *numNodes = 0; // Forget node DB
+    rebuildIndex();
+    nodeInfoCache.clear();
+    recountOnline();
 
     // init our devicestate with valid flags so protobuf writing/reading will work
     devicestate.has_my_node = true;
@@ -264,13 +291,51 @@ void NodeDB::installDefaultDeviceState()
         strcpy(myNodeInfo.region, oldRegion.c_str());
 }
 
+static int32_t ageOnlineNodesCb()
+{
+    nodeDB.ageOnlineNodes();
+    return ONLINE_BUCKET_SECS * 1000;
+}
+
+static concurrency::Periodic *ageOnlinePeriod;
+
+static int32_t saveNodesCb()
+{
+    nodeDB.saveNodesToDisk();
+    return NODEDB_JOURNAL_SECS * 1000;
+}
+
+static concurrency::Periodic *saveNodesPeriod;
+
+static int32_t saveStateCb()
+{
+    return nodeDB.runSaveScheduler();
+}
+
+static concurrency::Periodic *saveStatePeriod;
+
+static int32_t loadNodesCb()
+{
+    return nodeDB.loadMoreNodes() ? 1 : 0; // Let everyone else run between batches, stop once we are done
+}
+
+static concurrency::Periodic *loadNodesPeriod;
+
 void NodeDB::init()
 {
     installDefaultDeviceState();
 
+#ifdef NODEDB_PINNED_NODES
+    // Before we load any nodes, so a full DB never evicts these to make room
+    static const NodeNum buildPinned[] = {NODEDB_PINNED_NODES};
+    for (size_t i = 0; i < sizeof(buildPinned) / sizeof(buildPinned[0]); i++)
+        setPinned(buildPinned[i]);
+#endif
+
     // saveToDisk();
     loadFromDisk();
     // saveToDisk();
+    linkStore.load(); // So our first unicasts after a reboot don't each need a route discovery
 
     // We set node_num and packet_id _after_ loading from disk, because we always want to use the values this
     // rom was compiled for, not what happens to be in the save file.
@@ -293,12 +358,24 @@ void NodeDB::init()
     info->user = owner;
     info->has_user = true;
 
+    // Let observers know when nodes go offline, even if we aren't hearing any packets
+    ageOnlinePeriod = new concurrency::Periodic("AgeOnline", ageOnlineNodesCb);
+
+    if (loadingNodes)
+        loadNodesPeriod = new concurrency::Periodic("LoadNodes", loadNodesCb);
+
+    saveNodesPeriod = new concurrency::Periodic("SaveNodes", saveNodesCb);
+    saveNodesPeriod->setIntervalFromNow(NODEDB_JOURNAL_SECS * 1000);
+
+    saveStatePeriod = new concurrency::Periodic("SaveState", saveStateCb);
+    saveStatePeriod->setEnabled(false); // Until someone calls requestSave()
+
     // We set these _after_ loading from disk - because they come from the build and are more trusted than
     // what is stored in flash
     if (xstr(HW_VERSION)[0])
         strncpy(myNodeInfo.region, optstr(HW_VERSION), sizeof(myNodeInfo.region));
     else
-        DEBUG_MSG("This build does not specify a HW_VERSION\n"); // Eventually new builds will no longer include this build flag
+        LOG_DEBUG(MESH, "This build does not specify a HW_VERSION\n"); // Eventually new builds will no longer include this build flag
 
     // Check for the old style of region code strings, if found, convert to the new enum.
     // Those strings will look like "1.0-EU433"
@@ -316,7 +393,7 @@ void NodeDB::init()
 
     resetRadioConfig(); // If bogus settings got saved, then fix them
 
-    DEBUG_MSG("legacy_region=%s, region=%d, NODENUM=0x%x, dbsize=%d\n", myNodeInfo.region, radioConfig.preferences.region,
+    LOG_DEBUG(MESH, "legacy_region=%s, region=%d, NODENUM=0x%x, dbsize=%d\n", myNodeInfo.region, radioConfig.preferences.region,
               myNodeInfo.my_node_num, *numNodes);
 }
 
@@ -340,7 +417,7 @@ void NodeDB::pickNewNodeNum()
     NodeInfo *found;
     while ((found = getNode(r)) && memcmp(found->user.macaddr, owner.macaddr, sizeof(owner.macaddr))) {
         NodeNum n = random(NUM_RESERVED, NODENUM_BROADCAST); // try a new random choice
-        DEBUG_MSG("NOTE! Our desired nodenum 0x%x is in use, so trying for 0x%x\n", r, n);
+        LOG_DEBUG(MESH, "NOTE! Our desired nodenum 0x%x is in use, so trying for 0x%x\n", r, n);
         r = n;
     }
 
@@ -349,30 +426,49 @@ void NodeDB::pickNewNodeNum()
 
 const char *preffile = "/db.proto";
 const char *preftmp = "/db.proto.tmp";
+const char *nodefile = "/db.nodes";
+const char *nodetmp = "/db.nodes.tmp";
+const char *journalfile = "/db.journal";
+
+#ifdef FS
+// Our background loader reads nodefile and then journalfile, a few records at a time (see loadMoreNodes)
+static File *loadFile;
+static PbFileReader loadReader;
+static pb_istream_t &loadStream = loadReader.stream;
+static size_t loadFileNum, numLoaded;
+#endif
 
 void NodeDB::loadFromDisk()
 {
 #ifdef FS
     // static DeviceState scratch; We no longer read into a tempbuf because this structure is 15KB of valuable RAM
 
+    bool haveSnapshot = false;
     auto f = FS.open(preffile);
+    if (!f)
+        f = FS.open(preftmp); // We might have lost power while saveToDisk was replacing the old file (the new one is complete)
     if (f) {
-        DEBUG_MSG("Loading saved preferences\n");
-        pb_istream_t stream = {&readcb, &f, DeviceState_size};
+        LOG_DEBUG(MESH, "Loading saved preferences\n");
+        PbFileReader reader;
+        reader.begin(f);
+        pb_istream_t &stream = reader.stream;
 
         // DEBUG_MSG("Preload channel name=%s\n", channelSettings.name);
 
         memset(&devicestate, 0, sizeof(devicestate));
         if (!pb_decode(&stream, DeviceState_fields, &devicestate)) {
-            DEBUG_MSG("Error: can't decode protobuf %s\n", PB_GET_ERROR(&stream));
+            LOG_ERROR(MESH, "Error: can't decode protobuf %s\n", PB_GET_ERROR(&stream));
             installDefaultDeviceState(); // Our in RAM copy might now be corrupt
             // FIXME - report failure to phone
         } else {
             if (devicestate.version < DEVICESTATE_MIN_VER) {
-                DEBUG_MSG("Warn: devicestate is old, discarding\n");
+                LOG_WARN(MESH, "Warn: devicestate is old, discarding\n");
                 installDefaultDeviceState();
             } else {
-                DEBUG_MSG("Loaded saved preferences version %d\n", devicestate.version);
+                LOG_DEBUG(MESH, "Loaded saved preferences version %d\n", devicestate.version);
+                haveSnapshot = true;
+                if (devicestate.version == DEVICESTATE_CUR_VER && !*numNodes)
+                    savedStateHash = hashDeviceState(); // What we have on disk is current, no need to write it again
             }
 
             // DEBUG_MSG("Postload channel name=%s\n", channelSettings.name);
@@ -380,59 +476,346 @@ void NodeDB::loadFromDisk()
 
         f.close();
     } else {
-        DEBUG_MSG("No saved preferences found\n");
+        LOG_DEBUG(MESH, "No saved preferences found\n");
     }
 
+    // Old snapshots kept their nodes in devicestate, our profile might have room for fewer than the protobufs do
+    if (*numNodes > MAX_NUM_NODES)
+        *numNodes = MAX_NUM_NODES;
+
+    rebuildIndex(); // Our node_db was replaced wholesale (and loading our node records needs a valid index)
+
+    // Our node records are read in the background, so the radio and everything else can start without waiting for them.
+    // (Snapshots older than our node file kept their nodes in devicestate, in which case we just loaded them above.)
+    journalSize = 0;
+    if (haveSnapshot) {
+        loadingNodes = true;
+        loadFileNum = numLoaded = 0;
+    } else
+        journalSize = NODEDB_JOURNAL_MAX_SIZE; // Any journal on disk doesn't belong to our state, so write a fresh snapshot first
 #else
-    DEBUG_MSG("ERROR: Filesystem not implemented\n");
+    LOG_ERROR(MESH, "ERROR: Filesystem not implemented\n");
+#endif
+
+    recountOnline();
+    memset(nodeDirty, 0, sizeof(nodeDirty)); // Everything in RAM now matches what is on disk
+    memset(nodeGenerations, 0, sizeof(nodeGenerations));
+    nodeInfoCache.clear(); // Its generations no longer mean the same nodes
+    memset(keyframes, 0, sizeof(keyframes));
+    memset(hotHopsAway, NODEDB_HOPS_UNKNOWN, sizeof(hotHopsAway)); // We only learn these from packets we hear
+    memset(channelUtils, NODEDB_CHANNEL_UTIL_UNKNOWN, sizeof(channelUtils));
+    memset(txDuties, NODEDB_CHANNEL_UTIL_UNKNOWN, sizeof(txDuties));
+}
+
+bool NodeDB::loadMoreNodes()
+{
+    if (!loadingNodes)
+        return false;
+
+#ifdef FS
+    for (size_t i = 0; i < NODEDB_LOAD_BATCH;) {
+        if (!loadFile) {
+            if (loadFileNum > 1) {
+                finishLoading();
+                return false;
+            }
+
+            const char *name = loadFileNum++ ? journalfile : nodefile;
+            auto f = FS.open(name);
+            if (!f && name == nodefile)
+                f = FS.open(nodetmp); // Like preftmp, saveToDisk might have been replacing the old file
+            if (name == journalfile && journalSize < NODEDB_JOURNAL_MAX_SIZE)
+                journalSize = f ? f.size() : 0;
+            if (!f)
+                continue;
+
+            loadFile = new File(f);
+            loadReader.begin(*loadFile);
+        }
+
+        NodeInfo r;
+        if (loadStream.bytes_left && pb_decode_delimited(&loadStream, NodeInfo_fields, &r)) {
+            loadNodeRecord(r);
+            numLoaded++;
+            i++;
+        } else {
+            if (loadStream.bytes_left) {
+                // Probably we lost power part way through writing, anything we append after this would be unreadable so
+                // make sure a new snapshot gets written before the next append
+                LOG_WARN(MESH, "Warning: discarding damaged node records %s\n", PB_GET_ERROR(&loadStream));
+                journalSize = NODEDB_JOURNAL_MAX_SIZE;
+            }
+
+            loadFile->close();
+            delete loadFile;
+            loadFile = NULL;
+        }
+    }
+#endif
+
+    return true;
+}
+
+void NodeDB::loadNodeRecord(const NodeInfo &r)
+{
+    NodeInfo *n = getNode(r.num);
+    if (n && nodeDirty[n - nodes]) {
+        // We have heard from this node since boot, so what we have is newer.  Only fill in what we haven't heard yet.
+        if (!n->has_user && r.has_user) {
+            n->user = r.user;
+            n->has_user = true;
+        }
+        if (!n->position.latitude_i && !n->position.longitude_i && r.has_position) {
+            n->position.latitude_i = r.position.latitude_i;
+            n->position.longitude_i = r.position.longitude_i;
+            n->position.altitude = r.position.altitude;
+            n->has_position = true;
+            syncGrid(n - nodes);
+        }
+        markChanged(n - nodes);
+        return;
+    }
+
+    bool isNew = !n;
+    n = getOrCreateNode(r.num); // Might evict someone, our records are in the order nodes were heard from
+    uint8_t hops = hotHopsAway[n - nodes];
+    *n = r;
+    syncHot(n - nodes);
+    syncGrid(n - nodes);
+    hotHopsAway[n - nodes] = hops;
+    updateLastSeen(n);
+    nodeDirty[n - nodes] = false; // Unlike a node we just heard, this already matches what is on disk
+    if (isNew)
+        nodeGenerations[n - nodes] = 0; // Nor is it a change our phone needs to hear about
+}
+
+void NodeDB::finishLoading()
+{
+    loadingNodes = false;
+    LOG_DEBUG(MESH, "Loaded %u node records, %u nodes in our DB\n", numLoaded, *numNodes);
+
+    updateGUI = true;
+    notifyObservers(); // Our node counts have probably changed
+}
+
+/// Append any changed nodes to our journal, or write a full snapshot if the journal has grown too large
+void NodeDB::saveNodesToDisk()
+{
+    ensureLoaded(); // Our journal is read before we append to it
+
+    if (!devicestate.no_save)
+        linkStore.saveIfDue();
+
+    bool anyDirty = false;
+    for (size_t x = 0; x < *numNodes; x++)
+        anyDirty |= nodeDirty[x];
+
+    if (!anyDirty)
+        return;
+
+    if (journalSize >= NODEDB_JOURNAL_MAX_SIZE) {
+        LOG_DEBUG(MESH, "Compacting node journal\n");
+        saveToDisk();
+        return;
+    }
+
+#ifdef FS
+    if (!devicestate.no_save) {
+        auto f = FS.open(journalfile, FILE_O_APPEND);
+        if (f) {
+            PbFileWriter writer(f);
+            pb_ostream_t &stream = writer.stream;
+
+            size_t numRecords = 0;
+            for (size_t x = 0; x < *numNodes; x++)
+                if (nodeDirty[x]) {
+                    if (!pb_encode_delimited(&stream, NodeInfo_fields, &nodes[x])) {
+                        LOG_ERROR(MESH, "Error: can't write node journal %s\n", PB_GET_ERROR(&stream));
+                        journalSize = NODEDB_JOURNAL_MAX_SIZE; // Our journal might now have a partial record, start over
+                        break;
+                    }
+                    nodeDirty[x] = false;
+                    numRecords++;
+                }
+
+            if (!writer.flush()) {
+                LOG_ERROR(MESH, "Error: can't write node journal\n");
+                journalSize = NODEDB_JOURNAL_MAX_SIZE;
+            }
+            f.close();
+            if (journalSize < NODEDB_JOURNAL_MAX_SIZE)
+                journalSize += stream.bytes_written;
+            LOG_DEBUG(MESH, "Journaled %u nodes (journal is %u bytes)\n", numRecords, journalSize);
+        } else {
+            LOG_ERROR(MESH, "ERROR: can't write node journal\n");
+        }
+    }
 #endif
 }
 
+#ifdef FS
+/// Write all our nodes as delimited NodeInfo records, the same format as our journal
+static bool writeNodeFile(const char *filename, const NodeInfo *nodes, size_t numNodes)
+{
+    FS.remove(filename); // In case a previous attempt left a partial file behind
+    auto f = FS.open(filename, FILE_O_WRITE);
+    if (!f) {
+        LOG_ERROR(MESH, "ERROR: can't write node file\n");
+        return false;
+    }
+
+    PbFileWriter writer(f);
+    bool okay = true;
+    for (size_t x = 0; okay && x < numNodes; x++)
+        if (!pb_encode_delimited(&writer.stream, NodeInfo_fields, &nodes[x])) {
+            LOG_ERROR(MESH, "Error: can't write node file %s\n", PB_GET_ERROR(&writer.stream));
+            okay = false;
+        }
+    if (okay && !writer.flush()) {
+        LOG_ERROR(MESH, "Error: can't write node file\n");
+        okay = false;
+    }
+
+    f.close();
+    return okay;
+}
+#endif
+
+void NodeDB::requestSave()
+{
+    uint32_t now = millis();
+    if (!saveRequestMsec)
+        saveRequestMsec = now ? now : 1;
+
+    if (!saveStatePeriod) {
+        saveIfChanged(); // Before init, we don't have our timer yet
+        return;
+    }
+
+    // Each request restarts our quiet period, but not past our deadline
+    uint32_t waited = now - saveRequestMsec;
+    uint32_t wait = waited >= NODEDB_SAVE_MAX_MSEC ? 0 : min((uint32_t)NODEDB_SAVE_QUIET_MSEC, NODEDB_SAVE_MAX_MSEC - waited);
+    saveStatePeriod->setIntervalFromNow(wait);
+    saveStatePeriod->setEnabled(true);
+}
+
+int32_t NodeDB::runSaveScheduler()
+{
+    if (saveRequestMsec)
+        saveIfChanged();
+    return 0; // Until the next requestSave()
+}
+
+static bool hashcb(pb_ostream_t *stream, const uint8_t *buf, size_t count)
+{
+    uint32_t *hash = (uint32_t *)stream->state;
+    for (size_t i = 0; i < count; i++)
+        *hash = (*hash ^ buf[i]) * 16777619u; // FNV-1a
+    return true;
+}
+
+uint32_t NodeDB::hashDeviceState()
+{
+    uint32_t hash = 2166136261u;
+    pb_ostream_t stream = {&hashcb, &hash, SIZE_MAX, 0};
+
+    // The same encoding saveToDisk writes
+    devicestate.version = DEVICESTATE_CUR_VER;
+    pb_size_t savedNumNodes = *numNodes;
+    *numNodes = 0;
+    pb_encode(&stream, DeviceState_fields, &devicestate);
+    *numNodes = savedNumNodes;
+
+    return hash ? hash : 1; // 0 means we haven't saved
+}
+
+void NodeDB::saveIfChanged()
+{
+    saveRequestMsec = 0;
+
+    if (!devicestate.no_save)
+        linkStore.save(); // We are probably about to reboot or sleep, so make sure our routes survive it
+
+    if (hashDeviceState() != savedStateHash)
+        saveToDisk();
+    else {
+        LOG_DEBUG(MESH, "Device state unchanged, not saving it\n");
+        saveNodesToDisk(); // Which does nothing if our nodes haven't changed either
+    }
+}
+
 void NodeDB::saveToDisk()
 {
 #ifdef FS
     if (!devicestate.no_save) {
+        ensureLoaded(); // Otherwise our new snapshot would be missing the nodes we haven't read yet
+
+        if (!writeNodeFile(nodetmp, nodes, *numNodes))
+            return;
+
+        FS.remove(preftmp); // In case a previous attempt left a partial file behind
         auto f = FS.open(preftmp, FILE_O_WRITE);
         if (f) {
-            DEBUG_MSG("Writing preferences\n");
+            LOG_DEBUG(MESH, "Writing preferences\n");
 
-            pb_ostream_t stream = {&writecb, &f, SIZE_MAX, 0};
+            PbFileWriter writer(f);
+            pb_ostream_t &stream = writer.stream;
 
             // DEBUG_MSG("Presave channel name=%s\n", channelSettings.name);
 
+            // Our nodes are in nodetmp, so leave them out of devicestate (which we then decode in one go at boot).  Only the main
+            // thread looks at our nodes, so nobody sees them missing meanwhile.
             devicestate.version = DEVICESTATE_CUR_VER;
-            if (!pb_encode(&stream, DeviceState_fields, &devicestate)) {
-                DEBUG_MSG("Error: can't write protobuf %s\n", PB_GET_ERROR(&stream));
+            pb_size_t savedNumNodes = *numNodes;
+            *numNodes = 0;
+            bool okay = pb_encode(&stream, DeviceState_fields, &devicestate) && writer.flush();
+            *numNodes = savedNumNodes;
+
+            if (!okay) {
+                LOG_ERROR(MESH, "Error: can't write protobuf %s\n", PB_GET_ERROR(&stream));
                 // FIXME - report failure to phone
 
                 f.close();
             } else {
-                // Success - replace the old file
+                // Success - replace the old files
                 f.close();
 
+                // Our new snapshot includes everything in the journal, discard it _before_ we remove the old snapshot
+                // (if we lose power after this point loadFromDisk will use the tmp files)
+                FS.remove(journalfile);
+                journalSize = 0;
+                memset(nodeDirty, 0, sizeof(nodeDirty));
+                savedStateHash = hashDeviceState();
+
                 // brief window of risk here ;-)
+                FS.remove(nodefile); // Not there if our last snapshot was before we had node files
+                if (!FS.rename(nodetmp, nodefile))
+                    LOG_ERROR(MESH, "Error: can't rename new node file\n");
                 if (!FS.remove(preffile))
-                    DEBUG_MSG("Warning: Can't remove old pref file\n");
+                    LOG_WARN(MESH, "Warning: Can't remove old pref file\n");
                 if (!FS.rename(preftmp, preffile))
-                    DEBUG_MSG("Error: can't rename new pref file\n");
+                    LOG_ERROR(MESH, "Error: can't rename new pref file\n");
             }
         } else {
-            DEBUG_MSG("ERROR: can't write prefs\n"); // FIXME report to app
+            LOG_ERROR(MESH, "ERROR: can't write prefs\n"); // FIXME report to app
         }
     } else {
-        DEBUG_MSG("***** DEVELOPMENT MODE - DO NOT RELEASE - not saving to flash *****\n");
+        LOG_DEBUG(MESH, "***** DEVELOPMENT MODE - DO NOT RELEASE - not saving to flash *****\n");
     }
 #else
-    DEBUG_MSG("ERROR filesystem not implemented\n");
+    LOG_ERROR(MESH, "ERROR filesystem not implemented\n");
 #endif
 }
 
-const NodeInfo *NodeDB::readNextInfo()
+const NodeInfo *NodeDB::readNextInfo(uint32_t sinceGeneration)
 {
-    if (readPointer < *numNodes)
-        return &nodes[readPointer++];
-    else
-        return NULL;
+    while (readPointer < *numNodes) {
+        size_t x = readPointer++;
+        if (!sinceGeneration || nodeGenerations[x] > sinceGeneration)
+            return &nodes[x];
+    }
+
+    return NULL;
 }
 
 /// Given a node, return how many seconds in the past (vs now) that we last heard from it
@@ -448,49 +831,148 @@ uint32_t sinceLastSeen(const NodeInfo *n)
     return delta;
 }
 
-#define NUM_ONLINE_SECS (60 * 2) // 2 hrs to consider someone offline
-
 size_t NodeDB::getNumOnlineNodes()
 {
-    size_t numseen = 0;
+    advanceOnlineEpoch();
+    return numOnline;
+}
+
+/// Call this after changing info->position.time directly, so our online node count stays accurate
+void NodeDB::updateLastSeen(const NodeInfo *info)
+{
+    size_t x = info - nodes;
+    assert(x < *numNodes);
+
+    markChanged(x);
+    hotLastHeard[x] = info->position.time;
+    advanceOnlineEpoch();
+
+    uint32_t &e = onlineEpochs[x];
+    if (isOnlineEpoch(e)) {
+        onlineBucketCounts[e % ONLINE_BUCKETS]--;
+        numOnline--;
+    }
+    e = ONLINE_NOT_COUNTED;
+
+    countOnline(x);
+}
+
+/// Age our online node count, notifying observers if anyone has gone offline.  Called periodically.
+void NodeDB::ageOnlineNodes()
+{
+    size_t oldNumOnline = numOnline;
+
+    advanceOnlineEpoch();
+    if (numOnline != oldNumOnline)
+        notifyObservers();
+}
+
+/// Move onlineEpoch up to the current time, dropping the counts for any buckets which have aged out
+void NodeDB::advanceOnlineEpoch()
+{
+    uint32_t now = getTime() / ONLINE_BUCKET_SECS;
+
+    if (now == onlineEpoch)
+        return;
+
+    if (now < onlineEpoch || now - onlineEpoch >= ONLINE_BUCKETS) {
+        // Our clock was just set (or it has been a long time), the cheapest thing is to start over
+        onlineEpoch = now;
+        recountOnline();
+        return;
+    }
+
+    while (onlineEpoch != now) {
+        onlineEpoch++;
+
+        // The bucket for onlineEpoch - ONLINE_BUCKETS has just aged out
+        uint8_t &count = onlineBucketCounts[onlineEpoch % ONLINE_BUCKETS];
+        numOnline -= count;
+        count = 0;
+    }
+}
+
+/// Add nodes[x] to our online count (if it has been heard from recently), it must not currently be counted
+void NodeDB::countOnline(size_t x)
+{
+    uint32_t e = hotLastHeard[x] / ONLINE_BUCKET_SECS;
+    if (e > onlineEpoch) // our clock must be slightly off still - not set from GPS yet
+        e = onlineEpoch;
+
+    if (onlineEpoch - e < ONLINE_BUCKETS) {
+        onlineEpochs[x] = e;
+        onlineBucketCounts[e % ONLINE_BUCKETS]++;
+        numOnline++;
+    } else
+        onlineEpochs[x] = ONLINE_NOT_COUNTED;
+}
 
-    // FIXME this implementation is kinda expensive
-    for (int i = 0; i < *numNodes; i++)
-        if (sinceLastSeen(&nodes[i]) < NUM_ONLINE_SECS)
-            numseen++;
+/// Regenerate our online counts from scratch
+void NodeDB::recountOnline()
+{
+    onlineEpoch = getTime() / ONLINE_BUCKET_SECS;
+    memset(onlineBucketCounts, 0, sizeof(onlineBucketCounts));
+    numOnline = 0;
 
-    return numseen;
+    for (size_t x = 0; x < *numNodes; x++)
+        countOnline(x);
 }
 
 #include "MeshPlugin.h"
 
 /** Update position info for this node based on received position data
  */
-void NodeDB::updatePosition(uint32_t nodeId, const Position &p)
+void NodeDB::updatePosition(uint32_t nodeId, const Position &p, PacketId keyframeId)
 {
     NodeInfo *info = getOrCreateNode(nodeId);
 
-    DEBUG_MSG("DB update position node=0x%x time=%u, latI=%d, lonI=%d\n", nodeId, p.time, p.latitude_i, p.longitude_i);
+    LOG_DEBUG(MESH, "DB update position node=0x%x time=%u, latI=%d, lonI=%d\n", nodeId, p.time, p.latitude_i, p.longitude_i);
+
+    if (keyframeId)
+        keyframes[info - nodes] = {keyframeId, p.latitude_i, p.longitude_i, p.altitude, p.time};
 
     info->position = p;
     info->has_position = true;
+    nodeHistory.onPosition(nodeId, getValidTime(RTCQualityFromNet), p.latitude_i, p.longitude_i);
+    syncGrid(info - nodes);
+    updateLastSeen(info);
     updateGUIforNode = info;
     notifyObservers(true); // Force an update whether or not our node counts have changed
 }
 
+bool NodeDB::updatePositionDelta(uint32_t nodeId, const PositionDelta &d)
+{
+    NodeInfo *info = getNode(nodeId);
+    if (!info || keyframes[info - nodes].id != d.keyframeId) {
+        LOG_DEBUG(MESH, "Ignoring position delta from 0x%x, we don't have its base 0x%x\n", nodeId, d.keyframeId);
+        return false;
+    }
+
+    const PositionKeyframe &k = keyframes[info - nodes];
+    Position p = Position_init_default;
+    p.latitude_i = k.latitude_i + d.latitude_i;
+    p.longitude_i = k.longitude_i + d.longitude_i;
+    p.altitude = k.altitude + d.altitude;
+    p.time = k.time ? k.time + d.time : 0; // If they didn't know the time then, they don't now either
+    p.battery_level = d.battery_level;
+
+    updatePosition(nodeId, p);
+    return true;
+}
+
 /** Update user info for this node based on received user data
  */
 void NodeDB::updateUser(uint32_t nodeId, const User &p)
 {
     NodeInfo *info = getOrCreateNode(nodeId);
 
-    DEBUG_MSG("old user %s/%s/%s\n", info->user.id, info->user.long_name, info->user.short_name);
+    LOG_DEBUG(MESH, "old user %s/%s/%s\n", info->user.id, info->user.long_name, info->user.short_name);
 
     bool changed = memcmp(&info->user, &p,
                           sizeof(info->user)); // Both of these blocks start as filled with zero so I think this is okay
 
     info->user = p;
-    DEBUG_MSG("updating changed=%d user %s/%s/%s\n", changed, info->user.id, info->user.long_name, info->user.short_name);
+    LOG_DEBUG(MESH, "updating changed=%d user %s/%s/%s\n", changed, info->user.id, info->user.long_name, info->user.short_name);
     info->has_user = true;
 
     if (changed) {
@@ -504,39 +986,149 @@ void NodeDB::updateUser(uint32_t nodeId, const User &p)
     }
 }
 
+void NodeDB::updateBattery(uint32_t nodeId, int32_t batteryLevel)
+{
+    NodeInfo *info = getOrCreateNode(nodeId);
+    if (info->position.battery_level == batteryLevel)
+        return;
+
+    info->position.battery_level = batteryLevel;
+    markChanged(info - nodes);
+    updateGUIforNode = info;
+}
+
+void NodeDB::updateChannelUtil(uint32_t nodeId, uint8_t percent)
+{
+    NodeInfo *info = getOrCreateNode(nodeId);
+    channelUtils[info - nodes] = percent;
+}
+
+uint8_t NodeDB::getChannelUtil(NodeNum n)
+{
+    const NodeInfo *info = getNode(n);
+    return info ? channelUtils[info - nodes] : NODEDB_CHANNEL_UTIL_UNKNOWN;
+}
+
+void NodeDB::updateTxDuty(uint32_t nodeId, uint8_t percent)
+{
+    NodeInfo *info = getOrCreateNode(nodeId);
+    txDuties[info - nodes] = percent;
+}
+
+uint8_t NodeDB::getNeighborhoodUtil()
+{
+    uint32_t util = channelUtilizationPercent(UTIL_10_MINUTES) + 0.5f;
+    uint32_t sumTxDuty = txDutyPercent() + 0.5f;
+
+    // Neighbors beacon every (stretched) position_broadcast_secs, we forget those we haven't heard from in a few of those
+    uint32_t now = getTime();
+    uint32_t maxAgeSecs = 3 * CONGESTION_MAX_STRETCH * getPref_position_broadcast_secs();
+    for (size_t x = 0; x < *numNodes; x++) {
+        if (hotHopsAway[x] != 0 || hotNums[x] == getNodeNum() || now - hotLastHeard[x] > maxAgeSecs)
+            continue;
+
+        if (channelUtils[x] != NODEDB_CHANNEL_UTIL_UNKNOWN)
+            util = max(util, (uint32_t)channelUtils[x]);
+        if (txDuties[x] != NODEDB_CHANNEL_UTIL_UNKNOWN)
+            sumTxDuty += txDuties[x];
+    }
+
+    return min(max(util, sumTxDuty), (uint32_t)100);
+}
+
+uint32_t NodeDB::stretchForCongestion(uint32_t msec)
+{
+    uint32_t util = getNeighborhoodUtil();
+    if (util <= CONGESTION_LOW_PERCENT)
+        return msec;
+
+    uint32_t over = min(util, (uint32_t)CONGESTION_HIGH_PERCENT) - CONGESTION_LOW_PERCENT;
+    float stretch = 1 + (CONGESTION_MAX_STRETCH - 1) * (float)over / (CONGESTION_HIGH_PERCENT - CONGESTION_LOW_PERCENT);
+    return msec * stretch;
+}
+
+size_t NodeDB::findNearest(int32_t lat, int32_t lon, NodeDistance *out, size_t maxOut)
+{
+    const NodeInfo *us = getNode(getNodeNum());
+    return grid.findNearest(lat, lon, out, maxOut, us ? us - nodes : NODE_GRID_NONE);
+}
+
+size_t NodeDB::findInRadius(int32_t lat, int32_t lon, float meters, NodeDistance *out, size_t maxOut)
+{
+    const NodeInfo *us = getNode(getNodeNum());
+    return grid.findInRadius(lat, lon, meters, out, maxOut, us ? us - nodes : NODE_GRID_NONE);
+}
+
 /// given a subpacket sniffed from the network, update our DB state
 /// we updateGUI and updateGUIforNode if we think our this change is big enough for a redraw
+uint8_t NodeDB::getHopsAway(NodeNum n)
+{
+    const NodeInfo *info = getNode(n);
+    return info ? hotHopsAway[info - nodes] : NODEDB_HOPS_UNKNOWN;
+}
+
+void NodeDB::updateHeard(const MeshPacket &mp)
+{
+    NodeInfo *info = getNode(mp.from);
+    if (!info || !mp.rx_time)
+        return;
+
+    size_t x = info - nodes;
+    if (hotLastHeard[x] && mp.rx_time >= hotLastHeard[x] && mp.rx_time - hotLastHeard[x] < NODEDB_HEARD_COALESCE_SECS)
+        return; // We heard them recently enough
+
+    info->has_position = true;
+    info->position.time = mp.rx_time;
+    updateLastSeen(info);
+
+    const Neighbor *n = neighbors.find(mp.from);
+    info->snr = n ? n->snr : mp.rx_snr;
+    updateSnr(info);
+    nodeHistory.onHeard(mp.from, mp.rx_time, info->snr);
+
+    hotHopsAway[x] = hopStarts.getHopsTaken(&mp);
+}
+
 void NodeDB::updateFrom(const MeshPacket &mp)
 {
     if (mp.which_payload == MeshPacket_decoded_tag) {
         const SubPacket &p = mp.decoded;
-        DEBUG_MSG("Update DB node 0x%x, rx_time=%u\n", mp.from, mp.rx_time);
+        LOG_DEBUG(MESH, "Update DB node 0x%x, rx_time=%u\n", mp.from, mp.rx_time);
 
         NodeInfo *info = getOrCreateNode(mp.from);
 
         if (mp.rx_time) {              // if the packet has a valid timestamp use it to update our last_seen
             info->has_position = true; // at least the time is valid
             info->position.time = mp.rx_time;
+            updateLastSeen(info);
         }
 
-        info->snr = mp.rx_snr; // keep the most recent SNR we received for this node.
+        // For our neighbors use the smoothed SNR of the link, otherwise keep the most recent SNR we received for this node
+        const Neighbor *n = neighbors.find(mp.from);
+        info->snr = n ? n->snr : mp.rx_snr;
+        updateSnr(info);
+        nodeHistory.onHeard(mp.from, mp.rx_time, info->snr);
+
+        hotHopsAway[info - nodes] = hopStarts.getHopsTaken(&mp);
 
         switch (p.which_payload) {
         case SubPacket_position_tag: {
             // handle a legacy position packet
-            DEBUG_MSG("WARNING: Processing a (deprecated) position packet from %d\n", mp.from);
+            LOG_WARN(MESH, "WARNING: Processing a (deprecated) position packet from %d\n", mp.from);
             updatePosition(mp.from, p.position);
             break;
         }
 
         case SubPacket_data_tag: {
-            if (mp.to == NODENUM_BROADCAST || mp.to == nodeDB.getNodeNum())
+            if (mp.to == NODENUM_BROADCAST || mp.to == nodeDB.getNodeNum()) {
                 MeshPlugin::callPlugins(mp);
+                packetTrace.mark(&mp, TRACE_RX_PLUGINS);
+            }
             break;
         }
 
         case SubPacket_user_tag: {
-            DEBUG_MSG("WARNING: Processing a (deprecated) user packet from %d\n", mp.from);
+            LOG_WARN(MESH, "WARNING: Processing a (deprecated) user packet from %d\n", mp.from);
             updateUser(mp.from, p.user);
             break;
         }
@@ -549,38 +1141,167 @@ void NodeDB::updateFrom(const MeshPacket &mp)
 }
 
 /// Find a node in our DB, return null for missing
-/// NOTE: This function might be called from an ISR
+/// NOTE: Like the rest of NodeDB this is only safe on the main thread (other tasks use runOnMainThread), removeNode() shifts
+/// nodes[] and rebuilds nodeIndex in place
 NodeInfo *NodeDB::getNode(NodeNum n)
 {
-    for (int i = 0; i < *numNodes; i++)
-        if (nodes[i].num == n)
-            return &nodes[i];
+    for (size_t i = indexSlot(n), probes = 0; probes < NODE_INDEX_SIZE; i = (i + 1) & (NODE_INDEX_SIZE - 1), probes++) {
+        uint8_t x = nodeIndex[i];
+        if (x == NODE_INDEX_EMPTY)
+            break; // End of the chain, so this node can't be in the DB
+
+        if (x < *numNodes && hotNums[x] == n)
+            return &nodes[x];
+    }
 
     return NULL;
 }
 
+/// Regenerate nodeIndex from the current contents of nodes[]
+void NodeDB::rebuildIndex()
+{
+    memset(nodeIndex, NODE_INDEX_EMPTY, sizeof(nodeIndex));
+    grid.clear();
+
+    for (size_t x = 0; x < *numNodes; x++) {
+        syncHot(x);
+        addToIndex(x);
+        syncGrid(x);
+    }
+}
+
+/// Add nodes[x] to nodeIndex
+void NodeDB::addToIndex(size_t x)
+{
+    size_t i = indexSlot(hotNums[x]);
+    while (nodeIndex[i] != NODE_INDEX_EMPTY)
+        i = (i + 1) & (NODE_INDEX_SIZE - 1); // We are never more than half full, so this always terminates quickly
+
+    nodeIndex[i] = x;
+}
+
+void NodeDB::syncGrid(size_t x)
+{
+    const Position &p = nodes[x].position;
+    if (nodes[x].has_position && (p.latitude_i || p.longitude_i)) // Some positions only have a time
+        grid.set(x, p.latitude_i, p.longitude_i);
+    else
+        grid.remove(x);
+}
+
 /// Find a node in our DB, create an empty NodeInfo if missing
 NodeInfo *NodeDB::getOrCreateNode(NodeNum n)
 {
     NodeInfo *info = getNode(n);
+    if (info)
+        markChanged(info - nodes); // Our callers only use this when they are about to change the node
 
     if (!info) {
         // add the node
-        assert(*numNodes < MAX_NUM_NODES);
+        if (*numNodes >= MAX_NUM_NODES)
+            evictNode();
+
         info = &nodes[(*numNodes)++];
 
         // everything is missing except the nodenum
         memset(info, 0, sizeof(*info));
         info->num = n;
+        syncHot(info - nodes);
+        hotHopsAway[info - nodes] = NODEDB_HOPS_UNKNOWN;
+
+        addToIndex(info - nodes);
+
+        onlineEpochs[info - nodes] = ONLINE_NOT_COUNTED;
+        keyframes[info - nodes].id = 0;
+        channelUtils[info - nodes] = NODEDB_CHANNEL_UTIL_UNKNOWN;
+        txDuties[info - nodes] = NODEDB_CHANNEL_UTIL_UNKNOWN;
+        grid.remove(info - nodes);
+        updateLastSeen(info); // Also marks the node as dirty
     }
 
     return info;
 }
 
+/// Make room for a new node by discarding the least recently heard node (which isn't us or pinned)
+void NodeDB::evictNode()
+{
+    int victim = -1;
+    for (size_t x = 0; x < *numNodes; x++) {
+        if (hotNums[x] == getNodeNum() || isPinned(hotNums[x]))
+            continue;
+
+        if (victim < 0 || hotLastHeard[x] < hotLastHeard[victim])
+            victim = x;
+    }
+
+    assert(victim >= 0); // We never allow enough pins to fill our DB
+    LOG_WARN(MESH, "Node DB full, evicting node 0x%x (last seen %u)\n", hotNums[victim], hotLastHeard[victim]);
+    removeNode(victim);
+}
+
+/// Delete nodes[x], shifting the following nodes down so nodes[] stays compact
+void NodeDB::removeNode(size_t x)
+{
+    assert(x < *numNodes);
+
+    if (isOnlineEpoch(onlineEpochs[x])) {
+        onlineBucketCounts[onlineEpochs[x] % ONLINE_BUCKETS]--;
+        numOnline--;
+    }
+
+    size_t numAfter = *numNodes - x - 1;
+    memmove(&nodes[x], &nodes[x + 1], numAfter * sizeof(nodes[0]));
+    memmove(&onlineEpochs[x], &onlineEpochs[x + 1], numAfter * sizeof(onlineEpochs[0]));
+    memmove(&nodeDirty[x], &nodeDirty[x + 1], numAfter * sizeof(nodeDirty[0]));
+    memmove(&nodeGenerations[x], &nodeGenerations[x + 1], numAfter * sizeof(nodeGenerations[0]));
+    memmove(&keyframes[x], &keyframes[x + 1], numAfter * sizeof(keyframes[0]));
+    memmove(&channelUtils[x], &channelUtils[x + 1], numAfter * sizeof(channelUtils[0]));
+    memmove(&txDuties[x], &txDuties[x + 1], numAfter * sizeof(txDuties[0]));
+    memmove(&hotHopsAway[x], &hotHopsAway[x + 1], numAfter * sizeof(hotHopsAway[0]));
+    (*numNodes)--;
+
+    rebuildIndex();
+
+    // Fixup anyone who was pointing into our array
+    if (readPointer > x)
+        readPointer--;
+    if (updateGUIforNode == &nodes[x])
+        updateGUIforNode = NULL;
+    else if (updateGUIforNode > &nodes[x])
+        updateGUIforNode--;
+}
+
+/// Never evict this node from our DB (i.e. one listed in NODEDB_PINNED_NODES)
+void NodeDB::setPinned(NodeNum n, bool pinned)
+{
+    for (size_t i = 0; i < numPinned; i++)
+        if (pinnedNodes[i] == n) {
+            if (!pinned)
+                pinnedNodes[i] = pinnedNodes[--numPinned];
+            return;
+        }
+
+    if (pinned) {
+        if (numPinned < NODEDB_MAX_PINNED)
+            pinnedNodes[numPinned++] = n;
+        else
+            LOG_WARN(MESH, "Warning: can't pin node 0x%x, too many pinned nodes\n", n);
+    }
+}
+
+bool NodeDB::isPinned(NodeNum n)
+{
+    for (size_t i = 0; i < numPinned; i++)
+        if (pinnedNodes[i] == n)
+            return true;
+
+    return false;
+}
+
 /// Record an error that should be reported via analytics
 void recordCriticalError(CriticalErrorCode code, uint32_t address)
 {
-    DEBUG_MSG("NOTE! Recording critical error %d, address=%x\n", code, address);
+    LOG_ERROR(MESH, "NOTE! Recording critical error %d, address=%x\n", code, address);
     myNodeInfo.error_code = code;
     myNodeInfo.error_address = address;
     myNodeInfo.error_count++;
@@ -5,6 +5,7 @@
 #include <assert.h>
 
 #include "MeshTypes.h"
+#include "NodeGrid.h"
 #include "NodeStatus.h"
 #include "mesh-pb-constants.h"
 
@@ -18,6 +19,89 @@ extern const char *channelName;
 /// Given a node, return how many seconds in the past (vs now) that we last heard from it
 uint32_t sinceLastSeen(const NodeInfo *n);
 
+/// Number of slots in our NodeNum to node_db index hash table, must be a power of two and at least twice MAX_NUM_NODES (so
+/// probe chains stay short)
+#define NODE_INDEX_SIZE 64
+
+/// Marks an unused slot in our node index
+#define NODE_INDEX_EMPTY 0xff
+
+#define NUM_ONLINE_SECS (60 * 2) // 2 hrs to consider someone offline
+
+/// We keep our count of online nodes by bucketing last seen times, so a node goes offline somewhere between
+/// (NUM-1)/NUM and 1 NUM_ONLINE_SECS after we last heard from it
+#define ONLINE_BUCKETS 8
+#define ONLINE_BUCKET_SECS (NUM_ONLINE_SECS / ONLINE_BUCKETS)
+
+/// Marks a node which isn't included in our online node count
+#define ONLINE_NOT_COUNTED 0xffffffff
+
+/// The max number of nodes which can be pinned (protected from eviction when our DB is full)
+#define NODEDB_MAX_PINNED 8
+
+/// Build with i.e. -DNODEDB_PINNED_NODES=0x12345678,0x9abcdef0 to pin those nodes (say the routers of a fixed mesh) at boot
+// #define NODEDB_PINNED_NODES
+
+/// hopsAway for nodes we haven't heard a hop count from
+#define NODEDB_HOPS_UNKNOWN 0xff
+
+/// The channel utilization (or transmit duty cycle) of nodes which haven't sent us a beacon with one
+#define NODEDB_CHANNEL_UTIL_UNKNOWN 0xff
+
+/// Up to this neighborhood channel utilization (percent) our low priority periodic broadcasts keep their configured intervals
+#ifndef CONGESTION_LOW_PERCENT
+#define CONGESTION_LOW_PERCENT 25
+#endif
+
+/// From there their intervals stretch linearly, reaching CONGESTION_MAX_STRETCH times longer at this utilization
+#ifndef CONGESTION_HIGH_PERCENT
+#define CONGESTION_HIGH_PERCENT 60
+#endif
+
+#define CONGESTION_MAX_STRETCH 4
+
+/// Routers don't decode the transit packets they overhear, each sender's last heard time is updated from them at most this often
+#ifndef NODEDB_HEARD_COALESCE_SECS
+#define NODEDB_HEARD_COALESCE_SECS 60
+#endif
+
+/// How often we append changed nodes to our on disk journal
+#define NODEDB_JOURNAL_SECS 60
+
+/// requestSave() waits until our settings have stopped changing for this long, so a burst of changes is one flash write
+#ifndef NODEDB_SAVE_QUIET_MSEC
+#define NODEDB_SAVE_QUIET_MSEC (5 * 1000)
+#endif
+
+/// ...but never delays a save by more than this, in case the changes keep coming
+#ifndef NODEDB_SAVE_MAX_MSEC
+#define NODEDB_SAVE_MAX_MSEC (30 * 1000)
+#endif
+
+/// Once our journal grows past this size we replace it with a full snapshot of the device state
+#define NODEDB_JOURNAL_MAX_SIZE (4 * 1024)
+
+/// How many node records we read from flash each time our background loader runs (see NodeDB::loadMoreNodes)
+#ifndef NODEDB_LOAD_BATCH
+#define NODEDB_LOAD_BATCH 4
+#endif
+
+/// How far a node has moved since one of its full position broadcasts (see PositionPlugin)
+struct PositionDelta {
+    PacketId keyframeId;             // The id of the full broadcast this is relative to
+    int32_t latitude_i, longitude_i; // In Position's 1e-7 degree units
+    int32_t altitude;
+    uint32_t time; // secs after the full broadcast's time
+    int32_t battery_level;
+};
+
+/// The last full position broadcast we heard from a node, which its later deltas are relative to
+struct PositionKeyframe {
+    PacketId id; // 0 if we don't have one
+    int32_t latitude_i, longitude_i, altitude;
+    uint32_t time;
+};
+
 class NodeDB
 {
     // NodeNum provisionalNodeNum; // if we are trying to find a node num this is our current attempt
@@ -29,8 +113,72 @@ class NodeDB
     NodeInfo *nodes;
     pb_size_t *numNodes;
 
+    /// An open addressing (linear probing) hash table from NodeNum to the position of that node in nodes[].  Lives beside the
+    /// serialized array, so it is rebuilt whenever that array is replaced wholesale.
+    uint8_t nodeIndex[NODE_INDEX_SIZE];
+
+    /**
+     * Copies of the NodeInfo fields we look at for every node (lookups, online counts, eviction and the screen's node list),
+     * kept as compact arrays beside nodes[] so those scans don't drag each node's (mostly cold) user and position strings
+     * through the cache.  nodes[] is still the authoritative record (it is what we save and send to phones), anyone who
+     * changes these fields in a NodeInfo must tell us with updateLastSeen() or updateSnr().
+     */
+    NodeNum hotNums[MAX_NUM_NODES];
+    uint32_t hotLastHeard[MAX_NUM_NODES]; // position.time
+    float hotSnr[MAX_NUM_NODES];
+    uint8_t hotHopsAway[MAX_NUM_NODES]; // How many relays the last packet we heard from this node took, or NODEDB_HOPS_UNKNOWN
+
+    /// The online bucket (last seen time / ONLINE_BUCKET_SECS) each node in nodes[] was counted in, or ONLINE_NOT_COUNTED
+    uint32_t onlineEpochs[MAX_NUM_NODES];
+
+    /// The number of nodes counted in each online bucket which hasn't yet aged out
+    uint8_t onlineBucketCounts[ONLINE_BUCKETS];
+
+    /// The sum of onlineBucketCounts
+    size_t numOnline = 0;
+
+    /// The most recent bucket we've aged our online counts to
+    uint32_t onlineEpoch = 0;
+
+    /// Nodes in nodes[] which have changed since they were last written to disk
+    bool nodeDirty[MAX_NUM_NODES];
+
+    /// The value of generation when each node in nodes[] last changed (0 if it hasn't changed since we booted)
+    uint32_t nodeGenerations[MAX_NUM_NODES];
+
+    /// The last full position broadcast each node in nodes[] sent us
+    PositionKeyframe keyframes[MAX_NUM_NODES];
+
+    /// The channel utilization percentage each node in nodes[] last told us it sees (or NODEDB_CHANNEL_UTIL_UNKNOWN)
+    uint8_t channelUtils[MAX_NUM_NODES];
+
+    /// And the percentage of the time it spends transmitting (or NODEDB_CHANNEL_UTIL_UNKNOWN)
+    uint8_t txDuties[MAX_NUM_NODES];
+
+    /// Where the nodes in nodes[] with positions are, by their index in nodes[]
+    NodeGrid grid;
+
+    /// Counts every change to a node, so clients can ask for just the nodes which changed since they last synced
+    uint32_t generation = 0;
+
+    /// millis() of the oldest requestSave() we haven't saved yet (0 if none)
+    uint32_t saveRequestMsec = 0;
+
+    /// hashDeviceState() of what we last wrote to flash (0 if we haven't this boot)
+    uint32_t savedStateHash = 0;
+
+    /// Nodes we never evict
+    NodeNum pinnedNodes[NODEDB_MAX_PINNED];
+    size_t numPinned = 0;
+
+    /// The current size of our node journal file (NODEDB_JOURNAL_MAX_SIZE if it must be compacted before the next append)
+    size_t journalSize = 0;
+
     uint32_t readPointer = 0;
 
+    /// True while our node records are still being read from flash, after the rest of our state was loaded at boot
+    bool loadingNodes = false;
+
   public:
     bool updateGUI = false;            // we think the gui should definitely be redrawn, screen will clear this once handled
     NodeInfo *updateGUIforNode = NULL; // if currently showing this node, we think you should update the GUI
@@ -43,9 +191,37 @@ class NodeDB
     /// Called from service after app start, to do init which can only be done after OS load
     void init();
 
-    /// write to flash
+    /// write to flash (a full snapshot of our device state, which also compacts our node journal)
     void saveToDisk();
 
+    /**
+     * Save our device state soon, in the background.  Use this rather than saveToDisk() after changing settings: requests
+     * are merged until things have been quiet for NODEDB_SAVE_QUIET_MSEC (or NODEDB_SAVE_MAX_MSEC have passed)
+     */
+    void requestSave();
+
+    /// Save now if anything changed since our last save: a full snapshot if our device state did, otherwise just our
+    /// journal of changed nodes (and always our routes, see LinkStore).  For when we can't wait for requestSave() (i.e. before
+    /// deep sleep)
+    void saveIfChanged();
+
+    /// Called by our save timer, @return msecs until we want to run again (0 for not until the next requestSave())
+    int32_t runSaveScheduler();
+
+    /// Cheaply save any nodes which have changed, by appending them to our journal
+    void saveNodesToDisk();
+
+    /// Read up to NODEDB_LOAD_BATCH more of our saved node records, called from our background loader after boot
+    /// @return true if there are more to read
+    bool loadMoreNodes();
+
+    /// Finish reading our saved node records now, for callers which need the whole DB (i.e. before a snapshot)
+    void ensureLoaded()
+    {
+        while (loadMoreNodes())
+            ;
+    }
+
     /** Reinit radio config if needed, because either:
      * a) sometimes a buggy android app might send us bogus settings or
      * b) the client set factory_reset
@@ -58,14 +234,61 @@ class NodeDB
     /// we updateGUI and updateGUIforNode if we think our this change is big enough for a redraw
     void updateFrom(const MeshPacket &p);
 
+    /**
+     * We overheard a packet (still encrypted) from a node we already know, update when we last heard it and its SNR.
+     * Much cheaper than updateFrom(): we never add nodes, and we coalesce updates for busy senders to one per
+     * NODEDB_HEARD_COALESCE_SECS (each update has to be saved and sent to our clients).
+     */
+    void updateHeard(const MeshPacket &mp);
+
     /** Update position info for this node based on received position data
+     *
+     * If keyframeId is !0 this was the full position broadcast with that packet id, later deltas might be relative to it
      */
-    void updatePosition(uint32_t nodeId, const Position &p);
+    void updatePosition(uint32_t nodeId, const Position &p, PacketId keyframeId = 0);
+
+    /** Update position info for this node from how far it says it has moved since one of its full broadcasts
+     *
+     * @return false if we don't have that broadcast (we missed it, or we have since heard a newer one), so can't use the delta
+     */
+    bool updatePositionDelta(uint32_t nodeId, const PositionDelta &d);
 
     /** Update user info for this node based on received user data
      */
     void updateUser(uint32_t nodeId, const User &p);
 
+    /// Update this node's battery level (as a percentage), from a beacon which didn't carry its whole position
+    void updateBattery(uint32_t nodeId, int32_t batteryLevel);
+
+    /// Update how busy this node says its channel is (as a percentage)
+    void updateChannelUtil(uint32_t nodeId, uint8_t percent);
+
+    /// How busy n last told us its channel was (as a percentage), or NODEDB_CHANNEL_UTIL_UNKNOWN
+    uint8_t getChannelUtil(NodeNum n);
+
+    /// Update how much of the time this node says it spends transmitting (as a percentage)
+    void updateTxDuty(uint32_t nodeId, uint8_t percent);
+
+    /**
+     * How busy the channel is around us (as a percentage).  We only hear our own channel, but hidden terminals mean the
+     * congestion which matters is at our neighbors, so this is the most of: our own utilization, what each of our direct
+     * neighbors says theirs is, and the sum of our neighbors' (and our own) transmit duty cycles.
+     */
+    uint8_t getNeighborhoodUtil();
+
+    /// Stretch the interval of a low priority periodic broadcast (positions, telemetry, nodeinfo) for getNeighborhoodUtil()
+    uint32_t stretchForCongestion(uint32_t msec);
+
+    /**
+     * Find the nodes with known positions nearest to a position (in Position.latitude_i units), not including us.  Uses our
+     * grid index, so this is cheap when the nearest nodes are close by, however many nodes we know.
+     * @return the number of nodes (at most maxOut) written to out, nearest first
+     */
+    size_t findNearest(int32_t lat, int32_t lon, NodeDistance *out, size_t maxOut);
+
+    /// Find the nodes with known positions within meters of a position, not including us @return like findNearest
+    size_t findInRadius(int32_t lat, int32_t lon, float meters, NodeDistance *out, size_t maxOut);
+
     /// @return our node number
     NodeNum getNodeNum() { return myNodeInfo.my_node_num; }
 
@@ -83,10 +306,27 @@ class NodeDB
     */
 
     /// Called from bluetooth when the user wants to start reading the node DB from scratch.
-    void resetReadPointer() { readPointer = 0; }
+    void resetReadPointer()
+    {
+        ensureLoaded(); // The phone expects to see every node we know about
+        readPointer = 0;
+    }
+
+    /// Allow the bluetooth layer to read our next nodeinfo record (skipping any which haven't changed since sinceGeneration),
+    /// or NULL if done reading
+    const NodeInfo *readNextInfo(uint32_t sinceGeneration = 0);
 
-    /// Allow the bluetooth layer to read our next nodeinfo record, or NULL if done reading
-    const NodeInfo *readNextInfo();
+    /// A hash of the device state we last saved to flash (or loaded, if it was current), 0 if neither
+    uint32_t getSavedStateHash() const { return savedStateHash; }
+
+    /// @return our current generation, see readNextInfo()
+    uint32_t getGeneration() const { return generation; }
+
+    /// @return the index in our DB of a node we returned (i.e. from readNextInfo)
+    size_t getIndexOf(const NodeInfo *info) const { return info - nodes; }
+
+    /// @return the generation at which the node at index x last changed, 0 if it hasn't since we loaded it
+    uint32_t getGenerationByIndex(size_t x) const { return nodeGenerations[x]; }
 
     /// pick a provisional nodenum we hope no one is using
     void pickNewNodeNum();
@@ -100,13 +340,53 @@ class NodeDB
         return &nodes[x];
     }
 
+    /// Cheap accessors for the hot fields of nodes[x], for callers which scan every node
+    NodeNum getNodeNumByIndex(size_t x) const { return hotNums[x]; }
+    uint32_t getLastHeardByIndex(size_t x) const { return hotLastHeard[x]; }
+    float getSnrByIndex(size_t x) const { return hotSnr[x]; }
+    uint8_t getHopsAwayByIndex(size_t x) const { return hotHopsAway[x]; }
+
+    /// How many relays the last packet we heard from n took, or NODEDB_HOPS_UNKNOWN
+    uint8_t getHopsAway(NodeNum n);
+
+    /// Never evict this node from our DB (i.e. one listed in NODEDB_PINNED_NODES)
+    void setPinned(NodeNum n, bool pinned = true);
+
+    bool isPinned(NodeNum n);
+
     /// Return the number of nodes we've heard from recently (within the last 2 hrs?)
     size_t getNumOnlineNodes();
 
+    /// Call this after changing info->position.time directly, so our online node count stays accurate
+    void updateLastSeen(const NodeInfo *info);
+
+    /// Call this after changing info->snr directly
+    void updateSnr(const NodeInfo *info) { hotSnr[info - nodes] = info->snr; }
+
+    /// Age our online node count, notifying observers if anyone has gone offline.  Called periodically.
+    void ageOnlineNodes();
+
   private:
-    /// Find a node in our DB, create an empty NodeInfo if missing
+    /// A hash of our device state (without our nodes, which we save separately), so we can tell if it needs saving
+    uint32_t hashDeviceState();
+
+    /// Note that nodes[x] has changed (so it needs saving, and clients need to hear about it)
+    void markChanged(size_t x)
+    {
+        nodeDirty[x] = true;
+        nodeGenerations[x] = ++generation;
+    }
+
+    /// Find a node in our DB, create an empty NodeInfo if missing.  If our DB is full we evict the least recently heard node,
+    /// which moves other nodes in our array (so don't keep NodeInfo pointers across this call)
     NodeInfo *getOrCreateNode(NodeNum n);
 
+    /// Make room for a new node by discarding the least recently heard node (which isn't us or pinned)
+    void evictNode();
+
+    /// Delete nodes[x], shifting the following nodes down so nodes[] stays compact
+    void removeNode(size_t x);
+
     /// Notify observers of changes to the DB
     void notifyObservers(bool forceUpdate = false)
     {
@@ -118,6 +398,47 @@ class NodeDB
     /// read our db from flash
     void loadFromDisk();
 
+    /// Merge one node record from flash into our DB (records are read in the order they were saved)
+    void loadNodeRecord(const NodeInfo &r);
+
+    /// Called once all our node records have been read
+    void finishLoading();
+
+    /// Regenerate nodeIndex, our hot arrays and our grid index from the current contents of nodes[]
+    void rebuildIndex();
+
+    /// Copy the hot fields of nodes[x] into our hot arrays (other than hotHopsAway, which only we know)
+    void syncHot(size_t x)
+    {
+        hotNums[x] = nodes[x].num;
+        hotLastHeard[x] = nodes[x].position.time;
+        hotSnr[x] = nodes[x].snr;
+    }
+
+    /// Add nodes[x] to nodeIndex
+    void addToIndex(size_t x);
+
+    /// Update our grid index after nodes[x]'s position changed
+    void syncGrid(size_t x);
+
+    /// Is a node counted in this bucket still included in numOnline
+    bool isOnlineEpoch(uint32_t e) const { return e != ONLINE_NOT_COUNTED && onlineEpoch - e < ONLINE_BUCKETS; }
+
+    /// Move onlineEpoch up to the current time, dropping the counts for any buckets which have aged out
+    void advanceOnlineEpoch();
+
+    /// Add nodes[x] to our online count (if it has been heard from recently), it must not currently be counted
+    void countOnline(size_t x);
+
+    /// Regenerate our online counts from scratch
+    void recountOnline();
+
+    static size_t indexSlot(NodeNum n)
+    {
+        uint32_t h = n * 2654435761u;
+        return (h ^ (h >> 16)) & (NODE_INDEX_SIZE - 1);
+    }
+
     /// Reinit device state from scratch (not loading from disk)
     void installDefaultDeviceState();
 };
@@ -0,0 +1,174 @@
+#include "NodeGrid.h"
+#include "Geodesy.h"
+#include <math.h>
+#include <string.h>
+
+/// The size of a cell in degrees, and in meters north to south
+#define NODE_GRID_CELL_DEG ((1 << NODE_GRID_SHIFT) * 1e-7f)
+#define NODE_GRID_CELL_METERS (NODE_GRID_CELL_DEG * GEO_EARTH_RADIUS * 3.14159265f / 180)
+
+void NodeGrid::clear()
+{
+    memset(heads, NODE_GRID_NONE, sizeof(heads));
+    memset(indexed, 0, sizeof(indexed));
+    numIndexed = 0;
+}
+
+void NodeGrid::set(size_t x, int32_t lat, int32_t lon)
+{
+    uint32_t key = cellKey(cellCoord(lat), cellCoord(lon));
+    if (!indexed[x] || cells[x] != key) {
+        remove(x);
+
+        size_t slot = cellSlot(key);
+        next[x] = heads[slot];
+        heads[slot] = x;
+        cells[x] = key;
+        indexed[x] = true;
+        numIndexed++;
+    }
+
+    lats[x] = lat;
+    lons[x] = lon;
+}
+
+void NodeGrid::remove(size_t x)
+{
+    if (!indexed[x])
+        return;
+
+    uint8_t *link = &heads[cellSlot(cells[x])];
+    while (*link != x)
+        link = &next[*link];
+    *link = next[x];
+
+    indexed[x] = false;
+    numIndexed--;
+}
+
+size_t NodeGrid::findNearest(int32_t lat, int32_t lon, NodeDistance *out, size_t maxOut, size_t exclude) const
+{
+    size_t numOut = 0;
+    if (!maxOut)
+        return 0;
+
+    size_t total = numIndexed - (exclude < MAX_NUM_NODES && indexed[exclude] ? 1 : 0);
+    int32_t maxRing = 0;
+    while ((2 * maxRing + 3) * (2 * maxRing + 3) <= NODE_GRID_MAX_CELLS)
+        maxRing++;
+    float cellMeters = minCellMeters(lat, maxRing);
+
+    int32_t latCell = cellCoord(lat), lonCell = cellCoord(lon);
+    size_t seen = 0;
+    for (int32_t ring = 0; ring <= maxRing; ring++) {
+        seen += visitRing(latCell, lonCell, ring, lat, lon, INFINITY, out, numOut, maxOut, exclude);
+
+        // Anything in the rings we haven't visited is at least ring cells away
+        if (seen >= total || (numOut == maxOut && out[numOut - 1].meters <= ring * cellMeters))
+            return numOut;
+    }
+
+    numOut = 0;
+    visitAll(lat, lon, INFINITY, out, numOut, maxOut, exclude);
+    return numOut;
+}
+
+size_t NodeGrid::findInRadius(int32_t lat, int32_t lon, float meters, NodeDistance *out, size_t maxOut, size_t exclude) const
+{
+    size_t numOut = 0;
+    if (!maxOut)
+        return 0;
+
+    int32_t maxRing = 0;
+    while ((2 * maxRing + 3) * (2 * maxRing + 3) <= NODE_GRID_MAX_CELLS)
+        maxRing++;
+    float cellMeters = minCellMeters(lat, maxRing);
+
+    if (meters >= maxRing * cellMeters)
+        visitAll(lat, lon, meters, out, numOut, maxOut, exclude);
+    else {
+        int32_t latCell = cellCoord(lat), lonCell = cellCoord(lon);
+        int32_t rings = (int32_t)(meters / cellMeters) + 1; // A node within meters is at most this many cells away
+        for (int32_t ring = 0; ring <= rings; ring++)
+            visitRing(latCell, lonCell, ring, lat, lon, meters, out, numOut, maxOut, exclude);
+    }
+
+    return numOut;
+}
+
+float NodeGrid::minCellMeters(int32_t lat, int32_t rings)
+{
+    // Cells are narrowest east to west at their poleward edge
+    float poleward = fabsf(lat * 1e-7f) + (rings + 1) * NODE_GRID_CELL_DEG;
+    if (poleward >= 90)
+        return 0;
+    return NODE_GRID_CELL_METERS * geoCos(poleward * 3.14159265f / 180);
+}
+
+size_t NodeGrid::visitCell(int32_t latCell, int32_t lonCell, int32_t lat, int32_t lon, float maxMeters, NodeDistance *out,
+                           size_t &numOut, size_t maxOut, size_t exclude) const
+{
+    uint32_t key = cellKey(latCell, lonCell);
+    size_t count = 0;
+
+    // Other cells can share our chain, so check each node is really in this one
+    for (uint8_t x = heads[cellSlot(key)]; x != NODE_GRID_NONE; x = next[x]) {
+        if (cells[x] != key || x == exclude)
+            continue;
+
+        count++;
+        float d = geoDistanceMeters(lat, lon, lats[x], lons[x]);
+        if (d <= maxMeters)
+            insertSorted({x, d}, out, numOut, maxOut);
+    }
+
+    return count;
+}
+
+size_t NodeGrid::visitRing(int32_t latCell, int32_t lonCell, int32_t ring, int32_t lat, int32_t lon, float maxMeters,
+                           NodeDistance *out, size_t &numOut, size_t maxOut, size_t exclude) const
+{
+    if (ring == 0)
+        return visitCell(latCell, lonCell, lat, lon, maxMeters, out, numOut, maxOut, exclude);
+
+    size_t count = 0;
+
+    // The rows above and below, then the columns on either side between them
+    for (int32_t i = -ring; i <= ring; i++) {
+        count += visitCell(latCell + ring, lonCell + i, lat, lon, maxMeters, out, numOut, maxOut, exclude);
+        count += visitCell(latCell - ring, lonCell + i, lat, lon, maxMeters, out, numOut, maxOut, exclude);
+    }
+    for (int32_t i = -ring + 1; i < ring; i++) {
+        count += visitCell(latCell + i, lonCell + ring, lat, lon, maxMeters, out, numOut, maxOut, exclude);
+        count += visitCell(latCell + i, lonCell - ring, lat, lon, maxMeters, out, numOut, maxOut, exclude);
+    }
+
+    return count;
+}
+
+void NodeGrid::visitAll(int32_t lat, int32_t lon, float maxMeters, NodeDistance *out, size_t &numOut, size_t maxOut,
+                        size_t exclude) const
+{
+    for (size_t x = 0; x < MAX_NUM_NODES; x++) {
+        if (!indexed[x] || x == exclude)
+            continue;
+
+        float d = geoDistanceMeters(lat, lon, lats[x], lons[x]);
+        if (d <= maxMeters)
+            insertSorted({x, d}, out, numOut, maxOut);
+    }
+}
+
+void NodeGrid::insertSorted(NodeDistance d, NodeDistance *out, size_t &numOut, size_t maxOut)
+{
+    if (numOut == maxOut) {
+        if (d.meters >= out[numOut - 1].meters)
+            return;
+        numOut--; // Drop the furthest to make room
+    }
+
+    size_t i = numOut++;
+    for (; i > 0 && out[i - 1].meters > d.meters; i--)
+        out[i] = out[i - 1];
+    out[i] = d;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "mesh-pb-constants.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/// Our cells are 2^NODE_GRID_SHIFT Position units (1e-7 degrees) on a side, about 1.5 km north to south
+#ifndef NODE_GRID_SHIFT
+#define NODE_GRID_SHIFT 17
+#endif
+
+/// Number of chains in our cell hash table, must be a power of two
+#define NODE_GRID_SLOTS 32
+
+/// Once a query would visit more cells than this, it is cheaper to just look at every node
+#define NODE_GRID_MAX_CELLS (4 * NODE_GRID_SLOTS)
+
+/// Ends a chain
+#define NODE_GRID_NONE 0xff
+
+/// A node found by one of our queries
+struct NodeDistance {
+    size_t index; // Into our NodeDB, see NodeDB::getNodeByIndex
+    float meters;
+};
+
+/**
+ * A coarse spatial index over the positions in our NodeDB, so "which nodes are near here" costs about the number of cells
+ * around here rather than a distance calculation for every node we know.
+ *
+ * Positions are quantized to a lat/lon grid, and each occupied cell's nodes are chained (by their NodeDB index) from a small
+ * hash table of cells.  Queries visit rings of cells outward from the query point, and only work out exact distances (with
+ * geoDistanceMeters) for the nodes in the cells they visit.  Queries which would visit too many cells fall back to looking at
+ * every indexed node, so they are never much slower than the plain scan.
+ *
+ * Cells don't wrap around the antimeridian, so only that fallback finds nodes on the far side of it.
+ */
+class NodeGrid
+{
+    uint8_t heads[NODE_GRID_SLOTS];
+
+    /// For each NodeDB index: the next node in its chain, its cell and its position (valid while indexed[x])
+    uint8_t next[MAX_NUM_NODES];
+    uint32_t cells[MAX_NUM_NODES];
+    int32_t lats[MAX_NUM_NODES], lons[MAX_NUM_NODES];
+    bool indexed[MAX_NUM_NODES];
+
+    size_t numIndexed = 0;
+
+  public:
+    NodeGrid() { clear(); }
+
+    void clear();
+
+    /// Index (or move) the node at NodeDB index x to this position
+    void set(size_t x, int32_t lat, int32_t lon);
+
+    /// Forget the node at NodeDB index x (if it was indexed)
+    void remove(size_t x);
+
+    /**
+     * Find the nodes nearest to a position (in Position.latitude_i units), skipping the node at NodeDB index exclude
+     * @return the number of nodes (at most maxOut) written to out, nearest first
+     */
+    size_t findNearest(int32_t lat, int32_t lon, NodeDistance *out, size_t maxOut, size_t exclude = NODE_GRID_NONE) const;
+
+    /**
+     * Find the nodes within meters of a position, skipping the node at NodeDB index exclude
+     * @return the number of nodes written to out, nearest first (if there are more than maxOut, the nearest maxOut)
+     */
+    size_t findInRadius(int32_t lat, int32_t lon, float meters, NodeDistance *out, size_t maxOut,
+                        size_t exclude = NODE_GRID_NONE) const;
+
+    size_t getNumIndexed() const { return numIndexed; }
+
+  private:
+    static int32_t cellCoord(int32_t v) { return v >> NODE_GRID_SHIFT; } // Arithmetic shift, so it rounds towards -infinity
+
+    static uint32_t cellKey(int32_t latCell, int32_t lonCell) { return ((uint32_t)(uint16_t)latCell << 16) | (uint16_t)lonCell; }
+
+    static size_t cellSlot(uint32_t key)
+    {
+        uint32_t h = key * 2654435761u;
+        return (h ^ (h >> 16)) & (NODE_GRID_SLOTS - 1);
+    }
+
+    /// The least distance (in meters) across a cell within rings cells of lat, north to south or east to west
+    static float minCellMeters(int32_t lat, int32_t rings);
+
+    /// Look at every node in one cell, adding those within maxMeters to out @return the number of nodes in the cell
+    size_t visitCell(int32_t latCell, int32_t lonCell, int32_t lat, int32_t lon, float maxMeters, NodeDistance *out,
+                     size_t &numOut, size_t maxOut, size_t exclude) const;
+
+    /// Look at every node in the ring of cells rings away from (latCell, lonCell) @return the number of nodes in the ring
+    size_t visitRing(int32_t latCell, int32_t lonCell, int32_t ring, int32_t lat, int32_t lon, float maxMeters,
+                     NodeDistance *out, size_t &numOut, size_t maxOut, size_t exclude) const;
+
+    /// Look at every indexed node, for queries too big for our cells
+    void visitAll(int32_t lat, int32_t lon, float maxMeters, NodeDistance *out, size_t &numOut, size_t maxOut,
+                  size_t exclude) const;
+
+    /// Add a node to out (which is sorted nearest first), dropping the furthest if it is already full
+    static void insertSorted(NodeDistance d, NodeDistance *out, size_t &numOut, size_t maxOut);
+};
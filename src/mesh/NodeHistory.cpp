@@ -0,0 +1,295 @@
+#include "NodeHistory.h"
+#include "configuration.h"
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+NodeHistory nodeHistory;
+
+/// The slot of a record whose node we forgot
+#define NO_SLOT 0x3f
+
+/// A slot byte, a varint time delta and three varint value deltas
+#define MAX_RECORD_LEN (1 + 5 + 2 + 5 + 5)
+
+static_assert(NODE_HISTORY_MAX_NODES <= NO_SLOT, "Our records have 6 bits for the node's slot");
+static_assert(NODE_HISTORY_RING_LEN > MAX_RECORD_LEN, "Our ring must hold at least one record");
+
+/// One of our records, decoded
+struct Record {
+    size_t slot;
+    uint8_t flags; // NODE_HISTORY_HAS_SNR, NODE_HISTORY_HAS_POSITION
+    uint32_t dt;
+    int32_t dSnr, dLat, dLon;
+};
+
+/// Reads our records, which can wrap around the end of our ring
+struct RingReader {
+    const uint8_t *ring;
+    size_t pos;
+
+    uint8_t byte()
+    {
+        uint8_t b = ring[pos];
+        if (++pos == NODE_HISTORY_RING_LEN)
+            pos = 0;
+        return b;
+    }
+
+    uint32_t varint()
+    {
+        uint32_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t b = byte();
+            v |= (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+    }
+
+    int32_t svarint()
+    {
+        uint32_t u = varint();
+        return (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+    }
+
+    void record(Record &r)
+    {
+        uint8_t b = byte();
+        r.slot = b & NO_SLOT;
+        r.flags = b >> 6;
+        r.dt = varint();
+        r.dSnr = r.flags & NODE_HISTORY_HAS_SNR ? svarint() : 0;
+        r.dLat = r.flags & NODE_HISTORY_HAS_POSITION ? svarint() : 0;
+        r.dLon = r.flags & NODE_HISTORY_HAS_POSITION ? svarint() : 0;
+    }
+};
+
+static uint8_t *writeVarint(uint8_t *p, uint32_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (uint8_t)v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+static uint8_t *writeSvarint(uint8_t *p, int32_t v)
+{
+    return writeVarint(p, ((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+}
+
+void NodeHistory::onHeard(NodeNum n, uint32_t time, float snr)
+{
+    if (!time)
+        return; // We can't place samples without our clock
+
+    Track *t = findTrack(n, time);
+    if (t->numSamples && time >= t->lastTime && time - t->lastTime < NODE_HISTORY_HEARD_SECS)
+        return;
+
+    int32_t q = lroundf(snr * 4);
+    addSample(t, time, NODE_HISTORY_HAS_SNR, q < -128 ? -128 : (q > 127 ? 127 : q), 0, 0);
+}
+
+void NodeHistory::onPosition(NodeNum n, uint32_t time, int32_t latitude_i, int32_t longitude_i)
+{
+    if (!time || (!latitude_i && !longitude_i))
+        return;
+
+    Track *t = findTrack(n, time);
+    int32_t lat = latitude_i / NODE_HISTORY_POSITION_UNITS, lon = longitude_i / NODE_HISTORY_POSITION_UNITS;
+    bool moved = lat != t->lastLat || lon != t->lastLon;
+    if (t->lastPositionTime && time >= t->lastPositionTime &&
+        time - t->lastPositionTime < (moved ? NODE_HISTORY_POSITION_SECS : NODE_HISTORY_HEARD_SECS))
+        return;
+
+    t->lastPositionTime = time;
+    addSample(t, time, NODE_HISTORY_HAS_POSITION, 0, lat, lon);
+}
+
+size_t NodeHistory::getNumSamples(NodeNum n) const
+{
+    for (size_t i = 0; i < NODE_HISTORY_MAX_NODES; i++)
+        if (tracks[i].num == n)
+            return tracks[i].numSamples;
+    return 0;
+}
+
+size_t NodeHistory::read(NodeNum n, uint32_t sinceSecs, size_t skip, NodeHistorySample *out, size_t maxSamples) const
+{
+    size_t slot = 0;
+    while (slot < NODE_HISTORY_MAX_NODES && tracks[slot].num != n)
+        slot++;
+    if (!n || slot == NODE_HISTORY_MAX_NODES || !maxSamples)
+        return 0;
+
+    const Track &t = tracks[slot];
+    uint32_t time = t.baseTime;
+    int32_t snr = t.baseSnr, lat = t.baseLat, lon = t.baseLon;
+    size_t numRead = 0;
+
+    RingReader r = {ring, (head + NODE_HISTORY_RING_LEN - used) % NODE_HISTORY_RING_LEN};
+    for (size_t left = t.numSamples; left;) {
+        Record rec;
+        r.record(rec);
+        if (rec.slot != slot)
+            continue;
+
+        left--;
+        time += rec.dt;
+        snr += rec.dSnr;
+        lat += rec.dLat;
+        lon += rec.dLon;
+        if (time < sinceSecs)
+            continue;
+        if (skip) {
+            skip--;
+            continue;
+        }
+
+        NodeHistorySample &s = out[numRead];
+        s.time = time;
+        s.latitude_i = lat * NODE_HISTORY_POSITION_UNITS;
+        s.longitude_i = lon * NODE_HISTORY_POSITION_UNITS;
+        s.snr = snr;
+        s.flags = rec.flags;
+        if (++numRead == maxSamples)
+            break;
+    }
+
+    return numRead;
+}
+
+size_t NodeHistory::readChunk(NodeHistoryCursor &c, uint8_t *payload, size_t maxLen) const
+{
+    assert(maxLen >= sizeof(NodeHistoryChunk) + sizeof(NodeHistorySample));
+    NodeHistorySample *samples = (NodeHistorySample *)(payload + sizeof(NodeHistoryChunk));
+    size_t maxSamples = (maxLen - sizeof(NodeHistoryChunk)) / sizeof(NodeHistorySample);
+
+    NodeHistoryChunk h = {0, 0};
+    size_t n = 0;
+    while (!c.done && !n) {
+        NodeNum num = c.node ? c.node : tracks[c.slot].num;
+        n = read(num, c.nextSecs, c.skip, samples, maxSamples);
+        h.node = num;
+
+        if (n == maxSamples) {
+            // There might be more, next time we carry on after the samples we sent (several can have the same time)
+            uint32_t last = samples[n - 1].time;
+            size_t numLast = 1;
+            while (numLast < n && samples[n - 1 - numLast].time == last)
+                numLast++;
+            c.skip = numLast == n && last == c.nextSecs ? c.skip + n : numLast;
+            c.nextSecs = last;
+        } else {
+            // That was all of this node's
+            c.nextSecs = c.sinceSecs;
+            c.skip = 0;
+            c.done = c.node || ++c.slot == NODE_HISTORY_MAX_NODES;
+        }
+    }
+
+    if (!n)
+        h.node = 0;
+    h.flags = c.done ? NODE_HISTORY_LAST : 0;
+    memcpy(payload, &h, sizeof(h));
+    return sizeof(h) + n * sizeof(NodeHistorySample);
+}
+
+void NodeHistory::clear()
+{
+    memset(tracks, 0, sizeof(tracks));
+    head = used = 0;
+}
+
+NodeHistory::Track *NodeHistory::findTrack(NodeNum n, uint32_t time)
+{
+    Track *oldest = NULL;
+    for (size_t i = 0; i < NODE_HISTORY_MAX_NODES; i++) {
+        Track *t = &tracks[i];
+        if (t->num == n)
+            return t;
+        if (!oldest || (oldest->num && (!t->num || t->lastTime < oldest->lastTime)))
+            oldest = t; // A free slot, or the node we heard from longest ago
+    }
+
+    if (oldest->num) {
+        LOG_DEBUG(MESH, "Node history full, forgetting 0x%x\n", oldest->num);
+        orphanRecords(oldest - tracks);
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->num = n;
+    oldest->baseTime = oldest->lastTime = time;
+    return oldest;
+}
+
+void NodeHistory::addSample(Track *t, uint32_t time, uint8_t flags, int8_t snr, int32_t lat, int32_t lon)
+{
+    // Our clock can step backwards, but each node's samples stay in order
+    if (time < t->lastTime)
+        time = t->lastTime;
+
+    uint8_t buf[MAX_RECORD_LEN];
+    uint8_t *p = buf;
+    *p++ = (t - tracks) | (flags << 6);
+    p = writeVarint(p, time - t->lastTime);
+    if (flags & NODE_HISTORY_HAS_SNR)
+        p = writeSvarint(p, snr - t->lastSnr);
+    if (flags & NODE_HISTORY_HAS_POSITION) {
+        p = writeSvarint(p, lat - t->lastLat);
+        p = writeSvarint(p, lon - t->lastLon);
+    }
+
+    size_t len = p - buf;
+    while (NODE_HISTORY_RING_LEN - used < len)
+        dropOldest();
+    for (size_t i = 0; i < len; i++) {
+        ring[head] = buf[i];
+        if (++head == NODE_HISTORY_RING_LEN)
+            head = 0;
+    }
+    used += len;
+
+    t->numSamples++;
+    t->lastTime = time;
+    if (flags & NODE_HISTORY_HAS_SNR)
+        t->lastSnr = snr;
+    if (flags & NODE_HISTORY_HAS_POSITION) {
+        t->lastLat = lat;
+        t->lastLon = lon;
+    }
+}
+
+void NodeHistory::dropOldest()
+{
+    size_t tail = (head + NODE_HISTORY_RING_LEN - used) % NODE_HISTORY_RING_LEN;
+    RingReader r = {ring, tail};
+    Record rec;
+    r.record(rec);
+    used -= (r.pos + NODE_HISTORY_RING_LEN - tail) % NODE_HISTORY_RING_LEN;
+
+    if (rec.slot == NO_SLOT)
+        return;
+
+    // This was its node's oldest sample, so its values are now where that node's next sample starts from
+    Track &t = tracks[rec.slot];
+    t.numSamples--;
+    t.baseTime += rec.dt;
+    t.baseSnr += rec.dSnr;
+    t.baseLat += rec.dLat;
+    t.baseLon += rec.dLon;
+}
+
+void NodeHistory::orphanRecords(size_t slot)
+{
+    RingReader r = {ring, (head + NODE_HISTORY_RING_LEN - used) % NODE_HISTORY_RING_LEN};
+    for (size_t left = tracks[slot].numSamples; left;) {
+        size_t start = r.pos;
+        Record rec;
+        r.record(rec);
+        if (rec.slot == slot) {
+            ring[start] = NO_SLOT | (rec.flags << 6);
+            left--;
+        }
+    }
+}
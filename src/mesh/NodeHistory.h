@@ -0,0 +1,144 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "mesh-pb-constants.h"
+
+/// Bytes in our shared ring of samples.  Set by our MeshProfile, or override per deployment.
+#ifndef NODE_HISTORY_RING_LEN
+#define NODE_HISTORY_RING_LEN (meshProfile.nodeHistory)
+#endif
+
+/// How many nodes we keep history for, when a new one turns up we forget the one we heard from longest ago
+#ifndef NODE_HISTORY_MAX_NODES
+#define NODE_HISTORY_MAX_NODES (meshProfile.maxNodes)
+#endif
+
+/// We add an SNR sample for a node at most this often (every sample is also a time we heard them)
+#ifndef NODE_HISTORY_HEARD_SECS
+#define NODE_HISTORY_HEARD_SECS (5 * 60)
+#endif
+
+/// We add a position sample for a node at most this often, and only if they moved (or haven't for NODE_HISTORY_HEARD_SECS)
+#ifndef NODE_HISTORY_POSITION_SECS
+#define NODE_HISTORY_POSITION_SECS 30
+#endif
+
+/// We store positions to this many units of Position.latitude_i (1e-7 degrees), 100 is about a meter
+#define NODE_HISTORY_POSITION_UNITS 100
+
+/// Clients ask for the history of a node (or all of them) by sending a packet on this port (not yet in portnums.proto) to our
+/// own node, with a NodeHistoryRequest as its payload.  It doesn't go into the mesh.  We answer with packets on this port, from
+/// and to our own node, each with a NodeHistoryChunk and its samples.
+#define NODE_HISTORY_PORTNUM ((PortNum)48)
+
+struct NodeHistoryRequest {
+    uint32_t node;      // The node whose history we should send, or 0 for all of them
+    uint32_t sinceSecs; // Only its samples since then (secs since 1970), 0 for all of them
+} __attribute__((packed));
+
+/// The start of each packet of our answer, followed by as many NodeHistorySamples as fit.  All little endian.
+struct NodeHistoryChunk {
+    uint32_t node; // The node these samples are for, a node with many samples can take several chunks
+    uint8_t flags; // NODE_HISTORY_LAST
+} __attribute__((packed));
+
+/// This is the last chunk of our answer (it might have no samples)
+#define NODE_HISTORY_LAST 0x01
+
+/// This sample has the node's SNR
+#define NODE_HISTORY_HAS_SNR 0x01
+/// This sample has the node's position
+#define NODE_HISTORY_HAS_POSITION 0x02
+
+/// One sample, decoded.  Samples without a position carry the last one we had.
+struct NodeHistorySample {
+    uint32_t time;                   // When we heard the node (secs since 1970, by our clock)
+    int32_t latitude_i, longitude_i; // As in Position, to NODE_HISTORY_POSITION_UNITS
+    int8_t snr;                      // In quarter dB
+    uint8_t flags;                   // NODE_HISTORY_HAS_SNR, NODE_HISTORY_HAS_POSITION
+} __attribute__((packed));
+
+/// Where a client's answer (see NODE_HISTORY_PORTNUM) is up to
+struct NodeHistoryCursor {
+    NodeNum node;        // The node they asked for, 0 for all of them
+    uint32_t sinceSecs;  // What they asked for
+    size_t slot;         // If they asked for all of our nodes, the one we are sending
+    uint32_t nextSecs;   // Our next sample for this node is the first since then...
+    size_t skip;         // ...after this many of those (we already sent them)
+    bool done;
+};
+
+/**
+ * A compact history of each node's SNR, position and when we heard it, so our screen and clients can show link trends and
+ * tracks (NodeInfo only holds the latest of each).
+ *
+ * A full Position per sample would be far too big, so every sample is a small record in one ring we share between all our
+ * nodes: a byte with the node's slot in our table and which values the sample has, then each value as a varint of its change
+ * since that node's previous sample (seconds since, quarter dB, and latitude and longitude in NODE_HISTORY_POSITION_UNITS).
+ * A node we hear every few minutes costs 3 or 4 bytes a sample, one on the move 6 to 10.  Once the ring is full each new
+ * sample overwrites the oldest ones, whoever they were for.
+ *
+ * For each node we keep the values its deltas start from (the values before its oldest sample still in the ring, which move
+ * on as we overwrite its samples) and its newest values (which its next delta is from).  Reading a node's samples walks the
+ * whole ring, which is only a few KB and only happens when the screen or a client asks.
+ */
+class NodeHistory
+{
+    /// What we know of one node's samples
+    struct Track {
+        NodeNum num; // 0 for a free slot
+        uint16_t numSamples;
+        uint32_t lastPositionTime; // When we last added a position for them
+
+        // The values before its oldest sample in our ring, and its newest values
+        uint32_t baseTime, lastTime;
+        int32_t baseLat, baseLon, lastLat, lastLon; // In NODE_HISTORY_POSITION_UNITS
+        int8_t baseSnr, lastSnr;
+    };
+
+    Track tracks[NODE_HISTORY_MAX_NODES] = {};
+
+    uint8_t ring[NODE_HISTORY_RING_LEN];
+    size_t head = 0; // Where our next record goes
+    size_t used = 0; // Our records are the used bytes before head
+
+  public:
+    /// We heard from node n at time (secs since 1970), its SNR (dB) is now snr
+    void onHeard(NodeNum n, uint32_t time, float snr);
+
+    /// Node n reported this position (Position.latitude_i and longitude_i) at time
+    void onPosition(NodeNum n, uint32_t time, int32_t latitude_i, int32_t longitude_i);
+
+    /// How many samples we have for node n
+    size_t getNumSamples(NodeNum n) const;
+
+    /**
+     * Decode node n's samples (oldest first) into out
+     *
+     * @param sinceSecs only its samples since then
+     * @param skip leave out this many of those first
+     * @return how many samples we decoded (less than maxSamples once we have read all of them)
+     */
+    size_t read(NodeNum n, uint32_t sinceSecs, size_t skip, NodeHistorySample *out, size_t maxSamples) const;
+
+    /// Fill payload with our next chunk of c's answer (see NODE_HISTORY_PORTNUM) @return its length
+    size_t readChunk(NodeHistoryCursor &c, uint8_t *payload, size_t maxLen) const;
+
+    /// Forget everything (i.e. on a factory reset)
+    void clear();
+
+  private:
+    /// The track for n, if we don't have one we start one at time (forgetting our least recently heard node if we have to)
+    Track *findTrack(NodeNum n, uint32_t time);
+
+    /// Add a sample for t, with only the values in flags changed
+    void addSample(Track *t, uint32_t time, uint8_t flags, int8_t snr, int32_t lat, int32_t lon);
+
+    /// Overwrite our oldest record, moving its node's base values on past it
+    void dropOldest();
+
+    /// Mark all of slot's records as belonging to nobody (we are giving the slot to another node)
+    void orphanRecords(size_t slot);
+};
+
+extern NodeHistory nodeHistory;
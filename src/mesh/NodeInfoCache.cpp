@@ -0,0 +1,51 @@
+#include "NodeInfoCache.h"
+#include "LargeAlloc.h"
+#include "configuration.h"
+#include <string.h>
+
+NodeInfoCache nodeInfoCache;
+
+size_t NodeInfoCache::read(size_t x, NodeNum num, uint32_t generation, uint8_t *buf)
+{
+    const Entry *e = entries && x < MAX_NUM_NODES ? &entries[x] : NULL;
+    if (!e || !e->len || e->num != num || e->generation != generation) {
+        misses++;
+        return 0;
+    }
+
+    memcpy(buf, e->bytes, e->len);
+    hits++;
+    return e->len;
+}
+
+void NodeInfoCache::write(size_t x, NodeNum num, uint32_t generation, const uint8_t *bytes, size_t len)
+{
+    if (x >= MAX_NUM_NODES || !len || len > sizeof(entries[0].bytes))
+        return;
+
+    if (!entries) {
+        if (allocFailed)
+            return;
+
+        entries = (Entry *)largeAlloc(MAX_NUM_NODES * sizeof(Entry));
+        if (!entries) {
+            LOG_WARN(MESH, "No memory for our NodeInfo cache, encoding every time\n");
+            allocFailed = true;
+            return;
+        }
+        clear();
+    }
+
+    Entry &e = entries[x];
+    e.num = num;
+    e.generation = generation;
+    e.len = len;
+    memcpy(e.bytes, bytes, len);
+}
+
+void NodeInfoCache::clear()
+{
+    if (entries)
+        for (size_t x = 0; x < MAX_NUM_NODES; x++)
+            entries[x].len = 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "mesh-pb-constants.h"
+
+/**
+ * The FromRadio records we last encoded for each node in our DB, so sending the node DB to a phone is mostly memcpy.
+ *
+ * Entries are direct mapped by the node's index in NodeDB, and only match if the node number and the NodeDB generation it
+ * had when we encoded it are the same, so any change to a node (which always bumps its generation) or shuffling of the DB
+ * makes its entry a miss.  NodeDB clears us whenever it forgets or reloads its nodes, because nodes loaded from flash all
+ * start with generation 0.
+ *
+ * Our entries are allocated (with largeAlloc) the first time we store one.
+ */
+class NodeInfoCache
+{
+    struct Entry {
+        NodeNum num;
+        uint32_t generation;
+        uint16_t len; // 0 if the entry is empty
+        uint8_t bytes[FromRadio_size];
+    };
+
+    Entry *entries = NULL;
+    bool allocFailed = false;
+
+    uint32_t hits = 0, misses = 0;
+
+  public:
+    /// Copy our encoded FromRadio for the node at index x of NodeDB into buf (of at least FromRadio_size bytes)
+    /// @return its length, or 0 if we don't have it for that node and generation
+    size_t read(size_t x, NodeNum num, uint32_t generation, uint8_t *buf);
+
+    /// Remember the encoded FromRadio for the node at index x of NodeDB
+    void write(size_t x, NodeNum num, uint32_t generation, const uint8_t *bytes, size_t len);
+
+    /// Forget everything
+    void clear();
+
+    uint32_t getHits() const { return hits; }
+    uint32_t getMisses() const { return misses; }
+};
+
+extern NodeInfoCache nodeInfoCache;
@@ -0,0 +1,127 @@
+#include "NoiseMonitor.h"
+#include "ChannelSurvey.h"
+#include "configuration.h"
+
+NoiseMonitor *noiseMonitor;
+
+/// Move avg 1/2^NOISE_EWMA_SHIFT of the way towards sample
+static int32_t ewma(int32_t avg, int32_t sample)
+{
+    return avg + (sample - avg) / (1 << NOISE_EWMA_SHIFT);
+}
+
+NoiseMonitor::NoiseMonitor(RadioInterface *radio)
+    : concurrency::OSThread("NoiseMonitor", NOISE_SAMPLE_INTERVAL_MSEC), radio(radio)
+{
+    setSlack(NOISE_SAMPLE_SLACK_MSEC);
+}
+
+int32_t NoiseMonitor::runOnce()
+{
+    checkPreamble(millis());
+
+    ChannelSample sample;
+    uint8_t channel = radio->getChannel();
+    if (!radio->surveyChannel(channel, sample))
+        return NOISE_SAMPLE_RETRY_MSEC;
+
+    int32_t busy = sample.busy ? 10000 : 0;
+    stats.busy = stats.numSamples ? ewma(stats.busy, busy) : busy;
+    stats.numSamples++;
+
+    // A busy sample's RSSI is someone's signal rather than the noise floor, and their frame should follow
+    if (sample.busy)
+        onPreamble();
+    else if (sample.rssi)
+        addNoise((int32_t)sample.rssi * 16);
+
+    if (channelSurvey)
+        channelSurvey->addSample(channel, sample);
+
+    return NOISE_SAMPLE_INTERVAL_MSEC;
+}
+
+void NoiseMonitor::onPreamble()
+{
+    uint32_t now = millis();
+    checkPreamble(now);
+
+    preambleDeadlineMsec = now + radio->getPacketTime((uint32_t)MAX_RHPACKETLEN);
+    preamblePending = true;
+}
+
+void NoiseMonitor::onLostFrame()
+{
+    stats.preamblesLost++;
+}
+
+void NoiseMonitor::onFrame()
+{
+    preamblePending = false;
+}
+
+void NoiseMonitor::onCrcError()
+{
+    stats.crcErrors++;
+}
+
+void NoiseMonitor::onGoodFrame(float snr, float rssi)
+{
+    if (snr > NOISE_FRAME_MAX_SNR_DB)
+        return;
+
+    stats.numFrameNoise++;
+    addNoise((int32_t)((rssi - snr) * 16));
+}
+
+void NoiseMonitor::addNoise(int32_t noise)
+{
+    if (!stats.noiseFloor)
+        stats.noiseFloor = stats.baseline = noise;
+    else {
+        stats.noiseFloor = ewma(stats.noiseFloor, noise);
+        stats.baseline = stats.noiseFloor <= stats.baseline ? stats.noiseFloor : stats.baseline + NOISE_BASELINE_RISE;
+    }
+
+    // Once interfered we stay so until our floor is back within half of NOISE_INTERFERENCE_DB, so we don't flap at the edge
+    int32_t rise = stats.noiseFloor - stats.baseline;
+    bool nowInterfered = interfered ? rise >= NOISE_INTERFERENCE_DB * 16 / 2 : rise >= NOISE_INTERFERENCE_DB * 16;
+    if (nowInterfered == interfered)
+        return;
+
+    uint32_t now = millis();
+    interfered = nowInterfered;
+    if (interfered) {
+        interferedStartMsec = now;
+        LOG_WARN(RADIO, "Interference: our noise floor is %d dBm, %d dB above normal\n", stats.noiseFloor / 16,
+                 (stats.noiseFloor - stats.baseline) / 16);
+    } else {
+        stats.interferedMsec += now - interferedStartMsec;
+        LOG_INFO(RADIO, "Interference over after %u secs, our noise floor is %d dBm\n", (now - interferedStartMsec) / 1000,
+                 stats.noiseFloor / 16);
+    }
+}
+
+float NoiseMonitor::getNoiseRiseDb() const
+{
+    return stats.noiseFloor > stats.baseline ? (stats.noiseFloor - stats.baseline) / 16.0f : 0;
+}
+
+void NoiseMonitor::checkPreamble(uint32_t now)
+{
+    if (preamblePending && (int32_t)(now - preambleDeadlineMsec) >= 0) {
+        preamblePending = false;
+        stats.preamblesLost++;
+    }
+}
+
+NoiseStats NoiseMonitor::getStats()
+{
+    uint32_t now = millis();
+    checkPreamble(now);
+
+    NoiseStats s = stats;
+    if (interfered)
+        s.interferedMsec += now - interferedStartMsec;
+    return s;
+}
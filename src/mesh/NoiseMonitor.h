@@ -0,0 +1,118 @@
+#pragma once
+
+#include "RadioInterface.h"
+#include "concurrency/OSThread.h"
+
+/// How often we sample our own channel while our radio is idle
+#ifndef NOISE_SAMPLE_INTERVAL_MSEC
+#define NOISE_SAMPLE_INTERVAL_MSEC (30 * 1000L)
+#endif
+
+/// How late a sample may be, so it can share a wakeup with something else we do (see OSThread::setSlack)
+#ifndef NOISE_SAMPLE_SLACK_MSEC
+#define NOISE_SAMPLE_SLACK_MSEC (15 * 1000L)
+#endif
+
+/// If our radio was busy we try again this soon
+#define NOISE_SAMPLE_RETRY_MSEC 1000
+
+/// Each new sample moves our averages 1/2^NOISE_EWMA_SHIFT of the way towards it
+#define NOISE_EWMA_SHIFT 3
+
+/// Frames we hear with a better SNR than this say little about our noise floor (radios report the SNR of strong signals as
+/// no better than about +10 dB, so their RSSI minus SNR is far above the real noise)
+#define NOISE_FRAME_MAX_SNR_DB 5
+
+/// Our noise floor this far above its baseline means something is interfering with us
+#ifndef NOISE_INTERFERENCE_DB
+#define NOISE_INTERFERENCE_DB 6
+#endif
+
+/// Our baseline follows our noise floor down at once, but up by only this much (in 1/16 dB) per sample, so interference has
+/// to last for hours before it becomes our new normal
+#define NOISE_BASELINE_RISE 1
+
+/// What we know about the RF environment on our channel
+struct NoiseStats {
+    int16_t noiseFloor;      // Average RSSI when nobody was sending, in 1/16 dBm, 0 if we have no samples
+    int16_t baseline;        // Our quietest recent noise floor, in 1/16 dBm
+    uint16_t busy;           // How often our idle samples heard a preamble, in hundredths of a percent
+    uint32_t numSamples;     // Idle samples we took
+    uint32_t numFrameNoise;  // Frames we estimated the noise floor from (RSSI minus SNR)
+    uint32_t crcErrors;      // Frames whose header we got but whose payload was corrupt (usually collisions)
+    uint32_t preamblesLost;  // Preambles (or frame headers) we heard which no frame followed
+    uint32_t interferedMsec; // How long our noise floor has been NOISE_INTERFERENCE_DB above our baseline
+};
+
+/**
+ * Watches the RF environment on our channel between packets, so we (and whoever diagnoses a site) can tell collisions from
+ * interference.
+ *
+ * addReceiveMetadata() only records how well we heard the packets we decoded.  So every NOISE_SAMPLE_INTERVAL_MSEC, while
+ * our radio is idle, we run a channel activity detection and (on chips which can) read the instantaneous RSSI on our own
+ * channel, the same quick look ChannelSurvey takes at other channels.  Frames we hear weakly add another estimate (their RSSI
+ * minus their SNR), which is all we have on chips without an instantaneous RSSI.  Both feed an average noise floor, and a
+ * slowly rising baseline of our quietest floor.
+ *
+ * Our radio also tells us about frames which failed their CRC (a header survived, so usually another of our frames collided
+ * with it) and preambles which never became a frame (weak, collided, or not from our mesh).
+ *
+ * While our floor is NOISE_INTERFERENCE_DB over its baseline we are being interfered with: corrupt frames then don't grow our
+ * contention window (backing off doesn't help against a noisy appliance), NeighborTable adds the rise to its ADR margins, and
+ * we log when it starts and ends.  Our samples of our own channel also go to ChannelSurvey, if we have one.  Everything is in
+ * our metrics.
+ */
+class NoiseMonitor : private concurrency::OSThread
+{
+    RadioInterface *radio;
+
+    NoiseStats stats = {};
+
+    /// While we are waiting for the frame a preamble we heard should become, millis() when we give up on it
+    uint32_t preambleDeadlineMsec = 0;
+    bool preamblePending = false;
+
+    /// millis() when our interference started (valid if interfered)
+    uint32_t interferedStartMsec = 0;
+    bool interfered = false;
+
+  public:
+    explicit NoiseMonitor(RadioInterface *radio);
+
+    RadioInterface *getRadio() const { return radio; }
+
+    /// Our radio heard a preamble (or the start of a frame), a frame should follow within one packet time
+    void onPreamble();
+
+    /// Our radio started receiving a frame which then vanished without a receive interrupt
+    void onLostFrame();
+
+    /// Our radio received a frame (intact or not)
+    void onFrame();
+
+    /// Our radio received a frame with a valid header but a corrupt payload
+    void onCrcError();
+
+    /// Our radio received and decoded a frame with this SNR (dB) and RSSI (dBm)
+    void onGoodFrame(float snr, float rssi);
+
+    /// Is something interfering with us (our noise floor is NOISE_INTERFERENCE_DB over its baseline)?
+    bool isInterfered() const { return interfered; }
+
+    /// How far (in dB) our noise floor is above its baseline
+    float getNoiseRiseDb() const;
+
+    NoiseStats getStats();
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    /// Add an estimate of our noise floor (in 1/16 dBm)
+    void addNoise(int32_t noise);
+
+    /// Count our pending preamble as lost if its frame is overdue
+    void checkPreamble(uint32_t now);
+};
+
+extern NoiseMonitor *noiseMonitor;
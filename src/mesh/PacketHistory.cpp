@@ -4,8 +4,11 @@
 
 PacketHistory::PacketHistory()
 {
-    recentPackets.reserve(MAX_NUM_NODES); // Prealloc the worst case # of records - to prevent heap fragmentation
-                                          // setup our periodic task
+    static_assert((PACKET_HISTORY_SIZE & (PACKET_HISTORY_SIZE - 1)) == 0, "PACKET_HISTORY_SIZE must be a power of two");
+
+    memset(recentPackets, 0, sizeof(recentPackets));
+    memset(bucketCounts, 0, sizeof(bucketCounts));
+    lastEpoch = getEpoch();
 }
 
 /**
@@ -14,40 +17,195 @@ PacketHistory::PacketHistory()
 bool PacketHistory::wasSeenRecently(const MeshPacket *p, bool withUpdate)
 {
     if (p->id == 0) {
-        DEBUG_MSG("Ignoring message with zero id\n");
+        LOG_DEBUG(MESH, "Ignoring message with zero id\n");
         return false; // Not a floodable message ID, so we don't care
     }
 
-    uint32_t now = millis();
-    for (size_t i = 0; i < recentPackets.size();) {
+    uint32_t epoch = getEpoch();
+    expireBuckets(epoch);
+
+    uint16_t now = epoch; // All records are within FLOOD_EXPIRE_BUCKETS of now, so the low bits are all we need
+    sweep(now);
+
+    // Walk our probe chain looking for this packet, while remembering where we could put it if it isn't found
+    size_t home = hashSlot(p->from, p->id);
+    int reusable = -1, oldest = -1;
+    for (size_t n = 0; n < PACKET_HISTORY_MAX_PROBE; n++) {
+        size_t i = (home + n) & (PACKET_HISTORY_SIZE - 1);
         PacketRecord &r = recentPackets[i];
 
-        if ((now - r.rxTimeMsec) >= FLOOD_EXPIRE_TIME) {
-            // DEBUG_MSG("Deleting old broadcast record %d\n", i);
-            recentPackets.erase(recentPackets.begin() + i); // delete old record
-        } else {
-            if (r.id == p->id && r.sender == p->from) {
-                DEBUG_MSG("Found existing packet record for fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
+        if (!r.used) {
+            if (reusable < 0)
+                reusable = i;
+            break; // End of the chain, so this packet can't be in the table
+        }
+
+        bool expired = isExpired(r, now);
+        if (r.id == p->id && r.sender == p->from) {
+            if (!expired) {
+                LOG_DEBUG(MESH, "Found existing packet record for fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
+                numHits++;
+                onDuplicate(p);
 
                 // Update the time on this record to now
-                if (withUpdate)
-                    r.rxTimeMsec = now;
+                if (withUpdate) {
+                    forgetRecord(r, now);
+                    touchRecord(r, now);
+                }
                 return true;
             }
 
-            i++;
+            reusable = i; // An old record for this same packet, best to reuse it
+            break;
         }
+
+        if (expired) {
+            if (reusable < 0)
+                reusable = i;
+        } else if (oldest < 0 || (uint16_t)(now - r.epoch) > (uint16_t)(now - recentPackets[oldest].epoch))
+            oldest = i;
     }
 
     // Didn't find an existing record, make one
     if (withUpdate) {
-        PacketRecord r;
+        if (reusable < 0) {
+            // Our table is too full near this hash position, throw away the oldest record we saw
+            reusable = oldest;
+            numEvictions++;
+            LOG_WARN(MESH, "Warning: packet history full, evicting a record (evictions=%u)\n", numEvictions);
+        }
+
+        PacketRecord &r = recentPackets[reusable];
+        if (r.used)
+            forgetRecord(r, now);
+
         r.id = p->id;
         r.sender = p->from;
-        r.rxTimeMsec = now;
-        recentPackets.push_back(r);
-        printPacket("Adding packet record", p);
+        r.used = true;
+        touchRecord(r, now);
+        LOG_PACKET(MESH, "Adding packet record", p);
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+size_t PacketHistory::saveRecords(SavedPacketRecord *out, size_t maxOut)
+{
+    uint32_t epoch = getEpoch();
+    expireBuckets(epoch);
+    uint16_t now = epoch;
+
+    // A pass per bucket, so if we run out of room it is the records which would expire soonest we leave behind
+    size_t n = 0;
+    for (uint16_t age = 0; age < FLOOD_EXPIRE_BUCKETS; age++)
+        for (size_t i = 0; i < PACKET_HISTORY_SIZE; i++) {
+            const PacketRecord &r = recentPackets[i];
+            if (!r.used || (uint16_t)(now - r.epoch) != age)
+                continue;
+            if (n == maxOut)
+                return n;
+            out[n++] = {r.sender, r.id, (uint32_t)(age * FLOOD_EXPIRE_BUCKET_MSEC)};
+        }
+
+    return n;
+}
+
+void PacketHistory::restoreRecord(const SavedPacketRecord &r, uint32_t sleptMsec)
+{
+    uint32_t ageBuckets = (r.ageMsec + sleptMsec) / FLOOD_EXPIRE_BUCKET_MSEC;
+    if (ageBuckets >= FLOOD_EXPIRE_BUCKETS)
+        return;
+
+    MeshPacket p = MeshPacket_init_zero;
+    p.from = r.sender;
+    p.id = r.id;
+    if (wasSeenRecently(&p))
+        return;
+
+    // wasSeenRecently() stamped it as seen now, backdate it to when we really saw it (before our epochs restarted at boot)
+    uint16_t now = getEpoch();
+    for (size_t n = 0, i = hashSlot(r.sender, r.id); n < PACKET_HISTORY_MAX_PROBE; n++, i = (i + 1) & (PACKET_HISTORY_SIZE - 1)) {
+        PacketRecord &rec = recentPackets[i];
+        if (rec.used && rec.sender == r.sender && rec.id == r.id) {
+            forgetRecord(rec, now);
+            touchRecord(rec, now - ageBuckets);
+            return;
+        }
+    }
+}
+
+/// Move the counts of any buckets that have aged out into numExpired
+void PacketHistory::expireBuckets(uint32_t now)
+{
+    uint32_t elapsed = now - lastEpoch;
+    lastEpoch = now;
+
+    if (elapsed >= FLOOD_EXPIRE_BUCKETS) {
+        // It has been a long time (or millis() rolled over), everything has expired so just start over
+        memset(recentPackets, 0, sizeof(recentPackets));
+        memset(bucketCounts, 0, sizeof(bucketCounts));
+        numExpired = 0;
+        return;
+    }
+
+    // The buckets for epochs (lastEpoch - NUM, now - NUM] have just aged out
+    for (uint32_t e = now - elapsed + 1; elapsed > 0; e++, elapsed--) {
+        uint16_t &count = bucketCounts[e % FLOOD_EXPIRE_BUCKETS];
+        numExpired += count;
+        count = 0;
+    }
+}
+
+/// Remove a used record from our bucket accounting (because it is about to be replaced or deleted)
+void PacketHistory::forgetRecord(const PacketRecord &r, uint16_t now)
+{
+    if (isExpired(r, now)) {
+        assert(numExpired > 0);
+        numExpired--;
+    } else {
+        uint16_t &count = bucketCounts[r.epoch % FLOOD_EXPIRE_BUCKETS];
+        assert(count > 0);
+        count--;
+    }
+}
+
+/// Stamp r as seen in the current epoch
+void PacketHistory::touchRecord(PacketRecord &r, uint16_t now)
+{
+    r.epoch = now;
+    bucketCounts[now % FLOOD_EXPIRE_BUCKETS]++;
+}
+
+/// Empty a slot, shifting back any records in the same probe chain so lookups never need tombstones
+void PacketHistory::removeSlot(size_t i)
+{
+    const size_t mask = PACKET_HISTORY_SIZE - 1;
+
+    for (size_t j = (i + 1) & mask; recentPackets[j].used; j = (j + 1) & mask) {
+        size_t k = hashSlot(recentPackets[j].sender, recentPackets[j].id);
+
+        // If the home slot k lies cyclically in (i, j] then the record at j can stay where it is
+        bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            recentPackets[i] = recentPackets[j];
+            i = j;
+        }
+    }
+
+    recentPackets[i].used = false;
+}
+
+/// Free a few slots which are holding expired records
+void PacketHistory::sweep(uint16_t now)
+{
+    for (size_t n = 0; numExpired > 0 && n < PACKET_HISTORY_SWEEP_STEP; n++) {
+        PacketRecord &r = recentPackets[sweepPos];
+
+        if (r.used && isExpired(r, now)) {
+            // DEBUG_MSG("Deleting old broadcast record %d\n", sweepPos);
+            numExpired--;
+            removeSlot(sweepPos); // Note: another record might have shifted into sweepPos, so we look at it again next time
+        } else
+            sweepPos = (sweepPos + 1) & (PACKET_HISTORY_SIZE - 1);
+    }
+}
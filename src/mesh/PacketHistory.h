@@ -1,62 +1,68 @@
 #pragma once
 
 #include "Router.h"
-#include <queue>
-#include <unordered_set>
 
 using namespace std;
 
 /// We clear our old flood record five minute after we see the last of it
 #define FLOOD_EXPIRE_TIME (5 * 60 * 1000L)
 
+/// We age records in coarse buckets, a record expires somewhere between (NUM-1)/NUM and 1 FLOOD_EXPIRE_TIME after we last saw it
+#define FLOOD_EXPIRE_BUCKETS 8
+#define FLOOD_EXPIRE_BUCKET_MSEC (FLOOD_EXPIRE_TIME / FLOOD_EXPIRE_BUCKETS)
+
+/// Max number of packet records we can hold, must be a power of two.  Set by our MeshProfile, or override per deployment (see
+/// getNumEvictions())
+#ifndef PACKET_HISTORY_SIZE
+#define PACKET_HISTORY_SIZE (meshProfile.packetHistory)
+#endif
+
+/// A record is always stored within this many slots of its hash position
+#define PACKET_HISTORY_MAX_PROBE 16
+
+/// How many slots we check for expired records each time wasSeenRecently() is called (while we know some have expired)
+#define PACKET_HISTORY_SWEEP_STEP 4
+
 /**
  * A record of a recent message broadcast
  */
 struct PacketRecord {
     NodeNum sender;
     PacketId id;
-    uint32_t rxTimeMsec; // Unix time in msecs - the time we received it
+    uint16_t epoch; // The expiry bucket (millis() / FLOOD_EXPIRE_BUCKET_MSEC) when we last saw this packet
+    bool used;
 
     bool operator==(const PacketRecord &p) const { return sender == p.sender && id == p.id; }
 };
 
-class PacketRecordHashFunction
-{
-  public:
-    size_t operator()(const PacketRecord &p) const { return (hash<NodeNum>()(p.sender)) ^ (hash<PacketId>()(p.id)); }
-};
-
-/// Order packet records by arrival time, we want the oldest packets to be in the front of our heap
-class PacketRecordOrderFunction
-{
-  public:
-    size_t operator()(const PacketRecord &p1, const PacketRecord &p2) const
-    {
-        // If the timer ticks have rolled over the difference between times will be _enormous_.  Handle that case specially
-        uint32_t t1 = p1.rxTimeMsec, t2 = p2.rxTimeMsec;
-
-        if (t1 - t2 > UINT32_MAX / 2) {
-            // time must have rolled over, swap them because the new little number is 'bigger' than the old big number
-            t1 = t2;
-            t2 = p1.rxTimeMsec;
-        }
-
-        return t1 > t2;
-    }
-};
-
 /**
  * This is a mixin that adds a record of past packets we have seen
+ *
+ * Records are kept in a fixed size open addressing (linear probing) hash table keyed on (sender, id).  Expired records are
+ * treated as absent on lookup and can be overwritten in place by new records.  We also keep a count of how many records were
+ * last seen in each expiry bucket, so when a bucket ages out we know how many slots are reclaimable and incrementally sweep
+ * them out of the table (a few slots per call) to keep probe chains short.  Lookup, insert and expiry are all O(1)
+ * amortized and we never touch the heap.
  */
 class PacketHistory
 {
   private:
-    /** FIXME: really should be a std::unordered_set with the key being sender,id.
-     * This would make checking packets in wasSeenRecently faster.
-     */
-    vector<PacketRecord> recentPackets;
-    // priority_queue<PacketRecord, vector<PacketRecord>, PacketRecordOrderFunction> arrivalTimes;
-    // unordered_set<PacketRecord, PacketRecordHashFunction> recentPackets;
+    PacketRecord recentPackets[PACKET_HISTORY_SIZE];
+
+    /// The number of live (not yet expired) records last seen in each expiry bucket
+    uint16_t bucketCounts[FLOOD_EXPIRE_BUCKETS];
+
+    /// The number of records which have expired but are still occupying slots in our table
+    uint16_t numExpired = 0;
+
+    /// The most recent epoch we've processed bucket expiry for
+    uint32_t lastEpoch;
+
+    /// Our position in the table for incremental sweeping of expired records
+    uint16_t sweepPos = 0;
+
+    /// Debugging counts
+    uint32_t numHits = 0, numEvictions = 0;
 
   public:
     PacketHistory();
@@ -67,4 +73,46 @@ class PacketHistory
      * @param withUpdate if true and not found we add an entry to recentPackets
      */
     bool wasSeenRecently(const MeshPacket *p, bool withUpdate = true);
+
+    /// The number of times wasSeenRecently found a duplicate
+    uint32_t getNumHits() const { return numHits; }
+
+    /// The number of records we had to discard before they expired because our table was full.  If this is climbing you
+    /// should increase PACKET_HISTORY_SIZE
+    uint32_t getNumEvictions() const { return numEvictions; }
+
+    /// Copy up to maxOut of our unexpired records into out, most recently seen first @return the number copied
+    size_t saveRecords(SavedPacketRecord *out, size_t maxOut);
+
+    /// Add a record saved by saveRecords(), sleptMsec after it was saved (records which have expired since are ignored)
+    void restoreRecord(const SavedPacketRecord &r, uint32_t sleptMsec);
+
+  protected:
+    /// Called by wasSeenRecently() each time it finds we have already seen p
+    virtual void onDuplicate(const MeshPacket *p) {}
+
+  private:
+    static uint32_t getEpoch() { return millis() / FLOOD_EXPIRE_BUCKET_MSEC; }
+
+    static size_t hashSlot(NodeNum sender, PacketId id) { return (sender * 2654435761u ^ id) & (PACKET_HISTORY_SIZE - 1); }
+
+    bool isExpired(const PacketRecord &r, uint16_t now) const
+    {
+        return (uint16_t)(now - r.epoch) >= FLOOD_EXPIRE_BUCKETS;
+    }
+
+    /// Move the counts of any buckets that have aged out into numExpired
+    void expireBuckets(uint32_t now);
+
+    /// Remove a used record from our bucket accounting (because it is about to be replaced or deleted)
+    void forgetRecord(const PacketRecord &r, uint16_t now);
+
+    /// Stamp r as seen in the current epoch
+    void touchRecord(PacketRecord &r, uint16_t now);
+
+    /// Empty a slot, shifting back any records in the same probe chain so lookups never need tombstones
+    void removeSlot(size_t i);
+
+    /// Free a few slots which are holding expired records
+    void sweep(uint16_t now);
 };
@@ -0,0 +1,103 @@
+#include "PacketTrace.h"
+#include "concurrency/LockGuard.h"
+
+PacketTrace packetTrace;
+
+uint32_t TraceHistogram::getPercentileUsec(uint8_t percent) const
+{
+    uint64_t wanted = ((uint64_t)count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < PACKET_TRACE_NUM_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return min((uint32_t)PACKET_TRACE_MIN_USEC << i, maxUsec);
+    }
+
+    return maxUsec; // In our open ended last bucket
+}
+
+void TraceHistogram::add(uint32_t usec)
+{
+    size_t bucket = 0;
+    while (bucket < PACKET_TRACE_NUM_BUCKETS - 1 && usec >= ((uint32_t)PACKET_TRACE_MIN_USEC << bucket))
+        bucket++;
+    buckets[bucket]++;
+    count++;
+    totalUsec += usec;
+    if (usec > maxUsec)
+        maxUsec = usec;
+}
+
+PacketTrace::PacketTrace()
+{
+    // id 0 is never a valid packet id, so these entries won't match anything
+    memset(entries, 0, sizeof(entries));
+    memset(histograms, 0, sizeof(histograms));
+}
+
+void PacketTrace::begin(const MeshPacket *p, bool isTx, uint32_t startUsec)
+{
+    concurrency::LockGuard g(&lock);
+
+    int i = indexOf(p->from, p->id, isTx);
+    if (i < 0) {
+        i = next;
+        next = (next + 1) % PACKET_TRACE_SIZE;
+    }
+
+    entries[i] = {p->from, p->id, isTx, (uint8_t)(isTx ? TRACE_TX_ENCODE : TRACE_RX_RADIO), startUsec};
+}
+
+void PacketTrace::mark(NodeNum from, PacketId id, TraceStage stage, uint32_t atUsec)
+{
+    bool isTx = stage >= TRACE_TX_ENCODE;
+
+    concurrency::LockGuard g(&lock);
+
+    int i = indexOf(from, id, isTx);
+    if (i < 0)
+        return; // Not a packet we are following
+    Entry &e = entries[i];
+
+    if (stage < e.stage)
+        return; // Already done (i.e. a copy of this packet for another phone client or interface)
+
+    int32_t elapsed = atUsec - e.lastUsec;
+    if (elapsed < 0)
+        elapsed = 0; // atUsec was before the packet reached this stage (i.e. our transmit timer was already running)
+    else if ((uint32_t)elapsed > PACKET_TRACE_TIMEOUT_USEC) {
+        e.id = 0; // The packet sat somewhere too long for this to be a meaningful latency, forget it
+        return;
+    }
+
+    histograms[stage].add(elapsed);
+
+    e.lastUsec += elapsed;
+    e.stage = stage + 1;
+    if (stage == TRACE_RX_PHONE || stage == TRACE_TX_AIR)
+        e.id = 0; // The end of the line
+}
+
+TraceHistogram PacketTrace::getHistogram(TraceStage stage)
+{
+    concurrency::LockGuard g(&lock);
+    return histograms[stage];
+}
+
+int PacketTrace::indexOf(NodeNum from, PacketId id, bool isTx) const
+{
+    for (size_t i = 0; i < PACKET_TRACE_SIZE; i++) {
+        const Entry &e = entries[i];
+        if (e.id && e.id == id && e.from == from && e.isTx == isTx)
+            return i;
+    }
+
+    return -1;
+}
+
+const char *PacketTrace::getStageName(TraceStage stage)
+{
+    static const char *const names[TRACE_NUM_STAGES] = {"rxRadio",  "rxQueue", "rxDecode", "rxPlugins", "rxToPhone",
+                                                        "rxPhone",  "txEncode", "txQueue", "txTimer",   "txAir"};
+    return stage < TRACE_NUM_STAGES ? names[stage] : "?";
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "concurrency/Lock.h"
+
+/// How many packets we can follow through our stages at once (the oldest trace is dropped to make room)
+#ifndef PACKET_TRACE_SIZE
+#define PACKET_TRACE_SIZE 16
+#endif
+
+/// A packet which hasn't reached its next stage after this long is no longer followed (i.e. no phone is reading them)
+#define PACKET_TRACE_TIMEOUT_USEC (60 * 1000000UL)
+
+/// Our histograms have power of 2 buckets, the first covers everything up to this and the last everything beyond
+#define PACKET_TRACE_MIN_USEC 128
+#define PACKET_TRACE_NUM_BUCKETS 16
+
+/**
+ * The stages a packet passes through, each one's histogram records the time since the packet left the previous stage.  Stages
+ * a packet skips (i.e. plugins for packets which aren't data) are counted in the next stage it reaches.
+ *
+ * The order is part of the LatencyStatsPlugin wire format, only add to the end.
+ */
+enum TraceStage {
+    // Received packets, traced from our rx interrupt
+    TRACE_RX_RADIO,   // Until the radio thread read the frame and queued the packet in fromRadioQueue
+    TRACE_RX_QUEUE,   // Waiting in fromRadioQueue for Router::runOnce
+    TRACE_RX_DECODE,  // Decrypting and decoding
+    TRACE_RX_PLUGINS, // Until callPlugins returned
+    TRACE_RX_TOPHONE, // Until it was queued for our phone API clients
+    TRACE_RX_PHONE,   // Waiting for the first phone API client (BLE, serial, TCP or HTTP) to read it
+
+    // Sent packets, traced from Router::send
+    TRACE_TX_ENCODE,  // Encoding and encrypting
+    TRACE_TX_QUEUE,   // Waiting in an interface's txQueue, until the transmit timer which sent it was started
+    TRACE_TX_TIMER,   // The transmit delay (startTransmitTimer), including any retries because the channel was busy
+    TRACE_TX_AIR,     // On the air, until our tx done interrupt was handled
+
+    TRACE_NUM_STAGES
+};
+
+/// A latency histogram, in usecs
+struct TraceHistogram {
+    uint32_t count;
+    uint32_t maxUsec;
+    uint64_t totalUsec;
+    uint32_t buckets[PACKET_TRACE_NUM_BUCKETS]; // buckets[i] counts times < PACKET_TRACE_MIN_USEC << i (except the last)
+
+    /// Count one time (histograms are zeroed to start)
+    void add(uint32_t usec);
+
+    uint32_t getMeanUsec() const { return count ? totalUsec / count : 0; }
+
+    /// An upper bound on the given percentile (0 to 100), from our buckets
+    uint32_t getPercentileUsec(uint8_t percent) const;
+};
+
+/**
+ * Follows packets as they pass through our rx and tx paths, and keeps a latency histogram for each stage.
+ *
+ * MeshPackets get copied along the way (i.e. for each phone client, or the interfaces they are sent on), so rather than
+ * storing times in the packets we keep a small table of the packets in flight, keyed by (from, id, direction).  Each
+ * tracepoint is one scan of that table, cheap enough to leave enabled everywhere.  If we lose track of a packet (because the
+ * table was full, or it never reached its next stage) we just stop recording it.
+ *
+ * Safe to call from any thread (but not from ISRs: radios pass their interrupt time to beginRx instead).
+ */
+class PacketTrace
+{
+    struct Entry {
+        NodeNum from;
+        PacketId id; // 0 if this entry is free
+        bool isTx;
+        uint8_t stage;     // The next stage we expect (only used to keep our stages in order)
+        uint32_t lastUsec; // micros() when the packet left its last stage
+    };
+
+    Entry entries[PACKET_TRACE_SIZE];
+    size_t next = 0; // Where our next trace goes, we overwrite the oldest
+
+    TraceHistogram histograms[TRACE_NUM_STAGES];
+
+    concurrency::Lock lock;
+
+  public:
+    PacketTrace();
+
+    /// A radio received p, its rx interrupt was at rxIsrUsec
+    void beginRx(const MeshPacket *p, uint32_t rxIsrUsec) { begin(p, false, rxIsrUsec); }
+
+    /// Router::send was called for p (we start again for retransmissions and rebroadcasts)
+    void beginTx(const MeshPacket *p) { begin(p, true, micros()); }
+
+    /// p has finished stage (at atUsec, if it isn't now), the trace ends once the last stage for its direction is done
+    void mark(const MeshPacket *p, TraceStage stage) { mark(p, stage, micros()); }
+    void mark(const MeshPacket *p, TraceStage stage, uint32_t atUsec) { mark(p->from, p->id, stage, atUsec); }
+
+    /// The same, for callers which don't have the packet as a MeshPacket (i.e. it is still encoded)
+    void mark(NodeNum from, PacketId id, TraceStage stage) { mark(from, id, stage, micros()); }
+    void mark(NodeNum from, PacketId id, TraceStage stage, uint32_t atUsec);
+
+    /// A consistent copy of one stage's statistics
+    TraceHistogram getHistogram(TraceStage stage);
+
+    static const char *getStageName(TraceStage stage);
+
+  private:
+    void begin(const MeshPacket *p, bool isTx, uint32_t startUsec);
+
+    int indexOf(NodeNum from, PacketId id, bool isTx) const;
+};
+
+extern PacketTrace packetTrace;
@@ -0,0 +1,115 @@
+#include "PayloadCompression.h"
+#include "configuration.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+ * Our compressed format is a sequence of:
+ *
+ * 0x00 to 0x7f: that ASCII character
+ * 0x80 to 0xfe: dictionary[byte - 0x80]
+ * 0xff: the next byte is a literal (for anything outside of ASCII, i.e. UTF-8)
+ *
+ * The dictionary is part of our wire format, never change existing entries.
+ */
+#define LITERAL_ESCAPE 0xff
+
+static const char *const dictionary[] = {
+    " the ", "the ",  " and ", "ing ",  " you ", " to ",  " of ",  " is ",  " in ",  " for ", " on ",  " it ",  " be ",
+    " are ", " at ",  " we ",  "that",  "this",  "with",  "have",  "what",  "here",  "there", "where", "when",  "going",
+    "will",  "just",  "back",  "home",  "okay",  "thanks", "good", "see ",  "now",   "not",   "can",   "all",   "out",
+    "ing",   "ion",   "ent",   "her",   "for",   "ter",   "was",   "you",   "ere",   "ate",   "ver",
+    "the",   "and",   "th",    "he",    "in",    "er",    "an",    "re",    "on",    "at",    "en",    "nd",    "ti",
+    "es",    "or",    "te",    "of",    "ed",    "is",    "it",    "al",    "ar",    "st",    "to",    "nt",    "ng",
+    "se",    "ha",    "as",    "ou",    "io",    "le",    "ve",    "co",    "me",    "de",    "hi",    "ri",    "ro",
+    "ic",    "ne",    "ea",    "ra",    "ce",    "li",    "ch",    "ll",    "be",    "ma",    "si",    "om",    "ur",
+    "e ",    "s ",    "t ",    "d ",    "n ",    "y ",    "r ",    "o ",    ", ",    ". ",    "? ",    "! ",    " a",
+    " i",    " w",    " s",    " c",    " h",    " m",    " b",    " o",    " t",    " ok",   "lol",   "..."};
+
+#define DICTIONARY_SIZE (sizeof(dictionary) / sizeof(dictionary[0]))
+
+static_assert(DICTIONARY_SIZE <= LITERAL_ESCAPE - 0x80, "Too many dictionary entries for our code space");
+
+bool compressPayload(Data &d)
+{
+    // Our dictionary only helps text
+    if (d.portnum != PortNum_TEXT_MESSAGE_APP)
+        return false;
+
+    const uint8_t *in = d.payload.bytes;
+    size_t inLen = d.payload.size;
+
+    uint8_t out[sizeof(d.payload.bytes)];
+    size_t outLen = 0;
+
+    for (size_t i = 0; i < inLen;) {
+        // Find our longest dictionary match
+        size_t bestLen = 0, best = 0;
+        for (size_t j = 0; j < DICTIONARY_SIZE; j++) {
+            size_t len = strlen(dictionary[j]);
+            if (len > bestLen && len <= inLen - i && memcmp(in + i, dictionary[j], len) == 0) {
+                bestLen = len;
+                best = j;
+            }
+        }
+
+        size_t needed = bestLen || in[i] < 0x80 ? 1 : 2;
+        if (outLen + needed >= inLen)
+            return false; // Not worth it
+
+        if (bestLen) {
+            out[outLen++] = 0x80 + best;
+            i += bestLen;
+        } else {
+            if (in[i] >= 0x80)
+                out[outLen++] = LITERAL_ESCAPE;
+            out[outLen++] = in[i++];
+        }
+    }
+
+    memcpy(d.payload.bytes, out, outLen);
+    d.payload.size = outLen;
+    d.portnum = COMPRESSED_TEXT_PORTNUM;
+    return true;
+}
+
+bool decompressPayload(Data &d)
+{
+    if (d.portnum != COMPRESSED_TEXT_PORTNUM)
+        return true; // Not compressed
+
+    const uint8_t *in = d.payload.bytes;
+    size_t inLen = d.payload.size;
+
+    uint8_t out[sizeof(d.payload.bytes)];
+    size_t outLen = 0;
+
+    for (size_t i = 0; i < inLen; i++) {
+        uint8_t c = in[i];
+        const uint8_t *bytes = &c;
+        size_t len = 1;
+
+        if (c == LITERAL_ESCAPE) {
+            if (++i == inLen)
+                return false;
+            bytes = &in[i];
+        } else if (c >= 0x80) {
+            if (c - 0x80u >= DICTIONARY_SIZE)
+                return false;
+            bytes = (const uint8_t *)dictionary[c - 0x80];
+            len = strlen(dictionary[c - 0x80]);
+        }
+
+        if (outLen + len > sizeof(out)) {
+            LOG_DEBUG(MESH, "Compressed payload too big once expanded\n");
+            return false;
+        }
+        memcpy(out + outLen, bytes, len);
+        outLen += len;
+    }
+
+    memcpy(d.payload.bytes, out, outLen);
+    d.payload.size = outLen;
+    d.portnum = PortNum_TEXT_MESSAGE_APP;
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/**
+ * Data.portnum for a compressed TEXT_MESSAGE_APP payload (not yet in portnums.proto).
+ *
+ * It is in the core range, so it still fits in a single protobuf byte and never collides with a registered app.  Nodes which
+ * don't understand compression just see an unknown portnum and ignore it.
+ */
+#define COMPRESSED_TEXT_PORTNUM ((PortNum)50)
+
+/**
+ * Try to shrink the payload of d with our static text dictionary (SMAZ style, tuned for short English messages).
+ *
+ * If that makes the payload smaller we replace it and set COMPRESSED_TEXT_PORTNUM, otherwise d is unchanged.
+ *
+ * @return true if we compressed d
+ */
+bool compressPayload(Data &d);
+
+/**
+ * If d was compressed, restore its original payload and portnum
+ *
+ * @return false if d was compressed but is malformed (or too big once expanded), in which case d should be dropped
+ */
+bool decompressPayload(Data &d);
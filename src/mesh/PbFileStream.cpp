@@ -0,0 +1,67 @@
+#include "PbFileStream.h"
+
+#ifdef FS
+
+void PbFileReader::begin(File &f)
+{
+    file = &f;
+    pos = len = 0;
+    stream = {&readCb, this, (size_t)f.size()};
+}
+
+bool PbFileReader::readCb(pb_istream_t *stream, uint8_t *dest, size_t count)
+{
+    PbFileReader *r = (PbFileReader *)stream->state;
+
+    while (count) {
+        if (r->pos == r->len) {
+            // Big reads (i.e. long bytes fields) skip our buffer
+            if (dest && count >= sizeof(r->buf))
+                return r->file->read(dest, count) == (int)count;
+
+            int got = r->file->read(r->buf, sizeof(r->buf));
+            if (got <= 0)
+                return false;
+            r->pos = 0;
+            r->len = got;
+        }
+
+        size_t n = min(count, r->len - r->pos);
+        if (dest) { // Nanopb passes NULL to skip bytes
+            memcpy(dest, r->buf + r->pos, n);
+            dest += n;
+        }
+        r->pos += n;
+        count -= n;
+    }
+    return true;
+}
+
+PbFileWriter::PbFileWriter(File &f) : file(&f)
+{
+    stream = {&writeCb, this, SIZE_MAX, 0};
+}
+
+bool PbFileWriter::flush()
+{
+    bool okay = !len || file->write(buf, len) == len;
+    len = 0;
+    return okay;
+}
+
+bool PbFileWriter::writeCb(pb_ostream_t *stream, const uint8_t *src, size_t count)
+{
+    PbFileWriter *w = (PbFileWriter *)stream->state;
+
+    if (w->len + count > sizeof(w->buf) && !w->flush())
+        return false;
+
+    if (count >= sizeof(w->buf))
+        return w->file->write(src, count) == count; // Too big to be worth copying
+
+    memcpy(w->buf + w->len, src, count);
+    w->len += count;
+    return true;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "FSCommon.h"
+#include <pb_decode.h>
+#include <pb_encode.h>
+
+#ifdef FS
+
+/// How many bytes our file streams buffer.  Nanopb reads and writes a tag or varint at a time, which would otherwise each be a
+/// filesystem call (with its own locking and block lookups).
+#ifndef PB_FILE_BUF_SIZE
+#define PB_FILE_BUF_SIZE 256
+#endif
+
+/**
+ * A nanopb input stream which reads an Arduino File through our own buffer.
+ *
+ * Our stream's bytes_left starts at the file's size, and (unlike readcb) we never touch it, so it also works for a sequence of
+ * delimited messages.
+ */
+class PbFileReader
+{
+    File *file = NULL;
+    uint8_t buf[PB_FILE_BUF_SIZE];
+    size_t pos = 0, len = 0;
+
+  public:
+    pb_istream_t stream = {};
+
+    /// Start reading f from its current position, f must stay open while we are used
+    void begin(File &f);
+
+  private:
+    static bool readCb(pb_istream_t *stream, uint8_t *dest, size_t count);
+};
+
+/**
+ * A nanopb output stream which writes to an Arduino File through our own buffer.  Call flush() before closing the file.
+ */
+class PbFileWriter
+{
+    File *file;
+    uint8_t buf[PB_FILE_BUF_SIZE];
+    size_t len = 0;
+
+  public:
+    pb_ostream_t stream;
+
+    explicit PbFileWriter(File &f);
+
+    /// Write out whatever we have buffered, @return false if the file didn't take all of it
+    bool flush();
+
+  private:
+    static bool writeCb(pb_ostream_t *stream, const uint8_t *src, size_t count);
+};
+
+#endif
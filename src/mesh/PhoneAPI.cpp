@@ -2,9 +2,11 @@
 #include "GPS.h"
 #include "MeshService.h"
 #include "NodeDB.h"
+#include "NodeInfoCache.h"
 #include "PowerFSM.h"
 #include "RadioInterface.h"
 #include <assert.h>
+#include <pb_encode.h>
 
 #if FromRadio_size > MAX_TO_FROM_RADIO_SIZE
 #error FromRadio is too big
@@ -14,6 +16,13 @@
 #error ToRadio is too big
 #endif
 
+#if FromRadio_size >= (1 << 14)
+#error getFromRadioBatch assumes our length prefixes fit in a two byte varint
+#endif
+
+PhoneAPI::CompletedSync PhoneAPI::completedSyncs[PHONEAPI_MAX_SYNCS];
+size_t PhoneAPI::nextCompletedSync;
+
 PhoneAPI::PhoneAPI() {}
 
 void PhoneAPI::init()
@@ -28,6 +37,12 @@ PhoneAPI::~PhoneAPI() {
 void PhoneAPI::close() {
     unobserve();
     state = STATE_SEND_NOTHING;
+    batchHeldLen = 0;
+    hasFilter = false; // The next client might want everything
+    wantsConfigStream = false;
+    delete configStream;
+    configStream = NULL;
+    sendingHistory = false;
     bool oldConnected = isConnected;
     isConnected = false;
     if(oldConnected != isConnected)
@@ -62,37 +77,47 @@ void PhoneAPI::handleToRadio(const uint8_t *buf, size_t bufLength)
         switch (toRadioScratch.which_variant) {
         case ToRadio_packet_tag: {
             MeshPacket &p = toRadioScratch.variant.packet;
-            printPacket("PACKET FROM PHONE", &p);
-            service.handleToRadio(p);
+            LOG_PACKET(MESH, "PACKET FROM PHONE", &p);
+            if (!handleReplayRequest(p) && !handleFilterRequest(p) && !handleConfigStreamRequest(p) && !handleHistoryRequest(p))
+                service.handleToRadio(p);
             break;
         }
         case ToRadio_want_config_id_tag:
             config_nonce = toRadioScratch.variant.want_config_id;
-            DEBUG_MSG("Client wants config, nonce=%u\n", config_nonce);
             state = STATE_SEND_MY_INFO;
 
-            DEBUG_MSG("Reset nodeinfo read pointer\n");
+            // A client which reuses the nonce of a sync it completed already has our nodes as of then, so only send changes.
+            // Any other nonce (i.e. a new random one) gets the whole DB.
+            syncSinceGeneration = 0;
+            for (size_t i = 0; i < PHONEAPI_MAX_SYNCS; i++)
+                if (config_nonce && completedSyncs[i].nonce == config_nonce)
+                    syncSinceGeneration = completedSyncs[i].generation;
+            syncStartGeneration = nodeDB.getGeneration();
+            LOG_DEBUG(MESH, "Client wants config, nonce=%u, nodes changed since generation %u\n", config_nonce, syncSinceGeneration);
+
+            LOG_DEBUG(MESH, "Reset nodeinfo read pointer\n");
             nodeInfoForPhone = NULL;   // Don't keep returning old nodeinfos
             nodeDB.resetReadPointer(); // FIXME, this read pointer should be moved out of nodeDB and into this class - because
                                        // this will break once we have multiple instances of PhoneAPI running independently
+            beginConfigStream();
             break;
 
         case ToRadio_set_owner_tag:
-            DEBUG_MSG("Client is setting owner\n");
+            LOG_DEBUG(MESH, "Client is setting owner\n");
             handleSetOwner(toRadioScratch.variant.set_owner);
             break;
 
         case ToRadio_set_radio_tag:
-            DEBUG_MSG("Client is setting radio\n");
+            LOG_DEBUG(MESH, "Client is setting radio\n");
             handleSetRadio(toRadioScratch.variant.set_radio);
             break;
 
         default:
-            DEBUG_MSG("Error: unexpected ToRadio variant\n");
+            LOG_ERROR(MESH, "Error: unexpected ToRadio variant\n");
             break;
         }
     } else {
-        DEBUG_MSG("Error: ignoring malformed toradio\n");
+        LOG_ERROR(MESH, "Error: ignoring malformed toradio\n");
     }
 }
 
@@ -110,15 +135,41 @@ void PhoneAPI::handleToRadio(const uint8_t *buf, size_t bufLength)
  */
 size_t PhoneAPI::getFromRadio(uint8_t *buf)
 {
+    if (batchHeldLen) {
+        // The client switched back to unbatched reads, don't lose (or reorder) what we already took
+        size_t numbytes = batchHeldLen;
+        memcpy(buf, batchHeld, numbytes);
+        batchHeldLen = 0;
+        return numbytes;
+    }
+
     if (!available()) {
         // DEBUG_MSG("getFromRadio, !available\n");
         return 0;
     }
 
-    DEBUG_MSG("getFromRadio, state=%d\n", state);
+    LOG_DEBUG(MESH, "getFromRadio, state=%d\n", state);
+
+    // A client which asked for a compressed config gets all of its records, up to config_complete_id, in the stream (we might
+    // reach that state with the end of our last block still to send)
+    size_t numbytes;
+    if (configStream && state > STATE_SEND_NOTHING && (state < STATE_SEND_COMPLETE_ID || configStream->hasOutput()))
+        numbytes = getConfigStreamChunk(buf);
+    else
+        numbytes = encodeFromRadio(buf);
+
+    if (numbytes)
+        LOG_DEBUG(MESH, "encoded FromRadio for phone, %d bytes\n", numbytes);
+    else
+        LOG_DEBUG(MESH, "no FromRadio packet available\n");
+    return numbytes;
+}
 
-    // In case we send a FromRadio packet
-    memset(&fromRadioScratch, 0, sizeof(fromRadioScratch));
+size_t PhoneAPI::encodeFromRadio(uint8_t *buf)
+{
+    // We encode each FromRadio straight from the object it carries (the same bytes as a FromRadio with only that variant set),
+    // rather than copying it into fromRadioScratch first
+    size_t numbytes = 0;
 
     // Advance states as needed
     switch (state) {
@@ -131,83 +182,168 @@ size_t PhoneAPI::getFromRadio(uint8_t *buf)
         myNodeInfo.has_gps = (radioConfig.preferences.location_share == LocationSharing_LocDisabled)
                                  ? true
                                  : (gps && gps->isConnected()); // Update with latest GPS connect info
-        fromRadioScratch.which_variant = FromRadio_my_info_tag;
-        fromRadioScratch.variant.my_info = myNodeInfo;
+        numbytes = pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_my_info_tag, MyNodeInfo_fields, &myNodeInfo);
         state = STATE_SEND_RADIO;
 
         service.refreshMyNodeInfo();  // Update my NodeInfo because the client will be asking for it soon.
         break;
 
-    case STATE_SEND_RADIO:
-        fromRadioScratch.which_variant = FromRadio_radio_tag;
-
-        fromRadioScratch.variant.radio = radioConfig;
+    case STATE_SEND_RADIO: {
+        // The one record we do copy, because we send it with a change (once per config download)
+        RadioConfig &radio = fromRadioScratch.variant.radio;
+        radio = radioConfig;
 
         // NOTE: The phone app needs to know the ls_secs value so it can properly expect sleep behavior.
         // So even if we internally use 0 to represent 'use default' we still need to send the value we are
         // using to the app (so that even old phone apps work with new device loads).
-        fromRadioScratch.variant.radio.preferences.ls_secs = getPref_ls_secs();
+        radio.preferences.ls_secs = getPref_ls_secs();
 
+        numbytes = pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_radio_tag, RadioConfig_fields, &radio);
         state = STATE_SEND_NODEINFO;
         break;
+    }
 
     case STATE_SEND_NODEINFO: {
         const NodeInfo *info = nodeInfoForPhone;
         nodeInfoForPhone = NULL; // We just consumed a nodeinfo, will need a new one next time
 
         if (info) {
-            DEBUG_MSG("Sending nodeinfo: num=0x%x, lastseen=%u, id=%s, name=%s\n", info->num, info->position.time, info->user.id,
+            LOG_DEBUG(MESH, "Sending nodeinfo: num=0x%x, lastseen=%u, id=%s, name=%s\n", info->num, info->position.time, info->user.id,
                       info->user.long_name);
-            fromRadioScratch.which_variant = FromRadio_node_info_tag;
-            fromRadioScratch.variant.node_info = *info;
             // Stay in current state until done sending nodeinfos
+
+            // Most nodes haven't changed since the last phone downloaded them, so we usually have this one encoded already
+            size_t x = nodeDB.getIndexOf(info);
+            uint32_t nodeGeneration = nodeDB.getGenerationByIndex(x);
+            numbytes = nodeInfoCache.read(x, info->num, nodeGeneration, buf);
+            if (!numbytes) {
+                numbytes = pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_node_info_tag, NodeInfo_fields, info);
+                nodeInfoCache.write(x, info->num, nodeGeneration, buf, numbytes);
+            }
         } else {
-            DEBUG_MSG("Done sending nodeinfos\n");
+            LOG_DEBUG(MESH, "Done sending nodeinfos (nodeinfo cache %u hits, %u misses)\n", nodeInfoCache.getHits(),
+                      nodeInfoCache.getMisses());
             state = STATE_SEND_COMPLETE_ID;
             // Go ahead and send that ID right now
-            return getFromRadio(buf);
+            return encodeFromRadio(buf);
         }
         break;
     }
 
-    case STATE_SEND_COMPLETE_ID:
-        fromRadioScratch.which_variant = FromRadio_config_complete_id_tag;
-        fromRadioScratch.variant.config_complete_id = config_nonce;
+    case STATE_SEND_COMPLETE_ID: {
+        pb_ostream_t stream = pb_ostream_from_buffer(buf, FromRadio_size);
+        pb_encode_tag(&stream, PB_WT_VARINT, FromRadio_config_complete_id_tag);
+        pb_encode_varint(&stream, config_nonce);
+        numbytes = stream.bytes_written;
+
+        if (configStream) {
+            LOG_DEBUG(MESH, "Config stream done, %u bytes compressed to %u\n", configStream->getRawTotal(),
+                      configStream->getCompressedTotal());
+            delete configStream;
+            configStream = NULL;
+        }
+
+        rememberSync();
         config_nonce = 0;
         state = STATE_SEND_PACKETS;
         break;
+    }
 
     case STATE_LEGACY: // Treat as the same as send packets
     case STATE_SEND_PACKETS:
-        // Do we have a message from the mesh?
-        if (packetForPhone) {
-
-            printPacket("phone downloaded packet", packetForPhone);
-
-            // Encapsulate as a FromRadio packet
-            fromRadioScratch.which_variant = FromRadio_packet_tag;
-            fromRadioScratch.variant.packet = *packetForPhone;
-
-            service.releaseToPool(packetForPhone); // we just copied the bytes, so don't need this buffer anymore
-            packetForPhone = NULL;
-        }
+        // Do we have a message from the mesh?  Encapsulate it as a FromRadio packet.  Any history or replay the client asked
+        // for comes first, the replay ends where our live packets start.
+        if (sendingHistory)
+            numbytes = getHistoryChunk(buf);
+        else if (getReplayPacket(fromRadioScratch.variant.packet))
+            numbytes = pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_packet_tag, MeshPacket_fields,
+                                                &fromRadioScratch.variant.packet);
+        else
+            numbytes = service.encodeForPhone(packetCursor, buf, FromRadio_size, getFilter());
         break;
 
     default:
         assert(0); // unexpected state - FIXME, make an error code and reboot
     }
 
-    // Do we have a message from the mesh?
-    if (fromRadioScratch.which_variant != 0) {
-        // Encapsulate as a FromRadio packet
-        DEBUG_MSG("encoding toPhone packet to phone variant=%d", fromRadioScratch.which_variant);
-        size_t numbytes = pb_encode_to_bytes(buf, FromRadio_size, FromRadio_fields, &fromRadioScratch);
-        DEBUG_MSG(", %d bytes\n", numbytes);
-        return numbytes;
+    return numbytes;
+}
+
+size_t PhoneAPI::getConfigStreamChunk(uint8_t *buf)
+{
+    // Once the client has all of our last block, compress as many of our next records as fit in one
+    if (!configStream->hasOutput()) {
+        uint8_t *record;
+        while (state < STATE_SEND_COMPLETE_ID && (record = configStream->beginRecord()) != NULL) {
+            available(); // Finds our next nodeinfo
+            if (state == STATE_SEND_NODEINFO && !nodeInfoForPhone) {
+                state = STATE_SEND_COMPLETE_ID; // We send that ID on its own, after our stream
+                break;
+            }
+            configStream->endRecord(encodeFromRadio(record));
+        }
+        configStream->endBlock();
     }
 
-    DEBUG_MSG("no FromRadio packet available\n");
-    return 0;
+    MeshPacket &p = beginLocalPacket(CONFIG_STREAM_PORTNUM);
+    p.decoded.data.payload.size = configStream->readChunk(p.decoded.data.payload.bytes, sizeof(p.decoded.data.payload.bytes),
+                                                          state == STATE_SEND_COMPLETE_ID);
+
+    return pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_packet_tag, MeshPacket_fields, &p);
+}
+
+size_t PhoneAPI::getHistoryChunk(uint8_t *buf)
+{
+    MeshPacket &p = beginLocalPacket(NODE_HISTORY_PORTNUM);
+    p.decoded.data.payload.size =
+        nodeHistory.readChunk(historyCursor, p.decoded.data.payload.bytes, sizeof(p.decoded.data.payload.bytes));
+    sendingHistory = !historyCursor.done;
+
+    return pb_encode_field_to_bytes(buf, FromRadio_size, FromRadio_packet_tag, MeshPacket_fields, &p);
+}
+
+MeshPacket &PhoneAPI::beginLocalPacket(PortNum portnum)
+{
+    // These reach the client like the packets we send it, from and to our own node
+    MeshPacket &p = fromRadioScratch.variant.packet;
+    memset(&p, 0, sizeof(p));
+    p.from = p.to = nodeDB.getNodeNum();
+    p.which_payload = MeshPacket_decoded_tag;
+    p.decoded.which_payload = SubPacket_data_tag;
+    p.decoded.data.portnum = portnum;
+    return p;
+}
+
+size_t PhoneAPI::getFromRadioBatch(uint8_t *buf, size_t bufLen)
+{
+    assert(bufLen >= FROMRADIO_BATCH_MIN_LEN);
+
+    size_t used = 0;
+    while (true) {
+        // We can't put a FromRadio back once we've taken it, so one which doesn't fit waits in batchHeld for the next batch
+        if (!batchHeldLen) {
+            batchHeldLen = getFromRadio(batchHeld);
+            if (!batchHeldLen)
+                break; // Nothing more to send
+        }
+
+        size_t prefixLen = batchHeldLen < 0x80 ? 1 : 2;
+        if (used + prefixLen + batchHeldLen > bufLen)
+            break; // Full
+
+        if (prefixLen == 1)
+            buf[used++] = batchHeldLen;
+        else {
+            buf[used++] = (batchHeldLen & 0x7f) | 0x80;
+            buf[used++] = batchHeldLen >> 7;
+        }
+        memcpy(buf + used, batchHeld, batchHeldLen);
+        used += batchHeldLen;
+        batchHeldLen = 0;
+    }
+
+    LOG_DEBUG(MESH, "FromRadio batch of %d bytes\n", used);
+    return used;
 }
 
 /**
@@ -215,6 +351,9 @@ size_t PhoneAPI::getFromRadio(uint8_t *buf)
  */
 bool PhoneAPI::available()
 {
+    if (batchHeldLen)
+        return true; // Left over from our last batch
+
     switch (state) {
     case STATE_SEND_NOTHING:
         return false;
@@ -224,7 +363,7 @@ bool PhoneAPI::available()
 
     case STATE_SEND_NODEINFO:
         if (!nodeInfoForPhone)
-            nodeInfoForPhone = nodeDB.readNextInfo();
+            nodeInfoForPhone = nodeDB.readNextInfo(syncSinceGeneration);
         return true; // Always say we have something, because we might need to advance our state machine
 
     case STATE_SEND_RADIO:
@@ -235,10 +374,12 @@ bool PhoneAPI::available()
 
     case STATE_LEGACY: // Treat as the same as send packets
     case STATE_SEND_PACKETS: {
-        // Try to pull a new packet from the service (if we haven't already)
-        if (!packetForPhone)
-            packetForPhone = service.getForPhone();
-        bool hasPacket = !!packetForPhone;
+        // The first time we get here, start with all of the packets the service still has
+        if (!hasPacketCursor) {
+            packetCursor = service.getOldestForPhone();
+            hasPacketCursor = true;
+        }
+        bool hasPacket = sendingHistory || isReplaying() || service.hasForPhone(packetCursor, getFilter());
         // DEBUG_MSG("available hasPacket=%d\n", hasPacket);
         return hasPacket;
     }
@@ -250,6 +391,11 @@ bool PhoneAPI::available()
     return false;
 }
 
+uint32_t PhoneAPI::numPendingPackets() const
+{
+    return hasPacketCursor ? service.numForPhone(packetCursor, getFilter()) : 0;
+}
+
 //
 // The following routines are only public for now - until the rev1 bluetooth API is removed
 //
@@ -282,6 +428,7 @@ void PhoneAPI::handleSetRadio(const RadioConfig &r)
     bool didReset = service.reloadConfig();
     if (didReset) {
         state = STATE_SEND_MY_INFO; // Squirt a completely new set of configs to the client
+        beginConfigStream();
     }
 }
 
@@ -296,11 +443,131 @@ int PhoneAPI::onNotify(uint32_t newValue)
     checkConnectionTimeout(); // a handy place to check if we've heard from the phone (since the BLE version doesn't call this
                               // from idle)
 
-    if (state == STATE_SEND_PACKETS || state == STATE_LEGACY) {
-        DEBUG_MSG("Telling client we have new packets %u\n", newValue);
+    if ((state == STATE_SEND_PACKETS || state == STATE_LEGACY) && hasPacketCursor &&
+        !service.hasForPhone(packetCursor, getFilter()))
+        LOG_DEBUG(MESH, "(Client doesn't want our new packets)\n"); // So we don't wake its link for nothing
+    else if (state == STATE_SEND_PACKETS || state == STATE_LEGACY) {
+        LOG_DEBUG(MESH, "Telling client we have new packets %u\n", newValue);
         onNowHasData(newValue);
     } else
-        DEBUG_MSG("(Client not yet interested in packets)\n");
+        LOG_DEBUG(MESH, "(Client not yet interested in packets)\n");
 
     return 0;
-}
\ No newline at end of file
+}
+
+bool PhoneAPI::handleReplayRequest(const MeshPacket &p)
+{
+    if (p.which_payload != MeshPacket_decoded_tag || p.decoded.which_payload != SubPacket_data_tag ||
+        (uint32_t)p.decoded.data.portnum != (uint32_t)ARCHIVE_REPLAY_PORTNUM)
+        return false;
+
+    ArchiveReplayRequest r;
+    if (p.decoded.data.payload.size != sizeof(r)) {
+        LOG_WARN(MESH, "Ignoring replay request of %u bytes\n", p.decoded.data.payload.size);
+        return true;
+    }
+    memcpy(&r, p.decoded.data.payload.bytes, sizeof(r));
+
+    if (!startReplay(r.sinceSecs, r.node)) {
+        LOG_WARN(MESH, "Client asked for a replay, but we have no packet archive\n");
+        return true;
+    }
+
+    // The replay includes everything we have queued, so from here on the client only needs our new packets
+    packetCursor = service.getNewestForPhone();
+    hasPacketCursor = true;
+    onNowHasData(fromRadioNum);
+    return true;
+}
+
+bool PhoneAPI::handleFilterRequest(const MeshPacket &p)
+{
+    if (p.which_payload != MeshPacket_decoded_tag || p.decoded.which_payload != SubPacket_data_tag ||
+        (uint32_t)p.decoded.data.portnum != (uint32_t)PHONE_FILTER_PORTNUM)
+        return false;
+
+    PhoneFilterRequest r;
+    size_t size = p.decoded.data.payload.size;
+    size_t numPortnums = size >= sizeof(r) ? (size - sizeof(r)) / sizeof(uint16_t) : 0;
+    if (size < sizeof(r) || (size - sizeof(r)) % sizeof(uint16_t) || numPortnums > PHONE_FILTER_MAX_PORTNUMS) {
+        LOG_WARN(MESH, "Ignoring filter request of %u bytes\n", size);
+        return true;
+    }
+    memcpy(&r, p.decoded.data.payload.bytes, sizeof(r));
+
+    filter.from = r.from;
+    filter.wantsRouting = r.flags & PHONE_FILTER_ROUTING;
+    filter.numPortnums = numPortnums;
+    const uint8_t *portnums = p.decoded.data.payload.bytes + sizeof(r);
+    for (size_t i = 0; i < numPortnums; i++)
+        filter.portnums[i] = portnums[2 * i] | (portnums[2 * i + 1] << 8);
+    hasFilter = true;
+
+    LOG_DEBUG(MESH, "Client only wants packets from 0x%x on %u portnums (0 for all)\n", filter.from, filter.numPortnums);
+    return true;
+}
+
+bool PhoneAPI::handleConfigStreamRequest(const MeshPacket &p)
+{
+    if (p.which_payload != MeshPacket_decoded_tag || p.decoded.which_payload != SubPacket_data_tag ||
+        (uint32_t)p.decoded.data.portnum != (uint32_t)CONFIG_STREAM_PORTNUM)
+        return false;
+
+    ConfigStreamRequest r;
+    if (p.decoded.data.payload.size < sizeof(r)) {
+        LOG_WARN(MESH, "Ignoring config stream request of %u bytes\n", p.decoded.data.payload.size);
+        return true;
+    }
+    memcpy(&r, p.decoded.data.payload.bytes, sizeof(r));
+
+    // A client which wants a newer stream than ours gets plain records, which every client understands
+    wantsConfigStream = r.version == CONFIG_STREAM_VERSION;
+    LOG_DEBUG(MESH, "Client wants a compressed config stream, version %u (%s)\n", r.version,
+              wantsConfigStream ? "ok" : "unsupported");
+    return true;
+}
+
+bool PhoneAPI::handleHistoryRequest(const MeshPacket &p)
+{
+    if (p.which_payload != MeshPacket_decoded_tag || p.decoded.which_payload != SubPacket_data_tag ||
+        (uint32_t)p.decoded.data.portnum != (uint32_t)NODE_HISTORY_PORTNUM)
+        return false;
+
+    NodeHistoryRequest r;
+    if (p.decoded.data.payload.size != sizeof(r)) {
+        LOG_WARN(MESH, "Ignoring node history request of %u bytes\n", p.decoded.data.payload.size);
+        return true;
+    }
+    memcpy(&r, p.decoded.data.payload.bytes, sizeof(r));
+
+    // A new request replaces any answer we are part way through
+    LOG_DEBUG(MESH, "Client wants the history of node 0x%x (0 for all) since %u\n", r.node, r.sinceSecs);
+    historyCursor = {r.node, r.sinceSecs, 0, r.sinceSecs, 0, false};
+    sendingHistory = true;
+    onNowHasData(fromRadioNum);
+    return true;
+}
+
+void PhoneAPI::beginConfigStream()
+{
+    delete configStream;
+    configStream = wantsConfigStream ? new ConfigStream(config_nonce) : NULL;
+}
+
+void PhoneAPI::rememberSync()
+{
+    if (!config_nonce)
+        return;
+
+    // Replace our record of this nonce if we have one, otherwise our oldest record
+    CompletedSync *r = &completedSyncs[nextCompletedSync];
+    for (size_t i = 0; i < PHONEAPI_MAX_SYNCS; i++)
+        if (completedSyncs[i].nonce == config_nonce)
+            r = &completedSyncs[i];
+
+    if (r == &completedSyncs[nextCompletedSync])
+        nextCompletedSync = (nextCompletedSync + 1) % PHONEAPI_MAX_SYNCS;
+
+    r->nonce = config_nonce;
+    r->generation = syncStartGeneration;
+}
@@ -1,12 +1,46 @@
 #pragma once
 
+#include "ConfigStream.h"
+#include "MeshService.h"
+#include "NodeHistory.h"
 #include "Observer.h"
 #include "mesh-pb-constants.h"
-#include <string>
 
 // Make sure that we never let our packets grow too large for one BLE packet
 #define MAX_TO_FROM_RADIO_SIZE 512
 
+/// How many completed config syncs we remember, so returning clients only need to be sent the nodes which changed
+#define PHONEAPI_MAX_SYNCS 4
+
+/// Callers of getFromRadioBatch must provide at least this much room (one FromRadio plus its length prefix)
+#define FROMRADIO_BATCH_MIN_LEN (FromRadio_size + 2)
+
+/// The most we put in one batch
+#define FROMRADIO_BATCH_MAX_LEN MAX_TO_FROM_RADIO_SIZE
+
+/// Clients ask for a replay of the packets we archived (only linux gateways have an archive, see PacketArchive) by sending a
+/// packet on this port (not yet in portnums.proto), with an ArchiveReplayRequest as its payload.  It doesn't go into the mesh.
+#define ARCHIVE_REPLAY_PORTNUM ((PortNum)41)
+
+struct ArchiveReplayRequest {
+    uint32_t sinceSecs; // Replay the packets we received since then (secs since 1970)
+    uint32_t node;      // Only the packets from this node, or 0 for all of them
+} __attribute__((packed));
+
+/// Clients which only want some of the packets we receive (i.e. a logger which only wants telemetry) send a packet on this port
+/// (not yet in portnums.proto) during their config handshake, with a PhoneFilterRequest as its payload.  It doesn't go into
+/// the mesh, and lasts until the client disconnects (or sends another).  Packets it doesn't want never cross its link.
+#define PHONE_FILTER_PORTNUM ((PortNum)45)
+
+/// Followed by up to PHONE_FILTER_MAX_PORTNUMS little endian uint16 portnums to accept, none to accept any portnum
+struct PhoneFilterRequest {
+    uint32_t from; // Only packets from this node, or 0 for any
+    uint8_t flags; // PHONE_FILTER_ROUTING
+} __attribute__((packed));
+
+/// Also send packets without a portnum (acks, routing errors and packets we can't decrypt), i.e. for a client which sends
+#define PHONE_FILTER_ROUTING 0x01
+
 /**
  * Provides our protobuf based API which phone/PC clients can use to talk to our device
  * over UDP, bluetooth or serial.
@@ -37,9 +71,10 @@ class PhoneAPI
      */
     uint32_t fromRadioNum = 0;
 
-    /// We temporarily keep the packet here between the call to available and getFromRadio.  We will free it after the phone
-    /// downloads it
-    MeshPacket *packetForPhone = NULL;
+    /// The sequence number of the next received packet this client should get from MeshService (so each client sees every
+    /// packet, however many of us there are)
+    uint32_t packetCursor = 0;
+    bool hasPacketCursor = false;
 
     /// We temporarily keep the nodeInfo here between the call to available and getFromRadio
     const NodeInfo *nodeInfoForPhone = NULL;
@@ -49,6 +84,36 @@ class PhoneAPI
     /// Use to ensure that clients don't get confused about old messages from the radio
     uint32_t config_nonce = 0;
 
+    /// We only send the nodes which changed after this NodeDB generation (0 to send them all)
+    uint32_t syncSinceGeneration = 0;
+
+    /// The NodeDB generation when this sync started, once the client has it all they are up to date as of then
+    uint32_t syncStartGeneration = 0;
+
+    /// A config sync which a client completed (shared by all of our instances, a client might reconnect over a new link)
+    struct CompletedSync {
+        uint32_t nonce;
+        uint32_t generation;
+    };
+    static CompletedSync completedSyncs[PHONEAPI_MAX_SYNCS];
+    static size_t nextCompletedSync;
+
+    /// Which received packets this client wants (see PHONE_FILTER_PORTNUM), valid if hasFilter
+    PhoneFilter filter;
+    bool hasFilter = false;
+
+    /// Does this client want its config compressed (see CONFIG_STREAM_PORTNUM), and the stream of its current config sync
+    bool wantsConfigStream = false;
+    ConfigStream *configStream = NULL;
+
+    /// Where we are up to in the node history this client asked for (see NODE_HISTORY_PORTNUM), valid if sendingHistory
+    NodeHistoryCursor historyCursor;
+    bool sendingHistory = false;
+
+    /// A FromRadio which didn't fit in the last batch, we send it first in the next one
+    uint8_t batchHeld[FromRadio_size];
+    size_t batchHeldLen = 0;
+
     /** the last msec we heard from the client on the other side of this link */
     uint32_t lastContactMsec = 0;
 
@@ -78,11 +143,27 @@ class PhoneAPI
      */
     size_t getFromRadio(uint8_t *buf);
 
+    /**
+     * Get as many of our next FromRadio packets as will fit in buf, each preceded by its length as a protobuf varint (i.e.
+     * the same framing as protobuf's writeDelimitedTo/parseDelimitedFrom).
+     *
+     * For clients which opt in (by reading a batched endpoint/characteristic), so that the initial config sync and bursts of
+     * packets need far fewer round trips.  bufLen must be at least FROMRADIO_BATCH_MIN_LEN.
+     * Returns number of bytes used (or 0 if no packet available)
+     */
+    size_t getFromRadioBatch(uint8_t *buf, size_t bufLen);
+
     /**
      * Return true if we have data available to send to the phone
      */
     bool available();
 
+    /// Is the client in the middle of downloading our config (i.e. the node DB)?
+    bool isSendingConfig() const { return state > STATE_SEND_NOTHING && state < STATE_SEND_PACKETS; }
+
+    /// How many received packets are waiting for this client
+    uint32_t numPendingPackets() const;
+
     //
     // The following routines are only public for now - until the rev1 bluetooth API is removed
     //
@@ -94,7 +175,8 @@ class PhoneAPI
     /// Are we currently connected to a client?
     bool isConnected = false;
 
-    /// Our fromradio packet while it is being assembled
+    /// For the FromRadio records we can't encode straight from where they live (our adjusted radio config, replayed packets
+    /// and log records)
     FromRadio fromRadioScratch;
 
     /// Hookable to find out when connection changes
@@ -108,7 +190,31 @@ class PhoneAPI
      */
     virtual void onNowHasData(uint32_t fromRadioNum) {}
 
+    /// Transports which can replay archived packets override these.  Start replaying @return false if we can't
+    virtual bool startReplay(uint32_t sinceSecs, uint32_t node) { return false; }
+
+    /// Are we part way through a replay?
+    virtual bool isReplaying() { return false; }
+
+    /// Copy our replay's next packet into p @return false if it is done
+    virtual bool getReplayPacket(MeshPacket &p) { return false; }
+
   private:
+    /// Encode the FromRadio our state calls for next into buf, called once available() has said we have one
+    size_t encodeFromRadio(uint8_t *buf);
+
+    /// Our next chunk of the compressed config stream, as a FromRadio
+    size_t getConfigStreamChunk(uint8_t *buf);
+
+    /// Start a new config sync's stream (if our client wants one)
+    void beginConfigStream();
+
+    /// Our next chunk of the node history our client asked for, as a FromRadio
+    size_t getHistoryChunk(uint8_t *buf);
+
+    /// Clear our scratch packet for a payload on portnum, from and to our own node (how our answers to client requests go)
+    MeshPacket &beginLocalPacket(PortNum portnum);
+
     /**
      * Handle a packet that the phone wants us to send.  It is our responsibility to free the packet to the pool
      */
@@ -116,4 +222,22 @@ class PhoneAPI
 
     /// If the mesh service tells us fromNum has changed, tell the phone
     virtual int onNotify(uint32_t newValue);
+
+    /// Our client now has everything, so if they reconnect with the same nonce they only need changes
+    void rememberSync();
+
+    /// @return true if p was an ArchiveReplayRequest (which we have now handled)
+    bool handleReplayRequest(const MeshPacket &p);
+
+    /// @return true if p was a PhoneFilterRequest (which we have now handled)
+    bool handleFilterRequest(const MeshPacket &p);
+
+    /// @return true if p was a ConfigStreamRequest (which we have now handled)
+    bool handleConfigStreamRequest(const MeshPacket &p);
+
+    /// @return true if p was a NodeHistoryRequest (which we have now handled)
+    bool handleHistoryRequest(const MeshPacket &p);
+
+    /// Our filter, as MeshService wants it
+    const PhoneFilter *getFilter() const { return hasFilter ? &filter : NULL; }
 };
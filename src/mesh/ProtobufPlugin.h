@@ -10,6 +10,8 @@
  */
 template <class T> class ProtobufPlugin : private SinglePortPlugin
 {
+    static_assert(sizeof(T) <= PLUGIN_DECODE_ARENA_SIZE, "Raise PLUGIN_DECODE_ARENA_SIZE to decode this payload");
+
     const pb_msgdesc_t *fields;
 
   public:
@@ -55,11 +57,12 @@ template <class T> class ProtobufPlugin : private SinglePortPlugin
         // it would be better to update even if the message was destined to others.
 
         auto &p = mp.decoded.data;
-        DEBUG_MSG("Received %s from=0x%0x, id=0x%x, payloadlen=%d\n", name, mp.from, mp.id, p.payload.size);
+        LOG_DEBUG(MESH, "Received %s from=0x%0x, id=0x%x, payloadlen=%d\n", name, mp.from, mp.id, p.payload.size);
 
-        T scratch;
-        if (pb_decode_from_bytes(p.payload.bytes, p.payload.size, fields, &scratch))
-            return handleReceivedProtobuf(mp, scratch);
+        // Shared with any other plugin which wants the same payload type from this packet
+        auto decoded = (const T *)decodePayload(mp, fields, sizeof(T));
+        if (decoded)
+            return handleReceivedProtobuf(mp, *decoded);
 
         return false; // Let others look at this message also if they want
     }
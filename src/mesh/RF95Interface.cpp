@@ -11,6 +11,9 @@
 
 #define POWER_DEFAULT 17 // How much power to use if the user hasn't set a power level
 
+/// How long we receive before reading the RSSI of a channel we survey (a few RSSI sampling periods at any bandwidth)
+#define RF95_RSSI_SETTLE_USEC 1000
+
 RF95Interface::RF95Interface(RADIOLIB_PIN_TYPE cs, RADIOLIB_PIN_TYPE irq, RADIOLIB_PIN_TYPE rst, SPIClass &spi)
     : RadioLibInterface(cs, irq, rst, RADIOLIB_NC, spi)
 {
@@ -70,7 +73,10 @@ bool RF95Interface::init()
     setTransmitEnable(false);
 
     int res = lora->begin(freq, bw, sf, cr, syncWord, power, currentLimit, preambleLength);
-    DEBUG_MSG("RF95 init result %d\n", res);
+    txPower = power;
+    if (res == ERR_NONE)
+        markTuned();
+    LOG_DEBUG(RADIO, "RF95 init result %d\n", res);
 
     if (res == ERR_NONE)
         res = lora->setCRC(SX126X_LORA_CRC_ON);
@@ -92,6 +98,19 @@ bool RF95Interface::reconfigure()
 {
     applyModemConfig();
 
+    if (power > MAX_POWER) // This chip has lower power limits than some
+        power = MAX_POWER;
+
+    if (!isRetuneNeeded()) {
+        // Only our power changed (if anything), which the chip takes without leaving receive
+        if (power != txPower) {
+            int err = lora->setOutputPower(power);
+            if(err != ERR_NONE) recordCriticalError(CriticalErrorCode_InvalidRadioSetting);
+            txPower = power;
+        }
+        return ERR_NONE;
+    }
+
     // set mode to standby
     setStandby();
 
@@ -117,22 +136,26 @@ bool RF95Interface::reconfigure()
     err = lora->setFrequency(freq);
     if(err != ERR_NONE) recordCriticalError(CriticalErrorCode_InvalidRadioSetting);
 
-    if (power > MAX_POWER) // This chip has lower power limits than some
-        power = MAX_POWER;
     err = lora->setOutputPower(power);
     if(err != ERR_NONE) recordCriticalError(CriticalErrorCode_InvalidRadioSetting);
+    txPower = power;
+    markTuned();
 
     startReceive(); // restart receiving
 
     return ERR_NONE;
 }
 
-/**
- * Add SNR data to received messages
- */
-void RF95Interface::addReceiveMetadata(MeshPacket *mp)
+void RF95Interface::readReceiveMetadata()
+{
+    lora->readPacketStatus(rxSnr, rxRssi);
+}
+
+void RF95Interface::setTxPower(int8_t dbm)
 {
-    mp->rx_snr = lora->getSNR();
+    int err = lora->setOutputPower(dbm);
+    if (err != ERR_NONE)
+        LOG_WARN(RADIO, "Warning: can't set transmit power %d (error %d)\n", dbm, err);
 }
 
 void RF95Interface::setStandby()
@@ -167,6 +190,31 @@ void RF95Interface::startReceive()
     enableInterrupt(isrRxLevel0);
 }
 
+bool RF95Interface::isChannelActive()
+{
+    setStandby(); // CAD needs the radio to itself (and it drives the same interrupt pin we use)
+    setTransmitEnable(false); // CAD needs our receive path
+
+    int16_t res = lora->scanChannel();
+    if (res != PREAMBLE_DETECTED && res != CHANNEL_FREE)
+        LOG_ERROR(RADIO, "Channel activity detection failed, err=%d\n", res);
+
+    return res == PREAMBLE_DETECTED;
+}
+
+int16_t RF95Interface::readInstantRssi()
+{
+    // RegRssiValue only follows the channel while we receive, and needs a few of its sampling periods to settle
+    setTransmitEnable(false);
+    if (lora->startReceive() != ERR_NONE)
+        return 0;
+    delayMicroseconds(RF95_RSSI_SETTLE_USEC);
+
+    int16_t rssi = lora->readInstantRssi();
+    setStandby();
+    return rssi;
+}
+
 /** Could we send right now (i.e. either not actively receving or transmitting)? */
 bool RF95Interface::isActivelyReceiving()
 {
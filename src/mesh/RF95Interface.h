@@ -44,18 +44,28 @@ class RF95Interface : public RadioLibInterface
     /** are we actively receiving a packet (only called during receiving state) */
     virtual bool isActivelyReceiving();
 
+    /** Run Channel Activity Detection, @return true if someone is transmitting */
+    virtual bool isChannelActive();
+
+    virtual bool tuneFrequency(float freq) { return lora->setFrequency(freq) == ERR_NONE; }
+
+    /// Briefly starts receiving, to read RegRssiValue
+    virtual int16_t readInstantRssi();
+
     /**
      * Start waiting to receive a message
      */
     virtual void startReceive();
 
     /**
-     * Add SNR data to received messages
+     * Read the SNR/RSSI of the frame we just received
      */
-    virtual void addReceiveMetadata(MeshPacket *mp);
+    virtual void readReceiveMetadata();
 
     virtual void setStandby();
 
+    virtual void setTxPower(int8_t dbm);
+
     /**
      *  We override to turn on transmitter power as needed.
      */
@@ -1,8 +1,14 @@
 
 #include "RadioInterface.h"
+#include "HopStarts.h"
 #include "MeshRadio.h"
 #include "MeshService.h"
+#include "NeighborTable.h"
+#include "NetworkCoder.h"
 #include "NodeDB.h"
+#include "PacketTrace.h"
+#include "RTC.h"
+#include "RxTimestamps.h"
 #include "assert.h"
 #include "configuration.h"
 #include "sleep.h"
@@ -34,7 +40,7 @@ void initRegion()
     for (; r->code != RegionCode_Unset && r->code != radioConfig.preferences.region; r++)
         ;
     myRegion = r;
-    DEBUG_MSG("Wanted region %d, using %s\n", radioConfig.preferences.region, r->name);
+    LOG_DEBUG(RADIO, "Wanted region %d, using %s\n", radioConfig.preferences.region, r->name);
 
     myNodeInfo.num_channels = myRegion->numChannels; // Tell our android app how many channels we have
 }
@@ -53,56 +59,116 @@ separated by 2.16 MHz with respect to the adjacent channels. Channel zero starts
 // 1kb was too small
 #define RADIO_STACK_SIZE 4096
 
-/**
- * Calculate airtime per
- * https://www.rs-online.com/designspark/rel-assets/ds-assets/uploads/knowledge-items/application-notes-for-the-internet-of-things/LoRa%20Design%20Guide.pdf
- * section 4
- *
- * @return num msecs for the packet
- */
 uint32_t RadioInterface::getPacketTime(uint32_t pl)
 {
-    float bandwidthHz = bw * 1000.0f;
-    bool headDisable = false; // we currently always use the header
-    float tSym = (1 << sf) / bandwidthHz;
+    return getPacketTimeUsec(pl) / 1000;
+}
+
+uint32_t RadioInterface::getPacketTimeUsec(uint32_t pl)
+{
+    // numPayloadSym = 8 + max(ceil((8 * pl - 4 * sf + 28 + 16) / (4 * (sf - 2 * lowDataOptEn))) * cr, 0)
+    int32_t bits = 8 * pl + payloadBitsOffset;
+    uint32_t numPayloadSym = 8 + (bits > 0 ? (bits + payloadBitsPerBlock - 1) / payloadBitsPerBlock * cr : 0);
+
+    return preambleUsec + numPayloadSym * symbolUsec;
+}
 
+void RadioInterface::updatePacketTimeConstants()
+{
+    bool headDisable = false; // we currently always use the header
+    float tSym = (1 << sf) / (bw * 1000.0f);
     bool lowDataOptEn = tSym > 16e-3 ? true : false; // Needed if symbol time is >16ms
 
-    float tPreamble = (preambleLength + 4.25f) * tSym;
-    float numPayloadSym =
-        8 + max(ceilf(((8.0f * pl - 4 * sf + 28 + 16 - 20 * headDisable) / (4 * (sf - 2 * lowDataOptEn))) * cr), 0.0f);
-    float tPayload = numPayloadSym * tSym;
-    float tPacket = tPreamble + tPayload;
+    symbolUsec = tSym * 1e6f;
+    preambleUsec = (4 * preambleLength + 17) * symbolUsec / 4; // preambleLength + 4.25 symbols
+    payloadBitsOffset = -4 * sf + 28 + 16 - 20 * headDisable;
+    payloadBitsPerBlock = 4 * (sf - 2 * lowDataOptEn);
+}
+
+bool isCompactAck(const MeshPacket *p)
+{
+#ifdef LORA_COMPACT_ACKS
+    if (p->which_payload != MeshPacket_decoded_tag)
+        return false;
+
+    const SubPacket &s = p->decoded;
+    return s.which_ack == SubPacket_success_id_tag && s.which_payload == 0 && !s.original_id && !s.want_response && !s.dest &&
+           !s.source && !p->want_ack;
+#else
+    return false;
+#endif
+}
 
-    uint32_t msecs = tPacket * 1000;
+size_t getWirePayloadLen(const MeshPacket *p)
+{
+    if (p->which_payload == MeshPacket_encrypted_tag)
+        return p->encrypted.size;
 
-    DEBUG_MSG("(bw=%d, sf=%d, cr=4/%d) packet symLen=%d ms, payloadSize=%u, time %d ms\n", (int)bw, sf, cr, (int)(tSym * 1000),
-              pl, msecs);
-    return msecs;
+    assert(isCompactAck(p));
+    return sizeof(PacketId);
 }
 
-uint32_t RadioInterface::getPacketTime(MeshPacket *p)
+/// Copy the over the air payload of p (see getWirePayloadLen()) into dest
+static void copyWirePayload(const MeshPacket *p, uint8_t *dest)
 {
-    assert(p->which_payload == MeshPacket_encrypted_tag); // It should have already been encoded by now
-    uint32_t pl = p->encrypted.size + sizeof(PacketHeader);
+    if (p->which_payload == MeshPacket_encrypted_tag)
+        memcpy(dest, p->encrypted.bytes, p->encrypted.size);
+    else
+        memcpy(dest, &p->decoded.ack.success_id, sizeof(PacketId)); // Little endian, like the rest of our header
+}
 
-    return getPacketTime(pl);
+/// The PacketHeader (or AggregateHeader) flags for p
+static uint8_t getWireFlags(const MeshPacket *p)
+{
+    assert(p->hop_limit <= HOP_MAX);
+    return p->hop_limit | (p->want_ack ? PACKET_FLAGS_WANT_ACK_MASK : 0) |
+           (p->which_payload == MeshPacket_decoded_tag ? PACKET_FLAGS_ACK_MASK : 0);
+}
+
+/**
+ * Mixed into the hopStart bytes of a PacketHeader, so they only count for the packet they were sent with.  Older builds
+ * never write those bytes, so an old relay sends whatever the last frame it received had there (valid looking, but for some
+ * other packet).  Our ids are sequential, so we hash them (Fibonacci hashing) to make nearby ids give unrelated checks.
+ */
+static uint32_t getHeaderCheck(PacketId id)
+{
+    return id * 0x9e3779b1;
+}
+
+uint32_t RadioInterface::getPacketTime(const MeshPacket *p)
+{
+    size_t payloadLen;
+    if (p->which_payload == MeshPacket_encrypted_tag || isCompactAck(p))
+        payloadLen = getWirePayloadLen(p);
+    else if (!pb_get_encoded_size(&payloadLen, SubPacket_fields, &p->decoded))
+        payloadLen = MAX_RHPACKETLEN - sizeof(PacketHeader); // Can't happen, but assume the worst
+
+    return getPacketTime(payloadLen + sizeof(PacketHeader) + NETWORK_ID_LEN);
 }
 
 /** The delay to use for retransmitting dropped packets */
-uint32_t RadioInterface::getRetransmissionMsec(const MeshPacket *p)
+uint32_t RadioInterface::getRetransmissionMsec(const MeshPacket *p, uint32_t ackDelayMsec, bool sent)
 {
+    // When the channel is congested we spread our retries over a wider range, so everyone retrying doesn't collide again
+    uint32_t spread = getContentionWindow() - getMinContentionWindow();
+
     // was 20 and 22 secs respectively, but now with shortPacketMsec as 2269, this should give the same range
-    return random(9 * shortPacketMsec, 10 * shortPacketMsec);
+    uint32_t maxWait = 10 * shortPacketMsec;
+    if (!ackDelayMsec)
+        return random(9 * shortPacketMsec, maxWait + spread);
+
+    // We have measured how quickly this neighbor acks, so wait for our own packet to go out plus that long.  An ack can't
+    // arrive sooner than it takes to send one, and we never wait longer than we used to (plus the time for a long packet).
+    uint32_t airtime = sent ? 0 : getPacketTime(p);
+    uint32_t wait = airtime + min(max(ackDelayMsec, shortPacketMsec), maxWait);
+    return random(wait, wait + shortPacketMsec / 4 + spread);
 }
 
 /** The delay to use when we want to send something but the ether is busy */
 uint32_t RadioInterface::getTxDelayMsec()
 {
-    /** At the low end we want to pick a delay large enough that anyone who just completed sending (some other node)
-     * has had enough time to switch their radio back into receive mode.
-     */
-    const uint32_t MIN_TX_WAIT_MSEC = 100;
+    // At the low end we want to pick a delay large enough that anyone who just completed sending (some other node)
+    // has had enough time to switch their radio back into receive mode (see MIN_TX_WAIT_MSEC).
 
     /**
      * At the high end, this value is used to spread node attempts across time so when they are replying to a packet
@@ -112,7 +178,55 @@ uint32_t RadioInterface::getTxDelayMsec()
      */
     // const uint32_t MAX_TX_WAIT_MSEC = 2000; // stress test would still fail occasionally with 1000
 
-    return random(MIN_TX_WAIT_MSEC, shortPacketMsec);
+    return random(MIN_TX_WAIT_MSEC, MIN_TX_WAIT_MSEC + getContentionWindow());
+}
+
+uint32_t RadioInterface::getTurnaroundMsec(const MeshPacket *p)
+{
+    if (!turnaroundPeer || p->to != turnaroundPeer)
+        return 0;
+    turnaroundPeer = 0;
+
+    // Leave a margin for our own clock, and for how long the others take to start sending once their delay is up
+    uint32_t elapsed = (micros() - turnaroundUsec) / 1000;
+    if (elapsed + TX_TURNAROUND_MSEC > MIN_TX_WAIT_MSEC / 2)
+        return 0; // Too late, someone else might already be sending
+
+    return elapsed < TX_TURNAROUND_MSEC ? TX_TURNAROUND_MSEC - elapsed : 1;
+}
+
+/// With a clear channel we use the same range we always have (up to shortPacketMsec)
+uint32_t RadioInterface::getMinContentionWindow()
+{
+    return shortPacketMsec > MIN_TX_WAIT_MSEC ? shortPacketMsec - MIN_TX_WAIT_MSEC : 1;
+}
+
+/**
+ * The range of our random transmit delay.  Like CSMA/CA backoff, this doubles when we see signs of contention and halves
+ * when we send without trouble.  It is also stretched by how busy we have measured the channel to be, so a node which has just
+ * joined a busy mesh doesn't need to collide a few times first.
+ */
+uint32_t RadioInterface::getContentionWindow()
+{
+    uint32_t minWindow = getMinContentionWindow(), maxWindow = CONTENTION_WINDOW_MAX_FACTOR * minWindow;
+    if (contentionWindow < minWindow)
+        contentionWindow = minWindow;
+
+    // At 50% utilization we double the window, at 100% we triple it
+    uint32_t window = contentionWindow * (1.0f + channelUtilizationPercent(UTIL_1_MINUTE) / 50);
+    return window < maxWindow ? window : maxWindow;
+}
+
+void RadioInterface::growContentionWindow()
+{
+    uint32_t minWindow = getMinContentionWindow(), maxWindow = CONTENTION_WINDOW_MAX_FACTOR * minWindow;
+    uint32_t window = 2 * (contentionWindow > minWindow ? contentionWindow : minWindow);
+    contentionWindow = window < maxWindow ? window : maxWindow;
+}
+
+void RadioInterface::shrinkContentionWindow()
+{
+    contentionWindow /= 2; // getContentionWindow() clamps this to our minimum
 }
 
 void printPacket(const char *prefix, const MeshPacket *p)
@@ -174,7 +288,7 @@ RadioInterface::RadioInterface()
 
 bool RadioInterface::init()
 {
-    DEBUG_MSG("Starting meshradio init...\n");
+    LOG_DEBUG(RADIO, "Starting meshradio init...\n");
 
     configChangedObserver.observe(&service.configChanged);
     preflightSleepObserver.observe(&preflightSleep);
@@ -212,6 +326,18 @@ unsigned long hash(const char *str)
 /**
  * Pull our channel settings etc... from protobufs to the dumb interface settings
  */
+uint8_t RadioInterface::getNumChannels() const
+{
+    return myRegion ? myRegion->numChannels : 1;
+}
+
+void RadioInterface::setDataChannel(int8_t channel, uint8_t dataSf)
+{
+    wantedDataChannel = channel;
+    wantedDataSf = channel >= 0 ? dataSf : 0;
+    reconfigure();
+}
+
 void RadioInterface::applyModemConfig()
 {
     // Set up default configuration
@@ -254,25 +380,43 @@ void RadioInterface::applyModemConfig()
             bw = 31.25;
     }
 
+    controlSf = sf;
+    if (wantedDataChannel >= 0 && wantedDataSf && wantedDataSf < sf)
+        sf = wantedDataSf; // A peer on a good link agreed to talk faster with us on our data channel
+
     power = channelSettings.tx_power;
 
+    updatePacketTimeConstants();
     shortPacketMsec = getPacketTime(sizeof(PacketHeader));
 
     assert(myRegion); // Should have been found in init
 
+    // Carry on the djb2 hash of our name over our PSK, so channels which share a name but not a key still differ
+    channelHash = hash(channelName);
+    for (size_t i = 0; i < channelSettings.psk.size; i++)
+        channelHash = ((channelHash << 5) + channelHash) + channelSettings.psk.bytes[i];
+
     // If user has manually specified a channel num, then use that, otherwise generate one by hashing the name
-    int channel_num =
+    controlChannel =
         (channelSettings.channel_num ? channelSettings.channel_num - 1 : hash(channelName)) % myRegion->numChannels;
+    int channel_num = wantedDataChannel >= 0 && wantedDataChannel < myRegion->numChannels ? wantedDataChannel : controlChannel;
+    currentChannel = channel_num;
+
+#ifdef LORA_SLOTTED_TX
+    if (channel_num == controlChannel && sf == controlSf)
+        slots.configure(getPacketTime(TDMA_SLOT_BYTES));
+#endif
     freq = myRegion->freq + myRegion->spacing * channel_num;
 
-    DEBUG_MSG("Set radio: name=%s, config=%u, ch=%d, power=%d\n", channelName, channelSettings.modem_config, channel_num,
-              power);
-    DEBUG_MSG("Radio myRegion->freq: %f\n", myRegion->freq);
-    DEBUG_MSG("Radio myRegion->spacing: %f\n", myRegion->spacing);
-    DEBUG_MSG("Radio myRegion->numChannels: %d\n", myRegion->numChannels);
-    DEBUG_MSG("Radio channel_num: %d\n", channel_num);
-    DEBUG_MSG("Radio frequency: %f\n", freq);
-    DEBUG_MSG("Short packet time: %u msec\n", shortPacketMsec);
+    LOG_DEBUG(RADIO, "Set radio: name=%s, config=%u, ch=%d, sf=%u, power=%d\n", channelName, channelSettings.modem_config,
+              channel_num, sf, power);
+    LOG_DEBUG(RADIO, "Radio myRegion->freq: %f\n", myRegion->freq);
+    LOG_DEBUG(RADIO, "Radio myRegion->spacing: %f\n", myRegion->spacing);
+    LOG_DEBUG(RADIO, "Radio myRegion->numChannels: %d\n", myRegion->numChannels);
+    LOG_DEBUG(RADIO, "Radio channel_num: %d\n", channel_num);
+    LOG_DEBUG(RADIO, "Radio frequency: %f\n", freq);
+    LOG_DEBUG(RADIO, "Radio symbol time: %u usec\n", symbolUsec);
+    LOG_DEBUG(RADIO, "Short packet time: %u msec\n", shortPacketMsec);
 }
 
 /**
@@ -287,26 +431,270 @@ void RadioInterface::limitPower()
         maxPower = myRegion->powerLimit;
 
     if (power > maxPower) {
-        DEBUG_MSG("Lowering transmit power because of regulatory limits\n");
+        LOG_DEBUG(RADIO, "Lowering transmit power because of regulatory limits\n");
         power = maxPower;
     }
 
-    DEBUG_MSG("Set radio: final power level=%d\n", power);
+    LOG_DEBUG(RADIO, "Set radio: final power level=%d\n", power);
+}
+
+bool RadioInterface::deliverToReceiver(MeshPacket *p)
+{
+    assert(rxDest);
+    packetTrace.mark(p, TRACE_RX_RADIO); // Before the router can see (and release) it
+    if (!rxDest->enqueue(p)) {
+        LOG_WARN(RADIO, "Router is too far behind, dropping received packet\n");
+        countRxDrop(RX_DROP_QUEUE_FULL);
+        packetPool.release(p);
+        return false;
+    }
+    return true;
 }
 
-ErrorCode SimRadio::send(MeshPacket *p)
+void RadioInterface::addReceiveMetadata(MeshPacket *mp)
 {
-    DEBUG_MSG("SimRadio.send\n");
-    packetPool.release(p);
-    return ERRNO_OK;
+    mp->rx_snr = rxSnr;
+    neighbors.onReceive(mp, rxSnr, rxRssi, interfaceIndex);
+
+    // Timestamp the packet with when it actually arrived, not when we get around to handling it
+    uint32_t rxTime = getValidTime(RTCQualityFromNet);
+    uint32_t agoSecs = (micros() - rxFrameStartUsec) / 1000000;
+    mp->rx_time = rxTime > agoSecs ? rxTime - agoSecs : rxTime;
+    rxTimestamps.add(mp->from, mp->id, rxFrameStartUsec);
+    packetTrace.beginRx(mp, rxIsrUsec);
 }
 
-void RadioInterface::deliverToReceiver(MeshPacket *p)
+bool RadioInterface::deliverPacket(NodeNum to, NodeNum from, PacketId id, uint8_t flags, const uint8_t *payload,
+                                      size_t payloadLen, uint8_t hopStart, uint16_t relay)
 {
-    assert(rxDest);
-    assert(rxDest->enqueue(p, 0)); // NOWAIT - fixme, if queue is full, delete older messages
+    // Note: we deliver _all_ packets to our router (i.e. our interface is intentionally promiscuous).
+    // This allows the router and other apps on our node to sniff packets (usually routing) between other
+    // nodes.
+
+    // Except copies of floods it has already seen, which are most of what we hear in a dense mesh.  Those only need to feed our
+    // neighbor table and the router's flood suppression (which isDuplicate() does), so we don't spend a buffer on them.
+    if (rxFilter) {
+        MeshPacket key;
+        key.from = from;
+        key.to = to;
+        key.id = id;
+        key.hop_limit = flags & PACKET_FLAGS_HOP_MASK;
+        if (rxFilter->isDuplicate(&key)) {
+            if (hopStart <= HOP_MAX)
+                hopStarts.add(from, id, hopStart);
+            neighbors.onReceive(&key, rxSnr, rxRssi, interfaceIndex);
+            if (relay != RELAY_UNKNOWN)
+                rxFilter->onRelayHeard(&key, relay); // Every copy of a flood is a chance to learn a shorter path back
+            return true;
+        }
+    }
+
+    MeshPacket *mp = packetPool.allocUninitialized(0);
+    if (!mp) {
+        LOG_DEBUG(RADIO, "ignoring received packet, packet pool is exhausted\n");
+        countRxDrop(RX_DROP_NO_BUFFER);
+        return false;
+    }
+
+    // Only zero the fields outside of the payload buffer, because we are about to fill the part of it we use
+    memset(mp, 0, offsetof(MeshPacket, encrypted.bytes));
+    memset(&mp->channel_index, 0, sizeof(*mp) - offsetof(MeshPacket, channel_index));
+
+    mp->from = from;
+    mp->to = to;
+    mp->id = id;
+    assert(HOP_MAX <= PACKET_FLAGS_HOP_MASK); // If hopmax changes, carefully check this code
+    mp->hop_limit = flags & PACKET_FLAGS_HOP_MASK;
+    mp->want_ack = !!(flags & PACKET_FLAGS_WANT_ACK_MASK);
+
+    if (hopStart <= HOP_MAX)
+        hopStarts.add(from, id, hopStart); // Before anyone works out how far it came
+    if (rxFilter && relay != RELAY_UNKNOWN)
+        rxFilter->onRelayHeard(mp, relay);
+
+    // Sent to us, and not relayed, so its sender is our neighbor and is now waiting to hear back from us
+    if (to == nodeDB.getNodeNum() && hopStart <= HOP_MAX && mp->hop_limit == hopStart) {
+        turnaroundPeer = from;
+        turnaroundUsec = micros();
+    }
+    addReceiveMetadata(mp);
+
+    if (flags & PACKET_FLAGS_ACK_MASK) {
+        // A compact ack, it is already as decoded as it will ever be
+        if (payloadLen != sizeof(PacketId)) {
+            LOG_DEBUG(RADIO, "ignoring malformed compact ack\n");
+            countRxDrop(RX_DROP_MALFORMED);
+            packetPool.release(mp);
+            return false;
+        }
+
+        mp->which_payload = MeshPacket_decoded_tag;
+        memset(&mp->decoded, 0, sizeof(mp->decoded));
+        mp->decoded.which_ack = SubPacket_success_id_tag;
+        memcpy(&mp->decoded.ack.success_id, payload, sizeof(PacketId));
+    } else {
+        mp->which_payload = MeshPacket_encrypted_tag; // Mark that the payload is still encrypted at this point
+        assert(payloadLen <= sizeof(mp->encrypted.bytes));
+        memcpy(mp->encrypted.bytes, payload, payloadLen);
+        mp->encrypted.size = payloadLen;
+
+#ifdef LORA_NETWORK_CODING
+        networkCoder.onReceived(mp); // In case we forward it in a coded frame, which needs its ciphertext
+#endif
+    }
+
+    LOG_PACKET(RADIO, "Lora RX", mp);
+
+    return deliverToReceiver(mp);
+}
+
+size_t RadioInterface::deliverFrame(uint8_t *frame, size_t length)
+{
+    if (length > COMPACT_FLAGS_OFFSET && (frame[COMPACT_FLAGS_OFFSET] & PACKET_FLAGS_COMPACT_MASK)) {
+        uint8_t flags = frame[COMPACT_FLAGS_OFFSET] & ~PACKET_FLAGS_COMPACT_MASK;
+        if (flags & (PACKET_FLAGS_CODED_MASK | PACKET_FLAGS_AGGREGATE_MASK)) {
+            LOG_DEBUG(RADIO, "ignoring received packet with unknown header format\n");
+            countRxDrop(RX_DROP_MALFORMED);
+            return 0;
+        }
+
+        CompactHeader c;
+        memcpy(&c, frame, sizeof(c));
+
+        // Remove the flags byte, so the payload is all in one piece
+        memmove(frame + COMPACT_FLAGS_OFFSET, frame + COMPACT_FLAGS_OFFSET + 1, length - COMPACT_FLAGS_OFFSET - 1);
+        length--;
+
+        return deliverPacket(NODENUM_BROADCAST, c.from, c.id, flags, frame + sizeof(c), length - sizeof(c)) ? 1 : 0;
+    }
+
+    // check for short packets
+    if (length < sizeof(PacketHeader)) {
+        LOG_DEBUG(RADIO, "ignoring received packet too short\n");
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+    }
+
+    const PacketHeader *h = (const PacketHeader *)frame;
+    const uint8_t *payload = frame + sizeof(PacketHeader);
+    size_t payloadLen = length - sizeof(PacketHeader);
+
+    uint8_t hopStart = HOP_START_UNKNOWN;
+    uint16_t relay = RELAY_UNKNOWN;
+    uint32_t check = getHeaderCheck(h->id);
+    uint16_t magic = h->hopStartMagic ^ (uint16_t)(check >> 16);
+    uint8_t start = h->hopStart ^ (uint8_t)(check >> 8);
+    if (magic == HOP_START_MAGIC && start <= HOP_MAX) {
+        hopStart = start;
+        if ((h->flags & PACKET_FLAGS_HOP_MASK) == start)
+            relay = h->from & 0xff; // Not relayed, so its sender transmitted it (and wrote our magic)
+    } else if ((magic >> 8) == RELAY_MAGIC && start <= HOP_MAX) {
+        hopStart = start;
+        relay = magic & 0xff;
+    }
+    if (h->flags & PACKET_FLAGS_CODED_MASK) {
+#ifdef LORA_NETWORK_CODING
+        return deliverCoded(h, payload, payloadLen);
+#else
+        LOG_DEBUG(RADIO, "ignoring network coded frame, we weren't built to decode those\n");
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+#endif
+    }
+
+    if (!(h->flags & PACKET_FLAGS_AGGREGATE_MASK))
+        return deliverPacket(h->to, h->from, h->id, h->flags, payload, payloadLen, hopStart, relay) ? 1 : 0;
+
+    // An aggregated frame, first check that the whole thing is well formed
+    const uint8_t *end = frame + length;
+    if (payloadLen < 1 || *payload > payloadLen - 1) {
+        LOG_DEBUG(RADIO, "ignoring malformed aggregate frame\n");
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+    }
+    for (const uint8_t *next = payload + 1 + *payload; next < end;) {
+        AggregateHeader a;
+        if ((size_t)(end - next) < sizeof(a)) {
+            LOG_DEBUG(RADIO, "ignoring malformed aggregate frame\n");
+            countRxDrop(RX_DROP_MALFORMED);
+            return 0;
+        }
+        memcpy(&a, next, sizeof(a));
+        next += sizeof(a);
+        if (a.len > end - next) {
+            LOG_DEBUG(RADIO, "ignoring malformed aggregate frame\n");
+            countRxDrop(RX_DROP_MALFORMED);
+            return 0;
+        }
+        next += a.len;
+    }
+
+    size_t numDelivered = 0;
+    if (deliverPacket(h->to, h->from, h->id, h->flags, payload + 1, *payload, hopStart, relay))
+        numDelivered++;
+
+    for (const uint8_t *next = payload + 1 + *payload; next < end;) {
+        AggregateHeader a;
+        memcpy(&a, next, sizeof(a));
+        next += sizeof(a);
+        if (deliverPacket(a.to, a.from, a.id, a.flags, next, a.len))
+            numDelivered++;
+        next += a.len;
+    }
+
+    return numDelivered;
 }
 
+#ifdef LORA_NETWORK_CODING
+size_t RadioInterface::deliverCoded(const PacketHeader *h, const uint8_t *payload, size_t payloadLen)
+{
+    CodedHeader c;
+    if (payloadLen < sizeof(c)) {
+        LOG_DEBUG(RADIO, "ignoring malformed coded frame\n");
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+    }
+    memcpy(&c, payload, sizeof(c));
+    payload += sizeof(c);
+    payloadLen -= sizeof(c);
+    if (max(c.firstLen, c.secondLen) != payloadLen) {
+        LOG_DEBUG(RADIO, "ignoring malformed coded frame\n");
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+    }
+
+    // Each packet is for the sender of the other, so we can XOR ours back out
+    NodeNum us = nodeDB.getNodeNum();
+    NodeNum to, from;
+    PacketId id;
+    uint8_t flags;
+    size_t len, oursLen;
+    const uint8_t *ours;
+    if (h->to == us && c.from == us) {
+        to = h->to, from = h->from, id = h->id, flags = h->flags & PACKET_FLAGS_HOP_MASK, len = c.firstLen;
+        ours = networkCoder.findSent(c.from, c.id, oursLen);
+    } else if (c.to == us && h->from == us) {
+        to = c.to, from = c.from, id = c.id, flags = c.flags & PACKET_FLAGS_HOP_MASK, len = c.secondLen;
+        ours = networkCoder.findSent(h->from, h->id, oursLen);
+    } else
+        return 1; // Between two other nodes, nothing for us (but a good frame)
+
+    if (!ours) {
+        LOG_WARN(RADIO, "Can't decode coded frame from 0x%x, we no longer have our packet\n", from);
+        countRxDrop(RX_DROP_MALFORMED);
+        return 0;
+    }
+
+    uint8_t decoded[NC_MAX_LEN];
+    for (size_t i = 0; i < len; i++)
+        decoded[i] = payload[i] ^ (i < oursLen ? ours[i] : 0);
+
+    // It came through the relay, so its sender isn't our neighbor (however the header looks)
+    networkCoder.markDecoded(from, id);
+    return deliverPacket(to, from, id, flags, decoded, len) ? 1 : 0;
+}
+#endif
+
 /***
  * given a packet set sendingPacket and decode the protobufs into radiobuf.  Returns # of payload bytes to send
  */
@@ -315,23 +703,127 @@ size_t RadioInterface::beginSending(MeshPacket *p)
     assert(!sendingPacket);
 
     // DEBUG_MSG("sending queued packet on mesh (txGood=%d,rxGood=%d,rxBad=%d)\n", rf95.txGood(), rf95.rxGood(), rf95.rxBad());
-    assert(p->which_payload == MeshPacket_encrypted_tag); // It should have already been encoded by now
+    // It should have already been encoded by now (or be a compact ack)
+    assert(p->which_payload == MeshPacket_encrypted_tag || isCompactAck(p));
 
     lastTxStart = millis();
+    sendingPacket = p;
+    numAggregated = 0;
+
+    size_t payloadLen = getWirePayloadLen(p);
+    sendingCompact = false;
+    sendingCoded = false;
+#ifdef LORA_COMPACT_HEADERS
+    // Note: all nodes in the mesh must be running a build which understands compact headers.  They have no room for a hop start,
+    // so packets which don't start at HOP_RELIABLE need a full PacketHeader.
+    if (p->to == NODENUM_BROADCAST && sizeof(CompactHeader) + payloadLen > COMPACT_FLAGS_OFFSET &&
+        hopStarts.get(p->from, p->id) == HOP_RELIABLE) {
+        CompactHeader c;
+        c.from = p->from;
+        c.id = p->id;
+        assert(c.from);
+        memcpy(radiobuf, &c, sizeof(c));
+        copyWirePayload(p, radiobuf + sizeof(c));
+
+        // Make room for our flags at the same place they would be in a PacketHeader
+        size_t len = sizeof(c) + payloadLen;
+        memmove(radiobuf + COMPACT_FLAGS_OFFSET + 1, radiobuf + COMPACT_FLAGS_OFFSET, len - COMPACT_FLAGS_OFFSET);
+        radiobuf[COMPACT_FLAGS_OFFSET] = getWireFlags(p) | PACKET_FLAGS_COMPACT_MASK;
+
+        sendingCompact = true;
+        return len + 1;
+    }
+#endif
 
     PacketHeader *h = (PacketHeader *)radiobuf;
 
     h->from = p->from;
     h->to = p->to;
     h->id = p->id;
-    assert(p->hop_limit <= HOP_MAX);
-    h->flags = p->hop_limit | (p->want_ack ? PACKET_FLAGS_WANT_ACK_MASK : 0);
+    h->flags = getWireFlags(p);
+    uint32_t check = getHeaderCheck(p->id);
+    h->hopStart = hopStarts.get(p->from, p->id) ^ (uint8_t)(check >> 8);
+#ifdef LORA_RELAY_NODE
+    h->hopStartMagic = ((RELAY_MAGIC << 8) | (nodeDB.getNodeNum() & 0xff)) ^ (uint16_t)(check >> 16);
+#else
+    h->hopStartMagic = HOP_START_MAGIC ^ (uint16_t)(check >> 16);
+#endif
+
+#ifdef LORA_NETWORK_CODING
+    sendingCoded = networkCoder.isCoded(p);
+    if (sendingCoded)
+        h->flags |= PACKET_FLAGS_CODED_MASK;
+    else
+        networkCoder.onSent(p); // In case a relay codes it, we need it to decode its partner
+#endif
 
     // if the sender nodenum is zero, that means uninitialized
     assert(h->from);
 
-    memcpy(radiobuf + sizeof(PacketHeader), p->encrypted.bytes, p->encrypted.size);
+    copyWirePayload(p, radiobuf + sizeof(PacketHeader));
 
-    sendingPacket = p;
-    return p->encrypted.size + sizeof(PacketHeader);
-}
\ No newline at end of file
+    return payloadLen + sizeof(PacketHeader);
+}
+
+size_t RadioInterface::aggregateSpaceLeft(size_t numbytes) const
+{
+    if (numAggregated == MAX_AGGREGATE_PACKETS - 1 || sendingCompact || sendingCoded)
+        return 0;
+
+    // The first extra packet also costs us a length byte for the original payload
+    size_t needed = numbytes + sizeof(AggregateHeader) + (numAggregated ? 0 : 1);
+    needed += NETWORK_ID_LEN; // Which our radio adds once the frame is complete
+    return needed < MAX_LORA_FRAME_LEN ? MAX_LORA_FRAME_LEN - needed : 0;
+}
+
+void RadioInterface::traceSendingFrame(TraceStage stage, uint32_t atUsec)
+{
+    if (sendingPacket)
+        packetTrace.mark(sendingPacket, stage, atUsec);
+    for (size_t i = 0; i < numAggregated; i++)
+        packetTrace.mark(aggregatedPackets[i], stage, atUsec);
+}
+
+void RadioInterface::notifyTxDone()
+{
+    if (!rxFilter)
+        return;
+
+    if (sendingPacket)
+        rxFilter->onTxDone(sendingPacket);
+    for (size_t i = 0; i < numAggregated; i++)
+        rxFilter->onTxDone(aggregatedPackets[i]);
+}
+
+size_t RadioInterface::appendToSending(MeshPacket *p, size_t numbytes)
+{
+    size_t len = getWirePayloadLen(p);
+    assert(sendingPacket && len <= aggregateSpaceLeft(numbytes));
+
+    if (numAggregated == 0) {
+        // Convert our single packet frame to the aggregate format by inserting the length of the first payload
+        PacketHeader *h = (PacketHeader *)radiobuf;
+        h->flags |= PACKET_FLAGS_AGGREGATE_MASK;
+
+        uint8_t *payload = radiobuf + sizeof(PacketHeader);
+        size_t firstLen = getWirePayloadLen(sendingPacket);
+        memmove(payload + 1, payload, firstLen);
+        *payload = firstLen;
+        numbytes++;
+    }
+
+    AggregateHeader a;
+    a.to = p->to;
+    a.from = p->from;
+    a.id = p->id;
+    a.flags = getWireFlags(p);
+    a.len = len;
+
+    memcpy(radiobuf + numbytes, &a, sizeof(a));
+    numbytes += sizeof(a);
+    copyWirePayload(p, radiobuf + numbytes);
+    numbytes += len;
+
+    aggregatedPackets[numAggregated++] = p;
+    return numbytes;
+}
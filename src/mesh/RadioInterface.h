@@ -2,17 +2,89 @@
 
 #include "../concurrency/NotifiedWorkerThread.h"
 #include "MemoryPool.h"
+#include "MeshPacketQueue.h"
 #include "MeshTypes.h"
 #include "Observer.h"
+#include "PacketTrace.h"
 #include "PointerQueue.h"
+#include "SPSCQueue.h"
+#include "TxSlots.h"
 #include "airtime.h"
 
-#define MAX_TX_QUEUE 16 // max number of packets which can be waiting for transmission
+/// max number of packets which can be waiting for transmission (see MeshProfile)
+#ifndef MAX_TX_QUEUE
+#define MAX_TX_QUEUE (meshProfile.txQueue)
+#endif
 
 #define MAX_RHPACKETLEN 256
 
 #define PACKET_FLAGS_HOP_MASK 0x07
 #define PACKET_FLAGS_WANT_ACK_MASK 0x08
+#define PACKET_FLAGS_AGGREGATE_MASK 0x10
+#define PACKET_FLAGS_ACK_MASK 0x20
+/// The frame is network coded (see CodedHeader).  Builds without LORA_NETWORK_CODING drop these frames, but builds older than
+/// that flag never looked at this bit and take the frame for a normal packet to its first destination, so all nodes in the mesh
+/// must understand coded frames.
+#define PACKET_FLAGS_CODED_MASK 0x40
+#define PACKET_FLAGS_COMPACT_MASK 0x80 // The frame uses a CompactHeader
+
+/// The most packets we will pack into one aggregated frame (see AggregateHeader)
+#define MAX_AGGREGATE_PACKETS 4
+
+/// The shortest random delay before we transmit, so anyone who just finished sending has switched back to receive
+#define MIN_TX_WAIT_MSEC 100
+
+/**
+ * How long a radio which just finished sending needs before it is receiving again.  The SX126x and SX127x families both
+ * switch in well under a msec, the rest is for their host to service its tx done interrupt.  Must be well below
+ * MIN_TX_WAIT_MSEC (see getTurnaroundMsec()).
+ */
+#define TX_TURNAROUND_MSEC 10
+
+/// Under contention our transmit delay window can grow to this many times its normal size
+#define CONTENTION_WINDOW_MAX_FACTOR 8
+
+/// The biggest frame our radios can send
+#define MAX_LORA_FRAME_LEN 255
+
+/**
+ * Builds with LORA_NETWORK_ID end every frame they send with a network id byte (from a hash of our channel name and PSK), and
+ * drop received frames which don't end with ours as soon as they are read, before they cost us a packet buffer or any crypto.
+ * Other LoRa users and our other channels mostly share our sync word, so without this we only find out a frame isn't ours
+ * once we fail to decode it.  All nodes in the mesh must be running a build with it.
+ */
+#ifdef LORA_NETWORK_ID
+#define NETWORK_ID_LEN 1
+#else
+#define NETWORK_ID_LEN 0
+#endif
+
+/**
+ * Lets a radio throw away packets its receiver already has, before it spends a packet buffer on them (see
+ * Router::isDuplicate()).  Only called from the thread our radios deliver packets from.
+ */
+class DuplicateFilter
+{
+  public:
+    /**
+     * @param p just the header of a received packet (from, to, id and hop_limit), nothing else is set
+     * @return true if we can discard it
+     */
+    virtual bool isDuplicate(const MeshPacket *p) = 0;
+
+    /**
+     * We heard a copy of p which said who sent it (see RELAY_MAGIC), or which its sender sent us directly with a valid hop
+     * start, whether or not it was a duplicate.  Either way whoever transmitted it is running a build which understands our
+     * header (and source routing).
+     *
+     * @param p at least the header of the packet (from, to, id and hop_limit)
+     * @param relayByte the low byte of the node number of whoever transmitted this copy (the sender or a relay)
+     */
+    virtual void onRelayHeard(const MeshPacket *p, uint8_t relayByte) {}
+
+    /// Our radio has finished transmitting p (which may be a copy, with the same from and id, of the packet we sent it)
+    virtual void onTxDone(const MeshPacket *p) {}
+};
 
 /**
  * This structure has to exactly match the wire layout when sent over the radio link.  Used to keep compatibility
@@ -29,17 +101,123 @@ typedef struct {
      * The bottom three bits of flags are use to store hop_limit when sent over the wire.
      **/
     uint8_t flags;
+
+    /**
+     * The hop_limit the original sender started this packet with (see HopStarts), valid if hopStartMagic is
+     * HOP_START_MAGIC, or its high byte is RELAY_MAGIC.  Older builds never set these (they were our padding), so they hold
+     * whatever was in their buffer, often the valid looking bytes of the last frame they received.  So both are mixed with a
+     * hash of id (see getHeaderCheck()), which makes those stale bytes fail our check.
+     */
+    uint8_t hopStart;
+    uint16_t hopStartMagic;
 } PacketHeader;
 
+#define HOP_START_MAGIC 0x5348
+
+/**
+ * Builds with LORA_RELAY_NODE set hopStartMagic to RELAY_MAGIC << 8 plus the low byte of the node number of whoever is
+ * transmitting the frame (the sender, or the relay forwarding it), so listeners can learn reverse paths from the floods they
+ * overhear (see DSRRouter::onRelayHeard).  We always understand these, but builds older than that will think such frames
+ * have no hop start, so all nodes in the mesh should be running a build which understands them.
+ */
+#define RELAY_MAGIC 0xd5
+
+/// For frames which didn't tell us who transmitted them
+#define RELAY_UNKNOWN 0x100
+
+/// For frames which didn't tell us a hop start (their sender started at HOP_RELIABLE)
+#define HOP_START_UNKNOWN 0xff
+
+/**
+ * Broadcasts can be sent with this shorter header (when built with LORA_COMPACT_HEADERS), because they don't need a to address.
+ *
+ * The flags byte (with PACKET_FLAGS_COMPACT_MASK set) stays at the same offset in the frame as in a PacketHeader, so we can tell
+ * the two apart (older builds never set that bit).  The payload starts right after the CompactHeader and continues after the
+ * flags byte.  Frames must be longer than COMPACT_FLAGS_OFFSET to use this format.
+ *
+ * This saves the to address and the hop start of PacketHeader (7 bytes per broadcast).
+ */
+typedef struct __attribute__((packed)) {
+    NodeNum from;
+    PacketId id;
+} CompactHeader;
+
+#define COMPACT_FLAGS_OFFSET offsetof(PacketHeader, flags)
+
+/**
+ * If PACKET_FLAGS_AGGREGATE_MASK is set in the PacketHeader, the frame holds several packets:
+ *
+ * PacketHeader (for the first packet), uint8_t length of the first payload, the first payload, then for each additional packet an
+ * AggregateHeader followed by its payload.
+ */
+typedef struct __attribute__((packed)) {
+    NodeNum to, from;
+    PacketId id;
+    uint8_t flags; // hop limit and want ack, as in PacketHeader
+    uint8_t len;   // payload length
+} AggregateHeader;
+
+/**
+ * If PACKET_FLAGS_CODED_MASK is set in the PacketHeader, the frame holds two unicasts which a relay is forwarding in opposite
+ * directions (see NetworkCoder).  The PacketHeader describes the first packet and a CodedHeader after it the second, then the
+ * payload is the XOR of both ciphertexts (the shorter one padded with zeros).  Each packet is for the sender of the other.
+ */
+typedef struct __attribute__((packed)) {
+    NodeNum to, from;
+    PacketId id;
+    uint8_t flags; // hop limit, as in PacketHeader (coded packets are never acked)
+    uint8_t firstLen, secondLen;
+} CodedHeader;
+
+/**
+ * If PACKET_FLAGS_ACK_MASK is set the packet is a compact ack: instead of an encrypted SubPacket the payload is just the
+ * (little endian) PacketId being acked.  Acks carry nothing secret, so this saves us the protobuf, the crypto and a few bytes of
+ * airtime.
+ */
+
+/**
+ * Can p be sent as a compact ack (i.e. it is a bare ack with nothing else in its SubPacket)
+ *
+ * Always false unless we are built with LORA_COMPACT_ACKS (all nodes in the mesh must be running a build which understands
+ * compact acks), but we always understand compact acks we receive.
+ */
+bool isCompactAck(const MeshPacket *p);
+
+/// @return the number of payload bytes p will need over the air, p must be encrypted or a compact ack
+size_t getWirePayloadLen(const MeshPacket *p);
+
+/// Why we discarded a packet we received (rxBad counts every frame we couldn't use, including those which failed their CRC)
+enum RxDropCause {
+    RX_DROP_NO_BUFFER,  // Our packet pool was exhausted
+    RX_DROP_QUEUE_FULL, // Our router's receive queue was full, even with its burst space
+    RX_DROP_MALFORMED,  // The frame (or a packet in it) didn't parse
+    RX_DROP_FOREIGN,    // The frame was from another network (it didn't end with our network id, see NETWORK_ID_LEN)
+    RX_DROP_NUM_CAUSES
+};
+
+/// Counters a radio keeps, for our stats
+struct RadioStats {
+    uint32_t rxGood, rxBad, txGood;
+    uint32_t txQueued, txDropped; // Packets waiting in our transmit queue, and how many it had to drop
+    uint32_t rxDropped[RX_DROP_NUM_CAUSES];
+};
+
 /**
  * Basic operations all radio chipsets must implement.
  *
  * This defines the SOLE API for talking to radios (because soon we will have alternate radio implementations)
  */
+/// What surveyChannel() saw on a channel
+struct ChannelSample {
+    bool busy;    // Channel activity detection heard a LoRa preamble
+    int16_t rssi; // Instantaneous RSSI in dBm (the noise floor, unless someone was sending), 0 if our chip can't measure it
+};
+
 class RadioInterface
 {
     friend class MeshRadio; // for debugging we let that class touch pool
-    PointerQueue<MeshPacket> *rxDest = NULL;
+    SPSCQueue<MeshPacket *> *rxDest = NULL;
+    DuplicateFilter *rxFilter = NULL;
 
     CallbackObserver<RadioInterface, void *> configChangedObserver =
         CallbackObserver<RadioInterface, void *>(this, &RadioInterface::reloadConfig);
@@ -53,6 +231,12 @@ class RadioInterface
     /// Number of msecs we expect our shortest actual packet to be over the wire (used in retry timeout calcs)
     uint32_t shortPacketMsec;
 
+    /// Which of our router's interfaces we are (set by Router::addInterface)
+    uint8_t interfaceIndex = 0;
+
+    /// See countRxDrop()
+    uint32_t rxDropped[RX_DROP_NUM_CAUSES] = {};
+
   protected:
     float bw = 125;
     uint8_t sf = 9;
@@ -60,7 +244,23 @@ class RadioInterface
 
     uint16_t preambleLength = 32; // 8 is default, but we use longer to increase the amount of sleep time when receiving
 
+    /// Airtime constants for our current modem settings, see updatePacketTimeConstants()
+    uint32_t symbolUsec = 0, preambleUsec = 0;
+    int32_t payloadBitsOffset = 0, payloadBitsPerBlock = 1;
+
     MeshPacket *sendingPacket = NULL; // The packet we are currently sending
+
+    /// Any extra packets which are being sent in the same frame as sendingPacket
+    MeshPacket *aggregatedPackets[MAX_AGGREGATE_PACKETS - 1];
+    size_t numAggregated = 0;
+
+    /// True if the frame we are sending uses a CompactHeader (in which case we never aggregate other packets into it)
+    bool sendingCompact = false;
+
+    /// True if the frame we are sending is network coded (which both of its destinations must hear, and which we never
+    /// aggregate other packets into)
+    bool sendingCoded = false;
+
     uint32_t lastTxStart = 0L;
 
     /**
@@ -69,9 +269,59 @@ class RadioInterface
     uint8_t radiobuf[MAX_RHPACKETLEN];
 
     /**
-     * Enqueue a received packet for the registered receiver
+     * Enqueue a received packet for the registered receiver (or release it and count the drop, if their queue is full)
+     *
+     * @return false if we had to drop it
+     */
+    bool deliverToReceiver(MeshPacket *p);
+
+    /// Count a received packet we had to discard
+    void countRxDrop(RxDropCause cause) { rxDropped[cause]++; }
+
+    /// Subclasses call this from getStats(), to add the drops we counted
+    void addRxDrops(RadioStats &s) const
+    {
+        for (size_t i = 0; i < RX_DROP_NUM_CAUSES; i++)
+            s.rxDropped[i] += rxDropped[i];
+    }
+
+    /// The SNR and RSSI of the last frame we received
+    float rxSnr = 0, rxRssi = 0;
+
+    /// micros() when the frame we just received started to arrive
+    uint32_t rxFrameStartUsec = 0;
+
+    /// micros() when we were told the frame we just received had arrived (i.e. our rx interrupt)
+    uint32_t rxIsrUsec = 0;
+
+    /// The neighbor who just sent us a packet directly (0 if none), and micros() when we received it (see getTurnaroundMsec())
+    NodeNum turnaroundPeer = 0;
+    uint32_t turnaroundUsec = 0;
+
+    /**
+     * Add SNR data to received messages
+     */
+    void addReceiveMetadata(MeshPacket *mp);
+
+    /**
+     * Turn a received frame into MeshPackets and pass them to our receiver.  Each packet is still encrypted.  We might rearrange
+     * the contents of frame while doing so.
+     *
+     * @return the number of packets delivered (or 0 if the frame was malformed)
      */
-    void deliverToReceiver(MeshPacket *p);
+    size_t deliverFrame(uint8_t *frame, size_t length);
+
+  private:
+    /// Make a still encrypted MeshPacket from one packet in a received frame, returns false if we are out of packets
+    bool deliverPacket(NodeNum to, NodeNum from, PacketId id, uint8_t flags, const uint8_t *payload, size_t payloadLen,
+                       uint8_t hopStart = HOP_START_UNKNOWN, uint16_t relay = RELAY_UNKNOWN);
+
+#ifdef LORA_NETWORK_CODING
+    /// Deliver whichever packet in a coded frame is for us (see CodedHeader) @return the number of packets delivered
+    size_t deliverCoded(const PacketHeader *h, const uint8_t *payload, size_t payloadLen);
+#endif
+
+  protected:
 
   public:
     float freq = 915.0;
@@ -86,7 +336,11 @@ class RadioInterface
     /**
      * Set where to deliver received packets.  This method should only be used by the Router class
      */
-    void setReceiver(PointerQueue<MeshPacket> *_rxDest) { rxDest = _rxDest; }
+    void setReceiver(SPSCQueue<MeshPacket *> *_rxDest, DuplicateFilter *_rxFilter = NULL)
+    {
+        rxDest = _rxDest;
+        rxFilter = _rxFilter;
+    }
 
     /**
      * Return true if we think the board can go to sleep (i.e. our tx queue is empty, we are not sending or receiving)
@@ -98,12 +352,30 @@ class RadioInterface
     /// Prepare hardware for sleep.  Call this _only_ for deep sleep, not needed for light sleep.
     virtual bool sleep() { return true; }
 
+    /// @return our counters (radios which don't keep their own only return our drops)
+    virtual RadioStats getStats()
+    {
+        RadioStats s = RadioStats();
+        addRxDrops(s);
+        return s;
+    }
+
     /**
      * Send a packet (possibly by enquing in a private fifo).  This routine will
      * later free() the packet to pool.  This routine is not allowed to stall.
      * If the txmit queue is full it might return an error
+     *
+     * @param priority which class of packet this is, more important packets are sent first
+     * @param source who wants it sent, each source gets its fair share of our airtime
      */
-    virtual ErrorCode send(MeshPacket *p) = 0;
+    virtual ErrorCode send(MeshPacket *p, TxPriority priority, TxSource source) = 0;
+
+    /// What our transmit queue looks like right now (interfaces without one say so with a capacity of 0)
+    virtual TxQueueStatus getTxQueueStatus()
+    {
+        TxQueueStatus s = {};
+        return s;
+    }
 
     // methods from radiohead
 
@@ -117,25 +389,120 @@ class RadioInterface
     /// \return true if initialisation succeeded.
     virtual bool reconfigure() = 0;
 
-    /** The delay to use for retransmitting dropped packets */
-    uint32_t getRetransmissionMsec(const MeshPacket *p);
+    /// Our user changed our radio or channel settings, by default we just reconfigure()
+    virtual void onConfigChanged() { reconfigure(); }
+
+    /**
+     * The delay to use for retransmitting dropped packets
+     *
+     * @param ackDelayMsec how long (beyond the airtime of p) we expect to wait for an ack, or 0 if we don't know
+     * @param sent true if p has already gone out, so we only wait for the ack
+     */
+    uint32_t getRetransmissionMsec(const MeshPacket *p, uint32_t ackDelayMsec = 0, bool sent = false);
 
     /** The delay to use when we want to send something but the ether is busy */
     uint32_t getTxDelayMsec();
 
+    /**
+     * If p is a reply to a packet a neighbor just sent us (i.e. an ack), it can go out after TX_TURNAROUND_MSEC rather than
+     * a random getTxDelayMsec().  Everyone else who heard that packet waits at least MIN_TX_WAIT_MSEC before contending for the
+     * channel, so until then it is ours (and our neighbor is listening for us).  Each packet we receive allows one such reply.
+     *
+     * @return the delay to send p with, or 0 if it has to contend for the channel as usual
+     */
+    uint32_t getTurnaroundMsec(const MeshPacket *p);
+
+    /// The current range (in msecs) of our random transmit delay
+    uint32_t getContentionWindow();
+
+  protected:
+    /// Call when we see signs that others are contending for the channel (we found it busy, or heard a corrupted packet)
+    void growContentionWindow();
+
+    /// Call when we sent a packet without having to wait for the channel
+    void shrinkContentionWindow();
+
+  private:
+    uint32_t getMinContentionWindow();
+
+    /// Our backoff state, before adjusting for measured channel utilization
+    uint32_t contentionWindow = 0;
+
+  public:
     /**
      * Calculate airtime per
      * https://www.rs-online.com/designspark/rel-assets/ds-assets/uploads/knowledge-items/application-notes-for-the-internet-of-things/LoRa%20Design%20Guide.pdf
      * section 4
      *
-     * @return num msecs for the packet
+     * This is called several times per packet, so it only does integer math on constants we precalculate in
+     * applyModemConfig().
+     *
+     * @return num msecs for the packet (p may still be decoded, in which case we use the size it will have once encrypted)
      */
-    uint32_t getPacketTime(MeshPacket *p);
+    uint32_t getPacketTime(const MeshPacket *p);
     uint32_t getPacketTime(uint32_t totalPacketLen);
 
+    /// Like getPacketTime but in usecs, for when we need precise timing
+    uint32_t getPacketTimeUsec(uint32_t totalPacketLen);
+
+    /// @return how many channels our region has (our control channel and any we might use as data channels)
+    uint8_t getNumChannels() const;
+
+    /// The channel everyone in our mesh listens on (from our channel settings), set by applyModemConfig()
+    uint8_t getControlChannel() const { return controlChannel; }
+
+    /// The channel our radio is tuned to right now
+    uint8_t getChannel() const { return currentChannel; }
+
+    /**
+     * Move to another of our region's channels (a data channel), or back to our control channel if channel < 0.
+     *
+     * While we are on a data channel we can only talk to nodes which moved there with us, so callers must arrange that with
+     * their peer (over the control channel) and come back as soon as they are done.  By default we retune right away,
+     * subclasses which are busy sending can wait until they are done.
+     *
+     * @param dataSf if not 0, a (faster) spreading factor to use while we are on the data channel, for links which are good
+     * enough (see NeighborTable::pickSpreadFactor).  We never use a slower one than our control channel.
+     */
+    virtual void setDataChannel(int8_t channel, uint8_t dataSf = 0);
+
+    /**
+     * Take a quick look at another of our region's channels (see ChannelSurvey), and go straight back to ours.  Only done when
+     * we are idle, so we never miss a frame on our own channel for it.
+     *
+     * @return false if we couldn't now (we are busy, or our radio can't), in which case sample is unchanged
+     */
+    virtual bool surveyChannel(uint8_t channel, ChannelSample &sample) { return false; }
+
+    /// The spreading factor we are using right now (set by applyModemConfig)
+    uint8_t getSpreadFactor() const { return sf; }
+
+    /// The spreading factor of our control channel, which data channels can only improve on
+    uint8_t getControlSpreadFactor() const { return controlSf; }
+
   protected:
     int8_t power = 17; // Set by applyModemConfig()
 
+    /// The channel someone asked us to use with setDataChannel(), or -1 for our control channel
+    int8_t wantedDataChannel = -1;
+    uint8_t wantedDataSf = 0;
+
+    uint8_t controlSf = 9;
+
+    /// See getControlChannel() and getChannel()
+    uint8_t controlChannel = 0, currentChannel = 0;
+
+    /// A hash of our channel name and PSK (set by applyModemConfig), so frames of other channels can be told from ours
+    uint32_t channelHash = 0;
+
+    /// The byte our frames end with when we are built with LORA_NETWORK_ID
+    uint8_t getNetworkId() const { return channelHash & 0xff; }
+
+#ifdef LORA_SLOTTED_TX
+    /// Our transmit slots on our control channel (kept up to date by applyModemConfig)
+    TxSlots slots;
+#endif
+
     /***
      * given a packet set sendingPacket and decode the protobufs into radiobuf.  Returns # of bytes to send (including the
      * PacketHeader & payload).
@@ -144,6 +511,23 @@ class RadioInterface
      */
     size_t beginSending(MeshPacket *p);
 
+    /**
+     * Add another packet to the frame started by beginSending() (see AggregateHeader).
+     *
+     * @param numbytes the current length of the frame in radiobuf
+     * @return the new length of the frame
+     */
+    size_t appendToSending(MeshPacket *p, size_t numbytes);
+
+    /// How many payload bytes the next appendToSending() call could add to a frame which is currently numbytes long
+    size_t aggregateSpaceLeft(size_t numbytes) const;
+
+    /// Tell packetTrace that every packet in the frame we are sending finished stage at atUsec
+    void traceSendingFrame(TraceStage stage, uint32_t atUsec);
+
+    /// Tell our receiver (see DuplicateFilter::onTxDone) that every packet in the frame we are sending has gone out
+    void notifyTxDone();
+
     /**
      * Some regulatory regions limit xmit power.
      * This function should be called by subclasses after setting their desired power.  It might lower it
@@ -157,6 +541,9 @@ class RadioInterface
      */
     virtual void applyModemConfig();
 
+    /// Precalculate what getPacketTime needs from bw/sf/cr/preambleLength (called by applyModemConfig)
+    void updatePacketTimeConstants();
+
   private:
     /// Return 0 if sleep is okay
     int preflightSleepCb(void *unused = NULL) { return canSleep() ? 0 : 1; }
@@ -165,28 +552,17 @@ class RadioInterface
 
     int reloadConfig(void *unused)
     {
-        reconfigure();
+        onConfigChanged();
         return 0;
     }
 };
 
-class SimRadio : public RadioInterface
-{
-  public:
-    virtual ErrorCode send(MeshPacket *p);
-
-    // methods from radiohead
-
-    /// Initialise the Driver transport hardware and software.
-    /// Make sure the Driver is properly configured before calling init().
-    /// \return true if initialisation succeeded.
-    virtual bool init() { return true; }
-
-    /// Apply any radio provisioning changes
-    /// Make sure the Driver is properly configured before calling init().
-    /// \return true if initialisation succeeded.
-    virtual bool reconfigure() { return true; }
-};
-
 /// Debug printing for packets
-void printPacket(const char *prefix, const MeshPacket *p);
\ No newline at end of file
+void printPacket(const char *prefix, const MeshPacket *p);
+
+/// printPacket, but only if module is logging at LOG_LEVEL_DEBUG (so release builds skip all the formatting)
+#define LOG_PACKET(module, prefix, p)                                                                                           \
+    do {                                                                                                                       \
+        if (LOG_ENABLED(module, LOG_LEVEL_DEBUG))                                                                              \
+            printPacket(prefix, p);                                                                                            \
+    } while (0)
\ No newline at end of file
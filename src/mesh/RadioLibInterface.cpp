@@ -1,6 +1,9 @@
 #include "RadioLibInterface.h"
+#include "MeshRadio.h"
 #include "MeshTypes.h"
+#include "NeighborTable.h"
 #include "NodeDB.h"
+#include "NoiseMonitor.h"
 #include "SPILock.h"
 #include "mesh-pb-constants.h"
 #include <configuration.h>
@@ -10,11 +13,57 @@
 // FIXME, we default to 4MHz SPI, SPI mode 0, check if the datasheet says it can really do that
 static SPISettings spiSettings(4000000, MSBFIRST, SPI_MODE0);
 
+/// Transfers at least this long (i.e. FIFO reads/writes rather than register accesses) are sent as a single block
+#define SPI_BLOCK_MIN_BYTES 8
+
 void LockingModule::SPItransfer(uint8_t cmd, uint8_t reg, uint8_t *dataOut, uint8_t *dataIn, uint8_t numBytes)
 {
-    concurrency::LockGuard g(spiLock);
+    if (!inBatch)
+        spiLock->lock(SPI_CLIENT_RADIO);
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(NRF52_SERIES)
+    if (numBytes >= SPI_BLOCK_MIN_BYTES)
+        SPItransferBlock(cmd, reg, dataOut, dataIn, numBytes);
+    else
+#endif
+        Module::SPItransfer(cmd, reg, dataOut, dataIn, numBytes);
+
+    if (!inBatch)
+        spiLock->unlock();
+}
+
+void LockingModule::SPItransferBlock(uint8_t cmd, uint8_t reg, uint8_t *dataOut, uint8_t *dataIn, uint8_t numBytes)
+{
+    // The block transfer overwrites its buffer with what it reads, so writes go from a copy (protected by spiLock)
+    static uint8_t scratch[UINT8_MAX];
+    uint8_t *buf = cmd == SPIwriteCommand ? scratch : dataIn;
+    if (cmd == SPIwriteCommand)
+        memcpy(scratch, dataOut, numBytes);
+    else
+        memset(dataIn, 0, numBytes);
+
+    SPIClass *spi = getSpi();
+    spi->beginTransaction(getSpiSettings());
+    digitalWrite(getCs(), LOW);
+
+    spi->transfer(reg | cmd);
+    spi->transfer(buf, numBytes); // On nRF52 this uses EasyDMA, on ESP32 the SPI FIFO
+
+    digitalWrite(getCs(), HIGH);
+    spi->endTransaction();
+}
+
+LockingModule::Batch::Batch(LockingModule &_module) : module(_module)
+{
+    assert(!module.inBatch); // We don't nest
+    spiLock->lock(SPI_CLIENT_RADIO);
+    module.inBatch = true;
+}
 
-    Module::SPItransfer(cmd, reg, dataOut, dataIn, numBytes);
+LockingModule::Batch::~Batch()
+{
+    module.inBatch = false;
+    spiLock->unlock();
 }
 
 RadioLibInterface::RadioLibInterface(RADIOLIB_PIN_TYPE cs, RADIOLIB_PIN_TYPE irq, RADIOLIB_PIN_TYPE rst, RADIOLIB_PIN_TYPE busy,
@@ -22,6 +71,7 @@ RadioLibInterface::RadioLibInterface(RADIOLIB_PIN_TYPE cs, RADIOLIB_PIN_TYPE irq
     : NotifiedWorkerThread("RadioIf"), module(cs, irq, rst, busy, spi, spiSettings), iface(_iface)
 {
     instance = this;
+    setPriority(concurrency::PRIORITY_CRITICAL); // A received frame waits in the chip's FIFO, where the next one overwrites it
 }
 
 #ifndef NO_ESP32
@@ -33,10 +83,11 @@ RadioLibInterface::RadioLibInterface(RADIOLIB_PIN_TYPE cs, RADIOLIB_PIN_TYPE irq
 
 void INTERRUPT_ATTR RadioLibInterface::isrLevel0Common(PendingISR cause)
 {
+    instance->isrTimeUsec = micros(); // As early as possible, because this is our best clue to when the radio finished
     instance->disableInterrupt();
 
     BaseType_t xHigherPriorityTaskWoken;
-    instance->notifyFromISR(&xHigherPriorityTaskWoken, cause, true);
+    instance->notifyFromISR(&xHigherPriorityTaskWoken, cause);
 
     /* Force a context switch if xHigherPriorityTaskWoken is now set to pdTRUE.
     The macro used to do this is dependent on the port and may be called
@@ -67,28 +118,64 @@ bool RadioLibInterface::canSendImmediately()
     bool busyTx = sendingPacket != NULL;
     bool busyRx = isReceiving && isActivelyReceiving();
 
+    // If the radio was busy receiving last time we looked, but never gave us a packet, count that time as channel use (our
+    // receive interrupt clears activeRxStart, so that frame is lost)
+    NoiseMonitor *noise = getNoiseMonitor();
+    if (busyRx && !activeRxStart)
+        activeRxStart = millis();
+    else if (!busyRx && activeRxStart) {
+        logChannelBusy(millis() - activeRxStart);
+        activeRxStart = 0;
+        if (noise)
+            noise->onLostFrame();
+    }
+
     if (busyTx || busyRx) {
         if (busyTx)
-            DEBUG_MSG("Can not send yet, busyTx\n");
+            LOG_DEBUG(RADIO, "Can not send yet, busyTx\n");
         if (busyRx)
-            DEBUG_MSG("Can not send yet, busyRx\n");
+            LOG_DEBUG(RADIO, "Can not send yet, busyRx\n");
+        return false;
+    }
+
+#ifndef LORA_DISABLE_CAD
+    // The radio only tells us it is receiving once it has a valid header, so also look for preambles which are already on the
+    // air.  Listening again straight away gives us a chance of catching that packet.
+    if (isChannelActive()) {
+        LOG_DEBUG(RADIO, "Can not send yet, channel activity\n");
+        if (noise)
+            noise->onPreamble();
+        startReceive();
         return false;
-    } else
-        return true;
+    }
+#endif
+
+    return true;
 }
 
 /// Send a packet (possibly by enquing in a private fifo).  This routine will
 /// later free() the packet to pool.  This routine is not allowed to stall because it is called from
 /// bluetooth comms code.  If the txmit queue is empty it might return an error
-ErrorCode RadioLibInterface::send(MeshPacket *p)
+ErrorCode RadioLibInterface::send(MeshPacket *p, TxPriority priority, TxSource source)
 {
     // Sometimes when testing it is useful to be able to never turn on the xmitter
 #ifndef LORA_DISABLE_SENDING
-    printPacket("enqueuing for send", p);
+    LOG_PACKET(RADIO, "enqueuing for send", p);
     uint32_t xmitMsec = getPacketTime(p);
 
-    DEBUG_MSG("txGood=%d,rxGood=%d,rxBad=%d\n", txGood, rxGood, rxBad);
-    ErrorCode res = txQueue.enqueue(p, 0) ? ERRNO_OK : ERRNO_UNKNOWN;
+    LOG_DEBUG(RADIO, "txGood=%d,rxGood=%d,rxBad=%d,priority=%d\n", txGood, rxGood, rxBad, priority);
+    MeshPacket *dropped;
+#ifdef LORA_SLOTTED_TX
+    auto &queue = wantsSlot(p, priority) ? slotQueue : txQueue;
+#else
+    auto &queue = txQueue;
+#endif
+    ErrorCode res = queue.enqueue(p, priority, source, xmitMsec, &dropped) ? ERRNO_OK : ERRNO_UNKNOWN;
+
+    if (dropped) { // we made room by throwing away a less important packet
+        LOG_PACKET(RADIO, "TX queue full, dropping", dropped);
+        packetPool.release(dropped);
+    }
 
     if (res != ERRNO_OK) { // we weren't able to queue it, so we must drop it to prevent leaks
         packetPool.release(p);
@@ -100,8 +187,13 @@ ErrorCode RadioLibInterface::send(MeshPacket *p)
     logAirtime(TX_LOG, xmitMsec);
 
     // We want all sending/receiving to be done by our daemon thread, We use a delay here because this packet might have been sent
-    // in response to a packet we just received.  So we want to make sure the other side has had a chance to reconfigure its radio
-    startTransmitTimer(true);
+    // in response to a packet we just received.  So we want to make sure the other side has had a chance to reconfigure its radio.
+    // If it is the only reply to a neighbor who just sent to us we only need to wait for them, not contend for the channel.
+    uint32_t turnaround = (&queue == &txQueue && txQueue.getNumQueued() == 1) ? getTurnaroundMsec(p) : 0;
+    if (turnaround)
+        startTransmitTimer(true, turnaround);
+    else
+        startTransmitTimer(true);
 
     return res;
 #else
@@ -110,11 +202,40 @@ ErrorCode RadioLibInterface::send(MeshPacket *p)
 #endif
 }
 
+#ifdef LORA_SLOTTED_TX
+bool RadioLibInterface::wantsSlot(const MeshPacket *p, TxPriority priority)
+{
+    // Only our own periodic broadcasts, everything else is either forwarded (and would be stale by our slot) or someone is
+    // waiting for it
+    return priority == TX_PRIORITY_BACKGROUND && p->to == NODENUM_BROADCAST && p->from == nodeDB.getNodeNum() &&
+           canUseSlots();
+}
+
+bool RadioLibInterface::canUseSlots()
+{
+    return slots.isSynced() && getChannel() == getControlChannel() && getSpreadFactor() == getControlSpreadFactor();
+}
+#endif
+
+RadioStats RadioLibInterface::getStats()
+{
+    RadioStats s = {rxGood, rxBad, txGood, (uint32_t)txQueue.getNumQueued(), txQueue.getNumDropped()};
+#ifdef LORA_SLOTTED_TX
+    s.txQueued += slotQueue.getNumQueued();
+    s.txDropped += slotQueue.getNumDropped();
+#endif
+    addRxDrops(s);
+    return s;
+}
+
 bool RadioLibInterface::canSleep()
 {
     bool res = txQueue.isEmpty();
+#ifdef LORA_SLOTTED_TX
+    res = res && slotQueue.isEmpty(); // Our slot timer needs us awake
+#endif
     if (!res) // only print debug messages if we are vetoing sleep
-        DEBUG_MSG("radio wait to sleep, txEmpty=%d\n", res);
+        LOG_DEBUG(RADIO, "radio wait to sleep, txEmpty=%d\n", res);
 
     return res;
 }
@@ -132,51 +253,218 @@ transmitters that we are potentially stomping on.  Requires further thought.
 
 FIXME, the MIN_TX_WAIT_MSEC and MAX_TX_WAIT_MSEC values should be tuned via logic analyzer later.
 */
-void RadioLibInterface::onNotify(uint32_t notification)
+bool RadioLibInterface::handleSleepWake(uint32_t wakeUsec)
 {
-    switch (notification) {
-    case ISR_TX:
-        handleTransmitInterrupt();
-        startReceive();
-        // DEBUG_MSG("tx complete - starting timer\n");
-        startTransmitTimer();
-        break;
-    case ISR_RX:
-        handleReceiveInterrupt();
-        startReceive();
-        // DEBUG_MSG("rx complete - starting timer\n");
-        startTransmitTimer();
-        break;
-    case TRANSMIT_DELAY_COMPLETED:
-        // DEBUG_MSG("delay done\n");
-
-        // If we are not currently in receive mode, then restart the timer and try again later (this can happen if the main thread
-        // has placed the unit into standby)  FIXME, how will this work if the chipset is in sleep mode?
-        if (!txQueue.isEmpty()) {
-            if (!canSendImmediately()) {
-                startTransmitTimer(); // try again in a little while
-            } else {
-                // Send any outgoing packets we have ready
-                MeshPacket *txp = txQueue.dequeuePtr(0);
-                assert(txp);
-                startSend(txp);
+    // The irq is level triggered and the radio holds it high until we read the packet out, so if it is low we woke for
+    // some other reason (button, PMU etc...)
+    if (!digitalRead(getIrqPin()))
+        return false;
+
+    // Our ISR might or might not have already run (depending on when the GPIO matrix noticed the level), either way the
+    // wake time is our best clue to when the frame finished.  We only sleep while receiving, so this must be an rx interrupt.
+    isrTimeUsec = wakeUsec;
+    disableInterrupt();
+    notify(ISR_RX);
+    NotifiedWorkerThread::runOnce(); // Consumes the notification, so the scheduler won't run us again for this interrupt
+
+    lastWakeLatencyUsec = micros() - wakeUsec;
+    if (lastWakeLatencyUsec > maxWakeLatencyUsec)
+        maxWakeLatencyUsec = lastWakeLatencyUsec;
+    numRadioWakes++;
+
+    return true;
+}
+
+void RadioLibInterface::onNotify(uint32_t events)
+{
+    if (events & (ISR_TX | ISR_RX)) {
+        if (events & ISR_TX)
+            handleTransmitInterrupt();
+        if (events & ISR_RX)
+            handleReceiveInterrupt();
+        if (!perhapsChangeChannel())
+            startReceive();
+
+        // If our transmit delay is also done we look at our queue just below, otherwise start it
+        if (!(events & TRANSMIT_DELAY_COMPLETED))
+            startTransmitTimer();
+    }
+
+    if (events & TRANSMIT_DELAY_COMPLETED)
+        onTransmitDelayCompleted();
+}
+
+void RadioLibInterface::onTransmitDelayCompleted()
+{
+    // DEBUG_MSG("delay done\n");
+#ifdef LORA_SLOTTED_TX
+    slotTimerPending = false;
+    if (txQueue.isEmpty() && !slotQueue.isEmpty()) {
+        if (!canUseSlots()) {
+            // We lost our GPS time (or are off on a data channel), so our queued broadcasts go out the usual way
+            MeshPacket *slotp;
+            while ((slotp = slotQueue.dequeue()) != NULL) {
+                MeshPacket *dropped;
+                if (!txQueue.enqueue(slotp, TX_PRIORITY_BACKGROUND, TX_SOURCE_LOCAL, getPacketTime(slotp), &dropped))
+                    packetPool.release(slotp);
+                else if (dropped)
+                    packetPool.release(dropped);
             }
+        } else if (!slots.getMsecUntilOurSlot() && !sendingPacket && !(isReceiving && isActivelyReceiving())) {
+            // No contention delay or CAD, our slot is ours
+            startSend(slotQueue.dequeue());
+            return;
+        }
+        startTransmitTimer();
+        return;
+    }
+#endif
+
+    // If we are not currently in receive mode, then restart the timer and try again later (this can happen if the main thread
+    // has placed the unit into standby)  FIXME, how will this work if the chipset is in sleep mode?
+    if (!txQueue.isEmpty()) {
+        if (!canSendImmediately()) {
+            growContentionWindow(); // someone else is using the channel, so spread our attempts out more
+            startTransmitTimer();   // try again in a little while
         } else {
-            // DEBUG_MSG("done with txqueue\n");
+            // Send any outgoing packets we have ready
+            MeshPacket *txp = txQueue.dequeue();
+            assert(txp);
+            shrinkContentionWindow(); // we found the channel clear
+            startSend(txp);
         }
-        break;
-    default:
-        assert(0); // We expected to receive a valid notification from the ISR
     }
 }
 
-void RadioLibInterface::startTransmitTimer(bool withDelay)
+void RadioLibInterface::setDataChannel(int8_t channel, uint8_t dataSf)
+{
+    wantedDataChannel = channel;
+    wantedDataSf = channel >= 0 ? dataSf : 0;
+    channelChangePending = true;
+    perhapsChangeChannel();
+}
+
+void RadioLibInterface::onConfigChanged()
+{
+    applyModemConfig();
+    if (isRetuneNeeded() || channelChangePending) {
+        configChangePending = true;
+        perhapsChangeChannel(); // Or later, once we are idle
+        return;
+    }
+
+    reconfigure(); // Which won't need standby, so doesn't interrupt anything
+}
+
+#ifdef LORA_CHANNEL_SYNC_WORD
+/**
+ * A sync word for the channel with this hash.  Both nibbles are 1-7 (SX127x radios only match on some bits of the higher ones,
+ * SX126x radios use every bit), and never LoRaWAN's 0x34 or the 0x12 everyone else uses.  Uses different bits of the hash than
+ * our network id.
+ */
+static uint8_t pickSyncWord(uint32_t channelHash)
+{
+    uint8_t high = 1 + (channelHash >> 8) % 7, low = 1 + (channelHash >> 16) % 7;
+    uint8_t word = (high << 4) | low;
+    if (word == 0x34 || word == SX126X_SYNC_WORD_PRIVATE)
+        word++; // Its low nibble is at most 4, so still 1-7
+    return word;
+}
+#endif
+
+void RadioLibInterface::applyModemConfig()
+{
+    RadioInterface::applyModemConfig();
+
+#ifdef LORA_CHANNEL_SYNC_WORD
+    // Radios drop frames with another sync word in hardware, before they even interrupt us.  Note: all nodes in the mesh must
+    // be running a build with it.
+    syncWord = pickSyncWord(channelHash);
+#endif
+}
+
+bool RadioLibInterface::isRetuneNeeded() const
+{
+    return !isTuned || tuned.freq != freq || tuned.bw != bw || tuned.sf != sf || tuned.cr != cr ||
+           tuned.preambleLength != preambleLength || tuned.syncWord != syncWord;
+}
+
+void RadioLibInterface::markTuned()
+{
+    tuned.freq = freq;
+    tuned.bw = bw;
+    tuned.sf = sf;
+    tuned.cr = cr;
+    tuned.preambleLength = preambleLength;
+    tuned.syncWord = syncWord;
+    isTuned = true;
+}
+
+bool RadioLibInterface::perhapsChangeChannel()
+{
+    // A channel change also waits for our txQueue, which was meant for our old channel
+    bool wanted = channelChangePending ? txQueue.isEmpty() : configChangePending;
+    if (!wanted || sendingPacket || (isReceiving && isActivelyReceiving()))
+        return false;
+
+    channelChangePending = configChangePending = false;
+    reconfigure(); // Which tunes to the channel applyModemConfig() picks, and starts receiving
+    LOG_DEBUG(RADIO, "Now on channel %u at sf %u (control channel %u)\n", getChannel(), getSpreadFactor(), getControlChannel());
+    return true;
+}
+
+NoiseMonitor *RadioLibInterface::getNoiseMonitor()
+{
+    return noiseMonitor && noiseMonitor->getRadio() == this ? noiseMonitor : NULL;
+}
+
+bool RadioLibInterface::surveyChannel(uint8_t channel, ChannelSample &sample)
+{
+    // Only between frames, with nothing of ours waiting to go out and no retune waiting for us
+    if (!isTuned || !isReceiving || sendingPacket || !txQueue.isEmpty() || channelChangePending || configChangePending ||
+        channel >= getNumChannels() || isActivelyReceiving())
+        return false;
+#ifdef LORA_SLOTTED_TX
+    if (!slotQueue.isEmpty())
+        return false;
+#endif
+
+    setStandby();
+    bool ok = channel == currentChannel || tuneFrequency(myRegion->freq + myRegion->spacing * channel);
+    if (ok) {
+        sample.busy = isChannelActive();
+        sample.rssi = readInstantRssi();
+    }
+
+    if (channel != currentChannel)
+        tuneFrequency(tuned.freq);
+    startReceive();
+    return ok;
+}
+
+void RadioLibInterface::startTransmitTimer(bool withDelay, uint32_t delayMsec)
 {
     // If we have work to do and the timer wasn't already scheduled, schedule it now
     if (!txQueue.isEmpty()) {
-        uint32_t delay = !withDelay ? 1 : getTxDelayMsec();
+        uint32_t delay = !withDelay ? 1 : delayMsec ? delayMsec : getTxDelayMsec();
+        if (!txDelayStarted) {
+            // Retries because the channel was busy are part of the same delay
+            txDelayStarted = true;
+            txDelayStartUsec = micros();
+        }
         // DEBUG_MSG("xmit timer %d\n", delay);
-        notifyLater(delay, TRANSMIT_DELAY_COMPLETED, false); // This will implicitly enable
+#ifdef LORA_SLOTTED_TX
+        if (!notifyLaterUsec(delay * 1000, TRANSMIT_DELAY_COMPLETED) && slotTimerPending) {
+            rescheduleLaterUsec(delay * 1000); // Don't make these wait for our slot too
+            slotTimerPending = false;
+        }
+    } else if (!slotQueue.isEmpty()) {
+        uint32_t delay = canUseSlots() ? slots.getMsecUntilOurSlot() : 0;
+        if (notifyLaterUsec(delay ? delay * 1000 : 1000, TRANSMIT_DELAY_COMPLETED))
+            slotTimerPending = true;
+#else
+        notifyLaterUsec(delay * 1000, TRANSMIT_DELAY_COMPLETED); // This will implicitly enable
+#endif
     }
 }
 
@@ -193,15 +481,24 @@ void RadioLibInterface::completeSending()
 {
     // We are careful to clear sending packet before calling printPacket because
     // that can take a long time
+    traceSendingFrame(TRACE_TX_AIR, micros());
+    notifyTxDone(); // So reliable sends time their retransmissions from now, not from when they were queued
+    txDelayStarted = false; // Our next frame's delay starts now
+
     auto p = sendingPacket;
     sendingPacket = NULL;
 
     if (p) {
         txGood++;
-        printPacket("Completed sending", p);
+        LOG_PACKET(RADIO, "Completed sending", p);
 
         // We are done sending that packet, release it
         packetPool.release(p);
+
+        // And any others which shared its frame
+        for (size_t i = 0; i < numAggregated; i++)
+            packetPool.release(aggregatedPackets[i]);
+        numAggregated = 0;
         // DEBUG_MSG("Done with send\n");
     }
 }
@@ -211,73 +508,137 @@ void RadioLibInterface::handleReceiveInterrupt()
     uint32_t xmitMsec;
     assert(isReceiving);
     isReceiving = false;
+    activeRxStart = 0; // This time is counted by RX_ALL_LOG
+
+    size_t length;
+    int state;
+    {
+        // Get everything we need for this frame in one go, so we only wait for the SPI bus once
+        LockingModule::Batch batch(module);
+
+        // read the number of actually received bytes
+        length = iface->getPacketLength();
+
+        state = iface->readData(radiobuf, length);
+        if (state == ERR_NONE)
+            readReceiveMetadata();
+#ifdef LORA_FRAME_CAPTURE
+        else if (state == ERR_CRC_MISMATCH)
+            readReceiveMetadata(); // So our capture shows how well we heard the corrupt frame
+#endif
+    }
 
-    // read the number of actually received bytes
-    size_t length = iface->getPacketLength();
-
-    xmitMsec = getPacketTime(length);
+    uint32_t xmitUsec = getPacketTimeUsec(length);
+    xmitMsec = xmitUsec / 1000;
     logAirtime(RX_ALL_LOG, xmitMsec);
 
-    int state = iface->readData(radiobuf, length);
+    // Our interrupt fired once the whole frame was in, so the frame started one airtime earlier
+    rxIsrUsec = isrTimeUsec;
+    rxFrameStartUsec = rxIsrUsec - xmitUsec;
+#ifdef LORA_FRAME_CAPTURE
+    if (state == ERR_NONE || state == ERR_CRC_MISMATCH)
+        captureFrame(length, rxIsrUsec, state == ERR_NONE ? 0 : FRAME_CAPTURE_BAD_CRC);
+#endif
+#ifdef LORA_SLOTTED_TX
+    if (state == ERR_NONE && canUseSlots())
+        slots.onFrameStart(micros() - rxFrameStartUsec);
+#endif
+
+    NoiseMonitor *noise = getNoiseMonitor();
+    if (noise) {
+        noise->onFrame();
+        if (state == ERR_CRC_MISMATCH)
+            noise->onCrcError();
+        else if (state == ERR_NONE)
+            noise->onGoodFrame(rxSnr, rxRssi);
+    }
+
     if (state != ERR_NONE) {
-        DEBUG_MSG("ignoring received packet due to error=%d\n", state);
+        LOG_ERROR(RADIO, "ignoring received packet due to error=%d\n", state);
+        rxBad++;
+        if (!noise || !noise->isInterfered())
+            growContentionWindow(); // Corrupt packets are usually collisions (unless we know something is interfering)
+#ifdef LORA_NETWORK_ID
+    } else if (!length || radiobuf[length - 1] != getNetworkId()) {
+        countRxDrop(RX_DROP_FOREIGN); // Not worth a log line, these can be most of what we hear
+        rxBad++;
+#endif
+    } else if (!deliverFrame(radiobuf, length - NETWORK_ID_LEN)) {
         rxBad++;
     } else {
-        // Skip the 4 headers that are at the beginning of the rxBuf
-        int32_t payloadLen = length - sizeof(PacketHeader);
-        const uint8_t *payload = radiobuf + sizeof(PacketHeader);
-
-        // check for short packets
-        if (payloadLen < 0) {
-            DEBUG_MSG("ignoring received packet too short\n");
-            rxBad++;
-        } else {
-            const PacketHeader *h = (PacketHeader *)radiobuf;
-
-            rxGood++;
-
-            // Note: we deliver _all_ packets to our router (i.e. our interface is intentionally promiscuous).
-            // This allows the router and other apps on our node to sniff packets (usually routing) between other
-            // nodes.
-            MeshPacket *mp = packetPool.allocZeroed();
-
-            mp->from = h->from;
-            mp->to = h->to;
-            mp->id = h->id;
-            assert(HOP_MAX <= PACKET_FLAGS_HOP_MASK); // If hopmax changes, carefully check this code
-            mp->hop_limit = h->flags & PACKET_FLAGS_HOP_MASK;
-            mp->want_ack = !!(h->flags & PACKET_FLAGS_WANT_ACK_MASK);
-
-            addReceiveMetadata(mp);
-
-            mp->which_payload = MeshPacket_encrypted_tag; // Mark that the payload is still encrypted at this point
-            assert(((uint32_t) payloadLen) <= sizeof(mp->encrypted.bytes));
-            memcpy(mp->encrypted.bytes, payload, payloadLen);
-            mp->encrypted.size = payloadLen;
-
-            printPacket("Lora RX", mp);
-
-            xmitMsec = getPacketTime(mp);
-            logAirtime(RX_LOG, xmitMsec);
-
-            deliverToReceiver(mp);
-        }
+        rxGood++;
+        logAirtime(RX_LOG, xmitMsec);
     }
 }
 
 /** start an immediate transmit */
 void RadioLibInterface::startSend(MeshPacket *txp)
 {
-    printPacket("Starting low level send", txp);
+    LOG_PACKET(RADIO, "Starting low level send", txp);
     setStandby(); // Cancel any already in process receives
 
     configHardwareForSend(); // must be after setStandby
 
     size_t numbytes = beginSending(txp);
 
+#ifdef LORA_AGGREGATE_PACKETS
+    // Share our preamble and header with any other small packets which are ready to go.  Note: all nodes in the mesh must be
+    // running a build which understands aggregate frames.
+    MeshPacket *more;
+    size_t spaceLeft;
+    while ((spaceLeft = aggregateSpaceLeft(numbytes)) > 0 && (more = txQueue.dequeueIfFits(spaceLeft)) != NULL) {
+        LOG_PACKET(RADIO, "Aggregating", more);
+        numbytes = appendToSending(more, numbytes);
+    }
+#endif
+
+    // A frame which only holds unicasts for one neighbor just needs to be loud enough for them, so we don't drown out other
+    // conversations further away.  Anything else goes out at full power.
+    NodeNum to = sendingCompact || sendingCoded ? NODENUM_BROADCAST : sendingPacket->to;
+    for (size_t i = 0; i < numAggregated; i++)
+        if (aggregatedPackets[i]->to != to)
+            to = NODENUM_BROADCAST;
+    int8_t framePower = to == NODENUM_BROADCAST ? power : neighbors.pickTxPower(to, power, sf);
+    if (framePower != txPower) {
+        setTxPower(framePower);
+        txPower = framePower;
+    }
+
+#ifdef LORA_NETWORK_ID
+    radiobuf[numbytes++] = getNetworkId(); // aggregateSpaceLeft() kept room for it
+#endif
+
+    traceSendingFrame(TRACE_TX_QUEUE, txDelayStartUsec);
+    traceSendingFrame(TRACE_TX_TIMER, micros());
+    txDelayStarted = false; // Waiting for this frame to finish is not part of any packet's transmit delay
+
+#ifdef LORA_FRAME_CAPTURE
+    captureFrame(numbytes, micros(), FRAME_CAPTURE_TX);
+#endif
+
     int res = iface->startTransmit(radiobuf, numbytes);
     assert(res == ERR_NONE);
 
     // Must be done AFTER, starting transmit, because startTransmit clears (possibly stale) interrupt pending register bits
     enableInterrupt(isrTxLevel0);
 }
+
+#ifdef LORA_FRAME_CAPTURE
+void RadioLibInterface::captureFrame(size_t length, uint32_t atUsec, uint8_t flags)
+{
+    if (!frameCapture)
+        return;
+
+    CapturedFrame info;
+    info.usec = atUsec;
+    info.freq = freq;
+    info.bw = bw;
+    info.snr = rxSnr;
+    info.rssi = rxRssi;
+    info.sf = sf;
+    info.syncWord = syncWord;
+    info.flags = flags;
+    info.len = min(length, (size_t)MAX_LORA_FRAME_LEN);
+    frameCapture->capture(info, radiobuf);
+}
+#endif
@@ -3,12 +3,18 @@
 #include "../concurrency/OSThread.h"
 #include "RadioInterface.h"
 
+#ifdef LORA_FRAME_CAPTURE
+#include "FrameCapture.h"
+#endif
+
 #ifdef CubeCell_BoardPlus
 #define RADIOLIB_SOFTWARE_SERIAL_UNSUPPORTED
 #endif
 
 #include <RadioLib.h>
 
+class NoiseMonitor;
+
 // ESP32 has special rules about ISR code
 #ifdef ARDUINO_ARCH_ESP32
 #define INTERRUPT_ATTR IRAM_ATTR
@@ -57,12 +63,35 @@ class LockingModule : public Module
     \param numBytes Number of bytes to transfer.
     */
     virtual void SPItransfer(uint8_t cmd, uint8_t reg, uint8_t *dataOut, uint8_t *dataIn, uint8_t numBytes);
+
+    /**
+     * Holds the SPI lock across several register accesses, so a burst of reads (i.e. everything we need for a received
+     * packet) only has to wait for the bus once.  Only use this from the thread which owns the radio.
+     */
+    class Batch
+    {
+        LockingModule &module;
+
+      public:
+        explicit Batch(LockingModule &_module);
+        ~Batch();
+
+        Batch(const Batch &) = delete;
+        Batch &operator=(const Batch &) = delete;
+    };
+
+  private:
+    /// True while a Batch holds the SPI lock for us
+    bool inBatch = false;
+
+    /// Send/receive numBytes after the register address as a single block (which the SPI driver can hand to its DMA/FIFO)
+    void SPItransferBlock(uint8_t cmd, uint8_t reg, uint8_t *dataOut, uint8_t *dataIn, uint8_t numBytes);
 };
 
 class RadioLibInterface : public RadioInterface, protected concurrency::NotifiedWorkerThread
 {
-    /// Used as our notification from the ISR
-    enum PendingISR { ISR_NONE = 0, ISR_RX, ISR_TX, TRANSMIT_DELAY_COMPLETED };
+    /// Our notification event bits, from the ISR (or our transmit timer).  Several can be pending at once
+    enum PendingISR { ISR_NONE = 0, ISR_RX = 1 << 0, ISR_TX = 1 << 1, TRANSMIT_DELAY_COMPLETED = 1 << 2 };
 
     /**
      * Raw ISR handler that just calls our polymorphic method
@@ -74,13 +103,27 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
      */
     uint32_t rxBad = 0, rxGood = 0, txGood = 0;
 
-    PointerQueue<MeshPacket> txQueue = PointerQueue<MeshPacket>(MAX_TX_QUEUE);
+    MeshPacketQueue txQueue = MeshPacketQueue(MAX_TX_QUEUE);
+
+#ifdef LORA_SLOTTED_TX
+    /// Our own periodic broadcasts, waiting for our slot (see TxSlots)
+    MeshPacketQueue slotQueue = MeshPacketQueue(TDMA_MAX_QUEUED);
+
+    /// True while our transmit timer is waiting for our slot, rather than for a contention delay
+    bool slotTimerPending = false;
+
+    /// @return true if p should wait for our slot rather than contend for the channel
+    bool wantsSlot(const MeshPacket *p, TxPriority priority);
+
+    /// @return true if we can send slotted packets now (we have GPS time, and are on the channel our slots are for)
+    bool canUseSlots();
+#endif
 
   protected:
 
     /**
-     * FIXME, use a meshtastic sync word, but hashed with the Channel name.  Currently picking the same default
-     * the RF95 used (0x14). Note: do not use 0x34 - that is reserved for lorawan
+     * The private LoRa sync word (SX126X_SYNC_WORD_PRIVATE, 0x12), unless we are built with LORA_CHANNEL_SYNC_WORD (which
+     * hashes our channel, see applyModemConfig()).  Note: do not use 0x34 - that is reserved for lorawan
      */
     uint8_t syncWord = SX126X_SYNC_WORD_PRIVATE;
 
@@ -96,11 +139,31 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
     /// are _trying_ to receive a packet currently (note - we might just be waiting for one)
     bool isReceiving;
 
+    /// When we first saw the radio actively receiving (or 0 if it wasn't), only sampled when we want to send
+    uint32_t activeRxStart = 0;
+
   public:
     /** Our ISR code currently needs this to find our active instance
      */
     static RadioLibInterface *instance;
 
+    /// The pin our radio raises when it has something for us (so we can wake from light sleep)
+    RADIOLIB_PIN_TYPE getIrqPin() { return module.getIrq(); }
+
+    /**
+     * We just woke from light sleep because of a GPIO.  If it was our radio, handle its receive interrupt right now (rather
+     * than waiting for the scheduler to get round to us) so the packet reaches the router with as little delay as possible.
+     *
+     * @param wakeUsec micros() when the CPU came out of sleep
+     * @return true if the radio was the reason we woke
+     */
+    bool handleSleepWake(uint32_t wakeUsec);
+
+    virtual RadioStats getStats();
+
+    /// Wake to received packet handled latency stats for handleSleepWake, in usecs
+    uint32_t lastWakeLatencyUsec = 0, maxWakeLatencyUsec = 0, numRadioWakes = 0;
+
     /**
      * Glue functions called from ISR land
      */
@@ -115,7 +178,9 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
     RadioLibInterface(RADIOLIB_PIN_TYPE cs, RADIOLIB_PIN_TYPE irq, RADIOLIB_PIN_TYPE rst, RADIOLIB_PIN_TYPE busy, SPIClass &spi,
                       PhysicalLayer *iface = NULL);
 
-    virtual ErrorCode send(MeshPacket *p);
+    virtual ErrorCode send(MeshPacket *p, TxPriority priority, TxSource source);
+
+    virtual TxQueueStatus getTxQueueStatus() { return txQueue.getStatus(); }
 
     /**
      * Return true if we think the board can go to sleep (i.e. our tx queue is empty, we are not sending or receiving)
@@ -136,20 +201,49 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
      */
     virtual bool isActivelyReceiving() = 0;
 
+    /// We don't retune until we have sent (or given up on) everything we queued for our old channel
+    virtual void setDataChannel(int8_t channel, uint8_t dataSf = 0);
+
+    /// Power changes take effect right away, anything which needs a retune waits until we have finished the frame we are
+    /// sending or receiving (packets in our txQueue are kept, and go out with the new settings)
+    virtual void onConfigChanged();
+
+    /// Runs channel activity detection (and reads the RSSI, if our chip can) on the other channel, between frames
+    virtual bool surveyChannel(uint8_t channel, ChannelSample &sample);
+
   private:
+    /// Set by setDataChannel() until we can actually retune
+    bool channelChangePending = false;
+
+    /// Set by onConfigChanged() until we can actually retune
+    bool configChangePending = false;
+
+    /// Retune if setDataChannel() or onConfigChanged() asked us to and we are idle, @return true if we did (which also
+    /// restarted receiving)
+    bool perhapsChangeChannel();
+
+    /// The NoiseMonitor watching our channel, or NULL if we don't have one
+    NoiseMonitor *getNoiseMonitor();
+
     /** if we have something waiting to send, start a short random timer so we can come check for collision before actually doing
      * the transmit
      *
-     * If the timer was already running, we just wait for that one to occur.
+     * If the timer was already running, we just wait for that one to occur.  Where we have a hardware timer it fires on time,
+     * whatever the main loop is doing (see notifyLaterUsec()).
+     *
+     * @param delayMsec if set, the delay to use instead of a random one (see getTurnaroundMsec())
      * */
-    void startTransmitTimer(bool withDelay = true);
+    void startTransmitTimer(bool withDelay = true, uint32_t delayMsec = 0);
 
     void handleTransmitInterrupt();
     void handleReceiveInterrupt();
 
     static void timerCallback(void *p1, uint32_t p2);
 
-    virtual void onNotify(uint32_t notification);
+    virtual void onNotify(uint32_t events);
+
+    /// Our transmit delay (or slot timer) is done, send what we can
+    void onTransmitDelayCompleted();
 
     /** start an immediate transmit
      *  This method is virtual so subclasses can hook as needed, subclasses should not call directly
@@ -164,6 +258,21 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
     /** Could we send right now (i.e. either not actively receiving or transmitting)? */
     virtual bool canSendImmediately();
 
+    /**
+     * Use the radio's Channel Activity Detection to check whether someone else is already transmitting (even if we haven't
+     * received their header yet).  Only called when we are about to send, this leaves the radio in standby.
+     *
+     * Subclasses should override, the default assumes the channel is clear.
+     */
+    virtual bool isChannelActive() { return false; }
+
+    /// Retune our chip (in standby) to freq without touching our other settings, @return false if we can't (so we can't survey)
+    virtual bool tuneFrequency(float freq) { return false; }
+
+    /// @return the instantaneous RSSI (in dBm) on the frequency we are tuned to, or 0 if our chip can't tell us.  Leaves the
+    /// radio in standby.
+    virtual int16_t readInstantRssi() { return 0; }
+
     /**
      * Raw ISR handler that just calls our polymorphic method
      */
@@ -174,9 +283,49 @@ class RadioLibInterface : public RadioInterface, protected concurrency::Notified
     void completeSending();
 
     /**
-     * Add SNR data to received messages
+     * Read the link metrics for the frame we just received into rxSnr/rxRssi (called while we hold the SPI bus for the rest of
+     * the frame)
      */
-    virtual void addReceiveMetadata(MeshPacket *mp) = 0;
+    virtual void readReceiveMetadata() = 0;
+
+#ifdef LORA_FRAME_CAPTURE
+    /// Give the frame in radiobuf (with our current modem settings and link metrics) to frameCapture
+    void captureFrame(size_t length, uint32_t atUsec, uint8_t flags);
+#endif
+
+    /// micros() when our last interrupt fired (set in the ISR)
+    volatile uint32_t isrTimeUsec = 0;
 
+    /// micros() when we started the transmit delay for our next frame (valid if txDelayStarted), for packetTrace
+    uint32_t txDelayStartUsec = 0;
+    bool txDelayStarted = false;
+
+  protected:
     virtual void setStandby() = 0;
+
+    /// Set the power (in dBm) of the frames we send from now on (never more than the full power reconfigure() chose)
+    virtual void setTxPower(int8_t dbm) = 0;
+
+    /// The power our radio is currently set to send with (subclasses set this whenever they set our full power)
+    int8_t txPower = 0;
+
+    /// Also picks our sync word, which builds with LORA_CHANNEL_SYNC_WORD derive from our channel
+    virtual void applyModemConfig();
+
+    /// @return true if applyModemConfig() picked modem settings or a frequency our chip isn't tuned to.  Changing those
+    /// needs the chip in standby (which loses any frame we are sending or receiving), changing just our power doesn't.
+    bool isRetuneNeeded() const;
+
+    /// Subclasses call this once they have tuned our chip to what applyModemConfig() picked
+    void markTuned();
+
+  private:
+    /// What our chip is tuned to (valid once isTuned)
+    struct {
+        float freq, bw;
+        uint8_t sf, cr;
+        uint16_t preambleLength;
+        uint8_t syncWord;
+    } tuned;
+    bool isTuned = false;
 };
\ No newline at end of file
@@ -71,6 +71,26 @@ bool RadioLibRF95::isReceiving()
                    RH_RF95_MODEM_STATUS_HEADER_INFO_VALID)) != 0;
 }
 
+void RadioLibRF95::readPacketStatus(float &snr, float &rssi)
+{
+    // The SNR and RSSI registers are adjacent, so we can burst read both
+    static_assert(SX127X_REG_PKT_RSSI_VALUE == SX127X_REG_PKT_SNR_VALUE + 1, "packet status registers must be adjacent");
+    uint8_t regs[2];
+    _mod->SPIreadRegisterBurst(SX127X_REG_PKT_SNR_VALUE, sizeof(regs), regs);
+
+    // The same conversions as SX1278::getSNR() and getRSSI()
+    snr = (int8_t)regs[0] / 4.0;
+    rssi = (_freq < 868.0 ? -164 : -157) + regs[1];
+    if (snr < 0.0)
+        rssi += snr;
+}
+
+int16_t RadioLibRF95::readInstantRssi()
+{
+    // The same conversion as the packet RSSI
+    return (_freq < 868.0 ? -164 : -157) + readReg(SX127X_REG_RSSI_VALUE);
+}
+
 uint8_t RadioLibRF95::readReg(uint8_t addr)
 {
     return _mod->SPIreadRegister(addr);
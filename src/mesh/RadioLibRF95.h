@@ -62,6 +62,13 @@ class RadioLibRF95: public SX1278 {
     // Return true if we are actively receiving a message currently
     bool isReceiving();
 
+    /// Read the SNR (dB) and RSSI (dBm) of the last packet we received, in one SPI transfer (getSNR() then getRSSI() take
+    /// three, which matters on slow buses like the pinetab's USB dongle)
+    void readPacketStatus(float &snr, float &rssi);
+
+    /// The RSSI (dBm) the chip sees on its frequency right now (only meaningful while receiving)
+    int16_t readInstantRssi();
+
     /// For debugging
     uint8_t readReg(uint8_t addr); 
 
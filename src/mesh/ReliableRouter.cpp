@@ -1,9 +1,20 @@
 #include "ReliableRouter.h"
+#include "HopStarts.h"
 #include "MeshTypes.h"
+#include "NeighborTable.h"
 #include "configuration.h"
 #include "mesh-pb-constants.h"
 
-// ReliableRouter::ReliableRouter() {}
+ReliableRouter::ReliableRouter()
+{
+    for (size_t i = 0; i < PENDING_HASH_SIZE; i++)
+        buckets[i] = -1;
+
+    // All slots start out on the free list
+    for (size_t i = 0; i < MAX_PENDING_PACKETS; i++)
+        slots[i].next = i + 1 < MAX_PENDING_PACKETS ? (int8_t)(i + 1) : -1;
+    freeSlot = 0;
+}
 
 /**
  * If the message is want_ack, then add it to a list of packets to retransmit.
@@ -11,14 +22,29 @@
  */
 ErrorCode ReliableRouter::send(MeshPacket *p)
 {
+    // If we owe this neighbor an ack, let it ride along for free
+    if (p->which_payload == MeshPacket_decoded_tag && p->to != NODENUM_BROADCAST && !p->decoded.which_ack) {
+        for (size_t i = 0; i < numHeldAcks; i++)
+            if (heldAcks[i].to == p->to) {
+                LOG_DEBUG(MESH, "Piggybacking ack=%d on id=%d\n", heldAcks[i].id, p->id);
+                p->decoded.which_ack = SubPacket_success_id_tag;
+                p->decoded.ack.success_id = heldAcks[i].id;
+                memmove(heldAcks + i, heldAcks + i + 1, (numHeldAcks - i - 1) * sizeof(HeldAck));
+                numHeldAcks--;
+                break;
+            }
+    }
+
     if (p->want_ack) {
         // If someone asks for acks on broadcast, we need the hop limit to be at least one, so that first node that receives our
         // message will rebroadcast
         if (p->to == NODENUM_BROADCAST && p->hop_limit == 0)
             p->hop_limit = 1;
 
-        auto copy = packetPool.allocCopy(*p);
-        startRetransmission(copy);
+        // Router::send() makes its own copy if it needs to change the packet, so we can share it
+        auto copy = packetPool.share(p);
+        if (!startRetransmission(copy))
+            packetPool.release(copy); // We will only try sending it once
     }
 
     return FloodingRouter::send(p);
@@ -27,13 +53,13 @@ ErrorCode ReliableRouter::send(MeshPacket *p)
 bool ReliableRouter::shouldFilterReceived(const MeshPacket *p)
 {
     if (p->to == NODENUM_BROADCAST && p->from == getNodeNum()) {
-        printPacket("Rx someone rebroadcasting for us", p);
+        LOG_PACKET(MESH, "Rx someone rebroadcasting for us", p);
 
         // We are seeing someone rebroadcast one of our broadcast attempts.
         // If this is the first time we saw this, cancel any retransmissions we have queued up and generate an internal ack for
         // the original sending process.
         if (stopRetransmission(p->from, p->id)) {
-            DEBUG_MSG("Someone is retransmitting for us, generate implicit ack\n");
+            LOG_DEBUG(MESH, "Someone is retransmitting for us, generate implicit ack\n");
             sendAckNak(true, p->from, p->id);
         }
     }
@@ -60,7 +86,7 @@ void ReliableRouter::sniffReceived(const MeshPacket *p)
     if (p->to == ourNode) { // ignore ack/nak/want_ack packets that are not address to us (we only handle 0 hop reliability
                             // - not DSR routing)
         if (p->want_ack) {
-            sendAckNak(true, p->from, p->id);
+            holdAck(p->from, p->id);
         }
 
         // If the payload is valid, look for ack/nak
@@ -71,10 +97,15 @@ void ReliableRouter::sniffReceived(const MeshPacket *p)
         // We intentionally don't check wasSeenRecently, because it is harmless to delete non existent retransmission records
         if (ackId || nakId) {
             if (ackId) {
-                DEBUG_MSG("Received a ack=%d, stopping retransmissions\n", ackId);
+                LOG_DEBUG(MESH, "Received a ack=%d, stopping retransmissions\n", ackId);
+                PendingPacket *pending = findPendingPacket(p->to, ackId);
+                if (pending) {
+                    updateRtt(pending);
+                    neighbors.onAck(pending->packet->to);
+                }
                 stopRetransmission(p->to, ackId);
             } else {
-                DEBUG_MSG("Received a nak=%d, stopping retransmissions\n", nakId);
+                LOG_DEBUG(MESH, "Received a nak=%d, stopping retransmissions\n", nakId);
                 stopRetransmission(p->to, nakId);
             }
         }
@@ -92,7 +123,7 @@ void ReliableRouter::sendAckNak(bool isAck, NodeNum to, PacketId idFrom)
     auto p = allocForSending();
     p->hop_limit = 0; // Assume just immediate neighbors for now
     p->to = to;
-    DEBUG_MSG("Sending an ack=0x%x,to=0x%x,idFrom=0x%x,id=0x%x\n", isAck, to, idFrom, p->id);
+    LOG_DEBUG(MESH, "Sending an ack=0x%x,to=0x%x,idFrom=0x%x,id=0x%x\n", isAck, to, idFrom, p->id);
 
     if (isAck) {
         p->decoded.ack.success_id = idFrom;
@@ -105,22 +136,69 @@ void ReliableRouter::sendAckNak(bool isAck, NodeNum to, PacketId idFrom)
     sendLocal(p); // we sometimes send directly to the local node
 }
 
-#define NUM_RETRANSMISSIONS 3
+void ReliableRouter::holdAck(NodeNum to, PacketId idFrom)
+{
+    uint32_t holdMsec = iface ? iface->shortPacketMsec / 2 : 0;
 
-PendingPacket::PendingPacket(MeshPacket *p)
+    for (size_t i = 0; i < numHeldAcks; i++)
+        if (heldAcks[i].to == to && heldAcks[i].id == idFrom)
+            return; // They retransmitted before our ack went out, the one we already have will do
+
+    if (numHeldAcks == MAX_HELD_ACKS)
+        sendHeldAcks(heldAcks[0].to); // Make room by sending the acks we have held longest
+
+    heldAcks[numHeldAcks++] = {to, idFrom, millis() + holdMsec};
+    setIntervalFromNow(0); // Make sure runOnce() picks up our new deadline
+}
+
+void ReliableRouter::sendHeldAcks(NodeNum to)
 {
-    packet = p;
-    numRetransmissions = NUM_RETRANSMISSIONS - 1; // We subtract one, because we assume the user just did the first send
+    for (size_t i = 0; i < numHeldAcks;) {
+        if (heldAcks[i].to != to) {
+            i++;
+            continue;
+        }
+
+        PacketId id = heldAcks[i].id;
+        memmove(heldAcks + i, heldAcks + i + 1, (numHeldAcks - i - 1) * sizeof(HeldAck));
+        numHeldAcks--;
+        sendAckNak(true, to, id);
+    }
+}
+
+int32_t ReliableRouter::doHeldAcks()
+{
+    uint32_t now = millis();
+
+    // Held acks are kept oldest first, so we only need to look at the front
+    while (numHeldAcks) {
+        int32_t t = heldAcks[0].sendMsec - now;
+        if (t > 0)
+            return t;
+
+        sendHeldAcks(heldAcks[0].to);
+    }
+
+    return INT32_MAX;
 }
 
+#define NUM_RETRANSMISSIONS 3
+
 PendingPacket *ReliableRouter::findPendingPacket(GlobalPacketId key)
 {
-    auto old = pending.find(key); // If we have an old record, someone messed up because id got reused
-    if (old != pending.end()) {
-        return &old->second;
-    } else
-        return NULL;
+    int slot = findSlot(key);
+    return slot >= 0 ? &slots[slot] : NULL;
+}
+
+int ReliableRouter::findSlot(GlobalPacketId key) const
+{
+    for (int i = buckets[hashOf(key)]; i >= 0; i = slots[i].next)
+        if (GlobalPacketId(slots[i].packet) == key)
+            return i;
+
+    return -1;
 }
+
 /**
  * Stop any retransmissions we are doing of the specified node/packet ID pair
  */
@@ -132,14 +210,23 @@ bool ReliableRouter::stopRetransmission(NodeNum from, PacketId id)
 
 bool ReliableRouter::stopRetransmission(GlobalPacketId key)
 {
-    auto old = findPendingPacket(key);
-    if (old) {
-        auto numErased = pending.erase(key);
-        assert(numErased == 1);
-        packetPool.release(old->packet);
-        return true;
-    } else
+    // Find the link that points to our record, so we can unchain it
+    int8_t *link = &buckets[hashOf(key)];
+    while (*link >= 0 && !(GlobalPacketId(slots[*link].packet) == key))
+        link = &slots[*link].next;
+
+    int slot = *link;
+    if (slot < 0)
         return false;
+
+    PendingPacket &old = slots[slot];
+    *link = old.next;
+    heapRemove(old.heapPos);
+    packetPool.release(old.packet);
+
+    old.next = freeSlot;
+    freeSlot = slot;
+    return true;
 }
 
 /**
@@ -147,14 +234,29 @@ bool ReliableRouter::stopRetransmission(GlobalPacketId key)
  */
 PendingPacket *ReliableRouter::startRetransmission(MeshPacket *p)
 {
-    auto id = GlobalPacketId(p);
-    auto rec = PendingPacket(p);
+    stopRetransmission(p->from, p->id); // If we have an old record, someone messed up because id got reused
 
+    int slot = freeSlot;
+    if (slot < 0) {
+        LOG_DEBUG(MESH, "Too many pending reliable sends, not retransmitting id=%d\n", p->id);
+        return NULL;
+    }
+
+    PendingPacket &rec = slots[slot];
+    freeSlot = rec.next;
+
+    rec.packet = p;
+    rec.numRetransmissions = NUM_RETRANSMISSIONS - 1; // We subtract one, because we assume the user just did the first send
+    rec.firstTxMsec = millis();
+    rec.sent = false;
     setNextTx(&rec);
-    stopRetransmission(p->from, p->id);
-    pending[id] = rec;
 
-    return &pending[id];
+    size_t h = hashOf(GlobalPacketId(p));
+    rec.next = buckets[h];
+    buckets[h] = slot;
+    heapPush(slot);
+
+    return &rec;
 }
 
 /**
@@ -163,42 +265,180 @@ PendingPacket *ReliableRouter::startRetransmission(MeshPacket *p)
 int32_t ReliableRouter::doRetransmissions()
 {
     uint32_t now = millis();
-    int32_t d = INT32_MAX;
-
-    // FIXME, we should use a better datastructure rather than walking through this map.
-    // for(auto el: pending) {
-    for (auto it = pending.begin(), nextIt = it; it != pending.end(); it = nextIt) {
-        ++nextIt; // we use this odd pattern because we might be deleting it...
-        auto &p = it->second;
-
-        // FIXME, handle 51 day rolloever here!!!
-        if (p.nextTxMsec <= now) {
-            if (p.numRetransmissions == 0) {
-                DEBUG_MSG("Reliable send failed, returning a nak fr=0x%x,to=0x%x,id=%d\n", p.packet->from, p.packet->to,
-                          p.packet->id);
-                sendAckNak(false, p.packet->from, p.packet->id);
-                // Note: we don't stop retransmission here, instead the Nak packet gets processed in sniffReceived - which
-                // allows the DSR version to still be able to look at the PendingPacket
-                stopRetransmission(it->first);
-            } else {
-                DEBUG_MSG("Sending reliable retransmission fr=0x%x,to=0x%x,id=%d, tries left=%d\n", p.packet->from, p.packet->to,
-                          p.packet->id, p.numRetransmissions);
 
-                // Note: we call the superclass version because we don't want to have our version of send() add a new
-                // retransmission record
-                FloodingRouter::send(packetPool.allocCopy(*p.packet));
+    // Our heap means we only ever look at packets that are due
+    while (heapLen) {
+        int slot = heap[0];
+        PendingPacket &p = slots[slot];
 
-                // Queue again
-                --p.numRetransmissions;
-                setNextTx(&p);
-            }
+        int32_t t = p.nextTxMsec - now;
+        if (t > 0)
+            return t; // Not yet time
+
+        neighbors.onAckMissed(p.packet->to);
+
+        if (p.numRetransmissions == 0) {
+            NodeNum from = p.packet->from;
+            PacketId id = p.packet->id;
+            LOG_ERROR(MESH, "Reliable send failed fr=0x%x,to=0x%x,id=%d\n", from, p.packet->to, id);
+
+            bool handled = onReliableSendFailed(p.packet);
+
+            // Remove our record before the nak is delivered (because processing the nak will also try to stop us)
+            stopRetransmission(from, id);
+            if (!handled)
+                sendAckNak(false, from, id);
         } else {
-            // Not yet time
-            int32_t t = p.nextTxMsec - now;
+            LOG_DEBUG(MESH, "Sending reliable retransmission fr=0x%x,to=0x%x,id=%d, tries left=%d\n", p.packet->from, p.packet->to,
+                      p.packet->id, p.numRetransmissions);
 
-            d = min(t, d);
+            // Our hop start record (see Router::sendLocal) might have been pushed out since our first send
+            if (p.packet->from == getNodeNum() && p.packet->to == NODENUM_BROADCAST)
+                hopStarts.add(p.packet->from, p.packet->id, p.packet->hop_limit);
+
+            // Note: we call the superclass version because we don't want to have our version of send() add a new
+            // retransmission record
+            FloodingRouter::send(packetPool.share(p.packet));
+            numRetransmits++;
+
+            // Queue again
+            --p.numRetransmissions;
+            p.sent = false;
+            setNextTx(&p);
+            heapSiftDown(p.heapPos);
         }
     }
 
-    return d;
-}
\ No newline at end of file
+    return INT32_MAX;
+}
+
+void ReliableRouter::setNextTx(PendingPacket *pending)
+{
+    assert(iface);
+
+    // Each retry waits twice as long as the one before, we might have just been unlucky with our estimate
+    uint32_t ackDelay = getAckDelayMsec(pending->packet->to);
+    ackDelay <<= NUM_RETRANSMISSIONS - 1 - pending->numRetransmissions;
+
+    pending->nextTxMsec = millis() + iface->getRetransmissionMsec(pending->packet, ackDelay, pending->sent);
+}
+
+void ReliableRouter::onTxDone(const MeshPacket *p)
+{
+    int slot = findSlot(GlobalPacketId(p));
+    if (slot < 0 || slots[slot].sent)
+        return;
+
+    // However long it sat in our TX queue, the ack can only come after this
+    PendingPacket &pending = slots[slot];
+    pending.sent = true;
+    if (pending.numRetransmissions == NUM_RETRANSMISSIONS - 1)
+        pending.firstTxMsec = millis();
+    setNextTx(&pending);
+    heapSiftUp(pending.heapPos); // Usually later than the time we picked when we queued it, but it is random
+    heapSiftDown(pending.heapPos);
+}
+
+void ReliableRouter::updateRtt(const PendingPacket *pending)
+{
+    // Karn's rule: if we retransmitted we can't tell which send this ack was for, so ignore it
+    if (pending->numRetransmissions != NUM_RETRANSMISSIONS - 1 || pending->packet->to == NODENUM_BROADCAST)
+        return;
+
+    assert(iface);
+    uint32_t now = millis();
+    uint32_t airtime = pending->sent ? 0 : iface->getPacketTime(pending->packet); // firstTxMsec is after it once sent
+    uint32_t elapsed = now - pending->firstTxMsec;
+    uint32_t sample = elapsed > airtime ? elapsed - airtime : 0;
+
+    NodeNum node = pending->packet->to;
+    NeighborRtt *r = NULL;
+    for (size_t i = 0; i < numRtts && !r; i++)
+        if (rtts[i].node == node)
+            r = &rtts[i];
+
+    if (r) {
+        uint32_t err = sample > r->srttMsec ? sample - r->srttMsec : r->srttMsec - sample;
+        r->rttvarMsec = (3 * r->rttvarMsec + err) / 4;
+        r->srttMsec = (7 * r->srttMsec + sample) / 8;
+    } else {
+        if (numRtts < RTT_NEIGHBORS)
+            r = &rtts[numRtts++];
+        else {
+            // Replace the neighbor we heard from least recently
+            r = &rtts[0];
+            for (size_t i = 1; i < numRtts; i++)
+                if (now - rtts[i].lastSampleMsec > now - r->lastSampleMsec)
+                    r = &rtts[i];
+        }
+
+        r->node = node;
+        r->srttMsec = sample;
+        r->rttvarMsec = sample / 2;
+    }
+    r->lastSampleMsec = now;
+
+    LOG_DEBUG(MESH, "Ack delay from 0x%x was %u ms, srtt=%u rttvar=%u\n", node, sample, r->srttMsec, r->rttvarMsec);
+}
+
+uint32_t ReliableRouter::getAckDelayMsec(NodeNum node) const
+{
+    for (size_t i = 0; i < numRtts; i++)
+        if (rtts[i].node == node)
+            return max(rtts[i].srttMsec + 4 * rtts[i].rttvarMsec, (uint32_t)1); // Never 0, that means unmeasured
+
+    return 0;
+}
+
+void ReliableRouter::heapPush(int slot)
+{
+    assert(heapLen < MAX_PENDING_PACKETS);
+    heap[heapLen] = slot;
+    slots[slot].heapPos = heapLen;
+    heapSiftUp(heapLen++);
+}
+
+void ReliableRouter::heapRemove(size_t pos)
+{
+    assert(pos < heapLen);
+    if (pos != --heapLen) {
+        heapSwap(pos, heapLen);
+        heapSiftUp(pos);
+        heapSiftDown(pos);
+    }
+}
+
+void ReliableRouter::heapSiftUp(size_t pos)
+{
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (!heapBefore(pos, parent))
+            break;
+        heapSwap(pos, parent);
+        pos = parent;
+    }
+}
+
+void ReliableRouter::heapSiftDown(size_t pos)
+{
+    for (;;) {
+        size_t best = pos, left = 2 * pos + 1, right = left + 1;
+        if (left < heapLen && heapBefore(left, best))
+            best = left;
+        if (right < heapLen && heapBefore(right, best))
+            best = right;
+        if (best == pos)
+            break;
+        heapSwap(pos, best);
+        pos = best;
+    }
+}
+
+void ReliableRouter::heapSwap(size_t a, size_t b)
+{
+    int8_t t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    slots[heap[a]].heapPos = a;
+    slots[heap[b]].heapPos = b;
+}
@@ -1,7 +1,6 @@
 #pragma once
 
 #include "FloodingRouter.h"
-#include <unordered_map>
 
 /**
  * An identifier for a globalally unique message - a pair of the sending nodenum and the packet id assigned
@@ -26,6 +25,26 @@ struct GlobalPacketId {
     }
 };
 
+/// The most reliable sends we track at once (every packet in the TX queue might have a retransmission pending)
+#define MAX_PENDING_PACKETS MAX_TX_QUEUE
+static_assert(MAX_PENDING_PACKETS <= 127, "Our slot and heap indices are int8_t");
+
+/// Number of hash buckets we use to find pending packets by id (must be a power of two)
+#define PENDING_HASH_SIZE 32
+
+/// How many neighbors we remember ack round trip times for
+#define RTT_NEIGHBORS 16
+
+/**
+ * Our smoothed estimate of how long a neighbor takes to ack us (beyond the airtime of the packet we sent them)
+ */
+struct NeighborRtt {
+    NodeNum node;
+    uint32_t srttMsec;       // Smoothed ack delay
+    uint32_t rttvarMsec;     // Smoothed mean deviation of the ack delay
+    uint32_t lastSampleMsec; // So we can replace the neighbor we heard from least recently
+};
+
 /**
  * A packet queued for retransmission
  */
@@ -35,23 +54,35 @@ struct PendingPacket {
     /** The next time we should try to retransmit this packet */
     uint32_t nextTxMsec;
 
+    /** When our radio finished sending this packet the first time (see sent), for measuring the ack round trip time */
+    uint32_t firstTxMsec;
+
+    /**
+     * Our radio has finished sending our latest transmission of this packet (see onTxDone).  Until then nextTxMsec and
+     * firstTxMsec count from when we queued it, in case our interface never tells us.
+     */
+    bool sent;
+
     /** Starts at NUM_RETRANSMISSIONS -1(normally 3) and counts down.  Once zero it will be removed from the list */
     uint8_t numRetransmissions;
 
-    /** True if we have started trying to find a route - for DSR usage
-     * While trying to find a route we don't actually send the data packet.  We just leave it here pending until
-     * we have a route or we've failed to find one.
-     */
-    bool wantRoute = false;
+    /** The next slot in our hash chain (or in the free list), -1 for none */
+    int8_t next;
 
-    PendingPacket() {}
-    PendingPacket(MeshPacket *p);
+    /** Where we are in the retransmission heap */
+    int8_t heapPos;
 };
 
-class GlobalPacketIdHashFunction
-{
-  public:
-    size_t operator()(const GlobalPacketId &p) const { return (hash<NodeNum>()(p.node)) ^ (hash<PacketId>()(p.id)); }
+/// The most acks we will hold back at once, hoping to piggyback them on other traffic to the same neighbor
+#define MAX_HELD_ACKS 8
+
+/**
+ * An ack we owe a neighbor, but haven't sent yet
+ */
+struct HeldAck {
+    NodeNum to;
+    PacketId id;
+    uint32_t sendMsec; // If we haven't found anything to piggyback it on by now, send it on its own
 };
 
 /**
@@ -60,14 +91,34 @@ class GlobalPacketIdHashFunction
 class ReliableRouter : public FloodingRouter
 {
   private:
-    unordered_map<GlobalPacketId, PendingPacket, GlobalPacketIdHashFunction> pending;
+    /// All of our pending packet records, unused slots are chained together from freeSlot
+    PendingPacket slots[MAX_PENDING_PACKETS];
+    int8_t freeSlot;
+
+    /// The first slot in each hash chain, -1 for none
+    int8_t buckets[PENDING_HASH_SIZE];
+
+    /// A min-heap of slot numbers, keyed on nextTxMsec (so the next retransmission is always heap[0])
+    int8_t heap[MAX_PENDING_PACKETS];
+    size_t heapLen = 0;
+
+    /// Ack delays we have measured to our neighbors
+    NeighborRtt rtts[RTT_NEIGHBORS];
+    size_t numRtts = 0;
+
+    /// Acks we are briefly delaying (see holdAck())
+    HeldAck heldAcks[MAX_HELD_ACKS];
+    size_t numHeldAcks = 0;
+
+    /// Debugging counts
+    uint32_t numRetransmits = 0;
 
   public:
     /**
      * Constructor
      *
      */
-    // ReliableRouter();
+    ReliableRouter();
 
     /**
      * Send a packet on a suitable interface.  This routine will
@@ -82,8 +133,18 @@ class ReliableRouter : public FloodingRouter
         auto d = FloodingRouter::runOnce();
 
         int32_t r = doRetransmissions();
+        int32_t a = doHeldAcks();
 
-        return min(d, r);
+        return min(d, min(r, a));
+    }
+
+    /// Our radio finished sending p, so restart the retransmission timer of its pending record from now
+    virtual void onTxDone(const MeshPacket *p);
+
+    virtual void getStats(RouterStats &s)
+    {
+        FloodingRouter::getStats(s);
+        s.retransmissions = numRetransmits;
     }
 
   protected:
@@ -105,15 +166,41 @@ class ReliableRouter : public FloodingRouter
 
     /**
      * Add p to the list of packets to retransmit occasionally.  We will free it once we stop retransmitting.
+     *
+     * @return NULL if we are already tracking too many packets (in which case the caller still owns p)
      */
     PendingPacket *startRetransmission(MeshPacket *p);
 
-  private:
+    /**
+     * We have given up retransmitting p, which is still owned by us.  @return true if the subclass is taking care of it (and
+     * will send any nak itself), otherwise we send ourselves a nak for p
+     */
+    virtual bool onReliableSendFailed(const MeshPacket *p) { return false; }
+
     /**
      * Send an ack or a nak packet back towards whoever sent idFrom
      */
     void sendAckNak(bool isAck, NodeNum to, PacketId idFrom);
 
+  private:
+    /**
+     * Ack idFrom, but not right away.  If we send anything else to that neighbor in the meantime we piggyback the ack on it,
+     * otherwise all the acks we owe that neighbor go out together (so they can share a frame if we aggregate packets).
+     *
+     * We only wait a fraction of a short packet time, which is well below any retransmission timeout the sender will use.
+     */
+    void holdAck(NodeNum to, PacketId idFrom);
+
+    /// Send all the acks we are holding for to
+    void sendHeldAcks(NodeNum to);
+
+    /**
+     * Send any held acks which have waited long enough
+     *
+     * @return the number of msecs until we next need to send one or MAXINT if none are held
+     */
+    int32_t doHeldAcks();
+
     /**
      * Stop any retransmissions we are doing of the specified node/packet ID pair
      *
@@ -129,7 +216,32 @@ class ReliableRouter : public FloodingRouter
      */
     int32_t doRetransmissions();
 
-    void setNextTx(PendingPacket *pending) {  
-      assert(iface);
-      pending->nextTxMsec = millis() + iface->getRetransmissionMsec(pending->packet); }
+    /// Pick the time for our next retransmission of pending, based on how quickly its destination usually acks
+    void setNextTx(PendingPacket *pending);
+
+    /// We got an ack for pending, use it to improve our estimate of its destination's ack delay
+    void updateRtt(const PendingPacket *pending);
+
+    /**
+     * How long we should wait (beyond our own airtime) for an ack from node, or 0 if we haven't measured it yet
+     *
+     * This is the usual srtt + 4 * rttvar (RFC 6298)
+     */
+    uint32_t getAckDelayMsec(NodeNum node) const;
+
+    /// @return the slot holding key, or -1
+    int findSlot(GlobalPacketId key) const;
+
+    static size_t hashOf(GlobalPacketId key) { return (key.node ^ key.id) & (PENDING_HASH_SIZE - 1); }
+
+    /// Heap maintenance, all of these keep heapPos up to date
+    void heapPush(int slot);
+    void heapRemove(size_t pos);
+    void heapSiftUp(size_t pos);
+    void heapSiftDown(size_t pos);
+    void heapSwap(size_t a, size_t b);
+    bool heapBefore(size_t a, size_t b) const
+    {
+        return (int32_t)(slots[heap[a]].nextTxMsec - slots[heap[b]].nextTxMsec) < 0;
+    }
 };
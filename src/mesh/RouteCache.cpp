@@ -0,0 +1,86 @@
+#include "RouteCache.h"
+#include "configuration.h"
+
+RouteCache routeCache;
+
+bool RouteCache::add(NodeNum dest, NodeNum nextHop, uint8_t numHops)
+{
+    uint32_t now = millis();
+    int i = indexOf(dest);
+
+    if (i >= 0) {
+        Route &r = routes[i];
+
+        // Keep our existing route if it is still good and at least as short, but note that it is still in use.  A route from
+        // before our reboot is only a guess, so anything we learn now beats it.
+        if (!isExpired(r, now) && !r.restored && r.nextHop != nextHop && r.numHops <= numHops) {
+            r.lastUpdatedMsec = now;
+            return false;
+        }
+
+        bool changed = r.nextHop != nextHop || r.numHops != numHops;
+        r.nextHop = nextHop;
+        r.numHops = numHops;
+        r.lastUpdatedMsec = now;
+        r.restored = false;
+        return changed;
+    }
+
+    if (numRoutes == ROUTE_CACHE_SIZE) {
+        // Full, replace our stalest route
+        size_t oldest = 0;
+        for (size_t j = 1; j < numRoutes; j++)
+            if (now - routes[j].lastUpdatedMsec > now - routes[oldest].lastUpdatedMsec)
+                oldest = j;
+        removeAt(oldest);
+    }
+
+    LOG_DEBUG(MESH, "Adding route to 0x%x via 0x%x, hops=%d\n", dest, nextHop, numHops);
+    routes[numRoutes++] = {dest, nextHop, numHops, now, false};
+    return true;
+}
+
+void RouteCache::restore(NodeNum dest, NodeNum nextHop, uint8_t numHops, uint32_t ageMsec)
+{
+    if (ageMsec >= ROUTE_EXPIRE_MSEC || numRoutes == ROUTE_CACHE_SIZE || indexOf(dest) >= 0)
+        return;
+
+    routes[numRoutes++] = {dest, nextHop, numHops, millis() - ageMsec, true};
+}
+
+void RouteCache::remove(NodeNum dest)
+{
+    int i = indexOf(dest);
+    if (i >= 0) {
+        LOG_DEBUG(MESH, "Removing route to 0x%x\n", dest);
+        removeAt(i);
+    }
+}
+
+const Route *RouteCache::find(NodeNum dest)
+{
+    int i = indexOf(dest);
+    if (i < 0)
+        return NULL;
+
+    if (isExpired(routes[i], millis())) {
+        removeAt(i);
+        return NULL;
+    }
+
+    return &routes[i];
+}
+
+int RouteCache::indexOf(NodeNum dest) const
+{
+    for (size_t i = 0; i < numRoutes; i++)
+        if (routes[i].dest == dest)
+            return i;
+
+    return -1;
+}
+
+void RouteCache::removeAt(size_t i)
+{
+    routes[i] = routes[--numRoutes]; // Order doesn't matter, so just fill the hole with our last record
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/// Max number of destinations we will remember routes for
+#ifndef ROUTE_CACHE_SIZE
+#define ROUTE_CACHE_SIZE 32
+#endif
+
+/// We forget a route if we haven't heard anything to refresh it for this long
+#define ROUTE_EXPIRE_MSEC (15 * 60 * 1000L)
+
+/**
+ * How to reach a particular node
+ */
+struct Route {
+    NodeNum dest;
+    NodeNum nextHop;          // The adjacent node we should send to (== dest for a neighbor)
+    uint8_t numHops;          // How many nodes are between nextHop and dest (0 for a neighbor)
+    uint32_t lastUpdatedMsec; // When we last learned or confirmed this route
+    bool restored;            // Saved before our last reboot (see LinkStore) and not yet confirmed since
+};
+
+/**
+ * A small fixed size cache of source routes.  Lookups are a linear scan, which is fine for the handful of routes a node needs.
+ *
+ * If we learn more routes than we have room for, we replace the one which was updated least recently.
+ */
+class RouteCache
+{
+    Route routes[ROUTE_CACHE_SIZE];
+    size_t numRoutes = 0;
+
+  public:
+    /**
+     * Record that nextHop can reach dest for us, but they will need numHops to get there.
+     * If we already have an unexpired route that reaches that node in fewer hops we keep it instead.
+     *
+     * @return true if this changed our route to dest
+     */
+    bool add(NodeNum dest, NodeNum nextHop, uint8_t numHops);
+
+    /// Forget our route to dest
+    void remove(NodeNum dest);
+
+    /// @return our route to dest, or NULL if we don't have an unexpired one
+    const Route *find(NodeNum dest);
+
+    /**
+     * Put back a route we saved before a reboot, which was ageMsec old.  Any route we learn replaces it, even a longer one.
+     * Ignored if we already have a route to dest (or no room).
+     */
+    void restore(NodeNum dest, NodeNum nextHop, uint8_t numHops, uint32_t ageMsec);
+
+    /// The number of routes we have (which might include some that have expired)
+    size_t getNumRoutes() const { return numRoutes; }
+
+    /// For iterating over all of our routes, check isExpired yourself
+    const Route &getByIndex(size_t i) const { return routes[i]; }
+
+    static bool isExpired(const Route &r, uint32_t now) { return now - r.lastUpdatedMsec >= ROUTE_EXPIRE_MSEC; }
+
+  private:
+    /// @return the index of our record for dest, or -1
+    int indexOf(NodeNum dest) const;
+
+    void removeAt(size_t i);
+};
+
+extern RouteCache routeCache;
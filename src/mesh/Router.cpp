@@ -1,6 +1,11 @@
 #include "Router.h"
 #include "CryptoEngine.h"
+#include "HopStarts.h"
+#include "NeighborTable.h"
+#include "PacketTrace.h"
+#include "PayloadCompression.h"
 #include "RTC.h"
+#include "SubPacketCodec.h"
 #include "configuration.h"
 #include "mesh-pb-constants.h"
 #include <NodeDB.h>
@@ -15,34 +20,49 @@
  *
  **/
 
-#define MAX_RX_FROMRADIO                                                                                                         \
-    4 // max number of packets destined to our queue, we dispatch packets quickly so it doesn't need to be big
+// max number of packets destined to our queue, we dispatch packets quickly so it doesn't need to be big (see MeshProfile)
+#ifndef MAX_RX_FROMRADIO
+#define MAX_RX_FROMRADIO (meshProfile.rxFromRadio)
+#endif
 
-// I think this is right, one packet for each of the three fifos + one packet being currently assembled for TX or RX
-// And every TX packet might have a retransmission packet or an ack alive at any moment
+// Extra room in fromRadioQueue for bursts (i.e. an aggregate frame, or a flood arriving while we are busy).  Once a burst
+// spills past MAX_RX_FROMRADIO we ask to run ahead of other threads.  The packets in it come from a shared reserve in our
+// pool, which is only used up while a burst is waiting (MAX_RX_FROMRADIO + MAX_RX_BURST must be a power of 2).
+#ifndef MAX_RX_BURST
+#define MAX_RX_BURST (3 * MAX_RX_FROMRADIO)
+#endif
+
+#define RX_QUEUE_SIZE (MAX_RX_FROMRADIO + MAX_RX_BURST)
+
+// I think this is right, one packet for each of the fifos + one packet being currently assembled for TX or RX
+// And every TX packet might have a retransmission packet or an ack alive at any moment (each interface has its own TX queue)
+// (packets waiting for the phone don't count, MeshService keeps those in its own compact form)
 #define MAX_PACKETS                                                                                                              \
-    (MAX_RX_TOPHONE + MAX_RX_FROMRADIO + 2 * MAX_TX_QUEUE +                                                                      \
+    (2 * MAX_RX_FROMRADIO + MAX_RX_BURST + (MAX_INTERFACES + 1) * MAX_TX_QUEUE +                                                 \
      2) // max number of packets which can be in flight (either queued from reception or queued for sending)
 
-// static MemoryPool<MeshPacket> staticPool(MAX_PACKETS);
-static MemoryDynamic<MeshPacket> staticPool;
+// Hold back a few packets so that acks and packets we originate can still be allocated when we are being flooded by the mesh
+#define MAX_PACKETS_RESERVED 4
+
+static MemoryPool<MeshPacket> staticPool(MAX_PACKETS, MAX_PACKETS_RESERVED);
 
 Allocator<MeshPacket> &packetPool = staticPool;
 
 /**
  * Constructor
- *
- * Currently we only allow one interface, that may change in the future
  */
-Router::Router() : concurrency::OSThread("Router"), fromRadioQueue(MAX_RX_FROMRADIO)
+Router::Router() : concurrency::OSThread("Router"), fromRadioQueue(RX_QUEUE_SIZE), localQueue(MAX_RX_FROMRADIO)
 {
     // This is called pre main(), don't touch anything here, the following code is not safe
 
-    /* DEBUG_MSG("Size of NodeInfo %d\n", sizeof(NodeInfo));
-    DEBUG_MSG("Size of SubPacket %d\n", sizeof(SubPacket));
-    DEBUG_MSG("Size of MeshPacket %d\n", sizeof(MeshPacket)); */
+    /* LOG_DEBUG(MESH, "Size of NodeInfo %d\n", sizeof(NodeInfo));
+    LOG_DEBUG(MESH, "Size of SubPacket %d\n", sizeof(SubPacket));
+    LOG_DEBUG(MESH, "Size of MeshPacket %d\n", sizeof(MeshPacket)); */
 
     fromRadioQueue.setReader(this);
+    setPriority(concurrency::PRIORITY_CRITICAL);
+    fromRadioQueue.setUrgentLevel(MAX_RX_FROMRADIO);
+    localQueue.setReader(this);
 }
 
 /**
@@ -51,21 +71,37 @@ Router::Router() : concurrency::OSThread("Router"), fromRadioQueue(MAX_RX_FROMRA
  */
 int32_t Router::runOnce()
 {
+    uint32_t queued = fromRadioQueue.numQueued();
+    if (queued > maxFromRadioQueued)
+        maxFromRadioQueued = queued;
+
     MeshPacket *mp;
-    while ((mp = fromRadioQueue.dequeuePtr(0)) != NULL) {
-        perhapsHandleReceived(mp);
+    while (fromRadioQueue.dequeue(&mp)) {
+        packetTrace.mark(mp, TRACE_RX_QUEUE);
+        uint32_t start = micros();
+        perhapsHandleReceived(mp, false);
+        rxHandleUsec += micros() - start;
+        rxHandled++;
+    }
+    while ((mp = localQueue.dequeuePtr(0)) != NULL) {
+        perhapsHandleReceived(mp, true);
     }
 
+    // We have nothing else to do, so get ready to encrypt the next few packets we send
+    uint64_t nextIds[KEYSTREAM_CACHE_SIZE];
+    for (size_t n = 0; n < KEYSTREAM_CACHE_SIZE; n++)
+        nextIds[n] = peekPacketId(n);
+    crypto->precomputeKeystreams(getNodeNum(), nextIds, KEYSTREAM_CACHE_SIZE);
+
     return INT32_MAX; // Wait a long time - until we get woken for the message queue
 }
 
-/// Generate a unique packet id
-// FIXME, move this someplace better
-PacketId generatePacketId()
-{
-    static uint32_t i; // Note: trying to keep this in noinit didn't help for working across reboots
-    static bool didInit = false;
+static uint32_t packetIdCounter; // Note: trying to keep this in noinit didn't help for working across reboots (see WarmBoot)
+static bool didInit = false;
 
+/// Convert a value of our counter into a packet id between 1 and numPacketId (ie - never zero)
+static PacketId packetIdFromCounter(uint32_t i)
+{
     assert(sizeof(PacketId) == 4 || sizeof(PacketId) == 1);                // only supported values
     uint32_t numPacketId = sizeof(PacketId) == 1 ? UINT8_MAX : UINT32_MAX; // 0 is consider invalid
 
@@ -74,19 +110,48 @@ PacketId generatePacketId()
 
         // pick a random initial sequence number at boot (to prevent repeated reboots always starting at 0)
         // Note: we mask the high order bit to ensure that we never pass a 'negative' number to random
-        i = random(numPacketId & 0x7fffffff);
-        DEBUG_MSG("Initial packet id %u, numPacketId %u\n", i, numPacketId);
+        packetIdCounter = random(numPacketId & 0x7fffffff);
+        LOG_DEBUG(MESH, "Initial packet id %u, numPacketId %u\n", packetIdCounter, numPacketId);
+        return 0; // Our caller's counter value was stale, they must call us again
     }
 
-    i++;
-    PacketId id = (i % numPacketId) + 1; // return number between 1 and numPacketId (ie - never zero)
-    myNodeInfo.current_packet_id = id;   // Kinda crufty - we keep updating this so the phone can see a current value
+    return (i % numPacketId) + 1;
+}
+
+/// Return the id generatePacketId() will return after n more calls (i.e. n = 0 is the next id)
+PacketId peekPacketId(size_t n)
+{
+    PacketId id;
+    while ((id = packetIdFromCounter(packetIdCounter + 1 + n)) == 0) // Only loops the very first time
+        ;
+    return id;
+}
+
+uint32_t getPacketIdCounter()
+{
+    return packetIdCounter;
+}
+
+void setPacketIdCounter(uint32_t counter)
+{
+    didInit = true; // So we don't replace it with a random start
+    packetIdCounter = counter;
+    LOG_DEBUG(MESH, "Restored packet id counter %u\n", counter);
+}
+
+/// Generate a unique packet id
+// FIXME, move this someplace better
+PacketId generatePacketId()
+{
+    PacketId id = peekPacketId(0);
+    packetIdCounter++;
+    myNodeInfo.current_packet_id = id; // Kinda crufty - we keep updating this so the phone can see a current value
     return id;
 }
 
 MeshPacket *Router::allocForSending()
 {
-    MeshPacket *p = packetPool.allocZeroed();
+    MeshPacket *p = packetPool.allocZeroedReserved(); // We originated this packet, so it is allowed to use our reserved buffers
 
     p->which_payload = MeshPacket_decoded_tag; // Assume payload is decoded at start.
     p->from = nodeDB.getNodeNum();
@@ -99,19 +164,62 @@ MeshPacket *Router::allocForSending()
     return p;
 }
 
+void Router::addInterface(RadioInterface *_iface)
+{
+    if (numInterfaces == MAX_INTERFACES) {
+        LOG_WARN(MESH, "Warning: ignoring interface, we can only use %u\n", (unsigned)MAX_INTERFACES);
+        return;
+    }
+
+    _iface->interfaceIndex = numInterfaces;
+    _iface->setReceiver(&fromRadioQueue, this);
+    ifaces[numInterfaces++] = _iface;
+
+    if (!iface)
+        iface = _iface;
+}
+
+void Router::getStats(RouterStats &s)
+{
+    s = RouterStats();
+    for (size_t i = 0; i < numInterfaces; i++) {
+        RadioStats r = ifaces[i]->getStats();
+        s.radio.rxGood += r.rxGood;
+        s.radio.rxBad += r.rxBad;
+        s.radio.txGood += r.txGood;
+        s.radio.txQueued += r.txQueued;
+        s.radio.txDropped += r.txDropped;
+        for (size_t c = 0; c < RX_DROP_NUM_CAUSES; c++)
+            s.radio.rxDropped[c] += r.rxDropped[c];
+    }
+    s.fromRadioQueued = fromRadioQueue.numQueued();
+    s.rxHandled = rxHandled;
+    s.rxHandleUsec = rxHandleUsec;
+    s.maxFromRadioQueued = maxFromRadioQueued;
+}
+
 ErrorCode Router::sendLocal(MeshPacket *p)
 {
     // No need to deliver externally if the destination is the local node
     if (p->to == nodeDB.getNodeNum()) {
-        printPacket("Enqueuing local", p);
-        fromRadioQueue.enqueue(p);
+        LOG_PACKET(MESH, "Enqueuing local", p);
+        localQueue.enqueue(p);
         return ERRNO_OK;
     }
 
+    // Our own broadcasts only need to go as far as the farthest node we know of (callers which asked for a particular limit keep
+    // it).  We pick here, once, before ReliableRouter keeps a copy, so its retransmissions go out with the same limit.
+    if (p->from == getNodeNum() && p->to == NODENUM_BROADCAST && p->hop_limit == HOP_RELIABLE &&
+        p->which_payload == MeshPacket_decoded_tag) {
+        p = packetPool.makeWritable(p);
+        p->hop_limit = pickHopLimit(p->want_ack);
+        hopStarts.add(p->from, p->id, p->hop_limit); // So our radio tells everyone where we started
+    }
+
     // If we are sending a broadcast, we also treat it as if we just received it ourself
     // this allows local apps (and PCs) to see broadcasts sourced locally
     if (p->to == NODENUM_BROADCAST) {
-        handleReceived(p);
+        handleReceived(p, true);
     }
 
     return send(p);
@@ -125,43 +233,76 @@ ErrorCode Router::sendLocal(MeshPacket *p)
 ErrorCode Router::send(MeshPacket *p)
 {
     assert(p->to != nodeDB.getNodeNum()); // should have already been handled by sendLocal
+    packetTrace.beginTx(p);
 
-    PacketId nakId = p->decoded.which_ack == SubPacket_fail_id_tag ? p->decoded.ack.fail_id : 0;
+    // Note: packets we are just forwarding are still encrypted, so we can only check decoded packets
+    PacketId nakId = (p->which_payload == MeshPacket_decoded_tag && p->decoded.which_ack == SubPacket_fail_id_tag)
+                         ? p->decoded.ack.fail_id
+                         : 0;
     assert(
         !nakId); // I don't think we ever send 0hop naks over the wire (other than to the phone), test that assumption with assert
 
     // Never set the want_ack flag on broadcast packets sent over the air.
-    if (p->to == NODENUM_BROADCAST)
+    if (p->to == NODENUM_BROADCAST && p->want_ack) {
+        p = packetPool.makeWritable(p);
         p->want_ack = false;
+    }
 
     // If the packet hasn't yet been encrypted, do so now (it might already be encrypted if we are just forwarding it)
 
     assert(p->which_payload == MeshPacket_encrypted_tag ||
            p->which_payload == MeshPacket_decoded_tag); // I _think_ all packets should have a payload by now
 
-    // First convert from protobufs to raw bytes
-    if (p->which_payload == MeshPacket_decoded_tag) {
-        static uint8_t bytes[MAX_RHPACKETLEN]; // we have to use a scratch buffer because a union
+    // Must be checked before we encrypt
+    TxPriority priority = getTxPriority(p);
+    TxSource source = getTxSource(p);
+
+    // First convert from protobufs to raw bytes (compact acks stay decoded, the radio sends them without a payload)
+    if (p->which_payload == MeshPacket_decoded_tag && !isCompactAck(p)) {
+        p = packetPool.makeWritable(p); // We encode in place, and whoever shares this packet wants it as is
+        uint8_t bytes[MAX_RHPACKETLEN]; // we have to use a scratch buffer because decoded is a union with encrypted
 
-        size_t numbytes = pb_encode_to_bytes(bytes, sizeof(bytes), SubPacket_fields, &p->decoded);
+#ifdef LORA_COMPRESS_PAYLOADS
+        // Note: all nodes in the mesh must be running a build which understands compressed payloads to see these messages
+        if (p->decoded.which_payload == SubPacket_data_tag)
+            compressPayload(p->decoded.data);
+#endif
+
+        size_t numbytes = encodeSubPacket(bytes, sizeof(bytes), p->decoded);
 
         assert(numbytes <= MAX_RHPACKETLEN);
-        crypto->encrypt(p->from, p->id, numbytes, bytes);
 
-        // Copy back into the packet and set the variant type
-        memcpy(p->encrypted.bytes, bytes, numbytes);
+        // Encrypt straight into the packet and set the variant type
+        crypto->encryptOutgoing(p->from, p->id, numbytes, bytes, p->encrypted.bytes);
         p->encrypted.size = numbytes;
         p->which_payload = MeshPacket_encrypted_tag;
+
+        setIntervalFromNow(0); // We probably just used up one of our precomputed keystreams, refill when we are idle
     }
+    packetTrace.mark(p, TRACE_TX_ENCODE);
 
-    if (iface) {
-        // DEBUG_MSG("Sending packet via interface fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
-        return iface->send(p);
-    } else {
-        DEBUG_MSG("Dropping packet - no interfaces - fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
+    if (!numInterfaces) {
+        LOG_WARN(MESH, "Dropping packet - no interfaces - fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
         packetPool.release(p);
         return ERRNO_NO_INTERFACES;
     }
+
+    // A neighbor only needs to hear us on the interface they use
+    const Neighbor *n = p->to == NODENUM_BROADCAST ? NULL : neighbors.find(p->to);
+    if (n && n->interfaceIndex < numInterfaces)
+        return ifaces[n->interfaceIndex]->send(p, priority, source);
+
+    // Otherwise all of our interfaces get the packet, which from here on nobody changes, so they can all share it
+    for (size_t i = 1; i < numInterfaces; i++) {
+        MeshPacket *shared = packetPool.share(p);
+        if (shared)
+            ifaces[i]->send(shared, priority, source);
+        else
+            LOG_WARN(MESH, "Warning: packet pool is low, not sending on interface %d\n", i);
+    }
+
+    // DEBUG_MSG("Sending packet via interface fr=0x%x,to=0x%x,id=%d\n", p->from, p->to, p->id);
+    return ifaces[0]->send(p, priority, source);
 }
 
 /**
@@ -170,34 +311,154 @@ ErrorCode Router::send(MeshPacket *p)
  */
 void Router::sniffReceived(const MeshPacket *p)
 {
-    DEBUG_MSG("FIXME-update-db Sniffing packet\n");
+    LOG_DEBUG(MESH, "FIXME-update-db Sniffing packet\n");
     // FIXME, update nodedb here for any packet that passes through us
 }
 
+uint8_t Router::getHopsAway(NodeNum node)
+{
+    return nodeDB.getHopsAway(node);
+}
+
+uint8_t Router::pickHopLimit(bool wantAck)
+{
+    if (numHopLimitPicks++ % HOP_LIMIT_PROBE_INTERVAL == 0)
+        return HOP_RELIABLE;
+
+    uint32_t now = getTime();
+    uint8_t hopLimit = 0;
+    bool anyone = false;
+    for (size_t i = 0; i < nodeDB.getNumNodes(); i++) {
+        uint32_t lastHeard = nodeDB.getLastHeardByIndex(i);
+        NodeNum n = nodeDB.getNodeNumByIndex(i);
+        if (n == getNodeNum() || !lastHeard || now - lastHeard >= NUM_ONLINE_SECS)
+            continue; // Only the nodes which are around now need to hear us
+
+        anyone = true;
+        uint8_t hops = getHopsAway(n);
+        if (hops >= HOP_RELIABLE)
+            return HOP_RELIABLE; // Including the ones we don't know a distance for
+        if (hops > hopLimit)
+            hopLimit = hops;
+    }
+
+    // If no one is around we might as well try to reach everyone.  Acked broadcasts need at least one rebroadcast, because that
+    // is our ack.
+    if (!anyone)
+        return HOP_RELIABLE;
+    return wantAck && !hopLimit ? 1 : hopLimit;
+}
+
+void Router::sniffTransit(const MeshPacket *p)
+{
+    nodeDB.updateHeard(*p);
+}
+
 bool Router::perhapsDecode(MeshPacket *p)
 {
-    if (p->which_payload == MeshPacket_decoded_tag)
-        return true; // If packet was already decoded just return
+    SubPacketHeader h;
+    return decodeHeader(p, h) && finishDecode(p);
+}
+
+bool Router::decodeHeader(MeshPacket *p, SubPacketHeader &h)
+{
+    if (p->which_payload == MeshPacket_decoded_tag) {
+        getSubPacketHeader(p->decoded, h); // If packet was already decoded just return its header
+        return true;
+    }
 
     assert(p->which_payload == MeshPacket_encrypted_tag);
 
     // FIXME - someday don't send routing packets encrypted.  That would allow us to route for other channels without
     // being able to decrypt their data.
-    // Try to decrypt the packet if we can
-    static uint8_t bytes[MAX_RHPACKETLEN];
-    memcpy(bytes, p->encrypted.bytes,
-           p->encrypted.size); // we have to copy into a scratch buffer, because these bytes are a union with the decoded protobuf
-    crypto->decrypt(p->from, p->id, p->encrypted.size, bytes);
-
-    // Take those raw bytes and convert them back into a well structured protobuf we can understand
-    if (!pb_decode_from_bytes(bytes, p->encrypted.size, SubPacket_fields, &p->decoded)) {
-        DEBUG_MSG("Invalid protobufs in received mesh packet!\n");
-        return false;
-    } else {
-        // parsing was successful
-        p->which_payload = MeshPacket_decoded_tag;
+    // Try to decrypt the packet if we can.  We decrypt into our scratch buffer, because these bytes are a union with the
+    // decoded protobuf, and the header is all we read for now.
+    plainLen = p->encrypted.size;
+    numKeysTried = 0;
+    if (crypto->getNumKeys() == 1) {
+        crypto->decrypt(p->from, p->id, plainLen, p->encrypted.bytes, plain);
+        if (!peekSubPacket(plain, plainLen, h)) {
+            LOG_ERROR(MESH, "Invalid protobufs in received mesh packet!\n");
+            return false;
+        }
+        return true;
+    }
+
+    return trialDecode(p, h);
+}
+
+bool Router::finishDecode(MeshPacket *p)
+{
+    if (p->which_payload == MeshPacket_decoded_tag)
         return true;
+
+    // Take those raw bytes and convert them back into a well structured protobuf we can understand.  Until we know it is
+    // valid p keeps its ciphertext, so anyone forwarding it sends what we received.
+    SubPacket decoded;
+    for (;;) {
+        bool validProtobufs = decodeSubPacket(plain, plainLen, decoded);
+        if (validProtobufs && (decoded.which_payload != SubPacket_data_tag || decompressPayload(decoded.data)))
+            break;
+
+        // A wrong key can give a header that parses, so if we were trying keys one of the rest might still be the right one
+        if (numKeysTried && numKeysTried < crypto->getNumKeys()) {
+            SubPacketHeader h;
+            if (!trialDecode(p, h, numKeysTried))
+                return false;
+            continue;
+        }
+
+        if (validProtobufs)
+            LOG_ERROR(MESH, "Invalid compressed payload in received mesh packet!\n");
+        else
+            LOG_ERROR(MESH, "Invalid protobufs in received mesh packet!\n");
+        return false;
+    }
+
+    // parsing was successful, so now we know which key this sender uses
+    if (numKeysTried)
+        crypto->setKeyHint(p->from, trialKeyIndex);
+    p->decoded = decoded;
+    p->which_payload = MeshPacket_decoded_tag;
+    return true;
+}
+
+bool Router::trialDecode(const MeshPacket *p, SubPacketHeader &h, size_t numTried)
+{
+    // Start with whichever key worked for this sender last time, usually that is the only one we need
+    size_t numKeys = crypto->getNumKeys();
+    size_t first = crypto->getKeyHint(p->from);
+    if (!numTried) {
+        trialKeyIndex = first;
+        numKeysTried = 1;
+        crypto->decryptWith(first, p->from, p->id, plainLen, p->encrypted.bytes, plain);
+        if (peekSubPacket(plain, plainLen, h))
+            return true;
+        numTried = 1;
+    }
+
+    // Then the rest, CRYPTO_BATCH_LANES keys at a time (which an engine with parallel AES does for the price of one).  Only
+    // the router thread decodes, so one scratch will do.
+    static uint8_t batch[CRYPTO_BATCH_LANES][MAX_RHPACKETLEN];
+    for (size_t n = numTried; n < numKeys; n += CRYPTO_BATCH_LANES) {
+        CryptJob jobs[CRYPTO_BATCH_LANES];
+        size_t numJobs = 0;
+        for (; numJobs < CRYPTO_BATCH_LANES && n + numJobs < numKeys; numJobs++)
+            jobs[numJobs] = {(first + n + numJobs) % numKeys, p->from, p->id, plainLen, p->encrypted.bytes, batch[numJobs]};
+        crypto->decryptBatch(jobs, numJobs);
+
+        for (size_t j = 0; j < numJobs; j++)
+            if (peekSubPacket(batch[j], plainLen, h)) {
+                trialKeyIndex = jobs[j].keyIndex; // Only our hint once finishDecode() knows the whole packet is valid
+                numKeysTried = n + j + 1;
+                memcpy(plain, batch[j], plainLen);
+                return true;
+            }
     }
+    numKeysTried = numKeys;
+
+    LOG_ERROR(MESH, "Invalid protobufs in received mesh packet (with all %u of our keys)!\n", (uint32_t)numKeys);
+    return false;
 }
 
 NodeNum Router::getNodeNum()
@@ -209,31 +470,80 @@ NodeNum Router::getNodeNum()
  * Handle any packet that is received by an interface on this node.
  * Note: some packets may merely being passed through this node and will be forwarded elsewhere.
  */
-void Router::handleReceived(MeshPacket *p)
+void Router::handleReceived(MeshPacket *p, bool local)
+{
+    // Our own packets only come back to us over the air as rebroadcasts, which our duplicate filter has already dropped.
+    // Anything else claiming to be from us is forged, and must not pass for something our phone sent.
+    if (!local && p->from == getNodeNum()) {
+        LOG_WARN(MESH, "Dropping a received packet which claims to be from us (id 0x%x)\n", p->id);
+        return;
+    }
+
+    bool outerLocal = handlingLocal;
+    handlingLocal = local;
+    handleReceivedPacket(p);
+    handlingLocal = outerLocal;
+}
+
+void Router::handleReceivedPacket(MeshPacket *p)
 {
-    // Also, we should set the time from the ISR and it should have msec level resolution
-    p->rx_time = getValidTime(RTCQualityFromNet); // store the arrival timestamp for the phone
+    // Our radio already timestamped the packet when it arrived (if it could), otherwise store when we got it for the phone
+    if (!p->rx_time)
+        p->rx_time = getValidTime(RTCQualityFromNet);
+
+    // Routers see lots of unicasts for other nodes, which nothing here forwards or delivers.  Decrypting and decoding those
+    // is wasted work (that can make us miss the next packet on a busy mesh), so we just learn what the header tells us.
+    if (radioConfig.preferences.is_router && p->which_payload == MeshPacket_encrypted_tag && p->to != NODENUM_BROADCAST &&
+        p->to != getNodeNum()) {
+        sniffTransit(p);
+        return;
+    }
 
-    // Take those raw bytes and convert them back into a well structured protobuf we can understand
-    if (perhapsDecode(p)) {
-        // parsing was successful, queue for our recipient
+    // Our first stage only decrypts and reads the header, which leaves p as we received it
+    SubPacketHeader h;
+    if (!decodeHeader(p, h))
+        return; // Don't forward garbage
+    packetTrace.mark(p, TRACE_RX_DECODE);
+
+    MeshPacket *rebroadcast = p->which_payload == MeshPacket_encrypted_tag ? copyForRebroadcast(p) : NULL;
+    if (rebroadcast)
+        queueRebroadcast(rebroadcast);
+
+    // A unicast for someone else is only passing by, nothing here needs its payload unless it is route discovery (which
+    // DSRRouter learns routes from), so its header is all we look at
+    bool forUs = p->to == NODENUM_BROADCAST || p->to == getNodeNum();
+    bool isRouting = h.which_payload == SubPacket_route_request_tag || h.which_payload == SubPacket_route_reply_tag ||
+                     h.which_payload == SubPacket_route_error_tag;
+    if (!forUs && !isRouting) {
+        sniffTransit(p);
+        return;
+    }
 
+    // Everything else gets our full decode, for NodeDB, our plugins and the phone
+    if (finishDecode(p)) {
         sniffReceived(p);
 
-        if (p->to == NODENUM_BROADCAST || p->to == getNodeNum()) {
-            printPacket("Delivering rx packet", p);
+        if (forUs && prepareForDelivery(p)) {
+            LOG_PACKET(MESH, "Delivering rx packet", p);
             notifyPacketReceived.notifyObservers(p);
         }
     }
 }
 
-void Router::perhapsHandleReceived(MeshPacket *p)
+void Router::queueRebroadcast(MeshPacket *p)
+{
+    LOG_PACKET(MESH, "Rebroadcasting received floodmsg to neighbors", p);
+    // We are careful not to call our hooked version of send() - because we don't want to check this again
+    Router::send(p); // Still encrypted, so this just queues it for the radio
+}
+
+void Router::perhapsHandleReceived(MeshPacket *p, bool local)
 {
     assert(radioConfig.has_preferences);
     bool ignore = is_in_repeated(radioConfig.preferences.ignore_incoming, p->from);
 
     if (ignore)
-        DEBUG_MSG("Ignoring incoming message, 0x%x is in our ignore list\n", p->from);
+        LOG_DEBUG(MESH, "Ignoring incoming message, 0x%x is in our ignore list\n", p->from);
     else if (ignore |= shouldFilterReceived(p)) {
         // DEBUG_MSG("Incoming message was filtered 0x%x\n", p->from);
     }
@@ -241,7 +551,7 @@ void Router::perhapsHandleReceived(MeshPacket *p)
     // Note: we avoid calling shouldFilterReceived if we are supposed to ignore certain nodes - because some overrides might
     // cache/learn of the existence of nodes (i.e. FloodRouter) that they should not
     if (!ignore)
-        handleReceived(p);
+        handleReceived(p, local);
 
     packetPool.release(p);
 }
\ No newline at end of file
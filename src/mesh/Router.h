@@ -4,22 +4,70 @@
 #include "MeshTypes.h"
 #include "Observer.h"
 #include "PointerQueue.h"
+#include "SPSCQueue.h"
 #include "RadioInterface.h"
+#include "SubPacketCodec.h"
 #include "concurrency/OSThread.h"
 
+/// The most radio interfaces we can use at once (i.e. a gateway with two radios, see MeshProfile)
+#ifndef MAX_INTERFACES
+#define MAX_INTERFACES (meshProfile.interfaces)
+#endif
+
+/// Every this many broadcasts we use HOP_RELIABLE anyway, so nodes beyond the farthest one we know of still hear from us
+#ifndef HOP_LIMIT_PROBE_INTERVAL
+#define HOP_LIMIT_PROBE_INTERVAL 8
+#endif
+
+/// Counters our router (and its radios) keep, for our stats
+struct RouterStats {
+    RadioStats radio;          // Summed over all our interfaces
+    uint32_t fromRadioQueued;  // Received packets waiting for us to process them
+    uint32_t duplicates;       // Packets we ignored because we had already seen them
+    uint32_t suppressed;       // Rebroadcasts we cancelled because other nodes had already covered them
+    uint32_t gossipSkipped;    // Floods we chose not to rebroadcast because we have plenty of neighbors
+    uint32_t retransmissions;  // Reliable packets we had to send again because they weren't acked in time
+
+    uint32_t rxHandled;          // Received packets (including duplicates) we have processed
+    uint64_t rxHandleUsec;       // The CPU time we spent processing them
+    uint32_t maxFromRadioQueued; // The most received packets we have ever found waiting for us
+};
+
+/// A record of a packet we have seen, which we keep across a deep sleep (see WarmBoot)
+struct SavedPacketRecord {
+    NodeNum sender;
+    PacketId id;
+    uint32_t ageMsec; // How long before we saved it we last saw this packet
+};
+
 /**
  * A mesh aware router that supports multiple interfaces.
  */
-class Router : protected concurrency::OSThread
+class Router : protected concurrency::OSThread, public DuplicateFilter
 {
   private:
     /// Packets which have just arrived from the radio, ready to be processed by this service and possibly
     /// forwarded to the phone.
-    PointerQueue<MeshPacket> fromRadioQueue;
+    SPSCQueue<MeshPacket *> fromRadioQueue;
+
+    /// Packets we sent to ourselves.  Those can come from any task (i.e. a BLE callback), so this is a (thread safe) FreeRTOS
+    /// queue, while fromRadioQueue only ever has our radios (on the main thread) as its producer.
+    PointerQueue<MeshPacket> localQueue;
 
   protected:
+    /// Our first interface, whose modem settings we use for timing decisions (NULL until we have one)
     RadioInterface *iface = NULL;
 
+    RadioInterface *ifaces[MAX_INTERFACES];
+    size_t numInterfaces = 0;
+
+    /// For our stats, see RouterStats
+    uint32_t rxHandled = 0, maxFromRadioQueued = 0;
+    uint64_t rxHandleUsec = 0;
+
+    /// How many broadcasts we have picked a hop limit for, see HOP_LIMIT_PROBE_INTERVAL
+    uint32_t numHopLimitPicks = 0;
+
   public:
     /// Local services that want to see _every_ packet this node receives can observe this.
     /// Observers should always return 0 and _copy_ any packets they want to keep for use later (this packet will be getting
@@ -33,14 +81,42 @@ class Router : protected concurrency::OSThread
     Router();
 
     /**
-     * Currently we only allow one interface, that may change in the future
+     * Start sending and receiving with another interface.
+     *
+     * Broadcasts (including the floods we forward) go out on every interface, so our interfaces are bridged.  Unicasts go out
+     * only on the interface we last heard the destination on (or every interface if they aren't our neighbor), so separate
+     * interfaces add capacity.  Duplicates are suppressed across all interfaces because we share one packet history.
+     */
+    void addInterface(RadioInterface *_iface);
+
+    /**
+     * The interface plugins can move to a data channel (see RadioInterface::setDataChannel), or NULL if we can't.  Only nodes
+     * with a single interface can, a gateway's interfaces stay bridged on the control channel.
      */
-    void addInterface(RadioInterface *_iface)
+    RadioInterface *getDataChannelInterface()
     {
-        iface = _iface;
-        iface->setReceiver(&fromRadioQueue);
+        return numInterfaces == 1 && iface->getNumChannels() > 1 ? iface : NULL;
     }
 
+    /// Fill in our counters, each subclass adds its own
+    virtual void getStats(RouterStats &s);
+
+    /// Our first interface's transmit queue (the one our phone clients' broadcasts always go out on)
+    TxQueueStatus getTxQueueStatus()
+    {
+        TxQueueStatus s = {};
+        return iface ? iface->getTxQueueStatus() : s;
+    }
+
+    /// Our radios ask this before they queue a packet for us, a plain router has no history so needs everything
+    virtual bool isDuplicate(const MeshPacket *p) { return false; }
+
+    /// Copy up to maxOut of the packets we have seen recently into out, for keeping across a deep sleep @return the number copied
+    virtual size_t saveHistory(SavedPacketRecord *out, size_t maxOut) { return 0; }
+
+    /// Remember a packet saveHistory() gave us before a deep sleep, which lasted sleptMsec
+    virtual void restoreHistory(const SavedPacketRecord &r, uint32_t sleptMsec) {}
+
     /**
      * do idle processing
      * Mostly looking in our incoming rxPacket queue and calling handleReceived.
@@ -61,6 +137,13 @@ class Router : protected concurrency::OSThread
      * @return our local nodenum */
     NodeNum getNodeNum();
 
+    /**
+     * Did the packet we are handling now originate on this node (from our phone, or one of our plugins) rather than arrive
+     * from one of our interfaces?  Plugins which only obey our own phone check this (see MeshPlugin::isLocalRequest), never
+     * the packet's from, which any node can set to ours.
+     */
+    bool isHandlingLocal() const { return handlingLocal; }
+
   protected:
     /**
      * Send a packet on a suitable interface.  This routine will
@@ -85,6 +168,43 @@ class Router : protected concurrency::OSThread
      */
     virtual void sniffReceived(const MeshPacket *p);
 
+    /**
+     * We don't decode packets which are only passing by (unicasts for other nodes, other than route discovery), we call
+     * this instead of sniffReceived() with the packet still encrypted, so only its header can be looked at.  By default we
+     * just note that we heard the sender.
+     */
+    virtual void sniffTransit(const MeshPacket *p);
+
+    /// @return how many relays our packets need to reach node, or NODEDB_HOPS_UNKNOWN
+    virtual uint8_t getHopsAway(NodeNum node);
+
+    /**
+     * The hop limit our broadcasts need to reach every node we have heard from recently (never more than HOP_RELIABLE, which
+     * is also what we use if we don't know how far away some of them are)
+     */
+    uint8_t pickHopLimit(bool wantAck);
+
+    /**
+     * Called for every (non duplicate) received packet _before_ we decode it, while it still holds the original ciphertext.
+     * Subclasses which want to forward the packet as is should return a copy to send (with any header changes already made),
+     * or NULL.  We only send the copy if the packet turns out to be valid, and we send it without reencoding or encrypting.
+     */
+    virtual MeshPacket *copyForRebroadcast(const MeshPacket *p) { return NULL; }
+
+    /**
+     * Called with the copy from copyForRebroadcast() once we know the packet is valid.  By default we send it now, subclasses
+     * can hold on to it and send it later (with Router::send) or release it.
+     */
+    virtual void queueRebroadcast(MeshPacket *p);
+
+    /**
+     * Called for each valid packet addressed to us (or broadcast), just before we hand it to local services.  Subclasses can
+     * adjust the packet (i.e. to show the original sender of a forwarded message).
+     *
+     * @return false if this packet should not be delivered locally
+     */
+    virtual bool prepareForDelivery(MeshPacket *p) { return true; }
+
     /**
      * Remove any encryption and decode the protobufs inside this packet (if necessary).
      *
@@ -93,6 +213,42 @@ class Router : protected concurrency::OSThread
     bool perhapsDecode(MeshPacket *p);
 
   private:
+    /// The SubPacket decodeHeader() last decrypted, for finishDecode() (only the router thread decodes, so one will do)
+    uint8_t plain[MAX_RHPACKETLEN];
+    size_t plainLen = 0;
+
+    /// Which key trialDecode() decrypted plain with, and how many keys it has tried so far (0 if we didn't need it)
+    size_t trialKeyIndex = 0, numKeysTried = 0;
+
+    /// See isHandlingLocal() (handling a local packet can send, and so handle, another one)
+    bool handlingLocal = false;
+
+    /**
+     * The first of our two decode stages: decrypt p (if necessary) into our scratch and read the header of its SubPacket,
+     * without copying its payload anywhere.  p itself is left as it was, still encrypted.
+     *
+     * @return false for a corrupt packet (or one none of our keys decrypts)
+     */
+    bool decodeHeader(MeshPacket *p, SubPacketHeader &h);
+
+    /**
+     * The second stage, only for packets something here needs the payload of: decode the SubPacket decodeHeader() just
+     * decrypted into p.  If that was with a key trialDecode() guessed, and the rest doesn't decode, we carry on with the keys
+     * it hasn't tried (once we have a good packet its key is our hint for its sender).
+     *
+     * @return false for a corrupt packet (p is still encrypted)
+     */
+    bool finishDecode(MeshPacket *p);
+
+    /**
+     * Decrypt p with each key in our crypto engine's ring until its header parses (starting with the key that last worked
+     * for its sender), into our scratch
+     *
+     * @param numTried how many keys (in our order) an earlier call already tried
+     * @return false if none of our keys worked
+     */
+    bool trialDecode(const MeshPacket *p, SubPacketHeader &h, size_t numTried = 0);
+
     /**
      * Called from loop()
      * Handle any packet that is received by an interface on this node.
@@ -100,8 +256,10 @@ class Router : protected concurrency::OSThread
      *
      * Note: this packet will never be called for messages sent/generated by this node.
      * Note: this method will free the provided packet.
+     *
+     * @param local p originated on this node (see isHandlingLocal), rather than arriving from one of our interfaces
      */
-    void perhapsHandleReceived(MeshPacket *p);
+    void perhapsHandleReceived(MeshPacket *p, bool local);
 
     /**
      * Called from perhapsHandleReceived() - allows subclass message delivery behavior.
@@ -111,11 +269,21 @@ class Router : protected concurrency::OSThread
      * Note: this packet will never be called for messages sent/generated by this node.
      * Note: this method will free the provided packet.
      */
-    void handleReceived(MeshPacket *p);
+    void handleReceived(MeshPacket *p, bool local);
+
+    /// The body of handleReceived(), once we know p is worth handling
+    void handleReceivedPacket(MeshPacket *p);
 };
 
 extern Router *router;
 
 /// Generate a unique packet id
 // FIXME, move this someplace better
-PacketId generatePacketId();
\ No newline at end of file
+PacketId generatePacketId();
+
+/// Return the id generatePacketId() will return after n more calls (i.e. n = 0 is the next id)
+PacketId peekPacketId(size_t n);
+
+/// Where our packet ids are up to, so after a deep sleep we can carry on from there rather than picking a new random start
+uint32_t getPacketIdCounter();
+void setPacketIdCounter(uint32_t counter);
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include "RxTimestamps.h"
+
+RxTimestamps rxTimestamps;
+
+RxTimestamps::RxTimestamps()
+{
+    // id 0 is never a valid packet id, so these entries won't match anything
+    memset(entries, 0, sizeof(entries));
+}
+
+void RxTimestamps::add(NodeNum from, PacketId id, uint32_t frameStartUsec)
+{
+    entries[next] = {from, id, frameStartUsec};
+    next = (next + 1) % RX_TIMESTAMPS_SIZE;
+}
+
+bool RxTimestamps::find(NodeNum from, PacketId id, uint32_t *frameStartUsec) const
+{
+    for (size_t i = 0; i < RX_TIMESTAMPS_SIZE; i++) {
+        const Entry &e = entries[i];
+        if (e.id && e.from == from && e.id == id) {
+            *frameStartUsec = e.frameStartUsec;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/// How many recently received packets we remember precise arrival times for
+#define RX_TIMESTAMPS_SIZE 8
+
+/**
+ * Precise arrival times for the packets we most recently received.
+ *
+ * MeshPacket only has room for a time in seconds, so our radios record the micros() at which each frame started here (taken
+ * in the receive ISR, then corrected for the frame's airtime).  Anyone who wants sub-msec timing (i.e. round trip time
+ * estimation or latency tracing) can look a packet up while it is still being processed.
+ */
+class RxTimestamps
+{
+    struct Entry {
+        NodeNum from;
+        PacketId id;
+        uint32_t frameStartUsec;
+    };
+
+    Entry entries[RX_TIMESTAMPS_SIZE];
+    size_t next = 0; // Where our next record goes, we overwrite the oldest
+
+  public:
+    RxTimestamps();
+
+    void add(NodeNum from, PacketId id, uint32_t frameStartUsec);
+
+    /**
+     * Find the micros() at which the frame that carried this packet started
+     *
+     * @return false if we don't know (packets we sent ourselves, or which were received too long ago)
+     */
+    bool find(NodeNum from, PacketId id, uint32_t *frameStartUsec) const;
+};
+
+extern RxTimestamps rxTimestamps;
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+
+#include "concurrency/OSThread.h"
+#include "freertosinc.h"
+
+/**
+ * A wait-free ring buffer for queues with exactly one producer context and one consumer context (i.e. the radio and the
+ * router, which both run from the main loop).  Unlike TypedQueue no operation is a kernel call or enters a critical section.
+ *
+ * The producer only writes tail and the consumer only writes head, so each side just needs to see the other's index with
+ * acquire/release ordering.  Elements are copied by value, keep them small (pointers are ideal).
+ *
+ * If you have more than one producer or consumer (in different tasks or ISRs) use TypedQueue instead.
+ */
+template <class T> class SPSCQueue
+{
+    T *buf;
+    size_t mask; // capacity - 1
+
+    std::atomic<size_t> head; // The next element to dequeue, only written by the consumer
+    std::atomic<size_t> tail; // The next slot to fill, only written by the producer
+
+    concurrency::OSThread *reader = NULL;
+
+    /// Once this many elements are waiting our reader runs ahead of other threads (0 to never ask)
+    size_t urgentLevel = 0;
+
+  public:
+    /// capacity must be a power of 2
+    SPSCQueue(size_t capacity) : buf(new T[capacity]), mask(capacity - 1), head(0), tail(0)
+    {
+        assert(capacity && (capacity & mask) == 0);
+    }
+
+    ~SPSCQueue() { delete[] buf; }
+
+    SPSCQueue(const SPSCQueue &) = delete;
+    SPSCQueue &operator=(const SPSCQueue &) = delete;
+
+    /// How many elements are waiting
+    size_t numQueued() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+    bool isEmpty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+    int numFree() const
+    {
+        return mask + 1 - (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+    }
+
+    /// @return false if the queue was full
+    bool enqueue(T x)
+    {
+        if (!push(x))
+            return false;
+
+        // Only wake our reader once the element is visible, so it can't run, find nothing and go back to sleep
+        if (reader) {
+            wakeReader();
+            reader->getController()->wake();
+        }
+        return true;
+    }
+
+    bool enqueueFromISR(T x, BaseType_t *higherPriWoken)
+    {
+        if (!push(x))
+            return false;
+
+        if (reader) {
+            wakeReader();
+            reader->getController()->wakeFromISR(higherPriWoken);
+        }
+        return true;
+    }
+
+    /// @return false if the queue was empty
+    bool dequeue(T *p)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+
+        *p = buf[h & mask];
+        head.store(h + 1, std::memory_order_release); // Hand the slot back to the producer
+        return true;
+    }
+
+    /**
+     * Set a thread that is reading from this queue
+     * If a message is pushed to this queue that thread will be scheduled to run ASAP.
+     *
+     * Note: thread will not be automatically enabled, just have its interval set to 0
+     */
+    void setReader(concurrency::OSThread *t) { reader = t; }
+
+    /// Ask our reader's scheduler to run it ahead of other threads once level elements are waiting (see
+    /// Scheduler::runUrgently), so it can catch up before we overflow
+    void setUrgentLevel(size_t level) { urgentLevel = level; }
+
+  private:
+    void wakeReader()
+    {
+        if (urgentLevel && numQueued() >= urgentLevel)
+            reader->runUrgently();
+        else
+            reader->setInterval(0);
+    }
+
+    bool push(const T &x)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask)
+            return false; // Full
+
+        buf[t & mask] = x;
+        tail.store(t + 1, std::memory_order_release); // Publish the element to the consumer
+        return true;
+    }
+};
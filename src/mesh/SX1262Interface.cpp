@@ -53,7 +53,10 @@ bool SX1262Interface::init()
     limitPower();
 
     int res = lora.begin(freq, bw, sf, cr, syncWord, power, currentLimit, preambleLength, tcxoVoltage, useRegulatorLDO);
-    DEBUG_MSG("SX1262 init result %d\n", res);
+    txPower = power;
+    if (res == ERR_NONE)
+        markTuned();
+    LOG_DEBUG(RADIO, "SX1262 init result %d\n", res);
 
 #ifdef SX1262_TXEN
     // lora.begin sets Dio2 as RF switch control, which is not true if we are manually controlling RX and TX
@@ -74,6 +77,19 @@ bool SX1262Interface::reconfigure()
 {
     applyModemConfig();
 
+    if (power > 22) // This chip has lower power limits than some
+        power = 22;
+
+    if (!isRetuneNeeded()) {
+        // Only our power changed (if anything), which the chip takes without leaving receive
+        if (power != txPower) {
+            int err = lora.setOutputPower(power);
+            assert(err == ERR_NONE);
+            txPower = power;
+        }
+        return ERR_NONE;
+    }
+
     // set mode to standby
     setStandby();
 
@@ -103,10 +119,10 @@ bool SX1262Interface::reconfigure()
     err = lora.setFrequency(freq);
     if(err != ERR_NONE) recordCriticalError(CriticalErrorCode_InvalidRadioSetting);
 
-    if (power > 22) // This chip has lower power limits than some
-        power = 22;
     err = lora.setOutputPower(power);
     assert(err == ERR_NONE);
+    txPower = power;
+    markTuned();
 
     startReceive(); // restart receiving
 
@@ -118,6 +134,13 @@ void INTERRUPT_ATTR SX1262Interface::disableInterrupt()
     lora.clearDio1Action();
 }
 
+void SX1262Interface::setTxPower(int8_t dbm)
+{
+    int err = lora.setOutputPower(dbm);
+    if (err != ERR_NONE)
+        LOG_WARN(RADIO, "Warning: can't set transmit power %d (error %d)\n", dbm, err);
+}
+
 void SX1262Interface::setStandby()
 {
     int err = lora.standby();
@@ -135,13 +158,11 @@ void SX1262Interface::setStandby()
     completeSending(); // If we were sending, not anymore
 }
 
-/**
- * Add SNR data to received messages
- */
-void SX1262Interface::addReceiveMetadata(MeshPacket *mp)
+void SX1262Interface::readReceiveMetadata()
 {
     // DEBUG_MSG("PacketStatus %x\n", lora.getPacketStatus());
-    mp->rx_snr = lora.getSNR();
+    rxSnr = lora.getSNR();
+    rxRssi = lora.getRSSI();
 }
 
 /** We override to turn on transmitter power as needed.
@@ -170,9 +191,9 @@ void SX1262Interface::startReceive()
     digitalWrite(SX1262_RXEN, HIGH);
 #endif
 
-    // int err = lora.startReceive();
-    int err = lora.startReceiveDutyCycleAuto(); // We use a 32 bit preamble so this should save some power by letting radio sit in
-                                                // standby mostly.
+    // Let the radio sleep between short listens for a preamble (we use a 32 symbol preamble so the sleeps can be long).  The
+    // radio only wakes our CPU once a whole packet has arrived.
+    int err = lora.startReceiveDutyCycleAuto(preambleLength, SX1262_RX_MIN_SYMBOLS);
     assert(err == ERR_NONE);
 
     isReceiving = true;
@@ -182,6 +203,20 @@ void SX1262Interface::startReceive()
 #endif
 }
 
+bool SX1262Interface::isChannelActive()
+{
+    setStandby(); // CAD needs the radio to itself (and it drives the same interrupt pin we use)
+#ifdef SX1262_RXEN // CAD needs our receive path powered
+    digitalWrite(SX1262_RXEN, HIGH);
+#endif
+
+    int16_t res = lora.scanChannel();
+    if (res != LORA_DETECTED && res != CHANNEL_FREE)
+        LOG_ERROR(RADIO, "Channel activity detection failed, err=%d\n", res);
+
+    return res == LORA_DETECTED;
+}
+
 /** Could we send right now (i.e. either not actively receving or transmitting)? */
 bool SX1262Interface::isActivelyReceiving()
 {
@@ -203,7 +238,7 @@ bool SX1262Interface::isActivelyReceiving()
 bool SX1262Interface::sleep()
 {
     // Not keeping config is busted - next time nrf52 board boots lora sending fails  tcxo related? - see datasheet
-    DEBUG_MSG("sx1262 entering sleep mode (FIXME, don't keep config)\n");
+    LOG_DEBUG(RADIO, "sx1262 entering sleep mode (FIXME, don't keep config)\n");
     setStandby(); // Stop any pending operations
 
     // turn off TCXO if it was powered
@@ -2,6 +2,9 @@
 
 #include "RadioLibInterface.h"
 
+/// How many symbols of a preamble our RX duty cycle must hear to lock on (so each listen window is at least this long)
+#define SX1262_RX_MIN_SYMBOLS 8
+
 /**
  * Our adapter for SX1262 radios
  */
@@ -39,6 +42,12 @@ class SX1262Interface : public RadioLibInterface
     /** are we actively receiving a packet (only called during receiving state) */
     virtual bool isActivelyReceiving();
 
+    /** Run Channel Activity Detection, @return true if someone is transmitting */
+    virtual bool isChannelActive();
+
+    /// (Our RadioLib has no instantaneous RSSI for these, so surveys only have channel activity detection)
+    virtual bool tuneFrequency(float freq) { return lora.setFrequency(freq) == ERR_NONE; }
+
     /**
      * Start waiting to receive a message
      */
@@ -49,10 +58,12 @@ class SX1262Interface : public RadioLibInterface
      */
     virtual void configHardwareForSend();
 
+    virtual void setTxPower(int8_t dbm);
+
     /**
-     * Add SNR data to received messages
+     * Read the SNR/RSSI of the frame we just received
      */
-    virtual void addReceiveMetadata(MeshPacket *mp);
+    virtual void readReceiveMetadata();
 
     virtual void setStandby();
 
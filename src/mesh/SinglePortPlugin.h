@@ -23,6 +23,8 @@ class SinglePortPlugin : public MeshPlugin
      */
     virtual bool wantPortnum(PortNum p) { return p == ourPortNum; }
 
+    virtual int getSinglePortnum() { return ourPortNum; }
+
     /**
      * Return a mesh packet which has been preinited as a data packet with a particular port number.
      * You can then send this packet (after customizing any of the payload fields you might need) with
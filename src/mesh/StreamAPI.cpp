@@ -17,37 +17,50 @@ void StreamAPI::loop()
  */
 void StreamAPI::readStream()
 {
-    while (stream->available()) { // Currently we never want to block
-        uint8_t c = stream->read();
-
-        // Use the read pointer for a little state machine, first look for framing, then length bytes, then payload
-        size_t ptr = rxPtr++; // assume we will probably advance the rxPtr
-
-        rxBuf[ptr] = c; // store all bytes (including framing)
-
-        if (ptr == 0) { // looking for START1
-            if (c != START1)
-                rxPtr = 0;     // failed to find framing
-        } else if (ptr == 1) { // looking for START2
-            if (c != START2)
-                rxPtr = 0;                             // failed to find framing
-        } else if (ptr >= HEADER_LEN) {                // we have at least read our 4 byte framing
-            uint32_t len = (rxBuf[2] << 8) + rxBuf[3]; // big endian 16 bit length follows framing
-
-            if (ptr == HEADER_LEN) {
-                // we _just_ finished our 4 byte header, validate length now (note: a length of zero is a valid
-                // protobuf also)
-                if (len > MAX_TO_FROM_RADIO_SIZE)
-                    rxPtr = 0; // length is bogus, restart search for framing
-            }
-
-            if (rxPtr != 0 && ptr + 1 == len + HEADER_LEN) {
-                // If we didn't just fail the packet and we now have the right # of bytes, parse it
-                handleToRadio(rxBuf + HEADER_LEN, len);
-                rxPtr = 0; // start over again
-            }
+    int avail;
+    while ((avail = stream->available()) > 0) { // Currently we never want to block
+        // parseRxBuf always leaves less than one frame behind, so we always have room here
+        size_t toRead = min((size_t)avail, sizeof(rxBuf) - rxLen);
+        rxLen += stream->readBytes(rxBuf + rxLen, toRead);
+
+        parseRxBuf();
+    }
+}
+
+void StreamAPI::parseRxBuf()
+{
+    size_t pos = 0; // Everything before pos has been consumed
+
+    while (pos < rxLen) {
+        // Skip straight to the next possible frame start (memchr is much faster than checking a byte at a time)
+        const uint8_t *start = (const uint8_t *)memchr(rxBuf + pos, START1, rxLen - pos);
+        if (!start) {
+            pos = rxLen; // No framing anywhere in what we have
+            break;
+        }
+        pos = start - rxBuf;
+
+        if (rxLen - pos < HEADER_LEN)
+            break; // Wait for the rest of the header
+
+        uint32_t len = (rxBuf[pos + 2] << 8) + rxBuf[pos + 3]; // big endian 16 bit length follows framing
+
+        // Note: a length of zero is a valid protobuf also
+        if (rxBuf[pos + 1] != START2 || len > MAX_TO_FROM_RADIO_SIZE) {
+            pos++; // Not really framing (or the length is bogus), keep searching from the next byte
+            continue;
         }
+
+        if (rxLen - pos < HEADER_LEN + len)
+            break; // Wait for the rest of the payload
+
+        handleToRadio(rxBuf + pos + HEADER_LEN, len);
+        pos += HEADER_LEN + len;
     }
+
+    // Keep any partial frame at the start of our buffer
+    rxLen -= pos;
+    memmove(rxBuf, rxBuf + pos, rxLen);
 }
 
 /**
@@ -56,17 +69,17 @@ void StreamAPI::readStream()
 void StreamAPI::writeStream()
 {
     if (canWrite) {
+        // Only take packets from PhoneAPI while we have room for them, if our peer is slow the rest wait in MeshService
         uint32_t len;
-        do {
-            // Send every packet we can
-            len = getFromRadio(txBuf + HEADER_LEN);
+        while (sizeof(txRing) - txQueued >= MAX_STREAM_BUF_SIZE && (len = getFromRadio(txBuf + HEADER_LEN)) != 0)
             emitTxBuffer(len);
-        } while (len);
     }
+
+    flushTxRing();
 }
 
 /**
- * Send the current txBuffer over our stream
+ * Queue the current txBuffer for sending over our stream
  */
 void StreamAPI::emitTxBuffer(size_t len)
 {
@@ -76,10 +89,60 @@ void StreamAPI::emitTxBuffer(size_t len)
         txBuf[2] = (len >> 8) & 0xff;
         txBuf[3] = len & 0xff;
 
-        stream->write(txBuf, len + HEADER_LEN);
+        len += HEADER_LEN;
+        if (sizeof(txRing) - txQueued < len) {
+            LOG_WARN(MESH, "Stream tx ring full, dropping frame\n");
+            return;
+        }
+
+        size_t tail = (txHead + txQueued) % sizeof(txRing);
+        size_t firstPart = min(len, sizeof(txRing) - tail);
+        memcpy(txRing + tail, txBuf, firstPart);
+        memcpy(txRing, txBuf + firstPart, len - firstPart);
+        txQueued += len;
+
+        flushTxRing();
+    }
+}
+
+void StreamAPI::flushTxRing()
+{
+    while (txQueued) {
+        size_t contiguous = min(txQueued, sizeof(txRing) - txHead);
+        size_t written = writeNonBlocking(txRing + txHead, contiguous);
+
+        txHead = (txHead + written) % sizeof(txRing);
+        txQueued -= written;
+
+        if (written < contiguous)
+            break; // The stream is full, try again next loop
     }
 }
 
+size_t StreamAPI::writeNonBlocking(const uint8_t *buf, size_t len)
+{
+    int space = stream->availableForWrite();
+    return space > 0 ? stream->write(buf, min(len, (size_t)space)) : 0;
+}
+
+bool StreamAPI::emitLogRecord(uint32_t timeSec, const char *source, const char *message)
+{
+    memset(&fromRadioScratch, 0, sizeof(fromRadioScratch));
+    fromRadioScratch.which_variant = FromRadio_log_record_tag;
+    LogRecord &r = fromRadioScratch.variant.log_record;
+    strncpy(r.message, message, sizeof(r.message) - 1);
+    if (source)
+        strncpy(r.source, source, sizeof(r.source) - 1);
+    r.time = timeSec;
+
+    size_t len = pb_encode_to_bytes(txBuf + HEADER_LEN, FromRadio_size, FromRadio_fields, &fromRadioScratch);
+    if (sizeof(txRing) - txQueued < HEADER_LEN + len + MAX_STREAM_BUF_SIZE)
+        return false;
+
+    emitTxBuffer(len);
+    return true;
+}
+
 void StreamAPI::emitRebooted()
 {
     // In case we send a FromRadio packet
@@ -87,6 +150,6 @@ void StreamAPI::emitRebooted()
     fromRadioScratch.which_variant = FromRadio_rebooted_tag;
     fromRadioScratch.variant.rebooted = true;
 
-    DEBUG_MSG("Emitting reboot packet for serial shell\n");
+    LOG_DEBUG(MESH, "Emitting reboot packet for serial shell\n");
     emitTxBuffer(pb_encode_to_bytes(txBuf + HEADER_LEN, FromRadio_size, FromRadio_fields, &fromRadioScratch));
 }
\ No newline at end of file
@@ -6,6 +6,12 @@
 // A To/FromRadio packet + our 32 bit header
 #define MAX_STREAM_BUF_SIZE (MAX_TO_FROM_RADIO_SIZE + sizeof(uint32_t))
 
+/// Our receive buffer holds a partial frame plus room to read ahead in bulk
+#define STREAM_RX_BUF_SIZE (2 * MAX_STREAM_BUF_SIZE)
+
+/// How many bytes of encoded frames we can queue while waiting for a slow peer
+#define STREAM_TX_RING_SIZE (4 * MAX_STREAM_BUF_SIZE)
+
 /**
  * A version of our 'phone' API that talks over a Stream.  So therefore well suited to use with serial links
  * or TCP connections.
@@ -34,8 +40,14 @@ class StreamAPI : public PhoneAPI
      */
     Stream *stream;
 
-    uint8_t rxBuf[MAX_STREAM_BUF_SIZE];
-    size_t rxPtr = 0;
+    /// Bytes we have read but not yet parsed, always starting at the beginning of the buffer
+    uint8_t rxBuf[STREAM_RX_BUF_SIZE];
+    size_t rxLen = 0;
+
+    /// Encoded frames waiting for the stream to have room for them
+    uint8_t txRing[STREAM_TX_RING_SIZE];
+    size_t txHead = 0;   // The next byte to send
+    size_t txQueued = 0; // How many bytes (starting at txHead) are waiting
 
   public:
     StreamAPI(Stream *_stream) : stream(_stream) {}
@@ -47,17 +59,30 @@ class StreamAPI : public PhoneAPI
      */
     void loop();
 
+    /// Do we have output waiting for our stream to have room?
+    bool hasTxQueued() const { return txQueued != 0; }
+
   private:
     /**
      * Read any rx chars from the link and call handleToRadio
      */
     void readStream();
 
+    /**
+     * Call handleToRadio for every complete frame in rxBuf, then discard everything we've used
+     */
+    void parseRxBuf();
+
     /**
      * call getFromRadio() and deliver encapsulated packets to the Stream
      */
     void writeStream();
 
+    /**
+     * Send as much of txRing as our stream will currently accept
+     */
+    void flushTxRing();
+
   protected:
     /**
      * Send a FromRadio.rebooted = true packet to the phone
@@ -65,10 +90,26 @@ class StreamAPI : public PhoneAPI
     void emitRebooted();
     
     /**
-     * Send the current txBuffer over our stream
+     * Send the current txBuffer over our stream (it is queued in txRing if the stream is busy)
      */
     void emitTxBuffer(size_t len);
 
+    /**
+     * Send a log line as a FromRadio.log_record, unless that would leave our txRing without room for a whole packet (log
+     * lines always give way to packets)
+     *
+     * @return false if we dropped it
+     */
+    bool emitLogRecord(uint32_t timeSec, const char *source, const char *message);
+
+    /**
+     * Write as much of buf as the stream can take without blocking
+     *
+     * The default uses availableForWrite(), so subclasses whose streams don't implement that must override this
+     * @return the number of bytes written
+     */
+    virtual size_t writeNonBlocking(const uint8_t *buf, size_t len);
+
     /// Are we allowed to write packets to our output stream (subclasses can turn this off - i.e. SerialConsole)
     bool canWrite = true;
 
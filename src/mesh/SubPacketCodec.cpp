@@ -0,0 +1,549 @@
+#include "SubPacketCodec.h"
+#include <string.h>
+
+// Protobuf wire types
+#define WT_VARINT 0
+#define WT_64BIT 1
+#define WT_BYTES 2
+#define WT_32BIT 5
+
+/// A bounds checked output buffer, once full everything else we write is dropped and ok is false
+struct FastWriter {
+    uint8_t *p, *end;
+    bool ok;
+
+    void byte(uint8_t b)
+    {
+        if (p < end)
+            *p++ = b;
+        else
+            ok = false;
+    }
+
+    void varint(uint64_t v)
+    {
+        while (v >= 0x80) {
+            byte((uint8_t)v | 0x80);
+            v >>= 7;
+        }
+        byte((uint8_t)v);
+    }
+
+    void tag(uint32_t field, uint8_t wireType) { varint((field << 3) | wireType); }
+
+    void fixed32(uint32_t v)
+    {
+        for (int i = 0; i < 4; i++, v >>= 8)
+            byte((uint8_t)v);
+    }
+
+    void bytes(const uint8_t *b, size_t n)
+    {
+        if ((size_t)(end - p) < n) {
+            ok = false;
+            p = end;
+        } else {
+            memcpy(p, b, n);
+            p += n;
+        }
+    }
+
+    // Like nanopb, skip proto3 fields which have their default value
+    void uint32Field(uint32_t field, uint32_t v)
+    {
+        if (v) {
+            tag(field, WT_VARINT);
+            varint(v);
+        }
+    }
+
+    void int32Field(uint32_t field, int32_t v)
+    {
+        if (v) {
+            tag(field, WT_VARINT);
+            varint((uint64_t)(int64_t)v); // Negative int32s are sign extended to 10 bytes
+        }
+    }
+
+    void sint32Field(uint32_t field, int32_t v)
+    {
+        if (v) {
+            tag(field, WT_VARINT);
+            varint(((uint32_t)v << 1) ^ (uint32_t)(v >> 31));
+        }
+    }
+
+    /// A sub message, written by fn.  We reserve one byte for its length and move it along if it needs more.
+    template <typename F> void message(uint32_t field, F fn)
+    {
+        tag(field, WT_BYTES);
+        uint8_t *start = p;
+        byte(0);
+        fn();
+        if (!ok)
+            return;
+
+        size_t len = p - start - 1;
+        if (len < 0x80)
+            *start = len;
+        else {
+            // Our messages are always < 16K, so two bytes is enough
+            if (p >= end) {
+                ok = false;
+                return;
+            }
+            memmove(start + 2, start + 1, len);
+            p++;
+            start[0] = (uint8_t)len | 0x80;
+            start[1] = len >> 7;
+        }
+    }
+};
+
+static void writePosition(FastWriter &w, const Position &p)
+{
+    w.int32Field(Position_altitude_tag, p.altitude);
+    w.int32Field(Position_battery_level_tag, p.battery_level);
+    w.sint32Field(Position_latitude_i_tag, p.latitude_i);
+    w.sint32Field(Position_longitude_i_tag, p.longitude_i);
+    if (p.time) {
+        w.tag(Position_time_tag, WT_32BIT);
+        w.fixed32(p.time);
+    }
+}
+
+size_t fastEncodeSubPacket(uint8_t *buf, size_t bufsize, const SubPacket &s)
+{
+    FastWriter w = {buf, buf + bufsize, true};
+
+    switch (s.which_payload) {
+    case SubPacket_data_tag:
+        w.message(SubPacket_data_tag, [&]() {
+            w.uint32Field(Data_portnum_tag, s.data.portnum);
+            if (s.data.payload.size) {
+                w.tag(Data_payload_tag, WT_BYTES);
+                w.varint(s.data.payload.size);
+                w.bytes(s.data.payload.bytes, s.data.payload.size);
+            }
+        });
+        break;
+    case SubPacket_position_tag:
+        w.message(SubPacket_position_tag, [&]() { writePosition(w, s.position); });
+        break;
+    case 0:
+        break; // No payload (i.e. a bare ack)
+    default:
+        return 0;
+    }
+
+    w.uint32Field(SubPacket_original_id_tag, s.original_id);
+    w.uint32Field(SubPacket_want_response_tag, s.want_response);
+    w.uint32Field(SubPacket_dest_tag, s.dest);
+    if (s.which_ack == SubPacket_success_id_tag || s.which_ack == SubPacket_fail_id_tag) {
+        // Oneof members are written even when zero
+        w.tag(s.which_ack, WT_VARINT);
+        w.varint(s.ack.success_id);
+    } else if (s.which_ack)
+        return 0;
+    w.uint32Field(SubPacket_source_tag, s.source);
+
+    return w.ok ? w.p - buf : 0;
+}
+
+size_t fastEncodePosition(uint8_t *buf, size_t bufsize, const Position &p)
+{
+    FastWriter w = {buf, buf + bufsize, true};
+    writePosition(w, p);
+    return w.ok ? w.p - buf : 0;
+}
+
+/// Reads a protobuf, any error (or anything we don't handle) sets ok to false
+struct FastReader {
+    const uint8_t *p, *end;
+    bool ok;
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p >= end)
+                break;
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+        ok = false;
+        return 0;
+    }
+
+    uint32_t uint32()
+    {
+        uint64_t v = varint();
+        if (v > 0xffffffff)
+            ok = false;
+        return v;
+    }
+
+    int32_t int32()
+    {
+        int64_t v = varint();
+        if (v < INT32_MIN || v > INT32_MAX)
+            ok = false;
+        return v;
+    }
+
+    int32_t sint32()
+    {
+        uint64_t u = varint();
+        int64_t v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+        if (v < INT32_MIN || v > INT32_MAX)
+            ok = false;
+        return v;
+    }
+
+    uint32_t fixed32()
+    {
+        if (end - p < 4) {
+            ok = false;
+            return 0;
+        }
+        uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        p += 4;
+        return v;
+    }
+
+    /// The length of a WT_BYTES field, checked against what is left
+    size_t length()
+    {
+        uint32_t n = uint32();
+        if (n > (size_t)(end - p))
+            ok = false;
+        return ok ? n : 0;
+    }
+
+    /// Skip an unknown field, like nanopb does
+    void skip(uint8_t wireType)
+    {
+        switch (wireType) {
+        case WT_VARINT:
+            varint();
+            break;
+        case WT_64BIT:
+        case WT_32BIT: {
+            size_t n = wireType == WT_64BIT ? 8 : 4;
+            if ((size_t)(end - p) < n)
+                ok = false;
+            else
+                p += n;
+            break;
+        }
+        case WT_BYTES:
+            p += length();
+            break;
+        default:
+            ok = false;
+        }
+    }
+
+    /// Read the next field's tag, returns false at the end (or on error)
+    bool next(uint32_t &field, uint8_t &wireType)
+    {
+        if (!ok || p >= end)
+            return false;
+        uint32_t t = uint32();
+        field = t >> 3;
+        wireType = t & 7;
+        if (!field)
+            ok = false; // nanopb treats a zero tag as the end of the message, we leave that to it
+        return ok;
+    }
+};
+
+static void invalid(FastReader &r)
+{
+    r.ok = false;
+}
+
+static void readPosition(FastReader &r, Position &pos)
+{
+    uint32_t field;
+    uint8_t wt;
+    while (r.next(field, wt)) {
+        switch (field) {
+        case Position_altitude_tag:
+        case Position_battery_level_tag:
+            if (wt != WT_VARINT)
+                invalid(r);
+            else
+                (field == Position_altitude_tag ? pos.altitude : pos.battery_level) = r.int32();
+            break;
+        case Position_latitude_i_tag:
+        case Position_longitude_i_tag:
+            if (wt != WT_VARINT)
+                invalid(r);
+            else
+                (field == Position_latitude_i_tag ? pos.latitude_i : pos.longitude_i) = r.sint32();
+            break;
+        case Position_time_tag:
+            if (wt != WT_32BIT)
+                invalid(r);
+            else
+                pos.time = r.fixed32();
+            break;
+        default:
+            r.skip(wt);
+        }
+    }
+}
+
+static PortNum readPortNum(FastReader &r)
+{
+    // Like nanopb, reject enum values which don't fit (our enums might be short)
+    uint64_t v = r.varint();
+    if (sizeof(PortNum) < 4 && v >= (1ULL << (8 * sizeof(PortNum))))
+        invalid(r);
+    else if (v > 0xffffffff)
+        invalid(r);
+    return (PortNum)v;
+}
+
+static void readData(FastReader &r, Data &d)
+{
+    uint32_t field;
+    uint8_t wt;
+    while (r.next(field, wt)) {
+        switch (field) {
+        case Data_portnum_tag:
+            if (wt != WT_VARINT)
+                invalid(r);
+            else
+                d.portnum = readPortNum(r);
+            break;
+        case Data_payload_tag: {
+            if (wt != WT_BYTES) {
+                invalid(r);
+                break;
+            }
+            size_t n = r.length();
+            if (n > sizeof(d.payload.bytes))
+                invalid(r);
+            else if (r.ok) {
+                memcpy(d.payload.bytes, r.p, n);
+                d.payload.size = n;
+                r.p += n;
+            }
+            break;
+        }
+        default:
+            r.skip(wt);
+        }
+    }
+}
+
+bool fastDecodeSubPacket(const uint8_t *buf, size_t len, SubPacket &s)
+{
+    memset(&s, 0, sizeof(s));
+    FastReader r = {buf, buf + len, true};
+
+    uint32_t field;
+    uint8_t wt;
+    while (r.next(field, wt)) {
+        switch (field) {
+        case SubPacket_data_tag:
+        case SubPacket_position_tag: {
+            if (wt != WT_BYTES || s.which_payload)
+                return false; // A second payload is merged or replaces the first, we leave that to nanopb
+
+            size_t n = r.length();
+            FastReader sub = {r.p, r.p + n, r.ok};
+            if (field == SubPacket_data_tag)
+                readData(sub, s.data);
+            else
+                readPosition(sub, s.position);
+            r.ok &= sub.ok;
+            r.p += n;
+            s.which_payload = field;
+            break;
+        }
+        case SubPacket_original_id_tag:
+        case SubPacket_want_response_tag:
+        case SubPacket_dest_tag:
+        case SubPacket_source_tag: {
+            if (wt != WT_VARINT)
+                return false;
+            uint32_t v = r.uint32();
+            if (field == SubPacket_original_id_tag)
+                s.original_id = v;
+            else if (field == SubPacket_want_response_tag)
+                s.want_response = v != 0;
+            else if (field == SubPacket_dest_tag)
+                s.dest = v;
+            else
+                s.source = v;
+            break;
+        }
+        case SubPacket_success_id_tag:
+        case SubPacket_fail_id_tag:
+            if (wt != WT_VARINT)
+                return false;
+            s.which_ack = field;
+            s.ack.success_id = r.uint32();
+            break;
+        case SubPacket_user_tag:
+        case SubPacket_route_request_tag:
+        case SubPacket_route_reply_tag:
+        case SubPacket_route_error_tag:
+            return false; // Rare enough for nanopb
+        default:
+            r.skip(wt);
+        }
+    }
+
+    return r.ok;
+}
+
+/// Like FastReader::next(), except that we accept overlong tags as nanopb does (it keeps their low 32 bits)
+static bool peekTag(FastReader &r, uint32_t &field, uint8_t &wireType)
+{
+    if (!r.ok || r.p >= r.end)
+        return false;
+    uint32_t t = r.varint();
+    field = t >> 3;
+    wireType = t & 7;
+    if (!field)
+        invalid(r);
+    return r.ok;
+}
+
+/// Skip an unknown field exactly as nanopb does, which doesn't limit how long an unknown varint is
+static void peekSkip(FastReader &r, uint8_t wireType)
+{
+    if (wireType != WT_VARINT)
+        r.skip(wireType);
+    else {
+        while (r.p < r.end && (*r.p & 0x80))
+            r.p++;
+        if (r.p < r.end)
+            r.p++;
+        else
+            invalid(r);
+    }
+}
+
+static void peekData(FastReader &r, SubPacketHeader &h)
+{
+    uint32_t field;
+    uint8_t wt;
+    while (peekTag(r, field, wt)) {
+        if (field == Data_portnum_tag) {
+            if (wt != WT_VARINT)
+                invalid(r);
+            else
+                h.portnum = readPortNum(r);
+        } else if (field == Data_payload_tag) {
+            size_t n = wt == WT_BYTES ? r.length() : 0;
+            if (wt != WT_BYTES || n > sizeof(Data_payload_t::bytes))
+                invalid(r);
+            r.p += n;
+        } else
+            peekSkip(r, wt);
+    }
+}
+
+bool peekSubPacket(const uint8_t *buf, size_t len, SubPacketHeader &h)
+{
+    memset(&h, 0, sizeof(h));
+    FastReader r = {buf, buf + len, true};
+
+    uint32_t field;
+    uint8_t wt;
+    while (peekTag(r, field, wt)) {
+        switch (field) {
+        case SubPacket_position_tag:
+        case SubPacket_data_tag:
+        case SubPacket_user_tag:
+        case SubPacket_route_request_tag:
+        case SubPacket_route_reply_tag: {
+            if (wt != WT_BYTES)
+                return false;
+
+            // Only a Data payload has anything we route by, the rest we leave for the full decode to check
+            size_t n = r.length();
+            if (field == SubPacket_data_tag) {
+                if (h.which_payload != SubPacket_data_tag)
+                    h.portnum = (PortNum)0; // A different payload replaced our last one, nanopb merges repeats of the same
+                FastReader sub = {r.p, r.p + n, r.ok};
+                peekData(sub, h);
+                r.ok &= sub.ok;
+            }
+            r.p += n;
+            h.which_payload = field;
+            break;
+        }
+        case SubPacket_route_error_tag:
+            // The one payload which is an enum.  Our nanopb build drops this field (as if it were unknown) so we can't be
+            // any stricter, but we still say it is there, which only costs a full decode.
+            if (wt == WT_VARINT)
+                h.which_payload = field;
+            peekSkip(r, wt);
+            break;
+        case SubPacket_original_id_tag:
+        case SubPacket_want_response_tag:
+        case SubPacket_dest_tag:
+        case SubPacket_source_tag:
+        case SubPacket_success_id_tag:
+        case SubPacket_fail_id_tag: {
+            if (wt != WT_VARINT)
+                return false;
+            uint32_t v = r.uint32();
+            if (field == SubPacket_original_id_tag)
+                h.original_id = v;
+            else if (field == SubPacket_want_response_tag)
+                h.want_response = v != 0;
+            else if (field == SubPacket_dest_tag)
+                h.dest = v;
+            else if (field == SubPacket_source_tag)
+                h.source = v;
+            else {
+                h.which_ack = field;
+                h.ackId = v;
+            }
+            break;
+        }
+        default:
+            peekSkip(r, wt);
+        }
+    }
+
+    return r.ok;
+}
+
+void getSubPacketHeader(const SubPacket &s, SubPacketHeader &h)
+{
+    h.which_payload = s.which_payload;
+    h.portnum = s.which_payload == SubPacket_data_tag ? s.data.portnum : (PortNum)0;
+    h.which_ack = s.which_ack;
+    h.ackId = s.ack.success_id;
+    h.want_response = s.want_response;
+    h.original_id = s.original_id;
+    h.dest = s.dest;
+    h.source = s.source;
+}
+
+size_t encodeSubPacket(uint8_t *buf, size_t bufsize, const SubPacket &s)
+{
+    size_t n = fastEncodeSubPacket(buf, bufsize, s);
+    return n ? n : pb_encode_to_bytes(buf, bufsize, SubPacket_fields, &s);
+}
+
+bool decodeSubPacket(const uint8_t *buf, size_t len, SubPacket &s)
+{
+    return fastDecodeSubPacket(buf, len, s) || pb_decode_from_bytes(buf, len, SubPacket_fields, &s);
+}
+
+size_t encodePosition(uint8_t *buf, size_t bufsize, const Position &p)
+{
+    size_t n = fastEncodePosition(buf, bufsize, p);
+    return n ? n : pb_encode_to_bytes(buf, bufsize, Position_fields, &p);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "mesh-pb-constants.h"
+
+/**
+ * Hand written codecs for the protobufs we encode and decode for every packet: SubPacket with a Data or Position payload, and
+ * Position (the payload of our position broadcasts).
+ *
+ * nanopb interprets its field descriptors for every field of every message, which is a noticeable part of our per packet CPU
+ * on the slower boards.  These write the same bytes nanopb would (fields in declaration order, proto3 defaults skipped) and
+ * accept what nanopb accepts for these shapes.  For anything else (other payload types, unexpected wire types, merged
+ * duplicate fields) the fast versions give up and the wrappers fall back to nanopb, which stays the reference.
+ */
+
+/// Encode as pb_encode_to_bytes(..., SubPacket_fields, s) would, returns the encoded size
+size_t encodeSubPacket(uint8_t *buf, size_t bufsize, const SubPacket &s);
+
+/// Decode as pb_decode_from_bytes(..., SubPacket_fields, s) would, returns false if the bytes are invalid
+bool decodeSubPacket(const uint8_t *buf, size_t len, SubPacket &s);
+
+/// The parts of a SubPacket our routers look at, which peekSubPacket() reads without copying any payload
+struct SubPacketHeader {
+    pb_size_t which_payload; // Which SubPacket payload (SubPacket_*_tag), 0 for none
+    PortNum portnum;         // For a Data payload
+    pb_size_t which_ack;     // SubPacket_success_id_tag, SubPacket_fail_id_tag or 0
+    uint32_t ackId;
+    bool want_response;
+    uint32_t original_id, dest, source;
+};
+
+/**
+ * The cheap first stage of decoding a SubPacket: check its framing and read its header, skipping over the payload itself.
+ * That is enough to tell whether we decrypted it with the right key, and to route it.  We never reject anything
+ * decodeSubPacket() accepts, but we don't look inside payloads other than Data, so it can still reject what we accept.
+ *
+ * @return false if the bytes are invalid
+ */
+bool peekSubPacket(const uint8_t *buf, size_t len, SubPacketHeader &h);
+
+/// The header of a SubPacket which we already have decoded
+void getSubPacketHeader(const SubPacket &s, SubPacketHeader &h);
+
+/// Encode as pb_encode_to_bytes(..., Position_fields, p) would, returns the encoded size
+size_t encodePosition(uint8_t *buf, size_t bufsize, const Position &p);
+
+/// Our fast paths alone, these return 0/false if they can't handle the message (so our benchmarks can check them)
+size_t fastEncodeSubPacket(uint8_t *buf, size_t bufsize, const SubPacket &s);
+bool fastDecodeSubPacket(const uint8_t *buf, size_t len, SubPacket &s);
+size_t fastEncodePosition(uint8_t *buf, size_t bufsize, const Position &p);
@@ -0,0 +1,73 @@
+#include "TxSlots.h"
+#include "NodeDB.h"
+#include "RTC.h"
+#include "configuration.h"
+
+void TxSlots::configure(uint32_t frameMsec)
+{
+    uint32_t newSlotMsec = frameMsec + 2 * TDMA_GUARD_MSEC;
+    if (newSlotMsec == slotMsec)
+        return;
+
+    slotMsec = newSlotMsec;
+    numSlots = min((uint32_t)TDMA_MAX_SLOTS, TDMA_SUPERFRAME_MSEC / slotMsec);
+    if (!numSlots)
+        numSlots = 1; // Very slow modem settings, everyone shares one slot
+
+    // Whatever we heard was for the old slots
+    memset(heardMsec, 0, sizeof(heardMsec));
+    mySlot = nodeDB.getNodeNum() % numSlots;
+    LOG_DEBUG(RADIO, "TDMA: %u slots of %u msec, we start in slot %u\n", numSlots, slotMsec, mySlot);
+}
+
+bool TxSlots::isSynced() const
+{
+    return numSlots && getValidTimeMsec(RTCQualityGPS);
+}
+
+void TxSlots::onFrameStart(uint32_t usecAgo)
+{
+    uint64_t now = getValidTimeMsec(RTCQualityGPS);
+    if (!numSlots || !now)
+        return;
+
+    uint32_t pos = (now - usecAgo / 1000) % ((uint64_t)numSlots * slotMsec);
+    uint16_t slot = pos / slotMsec;
+    if (pos % slotMsec < 2 * TDMA_GUARD_MSEC) // Near enough to the start of a slot to be someone sending in it
+        heardMsec[slot] = millis() ? millis() : 1;
+}
+
+void TxSlots::perhapsMoveSlot()
+{
+    uint32_t now = millis(), holdMsec = TDMA_SLOT_HOLD_SUPERFRAMES * numSlots * slotMsec;
+    auto isTaken = [&](uint16_t s) { return heardMsec[s] && now - heardMsec[s] < holdMsec; };
+
+    if (!isTaken(mySlot))
+        return;
+
+    // Start looking somewhere random, so nodes which collided don't all pick the same free slot
+    uint16_t start = random(numSlots);
+    for (uint16_t i = 0; i < numSlots; i++) {
+        uint16_t s = (start + i) % numSlots;
+        if (!isTaken(s)) {
+            LOG_DEBUG(RADIO, "TDMA: someone else is in slot %u, moving to %u\n", mySlot, s);
+            mySlot = s;
+            return;
+        }
+    }
+    // Every slot is in use, stay where we are (some collisions are better than not sending)
+}
+
+uint32_t TxSlots::getMsecUntilOurSlot()
+{
+    perhapsMoveSlot();
+
+    uint32_t superframeMsec = numSlots * slotMsec;
+    uint32_t pos = getValidTimeMsec(RTCQualityGPS) % superframeMsec;
+    uint32_t start = mySlot * slotMsec + TDMA_GUARD_MSEC;
+
+    if (pos >= start && pos < start + TDMA_GUARD_MSEC)
+        return 0; // Late starts within the guard time still finish inside our slot
+
+    return (start + superframeMsec - pos) % superframeMsec;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "MeshTypes.h"
+
+/// How long one cycle through every slot takes (at most, we use a whole number of slots)
+#ifndef TDMA_SUPERFRAME_MSEC
+#define TDMA_SUPERFRAME_MSEC (60 * 1000L)
+#endif
+
+/// How far apart we assume our clocks can be, we start sending this long into our slot and leave as long after our frame
+#ifndef TDMA_GUARD_MSEC
+#define TDMA_GUARD_MSEC 200
+#endif
+
+/// Slots are sized for a frame this long (a position or user broadcast), anything longer might run into the next slot
+#define TDMA_SLOT_BYTES 80
+
+#define TDMA_MAX_SLOTS 128
+
+/// How many of our broadcasts can wait for our slot, we only send one per superframe so more would just get stale
+#define TDMA_MAX_QUEUED 4
+
+/// A slot we heard someone else start a frame in during the last this many superframes is theirs
+#define TDMA_SLOT_HOLD_SUPERFRAMES 3
+
+/**
+ * Self organising transmit slots, for LORA_SLOTTED_TX builds.
+ *
+ * Nodes with GPS time divide each superframe (aligned to the epoch) into slots.  Each node starts out in a slot picked from
+ * its node number, and listens: frames which begin just after a slot boundary belong to whoever holds that slot, and if
+ * someone else is using ours we move to a random slot nobody has used lately.  There is no coordinator, so this only needs
+ * everyone to agree on the time and the modem settings.
+ */
+class TxSlots
+{
+    uint32_t slotMsec = 0;
+    uint16_t numSlots = 0, mySlot = 0;
+
+    /// millis() when we last heard someone else start a frame in each slot (0 for never)
+    uint32_t heardMsec[TDMA_MAX_SLOTS] = {};
+
+  public:
+    /// Recompute our slots for a radio which takes frameMsec to send a TDMA_SLOT_BYTES frame
+    void configure(uint32_t frameMsec);
+
+    /// @return true if our clock is good enough to use our slot
+    bool isSynced() const;
+
+    /// Someone else's frame started arriving usecAgo usecs ago
+    void onFrameStart(uint32_t usecAgo);
+
+    /// @return msecs until we may start sending in our slot (0 if we may now).  Only meaningful if isSynced()
+    uint32_t getMsecUntilOurSlot();
+
+  private:
+    /// Move to a slot nobody else has used lately, if ours is taken
+    void perhapsMoveSlot();
+};
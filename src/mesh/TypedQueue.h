@@ -35,7 +35,7 @@ template <class T> class TypedQueue
     {
         if (reader) {
             reader->setInterval(0);
-            concurrency::mainDelay.interrupt();
+            reader->getController()->wake();
         }
         return xQueueSendToBack(h, &x, maxWait) == pdTRUE;
     }
@@ -44,7 +44,7 @@ template <class T> class TypedQueue
     {
         if (reader) {
             reader->setInterval(0);
-            concurrency::mainDelay.interruptFromISR(higherPriWoken);
+            reader->getController()->wakeFromISR(higherPriWoken);
         }
         return xQueueSendToBackFromISR(h, &x, higherPriWoken) == pdTRUE;
     }
@@ -64,50 +64,102 @@ template <class T> class TypedQueue
 
 #else
 
-#include <queue>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 /**
- * A wrapper for freertos queues.  Note: each element object should be small
- * and POD (Plain Old Data type) as elements are memcpied by value.
+ * A bounded ring buffer with the same capacity and blocking semantics as the freertos queues, so that sims on the linux
+ * target see the same overflows (and memory use) a real device would.  Safe for multiple producer and consumer threads.
+ *
+ * Note: on this platform a tick is one msec.  Each element object should be small, as elements are copied by value.
  */
 template <class T> class TypedQueue
 {
-    std::queue<T> q;
+    T *buf;
+    size_t capacity;
+    size_t head = 0;     // The next element to dequeue
+    size_t numQueued = 0;
+
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+
     concurrency::OSThread *reader = NULL;
 
   public:
-    TypedQueue(int maxElements) {}
+    TypedQueue(int maxElements) : buf(new T[maxElements]), capacity(maxElements) { assert(maxElements > 0); }
 
-    int numFree() { return 1; } // Always claim 1 free, because we can grow to any size
+    ~TypedQueue() { delete[] buf; }
 
-    bool isEmpty() { return q.empty(); }
+    TypedQueue(const TypedQueue &) = delete;
+    TypedQueue &operator=(const TypedQueue &) = delete;
+
+    int numFree()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return capacity - numQueued;
+    }
+
+    bool isEmpty()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return numQueued == 0;
+    }
 
     bool enqueue(T x, TickType_t maxWait = portMAX_DELAY)
     {
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            if (!waitFor(guard, notFull, maxWait, [this] { return numQueued < capacity; }))
+                return false; // Still full after maxWait, just like xQueueSendToBack
+
+            buf[(head + numQueued) % capacity] = x;
+            numQueued++;
+        }
+        notEmpty.notify_one();
+
+        // Only wake our reader once the element is visible, so it can't run, find nothing and go back to sleep
         if (reader) {
             reader->setInterval(0);
-            concurrency::mainDelay.interrupt();
+            reader->getController()->wake();
         }
-
-        q.push(x);
         return true;
     }
 
-    // bool enqueueFromISR(T x, BaseType_t *higherPriWoken) { return xQueueSendToBackFromISR(h, &x, higherPriWoken) == pdTRUE; }
-
     bool dequeue(T *p, TickType_t maxWait = portMAX_DELAY)
     {
-        if (isEmpty())
-            return false;
-        else {
-            *p = q.front();
-            q.pop();
-            return true;
+        {
+            std::unique_lock<std::mutex> guard(mutex);
+            if (!waitFor(guard, notEmpty, maxWait, [this] { return numQueued > 0; }))
+                return false;
+
+            *p = buf[head];
+            head = (head + 1) % capacity;
+            numQueued--;
         }
+        notFull.notify_one();
+        return true;
     }
 
-    // bool dequeueFromISR(T *p, BaseType_t *higherPriWoken) { return xQueueReceiveFromISR(h, p, higherPriWoken); }
-
+    /**
+     * Set a thread that is reading from this queue
+     * If a message is pushed to this queue that thread will be scheduled to run ASAP.
+     *
+     * Note: thread will not be automatically enabled, just have its interval set to 0
+     */
     void setReader(concurrency::OSThread *t) { reader = t; }
+
+  private:
+    /// Wait (with the mutex held) up to maxWait msecs for ready() to become true, portMAX_DELAY waits forever
+    template <class Pred>
+    static bool waitFor(std::unique_lock<std::mutex> &guard, std::condition_variable &cond, TickType_t maxWait, Pred ready)
+    {
+        if (maxWait == portMAX_DELAY) {
+            cond.wait(guard, ready);
+            return true;
+        }
+
+        return cond.wait_for(guard, std::chrono::milliseconds(maxWait), ready);
+    }
 };
 #endif
@@ -0,0 +1,16 @@
+/*
+ * Hand written, in the form nanopb 0.4.4 would generate from the TelemetryBatch message in plugins/TelemetryPlugin.h.  That
+ * message (and TELEMETRY_PORTNUM) isn't in the protobufs repo yet, so bin/regen-protos.sh can't make these files, keep them
+ * in step with the message by hand until it is.
+ */
+
+#include "telemetry.pb.h"
+#if PB_PROTO_HEADER_VERSION != 40
+#error Update this file for the current version of nanopb.
+#endif
+
+PB_BIND(TelemetryBatch, TelemetryBatch, 2)
+
+
+
+
@@ -0,0 +1,63 @@
+/*
+ * Hand written, in the form nanopb 0.4.4 would generate from the TelemetryBatch message in plugins/TelemetryPlugin.h.  That
+ * message (and TELEMETRY_PORTNUM) isn't in the protobufs repo yet, so bin/regen-protos.sh can't make these files, keep them
+ * in step with the message by hand until it is.
+ */
+
+#ifndef PB_TELEMETRY_PB_H_INCLUDED
+#define PB_TELEMETRY_PB_H_INCLUDED
+#include <pb.h>
+
+#if PB_PROTO_HEADER_VERSION != 40
+#error Update this file for the current version of nanopb.
+#endif
+
+/* Struct definitions */
+typedef struct _TelemetryBatch {
+    uint32_t seq;
+    uint32_t first_age_msec;
+    uint32_t interval_msec;
+    uint32_t num_channels;
+    pb_size_t deltas_count;
+    int32_t deltas[100];
+} TelemetryBatch;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Initializer values for message structs */
+#define TelemetryBatch_init_default              {0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
+#define TelemetryBatch_init_zero                 {0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}
+
+/* Field tags (for use in manual encoding/decoding) */
+#define TelemetryBatch_seq_tag                   1
+#define TelemetryBatch_first_age_msec_tag        2
+#define TelemetryBatch_interval_msec_tag         3
+#define TelemetryBatch_num_channels_tag          4
+#define TelemetryBatch_deltas_tag                5
+
+/* Struct field encoding specification for nanopb */
+#define TelemetryBatch_FIELDLIST(X, a) \
+X(a, STATIC,   SINGULAR, UINT32,   seq,               1) \
+X(a, STATIC,   SINGULAR, UINT32,   first_age_msec,    2) \
+X(a, STATIC,   SINGULAR, UINT32,   interval_msec,     3) \
+X(a, STATIC,   SINGULAR, UINT32,   num_channels,      4) \
+X(a, STATIC,   REPEATED, SINT32,   deltas,            5)
+#define TelemetryBatch_CALLBACK NULL
+#define TelemetryBatch_DEFAULT NULL
+
+extern const pb_msgdesc_t TelemetryBatch_msg;
+
+/* Defines for backwards compatibility with code written before nanopb-0.4.0 */
+#define TelemetryBatch_fields &TelemetryBatch_msg
+
+/* Maximum encoded size of messages (where known) */
+#define TelemetryBatch_size                      527
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -18,19 +18,31 @@ size_t pb_encode_to_bytes(uint8_t *destbuf, size_t destbufsize, const pb_msgdesc
 
     pb_ostream_t stream = pb_ostream_from_buffer(destbuf, destbufsize);
     if (!pb_encode(&stream, fields, src_struct)) {
-        DEBUG_MSG("Error: can't encode protobuf %s\n", PB_GET_ERROR(&stream));
+        LOG_ERROR(MESH, "Error: can't encode protobuf %s\n", PB_GET_ERROR(&stream));
         assert(0); // FIXME - panic
     } else {
         return stream.bytes_written;
     }
 }
 
+size_t pb_encode_field_to_bytes(uint8_t *destbuf, size_t destbufsize, uint32_t tag, const pb_msgdesc_t *fields,
+                                const void *src_struct)
+{
+    // The same bytes pb_encode writes for an outer struct with only this oneof variant set
+    pb_ostream_t stream = pb_ostream_from_buffer(destbuf, destbufsize);
+    if (!pb_encode_tag(&stream, PB_WT_STRING, tag) || !pb_encode_submessage(&stream, fields, src_struct)) {
+        LOG_ERROR(MESH, "Error: can't encode protobuf %s\n", PB_GET_ERROR(&stream));
+        assert(0); // FIXME - panic
+    }
+    return stream.bytes_written;
+}
+
 /// helper function for decoding a record as a protobuf, we will return false if the decoding failed
 bool pb_decode_from_bytes(const uint8_t *srcbuf, size_t srcbufsize, const pb_msgdesc_t *fields, void *dest_struct)
 {
     pb_istream_t stream = pb_istream_from_buffer(srcbuf, srcbufsize);
     if (!pb_decode(&stream, fields, dest_struct)) {
-        DEBUG_MSG("Error: can't decode protobuf %s, pb_msgdesc 0x%p\n", PB_GET_ERROR(&stream), fields);
+        LOG_ERROR(MESH, "Error: can't decode protobuf %s, pb_msgdesc 0x%p\n", PB_GET_ERROR(&stream), fields);
         return false;
     } else {
         return true;
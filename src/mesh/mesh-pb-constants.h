@@ -2,24 +2,38 @@
 
 #include "mesh/generated/mesh.pb.h"
 #include "mesh/generated/deviceonly.pb.h"
+#include "mesh/MeshProfile.h"
 
 // this file defines constants which come from mesh.options
 
 // Tricky macro to let you find the sizeof a type member
 #define member_size(type, member) sizeof(((type *)0)->member)
 
-/// max number of packets which can be waiting for delivery to android - note, this value comes from mesh.options protobuf
+/// max number of packets which can be waiting for delivery to android (see MeshProfile)
 // FIXME - max_count is actually 32 but we save/load this as one long string of preencoded MeshPacket bytes - not a big array in RAM
 // #define MAX_RX_TOPHONE (member_size(DeviceState, receive_queue) / member_size(DeviceState, receive_queue[0]))
-#define MAX_RX_TOPHONE 32
+#ifndef MAX_RX_TOPHONE
+#define MAX_RX_TOPHONE (meshProfile.rxToPhone)
+#endif
 
-/// max number of nodes allowed in the mesh
-#define MAX_NUM_NODES (member_size(DeviceState, node_db) / member_size(DeviceState, node_db[0]))
+/// The most nodes our protobufs have room for - note, this value comes from mesh.options protobuf
+#define PB_MAX_NUM_NODES (member_size(DeviceState, node_db) / member_size(DeviceState, node_db[0]))
+
+/// max number of nodes allowed in the mesh (see MeshProfile)
+#ifndef MAX_NUM_NODES
+#define MAX_NUM_NODES (meshProfile.maxNodes < PB_MAX_NUM_NODES ? meshProfile.maxNodes : PB_MAX_NUM_NODES)
+#endif
 
 /// helper function for encoding a record as a protobuf, any failures to encode are fatal and we will panic
 /// returns the encoded packet size
 size_t pb_encode_to_bytes(uint8_t *destbuf, size_t destbufsize, const pb_msgdesc_t *fields, const void *src_struct);
 
+/// helper function for encoding a record as field tag of an outer message which has no other fields set (i.e. one variant of
+/// FromRadio), straight from the record rather than a copy of it in the outer struct.  Failures are fatal like
+/// pb_encode_to_bytes, returns the encoded size
+size_t pb_encode_field_to_bytes(uint8_t *destbuf, size_t destbufsize, uint32_t tag, const pb_msgdesc_t *fields,
+                                const void *src_struct);
+
 /// helper function for decoding a record as a protobuf, we will return false if the decoding failed
 bool pb_decode_from_bytes(const uint8_t *srcbuf, size_t srcbufsize, const pb_msgdesc_t *fields, void *dest_struct);
 
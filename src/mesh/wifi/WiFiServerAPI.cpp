@@ -2,17 +2,24 @@
 #include "PowerFSM.h"
 #include "configuration.h"
 #include <Arduino.h>
+#include <assert.h>
+#include <lwip/sockets.h>
+
+/// Our wake task rechecks which sockets it should watch at least this often
+#define WAKE_TASK_RESCAN_MSEC 1000
+
+WiFiServerPort *WiFiServerPort::instance;
+
+size_t WiFiServerAPI::numConnected;
 
 WiFiServerAPI::WiFiServerAPI(WiFiClient &_client) : StreamAPI(&client), client(_client)
 {
-    DEBUG_MSG("Incoming wifi connection\n");
+    LOG_DEBUG(HTTP, "Incoming wifi connection\n");
 }
 
 WiFiServerAPI::~WiFiServerAPI()
 {
-    client.stop();
-
-    // FIXME - delete this if the client dropps the connection!
+    close(); // Our base class destructor would call close too, but by then it is too late for our onConnectionChanged
 }
 
 /// Hookable to find out when connection changes
@@ -22,9 +29,11 @@ void WiFiServerAPI::onConnectionChanged(bool connected)
     // block sleep
 
     if (connected) { // To prevent user confusion, turn off bluetooth while using the serial port api
-        powerFSM.trigger(EVENT_SERIAL_CONNECTED);
+        if (numConnected++ == 0)
+            powerFSM.trigger(EVENT_SERIAL_CONNECTED);
     } else {
-        powerFSM.trigger(EVENT_SERIAL_DISCONNECTED);
+        if (--numConnected == 0)
+            powerFSM.trigger(EVENT_SERIAL_DISCONNECTED);
     }
 }
 
@@ -34,6 +43,20 @@ void WiFiServerAPI::close() {
     StreamAPI::close();
 }
 
+void WiFiServerAPI::onNowHasData(uint32_t fromRadioNum)
+{
+    StreamAPI::onNowHasData(fromRadioNum);
+
+    if (WiFiServerPort::instance)
+        WiFiServerPort::instance->wake();
+}
+
+size_t WiFiServerAPI::writeNonBlocking(const uint8_t *buf, size_t len)
+{
+    int sent = send(client.fd(), buf, len, MSG_DONTWAIT);
+    return sent > 0 ? sent : 0; // If the socket is full (or broken) we try again later, loop() notices if it went away
+}
+
 bool WiFiServerAPI::loop()
 {
     if (client.connected()) {
@@ -46,39 +69,106 @@ bool WiFiServerAPI::loop()
 
 #define MESHTASTIC_PORTNUM 4403
 
-WiFiServerPort::WiFiServerPort() : WiFiServer(MESHTASTIC_PORTNUM), concurrency::OSThread("ApiServer") {}
+WiFiServerPort::WiFiServerPort() : WiFiServer(MESHTASTIC_PORTNUM), concurrency::OSThread("ApiServer")
+{
+    for (size_t i = 0; i < MAX_TCP_API_CLIENTS; i++)
+        watchFds[i] = -1;
+}
 
 void WiFiServerPort::init()
 {
-    DEBUG_MSG("API server sistening on TCP port %d\n", MESHTASTIC_PORTNUM);
+    LOG_DEBUG(HTTP, "API server sistening on TCP port %d\n", MESHTASTIC_PORTNUM);
     begin();
+
+    assert(!instance); // We only support one of these
+    instance = this;
+    xTaskCreate(wakeTask, "apiWake", 2048, this, 1, NULL);
+}
+
+void WiFiServerPort::wake()
+{
+    setInterval(0);
+    concurrency::mainDelay.interrupt();
+}
+
+void WiFiServerPort::wakeTask(void *param)
+{
+    WiFiServerPort *port = (WiFiServerPort *)param;
+
+    while (true) {
+        fd_set readFds, writeFds;
+        FD_ZERO(&readFds);
+        FD_ZERO(&writeFds);
+        int maxFd = -1;
+
+        port->watchLock.lock();
+        for (size_t i = 0; i < MAX_TCP_API_CLIENTS; i++) {
+            int fd = port->watchFds[i];
+            if (fd >= 0) {
+                FD_SET(fd, &readFds);
+                if (port->watchWritable[i])
+                    FD_SET(fd, &writeFds);
+                maxFd = max(maxFd, fd);
+            }
+        }
+        port->watchLock.unlock();
+
+        if (maxFd < 0) {
+            port->serviced.take(WAKE_TASK_RESCAN_MSEC); // No clients, wait for our thread to (maybe) accept some
+            continue;
+        }
+
+        // Time out now and then so we pick up new connections (and don't wait forever on a socket which was just closed)
+        struct timeval timeout = {0, WAKE_TASK_RESCAN_MSEC * 1000};
+        if (select(maxFd + 1, &readFds, &writeFds, NULL, &timeout) != 0) {
+            // Something is ready (or a socket was closed under us), either way our thread needs to look
+            port->wake();
+            port->serviced.take(WAKE_TASK_RESCAN_MSEC);
+        }
+    }
 }
 
 int32_t WiFiServerPort::runOnce()
 {
     auto client = available();
     if (client) {
-        // Close any previous connection (see FIXME in header file)
-        if (openAPI) {
-            DEBUG_MSG("Force closing previous TCP connection\n");
-            delete openAPI;
-        }
+        size_t slot = 0;
+        while (slot < MAX_TCP_API_CLIENTS && openAPIs[slot])
+            slot++;
 
-        openAPI = new WiFiServerAPI(client);
+        if (slot < MAX_TCP_API_CLIENTS)
+            openAPIs[slot] = new WiFiServerAPI(client);
+        else {
+            LOG_DEBUG(HTTP, "Already have %d TCP API clients, refusing new connection\n", MAX_TCP_API_CLIENTS);
+            client.stop();
+        }
     }
 
-    if (openAPI) {
+    // Give each client one turn, starting with a different one each time
+    for (size_t i = 0; i < MAX_TCP_API_CLIENTS; i++) {
+        size_t slot = (nextToService + i) % MAX_TCP_API_CLIENTS;
+        WiFiServerAPI *api = openAPIs[slot];
+        if (!api)
+            continue;
+
         // Allow idle processing so the API can read from its incoming stream
-        if(!openAPI->loop()) {
-            // If our API link was up, shut it down
-
-            DEBUG_MSG("Client dropped connection, closing API client\n");
-            // Note: we can't call delete here because this object includes other state
-            // besides the stream API.  Instead kill it later when we start a new instance
-            delete openAPI;
-            openAPI = NULL;
+        if (!api->loop()) {
+            LOG_DEBUG(HTTP, "Client dropped connection, closing API client\n");
+            delete api;
+            openAPIs[slot] = NULL;
         }
-        return 0; // run fast while our API server is running
-    } else
-        return 100; // only check occasionally for incoming connections
-}
\ No newline at end of file
+    }
+    nextToService = (nextToService + 1) % MAX_TCP_API_CLIENTS;
+
+    // Tell our wake task what to wait for
+    watchLock.lock();
+    for (size_t i = 0; i < MAX_TCP_API_CLIENTS; i++) {
+        watchFds[i] = openAPIs[i] ? openAPIs[i]->getFd() : -1;
+        watchWritable[i] = openAPIs[i] && openAPIs[i]->hasTxQueued();
+    }
+    watchLock.unlock();
+    serviced.give();
+
+    // Our wake task runs us as soon as a client has something for us, so we only need to poll for new connections
+    return TCP_API_ACCEPT_POLL_MSEC;
+}
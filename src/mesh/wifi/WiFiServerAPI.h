@@ -1,9 +1,19 @@
 #pragma once
 
 #include "StreamAPI.h"
+#include "concurrency/BinarySemaphoreFreeRTOS.h"
+#include "concurrency/Lock.h"
 #include "concurrency/OSThread.h"
 #include <WiFi.h>
 
+/// How many TCP API clients can be connected at once (each gets every packet its filter wants, see MeshService::encodeForPhone)
+#ifndef MAX_TCP_API_CLIENTS
+#define MAX_TCP_API_CLIENTS 3
+#endif
+
+/// How often we check for new connections (WiFiServer gives us no way to be woken for them)
+#define TCP_API_ACCEPT_POLL_MSEC 100
+
 /**
  * Provides both debug printing and, if the client starts sending protobufs to us, switches to send/receive protobufs
  * (and starts dropping debug printing - FIXME, eventually those prints should be encapsulated in protobufs).
@@ -13,6 +23,9 @@ class WiFiServerAPI : public StreamAPI
   private:
     WiFiClient client;
 
+    /// How many of our instances are currently connected, so we only tell the PowerFSM about the first and last
+    static size_t numConnected;
+
   public:
     WiFiServerAPI(WiFiClient &_client);
 
@@ -24,9 +37,21 @@ class WiFiServerAPI : public StreamAPI
     /// override close to also shutdown the TCP link
     virtual void close();
 
+    /// Our socket, so WiFiServerPort can wait for it to become readable/writable
+    int getFd() { return client.fd(); }
+
+    /// How many TCP API clients are connected
+    static size_t getNumConnected() { return numConnected; }
+
   protected:
     /// Hookable to find out when connection changes
     virtual void onConnectionChanged(bool connected);
+
+    /// We have new packets for our client, make sure we run soon
+    virtual void onNowHasData(uint32_t fromRadioNum);
+
+    /// WiFiClient can't tell us how much room it has (and its write() retries until everything is sent), so we use its socket
+    virtual size_t writeNonBlocking(const uint8_t *buf, size_t len);
 };
 
 /**
@@ -34,12 +59,19 @@ class WiFiServerAPI : public StreamAPI
  */
 class WiFiServerPort : public WiFiServer, private concurrency::OSThread
 {
-    /** The currently open port
-     *
-     * FIXME: We currently only allow one open TCP connection at a time, because we depend on the loop() call in this class to
-     * delegate to the worker.  Once coroutines are implemented we can relax this restriction.
-     */
-    WiFiServerAPI *openAPI = NULL;
+    /// Our currently open connections, NULL for unused slots
+    WiFiServerAPI *openAPIs[MAX_TCP_API_CLIENTS] = {};
+
+    /// Which slot we service first on our next run, we rotate this so no client always goes ahead of the others
+    size_t nextToService = 0;
+
+    /// The sockets our wake task should watch, updated at the end of each run (-1 for unused slots)
+    int watchFds[MAX_TCP_API_CLIENTS];
+    bool watchWritable[MAX_TCP_API_CLIENTS]; // Only set while that client has output queued, or we'd wake constantly
+    concurrency::Lock watchLock;
+
+    /// Given after each of our runs, so our wake task doesn't keep waking us for bytes we haven't had a chance to read yet
+    concurrency::BinarySemaphoreFreeRTOS serviced;
 
   public:
     WiFiServerPort();
@@ -47,4 +79,13 @@ class WiFiServerPort : public WiFiServer, private concurrency::OSThread
     void init();
 
     int32_t runOnce();
+
+    /// Run as soon as possible, safe to call from other tasks
+    void wake();
+
+    static WiFiServerPort *instance;
+
+  private:
+    /// Waits (in its own FreeRTOS task) for any of our sockets to be ready, then wakes our thread
+    static void wakeTask(void *param);
 };
@@ -0,0 +1,136 @@
+#include "JsonWriter.h"
+#include <assert.h>
+#include <stdarg.h>
+
+void JsonWriter::beginObject(const char *key)
+{
+    beginMember(key);
+    write('{');
+    assert(depth < JSON_WRITER_MAX_DEPTH);
+    depth++;
+    hasMembers &= ~(1UL << depth);
+}
+
+void JsonWriter::beginArray(const char *key)
+{
+    beginMember(key);
+    write('[');
+    assert(depth < JSON_WRITER_MAX_DEPTH);
+    depth++;
+    hasMembers &= ~(1UL << depth);
+}
+
+void JsonWriter::close(char c)
+{
+    assert(depth);
+    depth--;
+    write(c);
+}
+
+void JsonWriter::beginMember(const char *key)
+{
+    if (hasMembers & (1UL << depth))
+        write(',');
+    hasMembers |= 1UL << depth;
+
+    if (key) {
+        writeString(key);
+        write(':');
+    }
+}
+
+void JsonWriter::value(const char *key, const char *s)
+{
+    beginMember(key);
+    writeString(s);
+}
+
+void JsonWriter::value(const char *key, long v)
+{
+    beginMember(key);
+    writef("%ld", v);
+}
+
+void JsonWriter::value(const char *key, unsigned long v)
+{
+    beginMember(key);
+    writef("%lu", v);
+}
+
+void JsonWriter::value(const char *key, unsigned long long v)
+{
+    beginMember(key);
+    writef("%llu", v);
+}
+
+void JsonWriter::value(const char *key, double v, uint8_t decimals)
+{
+    beginMember(key);
+    if (isnan(v) || isinf(v))
+        write("null"); // JSON has no way to say these
+    else
+        writef("%.*f", decimals, v);
+}
+
+void JsonWriter::value(const char *key, bool v)
+{
+    beginMember(key);
+    write(v ? "true" : "false");
+}
+
+void JsonWriter::writeString(const char *s)
+{
+    write('"');
+    for (; *s; s++) {
+        char c = *s;
+        if (c == '"' || c == '\\') {
+            write('\\');
+            write(c);
+        } else if ((uint8_t)c < 0x20)
+            writef("\\u%04x", c);
+        else
+            write(c);
+    }
+    write('"');
+}
+
+void JsonWriter::write(const char *s, size_t n)
+{
+    while (n) {
+        if (len == bufSize)
+            end();
+
+        size_t chunk = min(n, bufSize - len);
+        memcpy(buf + len, s, chunk);
+        len += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+void JsonWriter::write(char c)
+{
+    if (len == bufSize)
+        end();
+    buf[len++] = c;
+}
+
+void JsonWriter::writef(const char *format, ...)
+{
+    char tmp[32]; // Plenty for any number
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(tmp, sizeof(tmp), format, args);
+    va_end(args);
+
+    if (n > 0)
+        write(tmp, min((size_t)n, sizeof(tmp) - 1));
+}
+
+void JsonWriter::end()
+{
+    if (len) {
+        out.write((const uint8_t *)buf, len);
+        len = 0;
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+
+/// How deeply objects and arrays can nest
+#define JSON_WRITER_MAX_DEPTH 16
+
+/**
+ * Writes JSON to a Print (i.e. an HTTPResponse) in large chunks.
+ *
+ * Every print on an HTTPS response is encrypted and sent as its own TLS record, so building a report from lots of small prints
+ * is very slow.  We buffer instead, and also take care of the commas and string escaping.
+ *
+ * The caller provides our buffer (a couple of KB is enough for most of our reports to go out in a handful of writes).
+ *
+ * Calls which take a key are for members of objects, the ones without are for elements of arrays (or the top level value).
+ * Call end() (or let us be destroyed) to write out whatever is left.
+ */
+class JsonWriter
+{
+    Print &out;
+    char *buf;
+    size_t bufSize, len = 0;
+
+    /// One bit per level of nesting, set once that object/array has its first member (so the next one needs a comma)
+    uint32_t hasMembers = 0;
+    uint8_t depth = 0;
+
+  public:
+    JsonWriter(Print &_out, void *_buf, size_t _bufSize) : out(_out), buf((char *)_buf), bufSize(_bufSize) {}
+
+    ~JsonWriter() { end(); }
+
+    void beginObject(const char *key = NULL);
+    void endObject() { close('}'); }
+
+    void beginArray(const char *key = NULL);
+    void endArray() { close(']'); }
+
+    void value(const char *key, const char *s);
+    void value(const char *key, const String &s) { value(key, s.c_str()); }
+    // Overloaded on the basic integer types, because which of them int32_t and friends are differs between our platforms
+    void value(const char *key, long v);
+    void value(const char *key, unsigned long v);
+    void value(const char *key, int v) { value(key, (long)v); }
+    void value(const char *key, unsigned v) { value(key, (unsigned long)v); }
+    void value(const char *key, unsigned long long v);
+    void value(const char *key, double v, uint8_t decimals = 2);
+    void value(const char *key, bool v);
+
+    /// An array element
+    template <typename T> void element(T v) { value(NULL, v); }
+
+    /// Write out everything we have buffered
+    void end();
+
+  private:
+    /// Start a new member: its comma, and its key if it has one
+    void beginMember(const char *key);
+
+    void close(char c);
+
+    void writeString(const char *s);
+
+    void write(const char *s, size_t n);
+    void write(const char *s) { write(s, strlen(s)); }
+    void write(char c);
+
+    /// printf into our buffer
+    void writef(const char *format, ...);
+};
@@ -0,0 +1,55 @@
+#include "meshwifi/WebBundle.h"
+#include "configuration.h"
+#include <string.h>
+
+WebBundle webBundle;
+
+bool WebBundle::begin()
+{
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)WEB_BUNDLE_PARTITION_SUBTYPE, WEB_BUNDLE_PARTITION_NAME);
+    if (!part) {
+        LOG_INFO(HTTP, "No web bundle partition, serving static files from SPIFFS\n");
+        return false;
+    }
+
+    const void *ptr;
+    esp_err_t err = esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &ptr, &handle);
+    if (err != ESP_OK) {
+        LOG_ERROR(HTTP, "Can't map web bundle partition, error %d\n", err);
+        return false;
+    }
+
+    // Check the whole index (and where it points) is inside the partition, an erased or partly written one fails here
+    const WebBundleHeader *h = (const WebBundleHeader *)ptr;
+    bool valid = h->magic == WEB_BUNDLE_MAGIC && h->version == WEB_BUNDLE_VERSION &&
+                 sizeof(*h) + h->numEntries * sizeof(WebBundleEntry) <= part->size;
+    const WebBundleEntry *e = (const WebBundleEntry *)(h + 1);
+    for (uint16_t i = 0; valid && i < h->numEntries; i++)
+        valid = e[i].offset <= part->size && e[i].length <= part->size - e[i].offset &&
+                memchr(e[i].path, 0, sizeof(e[i].path)) && memchr(e[i].contentType, 0, sizeof(e[i].contentType));
+    if (!valid) {
+        LOG_WARN(HTTP, "Web bundle partition doesn't hold a valid bundle, serving static files from SPIFFS\n");
+        spi_flash_munmap(handle);
+        return false;
+    }
+
+    base = (const uint8_t *)ptr;
+    entries = e;
+    numEntries = h->numEntries;
+    LOG_INFO(HTTP, "Serving %u static files from our web bundle\n", numEntries);
+    return true;
+}
+
+const WebBundleEntry *WebBundle::find(const char *path) const
+{
+    for (uint16_t i = 0; i < numEntries; i++)
+        if (strcmp(entries[i].path, path) == 0)
+            return &entries[i];
+    return NULL;
+}
+
+void WebBundle::formatETag(const WebBundleEntry &e, char *buf, size_t bufLen)
+{
+    snprintf(buf, bufLen, "\"%08x\"", (unsigned)e.crc);
+}
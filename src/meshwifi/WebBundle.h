@@ -0,0 +1,63 @@
+#pragma once
+
+#include <esp_partition.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// The data partition subtype (and name) bin/pack-web-bundle.py images are flashed to, see partition-table.csv
+#define WEB_BUNDLE_PARTITION_SUBTYPE 0x40
+#define WEB_BUNDLE_PARTITION_NAME "webui"
+
+#define WEB_BUNDLE_MAGIC 0x4245574d // "MWEB"
+#define WEB_BUNDLE_VERSION 1
+
+/// The entry's data is gzipped, send it with Content-Encoding: gzip
+#define WEB_BUNDLE_FLAG_GZIP 0x01
+
+/// The start of a bundle, followed by numEntries WebBundleEntries.  All fields are little endian.
+typedef struct __attribute__((packed)) {
+    uint32_t magic; // WEB_BUNDLE_MAGIC
+    uint16_t version;
+    uint16_t numEntries;
+} WebBundleHeader;
+
+typedef struct __attribute__((packed)) {
+    char path[48]; // As requested, i.e. /static/index.html (never ending in .gz), NUL terminated
+    uint32_t offset; // Of the data, from the start of the bundle
+    uint32_t length;
+    uint32_t crc; // CRC32 of the data, our ETag
+    uint8_t flags;
+    char contentType[35]; // NUL terminated
+} WebBundleEntry;
+
+static_assert(sizeof(WebBundleEntry) == 96, "Must match bin/pack-web-bundle.py");
+
+/**
+ * Our static web assets, packed at build time by bin/pack-web-bundle.py (already gzipped) into their own read only flash
+ * partition.
+ *
+ * We map the whole partition into our address space once at boot, so serving a file is a scan of the index and a write straight
+ * out of flash, with no filesystem calls or copies.  Files which aren't in the bundle (i.e. ones users upload to SPIFFS) are
+ * still served from SPIFFS.
+ */
+class WebBundle
+{
+    const uint8_t *base = NULL;
+    spi_flash_mmap_handle_t handle;
+    const WebBundleEntry *entries = NULL;
+    uint16_t numEntries = 0;
+
+  public:
+    /// Map our partition, @return false if there isn't one (or it doesn't hold a valid bundle)
+    bool begin();
+
+    /// @return the entry for path, or NULL
+    const WebBundleEntry *find(const char *path) const;
+
+    const uint8_t *getData(const WebBundleEntry &e) const { return base + e.offset; }
+
+    /// The ETag for an entry, a quoted hex CRC like we use for SPIFFS files (buf needs 11 bytes)
+    static void formatETag(const WebBundleEntry &e, char *buf, size_t bufLen);
+};
+
+extern WebBundle webBundle;
@@ -1,17 +1,39 @@
 #include "meshwifi/meshhttp.h"
+#include "BootTimer.h"
+#include "LargeAlloc.h"
+#include "MemoryMonitor.h"
+#include "MeshService.h"
 #include "NodeDB.h"
+#include "NoiseMonitor.h"
+#include "PacketTrace.h"
 #include "PowerFSM.h"
+#include "PowerStats.h"
+#include "RadioLibInterface.h"
+#include "Router.h"
+#include "SPILock.h"
 #include "airtime.h"
+#include "concurrency/MainThread.h"
+#include "concurrency/OSThread.h"
+#include "concurrency/Periodic.h"
 #include "configuration.h"
+#include "esp32/CpuGovernor.h"
+#include "esp32/RadioCoexistence.h"
+#include "esp32/UpdateWriter.h"
 #include "esp_task_wdt.h"
 #include "main.h"
 #include "meshhttpStatic.h"
+#include "meshwifi/JsonWriter.h"
+#include "meshwifi/WebBundle.h"
 #include "meshwifi/meshwifi.h"
+#include "plugins/LinkTestPlugin.h"
+#include "plugins/LoadGenPlugin.h"
 #include "sleep.h"
 #include <HTTPBodyParser.hpp>
 #include <HTTPMultipartBodyParser.hpp>
 #include <HTTPURLEncodedBodyParser.hpp>
 #include <SPIFFS.h>
+#include <Update.h>
+#include <CRC32.h>
 #include <WebServer.h>
 #include <WiFi.h>
 
@@ -38,9 +60,11 @@ Preferences prefs;
 #include <HTTPSServer.hpp>
 #include <HTTPServer.hpp>
 #include <SSLCert.hpp>
+#include <WebsocketHandler.hpp>
 
 // The HTTPS Server comes in a separate namespace. For easier use, include it here.
 using namespace httpsserver;
+using concurrency::runOnMainThread;
 
 SSLCert *cert;
 HTTPSServer *secureServer;
@@ -49,6 +73,121 @@ HTTPServer *insecureServer;
 // Our API to handle messages to and from the radio.
 HttpAPI webAPI;
 
+/// The web server runs in its own task on HOST_CORE (see configuration.h)
+#define WEB_SERVER_TASK_STACK 8192
+#define WEB_SERVER_TASK_PRIORITY 1
+
+/// How often our task polls the servers for new requests
+#define WEB_SERVER_POLL_MSEC 5
+
+/// We ask browsers to keep idle connections to us open this long, so their API polls reuse them rather than paying for a new TLS
+/// handshake each time.  Must be less than the server library's HTTPS_CONNECTION_TIMEOUT, after which it drops idle connections.
+#define HTTP_KEEPALIVE_SECS 15
+
+/// How many HTTPS clients we remember, to tell which requests came on a kept alive connection
+#define HTTPS_CLIENT_TABLE_SIZE 4
+
+/// We serve the results of our last WiFi scan for this long before starting a fresh one
+#define WIFI_SCAN_MAX_AGE_MSEC (30 * 1000)
+
+/// The most networks we remember from a scan
+#define WIFI_SCAN_MAX_NETWORKS 20
+
+/// How many clients can use our websocket API at once
+#define MAX_STREAM_API_CLIENTS 2
+
+/// The most FromRadio messages we push to each websocket client per loop, so a big config download doesn't stall the mesh
+#define STREAM_API_MAX_PUSH 8
+
+/// An OTA upload keeps our CPU at full speed until this long after the last chunk we received
+#define OTA_BOOST_MSEC (5 * 1000)
+
+/// We give up on an OTA upload if we receive nothing for this long
+#define OTA_IDLE_TIMEOUT_MSEC (15 * 1000)
+
+/// After a successful OTA of our app we reboot into it this much later (so our reply gets out first)
+#define OTA_REBOOT_DELAY_MSEC 2000
+
+/**
+ * Our API over a websocket (/api/v1/stream), so clients don't need to poll /api/v1/fromradio.
+ *
+ * Each binary message from the client is a ToRadio, and we push each FromRadio to the client as its own binary message as soon
+ * as we have it (the websocket does our framing).
+ */
+class HttpStreamAPI : public PhoneAPI, public WebsocketHandler
+{
+    /// Is this one of our (limited number of) clients?  If not we hang up as soon as it talks to us
+    bool accepted = false;
+
+  public:
+    /// Our WebsocketNode calls this for each new connection
+    static WebsocketHandler *create();
+
+    virtual void onMessage(WebsocketInputStreambuf *input);
+
+    virtual void onClose();
+
+    /// Send our client whatever we have for it
+    void push();
+};
+
+static HttpStreamAPI *streamClients[MAX_STREAM_API_CLIENTS];
+
+WebsocketHandler *HttpStreamAPI::create()
+{
+    HttpStreamAPI *api = new HttpStreamAPI();
+
+    for (size_t i = 0; i < MAX_STREAM_API_CLIENTS; i++)
+        if (!streamClients[i]) {
+            LOG_DEBUG(HTTP, "New websocket API client\n");
+            streamClients[i] = api;
+            api->accepted = true;
+            runOnMainThread([api]() { api->init(); });
+            break;
+        }
+
+    return api;
+}
+
+void HttpStreamAPI::onMessage(WebsocketInputStreambuf *input)
+{
+    if (!accepted) {
+        LOG_DEBUG(HTTP, "Already have %d websocket API clients, hanging up\n", MAX_STREAM_API_CLIENTS);
+        close();
+        return;
+    }
+
+    static uint8_t buf[ToRadio_size]; // Safe because the web server only handles one connection at a time
+    size_t len = input->sgetn((char *)buf, sizeof(buf));
+    runOnMainThread([this, len]() { handleToRadio(buf, len); });
+}
+
+void HttpStreamAPI::onClose()
+{
+    // The web server deletes us after this returns (on its task), so stop watching MeshService now
+    runOnMainThread([this]() { close(); });
+
+    for (size_t i = 0; i < MAX_STREAM_API_CLIENTS; i++)
+        if (streamClients[i] == this) {
+            LOG_DEBUG(HTTP, "Websocket API client closed\n");
+            streamClients[i] = NULL;
+        }
+}
+
+void HttpStreamAPI::push()
+{
+    static uint8_t buf[FromRadio_size];
+    size_t len;
+
+    for (int i = 0; i < STREAM_API_MAX_PUSH && !closed(); i++) {
+        runOnMainThread([this, &len]() { len = available() ? getFromRadio(buf) : 0; });
+        if (!len)
+            break;
+
+        send(buf, len, SEND_TYPE_BINARY);
+    }
+}
+
 // Declare some handler functions for the various URLs on the server
 void handleAPIv1FromRadio(HTTPRequest *req, HTTPResponse *res);
 void handleAPIv1ToRadio(HTTPRequest *req, HTTPResponse *res);
@@ -67,47 +206,276 @@ void handleSpiffsBrowseStatic(HTTPRequest *req, HTTPResponse *res);
 void handleSpiffsDeleteStatic(HTTPRequest *req, HTTPResponse *res);
 void handleBlinkLED(HTTPRequest *req, HTTPResponse *res);
 void handleReport(HTTPRequest *req, HTTPResponse *res);
+void handleMetrics(HTTPRequest *req, HTTPResponse *res);
+void handleLinkTest(HTTPRequest *req, HTTPResponse *res);
+void handleLoadGen(HTTPRequest *req, HTTPResponse *res);
+void handleOtaUpload(HTTPRequest *req, HTTPResponse *res);
 
-void middlewareSpeedUp240(HTTPRequest *req, HTTPResponse *res, std::function<void()> next);
-void middlewareSpeedUp160(HTTPRequest *req, HTTPResponse *res, std::function<void()> next);
+void middlewareActivity(HTTPRequest *req, HTTPResponse *res, std::function<void()> next);
+void middlewareKeepAlive(HTTPRequest *req, HTTPResponse *res, std::function<void()> next);
 void middlewareSession(HTTPRequest *req, HTTPResponse *res, std::function<void()> next);
 
 bool isWebServerReady = 0;
 bool isCertReady = 0;
 
-uint32_t timeSpeedUp = 0;
+/// When we last served a request
+static uint32_t lastRequestMsec;
+static bool haveServedRequest;
+
+bool isWebClientActive(uint32_t windowMsec)
+{
+    return haveServedRequest && millis() - lastRequestMsec < windowMsec;
+}
+
+/**
+ * The HTTPS clients we served recently.  The server library doesn't tell us about connections, so we guess: a request from a
+ * client whose last request left its connection open, less than HTTP_KEEPALIVE_SECS ago, almost certainly reused it.
+ */
+struct HttpsClient {
+    uint32_t ip; // 0 for an unused entry
+    uint32_t lastMsec;
+    bool keptAlive; // Their last request left the connection open
+};
+
+static HttpsClient httpsClients[HTTPS_CLIENT_TABLE_SIZE];
+
+/// Requests to our HTTPS server, and how many of them reused a kept alive connection (so skipped a TLS handshake)
+static uint32_t numHttpsRequests, numHttpsReused;
 
 // We need to specify some content-type mapping, so the resources get delivered with the
-// right content type and are displayed correctly in the browser
-char contentTypes[][2][32] = {{".txt", "text/plain"},     {".html", "text/html"},
-                              {".js", "text/javascript"}, {".png", "image/png"},
-                              {".jpg", "image/jpg"},      {".gz", "application/gzip"},
-                              {".gif", "image/gif"},      {".json", "application/json"},
-                              {".css", "text/css"},       {".ico", "image/vnd.microsoft.icon"},
-                              {".svg", "image/svg+xml"},  {"", ""}};
-
-void handleWebResponse()
+// right content type and are displayed correctly in the browser.  Pointers to string literals, all const, so neither the
+// table nor the strings take any RAM.
+static const char *const contentTypes[][2] = {{".txt", "text/plain"},     {".html", "text/html"},
+                                              {".js", "text/javascript"}, {".png", "image/png"},
+                                              {".jpg", "image/jpg"},      {".gz", "application/gzip"},
+                                              {".gif", "image/gif"},      {".json", "application/json"},
+                                              {".css", "text/css"},       {".ico", "image/vnd.microsoft.icon"},
+                                              {".svg", "image/svg+xml"}};
+
+/// The content type for filename (from the first extension in contentTypes it contains), or NULL if we don't know it
+static const char *getContentType(const std::string &filename)
 {
-    if (isWifiAvailable() == 0) {
+    for (size_t i = 0; i < sizeof(contentTypes) / sizeof(contentTypes[0]); i++)
+        if (filename.rfind(contentTypes[i][0]) != std::string::npos)
+            return contentTypes[i][1];
+    return NULL;
+}
+
+/// How many files we remember metadata for (the web UI only has a handful)
+#define STATIC_CACHE_SIZE 16
+
+/// We read and send static files in chunks this big
+#define STATIC_CHUNK_SIZE 2048
+
+/// Browsers can use their cached copy of a static file this long before checking (with If-None-Match) that it is unchanged
+#define STATIC_MAX_AGE_SECS 3600
+
+/// What we know about a file we serve from /static, so each request doesn't need several SPIFFS lookups
+struct StaticFileInfo {
+    std::string filename; // As requested (without any .gz), empty for unused entries
+    bool exists;
+    bool gzipped; // We actually send filename.gz
+    std::string etag;
+};
+
+static StaticFileInfo staticCache[STATIC_CACHE_SIZE];
+static size_t nextStaticCache; // When full we replace entries round robin
+
+// Safe because the web server only handles one request at a time (allocated by initWebServer, in PSRAM if we have it)
+static uint8_t *staticChunk;
+
+/// Forget everything we know about our static files, call whenever we change SPIFFS
+static void clearStaticCache()
+{
+    for (size_t i = 0; i < STATIC_CACHE_SIZE; i++)
+        staticCache[i].filename.clear();
+}
+
+/// Find (or fill in) our cached info for a static file
+static const StaticFileInfo &getStaticFileInfo(const std::string &filename)
+{
+    for (size_t i = 0; i < STATIC_CACHE_SIZE; i++)
+        if (staticCache[i].filename == filename)
+            return staticCache[i];
+
+    StaticFileInfo &info = staticCache[nextStaticCache];
+    nextStaticCache = (nextStaticCache + 1) % STATIC_CACHE_SIZE;
+
+    info.filename = filename;
+    info.gzipped = !SPIFFS.exists(filename.c_str());
+    std::string path = info.gzipped ? filename + ".gz" : filename;
+    info.exists = !info.gzipped || SPIFFS.exists(path.c_str());
+    info.etag.clear();
+
+    if (info.exists) {
+        // SPIFFS has no modification times, so our ETag is a hash of the contents (only computed once per boot)
+        File file = SPIFFS.open(path.c_str());
+        CRC32 crc;
+        size_t length;
+        while ((length = file.read(staticChunk, STATIC_CHUNK_SIZE)) > 0)
+            crc.update(staticChunk, length);
+        file.close();
+
+        char etag[12];
+        snprintf(etag, sizeof(etag), "\"%08x\"", (unsigned)crc.finalize());
+        info.etag = etag;
+    }
+
+    return info;
+}
+
+/// Send a file from our web bundle (straight out of flash), with caching headers
+static void sendBundleFile(HTTPRequest *req, HTTPResponse *res, const WebBundleEntry &e)
+{
+    char etag[12];
+    WebBundle::formatETag(e, etag, sizeof(etag));
+    res->setHeader("ETag", etag);
+    res->setHeader("Cache-Control", "max-age=" + httpsserver::intToString(STATIC_MAX_AGE_SECS));
+
+    if (req->getHeader("If-None-Match") == etag) {
+        res->setStatusCode(304);
+        res->setStatusText("Not Modified");
         return;
     }
 
-    if (isWebServerReady) {
-        // We're going to handle the DNS responder here so it
-        // will be ignored by the NRF boards.
-        handleDNSResponse();
+    if (e.flags & WEB_BUNDLE_FLAG_GZIP)
+        res->setHeader("Content-Encoding", "gzip");
+    res->setHeader("Content-Length", httpsserver::intToString(e.length));
+    res->setHeader("Content-Type", e.contentType);
+    res->write(webBundle.getData(e), e.length);
+}
 
-        secureServer->loop();
-        insecureServer->loop();
+/**
+ * Send a file from our web bundle, or else SPIFFS (or its .gz variant), with caching headers
+ *
+ * @return false if there is no such file (and we didn't send anything)
+ */
+static bool sendStaticFile(HTTPRequest *req, HTTPResponse *res, const std::string &filename)
+{
+    const WebBundleEntry *e = webBundle.find(filename.c_str());
+    if (e) {
+        sendBundleFile(req, res, *e);
+        return true;
     }
 
-    /*
-        Slow down the CPU if we have not received a request within the last few
-        seconds.
-    */
-    if (millis() - timeSpeedUp >= (25 * 1000)) {
-        setCpuFrequencyMhz(80);
-        timeSpeedUp = millis();
+    const StaticFileInfo &info = getStaticFileInfo(filename);
+    if (!info.exists)
+        return false;
+
+    res->setHeader("ETag", info.etag);
+    res->setHeader("Cache-Control", "max-age=" + httpsserver::intToString(STATIC_MAX_AGE_SECS));
+
+    if (req->getHeader("If-None-Match") == info.etag) {
+        // The browser already has this version
+        res->setStatusCode(304);
+        res->setStatusText("Not Modified");
+        return true;
+    }
+
+    File file = SPIFFS.open(info.gzipped ? (filename + ".gz").c_str() : filename.c_str());
+    if (!file.available()) {
+        LOG_DEBUG(HTTP, "File not available - %s\n", filename.c_str());
+    }
+
+    if (info.gzipped)
+        res->setHeader("Content-Encoding", "gzip");
+    res->setHeader("Content-Length", httpsserver::intToString(file.size()));
+
+    // Content-Type is guessed using the definition of the contentTypes-table defined above
+    const char *contentType = getContentType(filename);
+    // Set a default content type if we don't know it
+    res->setHeader("Content-Type", contentType ? contentType : "application/octet-stream");
+
+    // Read the file from SPIFFS and write it straight to the HTTP response body
+    size_t length;
+    while ((length = file.read(staticChunk, STATIC_CHUNK_SIZE)) > 0)
+        res->write(staticChunk, length);
+
+    file.close();
+    return true;
+}
+
+/**
+ * The (encrypted) networks our last WiFi scan found.  A scan takes several seconds, so /json/scanNetworks serves these and
+ * starts a scan in the background when they get old, rather than making everyone wait.  Only our web server task touches these.
+ */
+struct WifiScanNetwork {
+    char ssid[33];
+    int8_t rssi;
+};
+
+static WifiScanNetwork wifiScanNetworks[WIFI_SCAN_MAX_NETWORKS];
+static uint8_t numWifiScanNetworks;
+static uint32_t wifiScanMsec; // When our results were taken
+static bool haveWifiScan, wifiScanRunning;
+
+/// Start a background scan, unless one is running or our results are still fresh
+static void startWifiScan()
+{
+    if (wifiScanRunning || (haveWifiScan && millis() - wifiScanMsec < WIFI_SCAN_MAX_AGE_MSEC))
+        return;
+
+    wifiScanRunning = WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+    if (!wifiScanRunning)
+        LOG_WARN(HTTP, "Couldn't start a WiFi scan\n");
+}
+
+/// Collect the results of our background scan once it finishes
+static void pollWifiScan()
+{
+    if (!wifiScanRunning)
+        return;
+
+    int n = WiFi.scanComplete();
+    if (n == WIFI_SCAN_RUNNING)
+        return;
+
+    wifiScanRunning = false;
+    if (n < 0) {
+        LOG_WARN(HTTP, "WiFi scan failed\n");
+        return;
+    }
+
+    numWifiScanNetworks = 0;
+    for (int i = 0; i < n && numWifiScanNetworks < WIFI_SCAN_MAX_NETWORKS; i++)
+        if (WiFi.encryptionType(i) != WIFI_AUTH_OPEN) {
+            WifiScanNetwork &net = wifiScanNetworks[numWifiScanNetworks++];
+            strncpy(net.ssid, WiFi.SSID(i).c_str(), sizeof(net.ssid) - 1);
+            net.ssid[sizeof(net.ssid) - 1] = '\0';
+            net.rssi = WiFi.RSSI(i);
+        }
+    WiFi.scanDelete(); // Free the driver's copy
+
+    wifiScanMsec = millis();
+    haveWifiScan = true;
+    LOG_DEBUG(HTTP, "WiFi scan found %d networks\n", n);
+}
+
+/**
+ * Runs our web servers, so slow clients (i.e. TLS handshakes) never delay mesh processing
+ */
+static void webServerTask(void *parameter)
+{
+    while (true) {
+        if (isWifiAvailable()) {
+            // We're going to handle the DNS responder here so it
+            // will be ignored by the NRF boards.
+            handleDNSResponse();
+
+            // While a BLE client syncs our config we leave new HTTPS clients waiting, their TLS handshakes hog the radio
+            if (!wifiShouldDefer())
+                secureServer->loop();
+            insecureServer->loop();
+
+            pollWifiScan();
+
+            // Push anything new to our websocket clients
+            for (size_t i = 0; i < MAX_STREAM_API_CLIENTS; i++)
+                if (streamClients[i])
+                    streamClients[i]->push();
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(WEB_SERVER_POLL_MSEC));
     }
 }
 
@@ -118,7 +486,7 @@ void taskCreateCert(void *parameter)
 
     // Delete the saved certs
     if (0) {
-        DEBUG_MSG("Deleting any saved SSL keys ...\n");
+        LOG_DEBUG(HTTP, "Deleting any saved SSL keys ...\n");
         // prefs.clear();
         prefs.remove("PK");
         prefs.remove("cert");
@@ -127,12 +495,12 @@ void taskCreateCert(void *parameter)
     size_t pkLen = prefs.getBytesLength("PK");
     size_t certLen = prefs.getBytesLength("cert");
 
-    DEBUG_MSG("Checking if we have a previously saved SSL Certificate.\n");
+    LOG_DEBUG(HTTP, "Checking if we have a previously saved SSL Certificate.\n");
 
     if (pkLen && certLen) {
-        DEBUG_MSG("Existing SSL Certificate found!\n");
+        LOG_DEBUG(HTTP, "Existing SSL Certificate found!\n");
     } else {
-        DEBUG_MSG("Creating the certificate. This may take a while. Please wait...\n");
+        LOG_DEBUG(HTTP, "Creating the certificate. This may take a while. Please wait...\n");
         yield();
         cert = new SSLCert();
         yield();
@@ -141,21 +509,21 @@ void taskCreateCert(void *parameter)
         yield();
 
         if (createCertResult != 0) {
-            DEBUG_MSG("Creating the certificate failed\n");
+            LOG_ERROR(HTTP, "Creating the certificate failed\n");
 
             // Serial.printf("Creating the certificate failed. Error Code = 0x%02X, check SSLCert.hpp for details",
             //              createCertResult);
             // while (true)
             //    delay(500);
         } else {
-            DEBUG_MSG("Creating the certificate was successful\n");
+            LOG_DEBUG(HTTP, "Creating the certificate was successful\n");
 
-            DEBUG_MSG("Created Private Key: %d Bytes\n", cert->getPKLength());
+            LOG_DEBUG(HTTP, "Created Private Key: %d Bytes\n", cert->getPKLength());
             // for (int i = 0; i < cert->getPKLength(); i++)
             //  Serial.print(cert->getPKData()[i], HEX);
             // Serial.println();
 
-            DEBUG_MSG("Created Certificate: %d Bytes\n", cert->getCertLength());
+            LOG_DEBUG(HTTP, "Created Certificate: %d Bytes\n", cert->getCertLength());
             // for (int i = 0; i < cert->getCertLength(); i++)
             //  Serial.print(cert->getCertData()[i], HEX);
             // Serial.println();
@@ -186,26 +554,29 @@ void createSSLCert()
                 16,             /* Priority of the task. */
                 NULL);          /* Task handle. */
 
-    DEBUG_MSG("Waiting for SSL Cert to be generated.\n");
+    LOG_DEBUG(HTTP, "Waiting for SSL Cert to be generated.\n");
     while (!isCertReady) {
-        DEBUG_MSG(".");
+        LOG_DEBUG(HTTP, ".");
         delay(1000);
         yield();
         esp_task_wdt_reset();
     }
-    DEBUG_MSG("SSL Cert Ready!\n");
+    LOG_DEBUG(HTTP, "SSL Cert Ready!\n");
 }
 
 void initWebServer()
 {
-    DEBUG_MSG("Initializing Web Server ...\n");
+    LOG_DEBUG(HTTP, "Initializing Web Server ...\n");
+
+    webBundle.begin();
+    staticChunk = (uint8_t *)largeAlloc(STATIC_CHUNK_SIZE);
 
     prefs.begin("MeshtasticHTTPS", false);
 
     size_t pkLen = prefs.getBytesLength("PK");
     size_t certLen = prefs.getBytesLength("cert");
 
-    DEBUG_MSG("Checking if we have a previously saved SSL Certificate.\n");
+    LOG_DEBUG(HTTP, "Checking if we have a previously saved SSL Certificate.\n");
 
     if (pkLen && certLen) {
 
@@ -217,18 +588,18 @@ void initWebServer()
 
         cert = new SSLCert(certBuffer, certLen, pkBuffer, pkLen);
 
-        DEBUG_MSG("Retrieved Private Key: %d Bytes\n", cert->getPKLength());
+        LOG_DEBUG(HTTP, "Retrieved Private Key: %d Bytes\n", cert->getPKLength());
         // DEBUG_MSG("Retrieved Private Key: " + String(cert->getPKLength()) + " Bytes");
         // for (int i = 0; i < cert->getPKLength(); i++)
         //  Serial.print(cert->getPKData()[i], HEX);
         // Serial.println();
 
-        DEBUG_MSG("Retrieved Certificate: %d Bytes\n", cert->getCertLength());
+        LOG_DEBUG(HTTP, "Retrieved Certificate: %d Bytes\n", cert->getCertLength());
         // for (int i = 0; i < cert->getCertLength(); i++)
         //  Serial.print(cert->getCertData()[i], HEX);
         // Serial.println();
     } else {
-        DEBUG_MSG("Web Server started without SSL keys! How did this happen?\n");
+        LOG_DEBUG(HTTP, "Web Server started without SSL keys! How did this happen?\n");
     }
 
     // We can now use the new certificate to setup our server as usual.
@@ -241,6 +612,7 @@ void initWebServer()
     ResourceNode *nodeAPIv1ToRadioOptions = new ResourceNode("/api/v1/toradio", "OPTIONS", &handleAPIv1ToRadio);
     ResourceNode *nodeAPIv1ToRadio = new ResourceNode("/api/v1/toradio", "PUT", &handleAPIv1ToRadio);
     ResourceNode *nodeAPIv1FromRadio = new ResourceNode("/api/v1/fromradio", "GET", &handleAPIv1FromRadio);
+    WebsocketNode *nodeAPIv1Stream = new WebsocketNode("/api/v1/stream", &HttpStreamAPI::create);
     ResourceNode *nodeHotspot = new ResourceNode("/hotspot-detect.html", "GET", &handleHotspot);
     ResourceNode *nodeFavicon = new ResourceNode("/favicon.ico", "GET", &handleFavicon);
     ResourceNode *nodeRoot = new ResourceNode("/", "GET", &handleRoot);
@@ -253,6 +625,12 @@ void initWebServer()
     ResourceNode *nodeJsonScanNetworks = new ResourceNode("/json/scanNetworks", "GET", &handleScanNetworks);
     ResourceNode *nodeJsonBlinkLED = new ResourceNode("/json/blink", "POST", &handleBlinkLED);
     ResourceNode *nodeJsonReport = new ResourceNode("/json/report", "GET", &handleReport);
+    ResourceNode *nodeMetrics = new ResourceNode("/metrics", "GET", &handleMetrics);
+    ResourceNode *nodeJsonLinkTest = new ResourceNode("/json/linktest", "GET", &handleLinkTest);
+    ResourceNode *nodeJsonLinkTestPOST = new ResourceNode("/json/linktest", "POST", &handleLinkTest);
+    ResourceNode *nodeJsonLoadGen = new ResourceNode("/json/loadgen", "GET", &handleLoadGen);
+    ResourceNode *nodeJsonLoadGenPOST = new ResourceNode("/json/loadgen", "POST", &handleLoadGen);
+    ResourceNode *nodeOta = new ResourceNode("/ota", "POST", &handleOtaUpload);
     ResourceNode *nodeJsonSpiffsBrowseStatic = new ResourceNode("/json/spiffs/browse/static/", "GET", &handleSpiffsBrowseStatic);
     ResourceNode *nodeJsonDelete = new ResourceNode("/json/spiffs/delete/static", "DELETE", &handleSpiffsDeleteStatic);
 
@@ -260,6 +638,7 @@ void initWebServer()
     secureServer->registerNode(nodeAPIv1ToRadioOptions);
     secureServer->registerNode(nodeAPIv1ToRadio);
     secureServer->registerNode(nodeAPIv1FromRadio);
+    secureServer->registerNode(nodeAPIv1Stream);
     secureServer->registerNode(nodeHotspot);
     secureServer->registerNode(nodeFavicon);
     secureServer->registerNode(nodeRoot);
@@ -273,14 +652,22 @@ void initWebServer()
     secureServer->registerNode(nodeJsonSpiffsBrowseStatic);
     secureServer->registerNode(nodeJsonDelete);
     secureServer->registerNode(nodeJsonReport);
+    secureServer->registerNode(nodeMetrics);
+    secureServer->registerNode(nodeJsonLinkTest);
+    secureServer->registerNode(nodeJsonLinkTestPOST);
+    secureServer->registerNode(nodeJsonLoadGen);
+    secureServer->registerNode(nodeJsonLoadGenPOST);
+    secureServer->registerNode(nodeOta);
     secureServer->setDefaultNode(node404);
 
-    secureServer->addMiddleware(&middlewareSpeedUp240);
+    secureServer->addMiddleware(&middlewareActivity);
+    secureServer->addMiddleware(&middlewareKeepAlive);
 
     // Insecure nodes
     insecureServer->registerNode(nodeAPIv1ToRadioOptions);
     insecureServer->registerNode(nodeAPIv1ToRadio);
     insecureServer->registerNode(nodeAPIv1FromRadio);
+    insecureServer->registerNode(nodeAPIv1Stream);
     insecureServer->registerNode(nodeHotspot);
     insecureServer->registerNode(nodeFavicon);
     insecureServer->registerNode(nodeRoot);
@@ -294,50 +681,82 @@ void initWebServer()
     insecureServer->registerNode(nodeJsonSpiffsBrowseStatic);
     insecureServer->registerNode(nodeJsonDelete);
     insecureServer->registerNode(nodeJsonReport);
+    insecureServer->registerNode(nodeMetrics);
+    insecureServer->registerNode(nodeJsonLinkTest);
+    insecureServer->registerNode(nodeJsonLinkTestPOST);
+    insecureServer->registerNode(nodeJsonLoadGen);
+    insecureServer->registerNode(nodeJsonLoadGenPOST);
+    insecureServer->registerNode(nodeOta);
     insecureServer->setDefaultNode(node404);
 
-    insecureServer->addMiddleware(&middlewareSpeedUp160);
+    insecureServer->addMiddleware(&middlewareActivity);
+    insecureServer->addMiddleware(&middlewareKeepAlive);
 
-    DEBUG_MSG("Starting Web Servers...\n");
+    LOG_DEBUG(HTTP, "Starting Web Servers...\n");
     secureServer->start();
     insecureServer->start();
     if (secureServer->isRunning() && insecureServer->isRunning()) {
-        DEBUG_MSG("HTTP and HTTPS Web Servers Ready! :-) \n");
+        LOG_DEBUG(HTTP, "HTTP and HTTPS Web Servers Ready! :-) \n");
         isWebServerReady = 1;
+
+        xTaskCreatePinnedToCore(webServerTask, "webServer", WEB_SERVER_TASK_STACK, NULL, WEB_SERVER_TASK_PRIORITY, NULL,
+                                HOST_CORE);
     } else {
-        DEBUG_MSG("HTTP and HTTPS Web Servers Failed! ;-( \n");
+        LOG_ERROR(HTTP, "HTTP and HTTPS Web Servers Failed! ;-( \n");
     }
 }
 
-void middlewareSpeedUp240(HTTPRequest *req, HTTPResponse *res, std::function<void()> next)
+void middlewareActivity(HTTPRequest *req, HTTPResponse *res, std::function<void()> next)
 {
-    // We want to print the response status, so we need to call next() first.
     next();
 
     // Phone (or other device) has contacted us over WiFi. Keep the radio turned on.
-    //   TODO: This should go into its own middleware layer separate from the speedup.
     powerFSM.trigger(EVENT_CONTACT_FROM_PHONE);
 
-    setCpuFrequencyMhz(240);
-    timeSpeedUp = millis();
+    // Our CpuGovernor keeps us fast enough while web clients are active
+    lastRequestMsec = millis();
+    haveServedRequest = true;
 }
 
-void middlewareSpeedUp160(HTTPRequest *req, HTTPResponse *res, std::function<void()> next)
+void middlewareKeepAlive(HTTPRequest *req, HTTPResponse *res, std::function<void()> next)
 {
-    // We want to print the response status, so we need to call next() first.
-    next();
+    // The server library keeps a connection open if the client asks, and the handler doesn't send Connection: close.  We tell
+    // the client how long it can count on that.
+    std::string connection = req->getHeader("Connection");
+    bool wantKeepAlive = strcasecmp(connection.c_str(), "keep-alive") == 0;
+    if (wantKeepAlive)
+        res->setHeader("Keep-Alive", "timeout=" + httpsserver::intToString(HTTP_KEEPALIVE_SECS));
+
+    if (!req->isSecure()) {
+        next();
+        return;
+    }
 
-    // Phone (or other device) has contacted us over WiFi. Keep the radio turned on.
-    //   TODO: This should go into its own middleware layer separate from the speedup.
-    powerFSM.trigger(EVENT_CONTACT_FROM_PHONE);
+    uint32_t ip = req->getClientIP();
+    uint32_t now = millis();
+    HttpsClient *client = NULL, *oldest = &httpsClients[0];
+    for (size_t i = 0; i < HTTPS_CLIENT_TABLE_SIZE; i++) {
+        HttpsClient &c = httpsClients[i];
+        if (c.ip == ip)
+            client = &c;
+        if (now - c.lastMsec > now - oldest->lastMsec || !c.ip)
+            oldest = &c;
+    }
+
+    numHttpsRequests++;
+    if (client && client->keptAlive && now - client->lastMsec < HTTP_KEEPALIVE_SECS * 1000)
+        numHttpsReused++;
+    else if (cpuGovernor)
+        cpuGovernor->boost(GOVERNOR_HANDSHAKE_MSEC); // Browsers open several connections at once, the rest are handshaking now
+
+    next();
 
-    // If the frequency is 240mhz, we have recently gotten a HTTPS request.
-    //   In that case, leave the frequency where it is and just update the
-    //   countdown timer (timeSpeedUp).
-    if (getCpuFrequencyMhz() != 240) {
-        setCpuFrequencyMhz(160);
+    if (!client) {
+        client = oldest;
+        client->ip = ip;
     }
-    timeSpeedUp = millis();
+    client->lastMsec = millis();
+    client->keptAlive = wantKeepAlive && strcasecmp(res->getHeader("Connection").c_str(), "close") != 0;
 }
 
 void handleStaticPost(HTTPRequest *req, HTTPResponse *res)
@@ -388,6 +807,7 @@ void handleStaticPost(HTTPRequest *req, HTTPResponse *res)
             // into a buffer. That allows handling arbitrarily-sized field contents. Here,
             // we use it and write the file contents directly to the SPIFFS:
             size_t fieldLength = 0;
+            clearStaticCache();
             File file = SPIFFS.open(filename.c_str(), "w");
             savedFile = true;
             while (!parser.endOfField()) {
@@ -419,47 +839,36 @@ void handleSpiffsBrowseStatic(HTTPRequest *req, HTTPResponse *res)
     File root = SPIFFS.open("/");
 
     if (root.isDirectory()) {
-        res->println("{");
-        res->println("\"data\": {");
+        JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+        json.beginObject();
+        json.beginObject("data");
 
         File file = root.openNextFile();
-        res->print("\"files\": [");
-        bool firstFile = 1;
+        json.beginArray("files");
         while (file) {
             String filePath = String(file.name());
             if (filePath.indexOf("/static") == 0) {
-                if (firstFile) {
-                    firstFile = 0;
-                } else {
-                    res->println(",");
-                }
-
-                res->println("{");
-
-                if (String(file.name()).substring(1).endsWith(".gz")) {
-                    String modifiedFile = String(file.name()).substring(1);
-                    modifiedFile.remove((modifiedFile.length() - 3), 3);
-                    res->print("\"nameModified\": \"" + modifiedFile + "\",");
-                    res->print("\"name\": \"" + String(file.name()).substring(1) + "\",");
-
-                } else {
-                    res->print("\"name\": \"" + String(file.name()).substring(1) + "\",");
-                }
-                res->print("\"size\": " + String(file.size()));
-                res->print("}");
+                json.beginObject();
+
+                String name = filePath.substring(1);
+                if (name.endsWith(".gz"))
+                    json.value("nameModified", name.substring(0, name.length() - 3));
+                json.value("name", name);
+                json.value("size", file.size());
+                json.endObject();
             }
 
             file = root.openNextFile();
         }
-        res->print("],");
-        res->print("\"filesystem\" : {");
-        res->print("\"total\" : " + String(SPIFFS.totalBytes()) + ",");
-        res->print("\"used\" : " + String(SPIFFS.usedBytes()) + ",");
-        res->print("\"free\" : " + String(SPIFFS.totalBytes() - SPIFFS.usedBytes()));
-        res->println("}");
-        res->println("},");
-        res->println("\"status\": \"ok\"");
-        res->println("}");
+        json.endArray();
+        json.beginObject("filesystem");
+        json.value("total", SPIFFS.totalBytes());
+        json.value("used", SPIFFS.usedBytes());
+        json.value("free", SPIFFS.totalBytes() - SPIFFS.usedBytes());
+        json.endObject();
+        json.endObject();
+        json.value("status", "ok");
+        json.endObject();
     }
 }
 
@@ -471,14 +880,15 @@ void handleSpiffsDeleteStatic(HTTPRequest *req, HTTPResponse *res)
     res->setHeader("Content-Type", "application/json");
     if (params->getQueryParameter("delete", paramValDelete)) {
         std::string pathDelete = "/" + paramValDelete;
+        clearStaticCache();
         if (SPIFFS.remove(pathDelete.c_str())) {
-            Serial.println(pathDelete.c_str());
+            LOG_DEBUG(HTTP, "Deleted %s\n", pathDelete.c_str());
             res->println("{");
             res->println("\"status\": \"ok\"");
             res->println("}");
             return;
         } else {
-            Serial.println(pathDelete.c_str());
+            LOG_WARN(HTTP, "Couldn't delete %s\n", pathDelete.c_str());
             res->println("{");
             res->println("\"status\": \"Error\"");
             res->println("}");
@@ -494,7 +904,7 @@ void handleStaticBrowse(HTTPRequest *req, HTTPResponse *res)
     std::string paramValDelete;
     std::string paramValEdit;
 
-    DEBUG_MSG("Static Browse - Disabling keep-alive\n");
+    LOG_DEBUG(HTTP, "Static Browse - Disabling keep-alive\n");
     res->setHeader("Connection", "close");
 
     // Set a default content type
@@ -502,8 +912,9 @@ void handleStaticBrowse(HTTPRequest *req, HTTPResponse *res)
 
     if (params->getQueryParameter("delete", paramValDelete)) {
         std::string pathDelete = "/" + paramValDelete;
+        clearStaticCache();
         if (SPIFFS.remove(pathDelete.c_str())) {
-            Serial.println(pathDelete.c_str());
+            LOG_DEBUG(HTTP, "Deleted %s\n", pathDelete.c_str());
             res->println("<html><head><meta http-equiv=\"refresh\" content=\"1;url=/static\" /><title>File "
                          "deleted!</title></head><body><h1>File deleted!</h1>");
             res->println("<meta http-equiv=\"refresh\" 1;url=/static\" />\n");
@@ -511,7 +922,7 @@ void handleStaticBrowse(HTTPRequest *req, HTTPResponse *res)
 
             return;
         } else {
-            Serial.println(pathDelete.c_str());
+            LOG_WARN(HTTP, "Couldn't delete %s\n", pathDelete.c_str());
             res->println("<html><head><meta http-equiv=\"refresh\" content=\"1;url=/static\" /><title>Error deleteing "
                          "file!</title></head><body><h1>Error deleteing file!</h1>");
             res->println("Error deleteing file!<br>");
@@ -636,64 +1047,15 @@ void handleStatic(HTTPRequest *req, HTTPResponse *res)
     if (params->getPathParameter(0, parameter1)) {
 
         std::string filename = "/static/" + parameter1;
-        std::string filenameGzip = "/static/" + parameter1 + ".gz";
 
-        if (!SPIFFS.exists(filename.c_str()) && !SPIFFS.exists(filenameGzip.c_str())) {
+        if (!sendStaticFile(req, res, filename)) {
             // Send "404 Not Found" as response, as the file doesn't seem to exist
             res->setStatusCode(404);
             res->setStatusText("Not found");
             res->println("404 Not Found");
             res->printf("<p>File not found: %s</p>\n", filename.c_str());
-            return;
-        }
-
-        // Try to open the file from SPIFFS
-        File file;
-
-        if (SPIFFS.exists(filename.c_str())) {
-            file = SPIFFS.open(filename.c_str());
-            if (!file.available()) {
-                DEBUG_MSG("File not available - %s\n", filename.c_str());
-            }
-
-        } else if (SPIFFS.exists(filenameGzip.c_str())) {
-            file = SPIFFS.open(filenameGzip.c_str());
-            res->setHeader("Content-Encoding", "gzip");
-            if (!file.available()) {
-                DEBUG_MSG("File not available\n");
-            }
         }
 
-        res->setHeader("Content-Length", httpsserver::intToString(file.size()));
-
-        bool has_set_content_type = false;
-        // Content-Type is guessed using the definition of the contentTypes-table defined above
-        int cTypeIdx = 0;
-        do {
-            if (filename.rfind(contentTypes[cTypeIdx][0]) != std::string::npos) {
-                res->setHeader("Content-Type", contentTypes[cTypeIdx][1]);
-                has_set_content_type = true;
-                break;
-            }
-            cTypeIdx += 1;
-        } while (strlen(contentTypes[cTypeIdx][0]) > 0);
-
-        if (!has_set_content_type) {
-            // Set a default content type
-            res->setHeader("Content-Type", "application/octet-stream");
-        }
-
-        // Read the file from SPIFFS and write it to the HTTP response body
-        size_t length = 0;
-        do {
-            char buffer[256];
-            length = file.read((uint8_t *)buffer, 256);
-            std::string bufferString(buffer, length);
-            res->write((uint8_t *)bufferString.c_str(), bufferString.size());
-        } while (length > 0);
-
-        file.close();
-
         return;
 
     } else {
@@ -704,19 +1066,19 @@ void handleStatic(HTTPRequest *req, HTTPResponse *res)
 void handleFormUpload(HTTPRequest *req, HTTPResponse *res)
 {
 
-    DEBUG_MSG("Form Upload - Disabling keep-alive\n");
+    LOG_DEBUG(HTTP, "Form Upload - Disabling keep-alive\n");
     res->setHeader("Connection", "close");
 
-    DEBUG_MSG("Form Upload - Set frequency to 240mhz\n");
     // The upload process is very CPU intensive. Let's speed things up a bit.
-    setCpuFrequencyMhz(240);
+    if (cpuGovernor)
+        cpuGovernor->boost(30 * 1000);
 
     // First, we need to check the encoding of the form that we have received.
     // The browser will set the Content-Type request header, so we can use it for that purpose.
     // Then we select the body parser based on the encoding.
     // Actually we do this only for documentary purposes, we know the form is going
     // to be multipart/form-data.
-    DEBUG_MSG("Form Upload - Creating body parser reference\n");
+    LOG_DEBUG(HTTP, "Form Upload - Creating body parser reference\n");
     HTTPBodyParser *parser;
     std::string contentType = req->getHeader("Content-Type");
 
@@ -732,10 +1094,10 @@ void handleFormUpload(HTTPRequest *req, HTTPResponse *res)
 
     // Now, we can decide based on the content type:
     if (contentType == "multipart/form-data") {
-        DEBUG_MSG("Form Upload - multipart/form-data\n");
+        LOG_DEBUG(HTTP, "Form Upload - multipart/form-data\n");
         parser = new HTTPMultipartBodyParser(req);
     } else {
-        Serial.printf("Unknown POST Content-Type: %s\n", contentType.c_str());
+        LOG_WARN(HTTP, "Unknown POST Content-Type: %s\n", contentType.c_str());
         return;
     }
 
@@ -762,26 +1124,26 @@ void handleFormUpload(HTTPRequest *req, HTTPResponse *res)
         std::string filename = parser->getFieldFilename();
         std::string mimeType = parser->getFieldMimeType();
         // We log all three values, so that you can observe the upload on the serial monitor:
-        DEBUG_MSG("handleFormUpload: field name='%s', filename='%s', mimetype='%s'\n", name.c_str(), filename.c_str(),
+        LOG_DEBUG(HTTP, "handleFormUpload: field name='%s', filename='%s', mimetype='%s'\n", name.c_str(), filename.c_str(),
                   mimeType.c_str());
 
         // Double check that it is what we expect
         if (name != "file") {
-            DEBUG_MSG("Skipping unexpected field\n");
+            LOG_DEBUG(HTTP, "Skipping unexpected field\n");
             res->println("<p>No file found.</p>");
             return;
         }
 
         // Double check that it is what we expect
         if (filename == "") {
-            DEBUG_MSG("Skipping unexpected field\n");
+            LOG_DEBUG(HTTP, "Skipping unexpected field\n");
             res->println("<p>No file found.</p>");
             return;
         }
 
         // SPIFFS limits the total lenth of a path + file to 31 characters.
         if (filename.length() + 8 > 31) {
-            DEBUG_MSG("Uploaded filename too long!\n");
+            LOG_DEBUG(HTTP, "Uploaded filename too long!\n");
             res->println("<p>Uploaded filename too long! Limit of 23 characters.</p>");
             delete parser;
             return;
@@ -792,6 +1154,7 @@ void handleFormUpload(HTTPRequest *req, HTTPResponse *res)
         std::string pathname = "/static/" + filename;
 
         // Create a new file on spiffs to stream the data into
+        clearStaticCache();
         File file = SPIFFS.open(pathname.c_str(), "w");
         size_t fileLength = 0;
         didwrite = true;
@@ -819,7 +1182,7 @@ void handleFormUpload(HTTPRequest *req, HTTPResponse *res)
             //if (readLength) {
                 file.write(buf, readLength);
                 fileLength += readLength;
-                DEBUG_MSG("File Length %i\n", fileLength);
+                LOG_DEBUG(HTTP, "File Length %i\n", fileLength);
             //}
         }
         // enableLoopWDT();
@@ -861,7 +1224,7 @@ void handle404(HTTPRequest *req, HTTPResponse *res)
 */
 void handleHotspot(HTTPRequest *req, HTTPResponse *res)
 {
-    DEBUG_MSG("Hotspot Request\n");
+    LOG_DEBUG(HTTP, "Hotspot Request\n");
 
     /*
         If we don't do a redirect, be sure to return a "Success" message
@@ -879,7 +1242,7 @@ void handleHotspot(HTTPRequest *req, HTTPResponse *res)
 void handleAPIv1FromRadio(HTTPRequest *req, HTTPResponse *res)
 {
 
-    DEBUG_MSG("+++++++++++++++ webAPI handleAPIv1FromRadio\n");
+    LOG_DEBUG(HTTP, "+++++++++++++++ webAPI handleAPIv1FromRadio\n");
 
     /*
         For documentation, see:
@@ -888,6 +1251,9 @@ void handleAPIv1FromRadio(HTTPRequest *req, HTTPResponse *res)
 
         Example:
             http://10.10.30.198/api/v1/fromradio
+
+        With batch=true each protobuf is preceded by its length (as a varint), so that clients can split up the response
+        (and without all=true we return as many protobufs as fit in one buffer, rather than just one)
     */
 
     // Get access to the parameters
@@ -895,6 +1261,8 @@ void handleAPIv1FromRadio(HTTPRequest *req, HTTPResponse *res)
 
     // std::string paramAll = "all";
     std::string valueAll;
+    std::string valueBatch;
+    bool batch = params->getQueryParameter("batch", valueBatch) && valueBatch == "true";
 
     // Status code is 200 OK by default.
     res->setHeader("Content-Type", "application/x-protobuf");
@@ -905,34 +1273,41 @@ void handleAPIv1FromRadio(HTTPRequest *req, HTTPResponse *res)
     uint8_t txBuf[MAX_STREAM_BUF_SIZE];
     uint32_t len = 1;
 
-    if (params->getQueryParameter("all", valueAll)) {
+    if (batch) {
+        bool all = params->getQueryParameter("all", valueAll) && valueAll == "true";
+        do {
+            runOnMainThread([&]() { len = webAPI.getFromRadioBatch(txBuf, sizeof(txBuf)); });
+            res->write(txBuf, len);
+        } while (all && len);
+
+    } else if (params->getQueryParameter("all", valueAll)) {
 
         // If all is ture, return all the buffers we have available
         //   to us at this point in time.
         if (valueAll == "true") {
             while (len) {
-                len = webAPI.getFromRadio(txBuf);
+                runOnMainThread([&]() { len = webAPI.getFromRadio(txBuf); });
                 res->write(txBuf, len);
             }
 
             // Otherwise, just return one protobuf
         } else {
-            len = webAPI.getFromRadio(txBuf);
+            runOnMainThread([&]() { len = webAPI.getFromRadio(txBuf); });
             res->write(txBuf, len);
         }
 
         // the param "all" was not spcified. Return just one protobuf
     } else {
-        len = webAPI.getFromRadio(txBuf);
+        runOnMainThread([&]() { len = webAPI.getFromRadio(txBuf); });
         res->write(txBuf, len);
     }
 
-    DEBUG_MSG("--------------- webAPI handleAPIv1FromRadio, len %d\n", len);
+    LOG_DEBUG(HTTP, "--------------- webAPI handleAPIv1FromRadio, len %d\n", len);
 }
 
 void handleAPIv1ToRadio(HTTPRequest *req, HTTPResponse *res)
 {
-    DEBUG_MSG("+++++++++++++++ webAPI handleAPIv1ToRadio\n");
+    LOG_DEBUG(HTTP, "+++++++++++++++ webAPI handleAPIv1ToRadio\n");
 
     /*
         For documentation, see:
@@ -960,11 +1335,11 @@ void handleAPIv1ToRadio(HTTPRequest *req, HTTPResponse *res)
     byte buffer[MAX_TO_FROM_RADIO_SIZE];
     size_t s = req->readBytes(buffer, MAX_TO_FROM_RADIO_SIZE);
 
-    DEBUG_MSG("Received %d bytes from PUT request\n", s);
-    webAPI.handleToRadio(buffer, s);
+    LOG_DEBUG(HTTP, "Received %d bytes from PUT request\n", s);
+    runOnMainThread([&]() { webAPI.handleToRadio(buffer, s); });
 
     res->write(buffer, s);
-    DEBUG_MSG("--------------- webAPI handleAPIv1ToRadio\n");
+    LOG_DEBUG(HTTP, "--------------- webAPI handleAPIv1ToRadio\n");
 }
 
 /*
@@ -985,9 +1360,8 @@ void handleRoot(HTTPRequest *req, HTTPResponse *res)
     // DEBUG_MSG(cookie.c_str());
 
     std::string filename = "/static/index.html";
-    std::string filenameGzip = "/static/index.html.gz";
 
-    if (!SPIFFS.exists(filename.c_str()) && !SPIFFS.exists(filenameGzip.c_str())) {
+    if (!sendStaticFile(req, res, filename)) {
         // Send "404 Not Found" as response, as the file doesn't seem to exist
         res->setStatusCode(404);
         res->setStatusText("Not found");
@@ -997,44 +1371,117 @@ void handleRoot(HTTPRequest *req, HTTPResponse *res)
         res->printf("<p>You have gotten this error because the filesystem for the web server has not been loaded.</p>\n");
         res->printf("<p>Please review the 'Common Problems' section of the <a "
                     "href=https://github.com/meshtastic/Meshtastic-device/wiki/How-to-use-the-Meshtastic-Web-Interface-over-WiFi>web interface</a> documentation.</p>\n");
-        return;
-    }
-
-    // Try to open the file from SPIFFS
-    File file;
-
-    if (SPIFFS.exists(filename.c_str())) {
-        file = SPIFFS.open(filename.c_str());
-        if (!file.available()) {
-            DEBUG_MSG("File not available - %s\n", filename.c_str());
-        }
-
-    } else if (SPIFFS.exists(filenameGzip.c_str())) {
-        file = SPIFFS.open(filenameGzip.c_str());
-        res->setHeader("Content-Encoding", "gzip");
-        if (!file.available()) {
-            DEBUG_MSG("File not available\n");
-        }
     }
-
-    // Read the file from SPIFFS and write it to the HTTP response body
-    size_t length = 0;
-    do {
-        char buffer[256];
-        length = file.read((uint8_t *)buffer, 256);
-        std::string bufferString(buffer, length);
-        res->write((uint8_t *)bufferString.c_str(), bufferString.size());
-    } while (length > 0);
 }
 
 void handleRestart(HTTPRequest *req, HTTPResponse *res)
 {
     res->setHeader("Content-Type", "text/html");
 
-    DEBUG_MSG("***** Restarted on HTTP(s) Request *****\n");
+    LOG_DEBUG(HTTP, "***** Restarted on HTTP(s) Request *****\n");
     res->println("Restarting");
 
+    // Settings changed in the last few seconds might still be waiting for our save timer, and like the rest of our mesh state
+    // NodeDB is only safe to touch from the main thread
+    runOnMainThread([]() { nodeDB.saveIfChanged(); });
+    ESP.restart();
+}
+
+/// Reboots us into a new app image (disabled until an OTA upload succeeds)
+static concurrency::Periodic *otaRebootPeriod;
+
+static int32_t otaRebootCb()
+{
+    LOG_INFO(HTTP, "Rebooting for OTA update\n");
+    nodeDB.saveIfChanged();
     ESP.restart();
+    return 0;
+}
+
+/**
+ * POST /ota: the body is a raw app image (or with ?region=spiffs a SPIFFS image), optionally checked against ?md5=.
+ *
+ * We stream it through updateWriter as it arrives, so the flash erase and write of each sector overlap receiving the next,
+ * with our CPU at full speed.  Like BLE updates the radio is off meanwhile.  After a good app image we reboot into it.
+ */
+void handleOtaUpload(HTTPRequest *req, HTTPResponse *res)
+{
+    res->setHeader("Content-Type", "application/json");
+    res->setHeader("Connection", "close");
+
+    ResourceParameters *params = req->getParams();
+    std::string region, md5;
+    int command = params->getQueryParameter("region", region) && region == "spiffs" ? U_SPIFFS : U_FLASH;
+    size_t size = req->getContentLength();
+
+    if (cpuGovernor)
+        cpuGovernor->boost(OTA_BOOST_MSEC);
+    runOnMainThread([]() {
+        if (RadioLibInterface::instance)
+            RadioLibInterface::instance->sleep(); // The RF95 ISR/SPI code on ESP32 can fail while we are writing flash
+    });
+
+    const char *error = NULL;
+    if (!size)
+        error = "missing Content-Length";
+    else if (!updateWriter.begin(size, command))
+        error = "can't begin update (too big?)";
+    else if (params->getQueryParameter("md5", md5) && !Update.setMD5(md5.c_str()))
+        error = "bad md5";
+
+    if (!error) {
+        LOG_INFO(HTTP, "OTA upload of %u bytes to %s\n", size, command == U_SPIFFS ? "spiffs" : "app");
+        uint32_t lastDataMsec = millis();
+        while (!req->requestComplete() && millis() - lastDataMsec < OTA_IDLE_TIMEOUT_MSEC) {
+            esp_task_wdt_reset();
+
+            size_t n = req->readBytes(staticChunk, STATIC_CHUNK_SIZE);
+            if (!n) {
+                vTaskDelay(pdMS_TO_TICKS(WEB_SERVER_POLL_MSEC));
+                continue;
+            }
+
+            updateWriter.write(staticChunk, n);
+            lastDataMsec = millis();
+            if (cpuGovernor)
+                cpuGovernor->boost(OTA_BOOST_MSEC);
+        }
+
+        updateWriter.drain();
+        if (updateWriter.getReceivedSize() != size) {
+            error = "incomplete upload";
+            Update.abort();
+        } else if (!Update.end())
+            error = "update failed (bad image or md5?)";
+    }
+
+    if (error) {
+        LOG_ERROR(HTTP, "OTA upload failed: %s (update error %d)\n", error, Update.getError());
+        res->setStatusCode(400);
+    }
+
+    bool reboot = !error && command == U_FLASH;
+    runOnMainThread([&]() {
+        if (reboot) {
+            if (!otaRebootPeriod)
+                otaRebootPeriod = new concurrency::Periodic("OtaReboot", otaRebootCb);
+            otaRebootPeriod->setIntervalFromNow(OTA_REBOOT_DELAY_MSEC);
+        } else {
+            if (!error)
+                nodeDB.saveToDisk(); // Since we just wiped spiffs, we need to save our current state
+            if (RadioLibInterface::instance)
+                RadioLibInterface::instance->startReceive(); // Resume radio
+        }
+    });
+    if (!error && command == U_SPIFFS)
+        clearStaticCache();
+
+    JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+    json.beginObject();
+    json.value("bytes", (unsigned long)updateWriter.getReceivedSize());
+    json.value("rebooting", reboot);
+    json.value("status", error ? error : "ok");
+    json.endObject();
 }
 
 void handleBlinkLED(HTTPRequest *req, HTTPResponse *res)
@@ -1068,6 +1515,16 @@ void handleBlinkLED(HTTPRequest *req, HTTPResponse *res)
     res->println("}");
 }
 
+/// Report an airtime log, one entry per period
+static void writeAirtimeLog(JsonWriter &json, const char *key, reportTypes type)
+{
+    uint16_t *logArray = airtimeReport(type);
+    json.beginArray(key);
+    for (int i = 0; i < getPeriodsToLog(); i++)
+        json.element(logArray[i]);
+    json.endArray();
+}
+
 void handleReport(HTTPRequest *req, HTTPResponse *res)
 {
 
@@ -1086,77 +1543,484 @@ void handleReport(HTTPRequest *req, HTTPResponse *res)
         res->println("<pre>");
     }
 
-    res->println("{");
+    JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+    json.beginObject();
+    json.beginObject("data");
+
+    json.beginObject("airtime");
+    writeAirtimeLog(json, "tx_log", TX_LOG);
+    writeAirtimeLog(json, "rx_log", RX_LOG);
+    writeAirtimeLog(json, "rx_all_log", RX_ALL_LOG);
+    json.value("seconds_since_boot", getSecondsSinceBoot());
+    json.value("seconds_per_period", getSecondsPerPeriod());
+    json.value("periods_to_log", getPeriodsToLog());
+    json.value("tx_total_ms", getAirtimeMsec(TX_LOG));
+    json.value("rx_total_ms", getAirtimeMsec(RX_LOG));
+    json.value("rx_all_total_ms", getAirtimeMsec(RX_ALL_LOG));
+    json.value("channel_utilization_1min", channelUtilizationPercent(UTIL_1_MINUTE), 1);
+    json.value("channel_utilization_10min", channelUtilizationPercent(UTIL_10_MINUTES), 1);
+    json.endObject();
+
+    json.beginObject("packet_pool");
+    json.value("capacity", packetPool.getCapacity());
+    json.value("in_use", packetPool.getNumInUse());
+    json.value("max_in_use", packetPool.getMaxInUse());
+    json.value("failed_allocs", packetPool.getNumFailed());
+    json.endObject();
+
+    json.beginObject("phone_slabs");
+    json.value("capacity", service.getPhoneSlabs().getCapacity());
+    json.value("in_use", service.getPhoneSlabs().getNumInUse());
+    json.value("failed_allocs", service.getPhoneSlabs().getNumFailed());
+    json.endObject();
+
+    json.beginObject("phone_drops");
+    json.value("superseded", service.getNumPhoneDrops(PHONE_SUPERSEDED));
+    json.value("telemetry", service.getNumPhoneDrops(PHONE_TELEMETRY));
+    json.value("updates", service.getNumPhoneDrops(PHONE_UPDATE));
+    json.value("user_data", service.getNumPhoneDrops(PHONE_USER_DATA));
+    json.endObject();
+
+    if (memoryMonitor) {
+        MemoryStats m = memoryMonitor->getStats();
+        json.beginObject("memory");
+        json.value("seconds_since_sample", m.sampleMsec ? (millis() - m.sampleMsec) / 1000 : 0);
+        json.value("free_heap", m.freeHeap);
+        json.value("largest_free_block", m.largestFreeBlock);
+        json.value("min_free_heap", m.minFreeHeap);
+        json.beginArray("tasks");
+        for (size_t i = 0; i < m.numTasks; i++) {
+            json.beginObject();
+            json.value("name", m.tasks[i].name);
+            json.value("min_free_stack", m.tasks[i].minFreeBytes);
+            json.endObject();
+        }
+        json.endArray();
+        json.endObject();
+    }
 
-    res->println("\"data\": {");
+    json.beginObject("power");
+    json.value("state", PowerStats::getStateName(powerStats.getState()));
+    json.value("estimated_mah", powerStats.getTotalMah());
+    json.value("estimated_average_ma", powerStats.getAverageMilliamps());
+    json.value("radio_mah", powerStats.getRadioMah());
+    json.beginArray("states");
+    for (int i = 0; i < PS_NUM_STATES; i++) {
+        PowerStatsState s = (PowerStatsState)i;
+        json.beginObject();
+        json.value("name", PowerStats::getStateName(s));
+        json.value("total_ms", powerStats.getStateMsec(s));
+        json.value("entries", powerStats.getNumEntries(s));
+        json.value("estimated_mah", powerStats.getStateMah(s));
+        json.endObject();
+    }
+    json.endArray();
+    json.beginArray("transitions");
+    for (int from = 0; from < PS_NUM_STATES; from++)
+        for (int to = 0; to < PS_NUM_STATES; to++) {
+            uint16_t n = powerStats.getNumTransitions((PowerStatsState)from, (PowerStatsState)to);
+            if (n) {
+                json.beginObject();
+                json.value("from", PowerStats::getStateName((PowerStatsState)from));
+                json.value("to", PowerStats::getStateName((PowerStatsState)to));
+                json.value("count", n);
+                json.endObject();
+            }
+        }
+    json.endArray();
+    json.endObject();
+
+    json.beginObject("boot");
+    json.value("rx_ready_ms", bootTimer.getRxReadyMsec());
+    json.beginArray("phases");
+    for (size_t i = 0; i < bootTimer.getNumPhases(); i++) {
+        json.beginObject();
+        json.value("name", bootTimer.getPhase(i).name);
+        json.value("ms", bootTimer.getPhase(i).msec);
+        json.endObject();
+    }
+    json.endArray();
+    json.endObject();
+
+    json.beginArray("latency");
+    for (int i = 0; i < TRACE_NUM_STAGES; i++) {
+        TraceHistogram h = packetTrace.getHistogram((TraceStage)i);
+        json.beginObject();
+        json.value("stage", PacketTrace::getStageName((TraceStage)i));
+        json.value("count", h.count);
+        json.value("mean_us", h.getMeanUsec());
+        json.value("p50_us", h.getPercentileUsec(50));
+        json.value("p90_us", h.getPercentileUsec(90));
+        json.value("max_us", h.maxUsec);
+        json.beginArray("buckets");
+        for (int b = 0; b < PACKET_TRACE_NUM_BUCKETS; b++)
+            json.element(h.buckets[b]);
+        json.endArray();
+        json.endObject();
+    }
+    json.endArray();
+
+    json.beginArray("threads");
+    for (size_t i = 0; i < concurrency::mainController.getNumThreads(); i++) {
+        concurrency::OSThread *t = concurrency::mainController.getThread(i);
+        json.beginObject();
+        json.value("name", t->ThreadName.c_str());
+        json.value("enabled", (bool)t->enabled);
+        json.value("runs", t->getNumRuns());
+        json.value("total_run_us", t->getTotalRunMicros());
+        json.value("max_run_us", t->getMaxRunMicros());
+        json.value("total_late_ms", t->getTotalLateMsec());
+        json.value("max_late_ms", t->getMaxLateMsec());
+        json.value("priority", (uint32_t)t->getPriority());
+        json.value("overruns", t->getNumOverruns());
+        json.endObject();
+    }
+    json.endArray();
 
-    res->println("\"airtime\": {");
+    json.beginObject("wifi");
+    json.value("rssi", WiFi.RSSI());
+    if (radioConfig.preferences.wifi_ap_mode || isSoftAPForced())
+        json.value("ip", WiFi.softAPIP().toString());
+    else
+        json.value("ip", WiFi.localIP().toString());
+    json.endObject();
 
-    uint16_t *logArray;
+    json.value("test", 123);
 
-    res->print("\"tx_log\": [");
+    json.endObject();
 
-    logArray = airtimeReport(TX_LOG);
-    for (int i = 0; i < getPeriodsToLog(); i++) {
-        uint16_t tmp;
-        tmp = *(logArray + i);
-        res->printf("%d", tmp);
-        if (i != getPeriodsToLog() - 1) {
-            res->print(", ");
-        }
-    }
+    json.value("status", "ok");
+    json.endObject();
+}
 
-    res->println("],");
-    res->print("\"rx_log\": [");
+/// Print the HELP and TYPE lines which start a metric family
+static void printMetricHeader(HTTPResponse *res, const char *name, const char *type, const char *help)
+{
+    res->printf("# HELP meshtastic_%s %s\n", name, help);
+    res->printf("# TYPE meshtastic_%s %s\n", name, type);
+}
 
-    logArray = airtimeReport(RX_LOG);
-    for (int i = 0; i < getPeriodsToLog(); i++) {
-        uint16_t tmp;
-        tmp = *(logArray + i);
-        res->printf("%d", tmp);
-        if (i != getPeriodsToLog() - 1) {
-            res->print(", ");
+/// Copy s into buf (of len bytes) as a Prometheus label value, which must have its backslashes, quotes and newlines escaped
+static const char *escapeLabelValue(const char *s, char *buf, size_t len)
+{
+    size_t n = 0;
+    for (; *s && n + 2 < len; s++) {
+        char c = *s;
+        if (c == '\\' || c == '"' || c == '\n') {
+            buf[n++] = '\\';
+            c = c == '\n' ? 'n' : c;
         }
+        buf[n++] = c;
     }
+    buf[n] = '\0';
+    return buf;
+}
 
-    res->println("],");
-    res->print("\"rx_all_log\": [");
+/// A metric family with a single unlabeled sample
+static void printMetric(HTTPResponse *res, const char *name, const char *type, const char *help, double value)
+{
+    printMetricHeader(res, name, type, help);
+    res->printf("meshtastic_%s %.10g\n", name, value);
+}
 
-    logArray = airtimeReport(RX_ALL_LOG);
-    for (int i = 0; i < getPeriodsToLog(); i++) {
-        uint16_t tmp;
-        tmp = *(logArray + i);
-        res->printf("%d", tmp);
-        if (i != getPeriodsToLog() - 1) {
-            res->print(", ");
-        }
+/// Our counters in the Prometheus text exposition format, so monitoring systems can scrape us
+/// A numeric query parameter (decimal, or hex starting with 0x), or def if there isn't one
+static uint32_t getNumberParameter(ResourceParameters *params, const char *name, uint32_t def)
+{
+    std::string value;
+    if (!params->getQueryParameter(name, value) || value.empty())
+        return def;
+    return strtoul(value.c_str(), NULL, 0);
+}
+
+static void writeLinkTestDirection(JsonWriter &json, const char *key, const LinkTestDirection &d)
+{
+    json.beginObject(key);
+    json.value("done", d.done);
+    json.value("sent", d.sent);
+    json.value("received", d.received);
+    json.value("loss_percent", d.sent ? 100.0f * (d.sent - min(d.received, d.sent)) / d.sent : 0.0f, 1);
+    json.value("duplicates", d.duplicates);
+    json.value("out_of_order", d.outOfOrder);
+    json.value("bytes", d.bytes);
+    json.value("rx_ms", d.rxMsec);
+    json.value("goodput_bps", d.getGoodputBps());
+    json.value("tx_airtime_ms", d.txAirtimeMsec);
+    json.value("bytes_per_airtime_sec", d.getBytesPerAirtimeSec());
+    json.endObject();
+}
+
+/**
+ * GET shows the result of our latest link test (see LinkTestPlugin).  POST starts a test, with query parameters dest (a node
+ * number), count, size, interval_ms, hops and bidirectional=true.
+ */
+void handleLinkTest(HTTPRequest *req, HTTPResponse *res)
+{
+    res->setHeader("Content-Type", "application/json");
+
+    if (req->getMethod() == "POST") {
+        ResourceParameters *params = req->getParams();
+        std::string bidirectional;
+        LinkTestParams p;
+        p.dest = getNumberParameter(params, "dest", 0);
+        p.count = getNumberParameter(params, "count", 20);
+        p.size = getNumberParameter(params, "size", 32);
+        p.intervalMsec = getNumberParameter(params, "interval_ms", 2000);
+        p.hops = getNumberParameter(params, "hops", 0);
+        p.bidirectional = params->getQueryParameter("bidirectional", bidirectional) && bidirectional == "true";
+
+        bool started = false;
+        runOnMainThread([&]() { started = linkTestPlugin->startTest(p); });
+        if (!started)
+            res->setStatusCode(400);
+        res->println("{");
+        res->println(started ? "\"status\": \"ok\"" : "\"status\": \"busy or bad parameters\"");
+        res->println("}");
+        return;
     }
 
-    res->println("],");
-    res->printf("\"seconds_since_boot\": %u,\n", getSecondsSinceBoot());
-    res->printf("\"seconds_per_period\": %u,\n", getSecondsPerPeriod());
-    res->printf("\"periods_to_log\": %u\n", getPeriodsToLog());
+    LinkTestResult r;
+    runOnMainThread([&]() { r = linkTestPlugin->getResult(); });
+
+    JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+    json.beginObject();
+    json.beginObject("data");
+    json.value("peer", r.peer);
+    json.value("test_id", r.testId);
+    json.value("running", r.running);
+    json.value("count", r.params.count);
+    json.value("size", r.params.size);
+    json.value("interval_ms", r.params.intervalMsec);
+    json.value("hops", r.params.hops);
+    json.value("bidirectional", r.params.bidirectional);
+    writeLinkTestDirection(json, "out", r.out);
+    writeLinkTestDirection(json, "in", r.in);
+
+    json.beginObject("rtt");
+    json.value("count", r.rttMsec.count);
+    json.value("mean_ms", r.rttMsec.getMeanUsec()); // Our round trip histogram counts msecs
+    json.value("p50_ms", r.rttMsec.getPercentileUsec(50));
+    json.value("p90_ms", r.rttMsec.getPercentileUsec(90));
+    json.value("max_ms", r.rttMsec.maxUsec);
+    json.endObject();
+
+    json.endObject();
+    json.value("status", "ok");
+    json.endObject();
+}
 
-    res->println("},");
+/**
+ * GET shows the reports we have of the last load run we coordinated (see LoadGenPlugin).  POST starts a run, with query
+ * parameters dest (a node number, default every node), duration_s, per_min, size, unicast_percent and reliable_percent, or
+ * stops our run with stop=true.
+ */
+void handleLoadGen(HTTPRequest *req, HTTPResponse *res)
+{
+    res->setHeader("Content-Type", "application/json");
 
-    res->println("\"wifi\": {");
+    if (req->getMethod() == "POST") {
+        ResourceParameters *params = req->getParams();
+        std::string stop;
+        bool started = true;
+        if (params->getQueryParameter("stop", stop) && stop == "true")
+            runOnMainThread([&]() { loadGenPlugin->stopRun(); });
+        else {
+            NodeNum dest = getNumberParameter(params, "dest", NODENUM_BROADCAST);
+            LoadGenParams p;
+            p.coordinator = 0; // startRun fills in our own node
+            p.durationSecs = getNumberParameter(params, "duration_s", 300);
+            p.perMin = getNumberParameter(params, "per_min", 6);
+            p.size = getNumberParameter(params, "size", 32);
+            p.unicastPercent = getNumberParameter(params, "unicast_percent", 20);
+            p.reliablePercent = getNumberParameter(params, "reliable_percent", 20);
+            runOnMainThread([&]() { started = loadGenPlugin->startRun(dest, p); });
+        }
+        if (!started)
+            res->setStatusCode(400);
+        res->println("{");
+        res->println(started ? "\"status\": \"ok\"" : "\"status\": \"bad parameters\"");
+        res->println("}");
+        return;
+    }
 
-    res->println("\"rssi\": " + String(WiFi.RSSI()) + ",");
+    uint16_t runId;
+    size_t numReports;
+    static NodeNum nodes[LOAD_GEN_MAX_REPORTS];
+    static LoadGenReport reports[LOAD_GEN_MAX_REPORTS];
+    runOnMainThread([&]() {
+        runId = loadGenPlugin->getCoordinatedRunId();
+        numReports = loadGenPlugin->getNumReports();
+        for (size_t i = 0; i < numReports; i++) {
+            nodes[i] = loadGenPlugin->getReportNode(i);
+            reports[i] = loadGenPlugin->getReport(i);
+        }
+    });
+
+    JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+    json.beginObject();
+    json.beginObject("data");
+    json.value("run_id", runId);
+    json.beginArray("reports");
+    for (size_t i = 0; i < numReports; i++) {
+        const LoadGenReport &r = reports[i];
+        json.beginObject();
+        json.value("node", nodes[i]);
+        json.value("offered", r.offered);
+        json.value("skipped", r.skipped);
+        json.value("sent_broadcasts", r.sentBroadcasts);
+        json.value("sent_unicasts", r.sentUnicasts);
+        json.value("sent_reliable", r.sentReliable);
+        json.value("retransmissions", r.retransmissions);
+        json.value("tx_airtime_ms", r.txAirtimeMsec);
+        json.value("rx_broadcasts", r.rxBroadcasts);
+        json.value("rx_unicasts", r.rxUnicasts);
+        json.value("rx_senders", r.rxSenders);
+        json.beginObject("latency");
+        json.value("count", r.latencyCount);
+        json.value("mean_ms", r.latencyMeanMsec);
+        json.value("p50_ms", r.latencyP50Msec);
+        json.value("p90_ms", r.latencyP90Msec);
+        json.value("max_ms", r.latencyMaxMsec);
+        json.endObject();
+        json.endObject();
+    }
+    json.endArray();
+    json.endObject();
+    json.value("status", "ok");
+    json.endObject();
+}
 
-    if (radioConfig.preferences.wifi_ap_mode || isSoftAPForced()) {
-        res->println("\"ip\": \"" + String(WiFi.softAPIP().toString().c_str()) + "\"");
-    } else {
-        res->println("\"ip\": \"" + String(WiFi.localIP().toString().c_str()) + "\"");
+void handleMetrics(HTTPRequest *req, HTTPResponse *res)
+{
+    res->setHeader("Content-Type", "text/plain; version=0.0.4");
+
+    RouterStats r;
+    if (router)
+        router->getStats(r);
+    else
+        r = RouterStats();
+
+    printMetric(res, "rx_good_total", "counter", "Frames we received and could decode", r.radio.rxGood);
+    printMetric(res, "rx_bad_total", "counter", "Frames we received but had to discard", r.radio.rxBad);
+    printMetric(res, "tx_good_total", "counter", "Frames we finished sending", r.radio.txGood);
+
+    printMetricHeader(res, "rx_dropped_total", "counter", "Packets we received intact but had to discard, by cause");
+    res->printf("meshtastic_rx_dropped_total{cause=\"no_buffer\"} %u\n", r.radio.rxDropped[RX_DROP_NO_BUFFER]);
+    res->printf("meshtastic_rx_dropped_total{cause=\"queue_full\"} %u\n", r.radio.rxDropped[RX_DROP_QUEUE_FULL]);
+    res->printf("meshtastic_rx_dropped_total{cause=\"malformed\"} %u\n", r.radio.rxDropped[RX_DROP_MALFORMED]);
+    res->printf("meshtastic_rx_dropped_total{cause=\"foreign\"} %u\n", r.radio.rxDropped[RX_DROP_FOREIGN]);
+
+    printMetricHeader(res, "queue_length", "gauge", "Packets waiting in each of our queues");
+    res->printf("meshtastic_queue_length{queue=\"tx\"} %u\n", r.radio.txQueued);
+    res->printf("meshtastic_queue_length{queue=\"from_radio\"} %u\n", r.fromRadioQueued);
+    res->printf("meshtastic_queue_length{queue=\"to_phone\"} %u\n", service.getNumToPhone());
+
+    printMetricHeader(res, "queue_drops_total", "counter", "Packets our queues discarded because they were full");
+    res->printf("meshtastic_queue_drops_total{queue=\"tx\"} %u\n", r.radio.txDropped);
+    res->printf("meshtastic_queue_drops_total{queue=\"to_phone\",priority=\"superseded\"} %u\n",
+                service.getNumPhoneDrops(PHONE_SUPERSEDED));
+    res->printf("meshtastic_queue_drops_total{queue=\"to_phone\",priority=\"telemetry\"} %u\n",
+                service.getNumPhoneDrops(PHONE_TELEMETRY));
+    res->printf("meshtastic_queue_drops_total{queue=\"to_phone\",priority=\"updates\"} %u\n",
+                service.getNumPhoneDrops(PHONE_UPDATE));
+    res->printf("meshtastic_queue_drops_total{queue=\"to_phone\",priority=\"user_data\"} %u\n",
+                service.getNumPhoneDrops(PHONE_USER_DATA));
+
+    printMetric(res, "retransmissions_total", "counter", "Reliable packets we sent again because they weren't acked in time",
+                r.retransmissions);
+    printMetric(res, "duplicates_total", "counter", "Packets we ignored because we had already seen them", r.duplicates);
+    printMetric(res, "rebroadcasts_suppressed_total", "counter",
+                "Rebroadcasts we cancelled because other nodes had already covered them", r.suppressed);
+    printMetric(res, "rebroadcasts_gossip_skipped_total", "counter",
+                "Floods we chose not to rebroadcast because we have plenty of neighbors", r.gossipSkipped);
+
+    printMetric(res, "packet_pool_in_use", "gauge", "Packets allocated from our pool", packetPool.getNumInUse());
+    printMetric(res, "packet_pool_capacity", "gauge", "Packets our pool can hold", packetPool.getCapacity());
+    printMetric(res, "packet_pool_failures_total", "counter", "Packet allocations which failed", packetPool.getNumFailed());
+
+    if (memoryMonitor) {
+        MemoryStats m = memoryMonitor->getStats();
+        printMetric(res, "heap_free_bytes", "gauge", "Free heap", m.freeHeap);
+        printMetric(res, "heap_largest_free_block_bytes", "gauge", "Largest block we could allocate", m.largestFreeBlock);
+        printMetric(res, "heap_min_free_bytes", "gauge", "Least free heap since boot", m.minFreeHeap);
     }
 
-    res->println("},");
+    char label[64];
+    printMetricHeader(res, "thread_runs_total", "counter", "How many times each thread has run");
+    for (size_t i = 0; i < concurrency::mainController.getNumThreads(); i++) {
+        concurrency::OSThread *t = concurrency::mainController.getThread(i);
+        res->printf("meshtastic_thread_runs_total{thread=\"%s\"} %u\n",
+                    escapeLabelValue(t->ThreadName.c_str(), label, sizeof(label)), t->getNumRuns());
+    }
+    printMetricHeader(res, "thread_cpu_seconds_total", "counter", "CPU time each thread has used");
+    for (size_t i = 0; i < concurrency::mainController.getNumThreads(); i++) {
+        concurrency::OSThread *t = concurrency::mainController.getThread(i);
+        res->printf("meshtastic_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n",
+                    escapeLabelValue(t->ThreadName.c_str(), label, sizeof(label)), t->getTotalRunMicros() / 1e6);
+    }
 
-    res->println("\"test\": 123");
+    if (spiLock) {
+        static const char *const clients[SPI_NUM_CLIENTS] = {"radio", "host"};
+        printMetricHeader(res, "spi_wait_seconds_total", "counter", "Time each client has waited for the SPI bus");
+        for (int i = 0; i < SPI_NUM_CLIENTS; i++)
+            res->printf("meshtastic_spi_wait_seconds_total{client=\"%s\"} %.6f\n", clients[i],
+                        spiLock->getStats((SPIClient)i).totalWaitUsec / 1e6);
+        printMetricHeader(res, "spi_wait_max_seconds", "gauge", "The longest each client has waited for the SPI bus");
+        for (int i = 0; i < SPI_NUM_CLIENTS; i++)
+            res->printf("meshtastic_spi_wait_max_seconds{client=\"%s\"} %.6f\n", clients[i],
+                        spiLock->getStats((SPIClient)i).maxWaitUsec / 1e6);
+        printMetricHeader(res, "spi_hold_seconds_total", "counter", "Time each client has held the SPI bus");
+        for (int i = 0; i < SPI_NUM_CLIENTS; i++)
+            res->printf("meshtastic_spi_hold_seconds_total{client=\"%s\"} %.6f\n", clients[i],
+                        spiLock->getStats((SPIClient)i).totalHoldUsec / 1e6);
+        printMetricHeader(res, "spi_hold_max_seconds", "gauge", "The longest each client has held the SPI bus");
+        for (int i = 0; i < SPI_NUM_CLIENTS; i++)
+            res->printf("meshtastic_spi_hold_max_seconds{client=\"%s\"} %.6f\n", clients[i],
+                        spiLock->getStats((SPIClient)i).maxHoldUsec / 1e6);
+    }
 
-    res->println("},");
+    printMetricHeader(res, "power_state_seconds_total", "counter", "Time spent in each power state");
+    for (int i = 0; i < PS_NUM_STATES; i++) {
+        PowerStatsState s = (PowerStatsState)i;
+        res->printf("meshtastic_power_state_seconds_total{state=\"%s\"} %.3f\n", PowerStats::getStateName(s),
+                    powerStats.getStateMsec(s) / 1000.0);
+    }
+    printMetric(res, "estimated_charge_mah_total", "counter", "Estimated charge we have used since boot",
+                powerStats.getTotalMah());
+
+    printMetricHeader(res, "airtime_seconds_total", "counter", "Time our radio spent sending or receiving");
+    res->printf("meshtastic_airtime_seconds_total{direction=\"tx\"} %.3f\n", getAirtimeMsec(TX_LOG) / 1000.0);
+    res->printf("meshtastic_airtime_seconds_total{direction=\"rx\"} %.3f\n", getAirtimeMsec(RX_LOG) / 1000.0);
+    res->printf("meshtastic_airtime_seconds_total{direction=\"rx_all\"} %.3f\n", getAirtimeMsec(RX_ALL_LOG) / 1000.0);
+
+    printMetricHeader(res, "channel_utilization_percent", "gauge", "How busy our channel has been recently");
+    res->printf("meshtastic_channel_utilization_percent{window=\"1m\"} %.1f\n", channelUtilizationPercent(UTIL_1_MINUTE));
+    res->printf("meshtastic_channel_utilization_percent{window=\"10m\"} %.1f\n", channelUtilizationPercent(UTIL_10_MINUTES));
+
+    if (noiseMonitor) {
+        NoiseStats n = noiseMonitor->getStats();
+        if (n.noiseFloor) {
+            printMetric(res, "noise_floor_dbm", "gauge", "Our channel's average RSSI while nobody is sending",
+                        n.noiseFloor / 16.0);
+            printMetric(res, "noise_baseline_dbm", "gauge", "Our quietest recent noise floor", n.baseline / 16.0);
+        }
+        printMetric(res, "noise_interfered", "gauge", "1 while our noise floor is well above its baseline (interference)",
+                    noiseMonitor->isInterfered());
+        printMetric(res, "noise_interfered_seconds_total", "counter", "Time our noise floor has been well above its baseline",
+                    n.interferedMsec / 1000.0);
+        printMetric(res, "noise_samples_total", "counter", "Idle samples we took of our channel", n.numSamples);
+        printMetric(res, "noise_busy_percent", "gauge", "How often our idle samples heard a preamble", n.busy / 100.0);
+        printMetric(res, "rx_crc_errors_total", "counter", "Frames whose payload was corrupt (usually collisions)", n.crcErrors);
+        printMetric(res, "rx_preambles_lost_total", "counter", "Preambles or frame headers we heard which no frame followed",
+                    n.preamblesLost);
+    }
 
-    res->println("\"status\": \"ok\"");
-    res->println("}");
+    printMetricHeader(res, "https_requests_total", "counter",
+                      "Requests to our HTTPS server, by whether they reused a kept alive connection instead of a new TLS handshake");
+    res->printf("meshtastic_https_requests_total{connection=\"new\"} %u\n", numHttpsRequests - numHttpsReused);
+    res->printf("meshtastic_https_requests_total{connection=\"reused\"} %u\n", numHttpsReused);
+
+    printMetric(res, "uptime_seconds", "gauge", "Seconds since boot", getSecondsSinceBoot());
 }
 
 void handleScanNetworks(HTTPRequest *req, HTTPResponse *res)
@@ -1164,42 +2028,36 @@ void handleScanNetworks(HTTPRequest *req, HTTPResponse *res)
     res->setHeader("Content-Type", "application/json");
     // res->setHeader("Content-Type", "text/html");
 
-    int n = WiFi.scanNetworks();
-    res->println("{");
-    res->println("\"data\": {");
-    if (n == 0) {
-        // No networks found.
-        res->println("\"networks\": []");
+    // A scan takes the radio away from BLE for a couple of seconds, so don't start one while a BLE client syncs our config
+    if (!wifiShouldDefer())
+        startWifiScan();
+
+    JsonWriter json(*res, staticChunk, STATIC_CHUNK_SIZE);
+    if (!haveWifiScan) {
+        // Nothing to show yet, ask them to come back once our first scan is done
+        res->setStatusCode(503);
+        res->setHeader("Retry-After", "5");
+        json.beginObject();
+        json.value("status", wifiScanRunning ? "scanning" : "busy");
+        json.endObject();
+        return;
+    }
 
-    } else {
-        res->println("\"networks\": [");
-
-        for (int i = 0; i < n; ++i) {
-            char ssidArray[50];
-            String ssidString = String(WiFi.SSID(i));
-            // String ssidString = String(WiFi.SSID(i)).toCharArray(ssidArray, WiFi.SSID(i).length());
-            ssidString.replace("\"", "\\\"");
-            ssidString.toCharArray(ssidArray, 50);
-
-            if (WiFi.encryptionType(i) != WIFI_AUTH_OPEN) {
-                // res->println("{\"ssid\": \"%s\",\"rssi\": -75}, ", String(WiFi.SSID(i).c_str() );
-
-                res->printf("{\"ssid\": \"%s\",\"rssi\": %d}", ssidArray, WiFi.RSSI(i));
-                // WiFi.RSSI(i)
-                if (i != n - 1) {
-                    res->printf(",");
-                }
-            }
-            // Yield some cpu cycles to IP stack.
-            //   This is important in case the list is large and it takes us time to return
-            //   to the main loop.
-            yield();
-        }
-        res->println("]");
+    json.beginObject();
+    json.beginObject("data");
+    json.beginArray("networks");
+    for (size_t i = 0; i < numWifiScanNetworks; ++i) {
+        json.beginObject();
+        json.value("ssid", wifiScanNetworks[i].ssid);
+        json.value("rssi", wifiScanNetworks[i].rssi);
+        json.endObject();
     }
-    res->println("},");
-    res->println("\"status\": \"ok\"");
-    res->println("}");
+    json.endArray();
+    json.value("age_seconds", (unsigned long)((millis() - wifiScanMsec) / 1000));
+    json.value("refreshing", wifiScanRunning);
+    json.endObject();
+    json.value("status", "ok");
+    json.endObject();
 }
 
 void handleFavicon(HTTPRequest *req, HTTPResponse *res)
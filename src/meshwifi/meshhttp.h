@@ -9,12 +9,13 @@ void createSSLCert();
 
 void handleNotFound();
 
-void handleWebResponse();
-
 void handleJSONChatHistory();
 
 void notifyWebUI();
 
+/// Have we served an HTTP request within the last windowMsec?
+bool isWebClientActive(uint32_t windowMsec);
+
 void handleHotspot();
 
 void handleStyleCSS();
@@ -72,7 +72,7 @@ void deinitWifi()
 
     if (isWifiAvailable()) {
         WiFi.mode(WIFI_MODE_NULL);
-        DEBUG_MSG("WiFi Turned Off\n");
+        LOG_DEBUG(HTTP, "WiFi Turned Off\n");
         // WiFi.printDiag(Serial);
     }
 }
@@ -101,7 +101,7 @@ void initWifi(bool forceSoftAP)
         if ((*wifiName && *wifiPsw) || forceSoftAP) {
             if (forceSoftAP) {
 
-                DEBUG_MSG("Forcing SoftAP\n");
+                LOG_DEBUG(HTTP, "Forcing SoftAP\n");
 
                 const char *softAPssid = "meshtasticAdmin";
                 const char *softAPpasswd = "12345678";
@@ -110,8 +110,8 @@ void initWifi(bool forceSoftAP)
                 WiFi.onEvent(WiFiEvent);
 
                 WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
-                DEBUG_MSG("STARTING WIFI AP: ssid=%s, ok=%d\n", softAPssid, WiFi.softAP(softAPssid, softAPpasswd));
-                DEBUG_MSG("MY IP ADDRESS: %s\n", WiFi.softAPIP().toString().c_str());
+                LOG_DEBUG(HTTP, "STARTING WIFI AP: ssid=%s, ok=%d\n", softAPssid, WiFi.softAP(softAPssid, softAPpasswd));
+                LOG_DEBUG(HTTP, "MY IP ADDRESS: %s\n", WiFi.softAPIP().toString().c_str());
 
                 dnsServer.start(53, "*", apIP);
 
@@ -121,8 +121,8 @@ void initWifi(bool forceSoftAP)
                 WiFi.onEvent(WiFiEvent);
 
                 WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
-                DEBUG_MSG("STARTING WIFI AP: ssid=%s, ok=%d\n", wifiName, WiFi.softAP(wifiName, wifiPsw));
-                DEBUG_MSG("MY IP ADDRESS: %s\n", WiFi.softAPIP().toString().c_str());
+                LOG_DEBUG(HTTP, "STARTING WIFI AP: ssid=%s, ok=%d\n", wifiName, WiFi.softAP(wifiName, wifiPsw));
+                LOG_DEBUG(HTTP, "MY IP ADDRESS: %s\n", WiFi.softAPIP().toString().c_str());
 
                 dnsServer.start(53, "*", apIP);
 
@@ -131,7 +131,7 @@ void initWifi(bool forceSoftAP)
                 getMacAddr(dmac);
                 sprintf(ourHost, "Meshtastic-%02x%02x", dmac[4], dmac[5]);
 
-                Serial.println(ourHost);
+                LOG_DEBUG(HTTP, "Our hostname is %s\n", ourHost);
 
                 WiFi.mode(WIFI_MODE_STA);
                 WiFi.setHostname(ourHost);
@@ -141,8 +141,7 @@ void initWifi(bool forceSoftAP)
                 // WiFiEventId_t eventID = WiFi.onEvent(
                 WiFi.onEvent(
                     [](WiFiEvent_t event, WiFiEventInfo_t info) {
-                        Serial.print("\nWiFi lost connection. Reason: ");
-                        Serial.println(info.disconnected.reason);
+                        LOG_WARN(HTTP, "WiFi lost connection. Reason: %d\n", info.disconnected.reason);
 
                         /*
                            If we are disconnected from the AP for some reason,
@@ -155,29 +154,29 @@ void initWifi(bool forceSoftAP)
                     },
                     WiFiEvent_t::SYSTEM_EVENT_STA_DISCONNECTED);
 
-                DEBUG_MSG("JOINING WIFI: ssid=%s\n", wifiName);
+                LOG_DEBUG(HTTP, "JOINING WIFI: ssid=%s\n", wifiName);
                 if (WiFi.begin(wifiName, wifiPsw) == WL_CONNECTED) {
-                    DEBUG_MSG("MY IP ADDRESS: %s\n", WiFi.localIP().toString().c_str());
+                    LOG_DEBUG(HTTP, "MY IP ADDRESS: %s\n", WiFi.localIP().toString().c_str());
                 } else {
-                    DEBUG_MSG("Started Joining WIFI\n");
+                    LOG_DEBUG(HTTP, "Started Joining WIFI\n");
                 }
             }
         }
 
         if (!MDNS.begin("Meshtastic")) {
-            DEBUG_MSG("Error setting up MDNS responder!\n");
+            LOG_ERROR(HTTP, "Error setting up MDNS responder!\n");
 
             while (1) {
                 delay(1000);
             }
         }
-        DEBUG_MSG("mDNS responder started\n");
-        DEBUG_MSG("mDNS Host: Meshtastic.local\n");
+        LOG_DEBUG(HTTP, "mDNS responder started\n");
+        LOG_DEBUG(HTTP, "mDNS Host: Meshtastic.local\n");
         MDNS.addService("http", "tcp", 80);
         MDNS.addService("https", "tcp", 443);
 
     } else
-        DEBUG_MSG("Not using WIFI\n");
+        LOG_DEBUG(HTTP, "Not using WIFI\n");
 }
 
 static void initApiServer()
@@ -192,112 +191,110 @@ static void initApiServer()
 // Called by the Espressif SDK to
 static void WiFiEvent(WiFiEvent_t event)
 {
-    DEBUG_MSG("************ [WiFi-event] event: %d ************\n", event);
+    LOG_DEBUG(HTTP, "************ [WiFi-event] event: %d ************\n", event);
 
     switch (event) {
     case SYSTEM_EVENT_WIFI_READY:
-        DEBUG_MSG("WiFi interface ready\n");
+        LOG_DEBUG(HTTP, "WiFi interface ready\n");
         break;
     case SYSTEM_EVENT_SCAN_DONE:
-        DEBUG_MSG("Completed scan for access points\n");
+        LOG_DEBUG(HTTP, "Completed scan for access points\n");
         break;
     case SYSTEM_EVENT_STA_START:
-        DEBUG_MSG("WiFi client started\n");
+        LOG_DEBUG(HTTP, "WiFi client started\n");
         break;
     case SYSTEM_EVENT_STA_STOP:
-        DEBUG_MSG("WiFi clients stopped\n");
+        LOG_DEBUG(HTTP, "WiFi clients stopped\n");
         break;
     case SYSTEM_EVENT_STA_CONNECTED:
-        DEBUG_MSG("Connected to access point\n");
+        LOG_DEBUG(HTTP, "Connected to access point\n");
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
-        DEBUG_MSG("Disconnected from WiFi access point\n");
+        LOG_DEBUG(HTTP, "Disconnected from WiFi access point\n");
         // Event 5
 
         reconnectWiFi();
         break;
     case SYSTEM_EVENT_STA_AUTHMODE_CHANGE:
-        DEBUG_MSG("Authentication mode of access point has changed\n");
+        LOG_DEBUG(HTTP, "Authentication mode of access point has changed\n");
         break;
     case SYSTEM_EVENT_STA_GOT_IP:
-        DEBUG_MSG("Obtained IP address: \n");
-        Serial.println(WiFi.localIP());
+        LOG_DEBUG(HTTP, "Obtained IP address: %s\n", WiFi.localIP().toString().c_str());
 
         if (!APStartupComplete) {
             // Start web server
-            DEBUG_MSG("... Starting network services\n");
+            LOG_DEBUG(HTTP, "... Starting network services\n");
             initWebServer();
             initApiServer();
 
             APStartupComplete = true;
         } else {
-            DEBUG_MSG("... Not starting network services (They're already running)\n");
+            LOG_DEBUG(HTTP, "... Not starting network services (They're already running)\n");
         }
 
         break;
     case SYSTEM_EVENT_STA_LOST_IP:
-        DEBUG_MSG("Lost IP address and IP address is reset to 0\n");
+        LOG_DEBUG(HTTP, "Lost IP address and IP address is reset to 0\n");
         break;
     case SYSTEM_EVENT_STA_WPS_ER_SUCCESS:
-        DEBUG_MSG("WiFi Protected Setup (WPS): succeeded in enrollee mode\n");
+        LOG_DEBUG(HTTP, "WiFi Protected Setup (WPS): succeeded in enrollee mode\n");
         break;
     case SYSTEM_EVENT_STA_WPS_ER_FAILED:
-        DEBUG_MSG("WiFi Protected Setup (WPS): failed in enrollee mode\n");
+        LOG_ERROR(HTTP, "WiFi Protected Setup (WPS): failed in enrollee mode\n");
         break;
     case SYSTEM_EVENT_STA_WPS_ER_TIMEOUT:
-        DEBUG_MSG("WiFi Protected Setup (WPS): timeout in enrollee mode\n");
+        LOG_WARN(HTTP, "WiFi Protected Setup (WPS): timeout in enrollee mode\n");
         break;
     case SYSTEM_EVENT_STA_WPS_ER_PIN:
-        DEBUG_MSG("WiFi Protected Setup (WPS): pin code in enrollee mode\n");
+        LOG_DEBUG(HTTP, "WiFi Protected Setup (WPS): pin code in enrollee mode\n");
         break;
     case SYSTEM_EVENT_AP_START:
-        DEBUG_MSG("WiFi access point started\n");
-        Serial.println(WiFi.softAPIP());
+        LOG_DEBUG(HTTP, "WiFi access point started: %s\n", WiFi.softAPIP().toString().c_str());
 
         if (!APStartupComplete) {
             // Start web server
-            DEBUG_MSG("... Starting network services\n");
+            LOG_DEBUG(HTTP, "... Starting network services\n");
             initWebServer();
             initApiServer();
 
             APStartupComplete = true;
         } else {
-            DEBUG_MSG("... Not starting network services (They're already running)\n");
+            LOG_DEBUG(HTTP, "... Not starting network services (They're already running)\n");
         }
 
         break;
     case SYSTEM_EVENT_AP_STOP:
-        DEBUG_MSG("WiFi access point stopped\n");
+        LOG_DEBUG(HTTP, "WiFi access point stopped\n");
         break;
     case SYSTEM_EVENT_AP_STACONNECTED:
-        DEBUG_MSG("Client connected\n");
+        LOG_DEBUG(HTTP, "Client connected\n");
         break;
     case SYSTEM_EVENT_AP_STADISCONNECTED:
-        DEBUG_MSG("Client disconnected\n");
+        LOG_DEBUG(HTTP, "Client disconnected\n");
         break;
     case SYSTEM_EVENT_AP_STAIPASSIGNED:
-        DEBUG_MSG("Assigned IP address to client\n");
+        LOG_DEBUG(HTTP, "Assigned IP address to client\n");
         break;
     case SYSTEM_EVENT_AP_PROBEREQRECVED:
-        DEBUG_MSG("Received probe request\n");
+        LOG_DEBUG(HTTP, "Received probe request\n");
         break;
     case SYSTEM_EVENT_GOT_IP6:
-        DEBUG_MSG("IPv6 is preferred\n");
+        LOG_DEBUG(HTTP, "IPv6 is preferred\n");
         break;
     case SYSTEM_EVENT_ETH_START:
-        DEBUG_MSG("Ethernet started\n");
+        LOG_DEBUG(HTTP, "Ethernet started\n");
         break;
     case SYSTEM_EVENT_ETH_STOP:
-        DEBUG_MSG("Ethernet stopped\n");
+        LOG_DEBUG(HTTP, "Ethernet stopped\n");
         break;
     case SYSTEM_EVENT_ETH_CONNECTED:
-        DEBUG_MSG("Ethernet connected\n");
+        LOG_DEBUG(HTTP, "Ethernet connected\n");
         break;
     case SYSTEM_EVENT_ETH_DISCONNECTED:
-        DEBUG_MSG("Ethernet disconnected\n");
+        LOG_DEBUG(HTTP, "Ethernet disconnected\n");
         break;
     case SYSTEM_EVENT_ETH_GOT_IP:
-        DEBUG_MSG("Obtained IP address\n");
+        LOG_DEBUG(HTTP, "Obtained IP address\n");
         break;
     default:
         break;
@@ -320,7 +317,7 @@ void reconnectWiFi()
 
         if (*wifiName && *wifiPsw) {
 
-            DEBUG_MSG("... Reconnecting to WiFi access point");
+            LOG_DEBUG(HTTP, "... Reconnecting to WiFi access point");
 
             WiFi.mode(WIFI_MODE_STA);
             WiFi.begin(wifiName, wifiPsw);
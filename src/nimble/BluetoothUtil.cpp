@@ -67,11 +67,6 @@ void deinitBLE()
     DEBUG_MSG("Done shutting down bluetooth\n");
 }
 
-void loopBLE()
-{
-    // FIXME
-}
-
 extern "C" void ble_store_config_init(void);
 
 /// Print a macaddr - bytes are sometimes stored in reverse order
@@ -105,6 +100,25 @@ static void print_conn_desc(struct ble_gap_conn_desc *desc)
 
 static void advertise();
 
+/**
+ * Ask for the fastest link this connection supports, so a config download (or any burst of FromRadios) takes fewer
+ * connection events: the biggest MTU we can get, and the 2M PHY and longest link layer packets if our controller has them.
+ */
+static void requestFastLink(uint16_t connHandle)
+{
+    int rc = ble_gattc_exchange_mtu(connHandle, NULL, NULL); // We already set our preferred MTU of 512 at init
+    if (rc != 0)
+        DEBUG_MSG("MTU exchange failed, rc=%d\n", rc);
+
+#if MYNEWT_VAL(BLE_LL_CFG_FEAT_LE_2M_PHY)
+    ble_gap_set_prefered_le_phy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+#endif
+
+#if MYNEWT_VAL(BLE_LL_CFG_FEAT_DATA_LEN_EXT)
+    ble_gap_set_data_len(connHandle, 251, 2120); // The max PDU payload, and the time it takes at 1M
+#endif
+}
+
 /**
  * The nimble host executes this callback when a GAP event occurs.  The
  * application associates a GAP event callback with each connection that forms.
@@ -135,6 +149,8 @@ static int gap_event(struct ble_gap_event *event, void *arg)
             assert(rc == 0);
             print_conn_desc(&desc);
             curConnectionHandle = event->connect.conn_handle;
+            requestFastLink(curConnectionHandle);
+            bluetoothLinkManager->onConnect(curConnectionHandle);
         }
         DEBUG_MSG("\n");
 
@@ -150,6 +166,10 @@ static int gap_event(struct ble_gap_event *event, void *arg)
         DEBUG_MSG("\n");
 
         curConnectionHandle = -1;
+        if (bluetoothPhoneAPI) {
+            bluetoothPhoneAPI->onDisconnect();
+            bluetoothLinkManager->onDisconnect();
+        }
 
         /* Connection terminated; resume advertising. */
         advertise();
@@ -187,6 +207,13 @@ static int gap_event(struct ble_gap_event *event, void *arg)
                   event->subscribe.conn_handle, event->subscribe.attr_handle, event->subscribe.reason,
                   event->subscribe.prev_notify, event->subscribe.cur_notify, event->subscribe.prev_indicate,
                   event->subscribe.cur_indicate);
+        if (event->subscribe.attr_handle == fromRadioBatchValHandle)
+            bluetoothPhoneAPI->setStreaming(event->subscribe.cur_notify);
+        return 0;
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (event->notify_tx.attr_handle == fromRadioBatchValHandle && event->notify_tx.status == 0)
+            bluetoothPhoneAPI->onNotifySent();
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -376,10 +403,14 @@ void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
             fromNumValHandle = ctxt->chr.val_handle;
             // DEBUG_MSG("FromNum handle %d\n", fromNumValHandle);
         }
+        if (ctxt->chr.chr_def->uuid == &fromradiobatch_uuid.u)
+            fromRadioBatchValHandle = ctxt->chr.val_handle;
         if (ctxt->chr.chr_def->uuid == &update_result_uuid.u) {
             updateResultHandle = ctxt->chr.val_handle;
             // DEBUG_MSG("update result handle %d\n", updateResultHandle);
         }
+        if (ctxt->chr.chr_def->uuid == &update_ack_uuid.u)
+            updateAckHandle = ctxt->chr.val_handle;
         break;
 
     case BLE_GATT_REGISTER_OP_DSC:
@@ -474,6 +505,7 @@ void reinitBluetooth()
     if (isFirstTime) {
         bluetoothPhoneAPI = new BluetoothPhoneAPI();
         bluetoothPhoneAPI->init();
+        bluetoothLinkManager = new NimbleLinkManager(bluetoothPhoneAPI);
     }
 
     // FIXME - if waking from light sleep, only esp_nimble_hci_init?
@@ -536,7 +568,7 @@ void setBluetoothEnable(bool on)
 
         bluetoothOn = on;
         if (on) {
-            Serial.printf("Pre BT: %u heap size\n", ESP.getFreeHeap());
+            DEBUG_MSG("Pre BT: %u heap size\n", ESP.getFreeHeap());
             // ESP_ERROR_CHECK( heap_trace_start(HEAP_TRACE_LEAKS) );
             reinitBluetooth();
 
@@ -562,7 +594,7 @@ void setBluetoothEnable(bool on)
             // We have to totally teardown our bluetooth objects to prevent leaks
             deinitBLE();
 
-            Serial.printf("Shutdown BT: %u heap size\n", ESP.getFreeHeap());
+            DEBUG_MSG("Shutdown BT: %u heap size\n", ESP.getFreeHeap());
             // ESP_ERROR_CHECK( heap_trace_stop() );
             // heap_trace_dump();
         }
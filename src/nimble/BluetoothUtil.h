@@ -13,7 +13,6 @@ using StopBluetoothPinScreenCallback = std::function<void(void)>;
 /// Given a level between 0-100, update the BLE attribute
 void updateBatteryLevel(uint8_t level);
 void deinitBLE();
-void loopBLE();
 void reinitBluetooth();
 void disablePin();
 
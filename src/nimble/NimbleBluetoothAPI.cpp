@@ -1,5 +1,6 @@
 #include "NimbleBluetoothAPI.h"
 #include "PhoneAPI.h"
+#include "concurrency/MainThread.h"
 #include "configuration.h"
 #include "nimble/BluetoothUtil.h"
 #include "nimble/NimbleDefs.h"
@@ -8,21 +9,114 @@
 // This scratch buffer is used for various bluetooth reads/writes - but it is safe because only one bt operation can be in
 // proccess at once
 static uint8_t trBytes[FromRadio_size < ToRadio_size ? ToRadio_size : FromRadio_size];
+
+// Batched reads get their own buffer, because they are much bigger than any of our other reads/writes
+static uint8_t batchBytes[FROMRADIO_BATCH_MAX_LEN];
+
+// Batches we push as notifies are built on our own thread, so they can't share batchBytes with the nimble callbacks
+static uint8_t streamBytes[FROMRADIO_BATCH_MAX_LEN];
 static uint32_t fromNum;
 
-uint16_t fromNumValHandle;
+uint16_t fromNumValHandle, fromRadioBatchValHandle;
 
 /// We only allow one BLE connection at a time
 int16_t curConnectionHandle = -1;
 
-PhoneAPI *bluetoothPhoneAPI;
+BluetoothPhoneAPI *bluetoothPhoneAPI;
+NimbleLinkManager *bluetoothLinkManager;
+
+bool NimbleLinkManager::requestParams(uint16_t conn, const BluetoothLinkParams &params)
+{
+    struct ble_gap_upd_params p = {};
+    p.itvl_min = params.minInterval;
+    p.itvl_max = params.maxInterval;
+    p.latency = params.latency;
+    p.supervision_timeout = params.timeout;
+
+    int rc = ble_gap_update_params(conn, &p);
+    if (rc != 0)
+        DEBUG_MSG("BLE conn param update failed, rc=%d\n", rc);
+    return rc == 0;
+}
+
+/// The biggest batch we can send to this connection in one ATT payload, always room for at least one FromRadio
+static size_t getBatchLen(uint16_t connHandle, size_t headerLen)
+{
+    size_t maxLen = ble_att_mtu(connHandle) - headerLen;
+    if (maxLen < FROMRADIO_BATCH_MIN_LEN)
+        maxLen = FROMRADIO_BATCH_MIN_LEN;
+    else if (maxLen > sizeof(batchBytes))
+        maxLen = sizeof(batchBytes);
+    return maxLen;
+}
+
+void BluetoothPhoneAPI::setStreaming(bool enabled)
+{
+    DEBUG_MSG("BLE fromRadio streaming %s\n", enabled ? "on" : "off");
+    streaming = enabled;
+    if (enabled)
+        wakeStream();
+}
+
+void BluetoothPhoneAPI::onNotifySent()
+{
+    if (notifiesInFlight)
+        notifiesInFlight--;
+    wakeStream();
+}
+
+void BluetoothPhoneAPI::wakeStream()
+{
+    if (streaming) {
+        setInterval(0);
+        getController()->wake();
+    }
+}
+
+void BluetoothPhoneAPI::onDisconnect()
+{
+    streaming = false;
+    notifiesInFlight = 0;
+    pendingLen = 0;
+}
+
+int32_t BluetoothPhoneAPI::runOnce()
+{
+    for (int i = 0; i < BLE_STREAM_MAX_PER_RUN; i++) {
+        if (!streaming || curConnectionHandle < 0 || notifiesInFlight >= BLE_STREAM_MAX_INFLIGHT)
+            return INT32_MAX; // Wait until we are woken by a subscribe, a sent notify or new data
+
+        uint16_t conn = curConnectionHandle;
+        if (!pendingLen) {
+            // A notify payload is the MTU less its opcode and handle
+            pendingLen = getFromRadioBatch(streamBytes, getBatchLen(conn, 3));
+            if (!pendingLen)
+                return INT32_MAX; // Caught up
+        }
+
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(streamBytes, pendingLen);
+        if (!om)
+            return 50; // Nimble is out of mbufs, try again soon
+
+        notifiesInFlight++;
+        if (ble_gattc_notify_custom(conn, fromRadioBatchValHandle, om) != 0) {
+            notifiesInFlight--;
+            return 50;
+        }
+        pendingLen = 0;
+    }
+
+    return 0; // More might be waiting, but let our other threads run first
+}
 
 void BluetoothPhoneAPI::onNowHasData(uint32_t fromRadioNum)
 {
     PhoneAPI::onNowHasData(fromRadioNum);
 
     fromNum = fromRadioNum;
-    if (curConnectionHandle >= 0 && fromNumValHandle) {
+    if (streaming)
+        wakeStream(); // The client gets the packets themselves, no need to tell it to read
+    else if (curConnectionHandle >= 0 && fromNumValHandle) {
         DEBUG_MSG("BLE notify fromNum\n");
         auto res = ble_gattc_notify(curConnectionHandle, fromNumValHandle);
         assert(res == 0);
@@ -43,13 +137,18 @@ int toradio_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt
 
     /// DEBUG_MSG("toRadioWriteCb data %p, len %u\n", trBytes, len);
 
-    bluetoothPhoneAPI->handleToRadio(trBytes, len);
+    // We are on the Nimble host task, our PhoneAPI (and everything it talks to) belongs to the main thread
+    concurrency::runOnMainThread([len]() {
+        bluetoothPhoneAPI->handleToRadio(trBytes, len);
+        bluetoothPhoneAPI->wakeStream();
+    });
     return 0;
 }
 
 int fromradio_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    size_t numBytes = bluetoothPhoneAPI->getFromRadio(trBytes);
+    size_t numBytes;
+    concurrency::runOnMainThread([&]() { numBytes = bluetoothPhoneAPI->getFromRadio(trBytes); });
 
     DEBUG_MSG("BLE fromRadio called omlen=%d, ourlen=%d\n", OS_MBUF_PKTLEN(ctxt->om),
               numBytes); // the normal case has omlen 1 here
@@ -62,6 +161,21 @@ int fromradio_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_ga
     return 0; // success
 }
 
+int fromradiobatch_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    // Fill one ATT payload if we can (so the client doesn't need a long read), a read response has a one byte header
+    size_t numBytes;
+    concurrency::runOnMainThread(
+        [&]() { numBytes = bluetoothPhoneAPI->getFromRadioBatch(batchBytes, getBatchLen(conn_handle, 1)); });
+
+    DEBUG_MSG("BLE fromRadioBatch called omlen=%d, ourlen=%d\n", OS_MBUF_PKTLEN(ctxt->om), numBytes);
+
+    auto rc = os_mbuf_append(ctxt->om, batchBytes, numBytes);
+    assert(rc == 0);
+
+    return 0; // success
+}
+
 int fromnum_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
     return chr_readwrite32le(&fromNum, ctxt);
@@ -1,15 +1,62 @@
 #pragma once
 
+#include "BluetoothCommon.h"
 #include "PhoneAPI.h"
+#include "concurrency/OSThread.h"
+#include <atomic>
 
-extern uint16_t fromNumValHandle;
+extern uint16_t fromNumValHandle, fromRadioBatchValHandle;
 
-class BluetoothPhoneAPI : public PhoneAPI
+/// Notifies we let nimble queue before waiting for one to be sent, so we don't exhaust its mbufs
+#define BLE_STREAM_MAX_INFLIGHT 4
+
+/**
+ * Our PhoneAPI for BLE, its thread pushes FromRadio batches as notifies to clients who subscribed to fromradiobatch
+ */
+class BluetoothPhoneAPI : public PhoneAPI, public concurrency::OSThread
 {
+    bool streaming = false;
+
+    /// Notifies nimble hasn't finished sending yet, decremented from the nimble task
+    std::atomic<uint8_t> notifiesInFlight;
+
+    /// A batch we pulled from PhoneAPI but couldn't notify yet (out of mbufs), we send it first next time
+    size_t pendingLen = 0;
+
+  public:
+    BluetoothPhoneAPI() : OSThread("BLEStream"), notifiesInFlight(0) {}
+
+    /// The client (un)subscribed to fromradiobatch notifies
+    void setStreaming(bool enabled);
+
+    /// Nimble finished sending one of our notifies
+    void onNotifySent();
+
+    /// Something (i.e. a want_config from the client) might have made new FromRadios available, push them soon
+    void wakeStream();
+
+    /// Our BLE connection went away, forget any streaming state
+    void onDisconnect();
+
+  protected:
+    virtual int32_t runOnce();
+
     /**
      * Subclasses can use this as a hook to provide custom notifications for their transport (i.e. bluetooth notifies)
      */
     virtual void onNowHasData(uint32_t fromRadioNum);
 };
 
-extern PhoneAPI *bluetoothPhoneAPI;
\ No newline at end of file
+extern BluetoothPhoneAPI *bluetoothPhoneAPI;
+
+/// Asks nimble for the connection parameters BluetoothLinkManager picks
+class NimbleLinkManager : public BluetoothLinkManager
+{
+  public:
+    NimbleLinkManager(PhoneAPI *api) : BluetoothLinkManager(api) {}
+
+  protected:
+    virtual bool requestParams(uint16_t conn, const BluetoothLinkParams &params);
+};
+
+extern NimbleLinkManager *bluetoothLinkManager;
\ No newline at end of file
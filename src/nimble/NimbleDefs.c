@@ -11,6 +11,9 @@ static const ble_uuid128_t toradio_uuid =
 static const ble_uuid128_t fromradio_uuid =
     BLE_UUID128_INIT(0xd5, 0x54, 0xe4, 0xc5, 0x25, 0xc5, 0x31, 0xa5, 0x55, 0x4a, 0x02, 0xee, 0xc2, 0xbc, 0xa2, 0x8b);
 
+const ble_uuid128_t fromradiobatch_uuid =
+    BLE_UUID128_INIT(0xd6, 0x54, 0xe4, 0xc5, 0x25, 0xc5, 0x31, 0xa5, 0x55, 0x4a, 0x02, 0xee, 0xc2, 0xbc, 0xa2, 0x8b);
+
 const ble_uuid128_t fromnum_uuid =
     BLE_UUID128_INIT(0x53, 0x44, 0xe3, 0x47, 0x75, 0xaa, 0x70, 0xa6, 0x66, 0x4f, 0x00, 0xa8, 0x8c, 0xa1, 0x9d, 0xed);
 
@@ -30,6 +33,11 @@ const struct ble_gatt_svc_def gatt_svr_svcs[] = {
                                             .access_cb = fromradio_callback,
                                             .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_AUTHEN,
                                         },
+                                        {
+                                            .uuid = &fromradiobatch_uuid.u,
+                                            .access_cb = fromradiobatch_callback,
+                                            .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_AUTHEN | BLE_GATT_CHR_F_NOTIFY,
+                                        },
                                         {
                                             .uuid = &fromnum_uuid.u,
                                             .access_cb = fromnum_callback,
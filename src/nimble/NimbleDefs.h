@@ -21,11 +21,13 @@ int toradio_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt
 
 int fromradio_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 
+int fromradiobatch_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
+
 int fromnum_callback(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 extern const struct ble_gatt_svc_def gatt_svr_svcs[];
 
-extern const ble_uuid128_t mesh_service_uuid, fromnum_uuid;
+extern const ble_uuid128_t mesh_service_uuid, fromnum_uuid, fromradiobatch_uuid;
 
 #ifdef __cplusplus
 };
@@ -1,6 +1,8 @@
 #include "NRF52Bluetooth.h"
 #include "BluetoothCommon.h"
 #include "configuration.h"
+#include "concurrency/MainThread.h"
+#include "concurrency/OSThread.h"
 #include "main.h"
 #include <bluefruit.h>
 
@@ -10,6 +12,7 @@ static BLEService meshBleService = BLEService(BLEUuid(MESH_SERVICE_UUID_16));
 static BLECharacteristic fromNum = BLECharacteristic(BLEUuid(FROMNUM_UUID_16));
 static BLECharacteristic fromRadio = BLECharacteristic(BLEUuid(FROMRADIO_UUID_16));
 static BLECharacteristic toRadio = BLECharacteristic(BLEUuid(TORADIO_UUID_16));
+static BLECharacteristic fromRadioBatch = BLECharacteristic(BLEUuid(FROMRADIOBATCH_UUID_16));
 
 static BLEDis bledis; // DIS (Device Information Service) helper class instance
 static BLEBas blebas; // BAS (Battery Service) helper class instance
@@ -20,9 +23,87 @@ static BLEDfu bledfu; // DFU software update helper service
 // static uint8_t trBytes[_max(_max(_max(_max(ToRadio_size, RadioConfig_size), User_size), MyNodeInfo_size), FromRadio_size)];
 static uint8_t fromRadioBytes[FromRadio_size];
 static uint8_t toRadioBytes[ToRadio_size];
+static uint8_t fromRadioBatchBytes[FROMRADIO_BATCH_MAX_LEN];
 
-class BluetoothPhoneAPI : public PhoneAPI
+// Batches we push as notifies are built on our own thread, so they can't share fromRadioBatchBytes with the read callback
+static uint8_t streamBytes[FROMRADIO_BATCH_MAX_LEN];
+
+/// The MTU we ask for, the most bluefruit supports
+#define BLE_MAX_MTU 247
+
+/// How many notifies the softdevice can queue per connection, more lets a stream fill each connection event
+#define BLE_HVN_QUEUE_SIZE 8
+
+/// Always leave room for one FromRadio, if the MTU is smaller than that the client will need a long read
+static size_t getBatchLen(uint16_t conn_hdl, size_t headerLen)
+{
+    size_t maxLen = Bluefruit.Connection(conn_hdl)->getMtu() - headerLen;
+    if (maxLen < FROMRADIO_BATCH_MIN_LEN)
+        maxLen = FROMRADIO_BATCH_MIN_LEN;
+    else if (maxLen > sizeof(fromRadioBatchBytes))
+        maxLen = sizeof(fromRadioBatchBytes);
+    return maxLen;
+}
+
+/**
+ * Our PhoneAPI for BLE, its thread pushes FromRadio batches as notifies to clients who subscribed to fromradiobatch.
+ *
+ * We push from the main loop rather than the BLE callbacks, because notify() blocks while the softdevice queue is full and
+ * it is the BLE task which frees those slots.  That blocking is our flow control.
+ */
+class BluetoothPhoneAPI : public PhoneAPI, public concurrency::OSThread
 {
+    bool streaming = false;
+    uint16_t streamConn = 0;
+
+    /// A batch we pulled from PhoneAPI but couldn't notify yet, we send it first next time
+    size_t pendingLen = 0;
+
+  public:
+    BluetoothPhoneAPI() : OSThread("BLEStream") {}
+
+    /// The client (un)subscribed to fromradiobatch notifies
+    void setStreaming(uint16_t conn_hdl, bool enabled)
+    {
+        DEBUG_MSG("BLE fromRadio streaming %s\n", enabled ? "on" : "off");
+        streaming = enabled;
+        streamConn = conn_hdl;
+        if (!enabled)
+            pendingLen = 0;
+        wakeStream();
+    }
+
+    /// Something (i.e. a want_config from the client) might have made new FromRadios available, push them soon
+    void wakeStream()
+    {
+        if (streaming) {
+            setInterval(0);
+            getController()->wake();
+        }
+    }
+
+  protected:
+    virtual int32_t runOnce()
+    {
+        for (int i = 0; i < BLE_STREAM_MAX_PER_RUN; i++) {
+            if (!streaming || !Bluefruit.connected(streamConn))
+                return INT32_MAX; // Wait until we are woken by a subscribe or new data
+
+            if (!pendingLen) {
+                // A notify payload is the MTU less its opcode and handle
+                pendingLen = getFromRadioBatch(streamBytes, getBatchLen(streamConn, 3));
+                if (!pendingLen)
+                    return INT32_MAX; // Caught up
+            }
+
+            if (!fromRadioBatch.notify(streamConn, streamBytes, pendingLen))
+                return 50; // Softdevice queue still full (or the client went away), try again soon
+            pendingLen = 0;
+        }
+
+        return 0; // More might be waiting, but let our other threads run first
+    }
+
     /**
      * Subclasses can use this as a hook to provide custom notifications for their transport (i.e. bluetooth notifies)
      */
@@ -30,13 +111,34 @@ class BluetoothPhoneAPI : public PhoneAPI
     {
         PhoneAPI::onNowHasData(fromRadioNum);
 
-        DEBUG_MSG("BLE notify fromNum\n");
-        fromNum.notify32(fromRadioNum);
+        if (streaming)
+            wakeStream(); // The client gets the packets themselves, no need to tell it to read
+        else {
+            DEBUG_MSG("BLE notify fromNum\n");
+            fromNum.notify32(fromRadioNum);
+        }
     }
 };
 
 static BluetoothPhoneAPI *bluetoothPhoneAPI;
 
+/// Asks bluefruit for the connection parameters BluetoothLinkManager picks
+class NRF52LinkManager : public BluetoothLinkManager
+{
+  public:
+    NRF52LinkManager(PhoneAPI *api) : BluetoothLinkManager(api) {}
+
+  protected:
+    virtual bool requestParams(uint16_t conn, const BluetoothLinkParams &params)
+    {
+        // Bluefruit only takes one interval, so ask for the low end of our range
+        BLEConnection *connection = Bluefruit.Connection(conn);
+        return connection && connection->requestConnectionParameter(params.minInterval, params.latency, params.timeout);
+    }
+};
+
+static NRF52LinkManager *linkManager;
+
 void connect_callback(uint16_t conn_handle)
 {
     // Get the reference to current connection
@@ -46,6 +148,13 @@ void connect_callback(uint16_t conn_handle)
     connection->getPeerName(central_name, sizeof(central_name));
 
     DEBUG_MSG("BLE Connected to %s\n", central_name);
+
+    // Ask for the fastest link the central supports, so a config download takes fewer connection events
+    connection->requestPHY(); // 2M if the central has it
+    connection->requestDataLengthUpdate();
+    connection->requestMtuExchange(BLE_MAX_MTU);
+
+    linkManager->onConnect(conn_handle);
 }
 
 /**
@@ -55,9 +164,10 @@ void connect_callback(uint16_t conn_handle)
  */
 void disconnect_callback(uint16_t conn_handle, uint8_t reason)
 {
-    (void)conn_handle;
-
     DEBUG_MSG("BLE Disconnected, reason = 0x%x\n", reason);
+
+    bluetoothPhoneAPI->setStreaming(conn_handle, false);
+    linkManager->onDisconnect();
 }
 
 void cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t cccd_value)
@@ -73,7 +183,8 @@ void cccd_callback(uint16_t conn_hdl, BLECharacteristic *chr, uint16_t cccd_valu
         } else {
             DEBUG_MSG("fromNum 'Notify' disabled\n");
         }
-    }
+    } else if (chr->uuid == fromRadioBatch.uuid)
+        bluetoothPhoneAPI->setStreaming(conn_hdl, chr->notifyEnabled(conn_hdl));
 }
 
 void startAdv(void)
@@ -121,7 +232,9 @@ void fromRadioAuthorizeCb(uint16_t conn_hdl, BLECharacteristic *chr, ble_gatts_e
     if (request->offset == 0) {
         // If the read is long, we will get multiple authorize invocations - we only populate data on the first
 
-        size_t numBytes = bluetoothPhoneAPI->getFromRadio(fromRadioBytes);
+        // We are on the bluefruit task, our PhoneAPI (and everything it talks to) belongs to the main thread
+        size_t numBytes;
+        concurrency::runOnMainThread([&]() { numBytes = bluetoothPhoneAPI->getFromRadio(fromRadioBytes); });
 
         // DEBUG_MSG("fromRadioAuthorizeCb numBytes=%u\n", numBytes);
         // if (numBytes >= 2) DEBUG_MSG("fromRadio bytes %x %x\n", fromRadioBytes[0], fromRadioBytes[1]);
@@ -135,11 +248,29 @@ void fromRadioAuthorizeCb(uint16_t conn_hdl, BLECharacteristic *chr, ble_gatts_e
     authorizeRead(conn_hdl);
 }
 
+/**
+ * Like fromRadioAuthorizeCb, but we fill one ATT payload (if we can) with as many FromRadio packets as fit
+ */
+void fromRadioBatchAuthorizeCb(uint16_t conn_hdl, BLECharacteristic *chr, ble_gatts_evt_read_t *request)
+{
+    if (request->offset == 0) {
+        // A read response has a one byte header
+        size_t numBytes;
+        concurrency::runOnMainThread(
+            [&]() { numBytes = bluetoothPhoneAPI->getFromRadioBatch(fromRadioBatchBytes, getBatchLen(conn_hdl, 1)); });
+        fromRadioBatch.write(fromRadioBatchBytes, numBytes);
+    }
+    authorizeRead(conn_hdl);
+}
+
 void toRadioWriteCb(uint16_t conn_hdl, BLECharacteristic *chr, uint8_t *data, uint16_t len)
 {
     DEBUG_MSG("toRadioWriteCb data %p, len %u\n", data, len);
 
-    bluetoothPhoneAPI->handleToRadio(data, len);
+    concurrency::runOnMainThread([&]() {
+        bluetoothPhoneAPI->handleToRadio(data, len);
+        bluetoothPhoneAPI->wakeStream();
+    });
 }
 
 /**
@@ -156,6 +287,7 @@ void setupMeshService(void)
 {
     bluetoothPhoneAPI = new BluetoothPhoneAPI();
     bluetoothPhoneAPI->init();
+    linkManager = new NRF52LinkManager(bluetoothPhoneAPI);
 
     meshBleService.begin();
 
@@ -188,6 +320,14 @@ void setupMeshService(void)
     // for two copies
     fromRadio.begin();
 
+    fromRadioBatch.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+    fromRadioBatch.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS); // FIXME secure this!
+    fromRadioBatch.setMaxLen(sizeof(fromRadioBatchBytes));
+    fromRadioBatch.setReadAuthorizeCallback(fromRadioBatchAuthorizeCb, false);
+    fromRadioBatch.setCccdWriteCallback(cccd_callback); // Subscribing switches the client to streaming
+    fromRadioBatch.setBuffer(fromRadioBatchBytes, sizeof(fromRadioBatchBytes));
+    fromRadioBatch.begin();
+
     toRadio.setProperties(CHR_PROPS_WRITE);
     toRadio.setPermission(SECMODE_OPEN, SECMODE_OPEN); // FIXME secure this!
     toRadio.setFixedLen(0);
@@ -213,6 +353,10 @@ void NRF52Bluetooth::setup()
 {
     // Initialise the Bluefruit module
     DEBUG_MSG("Initialise the Bluefruit nRF52 module\n");
+
+    // Must be before begin(): big MTU, long connection events (6 * 1.25ms, room for data length extension packets) and a
+    // deep notify queue
+    Bluefruit.configPrphConn(BLE_MAX_MTU, 6, BLE_HVN_QUEUE_SIZE, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
     Bluefruit.begin();
 
     // Set the advertised device name (keep it short!)
@@ -1,69 +1,146 @@
-
 #include "CryptoEngine.h"
 #include "configuration.h"
 #include "ocrypto_aes_ctr.h"
-
+#include <nrf.h>
+#include <nrf_soc.h>
+
+/**
+ * AES-CTR for NRF52 targets.
+ *
+ * For AES128 keys (the default channel setting) we use the ECB peripheral (present on both the NRF52832 and NRF52840) to
+ * generate the CTR keystream one block at a time, which is much cheaper than doing AES on the M4.  The ECB peripheral only
+ * supports 128 bit keys, so for AES256 (or if the hardware reports an error) we fall back to the liboberon software
+ * implementation.  Define NO_NRF52_HW_AES to always use software.
+ *
+ * Batching: CryptoEngine::precomputeKeystreams() runs the hardware for several upcoming packets in one idle call.
+ *
+ * Note: when the softdevice is running it owns the ECB peripheral, so we must go through sd_ecb_block_encrypt().
+ */
 class NRF52CryptoEngine : public CryptoEngine
 {
 
-    /// How many bytes in our key
-    uint8_t keySize = 0;
-    const uint8_t *keyBytes;
+    /// How many bytes in each key (the ECB peripheral expands its key in hardware, so there is no schedule for us to keep)
+    uint8_t keySizes[CRYPTO_NUM_SLOTS] = {0};
+    const uint8_t *keyBytes[CRYPTO_NUM_SLOTS];
 
   public:
     NRF52CryptoEngine() {}
 
     ~NRF52CryptoEngine() {}
 
+  protected:
+    virtual void installKey(size_t keyIndex, size_t numBytes, const uint8_t *bytes)
+    {
+        keySizes[keyIndex] = numBytes;
+        keyBytes[keyIndex] = bytes;
+    }
+
     /**
-     * Set the key used for encrypt, decrypt.
-     *
-     * As a special case: If all bytes are zero, we assume _no encryption_ and send all data in cleartext.
+     * Run AES-CTR with one of our keys
      *
-     * @param numBytes must be 16 (AES128), 32 (AES256) or 0 (no crypt)
-     * @param bytes a _static_ buffer that will remain valid for the life of this crypto instance (i.e. this class will cache the
-     * provided pointer)
+     * @param in numBytes of input
+     * @param out where to write numBytes of output, it can be the same buffer as in
      */
-    virtual void setKey(size_t numBytes, uint8_t *bytes)
+    virtual void crypt(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
     {
-        keySize = numBytes;
-        keyBytes = bytes;
+        if (keySizes[keyIndex] != 0) {
+            uint8_t packetNonce[16];
+            initNonce(packetNonce, fromNode, packetNum);
+
+            if (!hwCrypt(keyIndex, packetNonce, numBytes, in, out))
+                swCrypt(keyIndex, packetNonce, 0, numBytes, in, out);
+        } else if (in != out)
+            memcpy(out, in, numBytes);
     }
 
+    /// The first block of AES-CTR's keystream is the encryption of its counter block, so we start the counter at in
+    virtual void cryptBlock(size_t keyIndex, const uint8_t *in, uint8_t *out)
+    {
+        if (keySizes[keyIndex] != 0) {
+            uint8_t block[16];
+            memcpy(block, in, sizeof(block));
+            memset(out, 0, sizeof(block));
+            if (!hwCrypt(keyIndex, block, sizeof(block), out, out))
+                swCrypt(keyIndex, block, 0, sizeof(block), out, out);
+        } else if (in != out)
+            memcpy(out, in, 16);
+    }
+
+  private:
     /**
-     * Encrypt a packet
+     * Run AES128-CTR using the ECB peripheral
      *
-     * @param bytes is updated in place
+     * @return false if the hardware can't be used with our key (in which case out has not been touched)
      */
-    virtual void encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    bool hwCrypt(size_t keyIndex, const uint8_t *nonce, size_t numBytes, const uint8_t *in, uint8_t *out)
     {
-        // DEBUG_MSG("NRF52 encrypt!\n");
-
-        if (keySize != 0) {
-            ocrypto_aes_ctr_ctx ctx;
-
-            initNonce(fromNode, packetNum);
-            ocrypto_aes_ctr_init(&ctx, keyBytes, keySize, nonce);
-
-            ocrypto_aes_ctr_encrypt(&ctx, bytes, bytes, numBytes);
+#ifdef NO_NRF52_HW_AES
+        return false;
+#else
+        if (keySizes[keyIndex] != 16)
+            return false;
+
+        nrf_ecb_hal_data_t ecb;
+        memcpy(ecb.key, keyBytes[keyIndex], sizeof(ecb.key));
+        memcpy(ecb.cleartext, nonce, sizeof(ecb.cleartext));
+
+        uint8_t sdEnabled = 0;
+        sd_softdevice_is_enabled(&sdEnabled);
+
+        for (size_t offset = 0; offset < numBytes; offset += 16) {
+            if (!ecbEncrypt(&ecb, sdEnabled)) {
+                DEBUG_MSG("Warning: ECB hardware failed, using software AES\n");
+                swCrypt(keyIndex, nonce, offset, numBytes, in, out);
+                return true;
+            }
+
+            size_t n = min((size_t)16, numBytes - offset);
+            for (size_t i = 0; i < n; i++)
+                out[offset + i] = in[offset + i] ^ ecb.ciphertext[i];
+
+            // Bump our big endian counter in the last four bytes of the block (same as the software implementations)
+            for (int i = 15; i >= 12 && ++ecb.cleartext[i] == 0; i--)
+                ;
         }
+
+        return true;
+#endif
     }
 
-    virtual void decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    /// Encrypt one block using the ECB peripheral
+    static bool ecbEncrypt(nrf_ecb_hal_data_t *ecb, bool sdEnabled)
     {
-        // DEBUG_MSG("NRF52 decrypt!\n");
-
-        if (keySize != 0) {
-            ocrypto_aes_ctr_ctx ctx;
-
-            initNonce(fromNode, packetNum);
-            ocrypto_aes_ctr_init(&ctx, keyBytes, keySize, nonce);
+        if (sdEnabled)
+            return sd_ecb_block_encrypt(ecb) == NRF_SUCCESS;
+
+        NRF_ECB->ECBDATAPTR = (uint32_t)ecb;
+        NRF_ECB->EVENTS_ENDECB = 0;
+        NRF_ECB->EVENTS_ERRORECB = 0;
+        NRF_ECB->TASKS_STARTECB = 1;
+        while (!NRF_ECB->EVENTS_ENDECB && !NRF_ECB->EVENTS_ERRORECB)
+            ;
+
+        bool ok = NRF_ECB->EVENTS_ENDECB;
+        NRF_ECB->EVENTS_ENDECB = 0;
+        NRF_ECB->EVENTS_ERRORECB = 0;
+        return ok;
+    }
 
-            ocrypto_aes_ctr_decrypt(&ctx, bytes, bytes, numBytes);
+    /// Run AES-CTR in software, starting at byte offset (a multiple of 16) of the packet
+    void swCrypt(size_t keyIndex, const uint8_t *nonce, size_t offset, size_t numBytes, const uint8_t *in, uint8_t *out)
+    {
+        ocrypto_aes_ctr_ctx ctx;
+        uint8_t scratch[16];
+
+        // If the hardware already did part of this packet, run the keystream up to where it stopped so the counter lines up
+        ocrypto_aes_ctr_init(&ctx, keyBytes[keyIndex], keySizes[keyIndex], nonce);
+        for (size_t skipped = 0; skipped < offset; skipped += sizeof(scratch)) {
+            memset(scratch, 0, sizeof(scratch));
+            ocrypto_aes_ctr_encrypt(&ctx, scratch, scratch, sizeof(scratch));
         }
-    }
 
-  private:
+        ocrypto_aes_ctr_encrypt(&ctx, out + offset, in + offset, numBytes - offset);
+    }
 };
 
 CryptoEngine *crypto = new NRF52CryptoEngine();
@@ -0,0 +1,247 @@
+#include "QSPIStore.h"
+
+#ifdef HAS_QSPI_STORE
+
+#include <nrfx_qspi.h>
+
+QSPIStore *qspiStore;
+
+#define NO_OFFSET UINT32_MAX
+
+/// Round up to our 4 byte write granularity
+static inline uint32_t align4(uint32_t x)
+{
+    return (x + 3) & ~3;
+}
+
+static inline uint32_t recordSize(const QSPIRecord *r)
+{
+    return align4(sizeof(QSPIRecord) + r->len);
+}
+
+static void waitWhileBusy()
+{
+    while (nrfx_qspi_mem_busy_check() == NRFX_ERROR_BUSY)
+        ;
+}
+
+/**
+ * Our XIP reads go through the same cache as internal flash, which doesn't know we just changed the flash underneath it.
+ * Turning the cache off (if it is on) discards what it holds.
+ */
+static void invalidateXipCache()
+{
+    uint32_t cacheCnf = NRF_NVMC->ICACHECNF;
+    if (cacheCnf & NVMC_ICACHECNF_CACHEEN_Msk) {
+        NRF_NVMC->ICACHECNF = cacheCnf & ~NVMC_ICACHECNF_CACHEEN_Msk;
+        __DSB();
+        NRF_NVMC->ICACHECNF = cacheCnf;
+    }
+}
+
+bool QSPIStore::begin()
+{
+    for (size_t i = 0; i < QSPI_NUM_STREAMS; i++)
+        latestOffset[i] = NO_OFFSET;
+    latestKnown = 0;
+
+    nrfx_qspi_config_t config = NRFX_QSPI_DEFAULT_CONFIG;
+    config.pins.sck_pin = g_ADigitalPinMap[PIN_QSPI_SCK];
+    config.pins.csn_pin = g_ADigitalPinMap[PIN_QSPI_CS];
+    config.pins.io0_pin = g_ADigitalPinMap[PIN_QSPI_IO0];
+    config.pins.io1_pin = g_ADigitalPinMap[PIN_QSPI_IO1];
+#ifdef PIN_QSPI_IO3
+    config.pins.io2_pin = g_ADigitalPinMap[PIN_QSPI_IO2];
+    config.pins.io3_pin = g_ADigitalPinMap[PIN_QSPI_IO3];
+    config.prot_if.readoc = NRF_QSPI_READOC_READ4IO;
+    config.prot_if.writeoc = NRF_QSPI_WRITEOC_PP4IO;
+#else
+    // Boards like the TTGO eink use WP and HOLD for other things, so we can only use two data lines
+    config.pins.io2_pin = NRF_QSPI_PIN_NOT_CONNECTED;
+    config.pins.io3_pin = NRF_QSPI_PIN_NOT_CONNECTED;
+    config.prot_if.readoc = NRF_QSPI_READOC_READ2IO;
+    config.prot_if.writeoc = NRF_QSPI_WRITEOC_PP2O;
+#endif
+    config.phy_if.sck_freq = NRF_QSPI_FREQ_32MDIV2; // 16 MHz, which every MX25R part we have seen copes with
+
+    if (nrfx_qspi_init(&config, NULL, NULL) != NRFX_SUCCESS) {
+        LOG_ERROR(MESH, "Error: can't init QSPI flash\n");
+        return false;
+    }
+
+#ifdef PIN_QSPI_IO3
+    // Our MX25R flash only answers on four data lines once its quad enable bit is set (write enable, then write status)
+    nrf_qspi_cinstr_conf_t cinstr = NRFX_QSPI_DEFAULT_CINSTR(0x06, NRF_QSPI_CINSTR_LEN_1B);
+    uint8_t status = 0x40;
+    nrfx_qspi_cinstr_xfer(&cinstr, NULL, NULL);
+    cinstr.opcode = 0x01;
+    cinstr.length = NRF_QSPI_CINSTR_LEN_2B;
+    nrfx_qspi_cinstr_xfer(&cinstr, &status, NULL);
+    waitWhileBusy();
+#endif
+
+    // The newest sector is the one whose first record has the largest seq
+    uint32_t newest = NO_OFFSET, maxSeq = 0;
+    for (uint32_t s = 0; s < numSectors; s++) {
+        const QSPIRecord *r = recordAt(s * QSPI_SECTOR_SIZE);
+        if (r && (newest == NO_OFFSET || (int32_t)(r->seq - maxSeq) > 0)) {
+            newest = s;
+            maxSeq = r->seq;
+        }
+    }
+
+    if (newest == NO_OFFSET) {
+        LOG_INFO(MESH, "QSPI store is empty, %u KB\n", getCapacity() / 1024);
+        return startSector(0);
+    }
+
+    // Find the last record we wrote in that sector, we don't trust the rest of it (we might have lost power mid write), so
+    // our next record goes in a fresh sector
+    uint32_t offset = newest * QSPI_SECTOR_SIZE, end = offset + QSPI_SECTOR_SIZE;
+    while (offset < end) {
+        const QSPIRecord *r = recordAt(offset);
+        if (!r)
+            break;
+        maxSeq = r->seq;
+        offset += recordSize(r);
+    }
+    nextSeq = maxSeq + 1;
+
+    LOG_INFO(MESH, "QSPI store has %u KB, resuming after record %u\n", getCapacity() / 1024, maxSeq);
+    return startSector((newest + 1) % numSectors);
+}
+
+bool QSPIStore::append(QSPIStream stream, const void *data, size_t len)
+{
+    if (len > QSPI_MAX_RECORD_LEN || stream == QSPI_STREAM_NONE || stream >= QSPI_NUM_STREAMS)
+        return false;
+
+    uint32_t size = align4(sizeof(QSPIRecord) + len);
+    if (head % QSPI_SECTOR_SIZE + size > QSPI_SECTOR_SIZE && !startSector((head / QSPI_SECTOR_SIZE + 1) % numSectors))
+        return false;
+
+    // Our data first, then the header that makes it a record
+    QSPIRecord r = {QSPI_RECORD_MAGIC, (uint8_t)stream, 0xff, (uint16_t)len, 0xffff, nextSeq};
+    if (!write(head + sizeof(r), data, len) || !write(head, &r, sizeof(r)))
+        return false;
+    invalidateXipCache();
+
+    latestOffset[stream] = head;
+    latestKnown |= 1 << stream;
+    nextSeq++;
+
+    // Erase ahead as soon as our sector is full, so head always points at erased flash
+    uint32_t sector = head / QSPI_SECTOR_SIZE;
+    head += size;
+    if (head - sector * QSPI_SECTOR_SIZE > QSPI_SECTOR_SIZE - sizeof(QSPIRecord) - 4)
+        return startSector((sector + 1) % numSectors);
+
+    return true;
+}
+
+const QSPIRecord *QSPIStore::latest(QSPIStream stream)
+{
+    if (stream >= QSPI_NUM_STREAMS)
+        return NULL;
+
+    if (!(latestKnown & (1 << stream))) {
+        // Only after a reboot, so walking every record is acceptable
+        const QSPIRecord *last = NULL;
+        for (const QSPIRecord *r = next(stream); r; r = next(stream, r))
+            last = r;
+        latestOffset[stream] = last ? offsetOf(last) : NO_OFFSET;
+        latestKnown |= 1 << stream;
+    }
+
+    return latestOffset[stream] == NO_OFFSET ? NULL : recordAt(latestOffset[stream]);
+}
+
+const QSPIRecord *QSPIStore::next(QSPIStream stream, const QSPIRecord *prev) const
+{
+    uint32_t offset;
+    if (prev)
+        offset = seek(offsetOf(prev) + recordSize(prev));
+    else
+        offset = seek(((head / QSPI_SECTOR_SIZE + 1) % numSectors) * QSPI_SECTOR_SIZE); // Our oldest sector
+
+    while (offset != NO_OFFSET) {
+        const QSPIRecord *r = recordAt(offset);
+        if (r->stream == stream)
+            return r;
+        offset = seek(offset + recordSize(r));
+    }
+    return NULL;
+}
+
+const QSPIRecord *QSPIStore::recordAt(uint32_t offset) const
+{
+    uint32_t room = QSPI_SECTOR_SIZE - offset % QSPI_SECTOR_SIZE;
+    if (room < sizeof(QSPIRecord))
+        return NULL;
+
+    auto r = (const QSPIRecord *)(QSPI_XIP_BASE + QSPI_STORE_OFFSET + offset);
+    if (r->magic != QSPI_RECORD_MAGIC || r->stream == QSPI_STREAM_NONE || r->stream >= QSPI_NUM_STREAMS ||
+        r->len > room - sizeof(QSPIRecord))
+        return NULL;
+    return r;
+}
+
+uint32_t QSPIStore::seek(uint32_t offset) const
+{
+    offset %= getCapacity();
+    for (uint32_t i = 0; i <= numSectors; i++) {
+        if (offset == head)
+            return NO_OFFSET;
+        if (recordAt(offset))
+            return offset;
+
+        // The rest of this sector is empty, try the start of the next one (skipping sectors we have never written)
+        offset = ((offset / QSPI_SECTOR_SIZE + 1) % numSectors) * QSPI_SECTOR_SIZE;
+    }
+    return NO_OFFSET;
+}
+
+bool QSPIStore::startSector(uint32_t sector)
+{
+    head = sector * QSPI_SECTOR_SIZE;
+
+    // Any stream whose newest record was in this sector has no records left at all (it was our oldest)
+    for (size_t i = 0; i < QSPI_NUM_STREAMS; i++)
+        if (latestOffset[i] != NO_OFFSET && latestOffset[i] / QSPI_SECTOR_SIZE == sector)
+            latestOffset[i] = NO_OFFSET;
+
+    nrfx_err_t err = nrfx_qspi_erase(NRF_QSPI_ERASE_LEN_4KB, QSPI_STORE_OFFSET + head);
+    waitWhileBusy();
+    invalidateXipCache();
+    if (err != NRFX_SUCCESS) {
+        LOG_ERROR(MESH, "Error: can't erase QSPI sector %u\n", sector);
+        return false;
+    }
+    return true;
+}
+
+bool QSPIStore::write(uint32_t offset, const void *data, size_t len)
+{
+    // QSPI's DMA can only read RAM in whole words, so we copy through a word aligned buffer (padding our last word)
+    static uint32_t bounce[64];
+    const uint8_t *src = (const uint8_t *)data;
+
+    while (len) {
+        size_t n = min(len, sizeof(bounce));
+        memset(bounce, 0xff, sizeof(bounce));
+        memcpy(bounce, src, n);
+
+        if (nrfx_qspi_write(bounce, align4(n), QSPI_STORE_OFFSET + offset) != NRFX_SUCCESS) {
+            LOG_ERROR(MESH, "Error: can't write QSPI flash at 0x%x\n", offset);
+            return false;
+        }
+        waitWhileBusy();
+
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "configuration.h"
+
+// Boards whose variant wires up external QSPI flash (see bin/qspi-flash-test.sh) get our store, unless built with NO_QSPI_STORE
+#if defined(NRF52840_XXAA) && defined(PIN_QSPI_SCK) && !defined(NO_QSPI_STORE)
+#define HAS_QSPI_STORE
+#endif
+
+#ifdef HAS_QSPI_STORE
+
+/// Where the nRF52840 maps external flash for execute in place (XIP) reads
+#define QSPI_XIP_BASE 0x12000000
+
+/// The part of the flash we use, which must be a whole number of sectors
+#ifndef QSPI_STORE_OFFSET
+#define QSPI_STORE_OFFSET 0
+#endif
+#ifndef QSPI_STORE_SIZE
+#define QSPI_STORE_SIZE (2 * 1024 * 1024)
+#endif
+
+/// The smallest amount of flash we can erase, a record never spans two sectors
+#define QSPI_SECTOR_SIZE 4096
+
+#define QSPI_RECORD_MAGIC 0x5153
+
+/// Which kind of data a record holds, so several users can share our log (add new ones at the end)
+enum QSPIStream { QSPI_STREAM_NONE, QSPI_STREAM_CAPTURE, QSPI_NUM_STREAMS };
+
+/// The header before each record's data.  Records (header and data) are padded to a multiple of 4 bytes.
+struct QSPIRecord {
+    uint16_t magic; // QSPI_RECORD_MAGIC, or 0xffff where a sector's records end
+    uint8_t stream; // A QSPIStream
+    uint8_t reserved;
+    uint16_t len; // Of the data after this header
+    uint16_t reserved2;
+    uint32_t seq; // Counts up across our whole log, so the newest sector is the one with the largest seq
+
+    /// The record's data, readable in place through XIP (like any other const memory)
+    const uint8_t *data() const { return (const uint8_t *)(this + 1); }
+};
+
+/// The largest record we can store
+#define QSPI_MAX_RECORD_LEN (QSPI_SECTOR_SIZE - sizeof(QSPIRecord))
+
+/**
+ * A log structured store in the external QSPI flash of nRF52840 boards, for data sets too big for our RAM or internal flash
+ * (capture rings, message caches, large node tables).
+ *
+ * Records are only ever appended, into a ring of 4KB sectors.  When the sector we are writing fills up we erase the oldest one
+ * and carry on there, so every sector wears at the same rate and nothing is rewritten in place.  A record's header is written
+ * after its data, so if we lose power part way through append() the record is simply missing.  After a reboot we start on a
+ * fresh sector rather than trust the end of the one we were writing.
+ *
+ * Reading doesn't copy anything: latest() and next() return pointers into the flash's XIP mapping, which stay valid until
+ * that record's sector is recycled (roughly QSPI_STORE_SIZE bytes of appends later).  Only one thread may append, and XIP
+ * reads stall while an erase or write is in progress, so keep appends out of anything latency sensitive.
+ */
+class QSPIStore
+{
+    uint32_t numSectors = QSPI_STORE_SIZE / QSPI_SECTOR_SIZE;
+
+    /// The offset (within our part of the flash) where our next record goes
+    uint32_t head = 0;
+
+    /// The sequence number of our next record
+    uint32_t nextSeq = 1;
+
+    /// The offset of each stream's newest record (UINT32_MAX if it has none), which we look up when first asked
+    uint32_t latestOffset[QSPI_NUM_STREAMS];
+    uint32_t latestKnown = 0; // Bit n is set once latestOffset[n] is valid
+
+  public:
+    /// Set up the QSPI peripheral and find the end of our log
+    bool begin();
+
+    /**
+     * Append a record to our log, erasing the oldest sector if we need room
+     *
+     * @return false if len is too big or the flash failed
+     */
+    bool append(QSPIStream stream, const void *data, size_t len);
+
+    /// The newest record in stream, or NULL if there isn't one
+    const QSPIRecord *latest(QSPIStream stream);
+
+    /// The record in stream after prev (or the oldest one, if prev is NULL), or NULL if there are no more
+    const QSPIRecord *next(QSPIStream stream, const QSPIRecord *prev = NULL) const;
+
+    /// How many bytes our log can hold before it starts recycling records
+    uint32_t getCapacity() const { return numSectors * QSPI_SECTOR_SIZE; }
+
+  private:
+    /// Our record at offset, or NULL if there isn't a complete one there
+    const QSPIRecord *recordAt(uint32_t offset) const;
+
+    /// The offset of the first record at or after offset, moving on through later sectors (UINT32_MAX once we reach our head)
+    uint32_t seek(uint32_t offset) const;
+
+    uint32_t offsetOf(const QSPIRecord *r) const
+    {
+        return (const uint8_t *)r - (const uint8_t *)(QSPI_XIP_BASE + QSPI_STORE_OFFSET);
+    }
+
+    /// Start writing at the beginning of sector, erasing it first
+    bool startSector(uint32_t sector);
+
+    /// Write len bytes (a multiple of 4) to offset
+    bool write(uint32_t offset, const void *data, size_t len);
+};
+
+extern QSPIStore *qspiStore;
+
+#endif
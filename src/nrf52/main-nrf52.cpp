@@ -1,4 +1,5 @@
 #include "NRF52Bluetooth.h"
+#include "QSPIStore.h"
 #include "configuration.h"
 #include "graphics/TFTDisplay.h"
 #include <SPI.h>
@@ -6,6 +7,7 @@
 #include <assert.h>
 #include <ble_gap.h>
 #include <memory.h>
+#include <nrf_soc.h>
 #include <stdio.h>
 
 #ifdef NRF52840_XXAA
@@ -104,13 +106,34 @@ void nrf52Setup()
         DEBUG_MSG("ERROR! Charge controller init failed\n");
 #endif
 
-    // Init random seed
-    // FIXME - use this to get random numbers
-    // #include "nrf_rng.h"
-    // uint32_t r;
-    // ble_controller_rand_vector_get_blocking(&r, sizeof(r));
-    // randomSeed(r);
-    DEBUG_MSG("FIXME, call randomSeed\n");
+#ifdef HAS_QSPI_STORE
+    qspiStore = new QSPIStore();
+    if (!qspiStore->begin()) {
+        delete qspiStore;
+        qspiStore = NULL;
+    }
+#endif
+
+    // Seed random() from our hardware RNG (through the softdevice if it is running, it owns the RNG then), so our packet ids
+    // and the nonces we pick at boot differ every time
+    uint32_t seed = 0;
+    uint8_t sdEnabled = 0;
+    sd_softdevice_is_enabled(&sdEnabled);
+    if (sdEnabled) {
+        while (sd_rand_application_vector_get((uint8_t *)&seed, sizeof(seed)) != NRF_SUCCESS)
+            ; // Its pool is still filling
+    } else {
+        NRF_RNG->CONFIG = RNG_CONFIG_DERCEN_Msk; // Bias correction
+        NRF_RNG->TASKS_START = 1;
+        for (size_t i = 0; i < sizeof(seed); i++) {
+            NRF_RNG->EVENTS_VALRDY = 0;
+            while (!NRF_RNG->EVENTS_VALRDY)
+                ;
+            seed = (seed << 8) | NRF_RNG->VALUE;
+        }
+        NRF_RNG->TASKS_STOP = 1;
+    }
+    randomSeed(seed);
     // ::printf("TESTING PRINTF\n");
 }
 
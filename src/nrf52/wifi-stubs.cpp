@@ -10,7 +10,5 @@ bool isWifiAvailable()
     return false;
 }
 
-void handleWebResponse() {}
-
 /// Perform idle loop processing required by the wifi layer
 void loopWifi() {}
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include "BeaconPlugin.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "PowerStatus.h"
+#include "SubPacketCodec.h"
+#include "airtime.h"
+#include "configuration.h"
+#include "mesh-pb-constants.h"
+#include "plugins/NodeInfoPlugin.h"
+#include "plugins/PositionPlugin.h"
+#include <assert.h>
+
+BeaconPlugin::BeaconPlugin() : SinglePortPlugin("beacon", BEACON_PORTNUM), concurrency::OSThread("Beacon", BEACON_FIRST_DELAY_MSEC)
+{
+    setSlack(BEACON_SLACK_MSEC);
+}
+
+int32_t BeaconPlugin::runOnce()
+{
+    assert(positionPlugin);
+
+    MeshPacket *p = allocDataPacket();
+    p->to = NODENUM_BROADCAST;
+
+    bool hasPosition = false;
+    if (positionPlugin->isBeaconDue()) {
+        Position pos = service.refreshMyNodeInfo()->position;
+        uint8_t buf[Position_size];
+        size_t len = encodePosition(buf, sizeof(buf), pos);
+        if (len && appendPart(p, BEACON_PART_POSITION, buf, len)) {
+            positionPlugin->beaconSent(p->id, pos);
+            hasPosition = true;
+        }
+    }
+
+    uint32_t userHash = NodeInfoPlugin::hashUser(owner);
+    appendPart(p, BEACON_PART_USER_HASH, &userHash, sizeof(userHash));
+
+    if (powerStatus && (powerStatus->getHasBattery() || powerStatus->knowsUSB())) {
+        BeaconPower power;
+        power.batteryPercent = powerStatus->getBatteryChargePercent();
+        power.batteryMv = constrain(powerStatus->getBatteryVoltageMv(), 0, UINT16_MAX);
+        power.flags = (powerStatus->getHasUSB() ? BEACON_POWER_USB : 0) | (powerStatus->getIsCharging() ? BEACON_POWER_CHARGING : 0);
+        appendPart(p, BEACON_PART_POWER, &power, sizeof(power));
+    }
+
+    uint8_t util = channelUtilizationPercent(UTIL_10_MINUTES) + 0.5f;
+    appendPart(p, BEACON_PART_CHANNEL_UTIL, &util, sizeof(util));
+
+    uint8_t txDuty = txDutyPercent() + 0.5f;
+    appendPart(p, BEACON_PART_TX_DUTY, &txDuty, sizeof(txDuty));
+
+    LOG_DEBUG(MESH, "Sending beacon, %u bytes (position=%d)\n", p->decoded.data.payload.size, hasPosition);
+    service.sendToMesh(p);
+
+    // When our neighborhood is busy, everyone's beacons (and the positions and telemetry they carry) back off
+    return nodeDB.stretchForCongestion(getPref_position_broadcast_secs() * 1000);
+}
+
+bool BeaconPlugin::appendPart(MeshPacket *p, BeaconPartType type, const void *data, size_t len)
+{
+    auto &payload = p->decoded.data.payload;
+    if (len > UINT8_MAX || payload.size + sizeof(BeaconPartHeader) + len > sizeof(payload.bytes))
+        return false;
+
+    BeaconPartHeader h = {(uint8_t)type, (uint8_t)len};
+    memcpy(payload.bytes + payload.size, &h, sizeof(h));
+    memcpy(payload.bytes + payload.size + sizeof(h), data, len);
+    payload.size += sizeof(h) + len;
+    return true;
+}
+
+bool BeaconPlugin::handleReceived(const MeshPacket &mp)
+{
+    if (mp.from == nodeDB.getNodeNum())
+        return true; // Our own, looped back
+
+    assert(positionPlugin && nodeInfoPlugin);
+
+    auto &payload = mp.decoded.data.payload;
+    const uint8_t *b = payload.bytes, *end = payload.bytes + payload.size;
+    while (b + sizeof(BeaconPartHeader) <= end) {
+        BeaconPartHeader h;
+        memcpy(&h, b, sizeof(h));
+        const uint8_t *data = b + sizeof(h);
+        if (data + h.len > end) {
+            LOG_WARN(MESH, "Ignoring the rest of a malformed beacon from 0x%x\n", mp.from);
+            break;
+        }
+        b = data + h.len;
+
+        // Parts may grow new fields at their end, so we only check they are at least as long as we expect
+        switch (h.type) {
+        case BEACON_PART_POSITION: {
+            Position pos = Position_init_default;
+            if (pb_decode_from_bytes(data, h.len, Position_fields, &pos)) {
+                positionPlugin->handlePosition(mp, pos);
+                sendPositionToPhone(mp, pos);
+            }
+            break;
+        }
+
+        case BEACON_PART_USER_HASH:
+            if (h.len >= sizeof(uint32_t)) {
+                uint32_t hash;
+                memcpy(&hash, data, sizeof(hash));
+                nodeInfoPlugin->checkUserHash(mp.from, hash);
+            }
+            break;
+
+        case BEACON_PART_POWER:
+            if (h.len >= sizeof(BeaconPower)) {
+                BeaconPower power;
+                memcpy(&power, data, sizeof(power));
+                nodeDB.updateBattery(mp.from, power.batteryPercent);
+            }
+            break;
+
+        case BEACON_PART_CHANNEL_UTIL:
+            if (h.len >= 1)
+                nodeDB.updateChannelUtil(mp.from, data[0]);
+            break;
+
+        case BEACON_PART_TX_DUTY:
+            if (h.len >= 1)
+                nodeDB.updateTxDuty(mp.from, data[0]);
+            break;
+
+        default:
+            break; // From a newer node than us
+        }
+    }
+
+    return true;
+}
+
+void BeaconPlugin::sendPositionToPhone(const MeshPacket &mp, const Position &pos)
+{
+    // Phone apps don't understand beacons
+    MeshPacket *p = packetPool.allocCopy(mp, 0);
+    if (p) {
+        p->decoded.data.portnum = PortNum_POSITION_APP;
+        p->decoded.data.payload.size = encodePosition(p->decoded.data.payload.bytes, sizeof(p->decoded.data.payload.bytes), pos);
+        service.sendToPhone(p);
+    }
+}
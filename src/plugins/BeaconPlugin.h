@@ -0,0 +1,70 @@
+#pragma once
+#include "SinglePortPlugin.h"
+#include "concurrency/OSThread.h"
+
+/// The portnum we send our periodic beacons on (not yet in portnums.proto)
+#define BEACON_PORTNUM ((PortNum)40)
+
+/// Our first beacon goes out this long after boot (to give the network time to set up)
+#define BEACON_FIRST_DELAY_MSEC (60 * 1000)
+
+/// Our beacon can go out this much later than it is due, so it shares a wakeup with other work (see OSThread::setSlack())
+#ifndef BEACON_SLACK_MSEC
+#define BEACON_SLACK_MSEC (30 * 1000)
+#endif
+
+/// What a part of a beacon holds.  Add new types at the end, receivers skip parts they don't know.
+enum BeaconPartType {
+    BEACON_PART_POSITION = 1, // An encoded Position, which is also a keyframe for the sender's position deltas
+    BEACON_PART_USER_HASH,    // NodeInfoPlugin::hashUser() of the sender's User, a uint32_t
+    BEACON_PART_POWER,        // A BeaconPower
+    BEACON_PART_CHANNEL_UTIL, // The percentage of the last 10 minutes the sender's channel was busy, a uint8_t
+    BEACON_PART_TX_DUTY,      // The percentage of the last 10 minutes the sender spent transmitting, a uint8_t
+};
+
+/// The header before each part's data.  All fields are little endian.
+typedef struct __attribute__((packed)) {
+    uint8_t type; // A BeaconPartType
+    uint8_t len;  // Of the data after this header
+} BeaconPartHeader;
+
+#define BEACON_POWER_USB 0x01
+#define BEACON_POWER_CHARGING 0x02
+
+typedef struct __attribute__((packed)) {
+    uint8_t batteryPercent; // 0 if unknown (or there is no battery)
+    uint16_t batteryMv;
+    uint8_t flags; // BEACON_POWER_USB, BEACON_POWER_CHARGING
+} BeaconPower;
+
+/**
+ * Once every position_broadcast_secs we send one beacon carrying all of our periodic payloads which are due: our position
+ * (when PositionPlugin says its regular update is due), a hash of our User, our battery, how busy our channel is and how
+ * much of it we use.  Each broadcast pays its own preamble, header and flood of rebroadcasts across the mesh, so sharing one
+ * is much cheaper than sending each payload on its own.
+ *
+ * The utilizations our neighbors send us are how we all learn about congestion we can't hear ourselves, when it rises
+ * everyone stretches their beacon interval (see NodeDB::stretchForCongestion()).
+ *
+ * The payload is a sequence of parts, each a BeaconPartHeader followed by its data.  Receivers hand each part to whoever
+ * handles that kind of data (PositionPlugin, NodeInfoPlugin and NodeDB), and give our phone any position as a regular
+ * Position packet.
+ */
+class BeaconPlugin : public SinglePortPlugin, private concurrency::OSThread
+{
+  public:
+    BeaconPlugin();
+
+  protected:
+    virtual bool handleReceived(const MeshPacket &mp);
+
+    /// Send our beacon @return msecs until the next one
+    virtual int32_t runOnce();
+
+  private:
+    /// Add a part to p's payload @return false if it didn't fit
+    static bool appendPart(MeshPacket *p, BeaconPartType type, const void *data, size_t len);
+
+    /// Give our phone a copy of mp with pos as its (Position) payload
+    static void sendPositionToPhone(const MeshPacket &mp, const Position &pos);
+};
@@ -0,0 +1,682 @@
+#include "BulkTransferPlugin.h"
+#include "ChannelSurvey.h"
+#include "ErasureCode.h"
+#include "MeshService.h"
+#include "NeighborTable.h"
+#include "NodeDB.h"
+#include "Router.h"
+#include "configuration.h"
+#include <assert.h>
+
+BulkTransferPlugin *bulkTransferPlugin;
+
+enum BulkMessageType { BULK_DATA = 0, BULK_ACK = 1, BULK_CHANNEL = 2, BULK_PARITY = 3 };
+
+/// The channel in a BulkChannel answer which refuses the offer
+#define BULK_NO_CHANNEL 0xff
+
+/// Starts the payload of each fragment
+typedef struct __attribute__((packed)) {
+    uint8_t type; // BULK_DATA
+    uint16_t transferId;
+    uint8_t index;
+    uint8_t numFragments;
+    uint16_t port;     // Where the reassembled payload should be delivered
+    uint16_t totalLen; // Of the whole transfer
+} BulkDataHeader;
+
+/// Starts the payload of each parity fragment, the rest is parity block index of the group (as long as its first fragment)
+typedef struct __attribute__((packed)) {
+    uint8_t type; // BULK_PARITY
+    uint16_t transferId;
+    uint8_t group; // The fragments from group * BULK_WINDOW on
+    uint8_t index;
+    uint8_t numFragments;
+    uint16_t port;
+    uint16_t totalLen;
+} BulkParityHeader;
+
+/// The whole payload of an ack
+typedef struct __attribute__((packed)) {
+    uint8_t type; // BULK_ACK
+    uint16_t transferId;
+    uint16_t received; // Bitmap of fragments the receiver has
+} BulkAck;
+
+/// The whole payload of a data channel offer (from the sender), or the receiver's answer
+typedef struct __attribute__((packed)) {
+    uint8_t type; // BULK_CHANNEL
+    uint16_t transferId;
+    uint8_t channel; // The receiver answers with the channel it was offered to agree, or BULK_NO_CHANNEL
+    uint8_t sf;      // The spreading factor to use there (the receiver can answer with a slower one), 0 for our usual one
+} BulkChannel;
+
+static_assert(sizeof(BulkDataHeader) + BULK_FRAGMENT_SIZE <= sizeof(((Data *)0)->payload.bytes), "Fragments too big");
+static_assert(sizeof(BulkParityHeader) + BULK_FRAGMENT_SIZE <= sizeof(((Data *)0)->payload.bytes), "Parity too big");
+static_assert(BULK_MAX_FRAGMENTS <= 16, "Our bitmaps are only 16 bits");
+static_assert(BULK_MAX_FRAGMENTS / BULK_WINDOW <= 8, "Our parity bitmap is only 8 bits");
+static_assert(BULK_WINDOW <= ERASURE_MAX_BLOCKS && BULK_MAX_PARITY <= ERASURE_MAX_BLOCKS, "Groups too big to code");
+
+/// The number of set bits in a bitmap
+static uint8_t countBits(uint16_t b)
+{
+    uint8_t n = 0;
+    for (; b; b &= b - 1)
+        n++;
+    return n;
+}
+
+/// A bitmap with the bottom n bits set
+static uint16_t lowBits(uint8_t n)
+{
+    return n >= 16 ? 0xffff : (1 << n) - 1;
+}
+
+/// The length of fragment i of a transfer which is len bytes long
+static size_t fragmentLen(size_t len, uint8_t i)
+{
+    size_t start = i * BULK_FRAGMENT_SIZE;
+    return min((size_t)BULK_FRAGMENT_SIZE, len - start);
+}
+
+/// Is this a transfer length and fragment count a sender could have picked
+static bool isValidShape(uint16_t totalLen, uint8_t numFragments)
+{
+    return numFragments && numFragments <= BULK_MAX_FRAGMENTS && totalLen <= BULK_MAX_LEN &&
+           (totalLen + BULK_FRAGMENT_SIZE - 1) / BULK_FRAGMENT_SIZE == numFragments;
+}
+
+/// The number of fragments in a group
+static uint8_t groupSize(uint8_t numFragments, uint8_t group)
+{
+    return min(BULK_WINDOW, numFragments - group * BULK_WINDOW);
+}
+
+BulkTransferPlugin::BulkTransferPlugin() : SinglePortPlugin("bulk", BULK_TRANSFER_PORTNUM), concurrency::OSThread("bulk")
+{
+    tx.active = false;
+    for (size_t i = 0; i < BULK_MAX_RX; i++)
+        rx[i].active = false;
+
+    nextTransferId = random(1, UINT16_MAX);
+    setEnabled(false); // Nothing to do until we have a transfer
+}
+
+uint16_t BulkTransferPlugin::startTransfer(NodeNum dest, PortNum port, const uint8_t *data, size_t len)
+{
+    if (tx.active || len == 0 || len > BULK_MAX_LEN || dest == NODENUM_BROADCAST)
+        return 0;
+
+    if (++nextTransferId == 0) // 0 is never a valid id
+        nextTransferId++;
+
+    tx.active = true;
+    tx.dest = dest;
+    tx.id = nextTransferId;
+    tx.port = port;
+    tx.len = len;
+    tx.numFragments = (len + BULK_FRAGMENT_SIZE - 1) / BULK_FRAGMENT_SIZE;
+    tx.acked = tx.inFlight = 0;
+    tx.lastProgressMsec = millis();
+    tx.retries = 0;
+    tx.channelState = CHANNEL_NONE;
+    tx.numParity = pickParity();
+    tx.paritySent = 0;
+    memcpy(tx.data, data, len);
+    memset(tx.data + len, 0, tx.numFragments * BULK_FRAGMENT_SIZE - len); // Our parity pads the last fragment with zeros
+
+    DEBUG_MSG("Starting bulk transfer %u to 0x%x, %u bytes in %u fragments (%u parity per group)\n", tx.id, dest, len,
+              tx.numFragments, tx.numParity);
+    if (!offerChannel())
+        sendWindow();
+    wakeup();
+    return tx.id;
+}
+
+bool BulkTransferPlugin::handleReceived(const MeshPacket &mp)
+{
+    if (mp.to != nodeDB.getNodeNum())
+        return true; // We only do transfers between two nodes
+
+    auto &p = mp.decoded.data.payload;
+    if (p.size < 1)
+        return true;
+
+    if (p.bytes[0] == BULK_DATA)
+        handleData(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == BULK_ACK)
+        handleAck(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == BULK_CHANNEL)
+        handleChannel(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == BULK_PARITY)
+        handleParity(mp.from, p.bytes, p.size);
+
+    return true; // No one else should look at our fragments
+}
+
+void BulkTransferPlugin::handleData(NodeNum from, const uint8_t *payload, size_t len)
+{
+    BulkDataHeader h;
+    if (len < sizeof(h))
+        return;
+    memcpy(&h, payload, sizeof(h));
+
+    // Check this is a fragment which makes sense
+    if (!isValidShape(h.totalLen, h.numFragments) || h.index >= h.numFragments ||
+        len - sizeof(h) != fragmentLen(h.totalLen, h.index)) {
+        DEBUG_MSG("Ignoring malformed bulk fragment from 0x%x\n", from);
+        return;
+    }
+
+    RxTransfer *r = findRx(from, h.transferId, true);
+    if (!r) {
+        DEBUG_MSG("No room to receive bulk transfer from 0x%x\n", from);
+        return;
+    }
+    if (!checkShape(*r, (PortNum)h.port, h.totalLen, h.numFragments))
+        return; // Inconsistent with what we already have
+
+    r->lastRxMsec = millis();
+
+    uint16_t bit = 1 << h.index;
+    bool recovered = false;
+    if (!(r->received & bit)) {
+        memcpy(r->data + h.index * BULK_FRAGMENT_SIZE, payload + sizeof(h), len - sizeof(h));
+        r->received |= bit;
+        recovered = recoverGroup(*r, h.index / BULK_WINDOW);
+    }
+
+    fragmentsArrived(from, *r, h.index == r->numFragments - 1, recovered);
+}
+
+void BulkTransferPlugin::handleParity(NodeNum from, const uint8_t *payload, size_t len)
+{
+    BulkParityHeader h;
+    if (len < sizeof(h))
+        return;
+    memcpy(&h, payload, sizeof(h));
+
+    if (!isValidShape(h.totalLen, h.numFragments) || h.group * BULK_WINDOW >= h.numFragments || h.index >= ERASURE_MAX_BLOCKS ||
+        len - sizeof(h) != fragmentLen(h.totalLen, h.group * BULK_WINDOW)) {
+        DEBUG_MSG("Ignoring malformed bulk parity from 0x%x\n", from);
+        return;
+    }
+
+    RxTransfer *r = findRx(from, h.transferId, true);
+    if (!r || !checkShape(*r, (PortNum)h.port, h.totalLen, h.numFragments))
+        return;
+
+    r->lastRxMsec = millis();
+    r->sawParity = true;
+
+    uint16_t mask = lowBits(groupSize(h.numFragments, h.group)) << (h.group * BULK_WINDOW);
+    if ((r->received & mask) == mask)
+        return; // Nothing lost in this group
+
+    // Prefer a free slot, or one for a group we already have
+    RxParity *slot = NULL;
+    for (size_t i = 0; i < BULK_RX_PARITY_SLOTS; i++) {
+        RxParity &q = r->parity[i];
+        if (q.valid && q.group == h.group && q.index == h.index)
+            return; // A duplicate
+        uint16_t m = lowBits(groupSize(h.numFragments, q.group)) << (q.group * BULK_WINDOW);
+        if (!slot && (!q.valid || (r->received & m) == m))
+            slot = &q;
+    }
+    if (!slot) {
+        slot = &r->parity[r->nextParity];
+        r->nextParity = (r->nextParity + 1) % BULK_RX_PARITY_SLOTS;
+    }
+
+    slot->valid = true;
+    slot->group = h.group;
+    slot->index = h.index;
+    memcpy(slot->bytes, payload + sizeof(h), len - sizeof(h));
+
+    fragmentsArrived(from, *r, false, recoverGroup(*r, h.group));
+}
+
+bool BulkTransferPlugin::checkShape(RxTransfer &r, PortNum port, uint16_t totalLen, uint8_t numFragments)
+{
+    if (r.numFragments)
+        return r.numFragments == numFragments && r.len == totalLen;
+
+    r.port = port;
+    r.len = totalLen;
+    r.numFragments = numFragments;
+    memset(r.data + totalLen, 0, numFragments * BULK_FRAGMENT_SIZE - totalLen); // Parity pads the last fragment with zeros
+    return true;
+}
+
+void BulkTransferPlugin::fragmentsArrived(NodeNum from, RxTransfer &r, bool lastFragment, bool recovered)
+{
+    if (r.received == lowBits(r.numFragments)) {
+        if (!r.done) {
+            DEBUG_MSG("Received bulk transfer %u from 0x%x, %u bytes\n", r.id, from, r.len);
+            r.done = true;
+
+            BulkTransferReceived event = {from, r.port, r.data, r.len};
+            onReceived.notifyObservers(&event);
+        }
+        sendAck(r);
+
+        if (r.onDataChannel) {
+            r.onDataChannel = false;
+            leaveChannel(); // After our ack has gone out.  If they missed it they will resend on the control channel
+        }
+    } else if (recovered || countBits(r.received) % BULK_WINDOW == 0 || (lastFragment && !r.sawParity))
+        sendAck(r); // They are probably waiting on us to open the window (if parity is coming we wait for it first)
+    else if (!r.ackDue) {
+        // Make sure they hear from us eventually, even if the rest of this window was lost
+        r.ackDue = true;
+        r.ackAtMsec = millis() + BULK_ACK_DELAY_MSEC;
+        wakeup();
+    }
+}
+
+bool BulkTransferPlugin::recoverGroup(RxTransfer &r, uint8_t group)
+{
+    uint8_t first = group * BULK_WINDOW, k = groupSize(r.numFragments, group);
+    uint16_t missing = ((uint16_t)~r.received >> first) & lowBits(k);
+    if (!missing)
+        return false;
+
+    const uint8_t *parity[BULK_RX_PARITY_SLOTS];
+    uint8_t indexes[BULK_RX_PARITY_SLOTS];
+    size_t numParity = 0;
+    for (size_t i = 0; i < BULK_RX_PARITY_SLOTS; i++)
+        if (r.parity[i].valid && r.parity[i].group == group) {
+            parity[numParity] = r.parity[i].bytes;
+            indexes[numParity++] = r.parity[i].index;
+        }
+    if (numParity < countBits(missing))
+        return false; // Not yet
+
+    uint8_t *data[BULK_WINDOW];
+    for (uint8_t i = 0; i < k; i++)
+        data[i] = r.data + (first + i) * BULK_FRAGMENT_SIZE;
+    if (!erasureDecode(data, k, missing, parity, indexes, numParity, fragmentLen(r.len, first)))
+        return false;
+
+    DEBUG_MSG("Rebuilt %u lost fragments of bulk transfer %u from parity\n", countBits(missing), r.id);
+    r.received |= missing << first;
+    for (size_t i = 0; i < BULK_RX_PARITY_SLOTS; i++)
+        if (r.parity[i].group == group)
+            r.parity[i].valid = false;
+    return true;
+}
+
+void BulkTransferPlugin::handleAck(NodeNum from, const uint8_t *payload, size_t len)
+{
+    BulkAck a;
+    if (len < sizeof(a))
+        return;
+    memcpy(&a, payload, sizeof(a));
+
+    if (!tx.active || from != tx.dest || a.transferId != tx.id)
+        return; // Probably a resent ack for a transfer we already finished
+
+    uint16_t newlyAcked = a.received & ~tx.acked & lowBits(tx.numFragments);
+    tx.acked |= newlyAcked;
+    if (newlyAcked) {
+        tx.lastProgressMsec = millis();
+        tx.retries = 0;
+    }
+
+    if (tx.acked == lowBits(tx.numFragments)) {
+        finishTransfer(true);
+        return;
+    }
+
+    // Any fragment we sent before one which arrived was probably lost, so let it be resent now (selective ack)
+    uint8_t highest = 0;
+    for (uint8_t i = 0; i < tx.numFragments; i++)
+        if (tx.acked & (1 << i))
+            highest = i;
+    tx.inFlight = tx.acked | (tx.inFlight & ~lowBits(highest + 1));
+
+    sendWindow();
+}
+
+void BulkTransferPlugin::handleChannel(NodeNum from, const uint8_t *payload, size_t len)
+{
+    BulkChannel c;
+    if (len < sizeof(c))
+        return;
+    memcpy(&c, payload, sizeof(c));
+
+    if (tx.active && from == tx.dest && c.transferId == tx.id) {
+        // Their answer to our offer
+        if (tx.channelState != CHANNEL_OFFERED)
+            return;
+
+        tx.channelMsec = millis();
+        if (c.channel == tx.channel) {
+            if (c.sf > tx.sf)
+                tx.sf = c.sf; // Their end of the link needs it slower
+            DEBUG_MSG("Moving bulk transfer %u to channel %u at sf %u\n", tx.id, tx.channel, tx.sf);
+            tx.channelState = CHANNEL_MOVING;
+            router->getDataChannelInterface()->setDataChannel(tx.channel, tx.sf);
+            wakeup(); // To notice once our radio has moved
+        } else {
+            tx.channelState = CHANNEL_NONE;
+            sendWindow();
+        }
+        return;
+    }
+
+    // An offer for a transfer to us.  If we already know this transfer we either agreed before (and they missed our answer) or
+    // it has already started on the control channel, where it should stay
+    RadioInterface *radio = router->getDataChannelInterface();
+    RxTransfer *r = findRx(from, c.transferId, false);
+    bool agree = r ? r->onDataChannel
+                   : radio && !isChannelInUse() && c.channel < radio->getNumChannels() && c.channel != radio->getControlChannel() &&
+                         (r = findRx(from, c.transferId, true)) != NULL;
+
+    // The link might be worse in our direction, in which case we ask for a slower spreading factor
+    uint8_t sf = 0;
+    if (agree && c.sf) {
+        sf = neighbors.pickSpreadFactor(from, radio->getControlSpreadFactor());
+        if (sf < c.sf)
+            sf = c.sf;
+    }
+
+    sendChannel(from, c.transferId, agree ? c.channel : BULK_NO_CHANNEL, sf);
+    if (agree && !r->onDataChannel) {
+        DEBUG_MSG("Moving to channel %u at sf %u for bulk transfer %u from 0x%x\n", c.channel, sf, r->id, from);
+        r->onDataChannel = true;
+        r->lastRxMsec = millis();
+        radio->setDataChannel(c.channel, sf); // Once our answer has gone out
+        wakeup();
+    }
+}
+
+uint8_t BulkTransferPlugin::pickParity()
+{
+    const Neighbor *n = neighbors.find(tx.dest);
+    if (!BULK_MAX_PARITY || !n)
+        return 0;
+
+    uint16_t loss = max(n->ackLoss, n->rxLoss);
+    if (loss < BULK_PARITY_MIN_LOSS)
+        return 0;
+
+    // Enough to rebuild the fragments we expect a group to lose, rounded up
+    uint8_t numParity = (BULK_WINDOW * loss + NEIGHBOR_LOSS_SCALE - 1) / NEIGHBOR_LOSS_SCALE;
+    return min(numParity, (uint8_t)BULK_MAX_PARITY);
+}
+
+bool BulkTransferPlugin::offerChannel()
+{
+    RadioInterface *radio = router->getDataChannelInterface();
+    if (!BULK_DATA_CHANNELS || !radio || tx.numFragments < 2 || !neighbors.find(tx.dest) || isChannelInUse())
+        return false; // Only worth it (and only possible) for bigger transfers straight to a neighbor
+
+    // Any channel but the control channel, picking at random spreads the transfers in our area over all of them
+    tx.channel = random(radio->getNumChannels() - 1);
+    if (tx.channel >= radio->getControlChannel())
+        tx.channel++;
+#ifdef CHANNEL_SURVEY
+    // Unless our survey found one quieter than the rest (which still spreads out, as it gets busy it stops being the quietest)
+    int8_t quietest = channelSurvey ? channelSurvey->getQuietestChannel(radio->getControlChannel()) : -1;
+    if (quietest >= 0)
+        tx.channel = quietest;
+#endif
+
+    // And the fastest spreading factor the link supports, unless that failed last time we tried it with them
+    uint8_t controlSf = radio->getControlSpreadFactor();
+    tx.sf = neighbors.pickSpreadFactor(tx.dest, controlSf);
+    if (tx.dest == stalledDest && tx.sf <= stalledSf)
+        tx.sf = min((uint8_t)(stalledSf + 1), controlSf);
+    if (tx.sf >= controlSf)
+        tx.sf = 0; // No faster than usual, but we still have the channel to ourselves
+
+    tx.channelState = CHANNEL_OFFERED;
+    tx.channelMsec = millis();
+    sendChannel(tx.dest, tx.id, tx.channel, tx.sf);
+    return true;
+}
+
+void BulkTransferPlugin::sendChannel(NodeNum to, uint16_t transferId, uint8_t channel, uint8_t sf)
+{
+    BulkChannel c;
+    c.type = BULK_CHANNEL;
+    c.transferId = transferId;
+    c.channel = channel;
+    c.sf = sf;
+
+    MeshPacket *p = allocDataPacket();
+    p->to = to;
+    auto &payload = p->decoded.data.payload;
+    memcpy(payload.bytes, &c, sizeof(c));
+    payload.size = sizeof(c);
+
+    service.sendToMesh(p);
+}
+
+bool BulkTransferPlugin::isChannelInUse()
+{
+    if (tx.active && tx.channelState != CHANNEL_NONE)
+        return true;
+
+    for (size_t i = 0; i < BULK_MAX_RX; i++)
+        if (rx[i].active && rx[i].onDataChannel)
+            return true;
+
+    return false;
+}
+
+void BulkTransferPlugin::leaveChannel()
+{
+    RadioInterface *radio = router->getDataChannelInterface();
+    if (radio)
+        radio->setDataChannel(-1);
+}
+
+void BulkTransferPlugin::sendWindow()
+{
+    if (tx.channelState == CHANNEL_OFFERED || tx.channelState == CHANNEL_MOVING)
+        return; // We don't know which channel to send on yet
+
+    for (uint8_t i = 0; i < tx.numFragments && countBits(tx.inFlight & ~tx.acked) < BULK_WINDOW; i++) {
+        uint16_t bit = 1 << i;
+        if (!(tx.inFlight & bit)) {
+            sendFragment(i);
+            tx.inFlight |= bit;
+
+            // A group's parity follows its last fragment, the first time we send it
+            uint8_t group = i / BULK_WINDOW;
+            if (tx.numParity && !(tx.paritySent & (1 << group)) && (i % BULK_WINDOW == BULK_WINDOW - 1 || i == tx.numFragments - 1)) {
+                tx.paritySent |= 1 << group;
+                sendParity(group);
+            }
+        }
+    }
+}
+
+void BulkTransferPlugin::sendFragment(uint8_t index)
+{
+    BulkDataHeader h;
+    h.type = BULK_DATA;
+    h.transferId = tx.id;
+    h.index = index;
+    h.numFragments = tx.numFragments;
+    h.port = tx.port;
+    h.totalLen = tx.len;
+
+    size_t len = fragmentLen(tx.len, index);
+    MeshPacket *p = allocDataPacket();
+    p->to = tx.dest;
+    auto &payload = p->decoded.data.payload;
+    memcpy(payload.bytes, &h, sizeof(h));
+    memcpy(payload.bytes + sizeof(h), tx.data + index * BULK_FRAGMENT_SIZE, len);
+    payload.size = sizeof(h) + len;
+
+    service.sendToMesh(p);
+}
+
+void BulkTransferPlugin::sendParity(uint8_t group)
+{
+    BulkParityHeader h;
+    h.type = BULK_PARITY;
+    h.transferId = tx.id;
+    h.group = group;
+    h.numFragments = tx.numFragments;
+    h.port = tx.port;
+    h.totalLen = tx.len;
+
+    uint8_t first = group * BULK_WINDOW, k = groupSize(tx.numFragments, group);
+    const uint8_t *data[BULK_WINDOW];
+    for (uint8_t i = 0; i < k; i++)
+        data[i] = tx.data + (first + i) * BULK_FRAGMENT_SIZE;
+    size_t len = fragmentLen(tx.len, first);
+
+    for (h.index = 0; h.index < tx.numParity; h.index++) {
+        MeshPacket *p = allocDataPacket();
+        p->to = tx.dest;
+        auto &payload = p->decoded.data.payload;
+        memcpy(payload.bytes, &h, sizeof(h));
+        erasureEncode(data, k, len, h.index, payload.bytes + sizeof(h));
+        payload.size = sizeof(h) + len;
+
+        service.sendToMesh(p);
+    }
+}
+
+void BulkTransferPlugin::sendAck(RxTransfer &r)
+{
+    BulkAck a;
+    a.type = BULK_ACK;
+    a.transferId = r.id;
+    a.received = r.received;
+
+    MeshPacket *p = allocDataPacket();
+    p->to = r.from;
+    auto &payload = p->decoded.data.payload;
+    memcpy(payload.bytes, &a, sizeof(a));
+    payload.size = sizeof(a);
+
+    service.sendToMesh(p);
+    r.ackDue = false;
+}
+
+void BulkTransferPlugin::finishTransfer(bool success)
+{
+    DEBUG_MSG("Bulk transfer %u to 0x%x %s\n", tx.id, tx.dest, success ? "complete" : "failed");
+    tx.active = false;
+
+    if (tx.channelState != CHANNEL_NONE) {
+        tx.channelState = CHANNEL_NONE;
+        leaveChannel();
+    }
+
+    BulkTransferResult result = {tx.id, tx.dest, success};
+    onSent.notifyObservers(&result);
+}
+
+BulkTransferPlugin::RxTransfer *BulkTransferPlugin::findRx(NodeNum from, uint16_t id, bool create)
+{
+    RxTransfer *slot = NULL;
+    for (size_t i = 0; i < BULK_MAX_RX; i++) {
+        RxTransfer &r = rx[i];
+        if (r.active && r.from == from && r.id == id)
+            return &r;
+
+        // Prefer an empty slot, but a completed transfer can be forgotten if we need the room
+        if (!r.active || (r.done && (!slot || slot->active)))
+            slot = &r;
+    }
+
+    if (!create || !slot)
+        return NULL;
+
+    memset(slot, 0, offsetof(RxTransfer, data));
+    for (size_t i = 0; i < BULK_RX_PARITY_SLOTS; i++)
+        slot->parity[i].valid = false;
+    slot->active = true;
+    slot->from = from;
+    slot->id = id;
+    slot->lastRxMsec = millis();
+    return slot;
+}
+
+void BulkTransferPlugin::wakeup()
+{
+    setEnabled(true);
+    setIntervalFromNow(0);
+}
+
+int32_t BulkTransferPlugin::runOnce()
+{
+    uint32_t now = millis();
+    bool busy = false, fastPoll = false;
+
+    if (tx.active) {
+        if (tx.channelState == CHANNEL_OFFERED && now - tx.channelMsec >= BULK_CHANNEL_OFFER_MSEC) {
+            DEBUG_MSG("No answer to our channel offer, sending bulk transfer %u on the control channel\n", tx.id);
+            tx.channelState = CHANNEL_NONE;
+            sendWindow();
+        } else if (tx.channelState == CHANNEL_MOVING) {
+            if (router->getDataChannelInterface()->getChannel() == tx.channel) {
+                tx.channelState = CHANNEL_ON;
+                tx.lastProgressMsec = now;
+                sendWindow();
+            } else if (now - tx.channelMsec >= BULK_CHANNEL_OFFER_MSEC) {
+                tx.channelState = CHANNEL_NONE; // Our radio never got a chance to move, forget it
+                leaveChannel();
+                sendWindow();
+            }
+            fastPoll = true;
+        } else if (tx.channelState == CHANNEL_ON && now - tx.lastProgressMsec >= BULK_ACK_TIMEOUT_MSEC) {
+            // Something is wrong over there, go back to the control channel (where they will be by now) and resend from there
+            DEBUG_MSG("Bulk transfer %u stalled on channel %u, going back to the control channel\n", tx.id, tx.channel);
+            if (tx.sf) {
+                stalledDest = tx.dest; // Next time we try a slower spreading factor with them
+                stalledSf = tx.sf;
+            }
+            tx.channelState = CHANNEL_NONE;
+            leaveChannel();
+        }
+
+        if (now - tx.lastProgressMsec >= BULK_ACK_TIMEOUT_MSEC) {
+            if (++tx.retries > BULK_MAX_RETRIES)
+                finishTransfer(false);
+            else {
+                DEBUG_MSG("Bulk transfer %u timed out, resending\n", tx.id);
+                tx.inFlight = tx.acked;
+                tx.lastProgressMsec = now;
+                sendWindow();
+            }
+        }
+        busy |= tx.active;
+    }
+
+    for (size_t i = 0; i < BULK_MAX_RX; i++) {
+        RxTransfer &r = rx[i];
+        if (!r.active)
+            continue;
+
+        if (r.onDataChannel && now - r.lastRxMsec >= BULK_CHANNEL_IDLE_MSEC) {
+            DEBUG_MSG("Nothing more for bulk transfer %u on our data channel, going back to the control channel\n", r.id);
+            r.onDataChannel = false;
+            leaveChannel();
+        }
+
+        if (now - r.lastRxMsec >= BULK_RX_TIMEOUT_MSEC) {
+            if (!r.done)
+                DEBUG_MSG("Giving up on bulk transfer %u from 0x%x\n", r.id, r.from);
+            r.active = false;
+            continue;
+        }
+
+        if (r.ackDue && (int32_t)(now - r.ackAtMsec) >= 0)
+            sendAck(r);
+        busy = true;
+    }
+
+    if (!busy)
+        setEnabled(false); // Nothing left to do
+
+    // Our timeouts are all seconds long, so this is plenty precise (but we want to start sending soon after our radio moves)
+    return fastPoll ? 50 : 500;
+}
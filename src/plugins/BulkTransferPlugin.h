@@ -0,0 +1,230 @@
+#pragma once
+#include "Observer.h"
+#include "SinglePortPlugin.h"
+#include "concurrency/OSThread.h"
+
+/// The portnum we use for fragments and acks (not yet in portnums.proto)
+#define BULK_TRANSFER_PORTNUM ((PortNum)34)
+
+/// How many bytes of a transfer we put in each fragment (small enough that a source routed fragment still fits in one frame)
+#define BULK_FRAGMENT_SIZE 180
+
+/// Transfers can have at most this many fragments (one bit each in our ack bitmap)
+#define BULK_MAX_FRAGMENTS 16
+
+#define BULK_MAX_LEN (BULK_FRAGMENT_SIZE * BULK_MAX_FRAGMENTS)
+
+/// How many fragments we send before waiting for an ack
+#define BULK_WINDOW 4
+
+/// Each group of BULK_WINDOW fragments gets up to this many Reed-Solomon parity fragments (see ErasureCode), so the receiver
+/// can rebuild a group from any BULK_WINDOW of its fragments without a resend round trip.  How many we send depends on how
+/// lossy our link to the receiver is.  Set to 0 to never send parity.
+#ifndef BULK_MAX_PARITY
+#define BULK_MAX_PARITY 2
+#endif
+
+/// We don't send parity over links which lose less than this (a NeighborTable loss rate)
+#define BULK_PARITY_MIN_LOSS (NEIGHBOR_LOSS_SCALE / 50)
+
+/// How many parity fragments a receiver keeps for each transfer (for groups it hasn't finished yet)
+#define BULK_RX_PARITY_SLOTS 4
+
+/// How many transfers we can reassemble at once
+#define BULK_MAX_RX 2
+
+/// If an ack doesn't show any progress for this long we resend our window
+#define BULK_ACK_TIMEOUT_MSEC (30 * 1000L)
+
+/// We give up on a transfer after this many timeouts in a row
+#define BULK_MAX_RETRIES 5
+
+/// The receiver acks at least this often (if it hasn't already acked because a window completed)
+#define BULK_ACK_DELAY_MSEC (3 * 1000L)
+
+/// We forget about a transfer we are receiving if we hear nothing for this long (we also keep completed transfers this long, so
+/// we can ack any resends)
+#define BULK_RX_TIMEOUT_MSEC (2 * 60 * 1000L)
+
+/// Transfers to a neighbor move off the control channel the whole mesh shares to one of our region's other channels, so they
+/// don't hold up everyone else's traffic (and several transfers can use the air at once).  Set to 0 to always stay put.
+#ifndef BULK_DATA_CHANNELS
+#define BULK_DATA_CHANNELS 1
+#endif
+
+/// How long we wait for a neighbor to agree to a data channel, before sending on the control channel anyway
+#define BULK_CHANNEL_OFFER_MSEC (5 * 1000L)
+
+/// A receiver goes back to the control channel if it hears nothing on its data channel for this long (the sender gives up on
+/// the data channel when an ack times out, so we must be back well before that)
+#define BULK_CHANNEL_IDLE_MSEC (10 * 1000L)
+
+/// A transfer which has been completely received
+struct BulkTransferReceived {
+    NodeNum from;
+    PortNum port; // The portnum the sender asked us to deliver this to
+    const uint8_t *data;
+    size_t len;
+};
+
+/// The outcome of one of our transfers
+struct BulkTransferResult {
+    uint16_t transferId;
+    NodeNum dest;
+    bool success;
+};
+
+/**
+ * Sends payloads which are too big for a single packet.
+ *
+ * Payloads are split into numbered fragments, we keep up to BULK_WINDOW fragments in flight and the receiver acks with a bitmap
+ * of the fragments it has (so we only resend what was actually lost).  Fragments are sent as regular unicasts, so they use our
+ * normal routing.
+ *
+ * Over a lossy link to a neighbor, each group of BULK_WINDOW fragments is followed by a few parity fragments, and the receiver
+ * rebuilds what it lost from those instead of waiting a round trip for a resend.  How much parity we send depends on the loss
+ * rate in our NeighborTable, which only knows about neighbors, so routed transfers don't get any.
+ *
+ * If the receiver is our neighbor (and we have a single radio, in a region with more than one channel) we first offer it a data
+ * channel, and if it agrees we both move there for the rest of the transfer.  Neither of us hears the control channel while
+ * we are away, so we come back as soon as the transfer is done (or stalls), and anything which goes wrong just leaves the
+ * transfer on the control channel.  Neighbors with a strong link also agree on a faster spreading factor for their data channel
+ * (picked from our NeighborTable, like LoRaWAN's adaptive data rate), if that stalls we try slower next time.
+ *
+ * Other plugins observe onReceived to get reassembled payloads (filtering on port) and onSent to learn how their transfers went.
+ */
+class BulkTransferPlugin : public SinglePortPlugin, private concurrency::OSThread
+{
+    /// Where the transfer we are sending is with moving to a data channel
+    enum ChannelState {
+        CHANNEL_NONE,    // We are sending on the control channel
+        CHANNEL_OFFERED, // We are waiting for the receiver to answer our offer
+        CHANNEL_MOVING,  // They agreed, we are waiting for our radio to retune
+        CHANNEL_ON       // We are sending on the data channel
+    };
+
+    struct TxTransfer {
+        bool active;
+        NodeNum dest;
+        uint16_t id;
+        PortNum port;
+        uint16_t len;
+        uint8_t numFragments;
+        uint16_t acked;    // Bitmap of fragments the receiver has
+        uint16_t inFlight; // Bitmap of fragments we have sent (and think might still arrive)
+        uint32_t lastProgressMsec;
+        uint8_t retries;
+        ChannelState channelState;
+        uint8_t channel;      // The data channel we offered (if channelState isn't CHANNEL_NONE)
+        uint8_t sf;           // The spreading factor we use there, or 0 for our usual one
+        uint32_t channelMsec; // When we entered channelState
+        uint8_t numParity;    // How many parity fragments we send for each group
+        uint8_t paritySent;   // Bitmap of groups we have sent parity for
+        uint8_t data[BULK_MAX_LEN];
+    };
+
+    /// A parity fragment we received, for rebuilding a group of a transfer
+    struct RxParity {
+        bool valid;
+        uint8_t group;
+        uint8_t index; // Which of the group's parity blocks this is
+        uint8_t bytes[BULK_FRAGMENT_SIZE];
+    };
+
+    struct RxTransfer {
+        bool active;
+        bool done; // We have delivered this transfer, but keep the record to ack any resends
+        bool ackDue;
+        bool onDataChannel; // We agreed to move to a data channel for this transfer, and haven't come back yet
+        NodeNum from;
+        uint16_t id;
+        PortNum port;
+        uint16_t len;
+        uint8_t numFragments;
+        uint16_t received; // Bitmap of fragments we have
+        uint32_t lastRxMsec;
+        uint32_t ackAtMsec;
+        bool sawParity;     // The sender is sending parity, so any losses in a group will probably be rebuilt soon
+        uint8_t nextParity; // The slot we replace if we have no free ones
+        uint8_t data[BULK_MAX_LEN];
+        RxParity parity[BULK_RX_PARITY_SLOTS];
+    };
+
+    TxTransfer tx;
+    RxTransfer rx[BULK_MAX_RX];
+
+    uint16_t nextTransferId;
+
+    /// The last receiver which stopped hearing us on a data channel, and the spreading factor we were using (our ADR fallback)
+    NodeNum stalledDest = 0;
+    uint8_t stalledSf = 0;
+
+  public:
+    Observable<const BulkTransferReceived *> onReceived;
+    Observable<const BulkTransferResult *> onSent;
+
+    /** Constructor
+     * name is for debugging output
+     */
+    BulkTransferPlugin();
+
+    /**
+     * Start sending data (which we copy) to dest, to be delivered to port on the other end
+     *
+     * @return the transfer id (which will be in our onSent notification), or 0 if we are already busy with a transfer or data is
+     * too big
+     */
+    uint16_t startTransfer(NodeNum dest, PortNum port, const uint8_t *data, size_t len);
+
+  protected:
+    virtual bool handleReceived(const MeshPacket &mp);
+
+    /// Handles all of our timers
+    virtual int32_t runOnce();
+
+  private:
+    void handleData(NodeNum from, const uint8_t *payload, size_t len);
+    void handleAck(NodeNum from, const uint8_t *payload, size_t len);
+    void handleChannel(NodeNum from, const uint8_t *payload, size_t len);
+    void handleParity(NodeNum from, const uint8_t *payload, size_t len);
+
+    /// Set up the shape of a transfer we are receiving from its first fragment, @return false if it doesn't match what we have
+    bool checkShape(RxTransfer &r, PortNum port, uint16_t totalLen, uint8_t numFragments);
+
+    /// We have more fragments of r (some of them rebuilt if recovered), deliver it or ack as needed
+    void fragmentsArrived(NodeNum from, RxTransfer &r, bool lastFragment, bool recovered);
+
+    /// Rebuild the missing fragments of a group from the parity we have, @return true if we did
+    bool recoverGroup(RxTransfer &r, uint8_t group);
+
+    /// How many parity fragments per group our link to the receiver needs
+    uint8_t pickParity();
+
+    /// Offer our receiver a data channel, @return false if we can't (so we should just start sending)
+    bool offerChannel();
+    void sendChannel(NodeNum to, uint16_t transferId, uint8_t channel, uint8_t sf);
+
+    /// Is any transfer (sending or receiving) using, or about to use, a data channel
+    bool isChannelInUse();
+
+    /// Go back to the control channel (our radio finishes sending anything it already has queued first)
+    void leaveChannel();
+
+    /// Send as many fragments as our window allows
+    void sendWindow();
+
+    void sendFragment(uint8_t index);
+    void sendParity(uint8_t group);
+    void sendAck(RxTransfer &r);
+
+    /// Tell our observers how a transfer went, and free it
+    void finishTransfer(bool success);
+
+    /// Make sure our thread runs soon, because we have a new timer
+    void wakeup();
+
+    /// Find the record for a transfer we are receiving, or make one if allowed, @return NULL if we have no room
+    RxTransfer *findRx(NodeNum from, uint16_t id, bool create);
+};
+
+extern BulkTransferPlugin *bulkTransferPlugin;
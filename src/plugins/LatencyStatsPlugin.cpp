@@ -0,0 +1,36 @@
+#include "LatencyStatsPlugin.h"
+#include "PacketTrace.h"
+#include "configuration.h"
+#include <assert.h>
+
+MeshPacket *LatencyStatsPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    LOG_DEBUG(MESH, "Sending latency stats to 0x%x\n", currentRequest->from);
+
+    auto reply = allocDataPacket();
+    auto &payload = reply->decoded.data.payload;
+    static_assert(sizeof(LatencyStatsReplyHeader) + TRACE_NUM_STAGES * sizeof(LatencyStatsStageRecord) <=
+                      sizeof(payload.bytes),
+                  "Latency stats must fit in one packet");
+    uint8_t *out = payload.bytes;
+
+    LatencyStatsReplyHeader *h = (LatencyStatsReplyHeader *)out;
+    h->version = LATENCY_STATS_VERSION;
+    h->numStages = TRACE_NUM_STAGES;
+    out += sizeof(*h);
+
+    for (int i = 0; i < TRACE_NUM_STAGES; i++) {
+        TraceHistogram s = packetTrace.getHistogram((TraceStage)i);
+        LatencyStatsStageRecord *r = (LatencyStatsStageRecord *)out;
+        r->count = s.count;
+        r->meanUsec = s.getMeanUsec();
+        r->p50Usec = s.getPercentileUsec(50);
+        r->p90Usec = s.getPercentileUsec(90);
+        r->maxUsec = s.maxUsec;
+        out += sizeof(*r);
+    }
+
+    payload.size = out - payload.bytes;
+    return reply;
+}
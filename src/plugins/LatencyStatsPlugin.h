@@ -0,0 +1,37 @@
+#pragma once
+#include "SinglePortPlugin.h"
+
+/// The portnum we answer packet latency requests on (not yet in portnums.proto)
+#define LATENCY_STATS_PORTNUM ((PortNum)37)
+
+/// Bump this if the reply format changes
+#define LATENCY_STATS_VERSION 1
+
+/**
+ * Reports the per stage latencies packetTrace has measured for our rx and tx paths.
+ *
+ * Send any packet to us on LATENCY_STATS_PORTNUM, with want_response set, either from a phone API client or over the mesh.
+ * The reply payload is a LatencyStatsReplyHeader then numStages LatencyStatsStageRecords (in TraceStage order).  All fields
+ * are little endian.
+ */
+class LatencyStatsPlugin : public SinglePortPlugin
+{
+  public:
+    LatencyStatsPlugin() : SinglePortPlugin("latencystats", LATENCY_STATS_PORTNUM) {}
+
+  protected:
+    virtual MeshPacket *allocReply();
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t numStages;
+} LatencyStatsReplyHeader;
+
+typedef struct __attribute__((packed)) {
+    uint32_t count;
+    uint32_t meanUsec;
+    uint32_t p50Usec; // Percentiles are upper bounds, from power of 2 histogram buckets
+    uint32_t p90Usec;
+    uint32_t maxUsec;
+} LatencyStatsStageRecord;
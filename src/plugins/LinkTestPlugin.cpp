@@ -0,0 +1,458 @@
+#include "LinkTestPlugin.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "airtime.h"
+#include "configuration.h"
+#include <assert.h>
+
+LinkTestPlugin *linkTestPlugin;
+
+/// Test packet flags (as well as LINK_TEST_BIDIRECTIONAL)
+#define LINK_TEST_ECHO_ME 0x02
+
+/// Starts each test packet, the rest is padding up to the test's size
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LINK_TEST_DATA
+    uint16_t testId;
+    uint16_t seq;
+    uint16_t count; // The rest of the test's params, so the receiver knows what to expect (and can send the same back)
+    uint16_t intervalMsec;
+    uint8_t hops;
+    uint8_t flags;
+} LinkTestData;
+
+/// The whole payload of an echo of a test packet
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LINK_TEST_ECHO
+    uint16_t testId;
+    uint16_t seq;
+} LinkTestEcho;
+
+/// The whole payload of a sender's done message
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LINK_TEST_DONE
+    uint16_t testId;
+    uint16_t sent;
+} LinkTestDone;
+
+/// The whole payload of a receiver's result
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LINK_TEST_RESULT
+    uint16_t testId;
+    uint16_t received;
+    uint16_t duplicates;
+    uint16_t outOfOrder;
+    uint32_t bytes;
+    uint32_t rxMsec;
+} LinkTestResultMessage;
+
+static_assert(sizeof(LinkTestReportHeader) + 2 * sizeof(LinkTestReportDirection) <= sizeof(((Data *)0)->payload.bytes),
+              "Link test reports must fit in one packet");
+static_assert(sizeof(((Data *)0)->payload.bytes) <= UINT8_MAX, "Test sizes are a byte");
+static_assert(LINK_TEST_MAX_PACKETS % 8 == 0, "Our seen bitmap is whole bytes");
+
+LinkTestPlugin::LinkTestPlugin() : SinglePortPlugin("linktest", LINK_TEST_PORTNUM), concurrency::OSThread("LinkTest")
+{
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    memset(&result, 0, sizeof(result));
+    setEnabled(false); // Nothing to do until we have a test
+}
+
+bool LinkTestPlugin::startTest(const LinkTestParams &params)
+{
+    if (tx.active || !params.dest || params.dest == NODENUM_BROADCAST || params.dest == nodeDB.getNodeNum() || !params.count ||
+        params.count > LINK_TEST_MAX_PACKETS || params.size < sizeof(LinkTestData) ||
+        params.size > sizeof(((Data *)0)->payload.bytes) || params.hops > HOP_MAX + 1)
+        return false;
+
+    rx.active = false; // Anything we were still receiving was part of an older test
+    beginResult(params.dest, random(1, UINT16_MAX), params);
+
+    LOG_INFO(MESH, "Starting link test %u to 0x%x, %u packets of %u bytes every %u ms (hops=%u, bidirectional=%d)\n",
+             result.testId, params.dest, params.count, params.size, params.intervalMsec, params.hops, params.bidirectional);
+    startStream(false);
+    return true;
+}
+
+void LinkTestPlugin::beginResult(NodeNum peer, uint16_t testId, const LinkTestParams &params)
+{
+    memset(&result, 0, sizeof(result));
+    result.peer = peer;
+    result.testId = testId;
+    result.running = true;
+    result.params = params;
+}
+
+void LinkTestPlugin::startStream(bool reverse)
+{
+    memset(&tx, 0, sizeof(tx));
+    tx.active = true;
+    tx.reverse = reverse;
+    tx.startMsec = tx.nextMsec = millis();
+    tx.startAirtimeMsec = getAirtimeMsec(TX_LOG);
+    wakeup();
+}
+
+bool LinkTestPlugin::handleReceived(const MeshPacket &mp)
+{
+    auto &p = mp.decoded.data.payload;
+    if (p.size < 1)
+        return true;
+
+    if (p.bytes[0] == LINK_TEST_START) {
+        LinkTestStart s;
+        if (!isLocalRequest() || p.size < sizeof(s))
+            return true; // Only our own phone can start tests
+
+        memcpy(&s, p.bytes, sizeof(s));
+        LinkTestParams params = {s.dest, s.count, s.size, s.intervalMsec, s.hops, (s.flags & LINK_TEST_BIDIRECTIONAL) != 0};
+        if (!startTest(params))
+            LOG_WARN(MESH, "Can't start link test to 0x%x\n", s.dest);
+        return true;
+    }
+
+    if (mp.to != nodeDB.getNodeNum())
+        return true; // Tests are only between two nodes
+
+    if (p.bytes[0] == LINK_TEST_DATA)
+        handleData(mp);
+    else if (p.bytes[0] == LINK_TEST_ECHO)
+        handleEcho(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == LINK_TEST_DONE)
+        handleDone(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == LINK_TEST_RESULT)
+        handleResult(mp.from, p.bytes, p.size);
+
+    return true; // No one else should look at our test packets
+}
+
+void LinkTestPlugin::handleData(const MeshPacket &mp)
+{
+    auto &p = mp.decoded.data.payload;
+    LinkTestData d;
+    if (p.size < sizeof(d))
+        return;
+    memcpy(&d, p.bytes, sizeof(d));
+
+    if (!d.count || d.count > LINK_TEST_MAX_PACKETS || d.seq >= d.count) {
+        LOG_WARN(MESH, "Ignoring malformed link test packet from 0x%x\n", mp.from);
+        return;
+    }
+
+    uint32_t now = millis();
+    if (!rx.active || rx.from != mp.from || rx.testId != d.testId) {
+        if (result.peer != mp.from || result.testId != d.testId) {
+            if (tx.active) {
+                LOG_DEBUG(MESH, "Busy with link test %u, ignoring test %u from 0x%x\n", result.testId, d.testId, mp.from);
+                return;
+            }
+            if (rx.active)
+                finishRx(); // Let the sender of our last test know what we got
+
+            LinkTestParams params = {mp.from, d.count, (uint8_t)p.size, d.intervalMsec, d.hops,
+                                     (d.flags & LINK_TEST_BIDIRECTIONAL) != 0};
+            beginResult(mp.from, d.testId, params);
+        } else if (result.in.done)
+            return; // A straggler of a stream we have already reported
+
+        memset(&rx, 0, sizeof(rx));
+        rx.active = true;
+        rx.from = mp.from;
+        rx.testId = d.testId;
+        rx.count = d.count;
+        rx.firstMsec = now;
+
+        if ((d.flags & LINK_TEST_BIDIRECTIONAL) && !tx.active) {
+            LOG_INFO(MESH, "Starting the reverse stream of link test %u to 0x%x\n", d.testId, mp.from);
+            startStream(true);
+        }
+        wakeup(); // For our timeout
+    }
+
+    rx.lastMsec = now;
+    LinkTestDirection &in = result.in;
+    uint8_t bit = 1 << (d.seq % 8);
+    if (rx.seen[d.seq / 8] & bit)
+        in.duplicates++;
+    else {
+        rx.seen[d.seq / 8] |= bit;
+        if (in.received && d.seq < rx.highestSeq)
+            in.outOfOrder++;
+        else
+            rx.highestSeq = d.seq;
+        in.received++;
+        in.bytes += p.size;
+    }
+
+    if (d.flags & LINK_TEST_ECHO_ME) {
+        MeshPacket *e = allocTestPacket();
+        LinkTestEcho *echo = (LinkTestEcho *)e->decoded.data.payload.bytes;
+        echo->type = LINK_TEST_ECHO;
+        echo->testId = d.testId;
+        echo->seq = d.seq;
+        e->decoded.data.payload.size = sizeof(*echo);
+        service.sendToMesh(e);
+    }
+}
+
+void LinkTestPlugin::handleEcho(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LinkTestEcho e;
+    if (!tx.active || from != result.peer || len < sizeof(e))
+        return;
+    memcpy(&e, payload, sizeof(e));
+
+    size_t slot = (e.seq / LINK_TEST_ECHO_EVERY) % LINK_TEST_ECHO_SLOTS;
+    if (e.testId == result.testId && tx.echoMsecs[slot] && tx.echoSeqs[slot] == e.seq) {
+        result.rttMsec.add(millis() - tx.echoMsecs[slot]);
+        tx.echoMsecs[slot] = 0; // Only count the first copy
+    }
+}
+
+void LinkTestPlugin::handleDone(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LinkTestDone d;
+    if (len < sizeof(d))
+        return;
+    memcpy(&d, payload, sizeof(d));
+
+    if (result.peer != from || result.testId != d.testId) {
+        // We didn't hear any of this test, which is a result too
+        if (tx.active)
+            return;
+        if (rx.active)
+            finishRx();
+        LinkTestParams params = {from, d.sent, 0, 0, 0, false};
+        beginResult(from, d.testId, params);
+    }
+
+    result.in.sent = d.sent;
+    if (rx.active && rx.from == from && rx.testId == d.testId)
+        finishRx();
+    else {
+        // We already reported (so our result was lost), or never heard this stream at all
+        bool first = !result.in.done;
+        result.in.done = true;
+        sendResult();
+        if (first && !tx.active)
+            finishTest();
+    }
+}
+
+void LinkTestPlugin::handleResult(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LinkTestResultMessage r;
+    if (!tx.finishing || from != result.peer || len < sizeof(r))
+        return;
+    memcpy(&r, payload, sizeof(r));
+    if (r.testId != result.testId)
+        return;
+
+    LinkTestDirection &out = result.out;
+    out.done = true;
+    out.received = r.received;
+    out.duplicates = r.duplicates;
+    out.outOfOrder = r.outOfOrder;
+    out.bytes = r.bytes;
+    out.rxMsec = r.rxMsec;
+
+    tx.active = false;
+    if (!rx.active)
+        finishTest();
+}
+
+void LinkTestPlugin::finishRx()
+{
+    rx.active = false;
+    result.in.done = true;
+    result.in.rxMsec = rx.lastMsec - rx.firstMsec;
+    sendResult();
+
+    if (!tx.active)
+        finishTest();
+}
+
+void LinkTestPlugin::finishTest()
+{
+    result.running = false;
+
+    const LinkTestDirection &out = result.out, &in = result.in;
+    LOG_INFO(MESH, "Link test %u with 0x%x done: out %u/%u (%u dups, %u bps), in %u/%u (%u dups, %u bps), rtt p50 %u ms\n",
+             result.testId, result.peer, out.received, out.sent, out.duplicates, out.getGoodputBps(), in.received, in.sent,
+             in.duplicates, in.getGoodputBps(), result.rttMsec.getPercentileUsec(50));
+
+    MeshPacket *p = allocReport();
+    p->to = nodeDB.getNodeNum();
+    service.sendToPhone(p);
+}
+
+void LinkTestPlugin::sendData()
+{
+    MeshPacket *p = allocTestPacket();
+    auto &payload = p->decoded.data.payload;
+
+    LinkTestData *d = (LinkTestData *)payload.bytes;
+    d->type = LINK_TEST_DATA;
+    d->testId = result.testId;
+    d->seq = tx.nextSeq;
+    d->count = result.params.count;
+    d->intervalMsec = result.params.intervalMsec;
+    d->hops = result.params.hops;
+    d->flags = (result.params.bidirectional && !tx.reverse) ? LINK_TEST_BIDIRECTIONAL : 0;
+
+    if (tx.nextSeq % LINK_TEST_ECHO_EVERY == 0) {
+        size_t slot = (tx.nextSeq / LINK_TEST_ECHO_EVERY) % LINK_TEST_ECHO_SLOTS;
+        uint32_t now = millis();
+        d->flags |= LINK_TEST_ECHO_ME;
+        tx.echoSeqs[slot] = tx.nextSeq;
+        tx.echoMsecs[slot] = now ? now : 1;
+    }
+
+    payload.size = result.params.size; // The rest is already zeroed
+    tx.nextSeq++;
+    service.sendToMesh(p);
+}
+
+void LinkTestPlugin::sendDone()
+{
+    MeshPacket *p = allocTestPacket();
+    p->want_ack = true;
+    auto &payload = p->decoded.data.payload;
+
+    LinkTestDone *d = (LinkTestDone *)payload.bytes;
+    d->type = LINK_TEST_DONE;
+    d->testId = result.testId;
+    d->sent = tx.nextSeq;
+    payload.size = sizeof(*d);
+    service.sendToMesh(p);
+}
+
+void LinkTestPlugin::sendResult()
+{
+    MeshPacket *p = allocTestPacket();
+    p->want_ack = true;
+    auto &payload = p->decoded.data.payload;
+
+    const LinkTestDirection &in = result.in;
+    LinkTestResultMessage *r = (LinkTestResultMessage *)payload.bytes;
+    r->type = LINK_TEST_RESULT;
+    r->testId = result.testId;
+    r->received = in.received;
+    r->duplicates = in.duplicates;
+    r->outOfOrder = in.outOfOrder;
+    r->bytes = in.bytes;
+    r->rxMsec = in.rxMsec;
+    payload.size = sizeof(*r);
+    service.sendToMesh(p);
+}
+
+MeshPacket *LinkTestPlugin::allocTestPacket()
+{
+    MeshPacket *p = allocDataPacket();
+    p->to = result.peer;
+    if (result.params.hops)
+        p->hop_limit = result.params.hops - 1; // A packet with hop_limit 0 is only heard by our neighbors
+    return p;
+}
+
+MeshPacket *LinkTestPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    LOG_DEBUG(MESH, "Sending link test result to 0x%x\n", currentRequest->from);
+    return allocReport();
+}
+
+/// Fill in one direction of a report
+static uint8_t *writeDirection(uint8_t *out, const LinkTestDirection &d)
+{
+    LinkTestReportDirection *r = (LinkTestReportDirection *)out;
+    r->done = d.done;
+    r->sent = d.sent;
+    r->received = d.received;
+    r->duplicates = d.duplicates;
+    r->outOfOrder = d.outOfOrder;
+    r->bytes = d.bytes;
+    r->rxMsec = d.rxMsec;
+    r->goodputBps = d.getGoodputBps();
+    r->txAirtimeMsec = d.txAirtimeMsec;
+    return out + sizeof(*r);
+}
+
+MeshPacket *LinkTestPlugin::allocReport()
+{
+    MeshPacket *p = allocDataPacket();
+    auto &payload = p->decoded.data.payload;
+    uint8_t *out = payload.bytes;
+
+    LinkTestReportHeader *h = (LinkTestReportHeader *)out;
+    h->version = LINK_TEST_VERSION;
+    h->peer = result.peer;
+    h->testId = result.testId;
+    h->running = result.running;
+    h->rttCount = result.rttMsec.count;
+    h->rttMeanMsec = result.rttMsec.getMeanUsec();
+    h->rttP50Msec = result.rttMsec.getPercentileUsec(50);
+    h->rttP90Msec = result.rttMsec.getPercentileUsec(90);
+    h->rttMaxMsec = result.rttMsec.maxUsec;
+    out += sizeof(*h);
+
+    out = writeDirection(out, result.out);
+    out = writeDirection(out, result.in);
+
+    payload.size = out - payload.bytes;
+    return p;
+}
+
+void LinkTestPlugin::wakeup()
+{
+    setEnabled(true);
+    setIntervalFromNow(0);
+}
+
+int32_t LinkTestPlugin::runOnce()
+{
+    uint32_t now = millis();
+    int32_t next = 1000; // Often enough for our timeouts
+
+    if (tx.active && (int32_t)(now - tx.nextMsec) >= 0) {
+        if (!tx.finishing) {
+            TxQueueStatus q = router->getTxQueueStatus();
+            if (q.capacity && q.free <= LINK_TEST_QUEUE_RESERVE)
+                tx.nextMsec = now + LINK_TEST_QUEUE_POLL_MSEC;
+            else {
+                sendData();
+                tx.nextMsec = now + result.params.intervalMsec;
+                if (tx.nextSeq == result.params.count) {
+                    tx.finishing = true;
+                    tx.nextMsec = now + LINK_TEST_DONE_DELAY_MSEC;
+                }
+            }
+        } else if (tx.retries++ <= LINK_TEST_MAX_RETRIES) {
+            if (tx.retries == 1) {
+                // Our packets have all left our queue by now
+                result.out.sent = tx.nextSeq;
+                result.out.txAirtimeMsec = getAirtimeMsec(TX_LOG) - tx.startAirtimeMsec;
+            }
+            sendDone();
+            tx.nextMsec = now + LINK_TEST_RESULT_TIMEOUT_MSEC;
+        } else {
+            LOG_WARN(MESH, "No result from 0x%x for link test %u\n", result.peer, result.testId);
+            tx.active = false;
+            if (!rx.active)
+                finishTest();
+        }
+    }
+
+    if (rx.active && now - rx.lastMsec >= LINK_TEST_RX_TIMEOUT_MSEC) {
+        LOG_INFO(MESH, "Link test %u from 0x%x went quiet, reporting what we got\n", rx.testId, rx.from);
+        finishRx();
+    }
+
+    if (tx.active)
+        next = min(next, max((int32_t)(tx.nextMsec - now), (int32_t)0));
+    else if (!rx.active)
+        setEnabled(false); // Nothing left to do
+
+    return next;
+}
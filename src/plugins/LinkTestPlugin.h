@@ -0,0 +1,222 @@
+#pragma once
+#include "PacketTrace.h"
+#include "SinglePortPlugin.h"
+#include "concurrency/OSThread.h"
+
+/// The portnum our link tests use (not yet in portnums.proto)
+#define LINK_TEST_PORTNUM ((PortNum)43)
+
+/// Bump this if the report format changes
+#define LINK_TEST_VERSION 1
+
+/// A test stream has at most this many packets (the receiver keeps one bit for each, to find duplicates)
+#ifndef LINK_TEST_MAX_PACKETS
+#define LINK_TEST_MAX_PACKETS 1024
+#endif
+
+/// Every this many packets of a stream asks the receiver to echo it back, so we can measure round trip times
+#ifndef LINK_TEST_ECHO_EVERY
+#define LINK_TEST_ECHO_EVERY 4
+#endif
+
+/// How many echoes we can be waiting for at once (older ones are forgotten)
+#define LINK_TEST_ECHO_SLOTS 8
+
+/// We leave this many slots of our transmit queue free for everyone else, and wait if it has fewer
+#define LINK_TEST_QUEUE_RESERVE 2
+
+/// How often we look again when our transmit queue is too full to send
+#define LINK_TEST_QUEUE_POLL_MSEC 50
+
+/// After our last packet we wait this long (for it to clear our queue and any relays) before telling the receiver we are done
+#define LINK_TEST_DONE_DELAY_MSEC (3 * 1000L)
+
+/// We resend our done message this often until the receiver sends its result, and give up after LINK_TEST_MAX_RETRIES
+#define LINK_TEST_RESULT_TIMEOUT_MSEC (15 * 1000L)
+#define LINK_TEST_MAX_RETRIES 3
+
+/// A receiver which hears nothing of a stream for this long reports what it got anyway
+#define LINK_TEST_RX_TIMEOUT_MSEC (60 * 1000L)
+
+/// What to test, from the phone (a LinkTestStart sent to our own node) or our web server
+struct LinkTestParams {
+    NodeNum dest;
+    uint16_t count;        // Packets to send
+    uint8_t size;          // Payload bytes in each (at least our header, at most a full packet)
+    uint16_t intervalMsec; // Between packets, 0 sends as fast as our transmit queue takes them
+    uint8_t hops;          // The most hops our packets may take, 1 for only the link to a neighbor, 0 for our usual limit
+    bool bidirectional;    // The receiver also sends a stream like ours back to us at the same time
+};
+
+/// One direction of a test
+struct LinkTestDirection {
+    bool done;              // The receiver has reported (for our stream), or we have everything of theirs we will get
+    uint16_t sent;          // As the sender counted, 0 if the receiver never heard the sender's count
+    uint16_t received;      // Distinct packets delivered
+    uint16_t duplicates;
+    uint16_t outOfOrder;    // Delivered after a later packet
+    uint32_t bytes;         // Payload bytes delivered
+    uint32_t rxMsec;        // From the first packet delivered to the last
+    uint32_t txAirtimeMsec; // The sender's time on air while it sent the stream (only known for our own stream)
+
+    /// Delivered payload bits per second (while packets were arriving)
+    uint32_t getGoodputBps() const { return rxMsec ? (uint64_t)bytes * 8000 / rxMsec : 0; }
+
+    /// Delivered payload bytes for each second we were on the air
+    uint32_t getBytesPerAirtimeSec() const { return txAirtimeMsec ? (uint64_t)bytes * 1000 / txAirtimeMsec : 0; }
+};
+
+/// The latest test we took part in, as either end
+struct LinkTestResult {
+    NodeNum peer; // 0 if we haven't had a test
+    uint16_t testId;
+    bool running;
+    LinkTestParams params;
+    LinkTestDirection out; // Our stream, as the peer received it
+    LinkTestDirection in;  // The peer's stream, as we received it
+
+    /// Round trip times of echoed packets from our stream, in msecs rather than usecs (so its buckets run from 128 msecs)
+    TraceHistogram rttMsec;
+};
+
+/**
+ * An on air throughput test, between us and another node (one link, or across several hops).
+ *
+ * The phone sends us a LinkTestStart (to our own node on LINK_TEST_PORTNUM), or our web server posts to /json/linktest.  We
+ * then stream count numbered packets of size bytes to dest, one every intervalMsec (as long as our transmit queue has room,
+ * so short intervals measure how much the link can take), and every LINK_TEST_ECHO_EVERY packet asks dest to echo it back.
+ * When we are done, we tell dest how many we sent and it replies with what it received: delivered packets and bytes,
+ * duplicates, reordering and how long delivery took.  Bidirectional tests also have dest stream back to us as it receives.
+ *
+ * Our result has goodput, loss and duplicates for each direction, round trip time percentiles, and how many delivered bytes
+ * each second of our airtime bought (our airtime counts everything we sent meanwhile, including relaying for others).  We give
+ * it to our phone when the test finishes, and answer any packet on LINK_TEST_PORTNUM with want_response set with it (see
+ * LinkTestReportHeader).  Our web server shows it at /json/linktest.
+ *
+ * Test packets are plain unicasts without want_ack, so we see the loss of the link itself (and our normal routing).
+ */
+class LinkTestPlugin : public SinglePortPlugin, private concurrency::OSThread
+{
+    struct TxStream {
+        bool active;
+        bool reverse;   // The stream back to the sender of a bidirectional test
+        bool finishing; // All sent, waiting for the receiver's result
+        uint16_t nextSeq;
+        uint32_t nextMsec; // When we send our next packet (or done message)
+        uint32_t startMsec;
+        uint64_t startAirtimeMsec;
+        uint8_t retries;
+        uint16_t echoSeqs[LINK_TEST_ECHO_SLOTS];
+        uint32_t echoMsecs[LINK_TEST_ECHO_SLOTS]; // When we sent each, 0 if the slot is free
+    };
+
+    struct RxStream {
+        bool active;
+        NodeNum from;
+        uint16_t testId;
+        uint16_t count;
+        uint16_t highestSeq;
+        uint32_t firstMsec, lastMsec;
+        uint8_t seen[LINK_TEST_MAX_PACKETS / 8];
+    };
+
+    TxStream tx;
+    RxStream rx;
+    LinkTestResult result;
+
+  public:
+    LinkTestPlugin();
+
+    /// Start a test @return false if we are already sending one or params don't make sense
+    bool startTest(const LinkTestParams &params);
+
+    const LinkTestResult &getResult() const { return result; }
+
+  protected:
+    virtual bool handleReceived(const MeshPacket &mp);
+
+    virtual MeshPacket *allocReply();
+
+    virtual int32_t runOnce();
+
+  private:
+    /// Start sending our stream of the test in result (ours, or the reverse of a bidirectional one)
+    void startStream(bool reverse);
+
+    /// Forget our last result, for a new test (or a test we just heard of)
+    void beginResult(NodeNum peer, uint16_t testId, const LinkTestParams &params);
+
+    void handleData(const MeshPacket &mp);
+    void handleEcho(NodeNum from, const uint8_t *payload, size_t len);
+    void handleDone(NodeNum from, const uint8_t *payload, size_t len);
+    void handleResult(NodeNum from, const uint8_t *payload, size_t len);
+
+    void sendData();
+    void sendDone();
+    void sendResult();
+
+    /// We have all of a stream we will get, tell its sender
+    void finishRx();
+
+    /// Our part of the test is over, tell our phone about it
+    void finishTest();
+
+    /// A packet to our peer, sent with the test's hop limit
+    MeshPacket *allocTestPacket();
+
+    /// A packet holding our result (see LinkTestReportHeader)
+    MeshPacket *allocReport();
+
+    /// Make sure our thread runs soon, because we have a new timer
+    void wakeup();
+};
+
+/// The first byte of each of our messages
+enum LinkTestMessageType {
+    LINK_TEST_START = 0,
+    LINK_TEST_DATA = 1,
+    LINK_TEST_ECHO = 2,
+    LINK_TEST_DONE = 3,
+    LINK_TEST_RESULT = 4
+};
+
+/// Sent by the phone to its own node, to start a test.  All our messages are little endian.
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LINK_TEST_START
+    uint32_t dest;
+    uint16_t count;
+    uint8_t size;
+    uint16_t intervalMsec;
+    uint8_t hops;
+    uint8_t flags; // LINK_TEST_BIDIRECTIONAL
+} LinkTestStart;
+
+/// LinkTestStart (and test packet) flags
+#define LINK_TEST_BIDIRECTIONAL 0x01
+
+/// Our reply (and what we give our phone): a LinkTestReportHeader, then LinkTestReportDirections for out and in
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint32_t peer;
+    uint16_t testId;
+    uint8_t running;
+    uint32_t rttCount;
+    uint32_t rttMeanMsec;
+    uint32_t rttP50Msec; // Percentiles are upper bounds, from power of 2 histogram buckets
+    uint32_t rttP90Msec;
+    uint32_t rttMaxMsec;
+} LinkTestReportHeader;
+
+typedef struct __attribute__((packed)) {
+    uint8_t done;
+    uint16_t sent;
+    uint16_t received;
+    uint16_t duplicates;
+    uint16_t outOfOrder;
+    uint32_t bytes;
+    uint32_t rxMsec;
+    uint32_t goodputBps;
+    uint32_t txAirtimeMsec;
+} LinkTestReportDirection;
+
+extern LinkTestPlugin *linkTestPlugin;
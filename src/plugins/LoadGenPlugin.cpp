@@ -0,0 +1,382 @@
+#include "LoadGenPlugin.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "RTC.h"
+#include "airtime.h"
+#include "configuration.h"
+
+LoadGenPlugin *loadGenPlugin;
+
+/// Latencies longer than this are someone's clock being wrong, not a slow mesh
+#define LOAD_GEN_MAX_LATENCY_MSEC (10 * 60 * 1000L)
+
+/// Starts each packet of load, the rest is padding up to the run's size
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LOAD_GEN_DATA
+    uint16_t runId;
+    uint32_t coordinator;   // So nodes which weren't told about the run know where to report
+    uint16_t remainingSecs; // Until the sender stops, so receivers know when to report
+    uint32_t seq;
+    uint32_t sentMsec; // The low 32 bits of the sender's GPS time in msecs, 0 if it doesn't have one
+} LoadGenData;
+
+static_assert(sizeof(LoadGenReport) <= sizeof(((Data *)0)->payload.bytes), "Load reports must fit in one packet");
+static_assert(sizeof(((Data *)0)->payload.bytes) <= UINT8_MAX, "Load sizes are a byte");
+
+LoadGenPlugin::LoadGenPlugin() : SinglePortPlugin("loadgen", LOAD_GEN_PORTNUM), concurrency::OSThread("LoadGen")
+{
+    memset(&run, 0, sizeof(run));
+    memset(&stats, 0, sizeof(stats));
+    memset(reports, 0, sizeof(reports));
+    setEnabled(false); // Nothing to do until we are part of a run
+}
+
+bool LoadGenPlugin::startRun(NodeNum dest, const LoadGenParams &params)
+{
+    if (!dest || !params.durationSecs || params.durationSecs > LOAD_GEN_MAX_DURATION_SECS || !params.perMin ||
+        params.perMin > LOAD_GEN_MAX_PER_MIN || params.size < sizeof(LoadGenData) ||
+        params.size > sizeof(((Data *)0)->payload.bytes) || params.unicastPercent > 100 || params.reliablePercent > 100)
+        return false;
+
+    coordinatedRunId = random(1, UINT16_MAX);
+    numReports = 0;
+
+    LoadGenParams p = params;
+    p.coordinator = nodeDB.getNodeNum();
+    LOG_INFO(MESH, "Starting load run %u on 0x%x: %u packets/min of %u bytes for %u secs (%u%% unicast, %u%% reliable)\n",
+             coordinatedRunId, dest, p.perMin, p.size, p.durationSecs, p.unicastPercent, p.reliablePercent);
+
+    if (dest == nodeDB.getNodeNum()) {
+        beginRun(coordinatedRunId, p, true, p.durationSecs * 1000UL);
+        return true;
+    }
+
+    MeshPacket *out = allocDataPacket();
+    out->to = dest;
+    out->want_ack = dest != NODENUM_BROADCAST;
+    LoadGenStart *s = (LoadGenStart *)out->decoded.data.payload.bytes;
+    s->type = LOAD_GEN_START;
+    s->runId = coordinatedRunId;
+    s->dest = 0; // Marks it as coming from the coordinator rather than a phone
+    s->coordinator = p.coordinator;
+    s->durationSecs = p.durationSecs;
+    s->perMin = p.perMin;
+    s->size = p.size;
+    s->unicastPercent = p.unicastPercent;
+    s->reliablePercent = p.reliablePercent;
+    out->decoded.data.payload.size = sizeof(*s);
+    service.sendToMesh(out);
+    return true;
+}
+
+void LoadGenPlugin::stopRun()
+{
+    if (!coordinatedRunId)
+        return;
+
+    LOG_INFO(MESH, "Stopping load run %u\n", coordinatedRunId);
+    MeshPacket *out = allocDataPacket();
+    out->to = NODENUM_BROADCAST;
+    LoadGenStop *s = (LoadGenStop *)out->decoded.data.payload.bytes;
+    s->type = LOAD_GEN_STOP;
+    s->runId = coordinatedRunId;
+    out->decoded.data.payload.size = sizeof(*s);
+    service.sendToMesh(out); // We hear our own broadcast, which stops us too
+}
+
+void LoadGenPlugin::beginRun(uint16_t runId, const LoadGenParams &params, bool generating, uint32_t remainingMsec)
+{
+    if (run.active && run.runId != runId)
+        sendReport(); // Whatever we have of the older run
+
+    RouterStats r;
+    router->getStats(r);
+
+    uint32_t now = millis();
+    memset(&run, 0, sizeof(run));
+    memset(&stats, 0, sizeof(stats));
+    run.active = true;
+    run.generating = generating;
+    run.runId = runId;
+    run.params = params;
+    run.endMsec = now + remainingMsec;
+    run.reportMsec = run.endMsec + LOAD_GEN_REPORT_DELAY_MSEC + random(LOAD_GEN_REPORT_JITTER_MSEC);
+    if (generating)
+        run.nextMsec = now + random(60 * 1000L / params.perMin); // Don't start in step with every other generator
+    run.startRetransmissions = r.retransmissions;
+    run.startAirtimeMsec = getAirtimeMsec(TX_LOG);
+    wakeup();
+}
+
+bool LoadGenPlugin::handleReceived(const MeshPacket &mp)
+{
+    auto &p = mp.decoded.data.payload;
+    if (p.size < 1)
+        return true;
+
+    if (p.bytes[0] == LOAD_GEN_START)
+        handleStart(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == LOAD_GEN_STOP)
+        handleStop(mp.from, p.bytes, p.size);
+    else if (p.bytes[0] == LOAD_GEN_DATA)
+        handleData(mp);
+    else if (p.bytes[0] == LOAD_GEN_REPORT && mp.to == nodeDB.getNodeNum())
+        handleReport(mp.from, p.bytes, p.size);
+
+    return true; // No one else should look at our load
+}
+
+void LoadGenPlugin::handleStart(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LoadGenStart s;
+    if (len < sizeof(s))
+        return;
+    memcpy(&s, payload, sizeof(s));
+
+    LoadGenParams params = {s.coordinator, s.durationSecs, s.perMin, s.size, s.unicastPercent, s.reliablePercent};
+    if (from == nodeDB.getNodeNum()) {
+        // From our phone (one we broadcast ourselves comes back with dest 0)
+        if (s.dest && !startRun(s.dest, params))
+            LOG_WARN(MESH, "Can't start load run on 0x%x\n", s.dest);
+        return;
+    }
+
+    if (!s.runId || !s.coordinator || !s.durationSecs || !s.perMin || s.size < sizeof(LoadGenData) ||
+        s.size > sizeof(((Data *)0)->payload.bytes) || s.unicastPercent > 100 || s.reliablePercent > 100) {
+        LOG_WARN(MESH, "Ignoring malformed load run start from 0x%x\n", from);
+        return;
+    }
+
+    // Whoever asked, we don't go beyond our own limits
+    params.durationSecs = min((uint32_t)params.durationSecs, (uint32_t)LOAD_GEN_MAX_DURATION_SECS);
+    params.perMin = min((uint32_t)params.perMin, (uint32_t)LOAD_GEN_MAX_PER_MIN);
+
+    LOG_INFO(MESH, "Generating load run %u for 0x%x: %u packets/min of %u bytes for %u secs\n", s.runId, s.coordinator,
+             params.perMin, params.size, params.durationSecs);
+    beginRun(s.runId, params, true, params.durationSecs * 1000UL);
+}
+
+void LoadGenPlugin::handleStop(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LoadGenStop s;
+    if (len < sizeof(s))
+        return;
+    memcpy(&s, payload, sizeof(s));
+
+    if (from == nodeDB.getNodeNum() && !s.runId) {
+        stopRun(); // From our phone, our broadcast of it has the run's id
+        return;
+    }
+
+    if (run.active && run.runId == s.runId && (int32_t)(run.endMsec - millis()) > 0) {
+        LOG_INFO(MESH, "Load run %u stopped by 0x%x\n", s.runId, from);
+        run.endMsec = millis();
+        run.reportMsec = run.endMsec + LOAD_GEN_REPORT_DELAY_MSEC + random(LOAD_GEN_REPORT_JITTER_MSEC);
+        wakeup();
+    }
+}
+
+void LoadGenPlugin::handleData(const MeshPacket &mp)
+{
+    auto &p = mp.decoded.data.payload;
+    LoadGenData d;
+    if (mp.from == nodeDB.getNodeNum() || p.size < sizeof(d))
+        return; // Our own broadcast
+    memcpy(&d, p.bytes, sizeof(d));
+
+    uint16_t remainingSecs = min((uint32_t)d.remainingSecs, (uint32_t)LOAD_GEN_MAX_DURATION_SECS);
+    uint32_t remainingMsec = remainingSecs * 1000UL;
+    if (!run.active || run.runId != d.runId) {
+        if (run.active && run.generating && (int32_t)(run.endMsec - millis()) > 0)
+            return; // We are busy generating a different run, don't let its load muddle our stats
+
+        LoadGenParams params = {d.coordinator, remainingSecs, 0, 0, 0, 0};
+        beginRun(d.runId, params, false, remainingMsec);
+    } else if (!run.generating && (int32_t)(millis() + remainingMsec - run.endMsec) > 0) {
+        // A sender which started later than the ones we heard first
+        run.endMsec = millis() + remainingMsec;
+        run.reportMsec = run.endMsec + LOAD_GEN_REPORT_DELAY_MSEC + random(LOAD_GEN_REPORT_JITTER_MSEC);
+    }
+
+    if (mp.to == NODENUM_BROADCAST)
+        stats.rxBroadcasts++;
+    else if (mp.to == nodeDB.getNodeNum())
+        stats.rxUnicasts++;
+    else
+        return; // Someone else's unicast, which we only overheard
+
+    for (size_t i = 0; i < LOAD_GEN_MAX_REPORTS; i++) {
+        if (run.senders[i] == mp.from)
+            break;
+        if (!run.senders[i]) {
+            run.senders[i] = mp.from;
+            stats.rxSenders++;
+            break;
+        }
+    }
+
+    uint32_t now = (uint32_t)getValidTimeMsec(RTCQualityGPS);
+    if (d.sentMsec && now && now - d.sentMsec < LOAD_GEN_MAX_LATENCY_MSEC)
+        stats.latencyMsec.add(now - d.sentMsec);
+}
+
+void LoadGenPlugin::handleReport(NodeNum from, const uint8_t *payload, size_t len)
+{
+    LoadGenReport r;
+    if (len < sizeof(r))
+        return;
+    memcpy(&r, payload, sizeof(r));
+
+    if (r.version != LOAD_GEN_VERSION || !coordinatedRunId || r.runId != coordinatedRunId)
+        return; // Our phone gets it anyway (like every packet we receive)
+
+    addReport(from, r);
+}
+
+void LoadGenPlugin::addReport(NodeNum from, const LoadGenReport &r)
+{
+    LOG_INFO(MESH, "Load run %u report from 0x%x: sent %u+%u (%u skipped, %u retransmissions, %u ms airtime), received %u+%u\n",
+             r.runId, from, r.sentBroadcasts, r.sentUnicasts, r.skipped, r.retransmissions, r.txAirtimeMsec, r.rxBroadcasts,
+             r.rxUnicasts);
+
+    size_t i = 0;
+    while (i < numReports && reports[i].from != from)
+        i++;
+    if (i == LOAD_GEN_MAX_REPORTS) {
+        LOG_WARN(MESH, "No room for the load report from 0x%x\n", from);
+        return;
+    }
+    if (i == numReports)
+        numReports++;
+    reports[i] = {from, r};
+}
+
+void LoadGenPlugin::sendLoad()
+{
+    stats.offered++;
+    TxQueueStatus q = router->getTxQueueStatus();
+    if (q.capacity && q.free <= LOAD_GEN_QUEUE_RESERVE) {
+        stats.skipped++; // Real traffic comes first, and the skips show our offered load was more than the mesh could take
+        return;
+    }
+
+    MeshPacket *p = allocDataPacket();
+    p->to = NODENUM_BROADCAST;
+    if ((uint32_t)random(100) < run.params.unicastPercent) {
+        NodeNum dest = pickUnicastDest();
+        if (dest)
+            p->to = dest;
+    }
+    p->want_ack = (uint32_t)random(100) < run.params.reliablePercent;
+
+    auto &payload = p->decoded.data.payload;
+    LoadGenData *d = (LoadGenData *)payload.bytes;
+    d->type = LOAD_GEN_DATA;
+    d->runId = run.runId;
+    d->coordinator = run.params.coordinator;
+    d->remainingSecs = (run.endMsec - millis()) / 1000;
+    d->seq = run.nextSeq++;
+    d->sentMsec = (uint32_t)getValidTimeMsec(RTCQualityGPS);
+    payload.size = run.params.size; // The rest is already zeroed
+
+    if (p->to == NODENUM_BROADCAST)
+        stats.sentBroadcasts++;
+    else
+        stats.sentUnicasts++;
+    if (p->want_ack)
+        stats.sentReliable++;
+    service.sendToMesh(p);
+}
+
+NodeNum LoadGenPlugin::pickUnicastDest()
+{
+    // Reservoir sampling over the nodes we have heard from recently
+    NodeNum picked = 0;
+    uint32_t numSeen = 0;
+    for (size_t i = 0; i < nodeDB.getNumNodes(); i++) {
+        const NodeInfo *n = nodeDB.getNodeByIndex(i);
+        if (n->num == nodeDB.getNodeNum() || sinceLastSeen(n) >= NUM_ONLINE_SECS)
+            continue;
+        if (random(++numSeen) == 0)
+            picked = n->num;
+    }
+    return picked;
+}
+
+void LoadGenPlugin::sendReport()
+{
+    RouterStats r;
+    router->getStats(r);
+    if (run.generating) {
+        stats.retransmissions = r.retransmissions - run.startRetransmissions;
+        stats.txAirtimeMsec = getAirtimeMsec(TX_LOG) - run.startAirtimeMsec;
+    }
+    run.active = false;
+
+    MeshPacket *p = allocDataPacket();
+    p->to = run.params.coordinator;
+    p->want_ack = true;
+    LoadGenReport *out = (LoadGenReport *)p->decoded.data.payload.bytes;
+    out->type = LOAD_GEN_REPORT;
+    out->version = LOAD_GEN_VERSION;
+    out->runId = run.runId;
+    out->offered = stats.offered;
+    out->skipped = stats.skipped;
+    out->sentBroadcasts = stats.sentBroadcasts;
+    out->sentUnicasts = stats.sentUnicasts;
+    out->sentReliable = stats.sentReliable;
+    out->retransmissions = stats.retransmissions;
+    out->txAirtimeMsec = stats.txAirtimeMsec;
+    out->rxBroadcasts = stats.rxBroadcasts;
+    out->rxUnicasts = stats.rxUnicasts;
+    out->rxSenders = stats.rxSenders;
+    out->latencyCount = stats.latencyMsec.count;
+    out->latencyMeanMsec = stats.latencyMsec.getMeanUsec(); // Our latency histogram counts msecs
+    out->latencyP50Msec = stats.latencyMsec.getPercentileUsec(50);
+    out->latencyP90Msec = stats.latencyMsec.getPercentileUsec(90);
+    out->latencyMaxMsec = stats.latencyMsec.maxUsec;
+    p->decoded.data.payload.size = sizeof(*out);
+
+    if (p->to == nodeDB.getNodeNum()) {
+        addReport(p->to, *out); // We coordinated this run ourselves
+        service.sendToPhone(p);
+    } else {
+        LOG_DEBUG(MESH, "Sending our report of load run %u to 0x%x\n", run.runId, p->to);
+        service.sendToMesh(p);
+    }
+}
+
+void LoadGenPlugin::wakeup()
+{
+    setEnabled(true);
+    setIntervalFromNow(0);
+}
+
+int32_t LoadGenPlugin::runOnce()
+{
+    if (!run.active) {
+        setEnabled(false);
+        return 0;
+    }
+
+    uint32_t now = millis();
+    bool generating = run.generating && (int32_t)(run.endMsec - now) > 0;
+    if (generating && (int32_t)(now - run.nextMsec) >= 0) {
+        sendLoad();
+
+        // Jitter each interval by +-50%, so generators don't fall into step
+        uint32_t interval = 60 * 1000L / run.params.perMin;
+        run.nextMsec = now + interval / 2 + random(interval + 1);
+    }
+
+    if ((int32_t)(now - run.reportMsec) >= 0) {
+        sendReport();
+        setEnabled(false);
+        return 0;
+    }
+
+    uint32_t next = run.reportMsec - now;
+    if (generating)
+        next = min(next, (uint32_t)max((int32_t)(run.nextMsec - now), (int32_t)0));
+    return next;
+}
@@ -0,0 +1,207 @@
+#pragma once
+#include "PacketTrace.h"
+#include "SinglePortPlugin.h"
+#include "concurrency/OSThread.h"
+
+/// The portnum of our synthetic load (not yet in portnums.proto)
+#define LOAD_GEN_PORTNUM ((PortNum)46)
+
+/// Bump this if the report format changes
+#define LOAD_GEN_VERSION 1
+
+/// The longest run we will take part in, so a node which never hears a stop doesn't flood the mesh forever
+#ifndef LOAD_GEN_MAX_DURATION_SECS
+#define LOAD_GEN_MAX_DURATION_SECS (60 * 60)
+#endif
+
+/// The most packets a minute we will generate
+#ifndef LOAD_GEN_MAX_PER_MIN
+#define LOAD_GEN_MAX_PER_MIN 120
+#endif
+
+/// We leave this many slots of our transmit queue free for everyone else, and skip a packet if it has fewer
+#define LOAD_GEN_QUEUE_RESERVE 2
+
+/// After a run ends we wait this long (for its last packets and retransmissions to land), plus a random part of
+/// LOAD_GEN_REPORT_JITTER_MSEC (so every node's report doesn't go out at once), before we report to the coordinator
+#define LOAD_GEN_REPORT_DELAY_MSEC (30 * 1000L)
+#define LOAD_GEN_REPORT_JITTER_MSEC (60 * 1000L)
+
+/// How many nodes' reports a coordinator keeps (for the latest run it started)
+#ifndef LOAD_GEN_MAX_REPORTS
+#define LOAD_GEN_MAX_REPORTS 16
+#endif
+
+/// What to generate, from the START a coordinator sent us
+struct LoadGenParams {
+    NodeNum coordinator;     // Where we report
+    uint16_t durationSecs;   // How long we generate for
+    uint16_t perMin;         // Packets a minute
+    uint8_t size;            // Payload bytes in each (at least our header, at most a full packet)
+    uint8_t unicastPercent;  // How many of our packets go to a random node we know, the rest are broadcasts
+    uint8_t reliablePercent; // How many of our packets are sent with want_ack
+};
+
+/// One node's view of a run, which it reports to the coordinator
+struct LoadGenStats {
+    // What we generated
+    uint32_t offered;         // Packets our rate called for
+    uint32_t skipped;         // ...which we didn't send because our transmit queue was full
+    uint32_t sentBroadcasts;
+    uint32_t sentUnicasts;
+    uint32_t sentReliable;    // Of those, how many had want_ack
+    uint32_t retransmissions; // By our router while we ran (including for others' packets we relayed reliably)
+    uint32_t txAirtimeMsec;   // Our time on air while we ran (including relaying, which is the mesh's real cost)
+
+    // What we received of everyone's load
+    uint32_t rxBroadcasts;
+    uint32_t rxUnicasts; // Sent to us
+    uint32_t rxSenders;  // How many different nodes' load we heard (up to LOAD_GEN_MAX_REPORTS of them)
+
+    /// Sender to us, only for packets where both had GPS time (in msecs rather than usecs, like LinkTestResult::rttMsec)
+    TraceHistogram latencyMsec;
+};
+
+/// The first byte of each of our messages
+enum LoadGenMessageType { LOAD_GEN_START = 0, LOAD_GEN_STOP = 1, LOAD_GEN_DATA = 2, LOAD_GEN_REPORT = 3 };
+
+/// Starts a run.  Our phone sends it to our own node (with dest set) to make us the coordinator, we then send it (with dest
+/// 0) to dest.  All our messages are little endian.
+typedef struct __attribute__((packed)) {
+    uint8_t type;   // LOAD_GEN_START
+    uint16_t runId; // Set by the coordinator
+    uint32_t dest;  // The node (or NODENUM_BROADCAST) our phone wants to start
+    uint32_t coordinator;
+    uint16_t durationSecs;
+    uint16_t perMin;
+    uint8_t size;
+    uint8_t unicastPercent;
+    uint8_t reliablePercent;
+} LoadGenStart;
+
+/// Ends a run early, our phone sends it to our own node and we broadcast it
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LOAD_GEN_STOP
+    uint16_t runId;
+} LoadGenStop;
+
+/// What each node sends its coordinator (and the coordinator gives its phone), the fields of LoadGenStats in order
+typedef struct __attribute__((packed)) {
+    uint8_t type; // LOAD_GEN_REPORT
+    uint8_t version;
+    uint16_t runId;
+    uint32_t offered;
+    uint32_t skipped;
+    uint32_t sentBroadcasts;
+    uint32_t sentUnicasts;
+    uint32_t sentReliable;
+    uint32_t retransmissions;
+    uint32_t txAirtimeMsec;
+    uint32_t rxBroadcasts;
+    uint32_t rxUnicasts;
+    uint32_t rxSenders;
+    uint32_t latencyCount;
+    uint32_t latencyMeanMsec;
+    uint32_t latencyP50Msec; // Percentiles are upper bounds, from power of 2 histogram buckets
+    uint32_t latencyP90Msec;
+    uint32_t latencyMaxMsec;
+} LoadGenReport;
+
+/**
+ * A synthetic load generator, for finding out how many users sending how many messages our mesh copes with (before a big
+ * event rather than during it).
+ *
+ * A coordinator (our phone sends a LoadGenStart to its own node, or our web server posts to /json/loadgen) sends START to the
+ * nodes it wants to generate load, or broadcasts it to all of them.  Each of those then sends perMin packets a minute (at
+ * jittered intervals) for durationSecs: unicastPercent of them to a random node we heard recently and the rest broadcasts,
+ * reliablePercent with want_ack, each padded to size bytes.  Every node which hears load traffic counts what it received
+ * (and, when both it and the sender have GPS time, how long it took).  When the run ends each node that generated or
+ * received load sends its LoadGenStats to the coordinator, whose phone gets every report (and our web server shows them).
+ * From those the coordinator can work out delivery, latency, retries and airtime per offered load; running again at higher
+ * rates finds the knee of the capacity curve under real RF conditions.
+ *
+ * All of it is on LOAD_GEN_PORTNUM, which phone apps ignore, and MeshService queues it for phones at our lowest priority.
+ * Like the rest of our remote admin, anyone on our channel can start a run, but runs are capped by LOAD_GEN_MAX_DURATION_SECS
+ * and LOAD_GEN_MAX_PER_MIN, STOP ends one early, and we always leave room in our transmit queue for real traffic.
+ */
+class LoadGenPlugin : public SinglePortPlugin, private concurrency::OSThread
+{
+    /// The run we are taking part in (or last took part in)
+    struct Run {
+        bool active;     // We haven't reported yet
+        bool generating; // We were told to generate load (rather than just hearing someone else's)
+        uint16_t runId;
+        LoadGenParams params;
+        uint32_t endMsec;    // When generating (or hearing load) stops
+        uint32_t reportMsec; // When we report
+        uint32_t nextMsec;   // When we send our next packet
+        uint32_t nextSeq;
+        uint32_t startRetransmissions;
+        uint64_t startAirtimeMsec;
+        NodeNum senders[LOAD_GEN_MAX_REPORTS]; // Whose load we have heard
+    };
+
+    /// One node's report of the run we coordinated
+    struct Report {
+        NodeNum from;
+        LoadGenReport report;
+    };
+
+    Run run;
+    LoadGenStats stats;
+
+    /// As a coordinator, the run we started and the reports we have for it
+    uint16_t coordinatedRunId = 0;
+    Report reports[LOAD_GEN_MAX_REPORTS];
+    size_t numReports = 0;
+
+  public:
+    LoadGenPlugin();
+
+    /**
+     * As a coordinator, start a run on dest (a node, or NODENUM_BROADCAST for every node which hears us)
+     *
+     * @return false if params don't make sense
+     */
+    bool startRun(NodeNum dest, const LoadGenParams &params);
+
+    /// As a coordinator, stop the run we started
+    void stopRun();
+
+    /// The run we coordinated, and the reports we have for it
+    uint16_t getCoordinatedRunId() const { return coordinatedRunId; }
+    size_t getNumReports() const { return numReports; }
+    NodeNum getReportNode(size_t i) const { return reports[i].from; }
+    const LoadGenReport &getReport(size_t i) const { return reports[i].report; }
+
+  protected:
+    virtual bool handleReceived(const MeshPacket &mp);
+
+    virtual int32_t runOnce();
+
+  private:
+    /// Take part in a run (forgetting any earlier one)
+    void beginRun(uint16_t runId, const LoadGenParams &params, bool generating, uint32_t remainingMsec);
+
+    void handleStart(NodeNum from, const uint8_t *payload, size_t len);
+    void handleStop(NodeNum from, const uint8_t *payload, size_t len);
+    void handleData(const MeshPacket &mp);
+    void handleReport(NodeNum from, const uint8_t *payload, size_t len);
+
+    /// Send our next packet of load (if our transmit queue has room)
+    void sendLoad();
+
+    /// Send our stats to the run's coordinator
+    void sendReport();
+
+    /// As a coordinator, keep a node's report of our run
+    void addReport(NodeNum from, const LoadGenReport &r);
+
+    /// A random node we have heard from recently (not us), or 0 if we don't know any
+    NodeNum pickUnicastDest();
+
+    /// Make sure our thread runs soon, because we have a new timer
+    void wakeup();
+};
+
+extern LoadGenPlugin *loadGenPlugin;
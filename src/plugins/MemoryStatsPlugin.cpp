@@ -0,0 +1,43 @@
+#include "MemoryStatsPlugin.h"
+#include "MemoryMonitor.h"
+#include "configuration.h"
+#include <assert.h>
+
+MeshPacket *MemoryStatsPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    if (!memoryMonitor)
+        return NULL;
+    LOG_DEBUG(MESH, "Sending memory stats to 0x%x\n", currentRequest->from);
+
+    MemoryStats s = memoryMonitor->getStats();
+
+    auto reply = allocDataPacket();
+    auto &payload = reply->decoded.data.payload;
+    uint8_t *out = payload.bytes;
+    const uint8_t *end = payload.bytes + sizeof(payload.bytes);
+
+    MemoryStatsReplyHeader *h = (MemoryStatsReplyHeader *)out;
+    h->version = MEMORY_STATS_VERSION;
+    h->numTasks = 0;
+    h->secsSinceSample = s.sampleMsec ? (millis() - s.sampleMsec) / 1000 : UINT32_MAX;
+    h->freeHeap = s.freeHeap;
+    h->largestFreeBlock = s.largestFreeBlock;
+    h->minFreeHeap = s.minFreeHeap;
+    h->packetsInUse = s.packetsInUse;
+    h->maxPacketsInUse = s.maxPacketsInUse;
+    h->packetCapacity = s.packetCapacity;
+    h->packetAllocFailures = min(s.packetAllocFailures, (uint32_t)UINT16_MAX);
+    out += sizeof(*h);
+
+    for (size_t i = 0; i < s.numTasks && out + sizeof(MemoryStatsTaskRecord) <= end; i++) {
+        MemoryStatsTaskRecord *r = (MemoryStatsTaskRecord *)out;
+        strncpy(r->name, s.tasks[i].name, sizeof(r->name));
+        r->minFreeBytes = min(s.tasks[i].minFreeBytes, (uint32_t)UINT16_MAX);
+        out += sizeof(*r);
+        h->numTasks++;
+    }
+
+    payload.size = out - payload.bytes;
+    return reply;
+}
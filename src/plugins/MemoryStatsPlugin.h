@@ -0,0 +1,42 @@
+#pragma once
+#include "SinglePortPlugin.h"
+
+/// The portnum we answer memory statistics requests on (not yet in portnums.proto)
+#define MEMORY_STATS_PORTNUM ((PortNum)38)
+
+/// Bump this if the reply format changes
+#define MEMORY_STATS_VERSION 1
+
+/**
+ * Reports the latest MemoryMonitor sample (heap, packet pool and per task stack high water marks).
+ *
+ * Send any packet to us on MEMORY_STATS_PORTNUM, with want_response set, either from a phone API client or over the mesh.  The
+ * reply payload is a MemoryStatsReplyHeader then numTasks MemoryStatsTaskRecords (as many tasks as fit in one packet).  All
+ * fields are little endian.
+ */
+class MemoryStatsPlugin : public SinglePortPlugin
+{
+  public:
+    MemoryStatsPlugin() : SinglePortPlugin("memorystats", MEMORY_STATS_PORTNUM) {}
+
+  protected:
+    virtual MeshPacket *allocReply();
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t numTasks;
+    uint32_t secsSinceSample;
+    uint32_t freeHeap;
+    uint32_t largestFreeBlock;
+    uint32_t minFreeHeap;
+    uint16_t packetsInUse;
+    uint16_t maxPacketsInUse;
+    uint16_t packetCapacity;
+    uint16_t packetAllocFailures; // Saturates
+} MemoryStatsReplyHeader;
+
+typedef struct __attribute__((packed)) {
+    char name[8];          // Not NUL terminated if the name fills it
+    uint16_t minFreeBytes; // Saturates
+} MemoryStatsTaskRecord;
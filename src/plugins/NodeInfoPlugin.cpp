@@ -5,6 +5,8 @@
 #include "Router.h"
 #include "configuration.h"
 #include "main.h"
+#include <pb_decode.h>
+#include <pb_encode.h>
 
 NodeInfoPlugin *nodeInfoPlugin;
 
@@ -32,9 +34,99 @@ void NodeInfoPlugin::sendOurNodeInfo(NodeNum dest, bool wantReplies)
     p->to = dest;
     p->decoded.want_response = wantReplies;
 
+    if (dest == NODENUM_BROADCAST)
+        sentHash = hashUser(owner);
+
     service.sendToMesh(p);
 }
 
+/// FNV-1a
+static uint32_t hashBytes(uint32_t h, const void *bytes, size_t len)
+{
+    const uint8_t *b = (const uint8_t *)bytes;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ b[i]) * 16777619;
+    return h;
+}
+
+bool NodeInfoPlugin::ownerChanged() const
+{
+    return hashUser(owner) != sentHash;
+}
+
+uint32_t NodeInfoPlugin::hashUser(const User &u)
+{
+    // Only the string contents, whatever follows their terminators varies between nodes.  The terminators keep "ab","c"
+    // and "a","bc" apart.
+    uint32_t h = 2166136261;
+    h = hashBytes(h, u.id, strlen(u.id) + 1);
+    h = hashBytes(h, u.long_name, strlen(u.long_name) + 1);
+    h = hashBytes(h, u.short_name, strlen(u.short_name) + 1);
+    return hashBytes(h, u.macaddr, sizeof(u.macaddr));
+}
+
+void NodeInfoPlugin::appendUserHash(MeshPacket *p) const
+{
+    auto &payload = p->decoded.data.payload;
+    pb_ostream_t stream = pb_ostream_from_buffer(payload.bytes + payload.size, sizeof(payload.bytes) - payload.size);
+
+    uint32_t hash = hashUser(owner);
+    if (pb_encode_tag(&stream, PB_WT_32BIT, POSITION_USER_HASH_TAG) && pb_encode_fixed32(&stream, &hash))
+        payload.size += stream.bytes_written;
+}
+
+void NodeInfoPlugin::checkUserHash(const MeshPacket &mp)
+{
+    if (mp.from == nodeDB.getNodeNum())
+        return;
+
+    auto &payload = mp.decoded.data.payload;
+    pb_istream_t stream = pb_istream_from_buffer(payload.bytes, payload.size);
+
+    uint32_t hash, tag;
+    pb_wire_type_t wireType;
+    bool eof, found = false;
+    while (!found && pb_decode_tag(&stream, &wireType, &tag, &eof)) {
+        if (tag == POSITION_USER_HASH_TAG && wireType == PB_WT_32BIT)
+            found = pb_decode_fixed32(&stream, &hash);
+        else if (!pb_skip_field(&stream, wireType))
+            return;
+    }
+    if (!found)
+        return; // An older node, which broadcasts its User regularly instead
+
+    checkUserHash(mp.from, hash);
+}
+
+void NodeInfoPlugin::checkUserHash(NodeNum from, uint32_t hash)
+{
+    if (from == nodeDB.getNodeNum())
+        return;
+
+    const NodeInfo *node = nodeDB.getNode(from);
+    if (node && node->has_user && hashUser(node->user) == hash)
+        return;
+
+    // Don't ask again if our request or their reply got lost, at least not right away
+    uint32_t now = millis();
+    Request *oldest = &requests[0];
+    for (size_t i = 0; i < NODEINFO_MAX_REQUESTS; i++) {
+        Request &r = requests[i];
+        if (r.node == from) {
+            if (now - r.msec < NODEINFO_REQUEST_MIN_SECS * 1000UL)
+                return;
+            oldest = &r;
+            break;
+        }
+        if (r.msec < oldest->msec) // Including any slots we haven't used yet
+            oldest = &r;
+    }
+    *oldest = {from, now};
+
+    LOG_DEBUG(MESH, "User hash of 0x%x doesn't match ours, asking for nodeinfo\n", from);
+    sendOurNodeInfo(from, true);
+}
+
 MeshPacket *NodeInfoPlugin::allocReply()
 {
     User &u = owner;
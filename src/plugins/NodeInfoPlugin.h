@@ -1,11 +1,39 @@
 #pragma once
 #include "ProtobufPlugin.h"
 
+/// The Position field we put a hash of the sender's User record in.  It isn't in mesh.proto, so other readers just skip it.
+#define POSITION_USER_HASH_TAG 100
+
+/// We ask any one node for its User record at most this often
+#ifndef NODEINFO_REQUEST_MIN_SECS
+#define NODEINFO_REQUEST_MIN_SECS (10 * 60)
+#endif
+
+/// How many nodes we remember asking (for NODEINFO_REQUEST_MIN_SECS)
+#define NODEINFO_MAX_REQUESTS 8
+
+/// Even if our User hasn't changed we broadcast it every this many send_owner_intervals, for nodes too old to ask for it
+#ifndef NODEINFO_REFRESH_INTERVALS
+#define NODEINFO_REFRESH_INTERVALS 8
+#endif
+
 /**
  * NodeInfo plugin for sending/receiving NodeInfos into the mesh
+ *
+ * Our User record almost never changes, so rather than broadcasting it regularly we put a hash of it in our beacons and
+ * position packets (see appendUserHash).  A node which hears a hash that doesn't match what it has for us asks for the whole record.
  */
 class NodeInfoPlugin : public ProtobufPlugin<User>
 {
+    /// The hash of the User we last broadcast
+    uint32_t sentHash = 0;
+
+    /// The nodes we recently asked for their User record
+    struct Request {
+        NodeNum node;
+        uint32_t msec;
+    } requests[NODEINFO_MAX_REQUESTS] = {};
+
   public:
     /** Constructor
      * name is for debugging output
@@ -17,6 +45,21 @@ class NodeInfoPlugin : public ProtobufPlugin<User>
      */
     void sendOurNodeInfo(NodeNum dest = NODENUM_BROADCAST, bool wantReplies = false);
 
+    /// Has our User changed since we last broadcast it
+    bool ownerChanged() const;
+
+    /// Add a hash of our User to p, which must have an encoded Position as its payload
+    void appendUserHash(MeshPacket *p) const;
+
+    /// Look for a User hash in a Position packet, and if it doesn't match what we have for the sender ask them for their User
+    void checkUserHash(const MeshPacket &mp);
+
+    /// If hash doesn't match the User we have for from, ask them for it
+    void checkUserHash(NodeNum from, uint32_t hash);
+
+    /// A hash of everything in a User record
+    static uint32_t hashUser(const User &u);
+
   protected:
     /** Called to handle a particular incoming message
 
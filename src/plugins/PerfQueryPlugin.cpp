@@ -0,0 +1,210 @@
+#include "PerfQueryPlugin.h"
+#include "CryptoEngine.h"
+#include "MemoryMonitor.h"
+#include "NodeDB.h"
+#include "NoiseMonitor.h"
+#include "PowerStats.h"
+#include "airtime.h"
+#include "concurrency/OSThread.h"
+#include "configuration.h"
+#include <assert.h>
+#include <stddef.h>
+
+PerfQueryPlugin *perfQueryPlugin;
+
+PerfQueryPlugin::PerfQueryPlugin() : SinglePortPlugin("perfquery", PERF_QUERY_PORTNUM)
+{
+    // Our platform setup seeded random() from hardware, so this is different every boot
+    bootNonce = ((uint32_t)random(0x10000) << 16) | random(0x10000);
+
+#ifdef PERF_QUERY_ADMIN_PSK
+    setAdminKey(PERF_QUERY_ADMIN_PSK);
+#endif
+}
+
+bool PerfQueryPlugin::setAdminKey(const char *hex)
+{
+    if (!crypto->setAuthKeyFromHex(hex))
+        return false;
+
+    LOG_INFO(MESH, "Answering remote performance queries made with our admin key\n");
+    return true;
+}
+
+void PerfQueryPlugin::computeMac(NodeNum from, const PerfQueryRequest &r, uint8_t *mac)
+{
+    uint8_t msg[offsetof(PerfQueryRequest, mac) + 2 * sizeof(NodeNum)];
+    NodeNum to = nodeDB.getNodeNum();
+    memcpy(msg, &r, offsetof(PerfQueryRequest, mac));
+    memcpy(msg + offsetof(PerfQueryRequest, mac), &from, sizeof(from));
+    memcpy(msg + offsetof(PerfQueryRequest, mac) + sizeof(from), &to, sizeof(to));
+
+    uint8_t full[CRYPTO_CMAC_LEN];
+    crypto->cmac(msg, sizeof(msg), full);
+    memcpy(mac, full, PERF_QUERY_MAC_LEN);
+}
+
+bool PerfQueryPlugin::isAuthorized(NodeNum from, const PerfQueryRequest &r)
+{
+    if (!crypto->hasAuthKey() || r.bootNonce != bootNonce)
+        return false;
+
+    uint8_t mac[PERF_QUERY_MAC_LEN];
+    computeMac(from, r, mac);
+    uint8_t diff = 0; // Compare every byte, so how long we take doesn't say how much of a forgery was right
+    for (size_t i = 0; i < sizeof(mac); i++)
+        diff |= mac[i] ^ r.mac[i];
+    if (diff)
+        return false;
+
+    AdminSeq *a = NULL;
+    for (size_t i = 0; i < PERF_QUERY_MAX_ADMINS && !a; i++)
+        if (admins[i].from == from)
+            a = &admins[i];
+    if (r.seq <= (a ? a->seq : forgottenSeq))
+        return false; // A replay (or a sender whose seq went backwards)
+
+    if (!a) {
+        a = &admins[nextAdmin];
+        nextAdmin = (nextAdmin + 1) % PERF_QUERY_MAX_ADMINS;
+        if (a->from && a->seq > forgottenSeq)
+            forgottenSeq = a->seq;
+        a->from = from;
+    }
+    a->seq = r.seq;
+    return true;
+}
+
+MeshPacket *PerfQueryPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    const MeshPacket &mp = *currentRequest;
+    auto &req = mp.decoded.data.payload;
+
+    PerfQueryRequest r;
+    if (req.size != sizeof(r))
+        return NULL;
+    memcpy(&r, req.bytes, sizeof(r));
+    if (r.version != PERF_QUERY_VERSION)
+        return NULL;
+
+    auto reply = allocDataPacket();
+    auto &payload = reply->decoded.data.payload;
+    uint8_t *out = payload.bytes;
+    const uint8_t *end = payload.bytes + sizeof(payload.bytes);
+
+    PerfQueryReplyHeader *h = (PerfQueryReplyHeader *)out;
+    h->version = PERF_QUERY_VERSION;
+    h->fields = 0;
+    h->uptimeSecs = 0;
+    h->bootNonce = bootNonce;
+    out += sizeof(*h);
+
+    // We tell anyone we don't accept our bootNonce (and nothing else), which is how clients learn it
+    if (!isLocalRequest() && !isAuthorized(mp.from, r)) {
+        LOG_WARN(MESH, "Refusing an unauthorized performance query from 0x%x\n", mp.from);
+        payload.size = out - payload.bytes;
+        return reply;
+    }
+    LOG_DEBUG(MESH, "Sending performance counters 0x%x to 0x%x\n", r.fields, mp.from);
+    h->uptimeSecs = getSecondsSinceBoot();
+
+    RouterStats rs;
+    if (router)
+        router->getStats(rs);
+    else
+        rs = RouterStats();
+
+    if ((r.fields & PERF_QUERY_QUEUES) && out + sizeof(PerfQueryQueuesSection) <= end) {
+        PerfQueryQueuesSection *s = (PerfQueryQueuesSection *)out;
+        s->txQueued = rs.radio.txQueued;
+        s->fromRadioQueued = rs.fromRadioQueued;
+        s->toPhoneQueued = service.getNumToPhone();
+        s->maxFromRadioQueued = rs.maxFromRadioQueued;
+        s->txDropped = rs.radio.txDropped;
+        for (int i = 0; i < PHONE_NUM_PRIORITIES; i++)
+            s->toPhoneDropped[i] = service.getNumPhoneDrops((PhonePriority)i);
+        for (int i = 0; i < RX_DROP_NUM_CAUSES; i++)
+            s->rxDropped[i] = rs.radio.rxDropped[i];
+        out += sizeof(*s);
+        h->fields |= PERF_QUERY_QUEUES;
+    }
+
+    if ((r.fields & PERF_QUERY_ROUTING) && out + sizeof(PerfQueryRoutingSection) <= end) {
+        PerfQueryRoutingSection *s = (PerfQueryRoutingSection *)out;
+        s->rxGood = rs.radio.rxGood;
+        s->rxBad = rs.radio.rxBad;
+        s->txGood = rs.radio.txGood;
+        s->retransmissions = rs.retransmissions;
+        s->duplicates = rs.duplicates;
+        s->suppressed = rs.suppressed;
+        s->gossipSkipped = rs.gossipSkipped;
+        out += sizeof(*s);
+        h->fields |= PERF_QUERY_ROUTING;
+    }
+
+    if ((r.fields & PERF_QUERY_CHANNEL) && out + sizeof(PerfQueryChannelSection) <= end) {
+        PerfQueryChannelSection *s = (PerfQueryChannelSection *)out;
+        NoiseStats n = noiseMonitor ? noiseMonitor->getStats() : NoiseStats();
+        s->utilization1m = channelUtilizationPercent(UTIL_1_MINUTE) * 10;
+        s->utilization10m = channelUtilizationPercent(UTIL_10_MINUTES) * 10;
+        s->txAirtimeSecs = getAirtimeMsec(TX_LOG) / 1000;
+        s->rxAirtimeSecs = getAirtimeMsec(RX_ALL_LOG) / 1000;
+        s->noiseFloor = n.noiseFloor;
+        s->noiseBaseline = n.baseline;
+        s->crcErrors = n.crcErrors;
+        s->preamblesLost = n.preamblesLost;
+        s->interferedSecs = n.interferedMsec / 1000;
+        out += sizeof(*s);
+        h->fields |= PERF_QUERY_CHANNEL;
+    }
+
+    if ((r.fields & PERF_QUERY_MEMORY) && out + sizeof(PerfQueryMemorySection) <= end) {
+        PerfQueryMemorySection *s = (PerfQueryMemorySection *)out;
+        memset(s, 0, sizeof(*s));
+        if (memoryMonitor) {
+            MemoryStats m = memoryMonitor->getStats();
+            s->freeHeap = m.freeHeap;
+            s->largestFreeBlock = m.largestFreeBlock;
+            s->minFreeHeap = m.minFreeHeap;
+        }
+        s->packetsInUse = packetPool.getNumInUse();
+        s->packetCapacity = packetPool.getCapacity();
+        s->packetAllocFailures = packetPool.getNumFailed();
+        out += sizeof(*s);
+        h->fields |= PERF_QUERY_MEMORY;
+    }
+
+    if ((r.fields & PERF_QUERY_POWER) && out + sizeof(PerfQueryPowerSection) + PS_NUM_STATES * sizeof(uint32_t) <= end) {
+        PerfQueryPowerSection *s = (PerfQueryPowerSection *)out;
+        s->state = powerStats.getState();
+        s->numStates = PS_NUM_STATES;
+        out += sizeof(*s);
+        for (int i = 0; i < PS_NUM_STATES; i++) {
+            uint32_t secs = powerStats.getStateMsec((PowerStatsState)i) / 1000;
+            memcpy(out, &secs, sizeof(secs));
+            out += sizeof(secs);
+        }
+        h->fields |= PERF_QUERY_POWER;
+    }
+
+    // Last, because it takes whatever room is left
+    if ((r.fields & PERF_QUERY_THREADS) && out + sizeof(PerfQueryThreadsSection) <= end) {
+        PerfQueryThreadsSection *s = (PerfQueryThreadsSection *)out;
+        s->numThreads = 0;
+        out += sizeof(*s);
+        for (size_t i = 0; i < concurrency::mainController.getNumThreads() && out + sizeof(PerfQueryThreadRecord) <= end; i++) {
+            concurrency::OSThread *t = concurrency::mainController.getThread(i);
+            PerfQueryThreadRecord *tr = (PerfQueryThreadRecord *)out;
+            strncpy(tr->name, t->ThreadName.c_str(), sizeof(tr->name));
+            tr->cpuMsec = t->getTotalRunMicros() / 1000;
+            tr->runs = t->getNumRuns();
+            out += sizeof(*tr);
+            s->numThreads++;
+        }
+        h->fields |= PERF_QUERY_THREADS;
+    }
+
+    payload.size = out - payload.bytes;
+    return reply;
+}
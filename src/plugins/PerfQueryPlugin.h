@@ -0,0 +1,150 @@
+#pragma once
+#include "MeshService.h"
+#include "SinglePortPlugin.h"
+
+/// The portnum we answer performance counter queries on (not yet in portnums.proto)
+#define PERF_QUERY_PORTNUM ((PortNum)49)
+
+/// Bump this if the request or reply format changes
+#define PERF_QUERY_VERSION 2
+
+/// How many senders we remember the last accepted seq of (so their old requests can't be replayed).  A sender we forgot must
+/// then beat the highest seq we forgot.
+#define PERF_QUERY_MAX_ADMINS 4
+
+/// The sections of our counters a request can ask for, each is a PerfQuery*Section in the reply
+#define PERF_QUERY_QUEUES 0x01   // PerfQueryQueuesSection
+#define PERF_QUERY_ROUTING 0x02  // PerfQueryRoutingSection
+#define PERF_QUERY_CHANNEL 0x04  // PerfQueryChannelSection
+#define PERF_QUERY_MEMORY 0x08   // PerfQueryMemorySection
+#define PERF_QUERY_POWER 0x10    // PerfQueryPowerSection, then numStates uint32_t secs (in PowerStatsState order)
+#define PERF_QUERY_THREADS 0x20  // PerfQueryThreadsSection, then numThreads PerfQueryThreadRecords
+#define PERF_QUERY_ALL 0x3f
+
+/// The length of the (truncated) AES-CMAC a request carries
+#define PERF_QUERY_MAC_LEN 8
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint32_t fields;                 // The PERF_QUERY_* sections we want
+    uint32_t seq;                    // Must be more than the last one we accepted from this sender (i.e. the sender's clock)
+    uint32_t bootNonce;              // Ours, from any of our replies since we last booted
+    uint8_t mac[PERF_QUERY_MAC_LEN]; // Not needed from our own phone
+} PerfQueryRequest;
+
+/**
+ * Answers authenticated queries for a compact snapshot of our performance counters, the same ones /metrics has, so an admin
+ * can watch routers which have neither a phone nor a web client (i.e. on a hilltop) from anywhere on the mesh.
+ *
+ * Send a PerfQueryRequest to us on PERF_QUERY_PORTNUM with want_response set.  The reply payload is a PerfQueryReplyHeader,
+ * then the sections it asked for in bit order.  A section which wouldn't fit in one packet is left out of the reply's fields,
+ * so a client picks the sections it needs most (or asks for the rest again).  Threads are last and get whatever room is left.
+ * All fields are little endian.
+ *
+ * Requests from our own phone always get an answer.  Requests from other nodes need a mac, made with an admin key (set with
+ * PERF_QUERY_ADMIN_PSK at build time, or MESH_ADMIN_PSK on linux) only our admins have.  Without an admin key we only answer
+ * our own phone.  The admin key is our crypto engine's authentication key, so it never decrypts packets.  The mac is the first
+ * PERF_QUERY_MAC_LEN bytes of the AES-CMAC (RFC 4493) of the request up to its mac, then the sender's node number and ours
+ * (little endian uint32s), so a request only works for the sender and the node it was made for.
+ *
+ * So a captured request can't be replayed, it has to have a seq above the last one we accepted from its sender, and our
+ * bootNonce, which we pick at random each time we boot.  A request we don't accept gets a reply with no sections, which tells
+ * the sender our bootNonce (this is also how a client learns it the first time).
+ *
+ * The reply itself is encrypted with our channel key like any other packet: the admin key stops strangers on our channel
+ * polling us, not reading replies.
+ */
+class PerfQueryPlugin : public SinglePortPlugin
+{
+    /// Requests must have this, so none from before we booted are any use
+    uint32_t bootNonce;
+
+    /// The last seq we accepted from each sender, replaced round robin
+    struct AdminSeq {
+        NodeNum from;
+        uint32_t seq;
+    } admins[PERF_QUERY_MAX_ADMINS] = {};
+    size_t nextAdmin = 0;
+
+    /// The highest seq of a sender we replaced, anyone not in admins must beat it
+    uint32_t forgottenSeq = 0;
+
+  public:
+    PerfQueryPlugin();
+
+    /// Accept remote requests made with this key (16 or 32 bytes as hex) @return false if it isn't a valid key
+    bool setAdminKey(const char *hex);
+
+  protected:
+    virtual MeshPacket *allocReply();
+
+  private:
+    /// Is r (received from from) made with our admin key, and not one we already accepted?
+    bool isAuthorized(NodeNum from, const PerfQueryRequest &r);
+
+    /// Compute the mac of a request (see above)
+    void computeMac(NodeNum from, const PerfQueryRequest &r, uint8_t *mac);
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint32_t fields;     // The sections which follow, 0 if we didn't accept the request
+    uint32_t uptimeSecs; // 0 if we didn't accept the request
+    uint32_t bootNonce;
+} PerfQueryReplyHeader;
+
+typedef struct __attribute__((packed)) {
+    uint16_t txQueued;
+    uint16_t fromRadioQueued;
+    uint16_t toPhoneQueued;
+    uint16_t maxFromRadioQueued;
+    uint32_t txDropped;
+    uint32_t toPhoneDropped[PHONE_NUM_PRIORITIES]; // By PhonePriority
+    uint32_t rxDropped[RX_DROP_NUM_CAUSES];        // By cause, as RadioStats
+} PerfQueryQueuesSection;
+
+typedef struct __attribute__((packed)) {
+    uint32_t rxGood, rxBad, txGood;
+    uint32_t retransmissions;
+    uint32_t duplicates;
+    uint32_t suppressed;
+    uint32_t gossipSkipped;
+} PerfQueryRoutingSection;
+
+typedef struct __attribute__((packed)) {
+    uint16_t utilization1m;  // In tenths of a percent
+    uint16_t utilization10m; // In tenths of a percent
+    uint32_t txAirtimeSecs;
+    uint32_t rxAirtimeSecs; // Including packets that weren't for us
+    int16_t noiseFloor;     // In 1/16 dBm, 0 if we don't know it
+    int16_t noiseBaseline;  // In 1/16 dBm
+    uint32_t crcErrors;
+    uint32_t preamblesLost;
+    uint32_t interferedSecs;
+} PerfQueryChannelSection;
+
+typedef struct __attribute__((packed)) {
+    uint32_t freeHeap;
+    uint32_t largestFreeBlock;
+    uint32_t minFreeHeap; // Our heap's high water mark (the least free we have had)
+    uint16_t packetsInUse;
+    uint16_t packetCapacity;
+    uint32_t packetAllocFailures;
+} PerfQueryMemorySection;
+
+typedef struct __attribute__((packed)) {
+    uint8_t state; // The PowerStatsState we are in now
+    uint8_t numStates;
+} PerfQueryPowerSection;
+
+typedef struct __attribute__((packed)) {
+    uint8_t numThreads;
+} PerfQueryThreadsSection;
+
+typedef struct __attribute__((packed)) {
+    char name[8]; // Not NUL terminated if the name fills it
+    uint32_t cpuMsec;
+    uint32_t runs;
+} PerfQueryThreadRecord;
+
+extern PerfQueryPlugin *perfQueryPlugin;
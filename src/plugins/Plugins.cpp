@@ -1,7 +1,18 @@
+#include "plugins/BeaconPlugin.h"
+#include "plugins/BulkTransferPlugin.h"
+#include "plugins/LatencyStatsPlugin.h"
+#include "plugins/LinkTestPlugin.h"
+#include "plugins/LoadGenPlugin.h"
+#include "plugins/MemoryStatsPlugin.h"
 #include "plugins/NodeInfoPlugin.h"
+#include "plugins/PerfQueryPlugin.h"
 #include "plugins/PositionPlugin.h"
+#include "plugins/PowerStatsPlugin.h"
+#include "plugins/QueueStatusPlugin.h"
 #include "plugins/ReplyPlugin.h"
 #include "plugins/RemoteHardwarePlugin.h"
+#include "plugins/StoreForwardPlugin.h"
+#include "plugins/TelemetryPlugin.h"
 #include "plugins/TextMessagePlugin.h"
 
 /**
@@ -10,11 +21,23 @@
 void setupPlugins() {
     nodeInfoPlugin = new NodeInfoPlugin();
     positionPlugin = new PositionPlugin();
+    new PositionDeltaPlugin();
+    new BeaconPlugin();
     textMessagePlugin = new TextMessagePlugin();
+    bulkTransferPlugin = new BulkTransferPlugin();
 
     // Note: if the rest of meshtastic doesn't need to explicitly use your plugin, you do not need to assign the instance
     // to a global variable.
 
-    new RemoteHardwarePlugin();
+    new PowerStatsPlugin();
+    new LatencyStatsPlugin();
+    new MemoryStatsPlugin();
+    new QueueStatusPlugin();
+    perfQueryPlugin = new PerfQueryPlugin();
+    linkTestPlugin = new LinkTestPlugin();
+    loadGenPlugin = new LoadGenPlugin();
+    remoteHardwarePlugin = new RemoteHardwarePlugin();
     new ReplyPlugin();
+    telemetryPlugin = new TelemetryPlugin();
+    new StoreForwardPlugin(); // Stores messages only on routers, but every node accepts replays
 }
\ No newline at end of file
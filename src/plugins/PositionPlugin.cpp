@@ -1,17 +1,36 @@
 #include "PositionPlugin.h"
+#include "GPS.h"
+#include "Geodesy.h"
 #include "MeshService.h"
 #include "NodeDB.h"
 #include "RTC.h"
 #include "Router.h"
+#include "SubPacketCodec.h"
+#include "plugins/NodeInfoPlugin.h"
 #include "configuration.h"
 
 PositionPlugin *positionPlugin;
 
+/// Distance between two positions in meters
+static float distanceMeters(const Position &a, const Position &b)
+{
+    return geoDistanceMeters(a.latitude_i, a.longitude_i, b.latitude_i, b.longitude_i);
+}
+
 bool PositionPlugin::handleReceivedProtobuf(const MeshPacket &mp, const Position &p)
 {
     // FIXME - we currently update position data in the DB only if the message was a broadcast or destined to us
     // it would be better to update even if the message was destined to others.
+    handlePosition(mp, p);
+
+    assert(nodeInfoPlugin);
+    nodeInfoPlugin->checkUserHash(mp);
+
+    return false; // Let others look at this message also if they want
+}
 
+void PositionPlugin::handlePosition(const MeshPacket &mp, const Position &p)
+{
     if (p.time) {
         struct timeval tv;
         uint32_t secs = p.time;
@@ -22,9 +41,8 @@ bool PositionPlugin::handleReceivedProtobuf(const MeshPacket &mp, const Position
         perhapsSetRTC(RTCQualityFromNet, &tv);
     }
 
-    nodeDB.updatePosition(mp.from, p);
-
-    return false; // Let others look at this message also if they want
+    // Only broadcasts are keyframes, unicasts (i.e. replies) aren't seen by everyone who will get the sender's deltas
+    nodeDB.updatePosition(mp.from, p, mp.to == NODENUM_BROADCAST ? mp.id : 0);
 }
 
 MeshPacket *PositionPlugin::allocReply()
@@ -32,7 +50,10 @@ MeshPacket *PositionPlugin::allocReply()
     NodeInfo *node = service.refreshMyNodeInfo(); // should guarantee there is now a position
     assert(node->has_position);
     
-    return allocDataProtobuf(node->position);
+    MeshPacket *p = allocDataProtobuf(node->position);
+    assert(nodeInfoPlugin);
+    nodeInfoPlugin->appendUserHash(p); // So nodes which don't know who we are can ask
+    return p;
 }
 
 void PositionPlugin::sendOurPosition(NodeNum dest, bool wantReplies)
@@ -41,6 +62,145 @@ void PositionPlugin::sendOurPosition(NodeNum dest, bool wantReplies)
     p->to = dest;
     p->decoded.want_response = wantReplies;
 
+    if (dest == NODENUM_BROADCAST) {
+        // Everyone who hears this can use our later deltas
+        keyframeId = p->id;
+        keyframe = nodeDB.getNode(nodeDB.getNodeNum())->position;
+        numDeltas = 0;
+    }
+
     service.sendToMesh(p);
 }
 
+void PositionPlugin::broadcastIfNeeded(bool wantReplies)
+{
+    const Position &pos = service.refreshMyNodeInfo()->position;
+    uint32_t now = millis();
+    uint32_t sinceSecs = (now - lastSendMsec) / 1000;
+    uint32_t heading = gps ? gps->heading : 0;
+
+    float moved = hasSent ? distanceMeters(lastSent, pos) : 0;
+    int32_t turned = abs((int32_t)(heading - lastSendHeading)) / 100000; // heading is in 1e-5 degrees
+    if (turned > 180)
+        turned = 360 - turned;
+
+    bool significant =
+        moved >= POSITION_MIN_MOVE_METERS || (turned >= POSITION_MIN_TURN_DEGREES && moved >= POSITION_MIN_TURN_METERS);
+
+    if (!hasSent || wantReplies) {
+        // Send now
+    } else if (significant && sinceSecs >= POSITION_MIN_INTERVAL_SECS) {
+        LOG_DEBUG(MESH, "Moved %.0fm (turned %d deg), sending position early\n", moved, turned);
+        backoff = 1;
+    } else
+        return; // Our next regular update goes in a beacon
+
+    lastSent = pos;
+    lastSendMsec = now;
+    lastSendHeading = heading;
+    hasSent = true;
+
+    PositionDeltaPayload d;
+    if (!wantReplies && numDeltas < POSITION_DELTAS_PER_KEYFRAME && makeDelta(pos, d)) {
+        LOG_DEBUG(MESH, "Sending position delta to mesh (%d/%d from keyframe 0x%x)\n", d.latitude, d.longitude, keyframeId);
+        sendDelta(d);
+        numDeltas++;
+    } else {
+        LOG_DEBUG(MESH, "Sending position to mesh (wantReplies=%d)\n", wantReplies);
+        sendOurPosition(NODENUM_BROADCAST, wantReplies);
+    }
+}
+
+bool PositionPlugin::isBeaconDue()
+{
+    if (!hasSent)
+        return true;
+
+    // We are asked once per position_broadcast_secs, so allow for a beacon which comes a little early
+    uint32_t intervalSecs = getPref_position_broadcast_secs();
+    if ((millis() - lastSendMsec) / 1000 + intervalSecs / 2 < intervalSecs * backoff)
+        return false;
+
+    // If we have stayed put, wait longer next time
+    const Position &pos = service.refreshMyNodeInfo()->position;
+    if (distanceMeters(lastSent, pos) >= POSITION_MIN_MOVE_METERS)
+        backoff = 1;
+    else if (backoff < POSITION_MAX_BACKOFF)
+        backoff *= 2;
+    return true;
+}
+
+void PositionPlugin::beaconSent(PacketId id, const Position &pos)
+{
+    lastSent = pos;
+    lastSendMsec = millis();
+    lastSendHeading = gps ? gps->heading : 0;
+    hasSent = true;
+
+    keyframeId = id;
+    keyframe = pos;
+    numDeltas = 0;
+}
+
+bool PositionPlugin::makeDelta(const Position &pos, PositionDeltaPayload &d) const
+{
+    if (!keyframeId || (keyframe.time && pos.time < keyframe.time))
+        return false;
+
+    // Round to our units (away from zero on .5)
+    int64_t dLat = (int64_t)pos.latitude_i - keyframe.latitude_i, dLon = (int64_t)pos.longitude_i - keyframe.longitude_i;
+    dLat = (dLat + (dLat < 0 ? -5 : 5)) / 10;
+    dLon = (dLon + (dLon < 0 ? -5 : 5)) / 10;
+    int32_t dAlt = pos.altitude - keyframe.altitude;
+    uint32_t dTime = keyframe.time ? pos.time - keyframe.time : 0;
+
+    if (dLat < INT16_MIN || dLat > INT16_MAX || dLon < INT16_MIN || dLon > INT16_MAX || dAlt < INT16_MIN || dAlt > INT16_MAX ||
+        dTime > UINT16_MAX)
+        return false;
+
+    d.keyframeId = keyframeId;
+    d.latitude = dLat;
+    d.longitude = dLon;
+    d.altitude = dAlt;
+    d.time = dTime;
+    d.batteryLevel = constrain(pos.battery_level, 0, 255);
+    return true;
+}
+
+void PositionPlugin::sendDelta(const PositionDeltaPayload &d)
+{
+    MeshPacket *p = allocDataPacket();
+    p->to = NODENUM_BROADCAST;
+    p->decoded.data.portnum = POSITION_DELTA_PORTNUM;
+    p->decoded.data.payload.size = sizeof(d);
+    memcpy(p->decoded.data.payload.bytes, &d, sizeof(d));
+
+    service.sendToMesh(p);
+}
+
+bool PositionDeltaPlugin::handleReceived(const MeshPacket &mp)
+{
+    auto &payload = mp.decoded.data.payload;
+    if (payload.size != sizeof(PositionDeltaPayload)) {
+        LOG_WARN(MESH, "Ignoring malformed position delta from 0x%x\n", mp.from);
+        return true;
+    }
+
+    PositionDeltaPayload d;
+    memcpy(&d, payload.bytes, sizeof(d));
+
+    PositionDelta delta = {d.keyframeId, d.latitude * 10, d.longitude * 10, d.altitude, d.time, d.batteryLevel};
+    if (!nodeDB.updatePositionDelta(mp.from, delta) || mp.from == nodeDB.getNodeNum())
+        return true;
+
+    // Phone apps only understand full positions, so give them one
+    MeshPacket *p = packetPool.allocCopy(mp, 0);
+    if (p) {
+        p->decoded.data.portnum = PortNum_POSITION_APP;
+        p->decoded.data.payload.size = encodePosition(p->decoded.data.payload.bytes, sizeof(p->decoded.data.payload.bytes),
+                                                      nodeDB.getNode(mp.from)->position);
+        service.sendToPhone(p);
+    }
+
+    return true;
+}
@@ -1,11 +1,57 @@
 #pragma once
 #include "ProtobufPlugin.h"
 
+/// The portnum we send position deltas on (not yet in portnums.proto)
+#define POSITION_DELTA_PORTNUM ((PortNum)36)
+
+/// If we have moved at least this far since our last broadcast we send another without waiting for position_broadcast_secs
+#ifndef POSITION_MIN_MOVE_METERS
+#define POSITION_MIN_MOVE_METERS 100
+#endif
+
+/// Or if our heading has changed this much (in degrees), as long as we have moved at least POSITION_MIN_TURN_METERS
+#define POSITION_MIN_TURN_DEGREES 30
+#define POSITION_MIN_TURN_METERS 20
+
+/// But we never broadcast our position more often than this
+#define POSITION_MIN_INTERVAL_SECS 30
+
+/// While we are stationary we double our interval after each broadcast, up to this multiple of position_broadcast_secs
+#define POSITION_MAX_BACKOFF 8
+
+/// After this many deltas we send a full position again (so nodes which missed our last one can use our deltas again)
+#define POSITION_DELTAS_PER_KEYFRAME 4
+
+/// How far we have moved since our last full position broadcast, little endian like all of our CPUs
+typedef struct __attribute__((packed)) {
+    uint32_t keyframeId;         // The packet id of that broadcast
+    int16_t latitude, longitude; // 1e-6 degrees (ie 10 of Position's units), so up to about 3km
+    int16_t altitude;            // meters
+    uint16_t time;               // secs
+    uint8_t batteryLevel;
+} PositionDeltaPayload;
+
 /**
  * Position plugin for sending/receiving positions into the mesh
+ *
+ * We broadcast our position more often while we are moving (or turning), and back off while we are stationary.  Between full
+ * Position broadcasts (keyframes) we send small moves as a PositionDeltaPayload on POSITION_DELTA_PORTNUM, which
+ * PositionDeltaPlugin turns back into a Position (see NodeDB::updatePositionDelta).  Our regular (not because we moved)
+ * updates ride in BeaconPlugin's beacons, which also count as keyframes.
  */
 class PositionPlugin : public ProtobufPlugin<Position>
 {
+    /// What we last broadcast (as a full position or a delta)
+    Position lastSent = Position_init_default;
+    uint32_t lastSendMsec = 0, lastSendHeading = 0;
+    bool hasSent = false;
+    uint8_t backoff = 1; // Our current multiple of position_broadcast_secs
+
+    /// Our last full position broadcast, which our deltas are relative to
+    PacketId keyframeId = 0;
+    Position keyframe = Position_init_default;
+    uint8_t numDeltas = 0; // Since that keyframe
+
   public:
     /** Constructor
      * name is for debugging output
@@ -17,6 +63,25 @@ class PositionPlugin : public ProtobufPlugin<Position>
      */
     void sendOurPosition(NodeNum dest = NODENUM_BROADCAST, bool wantReplies = false);
 
+    /**
+     * Our position has been updated, broadcast it if we have moved far enough or it has been long enough.
+     *
+     * If wantReplies, we always send (a full position) right away.
+     */
+    void broadcastIfNeeded(bool wantReplies);
+
+    /**
+     * BeaconPlugin asks us this once per beacon.  @return true if our regular position update is due, in which case the
+     * beacon must carry our position (and tell us with beaconSent).
+     */
+    bool isBeaconDue();
+
+    /// The beacon with packet id carried pos, so nodes which hear it can use our later deltas
+    void beaconSent(PacketId id, const Position &pos);
+
+    /// Use a position we heard from mp's sender (in a Position packet or a beacon)
+    void handlePosition(const MeshPacket &mp, const Position &p);
+
   protected:
 
     /** Called to handle a particular incoming message
@@ -28,6 +93,24 @@ class PositionPlugin : public ProtobufPlugin<Position>
     /** Messages can be received that have the want_response bit set.  If set, this callback will be invoked
      * so that subclasses can (optionally) send a response back to the original sender.  */
     virtual MeshPacket *allocReply();
+
+  private:
+    /// Encode pos relative to our keyframe, @return false if it is too far away to fit
+    bool makeDelta(const Position &pos, PositionDeltaPayload &d) const;
+
+    void sendDelta(const PositionDeltaPayload &d);
+};
+
+/**
+ * Receives other nodes' position deltas, and passes the reconstructed positions on to our phone as regular Position packets
+ */
+class PositionDeltaPlugin : public SinglePortPlugin
+{
+  public:
+    PositionDeltaPlugin() : SinglePortPlugin("positiondelta", POSITION_DELTA_PORTNUM) {}
+
+  protected:
+    virtual bool handleReceived(const MeshPacket &mp);
 };
 
-extern PositionPlugin *positionPlugin;
\ No newline at end of file
+extern PositionPlugin *positionPlugin;
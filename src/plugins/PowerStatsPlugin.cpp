@@ -0,0 +1,51 @@
+#include "PowerStatsPlugin.h"
+#include "PowerStats.h"
+#include "airtime.h"
+#include "configuration.h"
+#include <assert.h>
+
+MeshPacket *PowerStatsPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    LOG_DEBUG(POWER, "Sending power stats to 0x%x\n", currentRequest->from);
+
+    auto reply = allocDataPacket();
+    auto &payload = reply->decoded.data.payload;
+    uint8_t *out = payload.bytes;
+    const uint8_t *end = payload.bytes + sizeof(payload.bytes);
+
+    PowerStatsReplyHeader *h = (PowerStatsReplyHeader *)out;
+    h->version = POWER_STATS_VERSION;
+    h->numStates = PS_NUM_STATES;
+    h->state = powerStats.getState();
+    h->numTransitions = 0;
+    h->totalUah = powerStats.getTotalMah() * 1000;
+    h->radioUah = powerStats.getRadioMah() * 1000;
+    h->txMsec = getAirtimeMsec(TX_LOG);
+    h->rxMsec = getAirtimeMsec(RX_ALL_LOG);
+    out += sizeof(*h);
+
+    for (int i = 0; i < PS_NUM_STATES; i++) {
+        PowerStatsState s = (PowerStatsState)i;
+        PowerStatsStateRecord *r = (PowerStatsStateRecord *)out;
+        r->secs = powerStats.getStateMsec(s) / 1000;
+        r->entries = min(powerStats.getNumEntries(s), (uint32_t)UINT16_MAX);
+        r->uah = powerStats.getStateMah(s) * 1000;
+        out += sizeof(*r);
+    }
+
+    for (int from = 0; from < PS_NUM_STATES; from++)
+        for (int to = 0; to < PS_NUM_STATES; to++) {
+            uint16_t n = powerStats.getNumTransitions((PowerStatsState)from, (PowerStatsState)to);
+            if (n && out + sizeof(PowerStatsTransitionRecord) <= end) {
+                PowerStatsTransitionRecord *r = (PowerStatsTransitionRecord *)out;
+                r->fromTo = (from << 4) | to;
+                r->count = n;
+                out += sizeof(*r);
+                h->numTransitions++;
+            }
+        }
+
+    payload.size = out - payload.bytes;
+    return reply;
+}
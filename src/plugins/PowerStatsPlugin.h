@@ -0,0 +1,47 @@
+#pragma once
+#include "SinglePortPlugin.h"
+
+/// The portnum we answer power statistics requests on (not yet in portnums.proto)
+#define POWER_STATS_PORTNUM ((PortNum)35)
+
+/// Bump this if the reply format changes
+#define POWER_STATS_VERSION 1
+
+/**
+ * Reports our PowerStats (time, entries and estimated energy per PowerFSM state, plus transition counts).
+ *
+ * Send any packet to us on POWER_STATS_PORTNUM, with want_response set, either from a phone API client or over the mesh
+ * (handy for routers which never have a phone attached).  The reply payload is a PowerStatsReplyHeader, then numStates
+ * PowerStatsStateRecords (in PowerStatsState order) and numTransitions PowerStatsTransitionRecords.  All fields are little
+ * endian.
+ */
+class PowerStatsPlugin : public SinglePortPlugin
+{
+  public:
+    PowerStatsPlugin() : SinglePortPlugin("powerstats", POWER_STATS_PORTNUM) {}
+
+  protected:
+    virtual MeshPacket *allocReply();
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t numStates;
+    uint8_t state; // The PowerStatsState we are in now
+    uint8_t numTransitions;
+    uint32_t totalUah; // Estimated energy used since boot
+    uint32_t radioUah; // The radio's share of totalUah
+    uint32_t txMsec;   // Total airtime we have transmitted
+    uint32_t rxMsec;   // Total airtime we have received (including packets that weren't for us)
+} PowerStatsReplyHeader;
+
+typedef struct __attribute__((packed)) {
+    uint32_t secs;
+    uint16_t entries; // Saturates
+    uint32_t uah;     // Estimated energy the board (not including the radio) used in this state
+} PowerStatsStateRecord;
+
+typedef struct __attribute__((packed)) {
+    uint8_t fromTo; // from state in the high nibble, to state in the low nibble
+    uint16_t count;
+} PowerStatsTransitionRecord;
@@ -0,0 +1,52 @@
+#include "QueueStatusPlugin.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "configuration.h"
+#include <assert.h>
+
+QueueStatusPlugin::QueueStatusPlugin()
+    : SinglePortPlugin("queuestatus", QUEUE_STATUS_PORTNUM), concurrency::OSThread("QueueStatus", QUEUE_STATUS_POLL_MSEC)
+{
+}
+
+MeshPacket *QueueStatusPlugin::allocReply()
+{
+    assert(currentRequest); // should always be !NULL
+    return allocStatus(router->getTxQueueStatus());
+}
+
+int32_t QueueStatusPlugin::runOnce()
+{
+    TxQueueStatus s = router->getTxQueueStatus();
+    if (s.free == lastSent.free && s.capacity == lastSent.capacity && s.lastDroppedId == lastSent.lastDroppedId)
+        return QUEUE_STATUS_POLL_MSEC;
+
+    // Getting full (or dropping) is news the phone needs now, the queue draining can wait for our next report
+    bool urgent = s.free == 0 || s.lastDroppedId != lastSent.lastDroppedId;
+    uint32_t now = millis();
+    if (!urgent && now - lastSentMsec < QUEUE_STATUS_MIN_MSEC)
+        return QUEUE_STATUS_POLL_MSEC;
+
+    MeshPacket *p = allocStatus(s);
+    p->to = nodeDB.getNodeNum();
+    service.sendToPhone(p);
+
+    lastSent = s;
+    lastSentMsec = now;
+    return QUEUE_STATUS_POLL_MSEC;
+}
+
+MeshPacket *QueueStatusPlugin::allocStatus(const TxQueueStatus &s)
+{
+    MeshPacket *p = allocDataPacket();
+    auto &payload = p->decoded.data.payload;
+
+    QueueStatus *q = (QueueStatus *)payload.bytes;
+    q->version = QUEUE_STATUS_VERSION;
+    q->free = min(s.free, (uint32_t)UINT8_MAX);
+    q->capacity = min(s.capacity, (uint32_t)UINT8_MAX);
+    q->lastDroppedId = s.lastDroppedId;
+    q->etaMsec = s.queuedMsec;
+    payload.size = sizeof(*q);
+    return p;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "SinglePortPlugin.h"
+#include "concurrency/OSThread.h"
+
+/// The portnum we report our transmit queue's status on (not yet in portnums.proto)
+#define QUEUE_STATUS_PORTNUM ((PortNum)42)
+
+/// Bump this if the message format changes
+#define QUEUE_STATUS_VERSION 1
+
+/// How often we look for changes in our transmit queue
+#define QUEUE_STATUS_POLL_MSEC 250
+
+/// We tell our phone about changes at most this often (but always at once when our queue fills up or drops something)
+#ifndef QUEUE_STATUS_MIN_MSEC
+#define QUEUE_STATUS_MIN_MSEC 1000
+#endif
+
+/**
+ * Tells our API clients how much room our transmit queue has, so they can stop sending before we have to drop their packets
+ * (rather than finding out from a missing ack).
+ *
+ * Whenever the queue's free slots or last dropped packet change we give our phone a QueueStatus, and we answer any packet
+ * sent to us on QUEUE_STATUS_PORTNUM with want_response set (from the phone or over the mesh).  Our phone only keeps the
+ * newest of these queued for it.
+ */
+class QueueStatusPlugin : public SinglePortPlugin, private concurrency::OSThread
+{
+    /// What we last told our phone
+    TxQueueStatus lastSent = {};
+    uint32_t lastSentMsec = 0;
+
+  public:
+    QueueStatusPlugin();
+
+  protected:
+    virtual MeshPacket *allocReply();
+
+    virtual int32_t runOnce();
+
+  private:
+    /// A packet (to us) holding our queue's status
+    MeshPacket *allocStatus(const TxQueueStatus &s);
+};
+
+/// All fields are little endian
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t free;           // Transmit queue slots, 0 means the next packet we are given will be dropped (or displace one)
+    uint8_t capacity;       // 0 if we have no transmit queue
+    uint32_t lastDroppedId; // The last packet we dropped because our queue was full, 0 if none
+    uint32_t etaMsec;       // Roughly how long a packet queued now would wait before it is sent
+} QueueStatus;
@@ -11,26 +11,32 @@
 // Because (FIXME) we currently don't tell API clients status on sent messages
 // we need to throttle our sending, so that if a gpio is bouncing up and down we
 // don't generate more messages than the net can send. So we limit watch messages to 
-// a max of one change per 30 seconds
+// a max of one per 30 seconds (any changes in between are batched into the next one)
+#ifndef WATCH_INTERVAL_MSEC
 #define WATCH_INTERVAL_MSEC (30 * 1000)
+#endif
+
+#ifndef NOT_AN_INTERRUPT
+#define NOT_AN_INTERRUPT -1
+#endif
+
+RemoteHardwarePlugin *remoteHardwarePlugin;
 
 /// Set pin modes for every set bit in a mask
 static void pinModes(uint64_t mask, uint8_t mode) {
     for (uint8_t i = 0; i < NUM_GPIOS; i++) {
-        if (mask & (1 << i)) {
+        if (mask & (1ULL << i)) {
             pinMode(i, mode);
         }
     }
 }
 
-/// Read all the pins mentioned in a mask
-static uint64_t digitalReads(uint64_t mask) {
+/// Read all the pins mentioned in a mask, which must already be inputs
+static uint64_t readPins(uint64_t mask) {
     uint64_t res = 0;
 
-    pinModes(mask, INPUT_PULLUP);
-
     for (uint8_t i = 0; i < NUM_GPIOS; i++) {
-        uint64_t m = 1 << i;
+        uint64_t m = 1ULL << i;
         if (mask & m) {
             if (digitalRead(i))
                 res |= m;
@@ -40,6 +46,16 @@ static uint64_t digitalReads(uint64_t mask) {
     return res;
 }
 
+/// Read all the pins mentioned in a mask
+static uint64_t digitalReads(uint64_t mask) {
+    pinModes(mask, INPUT_PULLUP);
+    return readPins(mask);
+}
+
+static IRAM_ATTR void onWatchedEdge() {
+    if (remoteHardwarePlugin)
+        remoteHardwarePlugin->onEdgeFromISR();
+}
 
 RemoteHardwarePlugin::RemoteHardwarePlugin()
     : ProtobufPlugin("remotehardware", PortNum_REMOTE_HARDWARE_APP, HardwareMessage_fields),
@@ -57,7 +73,7 @@ bool RemoteHardwarePlugin::handleReceivedProtobuf(const MeshPacket &req, const H
         screen->print("Write GPIOs\n");
 
         for (uint8_t i = 0; i < NUM_GPIOS; i++) {
-            uint64_t mask = 1 << i;
+            uint64_t mask = 1ULL << i;
             if (p.gpio_mask & mask) {
                 digitalWrite(i, (p.gpio_value & mask) ? 1 : 0);
             }
@@ -83,11 +99,8 @@ bool RemoteHardwarePlugin::handleReceivedProtobuf(const MeshPacket &req, const H
     }
 
     case HardwareMessage_Type_WATCH_GPIOS: {
-        watchGpios = p.gpio_mask;
-        lastWatchMsec = 0; // Force a new publish soon
-        previousWatch = ~watchGpios; // generate a 'previous' value which is guaranteed to not match (to force an initial publish)
-        enabled = true; // Let our thread run at least once
-        DEBUG_MSG("Now watching GPIOs 0x%llx\n", watchGpios);
+        setWatch(p.gpio_mask);
+        DEBUG_MSG("Now watching GPIOs 0x%llx (0x%llx by interrupt)\n", watchGpios, interruptGpios);
         break;
     }
 
@@ -103,30 +116,93 @@ bool RemoteHardwarePlugin::handleReceivedProtobuf(const MeshPacket &req, const H
     return true; // handled
 }
 
-int32_t RemoteHardwarePlugin::runOnce() {
-    if(watchGpios) {
-        uint32_t now = millis();
-
-        if(now - lastWatchMsec >= WATCH_INTERVAL_MSEC) {
-            uint64_t curVal = digitalReads(watchGpios);
-
-            if(curVal != previousWatch) {
-                previousWatch = curVal;
-                DEBUG_MSG("Broadcasting GPIOS 0x%llx changed!\n", curVal);
-
-                // Something changed!  Tell the world with a broadcast message
-                HardwareMessage reply = HardwareMessage_init_default;
-                reply.typ = HardwareMessage_Type_GPIOS_CHANGED;
-                reply.gpio_value = curVal;
-                MeshPacket *p = allocDataProtobuf(reply);
-                service.sendToMesh(p);
-            }
+void RemoteHardwarePlugin::setWatch(uint64_t mask)
+{
+    for (uint8_t i = 0; i < NUM_GPIOS; i++)
+        if (interruptGpios & (1ULL << i))
+            detachInterrupt(digitalPinToInterrupt(i));
+    interruptGpios = 0;
+
+    watchGpios = mask;
+    pinModes(watchGpios, INPUT_PULLUP);
+    for (uint8_t i = 0; i < NUM_GPIOS; i++) {
+        uint64_t m = 1ULL << i;
+        if ((watchGpios & m) && digitalPinToInterrupt(i) != NOT_AN_INTERRUPT) {
+            attachInterrupt(digitalPinToInterrupt(i), onWatchedEdge, CHANGE);
+            interruptGpios |= m;
         }
     }
-    else {
+
+    // Force an initial publish of every pin
+    previousWatch = ~readPins(watchGpios);
+    lastWatchMsec = 0;
+    changedGpios = 0;
+    edgeSeen = false;
+    setEnabled(true);
+    setInterval(0);
+}
+
+IRAM_ATTR void RemoteHardwarePlugin::onEdgeFromISR()
+{
+    if (edgeSeen)
+        return; // We are already waiting to read our pins
+
+    edgeMsec = millis();
+    edgeSeen = true;
+    setInterval(0);
+
+    BaseType_t higherWake = 0;
+    getController()->wakeFromISR(&higherWake);
+}
+
+int32_t RemoteHardwarePlugin::runOnce() {
+    if (!watchGpios) {
         // No longer watching anything - stop using CPU
-        enabled = false;
+        setEnabled(false);
+        return RUN_SAME;
+    }
+
+    uint32_t now = millis();
+
+    if (edgeSeen) {
+        uint32_t settled = now - edgeMsec;
+        if (settled < WATCH_DEBOUNCE_MSEC)
+            return WATCH_DEBOUNCE_MSEC - settled;
+        edgeSeen = false; // Before we read, so another edge during our read wakes us again
+    }
+
+    uint64_t curVal = readPins(watchGpios);
+    uint64_t changed = (curVal ^ previousWatch) & watchGpios;
+    previousWatch = curVal;
+    if (changed && !changedGpios)
+        firstChangeMsec = now;
+    changedGpios |= changed;
+
+    // Polled pins need us to run again soon, otherwise we wait for an interrupt
+    int32_t wait = interruptGpios == watchGpios ? INT32_MAX : WATCH_POLL_MSEC;
+
+    if (changedGpios) {
+        // Wait for more changes to batch with these, and for our throttle
+        int32_t untilSend = WATCH_BATCH_MSEC - (now - firstChangeMsec);
+        if (lastWatchMsec)
+            untilSend = max(untilSend, (int32_t)(WATCH_INTERVAL_MSEC - (now - lastWatchMsec)));
+
+        if (untilSend > 0)
+            return min(wait, untilSend);
+
+        DEBUG_MSG("Broadcasting GPIOS 0x%llx changed (0x%llx)!\n", changedGpios, curVal);
+
+        // Something changed!  Tell the world with a broadcast message
+        HardwareMessage reply = HardwareMessage_init_default;
+        reply.typ = HardwareMessage_Type_GPIOS_CHANGED;
+        reply.gpio_mask = changedGpios;
+        reply.gpio_value = curVal;
+        MeshPacket *p = allocDataProtobuf(reply);
+        service.sendToMesh(p);
+
+        lastWatchMsec = now ? now : 1;
+        changedGpios = 0;
     }
 
-    return 200; // Poll our GPIOs every 200ms (FIXME, make adjustable via protobuf arg)
-}
\ No newline at end of file
+    return wait;
+}
@@ -3,26 +3,65 @@
 #include "mesh/generated/remote_hardware.pb.h"
 #include "concurrency/OSThread.h"
 
+/// After an edge on a watched pin we wait this long for it to settle before reading our pins
+#ifndef WATCH_DEBOUNCE_MSEC
+#define WATCH_DEBOUNCE_MSEC 50
+#endif
+
+/// After the first change we wait this long for more, so changes close together go out in one GPIOS_CHANGED message
+#ifndef WATCH_BATCH_MSEC
+#define WATCH_BATCH_MSEC 1000
+#endif
+
+/// How often we read watched pins which can't raise an interrupt
+#ifndef WATCH_POLL_MSEC
+#define WATCH_POLL_MSEC 200
+#endif
+
 /**
  * A plugin that provides easy low-level remote access to device hardware.
+ *
+ * Watched GPIOs raise an interrupt on every edge (pins which can't are polled instead).  Once a pin has been quiet for
+ * WATCH_DEBOUNCE_MSEC we read them all, and changes within WATCH_BATCH_MSEC of each other are broadcast as one GPIOS_CHANGED
+ * message, with gpio_mask set to the pins which changed.
  */
 class RemoteHardwarePlugin : public ProtobufPlugin<HardwareMessage>, private concurrency::OSThread
 {
     /// The current set of GPIOs we've been asked to watch for changes
     uint64_t watchGpios = 0; 
 
+    /// The watched GPIOs we have attached our interrupt to (the others we poll)
+    uint64_t interruptGpios = 0;
+
     /// The previously read value of watched pins
     uint64_t previousWatch = 0;
 
-    /// The timestamp of our last watch event (we throttle watches to 1 change every 30 seconds)
+    /// The watched pins which have changed since our last broadcast
+    uint64_t changedGpios = 0;
+
+    /// When the first of changedGpios changed
+    uint32_t firstChangeMsec = 0;
+
+    /// The timestamp of our last watch event (we throttle watches to 1 broadcast every WATCH_INTERVAL_MSEC)
     uint32_t lastWatchMsec = 0;
+
+    /// Set by our ISR on the first edge since we last read our pins
+    volatile bool edgeSeen = false;
+    volatile uint32_t edgeMsec = 0;
+
   public:
     /** Constructor
      * name is for debugging output
      */
     RemoteHardwarePlugin();
 
+    /// Called from our ISR when any watched pin changes
+    void onEdgeFromISR();
+
   protected:
+    /// Driving GPIOs and sending our replies can wait until the router is done
+    virtual bool isAsync() { return true; }
+
     /** Called to handle a particular incoming message
 
     @return true if you've guaranteed you've handled this message and no other handlers should be considered for it
@@ -30,14 +69,18 @@ class RemoteHardwarePlugin : public ProtobufPlugin<HardwareMessage>, private con
     virtual bool handleReceivedProtobuf(const MeshPacket &mp, const HardwareMessage &p);
 
     /**
-     * Periodically read the gpios we have been asked to WATCH, if they have changed,
-     * broadcast a message with the change information.
+     * Read the gpios we have been asked to WATCH once they have settled after an edge (or periodically, for pins without an
+     * interrupt), if they have changed, broadcast a message with the change information.
      * 
      * The method that will be called each time our thread gets a chance to run
      *
      * Returns desired period for next invocation (or RUN_SAME for no change)
      */
     virtual int32_t runOnce();
+
+  private:
+    /// Start watching a new set of pins (replacing any we were watching)
+    void setWatch(uint64_t mask);
 };
 
-extern RemoteHardwarePlugin remoteHardwarePlugin;
\ No newline at end of file
+extern RemoteHardwarePlugin *remoteHardwarePlugin;
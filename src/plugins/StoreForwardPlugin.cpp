@@ -0,0 +1,289 @@
+#include "StoreForwardPlugin.h"
+#include "FSCommon.h"
+#include "LargeAlloc.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "configuration.h"
+
+static const char *journalfile = "/sf.log";
+static const char *journaltmp = "/sf.tmp";
+
+StoreForwardPlugin::StoreForwardPlugin() : SinglePortPlugin("storeforward", STORE_FORWARD_PORTNUM)
+{
+    if (radioConfig.preferences.is_router)
+        loadJournal();
+}
+
+bool StoreForwardPlugin::handleReceived(const MeshPacket &mp)
+{
+    if (mp.from == nodeDB.getNodeNum())
+        return false; // Our own broadcasts, looped back
+
+    onHeard(mp.from);
+
+    if (mp.decoded.which_payload != SubPacket_data_tag)
+        return false;
+
+    auto &payload = mp.decoded.data.payload;
+    if (mp.decoded.data.portnum == PortNum_TEXT_MESSAGE_APP) {
+        markSeen(mp.from, mp.id);
+        if (radioConfig.preferences.is_router)
+            storeMessage(mp);
+        return false; // Let others look at this message also if they want
+    }
+
+    if (mp.decoded.data.portnum != STORE_FORWARD_PORTNUM || !payload.size)
+        return false;
+
+    if (payload.bytes[0] == STORE_FORWARD_REPLAY)
+        handleReplay(mp);
+    else if (payload.bytes[0] == STORE_FORWARD_REQUEST && payload.size == sizeof(StoreForwardRequest) &&
+             radioConfig.preferences.is_router && mp.to == nodeDB.getNodeNum()) {
+        StoreForwardRequest r;
+        memcpy(&r, payload.bytes, sizeof(r));
+
+        // Start after their last message (or from our oldest, if we don't have it any more)
+        size_t index = 0;
+        for (size_t i = 0; r.sinceId && i < numMessages; i++)
+            if (getMessage(i).header.id == r.sinceId)
+                index = i + 1;
+
+        LOG_DEBUG(MESH, "0x%x asked for messages since 0x%x\n", mp.from, r.sinceId);
+        replay(mp.from, index, 0);
+    }
+
+    return true;
+}
+
+void StoreForwardPlugin::storeMessage(const MeshPacket &mp)
+{
+    auto &payload = mp.decoded.data.payload;
+    if (payload.size > STORE_FORWARD_MAX_TEXT) {
+        LOG_DEBUG(MESH, "Text message from 0x%x is too long to store\n", mp.from);
+        return;
+    }
+
+    StoredMessage m;
+    m.header = {mp.from, mp.to, mp.id, mp.rx_time, (uint8_t)payload.size};
+    m.storedMsec = millis() ? millis() : 1;
+    memcpy(m.text, payload.bytes, payload.size);
+
+    if (!allocMessages())
+        return;
+    addMessage(m);
+    appendJournal(m);
+}
+
+void StoreForwardPlugin::onHeard(NodeNum node)
+{
+    uint32_t now = millis();
+
+    HeardNode *h = NULL, *oldest = &heard[0];
+    for (size_t i = 0; i < STORE_FORWARD_MAX_NODES && !h; i++) {
+        if (heard[i].node == node)
+            h = &heard[i];
+        else if (heard[i].msec < oldest->msec) // Including any slots we haven't used yet
+            oldest = &heard[i];
+    }
+
+    if (!h) {
+        // A node we haven't heard from (at least since we booted), we don't know what it missed
+        *oldest = {node, now};
+        return;
+    }
+
+    uint32_t lastHeard = h->msec;
+    h->msec = now;
+    if (radioConfig.preferences.is_router && now - lastHeard >= STORE_FORWARD_ABSENT_SECS * 1000UL) {
+        LOG_DEBUG(MESH, "0x%x is back after %u secs\n", node, (now - lastHeard) / 1000);
+        replay(node, 0, lastHeard);
+    }
+}
+
+void StoreForwardPlugin::replay(NodeNum dest, size_t index, uint32_t sinceMsec)
+{
+    MeshPacket *p = NULL;
+    StoreForwardReplayHeader *h = NULL;
+    size_t numBatches = 0, numSent = 0;
+
+    for (; index < numMessages; index++) {
+        const StoredMessage &m = getMessage(index);
+        if (m.header.from == dest || (m.header.to != NODENUM_BROADCAST && m.header.to != dest))
+            continue; // Not for them
+        if (sinceMsec && (!m.storedMsec || (int32_t)(m.storedMsec - sinceMsec) <= 0))
+            continue; // They were still around for this one
+
+        auto *payload = p ? &p->decoded.data.payload : NULL;
+        size_t len = sizeof(m.header) + m.header.len;
+        if (p && payload->size + len > sizeof(payload->bytes)) {
+            service.sendToMesh(p);
+            p = NULL;
+        }
+
+        if (!p) {
+            if (numBatches == STORE_FORWARD_MAX_BATCHES)
+                break; // They can ask for the rest
+
+            p = allocDataPacket();
+            p->to = dest;
+            payload = &p->decoded.data.payload;
+            h = (StoreForwardReplayHeader *)payload->bytes;
+            h->type = STORE_FORWARD_REPLAY;
+            h->numMessages = 0;
+            payload->size = sizeof(*h);
+            numBatches++;
+        }
+
+        memcpy(payload->bytes + payload->size, &m.header, sizeof(m.header));
+        memcpy(payload->bytes + payload->size + sizeof(m.header), m.text, m.header.len);
+        payload->size += len;
+        h->numMessages++;
+        numSent++;
+    }
+
+    if (p)
+        service.sendToMesh(p);
+
+    if (numSent)
+        LOG_INFO(MESH, "Replayed %u messages to 0x%x in %u packets\n", numSent, dest, numBatches);
+}
+
+void StoreForwardPlugin::handleReplay(const MeshPacket &mp)
+{
+    auto &payload = mp.decoded.data.payload;
+    if (payload.size < sizeof(StoreForwardReplayHeader))
+        return;
+
+    StoreForwardReplayHeader h;
+    memcpy(&h, payload.bytes, sizeof(h));
+
+    size_t offset = sizeof(h), numDelivered = 0;
+    for (uint8_t i = 0; i < h.numMessages; i++) {
+        StoreForwardMessageHeader m;
+        if (offset + sizeof(m) > payload.size)
+            break;
+        memcpy(&m, payload.bytes + offset, sizeof(m));
+        offset += sizeof(m);
+        if (offset + m.len > payload.size)
+            break;
+
+        if (m.from != nodeDB.getNodeNum() && markSeen(m.from, m.id)) {
+            // Give our phone the message as if we had heard it ourselves
+            MeshPacket *p = packetPool.allocZeroed(0);
+            if (p) {
+                p->from = m.from;
+                p->to = m.to;
+                p->id = m.id;
+                p->rx_time = m.rxTime;
+                p->which_payload = MeshPacket_decoded_tag;
+                p->decoded.which_payload = SubPacket_data_tag;
+                p->decoded.data.portnum = PortNum_TEXT_MESSAGE_APP;
+                p->decoded.data.payload.size = m.len;
+                memcpy(p->decoded.data.payload.bytes, payload.bytes + offset, m.len);
+                service.sendToPhone(p);
+                numDelivered++;
+            }
+        }
+        offset += m.len;
+    }
+
+    LOG_DEBUG(MESH, "Got %u replayed messages from 0x%x, %u were new\n", h.numMessages, mp.from, numDelivered);
+}
+
+bool StoreForwardPlugin::markSeen(NodeNum from, PacketId id)
+{
+    for (size_t i = 0; i < STORE_FORWARD_SEEN; i++)
+        if (seen[i].from == from && seen[i].id == id)
+            return false;
+
+    seen[nextSeen] = {from, id};
+    nextSeen = (nextSeen + 1) % STORE_FORWARD_SEEN;
+    return true;
+}
+
+bool StoreForwardPlugin::allocMessages()
+{
+    if (!messages) {
+        maxMessages = STORE_FORWARD_MAX_MESSAGES;
+        messages = (StoredMessage *)largeAllocScaled(maxMessages, sizeof(StoredMessage));
+        if (!messages)
+            LOG_ERROR(MESH, "Error: no memory for store and forward\n");
+    }
+
+    return messages != NULL;
+}
+
+void StoreForwardPlugin::addMessage(const StoredMessage &m)
+{
+    if (numMessages == maxMessages) {
+        // Full, so replace our oldest
+        messages[firstMessage] = m;
+        firstMessage = (firstMessage + 1) % maxMessages;
+    } else
+        getMessage(numMessages++) = m;
+}
+
+/// Our journal is just a sequence of (StoreForwardMessageHeader, len bytes of text), oldest first
+void StoreForwardPlugin::loadJournal()
+{
+#ifdef FS
+    auto f = FS.open(journalfile);
+    if (!f)
+        return;
+
+    if (allocMessages()) {
+        StoredMessage m;
+        while (f.read((uint8_t *)&m.header, sizeof(m.header)) == (int)sizeof(m.header) && m.header.len <= STORE_FORWARD_MAX_TEXT &&
+               f.read(m.text, m.header.len) == (int)m.header.len) {
+            m.storedMsec = 0; // Before we booted
+            addMessage(m);
+            numJournaled++;
+        }
+        LOG_DEBUG(MESH, "Loaded %u stored messages\n", numMessages);
+    }
+    f.close();
+#endif
+}
+
+void StoreForwardPlugin::appendJournal(const StoredMessage &m)
+{
+#ifdef FS
+    if (numJournaled >= 2 * maxMessages) {
+        rewriteJournal(); // Which includes m
+        return;
+    }
+
+    auto f = FS.open(journalfile, FILE_O_APPEND);
+    if (f) {
+        f.write((const uint8_t *)&m.header, sizeof(m.header));
+        f.write(m.text, m.header.len);
+        f.close();
+        numJournaled++;
+    } else
+        LOG_ERROR(MESH, "ERROR: can't write store and forward journal\n");
+#endif
+}
+
+void StoreForwardPlugin::rewriteJournal()
+{
+#ifdef FS
+    FS.remove(journaltmp); // In case a previous attempt left a partial file behind
+    auto f = FS.open(journaltmp, FILE_O_WRITE);
+    if (!f) {
+        LOG_ERROR(MESH, "ERROR: can't write store and forward journal\n");
+        return;
+    }
+
+    for (size_t i = 0; i < numMessages; i++) {
+        const StoredMessage &m = getMessage(i);
+        f.write((const uint8_t *)&m.header, sizeof(m.header));
+        f.write(m.text, m.header.len);
+    }
+    f.close();
+
+    FS.remove(journalfile);
+    if (!FS.rename(journaltmp, journalfile))
+        LOG_ERROR(MESH, "Error: can't rename new store and forward journal\n");
+    numJournaled = numMessages;
+#endif
+}
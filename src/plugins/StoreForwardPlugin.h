@@ -0,0 +1,134 @@
+#pragma once
+#include "SinglePortPlugin.h"
+
+/// The portnum we send store and forward requests and replays on (not yet in portnums.proto)
+#define STORE_FORWARD_PORTNUM ((PortNum)39)
+
+/// How many text messages a router keeps (in RAM, and journaled to flash so they survive a reboot), boards with PSRAM keep
+/// PSRAM_CAPACITY_SCALE times as many
+#ifndef STORE_FORWARD_MAX_MESSAGES
+#ifdef NRF52_SERIES
+#define STORE_FORWARD_MAX_MESSAGES 16
+#else
+#define STORE_FORWARD_MAX_MESSAGES 32
+#endif
+#endif
+
+/// How many nodes we remember hearing, so we notice when one comes back
+#define STORE_FORWARD_MAX_NODES 32
+
+/// A node we haven't heard from for this long has probably missed something, when we hear it again we replay what it missed
+#ifndef STORE_FORWARD_ABSENT_SECS
+#define STORE_FORWARD_ABSENT_SECS (10 * 60)
+#endif
+
+/// The most replay packets we send at once, a node which wants more asks again (with the id of the last message it got)
+#define STORE_FORWARD_MAX_BATCHES 4
+
+/// How many replayed messages we remember delivering, so we don't give our phone the same message twice
+#define STORE_FORWARD_SEEN 16
+
+enum StoreForwardType : uint8_t {
+    STORE_FORWARD_REQUEST = 1, // StoreForwardRequest, please send me what I missed
+    STORE_FORWARD_REPLAY = 2   // StoreForwardReplayHeader then numMessages (StoreForwardMessageHeader, len bytes of text)
+};
+
+/// All fields are little endian
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint32_t sinceId; // The id of the last message we got, we want the ones after it (0 for everything)
+} StoreForwardRequest;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t numMessages;
+} StoreForwardReplayHeader;
+
+typedef struct __attribute__((packed)) {
+    uint32_t from, to, id;
+    uint32_t rxTime;
+    uint8_t len;
+} StoreForwardMessageHeader;
+
+/// The longest text message we keep, any longer and its replay wouldn't fit in one packet
+#define STORE_FORWARD_MAX_TEXT                                                                                                   \
+    (sizeof(((Data *)0)->payload.bytes) - sizeof(StoreForwardReplayHeader) - sizeof(StoreForwardMessageHeader))
+
+/**
+ * Store and forward for text messages.
+ *
+ * Routers (is_router) keep the last STORE_FORWARD_MAX_MESSAGES text messages they heard.  When a router hears from a node
+ * which has been quiet for STORE_FORWARD_ABSENT_SECS (asleep or out of range) it sends that node the messages it missed,
+ * batched into as few STORE_FORWARD_REPLAY packets as they fit in.  Any node can also ask with a STORE_FORWARD_REQUEST.
+ *
+ * Every node delivers replayed messages to its phone as regular text messages, skipping any it already has.
+ *
+ * We can only store what plugins see: broadcasts and messages to us.  Unicasts between other nodes pass through
+ * the router still encrypted.
+ */
+class StoreForwardPlugin : public SinglePortPlugin
+{
+    struct StoredMessage {
+        StoreForwardMessageHeader header;
+        uint32_t storedMsec; // millis() when we stored this, or 0 if it was loaded from flash
+        uint8_t text[STORE_FORWARD_MAX_TEXT];
+    };
+
+    /// Our ring of messages, oldest first starting at firstMessage (allocated when we first need it, only routers do, in PSRAM
+    /// if we have it)
+    StoredMessage *messages = NULL;
+    size_t maxMessages = 0;
+    size_t firstMessage = 0, numMessages = 0;
+
+    /// How many records our flash journal holds, once it has twice as many as we keep we rewrite it
+    size_t numJournaled = 0;
+
+    struct HeardNode {
+        NodeNum node;
+        uint32_t msec;
+    } heard[STORE_FORWARD_MAX_NODES] = {};
+
+    /// (from, id) of the text messages we have delivered, newest at nextSeen - 1
+    struct SeenMessage {
+        NodeNum from;
+        PacketId id;
+    } seen[STORE_FORWARD_SEEN] = {};
+    size_t nextSeen = 0;
+
+  public:
+    StoreForwardPlugin();
+
+  protected:
+    /// We look at every packet, to notice nodes coming back and to store text messages
+    virtual bool wantPortnum(PortNum p) { return true; }
+
+    virtual int getSinglePortnum() { return -1; }
+
+    /// Journaling to flash and sending replays is slow, and nobody else needs to wait for us
+    virtual bool isAsync() { return true; }
+
+    virtual bool handleReceived(const MeshPacket &mp);
+
+  private:
+    void storeMessage(const MeshPacket &mp);
+
+    /// Update when we last heard from a node, and replay what it missed if it has been gone a while
+    void onHeard(NodeNum node);
+
+    /// Send dest the messages for it from index (in our ring) on, stored after sinceMsec (if it isn't 0)
+    void replay(NodeNum dest, size_t index, uint32_t sinceMsec);
+
+    void handleReplay(const MeshPacket &mp);
+
+    /// Remember we delivered (from, id) @return false if we already had
+    bool markSeen(NodeNum from, PacketId id);
+
+    StoredMessage &getMessage(size_t i) { return messages[(firstMessage + i) % maxMessages]; }
+
+    bool allocMessages();
+    void addMessage(const StoredMessage &m);
+
+    void loadJournal();
+    void appendJournal(const StoredMessage &m);
+    void rewriteJournal();
+};
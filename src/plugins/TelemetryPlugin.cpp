@@ -0,0 +1,166 @@
+#include "TelemetryPlugin.h"
+#include "MeshService.h"
+#include "NodeDB.h"
+#include "PowerStatus.h"
+#include "configuration.h"
+
+TelemetryPlugin *telemetryPlugin;
+
+#define TELEMETRY_MAX_DELTAS (sizeof(((TelemetryBatch *)0)->deltas) / sizeof(((TelemetryBatch *)0)->deltas[0]))
+
+static_assert(TELEMETRY_MAX_DELTAS >= TELEMETRY_MAX_CHANNELS, "A batch must hold at least one row");
+
+/// How many bytes a sint32 encodes to (a zigzag varint)
+static size_t sint32Len(int32_t v)
+{
+    uint32_t z = ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+    size_t n = 1;
+    for (; z >= 0x80; z >>= 7)
+        n++;
+    return n;
+}
+
+static bool readBatteryMv(int32_t &value)
+{
+    if (!powerStatus || !powerStatus->getHasBattery())
+        return false;
+    value = powerStatus->getBatteryVoltageMv();
+    return true;
+}
+
+TelemetryPlugin::TelemetryPlugin()
+    : ProtobufPlugin("telemetry", TELEMETRY_PORTNUM, TelemetryBatch_fields),
+      concurrency::OSThread("Telemetry", TELEMETRY_SAMPLE_MSEC)
+{
+    memset(last, 0, sizeof(last));
+    memset(senders, 0, sizeof(senders));
+    addSource(readBatteryMv);
+
+    if (TELEMETRY_SAMPLE_MSEC == 0)
+        setEnabled(false); // We still rebuild other nodes' batches
+}
+
+int TelemetryPlugin::addSource(TelemetrySource source)
+{
+    if (numSources == TELEMETRY_MAX_CHANNELS)
+        return -1;
+
+    sendBatch(); // Its rows don't have this channel
+    sources[numSources] = source;
+    return numSources++;
+}
+
+int32_t TelemetryPlugin::runOnce()
+{
+    int32_t values[TELEMETRY_MAX_CHANNELS];
+    bool anyReading = false;
+    for (uint8_t c = 0; c < numSources; c++) {
+        if (sources[c](values[c]))
+            anyReading = true;
+        else
+            values[c] = last[c];
+    }
+
+    // Rows of a batch must be evenly spaced, so once we have started one we fill in rows we couldn't read
+    if (anyReading || batch.deltas_count)
+        addRow(values);
+
+    if (batch.deltas_count && millis() - firstMsec + TELEMETRY_SAMPLE_MSEC > TELEMETRY_MAX_LATENCY_MSEC)
+        sendBatch(); // Our next row would be too late for it
+
+    return TELEMETRY_SAMPLE_MSEC;
+}
+
+void TelemetryPlugin::addRow(const int32_t *values)
+{
+    size_t rowBytes = 0;
+    for (uint8_t c = 0; c < numSources; c++)
+        rowBytes += sint32Len(batch.deltas_count ? values[c] - last[c] : values[c]);
+
+    if (batch.deltas_count &&
+        (batch.deltas_count + numSources > TELEMETRY_MAX_DELTAS || deltaBytes + rowBytes > TELEMETRY_MAX_DELTA_BYTES)) {
+        sendBatch();
+
+        rowBytes = 0; // Now it starts a batch, so it is absolute
+        for (uint8_t c = 0; c < numSources; c++)
+            rowBytes += sint32Len(values[c]);
+    }
+
+    bool first = !batch.deltas_count;
+    if (first)
+        firstMsec = millis();
+    for (uint8_t c = 0; c < numSources; c++) {
+        batch.deltas[batch.deltas_count++] = first ? values[c] : values[c] - last[c];
+        last[c] = values[c];
+    }
+    deltaBytes += rowBytes;
+}
+
+void TelemetryPlugin::sendBatch()
+{
+    if (!batch.deltas_count)
+        return;
+
+    batch.seq = nextSeq++;
+    batch.first_age_msec = millis() - firstMsec;
+    batch.interval_msec = TELEMETRY_SAMPLE_MSEC;
+    batch.num_channels = numSources;
+
+    MeshPacket *p = allocDataProtobuf(batch);
+    p->to = TELEMETRY_DEST;
+    LOG_DEBUG(MESH, "Sending telemetry batch %u, %u rows of %u channels in %u bytes\n", batch.seq,
+              batch.deltas_count / numSources, numSources, p->decoded.data.payload.size);
+    service.sendToMesh(p);
+
+    batch = TelemetryBatch_init_zero;
+    deltaBytes = 0;
+}
+
+bool TelemetryPlugin::handleReceivedProtobuf(const MeshPacket &mp, const TelemetryBatch &b)
+{
+    if (mp.from == nodeDB.getNodeNum())
+        return false; // One of our own, which we already know
+
+    if (!b.num_channels || b.num_channels > TELEMETRY_MAX_CHANNELS || b.deltas_count % b.num_channels) {
+        LOG_WARN(MESH, "Ignoring malformed telemetry batch from 0x%x\n", mp.from);
+        return false;
+    }
+
+    uint32_t lost = countLost(mp.from, b.seq);
+    uint32_t rows = b.deltas_count / b.num_channels;
+    LOG_DEBUG(MESH, "Telemetry batch %u from 0x%x, %u rows of %u channels (%u batches lost)\n", b.seq, mp.from, rows,
+              b.num_channels, lost);
+
+    // The sender took its first row first_age_msec before it sent the batch, and we got it at rx_time
+    uint64_t sentMsec = (uint64_t)mp.rx_time * 1000;
+    uint64_t firstMsec = sentMsec > b.first_age_msec ? sentMsec - b.first_age_msec : 0;
+
+    int32_t values[TELEMETRY_MAX_CHANNELS] = {0};
+    for (uint32_t r = 0; r < rows; r++)
+        for (uint8_t c = 0; c < b.num_channels; c++) {
+            values[c] += b.deltas[r * b.num_channels + c];
+
+            TelemetrySample s = {mp.from, c, firstMsec + (uint64_t)r * b.interval_msec, values[c]};
+            onSample.notifyObservers(&s);
+        }
+
+    return false; // Let others look at this message also if they want
+}
+
+uint32_t TelemetryPlugin::countLost(NodeNum from, uint32_t seq)
+{
+    for (size_t i = 0; i < TELEMETRY_MAX_SENDERS; i++) {
+        SenderSeq &s = senders[i];
+        if (s.from != from)
+            continue;
+
+        // A seq which went backwards means the sender rebooted
+        uint32_t lost = seq > s.seq ? seq - s.seq - 1 : 0;
+        s.seq = seq;
+        return lost;
+    }
+
+    senders[nextSender] = {from, seq};
+    nextSender = (nextSender + 1) % TELEMETRY_MAX_SENDERS;
+    return 0;
+}
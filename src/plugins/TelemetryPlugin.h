@@ -0,0 +1,115 @@
+#pragma once
+#include "Observer.h"
+#include "ProtobufPlugin.h"
+#include "concurrency/OSThread.h"
+#include "mesh/generated/telemetry.pb.h"
+
+/// The portnum we send telemetry batches on (not yet in portnums.proto)
+#define TELEMETRY_PORTNUM ((PortNum)44)
+
+/// How often we read our sensors, 0 to never send telemetry
+#ifndef TELEMETRY_SAMPLE_MSEC
+#define TELEMETRY_SAMPLE_MSEC (60 * 1000L)
+#endif
+
+/// We send a batch once its first reading is this old, even if it isn't full
+#ifndef TELEMETRY_MAX_LATENCY_MSEC
+#define TELEMETRY_MAX_LATENCY_MSEC (30 * 60 * 1000L)
+#endif
+
+/// Where we send our batches, i.e. the node number of a collector
+#ifndef TELEMETRY_DEST
+#define TELEMETRY_DEST NODENUM_BROADCAST
+#endif
+
+/// The most sensors we can read (and batches we receive can have)
+#define TELEMETRY_MAX_CHANNELS 4
+
+/// We keep the encoded deltas of a batch below this, so it fits in one packet with the rest of the TelemetryBatch
+#define TELEMETRY_MAX_DELTA_BYTES 200
+
+/// How many senders we remember the last batch seq of, to count lost batches
+#define TELEMETRY_MAX_SENDERS 8
+
+/// Reads one sensor, as an integer in whatever units suit it (i.e. millivolts, or hundredths of a degree) @return false if it
+/// has no reading now
+typedef bool (*TelemetrySource)(int32_t &value);
+
+/// One reading, reconstructed from a batch we received
+struct TelemetrySample {
+    NodeNum from;
+    uint8_t channel;   // In the order the sender added its sources
+    uint64_t timeMsec; // Since 1970, from the packet's rx_time (so only as good as our clock)
+    int32_t value;
+};
+
+/**
+ * Sends readings of our sensors in batches, so a fleet of sensor nodes gets a reading every TELEMETRY_SAMPLE_MSEC for a
+ * packet every TELEMETRY_MAX_LATENCY_MSEC (or whenever a batch fills up).
+ *
+ * Each TelemetryBatch has a row of readings (one per channel) for every sample we took, sent as the change since the previous
+ * row, so slowly changing readings are mostly 1 byte zigzag varints (as the protobuf's packed sint32s).  The first row is
+ * absolute.  A sensor with no reading repeats its last one.  Rows are evenly spaced by interval_msec, and first_age_msec says
+ * how long before we sent the batch its first row was taken, so receivers don't need our clock.
+ *
+ * Channel 0 is our battery voltage (in millivolts), board code can add other sensors with addSource.
+ *
+ * Receivers rebuild the time series and notify onSample for every reading (and count the batches they missed from seq), our
+ * phone gets the batches themselves like any other packet.
+ *
+ *  message TelemetryBatch {
+ *      uint32 seq = 1;
+ *      uint32 first_age_msec = 2;
+ *      uint32 interval_msec = 3;
+ *      uint32 num_channels = 4;
+ *      repeated sint32 deltas = 5 [(nanopb).max_count = 100]; // Row by row
+ *  }
+ */
+class TelemetryPlugin : public ProtobufPlugin<TelemetryBatch>, private concurrency::OSThread
+{
+    TelemetrySource sources[TELEMETRY_MAX_CHANNELS];
+    uint8_t numSources = 0;
+
+    /// The batch we are filling, its first row is taken at firstMsec
+    TelemetryBatch batch = TelemetryBatch_init_zero;
+    uint32_t firstMsec = 0;
+    size_t deltaBytes = 0; // How many bytes batch.deltas will encode to
+
+    /// Our last reading of each channel (what the next row's deltas are from)
+    int32_t last[TELEMETRY_MAX_CHANNELS];
+
+    uint32_t nextSeq = 0;
+
+    /// The last seq we got from each sender
+    struct SenderSeq {
+        NodeNum from;
+        uint32_t seq;
+    } senders[TELEMETRY_MAX_SENDERS];
+    size_t nextSender = 0;
+
+  public:
+    Observable<const TelemetrySample *> onSample;
+
+    TelemetryPlugin();
+
+    /// Read another sensor on each sample, as the next channel @return its channel, or -1 if we have no room
+    int addSource(TelemetrySource source);
+
+  protected:
+    virtual bool handleReceivedProtobuf(const MeshPacket &mp, const TelemetryBatch &b);
+
+    /// Takes our samples, and sends our batches
+    virtual int32_t runOnce();
+
+  private:
+    /// Add a row of readings to our batch (sending it first if the row won't fit)
+    void addRow(const int32_t *values);
+
+    /// Send our batch (if it has anything), and start a new one
+    void sendBatch();
+
+    /// Count the batches we missed from a sender
+    uint32_t countLost(NodeNum from, uint32_t seq);
+};
+
+extern TelemetryPlugin *telemetryPlugin;
@@ -1,36 +1,40 @@
 #include "AES.h"
 #include "CTR.h"
 #include "CryptoEngine.h"
+#include "HwAes.h"
 #include "configuration.h"
 
-/** A platform independent AES engine implemented using Tiny-AES
+/** A platform independent AES engine implemented using Tiny-AES, or the CPU's AES instructions when it has them (see HwAes)
  */
 class CrossPlatformCryptoEngine : public CryptoEngine
 {
 
-    CTRCommon *ctr = NULL;
+    /// One CTR object (holding its key's expanded schedule) per key, NULL for no crypt
+    CTRCommon *ctrs[CRYPTO_NUM_SLOTS] = {NULL};
 
-    /// How many bytes in our key
-    uint8_t keySize = 0;
+    /// Does this CPU have AES instructions?  If so we use hwKeys rather than ctrs.
+    bool useHw = HwAes::isSupported();
+
+    /// Each key's schedule for HwAes, rounds is 0 for no crypt
+    HwAes::Key hwKeys[CRYPTO_NUM_SLOTS];
 
   public:
-    CrossPlatformCryptoEngine() {}
+    CrossPlatformCryptoEngine()
+    {
+        for (size_t i = 0; i < CRYPTO_NUM_SLOTS; i++)
+            hwKeys[i].rounds = 0;
+    }
 
-    ~CrossPlatformCryptoEngine() {}
+    ~CrossPlatformCryptoEngine()
+    {
+        for (size_t i = 0; i < CRYPTO_NUM_SLOTS; i++)
+            delete ctrs[i];
+    }
 
-    /**
-     * Set the key used for encrypt, decrypt.
-     *
-     * As a special case: If all bytes are zero, we assume _no encryption_ and send all data in cleartext.
-     *
-     * @param numBytes must be 16 (AES128), 32 (AES256) or 0 (no crypt)
-     * @param bytes a _static_ buffer that will remain valid for the life of this crypto instance (i.e. this class will cache the
-     * provided pointer)
-     */
-    virtual void setKey(size_t numBytes, uint8_t *bytes)
+  protected:
+    virtual void installKey(size_t keyIndex, size_t numBytes, const uint8_t *bytes)
     {
-        keySize = numBytes;
-        DEBUG_MSG("Installing AES%d key!\n", numBytes * 8);
+        CTRCommon *&ctr = ctrs[keyIndex];
         if (ctr) {
             delete ctr;
             ctr = NULL;
@@ -43,40 +47,99 @@ class CrossPlatformCryptoEngine : public CryptoEngine
 
             ctr->setKey(bytes, numBytes);
         }
+
+        if (numBytes != 0)
+            HwAes::expandKey(hwKeys[keyIndex], bytes, numBytes);
+        else
+            hwKeys[keyIndex].rounds = 0;
+        if (useHw && keyIndex == 0)
+            LOG_INFO(MESH, "Using the CPU's AES instructions\n");
     }
 
     /**
-     * Encrypt a packet
+     * Run AES-CTR with one of our keys
      *
-     * @param bytes is updated in place
+     * @param in numBytes of input
+     * @param out where to write numBytes of output, it can be the same buffer as in
      */
-    virtual void encrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    virtual void crypt(size_t keyIndex, uint32_t fromNode, uint64_t packetNum, size_t numBytes, const uint8_t *in, uint8_t *out)
     {
-        if (keySize != 0) {
-            uint8_t stream_block[16];
-            static uint8_t scratch[MAX_BLOCKSIZE];
-            size_t nc_off = 0;
+        if (useHw) {
+            CryptJob job = {keyIndex, fromNode, packetNum, numBytes, in, out};
+            cryptBatch(&job, 1);
+            return;
+        }
+
+        CTRCommon *ctr = ctrs[keyIndex];
+        if (ctr) {
+            uint8_t packetNonce[16];
 
-            // DEBUG_MSG("ESP32 encrypt!\n");
-            initNonce(fromNode, packetNum);
+            initNonce(packetNonce, fromNode, packetNum);
             assert(numBytes <= MAX_BLOCKSIZE);
-            memcpy(scratch, bytes, numBytes);
-            memset(scratch + numBytes, 0,
-                   sizeof(scratch) - numBytes); // Fill rest of buffer with zero (in case cypher looks at it)
 
-            ctr->setIV(nonce, sizeof(nonce));
+            // Note: the ctr object holds per packet state, so this engine is not reentrant (portduino is single threaded)
+            ctr->setIV(packetNonce, sizeof(packetNonce));
             ctr->setCounterSize(4);
-            ctr->encrypt(bytes, scratch, numBytes);
-        }
+            ctr->encrypt(out, in, numBytes); // CTR mode is fine with out == in
+        } else if (in != out)
+            memcpy(out, in, numBytes);
     }
 
-    virtual void decrypt(uint32_t fromNode, uint64_t packetNum, size_t numBytes, uint8_t *bytes)
+    /// The first block of AES-CTR's keystream is the encryption of its counter block, so we start the counter at in
+    virtual void cryptBlock(size_t keyIndex, const uint8_t *in, uint8_t *out)
     {
-        // For CTR, the implementation is the same
-        encrypt(fromNode, packetNum, numBytes, bytes);
+        uint8_t block[16];
+        memcpy(block, in, sizeof(block));
+        if (useHw ? !hwKeys[keyIndex].rounds : !ctrs[keyIndex]) {
+            memcpy(out, block, sizeof(block)); // No crypt
+            return;
+        }
+
+        memset(out, 0, sizeof(block));
+        if (useHw) {
+            HwAes::Job job = {&hwKeys[keyIndex], {0}, out, out, sizeof(block)};
+            memcpy(job.iv, block, sizeof(block));
+            HwAes::ctr(&job, 1);
+        } else {
+            CTRCommon *ctr = ctrs[keyIndex];
+            ctr->setIV(block, sizeof(block));
+            ctr->setCounterSize(4);
+            ctr->encrypt(out, out, sizeof(block));
+        }
     }
 
-  private:
+    /// With AES instructions, all the jobs' blocks go through HwAes together, HW_AES_LANES at a time
+    virtual void cryptBatch(const CryptJob *jobs, size_t numJobs)
+    {
+        if (!useHw) {
+            CryptoEngine::cryptBatch(jobs, numJobs);
+            return;
+        }
+
+        HwAes::Job hwJobs[CRYPTO_BATCH_LANES];
+        while (numJobs) {
+            size_t n = 0;
+            for (; n < CRYPTO_BATCH_LANES && n < numJobs; n++) {
+                const CryptJob &j = jobs[n];
+                assert(j.numBytes <= MAX_BLOCKSIZE);
+
+                const HwAes::Key &key = hwKeys[j.keyIndex];
+                if (!key.rounds) {
+                    // No crypt, so copy it here and give HwAes nothing to do
+                    if (j.in != j.out)
+                        memcpy(j.out, j.in, j.numBytes);
+                    hwJobs[n] = {&key, {0}, j.in, j.out, 0};
+                    continue;
+                }
+                hwJobs[n] = {&key, {0}, j.in, j.out, j.numBytes};
+                initNonce(hwJobs[n].iv, j.fromNode, j.packetNum);
+            }
+
+            HwAes::ctr(hwJobs, n);
+            jobs += n;
+            numJobs -= n;
+        }
+    }
 };
 
 CryptoEngine *crypto = new CrossPlatformCryptoEngine();
@@ -0,0 +1,239 @@
+#include "EpollServerAPI.h"
+#include "PowerFSM.h"
+#include "configuration.h"
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+/// How many events our epoll thread takes at once
+#define EPOLL_API_MAX_EVENTS 64
+
+EpollServerPort *EpollServerPort::instance;
+
+size_t EpollServerAPI::numConnected;
+
+int SocketStream::available()
+{
+    if (rxHead == rxLen && !closed) {
+        rxHead = rxLen = 0;
+
+        ssize_t got = recv(fd, rxBuf, sizeof(rxBuf), MSG_DONTWAIT);
+        if (got > 0)
+            rxLen = got;
+        else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            closed = true;
+    }
+
+    return rxLen - rxHead;
+}
+
+int SocketStream::read()
+{
+    return available() ? rxBuf[rxHead++] : -1;
+}
+
+int SocketStream::peek()
+{
+    return available() ? rxBuf[rxHead] : -1;
+}
+
+size_t SocketStream::write(const uint8_t *buf, size_t len)
+{
+    if (closed)
+        return 0;
+
+    // MSG_NOSIGNAL so a client which hung up doesn't SIGPIPE our whole gateway
+    ssize_t sent = send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        closed = true;
+
+    return sent > 0 ? sent : 0; // If the socket is full we try again when epoll says it has room
+}
+
+EpollServerAPI::EpollServerAPI(int fd, size_t _slot) : StreamAPI(&socket), socket(fd), slot(_slot)
+{
+    LOG_DEBUG(HTTP, "Incoming API connection (slot %u)\n", slot);
+    init();
+}
+
+EpollServerAPI::~EpollServerAPI()
+{
+    close(); // Our base class destructor would call close too, but by then it is too late for our onConnectionChanged
+    if (packetArchive)
+        packetArchive->endReplay(replay);
+    ::close(socket.getFd()); // Which also removes it from our epoll set
+}
+
+void EpollServerAPI::onConnectionChanged(bool connected)
+{
+    if (connected) {
+        if (numConnected++ == 0)
+            powerFSM.trigger(EVENT_SERIAL_CONNECTED);
+    } else {
+        if (--numConnected == 0)
+            powerFSM.trigger(EVENT_SERIAL_DISCONNECTED);
+    }
+}
+
+void EpollServerAPI::onNowHasData(uint32_t fromRadioNum)
+{
+    StreamAPI::onNowHasData(fromRadioNum);
+
+    if (EpollServerPort::instance)
+        EpollServerPort::instance->wake(slot);
+}
+
+bool EpollServerAPI::startReplay(uint32_t sinceSecs, uint32_t node)
+{
+    return packetArchive && packetArchive->startReplay(replay, sinceSecs, node);
+}
+
+bool EpollServerAPI::getReplayPacket(MeshPacket &p)
+{
+    return replay.active && packetArchive->nextReplay(replay, p);
+}
+
+bool EpollServerAPI::loop()
+{
+    StreamAPI::loop();
+    return !socket.isClosed();
+}
+
+EpollServerPort::EpollServerPort() : concurrency::OSThread("ApiServer", EPOLL_API_SWEEP_MSEC)
+{
+    for (size_t i = 0; i < EPOLL_API_MAX_CLIENTS; i++)
+        ready[i] = false;
+    listenReady = false;
+}
+
+bool EpollServerPort::init()
+{
+    assert(!instance); // We only support one of these
+
+    listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // Which also accepts IPv4 clients
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0) {
+        LOG_ERROR(HTTP, "API server can't open sockets (errno %d)\n", errno);
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)); // So we can restart without waiting out TIME_WAIT
+
+    sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(EPOLL_API_PORT);
+    addr.sin6_addr = in6addr_any;
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        LOG_ERROR(HTTP, "API server can't listen on TCP port %d (errno %d)\n", EPOLL_API_PORT, errno);
+        ::close(listenFd);
+        ::close(epollFd);
+        listenFd = epollFd = -1;
+        return false;
+    }
+
+    instance = this;
+    arm(listenFd, 0, false, EPOLL_CTL_ADD);
+    std::thread(&EpollServerPort::epollTask, this).detach();
+
+    LOG_INFO(HTTP, "API server listening on TCP port %d\n", EPOLL_API_PORT);
+    return true;
+}
+
+void EpollServerPort::arm(int fd, uint32_t data, bool wantWritable, int op)
+{
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT | (wantWritable ? EPOLLOUT : 0);
+    ev.data.u32 = data;
+    if (epoll_ctl(epollFd, op, fd, &ev) < 0)
+        LOG_ERROR(HTTP, "API server can't watch socket %d (errno %d)\n", fd, errno);
+}
+
+void EpollServerPort::wake(size_t slot)
+{
+    ready[slot] = true;
+    setInterval(0);
+    concurrency::mainDelay.interrupt();
+}
+
+void EpollServerPort::epollTask()
+{
+    epoll_event events[EPOLL_API_MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(epollFd, events, EPOLL_API_MAX_EVENTS, -1);
+        if (n <= 0)
+            continue; // EINTR
+
+        for (int i = 0; i < n; i++) {
+            uint32_t data = events[i].data.u32;
+            if (data == 0)
+                listenReady = true;
+            else
+                ready[data - 1] = true;
+        }
+
+        // Our sockets are all one shot, so none of these can wake us again until our OSThread has run them
+        setInterval(0);
+        concurrency::mainDelay.interrupt();
+    }
+}
+
+void EpollServerPort::acceptClients()
+{
+    size_t slot = 0;
+    while (true) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            break; // EAGAIN, we have them all
+
+        while (slot < EPOLL_API_MAX_CLIENTS && openAPIs[slot])
+            slot++;
+
+        if (slot == EPOLL_API_MAX_CLIENTS) {
+            LOG_WARN(HTTP, "Already have %d API clients, refusing new connection\n", EPOLL_API_MAX_CLIENTS);
+            ::close(fd);
+            continue;
+        }
+
+        openAPIs[slot] = new EpollServerAPI(fd, slot);
+        ready[slot] = true; // Run it once now, there might be bytes waiting already
+        arm(fd, slot + 1, false, EPOLL_CTL_ADD);
+    }
+
+    arm(listenFd, 0, false, EPOLL_CTL_MOD);
+}
+
+int32_t EpollServerPort::runOnce()
+{
+    if (listenReady.exchange(false))
+        acceptClients();
+
+    uint32_t now = millis();
+    bool sweep = now - lastSweepMsec >= EPOLL_API_SWEEP_MSEC;
+    if (sweep)
+        lastSweepMsec = now;
+
+    for (size_t i = 0; i < EPOLL_API_MAX_CLIENTS; i++) {
+        EpollServerAPI *api = openAPIs[i];
+        if (!api || !(ready[i].exchange(false) || sweep))
+            continue;
+
+        if (api->loop())
+            arm(api->getFd(), i + 1, api->hasTxQueued(), EPOLL_CTL_MOD); // Only ask for EPOLLOUT while we are waiting for room
+        else {
+            LOG_DEBUG(HTTP, "Client dropped connection, closing API client (slot %u)\n", i);
+            delete api;
+            openAPIs[i] = NULL;
+        }
+    }
+
+    uint32_t sinceSweep = millis() - lastSweepMsec;
+    return sinceSweep < EPOLL_API_SWEEP_MSEC ? EPOLL_API_SWEEP_MSEC - sinceSweep : 0;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "PacketArchive.h"
+#include "StreamAPI.h"
+#include "concurrency/OSThread.h"
+#include <atomic>
+
+/// The TCP port we serve our API on (the same as WiFiServerPort)
+#ifndef EPOLL_API_PORT
+#define EPOLL_API_PORT 4403
+#endif
+
+/// How many API clients can be connected at once (each gets every packet its filter wants, see MeshService::encodeForPhone)
+#ifndef EPOLL_API_MAX_CLIENTS
+#define EPOLL_API_MAX_CLIENTS 256
+#endif
+
+/// How often we run clients nobody woke us for, so they notice their connection timing out
+#define EPOLL_API_SWEEP_MSEC 1000
+
+/// How many bytes our sockets read at a time
+#define EPOLL_API_READ_CHUNK 512
+
+/**
+ * The Stream a StreamAPI reads and writes, over a non blocking socket
+ *
+ * StreamAPI reads a byte at a time (through Stream::readBytes), so we recv in chunks and hand those out from our buffer.
+ */
+class SocketStream : public Stream
+{
+    int fd;
+
+    uint8_t rxBuf[EPOLL_API_READ_CHUNK];
+    size_t rxHead = 0, rxLen = 0;
+
+    /// Our peer hung up (or the socket broke)
+    bool closed = false;
+
+  public:
+    SocketStream(int _fd) : fd(_fd) {}
+
+    int getFd() const { return fd; }
+
+    bool isClosed() const { return closed; }
+
+    /// Read whatever the socket has for us (if our buffer is empty), without blocking
+    virtual int available();
+
+    virtual int read();
+
+    virtual int peek();
+
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+
+    /// Writes what the socket will take without blocking
+    virtual size_t write(const uint8_t *buf, size_t len);
+};
+
+/**
+ * One API client of EpollServerPort, with its own framing state
+ */
+class EpollServerAPI : public StreamAPI
+{
+    SocketStream socket;
+
+    /// Which of our port's slots we are in
+    size_t slot;
+
+    /// The replay of our PacketArchive this client asked for (if any)
+    ArchiveReplay replay;
+
+    /// How many of our instances are currently connected, so we only tell the PowerFSM about the first and last
+    static size_t numConnected;
+
+  public:
+    EpollServerAPI(int fd, size_t _slot);
+
+    virtual ~EpollServerAPI();
+
+    /// @return true if we want to keep running, or false if we are ready to be destroyed
+    bool loop();
+
+    int getFd() const { return socket.getFd(); }
+
+  protected:
+    /// Hookable to find out when connection changes
+    virtual void onConnectionChanged(bool connected);
+
+    /// We have new packets for our client, make sure we run soon
+    virtual void onNowHasData(uint32_t fromRadioNum);
+
+    virtual size_t writeNonBlocking(const uint8_t *buf, size_t len) { return socket.write(buf, len); }
+
+    virtual bool startReplay(uint32_t sinceSecs, uint32_t node);
+
+    virtual bool isReplaying() { return replay.active; }
+
+    virtual bool getReplayPacket(MeshPacket &p);
+};
+
+/**
+ * A TCP API server for linux gateways, which might have hundreds of clients (dashboards, loggers, bridges).
+ *
+ * A thread of our own waits in epoll_wait for any socket to be ready, flags which ones were, and wakes our OSThread, which
+ * runs just those clients on the main loop (our mesh state is only touched from there, see runOnMainThread).  Every socket is
+ * EPOLLONESHOT, so a client which is slow to be serviced doesn't wake us again until we've looked at it, and we only ask for
+ * EPOLLOUT while a client has output queued.  So an idle client costs us nothing but its memory and a visit every
+ * EPOLL_API_SWEEP_MSEC.
+ *
+ * Received packets aren't copied per client, they all read the same MeshService toPhone queue with their own cursor.
+ */
+class EpollServerPort : private concurrency::OSThread
+{
+    int listenFd = -1, epollFd = -1;
+
+    /// Our currently open connections, NULL for unused slots (only touched on the main loop)
+    EpollServerAPI *openAPIs[EPOLL_API_MAX_CLIENTS] = {};
+
+    /// Set by our epoll thread (or onNowHasData) for the slots which need to run, cleared on the main loop before running them
+    std::atomic<bool> ready[EPOLL_API_MAX_CLIENTS];
+    std::atomic<bool> listenReady;
+
+    /// When we last ran every client
+    uint32_t lastSweepMsec = 0;
+
+  public:
+    EpollServerPort();
+
+    /// Start listening @return false if we couldn't
+    bool init();
+
+    /// Mark slot as needing to run, and run as soon as possible.  Safe to call from other threads
+    void wake(size_t slot);
+
+    static EpollServerPort *instance;
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    void acceptClients();
+
+    /// Ask epoll for the next event on fd (which is EPOLLONESHOT), data is its slot + 1 (0 for our listen socket)
+    void arm(int fd, uint32_t data, bool wantWritable, int op);
+
+    /// Waits (in its own thread) for any of our sockets to be ready, then wakes our OSThread
+    void epollTask();
+};
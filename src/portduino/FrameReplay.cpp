@@ -0,0 +1,94 @@
+#include "FrameReplay.h"
+#include "configuration.h"
+
+FrameReplay::~FrameReplay()
+{
+    if (file)
+        fclose(file);
+}
+
+bool FrameReplay::open(const char *path, float _speed)
+{
+    speed = _speed;
+    file = fopen(path, "rb");
+    if (!file) {
+        LOG_ERROR(RADIO, "Can't open capture %s\n", path);
+        return false;
+    }
+
+    PcapHeader ph;
+    if (fread(&ph, sizeof(ph), 1, file) != 1 || (ph.magic != PCAP_MAGIC && ph.magic != __builtin_bswap32(PCAP_MAGIC))) {
+        LOG_ERROR(RADIO, "%s isn't a pcap file\n", path);
+        return false;
+    }
+    swapped = ph.magic != PCAP_MAGIC;
+    if (fix32(ph.linkType) != LINKTYPE_LORATAP) {
+        LOG_ERROR(RADIO, "%s isn't a LoRaTap capture (link type %u)\n", path, fix32(ph.linkType));
+        return false;
+    }
+
+    readNext();
+    return true;
+}
+
+void FrameReplay::readNext()
+{
+    haveNext = false;
+
+    PcapRecordHeader rh;
+    uint8_t record[sizeof(LoRaTapHeader) + MAX_LORA_FRAME_LEN];
+    while (fread(&rh, sizeof(rh), 1, file) == 1) {
+        uint32_t len = fix32(rh.inclLen);
+        if (len > sizeof(record)) {
+            LOG_ERROR(RADIO, "Capture record of %u bytes is too long, stopping\n", len);
+            return;
+        }
+        if (fread(record, len, 1, file) != 1)
+            return; // The capture ends part way through a record (we might have lost power while writing it)
+
+        LoRaTapHeader lh;
+        memcpy(&lh, record, min((size_t)len, sizeof(lh)));
+        uint16_t headerLen = __builtin_bswap16(lh.length); // Always big endian
+        if (len < sizeof(lh) || lh.version != 0 || headerLen < sizeof(lh) || headerLen >= len || (lh.padding & FRAME_CAPTURE_TX)) {
+            numSkipped++;
+            continue;
+        }
+
+        frameLen = len - headerLen;
+        memcpy(frame, record + headerLen, frameLen);
+        snr = lh.snr / 4.0;
+        rssi = lh.packetRssi - 139;
+        badCrc = lh.padding & FRAME_CAPTURE_BAD_CRC;
+
+        uint64_t capturedUsec = (uint64_t)fix32(rh.tsSec) * 1000000 + fix32(rh.tsUsec);
+        if (!haveFirst) {
+            firstCapturedUsec = capturedUsec;
+            haveFirst = true;
+        }
+        frameUsec = capturedUsec - firstCapturedUsec;
+        haveNext = true;
+        return;
+    }
+}
+
+size_t FrameReplay::next(uint8_t *dest, float &snrOut, float &rssiOut, bool &badCrcOut)
+{
+    if (!haveNext)
+        return 0;
+
+    if (!started) {
+        startMsec = millis();
+        started = true;
+    }
+    if (speed > 0 && (millis() - startMsec) * speed < frameUsec / 1000)
+        return 0;
+
+    size_t len = frameLen;
+    memcpy(dest, frame, len);
+    snrOut = snr;
+    rssiOut = rssi;
+    badCrcOut = badCrc;
+
+    readNext();
+    return len;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "mesh/FrameCapture.h"
+#include "mesh/RadioInterface.h"
+#include <stdio.h>
+
+/**
+ * Reads the frames we received from a capture (see FrameCapture), and says when each one is due to be replayed.  Frames we
+ * sent are skipped, the node replaying the capture decides what it sends.
+ */
+class FrameReplay
+{
+    FILE *file = NULL;
+
+    /// The capture was written on a host with the other byte order
+    bool swapped = false;
+
+    /// How many times real time we replay at, 0 for as fast as we can
+    float speed = 1;
+
+    /// Our next frame (valid if haveNext), and when it was received (in usecs since the capture's first frame)
+    uint8_t frame[MAX_LORA_FRAME_LEN];
+    size_t frameLen = 0;
+    float snr = 0, rssi = 0;
+    bool badCrc = false;
+    uint64_t frameUsec = 0;
+    bool haveNext = false;
+
+    /// When the capture's first frame was received, and when we replayed it
+    uint64_t firstCapturedUsec = 0;
+    uint32_t startMsec = 0;
+    bool haveFirst = false, started = false;
+
+    uint32_t numSkipped = 0;
+
+  public:
+    ~FrameReplay();
+
+    /// @return false if path isn't a LoRaTap capture we can read
+    bool open(const char *path, float speed);
+
+    /// @return true once we have replayed every frame
+    bool isDone() const { return !haveNext; }
+
+    /**
+     * If our next frame is due, copy it into dest (which must hold MAX_LORA_FRAME_LEN bytes) and move on to the one after
+     *
+     * @param badCrcOut set if the frame failed its CRC when it was captured
+     * @return the frame's length, or 0 if it isn't due yet (or we are done)
+     */
+    size_t next(uint8_t *dest, float &snrOut, float &rssiOut, bool &badCrcOut);
+
+    /// How many records we skipped (frames we sent, or with a header we don't understand)
+    uint32_t getNumSkipped() const { return numSkipped; }
+
+  private:
+    /// Read ahead to the next frame we received
+    void readNext();
+
+    uint32_t fix32(uint32_t x) const { return swapped ? __builtin_bswap32(x) : x; }
+};
@@ -0,0 +1,191 @@
+#include "HwAes.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HW_AES_X86
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HW_AES_ARM
+#endif
+
+namespace HwAes
+{
+
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+void expandKey(Key &key, const uint8_t *bytes, size_t numBytes)
+{
+    // FIPS-197 section 5.2, in words of 4 bytes.  Only done when a key is installed, so the portable version will do.
+    const size_t nk = numBytes / 4;
+    key.rounds = nk + 6;
+    uint8_t *w = &key.roundKeys[0][0];
+    memcpy(w, bytes, numBytes);
+
+    uint8_t rcon = 1;
+    for (size_t i = nk; i < 4 * (key.rounds + 1u); i++) {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % nk == 0) {
+            uint8_t first = t[0];
+            t[0] = sbox[t[1]] ^ rcon;
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[first];
+            rcon = (rcon << 1) ^ (rcon & 0x80 ? 0x1b : 0);
+        } else if (nk > 6 && i % nk == 4) {
+            for (int b = 0; b < 4; b++)
+                t[b] = sbox[t[b]];
+        }
+        for (int b = 0; b < 4; b++)
+            w[4 * i + b] = w[4 * (i - nk) + b] ^ t[b];
+    }
+}
+
+/// One counter block on its way through encryptBlocks()
+struct Block {
+    const Key *key;
+    uint8_t counter[16];
+    const uint8_t *in;
+    uint8_t *out;
+    size_t len; // Up to 16
+};
+
+#if defined(HW_AES_X86)
+
+bool isSupported()
+{
+    unsigned a, b, c, d;
+    return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+}
+
+/// Encrypt the counters of n (up to HW_AES_LANES) blocks side by side, and XOR their keystream into their output
+__attribute__((target("aes,sse2"))) static void encryptBlocks(const Block *blocks, size_t n)
+{
+    __m128i s[HW_AES_LANES];
+    uint8_t maxRounds = 0;
+    for (size_t i = 0; i < n; i++) {
+        s[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)blocks[i].counter),
+                             _mm_load_si128((const __m128i *)blocks[i].key->roundKeys[0]));
+        if (blocks[i].key->rounds > maxRounds)
+            maxRounds = blocks[i].key->rounds;
+    }
+
+    // Lanes can have different key sizes, each finishes at its own last round
+    for (uint8_t r = 1; r <= maxRounds; r++)
+        for (size_t i = 0; i < n; i++) {
+            const Key *k = blocks[i].key;
+            if (r < k->rounds)
+                s[i] = _mm_aesenc_si128(s[i], _mm_load_si128((const __m128i *)k->roundKeys[r]));
+            else if (r == k->rounds)
+                s[i] = _mm_aesenclast_si128(s[i], _mm_load_si128((const __m128i *)k->roundKeys[r]));
+        }
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t ks[16];
+        _mm_storeu_si128((__m128i *)ks, s[i]);
+        for (size_t b = 0; b < blocks[i].len; b++)
+            blocks[i].out[b] = blocks[i].in[b] ^ ks[b];
+    }
+}
+
+#elif defined(HW_AES_ARM)
+
+bool isSupported()
+{
+    return getauxval(AT_HWCAP) & HWCAP_AES;
+}
+
+/// Encrypt the counters of n (up to HW_AES_LANES) blocks side by side, and XOR their keystream into their output
+__attribute__((target("+crypto"))) static void encryptBlocks(const Block *blocks, size_t n)
+{
+    // AESE does AddRoundKey first, so round key r goes in before round r's SubBytes, and the last key is a plain XOR
+    uint8x16_t s[HW_AES_LANES];
+    uint8_t maxRounds = 0;
+    for (size_t i = 0; i < n; i++) {
+        s[i] = vld1q_u8(blocks[i].counter);
+        if (blocks[i].key->rounds > maxRounds)
+            maxRounds = blocks[i].key->rounds;
+    }
+
+    for (uint8_t r = 0; r < maxRounds; r++)
+        for (size_t i = 0; i < n; i++) {
+            const Key *k = blocks[i].key;
+            if (r + 1 < k->rounds)
+                s[i] = vaesmcq_u8(vaeseq_u8(s[i], vld1q_u8(k->roundKeys[r])));
+            else if (r + 1 == k->rounds)
+                s[i] = veorq_u8(vaeseq_u8(s[i], vld1q_u8(k->roundKeys[r])), vld1q_u8(k->roundKeys[r + 1]));
+        }
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t ks[16];
+        vst1q_u8(ks, s[i]);
+        for (size_t b = 0; b < blocks[i].len; b++)
+            blocks[i].out[b] = blocks[i].in[b] ^ ks[b];
+    }
+}
+
+#else
+
+bool isSupported()
+{
+    return false;
+}
+
+static void encryptBlocks(const Block *blocks, size_t n) {}
+
+#endif
+
+void ctr(const Job *jobs, size_t numJobs)
+{
+    // Every block of every job is independent, so we just fill our lanes in order
+    Block blocks[HW_AES_LANES];
+    size_t n = 0;
+    for (size_t j = 0; j < numJobs; j++) {
+        const Job &job = jobs[j];
+        uint32_t first = ((uint32_t)job.iv[12] << 24) | ((uint32_t)job.iv[13] << 16) | ((uint32_t)job.iv[14] << 8) | job.iv[15];
+
+        for (size_t offset = 0, i = 0; offset < job.numBytes; offset += 16, i++) {
+            Block &b = blocks[n++];
+            b.key = job.key;
+            memcpy(b.counter, job.iv, 12);
+            uint32_t counter = first + i;
+            b.counter[12] = counter >> 24;
+            b.counter[13] = counter >> 16;
+            b.counter[14] = counter >> 8;
+            b.counter[15] = counter;
+            b.in = job.in + offset;
+            b.out = job.out + offset;
+            b.len = job.numBytes - offset < 16 ? job.numBytes - offset : 16;
+
+            if (n == HW_AES_LANES) {
+                encryptBlocks(blocks, n);
+                n = 0;
+            }
+        }
+    }
+    if (n)
+        encryptBlocks(blocks, n);
+}
+
+} // namespace HwAes
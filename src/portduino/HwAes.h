@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// How many AES blocks we keep in flight at once.  The AES instructions are pipelined (a new one can start every cycle or
+/// two, each takes several), so independent blocks side by side run nearly as fast as one.
+#define HW_AES_LANES 4
+
+/**
+ * AES-CTR with the CPU's own AES instructions (x86 AES-NI or ARMv8 Crypto Extensions), for our linux builds.
+ *
+ * Whether the CPU we are running on has them is only known at runtime (the same binary runs on any x86 or arm64 gateway), so
+ * callers check isSupported() and fall back to the portable AES otherwise.  Every block of every job is independent in CTR
+ * mode, so ctr() encrypts HW_AES_LANES counter blocks at a time, from one packet or several (which may use different keys).
+ */
+namespace HwAes
+{
+
+/// An expanded key, in the standard (FIPS-197) round key layout both instruction sets use
+struct Key {
+    alignas(16) uint8_t roundKeys[15][16];
+    uint8_t rounds; // 10 for AES128, 14 for AES256
+};
+
+/// One packet for ctr()
+struct Job {
+    const Key *key;
+    uint8_t iv[16]; // The counter block of the first block, its last 4 bytes are a big endian block counter
+    const uint8_t *in;
+    uint8_t *out; // Can be the same buffer as in
+    size_t numBytes;
+};
+
+/// Does the CPU we are running on have AES instructions (and were we built with code for them)?
+bool isSupported();
+
+/// Expand a 16 (AES128) or 32 (AES256) byte key
+void expandKey(Key &key, const uint8_t *bytes, size_t numBytes);
+
+/// Run AES-CTR (which both encrypts and decrypts) for every job, only call this if isSupported()
+void ctr(const Job *jobs, size_t numJobs);
+
+} // namespace HwAes
@@ -0,0 +1,419 @@
+#include "PacketArchive.h"
+#include "Router.h"
+#include "configuration.h"
+#include "mesh-pb-constants.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+PacketArchive *packetArchive;
+
+static bool byKey(const ArchiveIndexEntry &a, const ArchiveIndexEntry &b)
+{
+    return a.key < b.key;
+}
+
+static bool writeAll(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len) {
+        ssize_t wrote = write(fd, p, len);
+        if (wrote < 0 && errno == EINTR)
+            continue;
+        if (wrote <= 0)
+            return false;
+        p += wrote;
+        len -= wrote;
+    }
+    return true;
+}
+
+/// Add the record at offset to a segment's indexes
+static void indexRecord(ArchiveSegment &s, std::vector<ArchiveIndexEntry> &nodes, const ArchiveRecordHeader &h, uint32_t offset)
+{
+    if (s.numRecords % ARCHIVE_TIME_STRIDE == 0)
+        s.times.push_back({h.time, offset});
+    nodes.push_back({h.from, offset});
+    s.numRecords++;
+    s.maxTime = std::max(s.maxTime, h.time);
+    s.size = offset + sizeof(h) + h.len;
+}
+
+PacketArchive::PacketArchive() : concurrency::OSThread("PacketArchive", ARCHIVE_FLUSH_MSEC) {}
+
+PacketArchive::~PacketArchive()
+{
+    flush();
+    if (activeFd >= 0)
+        close(activeFd);
+}
+
+std::string PacketArchive::segmentPath(uint32_t number, const char *ext) const
+{
+    char name[16];
+    snprintf(name, sizeof(name), "/%08x.%s", number, ext);
+    return dir + name;
+}
+
+bool PacketArchive::init()
+{
+    const char *archiveDir = getenv("PACKET_ARCHIVE_DIR");
+    if (!archiveDir)
+        return false;
+    dir = archiveDir;
+
+    mkdir(dir.c_str(), 0755); // Fine if it already exists
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        LOG_ERROR(MESH, "Can't open packet archive %s (errno %d)\n", dir.c_str(), errno);
+        return false;
+    }
+
+    std::vector<uint32_t> numbers;
+    while (struct dirent *e = readdir(d)) {
+        unsigned number;
+        char ext[4];
+        if (strlen(e->d_name) == 12 && sscanf(e->d_name, "%8x.%3s", &number, ext) == 2 && strcmp(ext, "log") == 0)
+            numbers.push_back(number);
+    }
+    closedir(d);
+    std::sort(numbers.begin(), numbers.end());
+
+    // Sealed segments have an index, only the one we were writing (or one we couldn't write the index for) needs scanning
+    bool haveActive = false;
+    for (size_t i = 0; i < numbers.size(); i++) {
+        ArchiveSegment s = {numbers[i], 0, 0, 0, {}};
+        if (!loadIndex(s)) {
+            std::vector<ArchiveIndexEntry> nodes;
+            scanSegment(s, nodes);
+            if (i == numbers.size() - 1 && s.size < ARCHIVE_SEGMENT_BYTES) {
+                activeNodes.swap(nodes);
+                haveActive = true;
+            } else
+                writeIndex(s, nodes);
+        }
+        segments.push_back(s);
+    }
+
+    if (!haveActive)
+        segments.push_back({segments.empty() ? 0 : segments.back().number + 1, 0, 0, 0, {}});
+    activeFd = open(segmentPath(segments.back().number, "log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (activeFd < 0) {
+        LOG_ERROR(MESH, "Can't write packet archive %s (errno %d)\n", dir.c_str(), errno);
+        return false;
+    }
+    flushedSize = segments.back().size;
+    trim();
+
+    uint32_t numRecords = 0;
+    for (auto &s : segments)
+        numRecords += s.numRecords;
+    LOG_INFO(MESH, "Packet archive %s holds %u packets in %u segments\n", dir.c_str(), numRecords, (uint32_t)segments.size());
+
+    packetReceivedObserver.observe(&router->notifyPacketReceived);
+    return true;
+}
+
+bool PacketArchive::loadIndex(ArchiveSegment &s)
+{
+    int fd = open(segmentPath(s.number, "idx").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    ArchiveIndexHeader h;
+    struct stat st;
+    bool ok = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && h.magic == ARCHIVE_INDEX_MAGIC &&
+              stat(segmentPath(s.number, "log").c_str(), &st) == 0 && st.st_size == h.size;
+    if (ok) {
+        s.times.resize(h.numTimes);
+        size_t bytes = h.numTimes * sizeof(ArchiveIndexEntry);
+        ok = read(fd, s.times.data(), bytes) == (ssize_t)bytes;
+    }
+    close(fd);
+
+    if (!ok) {
+        s.times.clear();
+        return false;
+    }
+    s.size = h.size;
+    s.numRecords = h.numRecords;
+    s.maxTime = h.maxTime;
+    return true;
+}
+
+void PacketArchive::scanSegment(ArchiveSegment &s, std::vector<ArchiveIndexEntry> &nodes)
+{
+    int fd = open(segmentPath(s.number, "log").c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    std::vector<uint8_t> buf(st.st_size);
+    if (read(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+        buf.clear();
+
+    uint32_t at = 0;
+    ArchiveRecordHeader h;
+    while (at + sizeof(h) <= buf.size()) {
+        memcpy(&h, &buf[at], sizeof(h));
+        if (h.magic != ARCHIVE_RECORD_MAGIC || h.len > MeshPacket_size || at + sizeof(h) + h.len > buf.size())
+            break;
+        indexRecord(s, nodes, h, at);
+        at += sizeof(h) + h.len;
+    }
+
+    if (at < buf.size()) {
+        LOG_WARN(MESH, "Packet archive segment %08x ends in a partial record, truncating it to %u bytes\n", s.number, at);
+        if (ftruncate(fd, at) < 0)
+            LOG_ERROR(MESH, "Can't truncate packet archive segment (errno %d)\n", errno);
+    }
+    close(fd);
+}
+
+bool PacketArchive::writeIndex(const ArchiveSegment &s, std::vector<ArchiveIndexEntry> &nodes)
+{
+    std::stable_sort(nodes.begin(), nodes.end(), byKey); // Each node's records stay in offset order
+
+    // Written to a temporary file and renamed, so a crash can't leave an index which is only partly there
+    std::string path = segmentPath(s.number, "idx"), tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    ArchiveIndexHeader h = {ARCHIVE_INDEX_MAGIC, s.size, s.numRecords, s.maxTime, (uint32_t)s.times.size(),
+                            (uint32_t)nodes.size()};
+    bool ok = fd >= 0 && writeAll(fd, &h, sizeof(h)) &&
+              writeAll(fd, s.times.data(), s.times.size() * sizeof(ArchiveIndexEntry)) &&
+              writeAll(fd, nodes.data(), nodes.size() * sizeof(ArchiveIndexEntry)) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        LOG_ERROR(MESH, "Can't write packet archive index %s (errno %d)\n", path.c_str(), errno);
+        unlink(tmp.c_str());
+        return false; // We scan the segment instead
+    }
+    return true;
+}
+
+int PacketArchive::onReceived(const MeshPacket *p)
+{
+    append(*p);
+    return 0;
+}
+
+void PacketArchive::append(const MeshPacket &p)
+{
+    if (activeFd < 0)
+        return;
+
+    uint8_t encoded[MeshPacket_size];
+    size_t len = pb_encode_to_bytes(encoded, sizeof(encoded), MeshPacket_fields, &p);
+    if (!len) {
+        LOG_ERROR(MESH, "Error: can't encode packet for our archive\n");
+        return;
+    }
+
+    ArchiveRecordHeader h = {ARCHIVE_RECORD_MAGIC, (uint16_t)len, p.rx_time ? p.rx_time : (uint32_t)time(NULL), p.from};
+    if (segments.back().numRecords && segments.back().size + sizeof(h) + len > ARCHIVE_SEGMENT_BYTES)
+        rotate();
+
+    ArchiveSegment &s = segments.back();
+    indexRecord(s, activeNodes, h, s.size);
+    pending.insert(pending.end(), (const uint8_t *)&h, (const uint8_t *)&h + sizeof(h));
+    pending.insert(pending.end(), encoded, encoded + len);
+
+    if (pending.size() >= ARCHIVE_FLUSH_BYTES)
+        flush();
+}
+
+void PacketArchive::flush()
+{
+    if (pending.empty() || activeFd < 0)
+        return;
+
+    numWrites++;
+    if (writeAll(activeFd, pending.data(), pending.size()))
+        flushedSize += pending.size();
+    else {
+        // Drop these records from our indexes too, so they still match the log
+        LOG_ERROR(MESH, "Error: can't write packet archive (errno %d), discarding %u bytes\n", errno, (uint32_t)pending.size());
+        ArchiveSegment &s = segments.back();
+        while (!activeNodes.empty() && activeNodes.back().offset >= flushedSize) {
+            activeNodes.pop_back();
+            s.numRecords--;
+        }
+        while (!s.times.empty() && s.times.back().offset >= flushedSize)
+            s.times.pop_back();
+        s.size = flushedSize;
+        if (ftruncate(activeFd, flushedSize) < 0)
+            LOG_ERROR(MESH, "Can't truncate packet archive segment (errno %d)\n", errno);
+    }
+    pending.clear();
+}
+
+void PacketArchive::rotate()
+{
+    flush();
+    writeIndex(segments.back(), activeNodes);
+    activeNodes.clear();
+    close(activeFd);
+
+    uint32_t number = segments.back().number + 1;
+    LOG_DEBUG(MESH, "Starting packet archive segment %08x\n", number);
+    segments.push_back({number, 0, 0, 0, {}});
+    activeFd = open(segmentPath(number, "log").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (activeFd < 0)
+        LOG_ERROR(MESH, "Can't write packet archive %s (errno %d), no longer archiving\n", dir.c_str(), errno);
+    flushedSize = 0;
+    trim();
+}
+
+void PacketArchive::trim()
+{
+    while (segments.size() > ARCHIVE_MAX_SEGMENTS) {
+        unlink(segmentPath(segments.front().number, "log").c_str()); // Replays still reading it keep it open
+        unlink(segmentPath(segments.front().number, "idx").c_str());
+        segments.erase(segments.begin());
+    }
+}
+
+int32_t PacketArchive::runOnce()
+{
+    flush();
+    return ARCHIVE_FLUSH_MSEC;
+}
+
+bool PacketArchive::startReplay(ArchiveReplay &r, uint32_t sinceSecs, NodeNum node)
+{
+    endReplay(r);
+    flush(); // So the replay can read everything from disk
+
+    r.sinceSecs = sinceSecs;
+    r.node = node;
+    r.endSegment = segments.back().number;
+    r.endOffset = segments.back().size;
+    r.active = true;
+
+    // Skip the segments with nothing new enough
+    uint32_t first = r.endSegment;
+    for (auto &s : segments)
+        if (s.maxTime >= sinceSecs) {
+            first = s.number;
+            break;
+        }
+
+    if (!openReplaySegment(r, first))
+        endReplay(r);
+    LOG_DEBUG(MESH, "Replaying archived packets since %u (from node 0x%x) starting at segment %08x\n", sinceSecs, node,
+              r.segment);
+    return true;
+}
+
+bool PacketArchive::openReplaySegment(ArchiveReplay &r, uint32_t number)
+{
+    if (r.fd >= 0) {
+        close(r.fd);
+        r.fd = -1;
+    }
+
+    for (auto &s : segments) {
+        if (s.number < number)
+            continue;
+        if (s.number > r.endSegment)
+            break;
+
+        r.segment = s.number;
+        r.fd = open(segmentPath(s.number, "log").c_str(), O_RDONLY | O_CLOEXEC);
+        if (r.fd < 0)
+            continue; // Trimmed since we started
+
+        // Start at the last time entry older than sinceSecs, every record before it is older too
+        r.offset = 0;
+        for (size_t i = 0; i < s.times.size() && s.times[i].key < r.sinceSecs; i++)
+            r.offset = s.times[i].offset;
+
+        if (r.node) {
+            findNodeOffsets(s, r.node, r.nodeOffsets);
+            r.nextNodeOffset = std::lower_bound(r.nodeOffsets.begin(), r.nodeOffsets.end(), r.offset) - r.nodeOffsets.begin();
+        }
+        return true;
+    }
+    return false;
+}
+
+void PacketArchive::findNodeOffsets(const ArchiveSegment &s, NodeNum node, std::vector<uint32_t> &offsets)
+{
+    offsets.clear();
+    if (&s == &segments.back()) {
+        for (auto &e : activeNodes)
+            if (e.key == node)
+                offsets.push_back(e.offset);
+        return;
+    }
+
+    std::vector<ArchiveIndexEntry> nodes;
+    int fd = open(segmentPath(s.number, "idx").c_str(), O_RDONLY | O_CLOEXEC);
+    ArchiveIndexHeader h;
+    if (fd >= 0 && read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && h.magic == ARCHIVE_INDEX_MAGIC && h.size == s.size) {
+        nodes.resize(h.numNodes);
+        size_t bytes = h.numNodes * sizeof(ArchiveIndexEntry);
+        if (pread(fd, nodes.data(), bytes, sizeof(h) + h.numTimes * sizeof(ArchiveIndexEntry)) != (ssize_t)bytes)
+            nodes.clear();
+    } else {
+        // We couldn't write its index, so scan the log
+        ArchiveSegment scanned = {s.number, 0, 0, 0, {}};
+        scanSegment(scanned, nodes);
+        std::stable_sort(nodes.begin(), nodes.end(), byKey);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    auto range = std::equal_range(nodes.begin(), nodes.end(), ArchiveIndexEntry{node, 0}, byKey);
+    for (auto it = range.first; it != range.second; ++it)
+        offsets.push_back(it->offset);
+}
+
+bool PacketArchive::nextReplay(ArchiveReplay &r, MeshPacket &p)
+{
+    while (r.active) {
+        uint32_t end = r.segment == r.endSegment ? r.endOffset : UINT32_MAX, at = r.offset;
+        if (r.node)
+            at = r.nextNodeOffset < r.nodeOffsets.size() ? r.nodeOffsets[r.nextNodeOffset++] : end;
+
+        ArchiveRecordHeader h;
+        uint8_t encoded[MeshPacket_size];
+        if (at < end && pread(r.fd, &h, sizeof(h), at) == (ssize_t)sizeof(h) && h.magic == ARCHIVE_RECORD_MAGIC &&
+            h.len <= sizeof(encoded) && pread(r.fd, encoded, h.len, at + sizeof(h)) == (ssize_t)h.len) {
+            r.offset = at + sizeof(h) + h.len;
+            if (h.time < r.sinceSecs)
+                continue;
+
+            memset(&p, 0, sizeof(p));
+            if (pb_decode_from_bytes(encoded, h.len, MeshPacket_fields, &p))
+                return true;
+            LOG_ERROR(MESH, "Error: can't decode archived packet\n");
+            continue;
+        }
+
+        // Done with this segment
+        if (r.segment == r.endSegment || !openReplaySegment(r, r.segment + 1))
+            endReplay(r);
+    }
+    return false;
+}
+
+void PacketArchive::endReplay(ArchiveReplay &r)
+{
+    if (r.fd >= 0)
+        close(r.fd);
+    r.fd = -1;
+    r.nodeOffsets.clear();
+    r.active = false;
+}
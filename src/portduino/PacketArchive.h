@@ -0,0 +1,176 @@
+#pragma once
+
+#include "MeshTypes.h"
+#include "Observer.h"
+#include "concurrency/OSThread.h"
+#include <string>
+#include <vector>
+
+/// Once a segment of our log is this big we seal it (writing its index) and start the next
+#ifndef ARCHIVE_SEGMENT_BYTES
+#define ARCHIVE_SEGMENT_BYTES (1024 * 1024)
+#endif
+
+/// How many segments we keep, once we have more we delete the oldest
+#ifndef ARCHIVE_MAX_SEGMENTS
+#define ARCHIVE_MAX_SEGMENTS 256
+#endif
+
+/// How often we write the records we have buffered out to our log
+#ifndef ARCHIVE_FLUSH_MSEC
+#define ARCHIVE_FLUSH_MSEC 2000
+#endif
+
+/// We write sooner if this many bytes of records are waiting
+#ifndef ARCHIVE_FLUSH_BYTES
+#define ARCHIVE_FLUSH_BYTES (64 * 1024)
+#endif
+
+/// Our time index has an entry for every this many records
+#define ARCHIVE_TIME_STRIDE 64
+
+#define ARCHIVE_RECORD_MAGIC 0xa7c3
+#define ARCHIVE_INDEX_MAGIC 0x58494150 // "PAIX"
+
+/// Each record in a segment's log is one of these, followed by len bytes of encoded MeshPacket.  All in our native byte order.
+struct ArchiveRecordHeader {
+    uint16_t magic; // ARCHIVE_RECORD_MAGIC
+    uint16_t len;
+    uint32_t time; // When we received it, in secs since 1970
+    uint32_t from;
+} __attribute__((packed));
+
+/// A sealed segment's index file starts with this, followed by numTimes time entries and then numNodes node entries
+struct ArchiveIndexHeader {
+    uint32_t magic; // ARCHIVE_INDEX_MAGIC
+    uint32_t size;  // Of the segment's log, so we notice an index which doesn't match it
+    uint32_t numRecords;
+    uint32_t maxTime;
+    uint32_t numTimes, numNodes;
+};
+
+/// A time entry is (the record's time, its offset), a node entry is (the node it is from, its offset), sorted by node then offset
+struct ArchiveIndexEntry {
+    uint32_t key;
+    uint32_t offset;
+};
+
+/// One segment of our log: NNNNNNNN.log holds its records, and once sealed NNNNNNNN.idx holds its indexes
+struct ArchiveSegment {
+    uint32_t number;
+    uint32_t size; // Of its records, including any we haven't flushed yet
+    uint32_t numRecords;
+    uint32_t maxTime; // The newest record's time (0 if none)
+    std::vector<ArchiveIndexEntry> times;
+};
+
+/**
+ * A client's replay of the archive, from startReplay() to the end the archive had then.  Close it with endReplay().
+ */
+struct ArchiveReplay {
+    uint32_t sinceSecs = 0;
+    NodeNum node = 0; // Only the packets from this node, or 0 for all of them
+
+    uint32_t segment = 0; // The segment we are reading
+    int fd = -1;          // Its log (we keep it open, so it can be deleted while we read it)
+    uint32_t offset = 0;  // Of our next record
+
+    /// With a node filter, the offsets of that node's records in our segment, we are up to nextNodeOffset
+    std::vector<uint32_t> nodeOffsets;
+    size_t nextNodeOffset = 0;
+
+    /// Where the archive ended when we started
+    uint32_t endSegment = 0, endOffset = 0;
+
+    bool active = false;
+};
+
+/**
+ * Keeps every packet a linux gateway hears (everything our phone clients are given), so clients can analyse them later or
+ * backfill what they missed while disconnected.  Set PACKET_ARCHIVE_DIR to enable it.
+ *
+ * The archive is an append only log, split into segments of ARCHIVE_SEGMENT_BYTES.  Records are buffered in RAM and written out
+ * with one write() every ARCHIVE_FLUSH_MSEC (or ARCHIVE_FLUSH_BYTES), however fast packets arrive.  Sealing a segment writes its
+ * index: a sparse time index (every ARCHIVE_TIME_STRIDE'th record) and a node index (every record's sender).
+ *
+ * We keep every segment's time index in RAM, so finding where "since T" starts is a look at a few hundred entries and a scan
+ * of at most ARCHIVE_TIME_STRIDE records.  Node indexes stay on disk until a replay for that node reaches their segment.
+ *
+ * At boot we load the indexes, and only scan the segment we were writing (truncating any record a crash cut short).
+ */
+class PacketArchive : private concurrency::OSThread
+{
+    CallbackObserver<PacketArchive, const MeshPacket *> packetReceivedObserver =
+        CallbackObserver<PacketArchive, const MeshPacket *>(this, &PacketArchive::onReceived);
+
+    std::string dir;
+
+    /// Oldest first, the last one is the one we are appending to
+    std::vector<ArchiveSegment> segments;
+
+    /// The node index of the segment we are appending to, in the order we wrote them
+    std::vector<ArchiveIndexEntry> activeNodes;
+
+    int activeFd = -1;
+
+    /// Records we haven't written yet, they start at flushedSize in the active segment
+    std::vector<uint8_t> pending;
+    uint32_t flushedSize = 0;
+
+    uint32_t numWrites = 0;
+
+  public:
+    PacketArchive();
+
+    ~PacketArchive();
+
+    /// Open (or create) the archive in PACKET_ARCHIVE_DIR and start archiving @return false if it isn't set, or we couldn't
+    bool init();
+
+    /// Start replaying the packets we received since sinceSecs (and from node, unless it is 0) @return false if we can't
+    bool startReplay(ArchiveReplay &r, uint32_t sinceSecs, NodeNum node);
+
+    /// Copy the next packet of a replay into p @return false (and end the replay) once it is done
+    bool nextReplay(ArchiveReplay &r, MeshPacket &p);
+
+    void endReplay(ArchiveReplay &r);
+
+    uint32_t getNumSegments() const { return segments.size(); }
+
+    uint32_t getNumWrites() const { return numWrites; }
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    int onReceived(const MeshPacket *p);
+
+    void append(const MeshPacket &p);
+
+    /// Write our pending records to the active segment
+    void flush();
+
+    /// Write the active segment's index and start a new segment
+    void rotate();
+
+    /// Delete our oldest segments until we have at most ARCHIVE_MAX_SEGMENTS
+    void trim();
+
+    std::string segmentPath(uint32_t number, const char *ext) const;
+
+    /// Load a sealed segment's index @return false if it has none (or it doesn't match the log)
+    bool loadIndex(ArchiveSegment &s);
+
+    /// Rebuild a segment's indexes from its log, truncating any partial record at its end
+    void scanSegment(ArchiveSegment &s, std::vector<ArchiveIndexEntry> &nodes);
+
+    bool writeIndex(const ArchiveSegment &s, std::vector<ArchiveIndexEntry> &nodes);
+
+    /// Open the segment a replay should read next, at or after number @return false if there isn't one before its end
+    bool openReplaySegment(ArchiveReplay &r, uint32_t number);
+
+    /// The offsets of node's records in a segment
+    void findNodeOffsets(const ArchiveSegment &s, NodeNum node, std::vector<uint32_t> &offsets);
+};
+
+extern PacketArchive *packetArchive;
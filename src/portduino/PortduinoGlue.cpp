@@ -6,6 +6,17 @@
 
 #include <Utility.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/// While we poll the radio for its interrupt (see R595PolledIrqPin), the longest we wait between polls once it has gone quiet
+#ifndef IRQ_POLL_MAX_MSEC
+#define IRQ_POLL_MAX_MSEC 16
+#endif
 
 // FIXME - move getMacAddr/setBluetoothEnable into a HALPlatform class
 
@@ -14,8 +25,14 @@ uint32_t hwId; // fixme move into portduino
 void getMacAddr(uint8_t *dmac)
 {
     if (!hwId) {
-        notImplemented("getMacAddr");
-        hwId = random();
+        // Each node in a simulated mesh needs its own address (and so NodeNum)
+        const char *simNode = getenv("MESHSIM_NODE");
+        if (simNode)
+            hwId = 0x10000 + atoi(simNode);
+        else {
+            notImplemented("getMacAddr");
+            hwId = random();
+        }
     }
 
     dmac[0] = 0x80;
@@ -61,23 +78,83 @@ void updateBatteryLevel(uint8_t level) NOT_IMPLEMENTED("updateBatteryLevel");
  * Porduino helper class to do this i2c based polling:
  */
 class R595PolledIrqPin : public GPIOPin {
+    /// A gpiochip line event fd for LORA_DIO0 (if it is wired to a GPIO the kernel can watch), or -1 to poll
+    int eventFd = -1;
+
+    /// The pin level our last read saw
+    PinStatus level = LOW;
+
+    /// While polling, when we next ask the radio and how long we wait after that (which grows while nothing happens)
+    uint32_t nextPollMsec = 0, pollIntervalMsec = 0;
+
 public:
     R595PolledIrqPin() : GPIOPin(LORA_DIO0, "LORA_DIO0") {}
 
+    /**
+     * Wired boards tell us which gpiochip line DIO0 is on with LORA_DIO0_GPIOCHIP (i.e. /dev/gpiochip0) and LORA_DIO0_LINE,
+     * then our reads cost nothing: the kernel tells us about each edge.
+     */
+    void openEdgeEvents()
+    {
+        const char *chip = getenv("LORA_DIO0_GPIOCHIP"), *line = getenv("LORA_DIO0_LINE");
+        if (!chip || !line)
+            return;
+
+        int chipFd = open(chip, O_RDONLY | O_CLOEXEC);
+        if (chipFd < 0) {
+            printf("Can't open %s, polling LORA_DIO0 instead\n", chip);
+            return;
+        }
+
+        struct gpioevent_request req;
+        memset(&req, 0, sizeof(req));
+        req.lineoffset = atoi(line);
+        req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        strncpy(req.consumer_label, "meshtastic", sizeof(req.consumer_label) - 1);
+
+        struct gpiohandle_data data;
+        if (ioctl(chipFd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0 || ioctl(req.fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0)
+            printf("Can't watch %s line %s, polling LORA_DIO0 instead\n", chip, line);
+        else {
+            eventFd = req.fd;
+            fcntl(eventFd, F_SETFL, O_NONBLOCK);
+            level = data.values[0] ? HIGH : LOW;
+            printf("Watching LORA_DIO0 on %s line %s\n", chip, line);
+        }
+        close(chipFd);
+    }
+
     /// Read the low level hardware for this pin
     virtual PinStatus readPinHardware()
     {
+        if (eventFd >= 0) {
+            // DIO0 stays high until we clear the radio's irq flags, so the last edge tells us its level
+            struct gpioevent_data ev;
+            while (read(eventFd, &ev, sizeof(ev)) == (ssize_t)sizeof(ev))
+                level = ev.id == GPIOEVENT_EVENT_RISING_EDGE ? HIGH : LOW;
+            return level;
+        }
+
         if(isrPinStatus < 0)
             return LOW; // No interrupt handler attached, don't bother polling i2c right now
-        else {
-            extern RadioInterface *rIf; // FIXME, temporary hack until we know if we need to keep this 
 
-            assert(rIf);
-            RF95Interface *rIf95 = static_cast<RF95Interface *>(rIf);
-            bool p = rIf95->isIRQPending();
-            // log(SysGPIO, LogDebug, "R595PolledIrqPin::readPinHardware(%s, %d, %d)", getName(), getPinNum(), p);
-            return p ? HIGH : LOW;
-        }
+        // Each poll is a few round trips over USB, so back off while the radio is quiet.  The shortest packet we can receive
+        // is still much longer than IRQ_POLL_MAX_MSEC, so a late rx done interrupt costs us latency but never a packet.
+        uint32_t now = millis();
+        if ((int32_t)(now - nextPollMsec) < 0)
+            return level;
+
+        extern RadioInterface *rIf; // FIXME, temporary hack until we know if we need to keep this 
+
+        assert(rIf);
+        RF95Interface *rIf95 = static_cast<RF95Interface *>(rIf);
+        level = rIf95->isIRQPending() ? HIGH : LOW;
+        // log(SysGPIO, LogDebug, "R595PolledIrqPin::readPinHardware(%s, %d, %d)", getName(), getPinNum(), level);
+
+        pollIntervalMsec = level == HIGH ? 0 : min(2 * pollIntervalMsec + 1, (uint32_t)IRQ_POLL_MAX_MSEC);
+        nextPollMsec = now + pollIntervalMsec;
+        return level;
     }
 };
 
@@ -88,7 +165,9 @@ public:
  */
 void  portduinoSetup() {
   printf("Setting up Meshtastic on Porduino...\n");
-  gpioBind(new R595PolledIrqPin());
+  auto dio0 = new R595PolledIrqPin();
+  dio0->openEdgeEvents();
+  gpioBind(dio0);
   // gpioBind((new SimGPIOPin(LORA_RESET, "LORA_RESET")));
   // gpioBind((new SimGPIOPin(RF95_NSS, "RF95_NSS"))->setSilent());
 }
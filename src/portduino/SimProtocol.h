@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * The UDP messages between SimRadio (in each simulated node) and the meshsim medium (tools/meshsim), which plays the part of
+ * the ether.  Everything is sent in host byte order, the nodes and the medium always run on the same machine.
+ *
+ * A node says SIM_HELLO when it starts (and every SIM_HELLO_MSEC after, in case the medium was restarted), so the medium
+ * knows its address.  After that the node sends each frame it transmits as SIM_TX, and the medium sends it SIM_BUSY when a
+ * frame starts arriving (so it can do carrier sense) and SIM_RX when a frame it heard finishes arriving intact.
+ */
+
+/// The UDP port the medium listens on, if MESHSIM_PORT isn't set in the environment
+#define SIM_DEFAULT_PORT 4700
+
+/// How often nodes repeat their SIM_HELLO
+#define SIM_HELLO_MSEC 5000
+
+/// Bigger than any LoRa frame
+#define SIM_MAX_FRAME_LEN 256
+
+enum SimMessageType : uint8_t {
+    SIM_HELLO = 1, // node -> medium, index and nodeNum are set
+    SIM_TX,        // node -> medium, nodeNum, usec (airtime), rssi (our transmit power in dBm) and the frame are set
+    SIM_BUSY,      // medium -> node, usec is how long until the frame we just started hearing ends
+    SIM_RX         // medium -> node, nodeNum (the sender), snr, rssi and the frame are set
+};
+
+struct SimMessage {
+    SimMessageType type;
+    uint8_t reserved;
+    uint16_t index;   // Which of the simulated nodes this is (from MESHSIM_NODE), selects its position
+    uint32_t nodeNum; // Our NodeNum for SIM_HELLO/SIM_TX, the sender's for SIM_RX
+    uint32_t usec;
+    float snr, rssi;
+    uint16_t len; // Length of frame
+    uint8_t frame[SIM_MAX_FRAME_LEN];
+} __attribute__((packed));
+
+/// The size of a SimMessage carrying a frame of len bytes
+#define SIM_MESSAGE_LEN(len) (sizeof(SimMessage) - SIM_MAX_FRAME_LEN + (len))
@@ -0,0 +1,284 @@
+#include "SimRadio.h"
+#include "NodeDB.h"
+#include "Router.h"
+#include "airtime.h"
+#include "configuration.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool SimRadio::init()
+{
+    RadioInterface::init();
+
+    applyModemConfig();
+    if (power == 0)
+        power = 17; // Same as our real radios default to
+    limitPower();
+
+    const char *replayPath = getenv("MESHSIM_REPLAY");
+    if (replayPath) {
+        const char *speed = getenv("MESHSIM_REPLAY_SPEED");
+        replay = new FrameReplay();
+        replayFast = speed && atof(speed) <= 0;
+        if (!replay->open(replayPath, speed ? atof(speed) : 1))
+            return false;
+
+        randomSeed(1); // So our random delays (and packet ids) are the same every run
+        LOG_INFO(RADIO, "SimRadio replaying %s\n", replayPath);
+        setInterval(0);
+        return true;
+    }
+
+    const char *port = getenv("MESHSIM_PORT"), *node = getenv("MESHSIM_NODE");
+    index = node ? atoi(node) : 0;
+
+    memset(&medium, 0, sizeof(medium));
+    medium.sin_family = AF_INET;
+    medium.sin_port = htons(port ? atoi(port) : SIM_DEFAULT_PORT);
+    medium.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        LOG_ERROR(RADIO, "SimRadio can't open socket\n");
+        return false;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    LOG_INFO(RADIO, "SimRadio node %u using medium on port %u\n", index, ntohs(medium.sin_port));
+    setInterval(0); // Say hello right away
+    return true;
+}
+
+bool SimRadio::reconfigure()
+{
+    applyModemConfig();
+    limitPower();
+    return true;
+}
+
+ErrorCode SimRadio::send(MeshPacket *p, TxPriority priority, TxSource source)
+{
+    LOG_PACKET(RADIO, "enqueuing for send", p);
+
+    MeshPacket *dropped;
+    ErrorCode res = txQueue.enqueue(p, priority, source, getPacketTime(p), &dropped) ? ERRNO_OK : ERRNO_UNKNOWN;
+
+    if (dropped) { // we made room by throwing away a less important packet
+        LOG_PACKET(RADIO, "TX queue full, dropping", dropped);
+        stats.txDropped++;
+        packetPool.release(dropped);
+    }
+
+    if (res != ERRNO_OK) { // we weren't able to queue it, so we must drop it to prevent leaks
+        stats.txDropped++;
+        packetPool.release(p);
+        return res;
+    }
+
+    logAirtime(TX_LOG, getPacketTime(p));
+
+    // Like our real radios, give whoever we might be replying to time to get back to receiving
+    uint32_t now = millis();
+    uint32_t turnaround = txQueue.getNumQueued() == 1 ? getTurnaroundMsec(p) : 0;
+    if (!sendingPacket && turnaround)
+        nextTxMsec = now + turnaround;
+    else if (!sendingPacket && (int32_t)(nextTxMsec - now) < (int32_t)MIN_TX_WAIT_MSEC)
+        nextTxMsec = now + getTxDelayMsec();
+    return res;
+}
+
+RadioStats SimRadio::getStats()
+{
+    stats.txQueued = txQueue.getNumQueued();
+    RadioStats s = stats;
+    addRxDrops(s);
+    return s;
+}
+
+int32_t SimRadio::runOnce()
+{
+    uint32_t now = millis();
+    if (replay)
+        replayFrame();
+    else {
+        if (!lastHelloMsec || now - lastHelloMsec >= SIM_HELLO_MSEC) {
+            SimMessage m;
+            m.type = SIM_HELLO;
+            m.index = index;
+            m.nodeNum = nodeDB.getNodeNum();
+            m.len = 0;
+            sendToMedium(m);
+            lastHelloMsec = now ? now : 1;
+        }
+
+        SimMessage m;
+        ssize_t len;
+        while ((len = recv(sock, &m, sizeof(m), 0)) > 0)
+            handleMessage(m, len);
+    }
+
+    now = millis();
+    if (sendingPacket && (int32_t)(now - txEndMsec) >= 0)
+        completeSending();
+
+    if (!sendingPacket && !txQueue.isEmpty() && (int32_t)(now - nextTxMsec) >= 0)
+        startSend();
+
+    if (replay && !replay->isDone())
+        return replayFast ? 0 : 1;
+    return SIM_RADIO_POLL_MSEC;
+}
+
+void SimRadio::replayFrame()
+{
+    if (!numReplayed && !replayStartUsec)
+        replayStartUsec = micros();
+
+    bool badCrc;
+    size_t len = replay->next(radiobuf, rxSnr, rxRssi, badCrc);
+    if (!len) {
+        if (replay->isDone() && millis() - replayEndMsec >= SIM_REPLAY_DRAIN_MSEC)
+            reportReplay();
+        return;
+    }
+
+    numReplayed++;
+    if (replay->isDone())
+        replayEndMsec = millis();
+
+    uint32_t airtimeUsec = getPacketTimeUsec(len);
+    logAirtime(RX_ALL_LOG, airtimeUsec / 1000);
+    rxIsrUsec = micros();
+    rxFrameStartUsec = rxIsrUsec - airtimeUsec;
+
+    if (badCrc) {
+        // What RadioLibInterface does for corrupt frames
+        numReplayedBadCrc++;
+        stats.rxBad++;
+        growContentionWindow();
+    } else if (deliverFrame(radiobuf, len)) {
+        stats.rxGood++;
+        logAirtime(RX_LOG, airtimeUsec / 1000);
+    } else
+        stats.rxBad++;
+}
+
+void SimRadio::reportReplay()
+{
+    RouterStats r;
+    router->getStats(r);
+
+    DEBUG_MSG("REPLAY {\"frames\":%u,\"badCrc\":%u,\"skipped\":%u,\"rxBad\":%u,\"handled\":%u,\"usecPerPacket\":%u,"
+              "\"maxFromRadioQueued\":%u,\"duplicates\":%u,\"suppressed\":%u,\"retransmissions\":%u,\"txGood\":%u,"
+              "\"txDropped\":%u,\"elapsedUsec\":%u}\n",
+              numReplayed, numReplayedBadCrc, replay->getNumSkipped(), r.radio.rxBad, r.rxHandled,
+              r.rxHandled ? (uint32_t)(r.rxHandleUsec / r.rxHandled) : 0, r.maxFromRadioQueued, r.duplicates, r.suppressed,
+              r.retransmissions, r.radio.txGood, r.radio.txDropped, micros() - replayStartUsec);
+    exit(0);
+}
+
+void SimRadio::sendToMedium(SimMessage &m)
+{
+    m.reserved = 0;
+    if (sendto(sock, &m, SIM_MESSAGE_LEN(m.len), 0, (const sockaddr *)&medium, sizeof(medium)) < 0)
+        LOG_DEBUG(RADIO, "SimRadio can't reach the medium\n");
+}
+
+void SimRadio::handleMessage(SimMessage &m, size_t len)
+{
+    if (len < SIM_MESSAGE_LEN(0) || m.len > SIM_MAX_FRAME_LEN || len < SIM_MESSAGE_LEN(m.len)) {
+        LOG_DEBUG(RADIO, "SimRadio ignoring malformed message\n");
+        return;
+    }
+
+    switch (m.type) {
+    case SIM_BUSY:
+        // Our carrier sense, we heard a preamble
+        busyUntilMsec = millis() + m.usec / 1000;
+        break;
+
+    case SIM_RX: {
+        uint32_t airtimeUsec = getPacketTimeUsec(m.len);
+        logAirtime(RX_ALL_LOG, airtimeUsec / 1000);
+
+        rxSnr = m.snr;
+        rxRssi = m.rssi;
+        rxIsrUsec = micros();
+        rxFrameStartUsec = rxIsrUsec - airtimeUsec;
+
+        memcpy(radiobuf, m.frame, m.len);
+        if (deliverFrame(radiobuf, m.len)) {
+            stats.rxGood++;
+            logAirtime(RX_LOG, airtimeUsec / 1000);
+        } else
+            stats.rxBad++;
+        break;
+    }
+
+    default:
+        LOG_DEBUG(RADIO, "SimRadio ignoring message type %d\n", m.type);
+    }
+}
+
+void SimRadio::startSend()
+{
+    uint32_t now = millis();
+    if ((int32_t)(busyUntilMsec - now) > 0) {
+        // Someone else is talking, back off like RadioLibInterface does when it finds the channel active
+        growContentionWindow();
+        nextTxMsec = busyUntilMsec + getTxDelayMsec();
+        return;
+    }
+    shrinkContentionWindow();
+
+    MeshPacket *txp = txQueue.dequeue();
+    LOG_PACKET(RADIO, "Starting low level send", txp);
+
+    size_t numbytes = beginSending(txp);
+
+#ifdef LORA_AGGREGATE_PACKETS
+    MeshPacket *more;
+    size_t spaceLeft;
+    while ((spaceLeft = aggregateSpaceLeft(numbytes)) > 0 && (more = txQueue.dequeueIfFits(spaceLeft)) != NULL) {
+        LOG_PACKET(RADIO, "Aggregating", more);
+        numbytes = appendToSending(more, numbytes);
+    }
+#endif
+
+    // We don't have a separate transmit timer, so TRACE_TX_TIMER includes all of the packet's wait in txQueue
+    traceSendingFrame(TRACE_TX_TIMER, micros());
+
+    SimMessage m;
+    m.type = SIM_TX;
+    m.index = index;
+    m.nodeNum = nodeDB.getNodeNum();
+    m.usec = getPacketTimeUsec(numbytes);
+    m.snr = 0;
+    m.rssi = power;
+    m.len = numbytes;
+    memcpy(m.frame, radiobuf, numbytes);
+    if (!replay) // Nobody hears what we send while we replay a capture
+        sendToMedium(m);
+
+    txEndMsec = now + m.usec / 1000;
+    nextTxMsec = txEndMsec + getTxDelayMsec();
+}
+
+void SimRadio::completeSending()
+{
+    traceSendingFrame(TRACE_TX_AIR, micros());
+    notifyTxDone();
+
+    MeshPacket *p = sendingPacket;
+    sendingPacket = NULL;
+
+    LOG_PACKET(RADIO, "Completed sending", p);
+    stats.txGood++;
+    packetPool.release(p);
+    for (size_t i = 0; i < numAggregated; i++)
+        packetPool.release(aggregatedPackets[i]);
+    numAggregated = 0;
+}
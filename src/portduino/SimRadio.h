@@ -0,0 +1,107 @@
+#pragma once
+
+#include "FrameReplay.h"
+#include "MeshPacketQueue.h"
+#include "RadioInterface.h"
+#include "SimProtocol.h"
+#include "concurrency/OSThread.h"
+#include <netinet/in.h>
+
+/// How often we check for frames from the medium (and whether we can start sending)
+#define SIM_RADIO_POLL_MSEC 5
+
+/// How long we keep running after replaying the last frame of a capture, so our rebroadcasts and retransmissions finish
+#define SIM_REPLAY_DRAIN_MSEC (10 * 1000)
+
+/**
+ * A radio for the linux build which sends its frames to the meshsim medium over UDP (see SimProtocol.h), so we can run a
+ * whole mesh of nodes as processes on one machine.
+ *
+ * Frames are built and parsed by the same code our real radios use, and we time our transmissions and listen before talking
+ * the way RadioLibInterface does.  The medium decides who hears each frame (its propagation and collision models), and how
+ * long the channel is busy.
+ *
+ * Instead of joining the medium we can replay the frames in a capture (see FrameCapture), to measure how our router copes
+ * with real traffic.  Frames are delivered one per runOnce (so the router runs between them, as it would between real
+ * interrupts), and SIM_REPLAY_DRAIN_MSEC after the last one we print our counters as one line:
+ *
+ *   REPLAY {"frames":1200,"badCrc":31,"handled":1164,"usecPerPacket":85,"maxFromRadioQueued":3,"duplicates":402,...}
+ *
+ * then exit, so a script can compare builds on the same capture.  Random numbers are seeded the same way every run.
+ *
+ * Environment variables:
+ *   MESHSIM_PORT - The UDP port of the medium on localhost (default SIM_DEFAULT_PORT)
+ *   MESHSIM_NODE - Which of the medium's simulated nodes we are (default 0)
+ *   MESHSIM_REPLAY - A capture to replay instead
+ *   MESHSIM_REPLAY_SPEED - How many times real time to replay at, or 0 for as fast as we can (default 1)
+ */
+class SimRadio : public RadioInterface, protected concurrency::OSThread
+{
+    MeshPacketQueue txQueue = MeshPacketQueue(MAX_TX_QUEUE);
+
+    int sock = -1;
+    sockaddr_in medium;
+    uint16_t index = 0;
+
+    /// When our current transmission finishes
+    uint32_t txEndMsec = 0;
+
+    /// Until when the medium told us someone else is transmitting
+    uint32_t busyUntilMsec = 0;
+
+    /// The earliest we may start our next transmission
+    uint32_t nextTxMsec = 0;
+
+    uint32_t lastHelloMsec = 0;
+
+    RadioStats stats = RadioStats();
+
+    /// The capture we are replaying, if any
+    FrameReplay *replay = NULL;
+    bool replayFast = false;
+    uint32_t replayStartUsec = 0, replayEndMsec = 0;
+    uint32_t numReplayed = 0, numReplayedBadCrc = 0;
+
+  public:
+    SimRadio() : concurrency::OSThread("SimRadio") { setPriority(concurrency::PRIORITY_CRITICAL); }
+
+    virtual ErrorCode send(MeshPacket *p, TxPriority priority, TxSource source);
+
+    virtual TxQueueStatus getTxQueueStatus() { return txQueue.getStatus(); }
+
+    virtual bool canSleep() { return txQueue.isEmpty() && !sendingPacket; }
+
+    virtual RadioStats getStats();
+
+    // methods from radiohead
+
+    /// Initialise the Driver transport hardware and software.
+    /// Make sure the Driver is properly configured before calling init().
+    /// \return true if initialisation succeeded.
+    virtual bool init();
+
+    /// Apply any radio provisioning changes
+    /// Make sure the Driver is properly configured before calling init().
+    /// \return true if initialisation succeeded.
+    virtual bool reconfigure();
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    void sendToMedium(SimMessage &m);
+
+    void handleMessage(SimMessage &m, size_t len);
+
+    /// Deliver our capture's next frame, if it is due
+    void replayFrame();
+
+    /// Print what happened while we replayed our capture, and exit
+    void reportReplay();
+
+    /// Start sending the next packet in our queue, if the channel is clear
+    void startSend();
+
+    /// Our transmission has finished, release its packets
+    void completeSending();
+};
@@ -0,0 +1,164 @@
+#include "UdpMulticastInterface.h"
+#include "NodeDB.h"
+#include "configuration.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool UdpMulticastInterface::init()
+{
+    const char *groupAddr = getenv("MESH_BACKHAUL_GROUP"), *port = getenv("MESH_BACKHAUL_PORT"),
+               *localAddr = getenv("MESH_BACKHAUL_ADDR");
+    if (!groupAddr)
+        return false;
+
+    RadioInterface::init();
+    applyModemConfig(); // We don't use them, but getPacketTime() should still make sense for whoever asks us
+
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(port ? atoi(port) : BACKHAUL_DEFAULT_PORT);
+    if (inet_pton(AF_INET, groupAddr, &group.sin_addr) != 1 || !IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+        LOG_ERROR(RADIO, "Backhaul group %s isn't a multicast address\n", groupAddr);
+        return false;
+    }
+
+    ip_mreq mreq;
+    mreq.imr_multiaddr = group.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (localAddr && inet_pton(AF_INET, localAddr, &mreq.imr_interface) != 1) {
+        LOG_ERROR(RADIO, "Backhaul address %s is invalid\n", localAddr);
+        return false;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        LOG_ERROR(RADIO, "Backhaul can't open socket\n");
+        return false;
+    }
+
+    // Several gateways can run on one host (we tell our own datagrams apart by their BackhaulHeader)
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in bindAddr = group;
+    bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (const sockaddr *)&bindAddr, sizeof(bindAddr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq.imr_interface, sizeof(mreq.imr_interface)) < 0) {
+        LOG_ERROR(RADIO, "Backhaul can't join %s\n", groupAddr);
+        close(sock);
+        sock = -1;
+        return false;
+    }
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+
+    lastRefillMsec = millis();
+    LOG_INFO(RADIO, "Backhaul joined %s port %u\n", groupAddr, ntohs(group.sin_port));
+    setInterval(BACKHAUL_POLL_MSEC);
+    return true;
+}
+
+ErrorCode UdpMulticastInterface::send(MeshPacket *p, TxPriority priority, TxSource source)
+{
+    // Every peer heard this from whoever sent it to the group
+    if (fromPeers.wasSeenRecently(p, false)) {
+        LOG_PACKET(RADIO, "Not echoing to backhaul", p);
+        packetPool.release(p);
+        return ERRNO_OK;
+    }
+
+    LOG_PACKET(RADIO, "Sending to backhaul", p);
+    traceSendingFrame(TRACE_TX_TIMER, micros()); // Nothing to wait for
+
+    uint8_t datagram[sizeof(BackhaulHeader) + MAX_RHPACKETLEN];
+    BackhaulHeader h;
+    h.magic = BACKHAUL_MAGIC;
+    h.version = 0;
+    h.reserved = 0;
+    h.gateway = nodeDB.getNodeNum();
+    memcpy(datagram, &h, sizeof(h));
+
+    size_t numbytes = beginSending(p);
+    memcpy(datagram + sizeof(h), radiobuf, numbytes);
+
+    ErrorCode res = ERRNO_OK;
+    if (sendto(sock, datagram, sizeof(h) + numbytes, 0, (const sockaddr *)&group, sizeof(group)) < 0) {
+        LOG_DEBUG(RADIO, "Backhaul send failed\n");
+        stats.txDropped++;
+        res = ERRNO_UNKNOWN;
+    } else {
+        traceSendingFrame(TRACE_TX_AIR, micros());
+        stats.txGood++;
+    }
+
+    sendingPacket = NULL;
+    packetPool.release(p);
+    return res;
+}
+
+int32_t UdpMulticastInterface::runOnce()
+{
+    uint8_t buf[sizeof(BackhaulHeader) + MAX_RHPACKETLEN + 1];
+    ssize_t len;
+    while ((len = recv(sock, buf, sizeof(buf), 0)) > 0)
+        handleDatagram(buf, len);
+
+    return BACKHAUL_POLL_MSEC;
+}
+
+void UdpMulticastInterface::handleDatagram(const uint8_t *buf, size_t len)
+{
+    BackhaulHeader h;
+    if (len <= sizeof(h) || len > sizeof(h) + MAX_RHPACKETLEN)
+        return;
+    memcpy(&h, buf, sizeof(h));
+    if (h.magic != BACKHAUL_MAGIC || h.version != 0 || h.gateway == nodeDB.getNodeNum())
+        return; // Not for us, or our own datagram looped back to us
+
+    if (!takeRxToken()) {
+        LOG_DEBUG(RADIO, "Backhaul peers are sending too fast, dropping a packet from gateway 0x%x\n", h.gateway);
+        stats.rxBad++;
+        return;
+    }
+
+    size_t frameLen = len - sizeof(h);
+    memcpy(radiobuf, buf + sizeof(h), frameLen);
+
+    // Remember who sent the packet, so send() doesn't echo it back to the group.  Our peers send one packet per frame.
+    MeshPacket heard = MeshPacket_init_zero;
+    if (frameLen > COMPACT_FLAGS_OFFSET && (radiobuf[COMPACT_FLAGS_OFFSET] & PACKET_FLAGS_COMPACT_MASK)) {
+        CompactHeader c;
+        memcpy(&c, radiobuf, sizeof(c));
+        heard.from = c.from;
+        heard.id = c.id;
+    } else if (frameLen >= sizeof(PacketHeader)) {
+        const PacketHeader *ph = (const PacketHeader *)radiobuf;
+        heard.from = ph->from;
+        heard.id = ph->id;
+    }
+
+    rxSnr = BACKHAUL_SNR;
+    rxRssi = 0;
+    rxIsrUsec = rxFrameStartUsec = micros();
+    if (deliverFrame(radiobuf, frameLen)) {
+        fromPeers.wasSeenRecently(&heard);
+        stats.rxGood++;
+    } else
+        stats.rxBad++;
+}
+
+bool UdpMulticastInterface::takeRxToken()
+{
+    // After BACKHAUL_RX_BURST seconds of quiet our bucket is full anyway, which also keeps this from overflowing
+    uint32_t now = millis(), elapsed = min(now - lastRefillMsec, (uint32_t)BACKHAUL_RX_BURST * 1000);
+    rxTokens = min(rxTokens + elapsed * BACKHAUL_MAX_RX_PER_SEC, (uint32_t)BACKHAUL_RX_BURST * 1000);
+    lastRefillMsec = now;
+
+    if (rxTokens < 1000)
+        return false;
+    rxTokens -= 1000;
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "PacketHistory.h"
+#include "RadioInterface.h"
+#include "concurrency/OSThread.h"
+#include <netinet/in.h>
+
+/// The UDP port our backhaul uses, if MESH_BACKHAUL_PORT isn't set in the environment
+#define BACKHAUL_DEFAULT_PORT 4404
+
+/// How often we check for datagrams from our peers
+#define BACKHAUL_POLL_MSEC 10
+
+/// The most packets a second we take from our peers (on average), so they can't send our LoRa side more than it can carry
+#ifndef BACKHAUL_MAX_RX_PER_SEC
+#define BACKHAUL_MAX_RX_PER_SEC 5
+#endif
+
+/// How many packets our peers can send us at once (after being quiet) before BACKHAUL_MAX_RX_PER_SEC kicks in
+#ifndef BACKHAUL_RX_BURST
+#define BACKHAUL_RX_BURST 20
+#endif
+
+/// Our peers are as good a link as there is, so NeighborTable should never prefer a LoRa one over them
+#define BACKHAUL_SNR 30
+
+#define BACKHAUL_MAGIC 0x4d42 // "BM"
+
+/**
+ * Each datagram is one of these followed by a frame, exactly as our radios would send it (see RadioInterface::beginSending).
+ * Sent in host byte order, like PacketHeader.
+ */
+struct BackhaulHeader {
+    uint16_t magic;   // BACKHAUL_MAGIC, so we ignore anything else which turns up on our group
+    uint8_t version;  // 0, receivers drop anything else
+    uint8_t reserved;
+    uint32_t gateway; // The NodeNum of the gateway which sent this datagram
+} __attribute__((packed));
+
+/**
+ * An interface for linux gateways which sends our packets (still encrypted) to other gateways over UDP multicast, so LoRa
+ * islands joined by Ethernet act as one mesh.
+ *
+ * The Router bridges us with the gateway's radio like any other interface, and its packet history stops floods from looping
+ * between islands.  We keep a history of our own of what we heard from our peers, so we don't echo those packets back to the
+ * group (every peer already heard them).  Frames are sent right away, one packet per datagram.
+ *
+ * Environment variables:
+ *   MESH_BACKHAUL_GROUP - The multicast group our peers use (i.e. 239.0.0.1), we stay off if it isn't set
+ *   MESH_BACKHAUL_PORT - The UDP port (default BACKHAUL_DEFAULT_PORT)
+ *   MESH_BACKHAUL_ADDR - The address of the local network interface to use (default: let the kernel pick)
+ */
+class UdpMulticastInterface : public RadioInterface, protected concurrency::OSThread
+{
+    int sock = -1;
+    sockaddr_in group;
+
+    /// Packets we heard from our peers, which we don't send back to them
+    PacketHistory fromPeers;
+
+    /// Our rx rate limit (a token bucket) in thousandths of a packet, and when we last topped it up
+    uint32_t rxTokens = BACKHAUL_RX_BURST * 1000;
+    uint32_t lastRefillMsec = 0;
+
+    RadioStats stats = RadioStats();
+
+  public:
+    UdpMulticastInterface() : concurrency::OSThread("Backhaul") {}
+
+    virtual ErrorCode send(MeshPacket *p, TxPriority priority, TxSource source);
+
+    virtual RadioStats getStats()
+    {
+        RadioStats s = stats;
+        addRxDrops(s);
+        return s;
+    }
+
+    /// Join our group @return false if we are not configured to, or couldn't
+    virtual bool init();
+
+    virtual bool reconfigure() { return true; }
+
+  protected:
+    virtual int32_t runOnce();
+
+  private:
+    void handleDatagram(const uint8_t *buf, size_t len);
+
+    /// Take a packet from our rate limit @return false if our peers are sending too fast
+    bool takeRxToken();
+};
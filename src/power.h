@@ -15,6 +15,19 @@
 #define BAT_MILLIVOLTS_FULL 4100
 #define BAT_MILLIVOLTS_EMPTY 3500
 
+/// How often we read the battery while things are changing, we double this each time nothing changed (up to the max)
+#define POWER_POLL_MIN_MSEC (20 * 1000)
+#define POWER_POLL_MAX_MSEC (5 * 60 * 1000)
+
+/// Our polls can run this late, to share a wakeup with other work (PMU interrupts still wake us at once)
+#define POWER_POLL_SLACK_MSEC (5 * 1000)
+
+/// A battery voltage change smaller than this is just noise (for deciding whether to back off)
+#define POWER_CHANGE_MILLIVOLTS 50
+
+/// We don't back off while the battery is within this much of MIN_BAT_MILLIVOLTS, so we don't miss going flat
+#define POWER_LOW_MARGIN_MILLIVOLTS 200
+
 class Power : private concurrency::OSThread
 {
 
@@ -24,7 +37,15 @@ class Power : private concurrency::OSThread
     Power();
 
     void shutdown();
-    void readPowerStatus();
+
+    /// Publish our current power status, @return true if it changed significantly since last time
+    bool readPowerStatus();
+
+    /// Handle any PMU events (plug/unplug etc...) which have arrived, @return true if there were any
+    bool checkPmuIrq();
+
+    /// Our PMU raised its IRQ line, read its events ASAP
+    void onPmuIrqFromISR();
     virtual bool setup();
     virtual int32_t runOnce();
     void setStatusHandler(meshtastic::PowerStatus *handler) { statusHandler = handler; }
@@ -32,6 +53,13 @@ class Power : private concurrency::OSThread
   protected:
     meshtastic::PowerStatus *statusHandler;
 
+    /// Our current poll period (see POWER_POLL_MIN_MSEC)
+    uint32_t pollMsec = POWER_POLL_MIN_MSEC;
+
+    /// What we last published, so we can tell if anything changed
+    int lastVoltageMv = -1;
+    bool lastHasUSB = false, lastIsCharging = false, lastHasBattery = false;
+
     /// Setup a axp192, return true if found
     bool axp192Init();
 
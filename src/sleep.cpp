@@ -3,9 +3,12 @@
 #include "MeshRadio.h"
 #include "MeshService.h"
 #include "NodeDB.h"
+#include "RadioLibInterface.h"
+#include "WarmBoot.h"
 #include "configuration.h"
 #include "error.h"
 #include "main.h"
+#include "power.h"
 #include "target_specific.h"
 
 #ifndef NO_ESP32
@@ -18,6 +21,7 @@
 #include "nimble/BluetoothUtil.h"
 
 esp_sleep_source_t wakeCause; // the reason we booted this time
+uint32_t lightSleepWakeUsec;
 #endif
 
 #ifdef TBEAM_V10
@@ -69,7 +73,7 @@ void setLed(bool ledOn)
 
 void setGPSPower(bool on)
 {
-    DEBUG_MSG("Setting GPS power=%d\n", on);
+    LOG_DEBUG(POWER, "Setting GPS power=%d\n", on);
 
 #ifdef TBEAM_V10
     if (axp192_found)
@@ -107,7 +111,7 @@ void initDeepSleep()
     if (wakeCause == ESP_SLEEP_WAKEUP_TIMER)
         reason = "timeout";
 
-    DEBUG_MSG("booted, wake cause %d (boot count %d), reset_reason=%s\n", wakeCause, bootCount, reason);
+    LOG_DEBUG(POWER, "booted, wake cause %d (boot count %d), reset_reason=%s\n", wakeCause, bootCount, reason);
 #endif
 }
 
@@ -134,6 +138,10 @@ static void waitEnterSleep()
     }
 
     // Code that still needs to be moved into notifyObservers
+#ifdef DEBUG_PORT
+    DEBUG_PORT.flushLog(); // print any log messages still waiting for our drain thread
+    DEBUG_PORT.flush();
+#endif
     Serial.flush();            // send all our characters before we stop cpu clock
     setBluetoothEnable(false); // has to be off before calling light sleep
 
@@ -142,7 +150,7 @@ static void waitEnterSleep()
 
 void doDeepSleep(uint64_t msecToWake)
 {
-    DEBUG_MSG("Entering deep sleep for %lu seconds\n", msecToWake / 1000);
+    LOG_DEBUG(POWER, "Entering deep sleep for %lu seconds\n", msecToWake / 1000);
 
     // not using wifi yet, but once we are this is needed to shutoff the radio hw
     // esp_wifi_stop();
@@ -151,7 +159,8 @@ void doDeepSleep(uint64_t msecToWake)
 
     screen->doDeepSleep(); // datasheet says this will draw only 10ua
 
-    nodeDB.saveToDisk();
+    nodeDB.saveIfChanged(); // Including anything still waiting for our save timer
+    warmBoot.save();        // After that, so its stamp matches what is in flash
 
     // Kill GPS power completely (even if previously we just had it in sleep mode)
     setGPSPower(false);
@@ -183,6 +192,9 @@ void doDeepSleep(uint64_t msecToWake)
     }
 #endif
 
+#ifdef DEBUG_PORT
+    DEBUG_PORT.flushLog();
+#endif
     cpuDeepSleep(msecToWake);
 }
 
@@ -231,22 +243,25 @@ esp_sleep_wakeup_cause_t doLightSleep(uint64_t sleepMsec) // FIXME, use a more r
 #ifdef BUTTON_PIN
     gpio_wakeup_enable((gpio_num_t)BUTTON_PIN, GPIO_INTR_LOW_LEVEL); // when user presses, this button goes low
 #endif
-#ifdef RF95_IRQ_GPIO
-    gpio_wakeup_enable((gpio_num_t)RF95_IRQ_GPIO, GPIO_INTR_HIGH_LEVEL); // RF95 interrupt, active high
-#endif
+    // Our radio keeps listening while we sleep, and only raises its interrupt once it has a whole packet for us
+    if (RadioLibInterface::instance)
+        gpio_wakeup_enable((gpio_num_t)RadioLibInterface::instance->getIrqPin(), GPIO_INTR_HIGH_LEVEL); // active high
 #ifdef PMU_IRQ
     // wake due to PMU can happen repeatedly if there is no battery installed or the battery fills
-    if (axp192_found)
+    if (axp192_found) {
+        power->checkPmuIrq(); // Any event still pending would hold the line low and wake us straight away
         gpio_wakeup_enable((gpio_num_t)PMU_IRQ, GPIO_INTR_LOW_LEVEL); // pmu irq
+    }
 #endif
     assert(esp_sleep_enable_gpio_wakeup() == ESP_OK);
     assert(esp_sleep_enable_timer_wakeup(sleepUsec) == ESP_OK);
     assert(esp_light_sleep_start() == ESP_OK);
+    lightSleepWakeUsec = micros(); // Before anything else, so wake latency measurements include our own overhead
 
     esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
 #ifdef BUTTON_PIN
     if (cause == ESP_SLEEP_WAKEUP_GPIO)
-        DEBUG_MSG("Exit light sleep gpio: btn=%d\n", !digitalRead(BUTTON_PIN));
+        LOG_DEBUG(POWER, "Exit light sleep gpio: btn=%d\n", !digitalRead(BUTTON_PIN));
 #endif
 
     return cause;
@@ -268,6 +283,6 @@ void enableModemSleep()
     config.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
     config.min_freq_mhz = 20; // 10Mhz is minimum recommended
     config.light_sleep_enable = false;
-    DEBUG_MSG("Sleep request result %x\n", esp_pm_configure(&config));
+    LOG_DEBUG(POWER, "Sleep request result %x\n", esp_pm_configure(&config));
 }
 #endif
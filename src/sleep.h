@@ -11,6 +11,9 @@ void doDeepSleep(uint64_t msecToWake), cpuDeepSleep(uint64_t msecToWake);
 esp_sleep_wakeup_cause_t doLightSleep(uint64_t msecToWake);
 
 extern esp_sleep_source_t wakeCause;
+
+/// micros() when we last came out of light sleep
+extern uint32_t lightSleepWakeUsec;
 #endif
 void setGPSPower(bool on);
 
@@ -0,0 +1,470 @@
+/**
+ * meshsim - the ether for a simulated mesh.
+ *
+ * Each simulated node is a linux build of the firmware whose SimRadio sends us the frames it transmits (see
+ * src/portduino/SimProtocol.h).  We place the nodes on a plane, decide who hears each frame with a log-distance path loss
+ * model, destroy frames which overlap at a receiver (unless one is strong enough to capture the receiver) or which arrive
+ * while the receiver is transmitting, and deliver the rest when their airtime has passed.
+ *
+ * We also watch the frames go by, and when we exit (after --duration or on ctrl-C) we report the delivery ratio, latency and
+ * airtime of the packets the nodes originated.
+ *
+ * Build with: g++ -O2 -std=c++11 -o meshsim meshsim.cpp
+ * Usually run by bin/run-sim.sh, which also starts the nodes.
+ */
+
+#include "../../src/portduino/SimProtocol.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Our view of the frame headers, see PacketHeader/CompactHeader/AggregateHeader in RadioInterface.h
+#define HEADER_LEN 16
+#define AGGREGATE_HEADER_LEN 14
+#define FLAGS_OFFSET 12
+#define FLAGS_AGGREGATE 0x10
+#define FLAGS_ACK 0x20
+#define FLAGS_COMPACT 0x80
+#define BROADCAST 0xffffffffU
+
+struct Options {
+    int numNodes = 10;
+    double area = 5000;        // Nodes are placed at random in a square this many meters on a side
+    unsigned seed = 1;
+    int port = SIM_DEFAULT_PORT;
+    double duration = 0;       // Seconds to run for, 0 for until ctrl-C
+    double pathLoss0 = 120;    // dB of path loss at 1km
+    double exponent = 3.0;     // Path loss exponent
+    double shadowing = 4;      // Standard deviation (dB) of the per link log-normal shadowing
+    double sensitivity = -130; // Weakest signal (dBm) we can decode
+    double noiseFloor = -117;  // dBm, for SNR
+    double capture = 6;        // A frame this many dB stronger than another that overlaps it still gets through
+    const char *positions = NULL;
+};
+
+struct Node {
+    bool known = false; // Have we had a SIM_HELLO from them yet?
+    uint32_t nodeNum = 0;
+    sockaddr_in addr;
+    double x = 0, y = 0;
+    uint64_t txEndUsec = 0;
+    uint64_t airtimeUsec = 0;
+    uint32_t framesSent = 0;
+};
+
+struct Reception {
+    int sender, receiver;
+    uint64_t startUsec, endUsec;
+    double rssi;
+    bool decodable; // Strong enough to decode, otherwise it is just interference
+    bool lost;
+    SimMessage msg;
+};
+
+/// What we know about one packet the mesh carried
+struct PacketRecord {
+    uint32_t to;
+    bool isAck;
+    bool originated = false; // Did we see its first transmission (by the node which made it)?
+    uint64_t originUsec = 0;
+    std::map<uint32_t, uint64_t> firstHeardUsec; // nodeNum -> when they first received a copy
+};
+
+static Options opts;
+static std::vector<Node> nodes;
+static std::vector<std::vector<double>> linkLoss; // dB, [sender][receiver]
+static std::vector<Reception> receptions;         // In progress
+static std::map<uint64_t, PacketRecord> packets;    // (from << 32 | id) -> record
+static int sock;
+static volatile bool quit = false;
+
+static uint64_t totalAirtimeUsec, framesSent, rxOk, rxCollided, rxHalfDuplex;
+
+static uint64_t nowUsec()
+{
+    using namespace std::chrono;
+    static steady_clock::time_point start = steady_clock::now();
+    return duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: meshsim [--nodes N] [--area meters] [--seed S] [--port P] [--duration secs]\n"
+                    "               [--pathloss dB@1km] [--exponent n] [--shadowing dB] [--sensitivity dBm]\n"
+                    "               [--noise dBm] [--capture dB] [--positions file]\n");
+    exit(1);
+}
+
+static void parseArgs(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        if (i + 1 >= argc)
+            usage();
+        const char *v = argv[++i];
+
+        if (!strcmp(a, "--nodes"))
+            opts.numNodes = atoi(v);
+        else if (!strcmp(a, "--area"))
+            opts.area = atof(v);
+        else if (!strcmp(a, "--seed"))
+            opts.seed = atoi(v);
+        else if (!strcmp(a, "--port"))
+            opts.port = atoi(v);
+        else if (!strcmp(a, "--duration"))
+            opts.duration = atof(v);
+        else if (!strcmp(a, "--pathloss"))
+            opts.pathLoss0 = atof(v);
+        else if (!strcmp(a, "--exponent"))
+            opts.exponent = atof(v);
+        else if (!strcmp(a, "--shadowing"))
+            opts.shadowing = atof(v);
+        else if (!strcmp(a, "--sensitivity"))
+            opts.sensitivity = atof(v);
+        else if (!strcmp(a, "--noise"))
+            opts.noiseFloor = atof(v);
+        else if (!strcmp(a, "--capture"))
+            opts.capture = atof(v);
+        else if (!strcmp(a, "--positions"))
+            opts.positions = v;
+        else
+            usage();
+    }
+    if (opts.numNodes < 1 || opts.numNodes > 65535)
+        usage();
+}
+
+/// Place our nodes and work out the path loss between each pair
+static void makeTopology()
+{
+    std::mt19937 rng(opts.seed);
+    std::uniform_real_distribution<double> place(0, opts.area);
+    std::normal_distribution<double> shadow(0, opts.shadowing);
+
+    nodes.resize(opts.numNodes);
+
+    FILE *f = opts.positions ? fopen(opts.positions, "r") : NULL;
+    if (opts.positions && !f) {
+        perror(opts.positions);
+        exit(1);
+    }
+    for (auto &n : nodes) {
+        if (!f || fscanf(f, "%lf %lf", &n.x, &n.y) != 2) {
+            n.x = place(rng);
+            n.y = place(rng);
+        }
+    }
+    if (f)
+        fclose(f);
+
+    linkLoss.assign(nodes.size(), std::vector<double>(nodes.size(), 0));
+    for (size_t a = 0; a < nodes.size(); a++)
+        for (size_t b = a + 1; b < nodes.size(); b++) {
+            double d = std::max(hypot(nodes[a].x - nodes[b].x, nodes[a].y - nodes[b].y), 1.0);
+            double loss = opts.pathLoss0 + 10 * opts.exponent * log10(d / 1000) + (opts.shadowing > 0 ? shadow(rng) : 0);
+            linkLoss[a][b] = linkLoss[b][a] = loss; // Links are symmetric
+        }
+}
+
+static void sendTo(int index, SimMessage &m)
+{
+    Node &n = nodes[index];
+    if (n.known)
+        sendto(sock, &m, SIM_MESSAGE_LEN(m.len), 0, (const sockaddr *)&n.addr, sizeof(n.addr));
+}
+
+/// Call fn(to, from, id, flags) for each packet in a frame, returns false if the frame is malformed
+template <class F> static bool forEachPacket(const uint8_t *frame, size_t len, F fn)
+{
+    uint32_t to, from, id;
+    if (len > FLAGS_OFFSET && (frame[FLAGS_OFFSET] & FLAGS_COMPACT)) {
+        memcpy(&from, frame, 4);
+        memcpy(&id, frame + 4, 4);
+        fn(BROADCAST, from, id, frame[FLAGS_OFFSET]);
+        return true;
+    }
+    if (len < HEADER_LEN)
+        return false;
+
+    memcpy(&to, frame, 4);
+    memcpy(&from, frame + 4, 4);
+    memcpy(&id, frame + 8, 4);
+    uint8_t flags = frame[FLAGS_OFFSET];
+    fn(to, from, id, flags);
+
+    if (flags & FLAGS_AGGREGATE) {
+        const uint8_t *next = frame + HEADER_LEN, *end = frame + len;
+        if (next >= end)
+            return false;
+        next += 1 + *next;
+        while (next + AGGREGATE_HEADER_LEN <= end) {
+            memcpy(&to, next, 4);
+            memcpy(&from, next + 4, 4);
+            memcpy(&id, next + 8, 4);
+            fn(to, from, id, next[12]);
+            next += AGGREGATE_HEADER_LEN + next[13];
+        }
+    }
+    return true;
+}
+
+static void handleTx(int sender, SimMessage &m)
+{
+    uint64_t now = nowUsec();
+    Node &s = nodes[sender];
+
+    s.txEndUsec = now + m.usec;
+    s.airtimeUsec += m.usec;
+    s.framesSent++;
+    totalAirtimeUsec += m.usec;
+    framesSent++;
+
+    // Note the first time we see each packet leave the node that made it
+    forEachPacket(m.frame, m.len, [&](uint32_t to, uint32_t from, uint32_t id, uint8_t flags) {
+        PacketRecord &r = packets[(uint64_t)from << 32 | id];
+        if (!r.originated && from == s.nodeNum) {
+            r.originated = true;
+            r.originUsec = now;
+            r.to = to;
+            r.isAck = flags & FLAGS_ACK;
+        }
+    });
+
+    // We are half duplex, anything we were receiving is lost
+    for (auto &q : receptions)
+        if (q.receiver == sender && !q.lost) {
+            q.lost = true;
+            rxHalfDuplex++;
+        }
+
+    for (size_t r = 0; r < nodes.size(); r++) {
+        if ((int)r == sender)
+            continue;
+
+        double rssi = m.rssi - linkLoss[sender][r];
+        if (rssi < opts.sensitivity - opts.capture)
+            continue; // Too weak to even interfere
+
+        Reception rx;
+        rx.sender = sender;
+        rx.receiver = r;
+        rx.startUsec = now;
+        rx.endUsec = now + m.usec;
+        rx.rssi = rssi;
+        rx.decodable = rssi >= opts.sensitivity;
+        rx.lost = nodes[r].txEndUsec > now; // They are busy talking
+        if (rx.lost && rx.decodable)
+            rxHalfDuplex++;
+
+        // Overlapping frames destroy each other, unless one is strong enough to capture the receiver
+        for (auto &q : receptions) {
+            if (q.receiver != (int)r)
+                continue;
+            if (rssi - q.rssi < opts.capture && !rx.lost) {
+                rx.lost = true;
+                if (rx.decodable)
+                    rxCollided++;
+            }
+            if (q.rssi - rssi < opts.capture && !q.lost) {
+                q.lost = true;
+                if (q.decodable)
+                    rxCollided++;
+            }
+        }
+
+        if (rx.decodable) {
+            // Let them know the channel is busy (they would see our preamble)
+            SimMessage busy;
+            busy.type = SIM_BUSY;
+            busy.usec = m.usec;
+            busy.len = 0;
+            sendTo(r, busy);
+        }
+
+        rx.msg = m;
+        rx.msg.type = SIM_RX;
+        rx.msg.nodeNum = s.nodeNum;
+        rx.msg.rssi = rssi;
+        rx.msg.snr = rssi - opts.noiseFloor;
+        receptions.push_back(rx);
+    }
+}
+
+/// Deliver (or drop) every reception that has finished by now
+static void finishReceptions()
+{
+    uint64_t now = nowUsec();
+    for (size_t i = 0; i < receptions.size();) {
+        Reception &q = receptions[i];
+        if (q.endUsec > now) {
+            i++;
+            continue;
+        }
+
+        if (q.decodable && !q.lost) {
+            rxOk++;
+            sendTo(q.receiver, q.msg);
+
+            uint32_t receiverNum = nodes[q.receiver].nodeNum;
+            forEachPacket(q.msg.frame, q.msg.len, [&](uint32_t to, uint32_t from, uint32_t id, uint8_t flags) {
+                PacketRecord &r = packets[(uint64_t)from << 32 | id];
+                if (from != receiverNum && !r.firstHeardUsec.count(receiverNum))
+                    r.firstHeardUsec[receiverNum] = q.endUsec;
+            });
+        }
+
+        receptions[i] = receptions.back();
+        receptions.pop_back();
+    }
+}
+
+static void handleMessage(SimMessage &m, size_t len, const sockaddr_in &from)
+{
+    if (len < SIM_MESSAGE_LEN(0) || m.len > SIM_MAX_FRAME_LEN || len < SIM_MESSAGE_LEN(m.len))
+        return;
+    if (m.index >= nodes.size()) {
+        fprintf(stderr, "ignoring node %u, we were only told to expect %zu nodes\n", m.index, nodes.size());
+        return;
+    }
+
+    Node &n = nodes[m.index];
+    if (!n.known || n.nodeNum != m.nodeNum)
+        printf("node %u is 0x%x at (%.0f, %.0f)\n", m.index, m.nodeNum, n.x, n.y);
+    n.known = true;
+    n.nodeNum = m.nodeNum;
+    n.addr = from;
+
+    if (m.type == SIM_TX)
+        handleTx(m.index, m);
+}
+
+static int percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void report()
+{
+    size_t numKnown = 0;
+    std::map<uint32_t, int> byNodeNum;
+    for (size_t i = 0; i < nodes.size(); i++)
+        if (nodes[i].known) {
+            numKnown++;
+            byNodeNum[nodes[i].nodeNum] = i;
+        }
+
+    size_t numBroadcasts = 0, numUnicasts = 0, numAcks = 0, numUnicastDelivered = 0;
+    double broadcastReach = 0;
+    std::vector<double> latencies; // msecs
+    for (auto &e : packets) {
+        PacketRecord &r = e.second;
+        if (!r.originated)
+            continue;
+        if (r.isAck) {
+            numAcks++;
+            continue;
+        }
+
+        if (r.to == BROADCAST) {
+            numBroadcasts++;
+            if (numKnown > 1)
+                broadcastReach += (double)r.firstHeardUsec.size() / (numKnown - 1);
+            for (auto &h : r.firstHeardUsec)
+                latencies.push_back((h.second - r.originUsec) / 1000.0);
+        } else {
+            numUnicasts++;
+            auto h = r.firstHeardUsec.find(r.to);
+            if (h != r.firstHeardUsec.end()) {
+                numUnicastDelivered++;
+                latencies.push_back((h->second - r.originUsec) / 1000.0);
+            }
+        }
+    }
+
+    double seconds = nowUsec() / 1e6;
+    uint64_t maxNodeAirtime = 0;
+    for (auto &n : nodes)
+        maxNodeAirtime = std::max(maxNodeAirtime, n.airtimeUsec);
+
+    size_t numOriginated = numBroadcasts + numUnicasts + numAcks;
+    printf("\n=== meshsim report after %.0f secs, %zu of %zu nodes seen ===\n", seconds, numKnown, nodes.size());
+    printf("packets originated:   %zu broadcasts, %zu unicasts, %zu acks\n", numBroadcasts, numUnicasts, numAcks);
+    printf("broadcast delivery:   %.1f%% of nodes reached (mean)\n", numBroadcasts ? 100 * broadcastReach / numBroadcasts : 0);
+    printf("unicast delivery:     %.1f%% reached their destination\n",
+           numUnicasts ? 100.0 * numUnicastDelivered / numUnicasts : 0);
+    printf("latency (msecs):      p50 %d, p90 %d, p99 %d\n", percentile(latencies, 0.5), percentile(latencies, 0.9),
+           percentile(latencies, 0.99));
+    printf("frames sent:          %llu, %.1f per originated packet\n", (unsigned long long)framesSent,
+           numOriginated ? (double)framesSent / numOriginated : 0);
+    printf("total airtime:        %.1f secs (%.1f%% of the run), busiest node %.1f secs\n", totalAirtimeUsec / 1e6,
+           seconds > 0 ? 100 * totalAirtimeUsec / 1e6 / seconds : 0, maxNodeAirtime / 1e6);
+    printf("receptions:           %llu ok, %llu lost to collisions, %llu lost while transmitting\n", (unsigned long long)rxOk,
+           (unsigned long long)rxCollided, (unsigned long long)rxHalfDuplex);
+    fflush(stdout);
+}
+
+static void onSignal(int)
+{
+    quit = true;
+}
+
+int main(int argc, char **argv)
+{
+    parseArgs(argc, argv);
+    makeTopology();
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, (const sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("meshsim can't listen");
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    printf("meshsim: %d nodes in %.0fm square, listening on port %d\n", opts.numNodes, opts.area, opts.port);
+    fflush(stdout);
+
+    while (!quit && (opts.duration <= 0 || nowUsec() < opts.duration * 1e6)) {
+        // Sleep until our next reception completes, or a node sends us something
+        uint64_t now = nowUsec(), next = now + 100000;
+        for (auto &q : receptions)
+            next = std::min(next, q.endUsec);
+        pollfd p = {sock, POLLIN, 0};
+        poll(&p, 1, next > now ? (next - now + 999) / 1000 : 0);
+
+        SimMessage m;
+        sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t len;
+        while ((len = recvfrom(sock, &m, sizeof(m), MSG_DONTWAIT, (sockaddr *)&from, &fromLen)) > 0) {
+            handleMessage(m, len, from);
+            fromLen = sizeof(from);
+        }
+
+        finishReceptions();
+    }
+
+    report();
+    return 0;
+}